@@ -0,0 +1,162 @@
+"""ctypes bindings to the cis565_renderer shared library (configure with -DRENDERER_SHARED=ON).
+
+Frames stay on the GPU: Renderer.buffer returns a Frame that implements both the DLPack protocol
+and __cuda_array_interface__, so torch.from_dlpack(frame), cupy.asarray(frame) or numba take the
+device memory as is. A frame is a view of the renderer's buffer, valid until the next render,
+load or unload, clone it to keep it.
+
+    renderer = Renderer()
+    renderer.load("scenes/cornell.txt", ["BVH_WIDE=1"])
+    renderer.set_camera((0, 5, 10.5), (0, 5, 0))
+    renderer.render(64)
+    image = torch.from_dlpack(renderer.buffer(IMAGE)) / renderer.samples
+"""
+
+import ctypes
+import os
+
+# DeviceBuffer in pathtrace.h
+IMAGE, ALBEDO, NORMAL, POSITION, SAMPLE_COUNTS = range(5)
+
+
+class _DLDevice(ctypes.Structure):
+    _fields_ = [("device_type", ctypes.c_int), ("device_id", ctypes.c_int32)]
+
+
+class _DLDataType(ctypes.Structure):
+    _fields_ = [("code", ctypes.c_uint8), ("bits", ctypes.c_uint8), ("lanes", ctypes.c_uint16)]
+
+
+class _DLTensor(ctypes.Structure):
+    _fields_ = [
+        ("data", ctypes.c_void_p),
+        ("device", _DLDevice),
+        ("ndim", ctypes.c_int32),
+        ("dtype", _DLDataType),
+        ("shape", ctypes.POINTER(ctypes.c_int64)),
+        ("strides", ctypes.POINTER(ctypes.c_int64)),
+        ("byte_offset", ctypes.c_uint64),
+    ]
+
+
+class _DLManagedTensor(ctypes.Structure):
+    pass
+
+
+_DLManagedTensor._fields_ = [
+    ("dl_tensor", _DLTensor),
+    ("manager_ctx", ctypes.c_void_p),
+    ("deleter", ctypes.CFUNCTYPE(None, ctypes.POINTER(_DLManagedTensor))),
+]
+
+
+def _load_library():
+    path = os.environ.get("CIS565_RENDERER")
+    if path is None:
+        name = "cis565_renderer.dll" if os.name == "nt" else "libcis565_renderer.so"
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "build", "lib", name)
+    lib = ctypes.CDLL(path)
+    lib.rendererCreate.restype = ctypes.c_void_p
+    lib.rendererDestroy.argtypes = [ctypes.c_void_p]
+    lib.rendererLoad.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_char_p), ctypes.c_int,
+                                 ctypes.c_char_p, ctypes.c_int]
+    lib.rendererLoad.restype = ctypes.c_int
+    lib.rendererSetCamera.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_float), ctypes.POINTER(ctypes.c_float),
+                                      ctypes.POINTER(ctypes.c_float)]
+    lib.rendererRender.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.rendererSamples.argtypes = [ctypes.c_void_p]
+    lib.rendererSamples.restype = ctypes.c_int
+    lib.rendererRestart.argtypes = [ctypes.c_void_p]
+    lib.rendererExportBuffer.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.rendererExportBuffer.restype = ctypes.POINTER(_DLManagedTensor)
+    return lib
+
+
+_lib = _load_library()
+
+_capsule_new = ctypes.pythonapi.PyCapsule_New
+_capsule_new.restype = ctypes.py_object
+_capsule_new.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]
+# the destructor gets the dying capsule, taken as a raw pointer rather than a new reference to it
+_capsule_is_valid = ctypes.pythonapi.PyCapsule_IsValid
+_capsule_is_valid.restype = ctypes.c_int
+_capsule_is_valid.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+_capsule_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+_capsule_pointer.restype = ctypes.c_void_p
+_capsule_pointer.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+
+
+# a capsule nobody consumed still owns its tensor, a consumer renames it to used_dltensor
+@ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+def _capsule_destructor(capsule):
+    if _capsule_is_valid(capsule, b"dltensor"):
+        managed = ctypes.cast(_capsule_pointer(capsule, b"dltensor"), ctypes.POINTER(_DLManagedTensor))
+        managed.contents.deleter(managed)
+
+
+class Frame(object):
+    """One exported device buffer: height x width x 3 float32 sums, or height x width int32 sample counts."""
+
+    def __init__(self, renderer, which, managed):
+        self._renderer = renderer  # the buffer goes with the renderer's scene
+        self._which = which
+        tensor = managed.contents.dl_tensor
+        self.device_id = tensor.device.device_id
+        self.shape = tuple(tensor.shape[i] for i in range(tensor.ndim))
+        self.data = tensor.data
+        self.typestr = "<f4" if tensor.dtype.code == 2 else "<i4"
+        managed.contents.deleter(managed)
+
+    def __dlpack_device__(self):
+        return (2, self.device_id)  # kDLCUDA
+
+    def __dlpack__(self, stream=None):
+        # the export waits for the renderer's work, so there's nothing for stream to wait on
+        managed = _lib.rendererExportBuffer(self._renderer._handle, self._which)
+        return _capsule_new(ctypes.cast(managed, ctypes.c_void_p), b"dltensor", ctypes.cast(_capsule_destructor, ctypes.c_void_p))
+
+    @property
+    def __cuda_array_interface__(self):
+        return {"shape": self.shape, "typestr": self.typestr, "data": (self.data, False), "strides": None,
+                "version": 3, "stream": None}
+
+
+class Renderer(object):
+    """One scene on the GPU. Use it from the thread that made it, one per thread."""
+
+    def __init__(self):
+        self._handle = _lib.rendererCreate()
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.rendererDestroy(self._handle)
+            self._handle = None
+
+    def load(self, filename, overrides=()):
+        """Loads a scene file with KEY=VALUE setting overrides, raises RuntimeError when it doesn't load."""
+        encoded = [o.encode() for o in overrides]
+        array = (ctypes.c_char_p * max(len(encoded), 1))(*encoded)
+        error = ctypes.create_string_buffer(1024)
+        if not _lib.rendererLoad(self._handle, filename.encode(), array, len(encoded), error, len(error)):
+            raise RuntimeError(error.value.decode())
+
+    def set_camera(self, eye, lookat, up=(0.0, 1.0, 0.0)):
+        vec3 = ctypes.c_float * 3
+        _lib.rendererSetCamera(self._handle, vec3(*eye), vec3(*lookat), vec3(*up))
+
+    def render(self, samples):
+        _lib.rendererRender(self._handle, samples)
+
+    def restart(self):
+        _lib.rendererRestart(self._handle)
+
+    @property
+    def samples(self):
+        return _lib.rendererSamples(self._handle)
+
+    def buffer(self, which=IMAGE):
+        """The buffer as a Frame, None when the scene's settings don't keep it (see DeviceBuffer)."""
+        managed = _lib.rendererExportBuffer(self._handle, which)
+        if not managed:
+            return None
+        return Frame(self, which, managed)
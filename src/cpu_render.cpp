@@ -0,0 +1,730 @@
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "cpu_render.h"
+#include "pathtrace.h"
+#include "interactions.h"
+#include "traversal.h"
+
+#define CPU_TILE_SIZE 16
+#define CPU_PACKET_SIZE (CPU_TILE_SIZE * CPU_TILE_SIZE) // one tile's paths for one sample
+#define CPU_PACKET_TRAVERSAL // camera rays walk the BVH CPU_RAY_PACKET_WIDTH at a time
+#define CPU_RAY_PACKET_WIDTH 8 // lanes of one AVX register
+
+// the scene's host copies in the layout of the device's SceneAccel, so the traversal in
+// traversal.h walks them as is
+struct HostAccel {
+	SceneAccel accel;
+	std::vector<GeomGPU> geom_records;
+	std::vector<TriIntersect> tris;
+	std::vector<int> bvh_parents;
+	std::vector<int> tlas_parents;
+	std::vector<AlphaMap> alpha_maps;
+	std::vector<MeshUV> uvs; // COMPRESSED_MESH, the uvs the alpha test reads as the device stores them
+};
+
+// STACKLESS_BVH: parent links of one tree, same as findBVHParents
+static void findHostParents(const BVHNode_GPU* nodes, int num_nodes, int* parents) {
+	if (num_nodes > 0) {
+		parents[0] = -1;
+	}
+	for (int i = 0; i < num_nodes; i++) {
+		if (!BVH_IS_LEAF(nodes[i])) {
+			parents[i + 1] = i;
+			parents[nodes[i].offset_to_second_child] = i;
+		}
+	}
+}
+
+// an LBVH only exists on the device and the wide tree is collapsed from it there, those
+// scenes are traced without a BVH
+static void buildHostAccel(Scene* scene, HostAccel& host) {
+	host.geom_records = geomRecords(scene->geoms);
+	host.tris.resize(scene->num_tris);
+	for (int i = 0; i < scene->num_tris; i++) {
+		const glm::ivec3& tri = scene->mesh.indices[i];
+		host.tris[i].p0 = scene->mesh.positions[tri.x];
+		host.tris[i].p1 = scene->mesh.positions[tri.y];
+		host.tris[i].p2 = scene->mesh.positions[tri.z];
+	}
+
+	SceneAccel& accel = host.accel;
+	accel.geoms = scene->geoms.data();
+	accel.geom_records = host.geom_records.data();
+	accel.geoms_size = scene->geoms.size();
+	accel.tlas_nodes = scene->tlas_nodes_gpu.data();
+	accel.blases = scene->blases.data();
+	accel.tris = host.tris.data();
+	accel.bvh_nodes = scene->wide_bvh_nodes_gpu.empty() && !scene->bvh_nodes_gpu.empty() ? scene->bvh_nodes_gpu.data() : NULL;
+	accel.wide_bvh_nodes = scene->wide_bvh_nodes_gpu.empty() ? NULL : scene->wide_bvh_nodes_gpu.data();
+	accel.bvh_parents = NULL;
+	accel.tlas_parents = NULL;
+	accel.use_bvh = scene->render_settings.bvh_accel;
+	accel.geom_mask = scene->render_settings.geom_mask;
+	accel.curve_sets = scene->curve_sets.empty() ? NULL : scene->curve_sets.data();
+	accel.curve_segments = scene->curve_segments.data();
+	accel.curve_nodes = scene->curve_nodes.data();
+	host.alpha_maps.assign(scene->materials.size(), AlphaMap());
+	for (size_t m = 0; m < scene->materials.size(); m++) {
+		const Material& material = scene->materials[m];
+		if (material.alpha_map < 0) {
+			continue;
+		}
+		// the host only reads RGBA8 texels, alphaCoverage leaves the others opaque
+		const Texture& texture = scene->textures[material.alpha_map];
+		AlphaMap& map = host.alpha_maps[m];
+		map.texels = texture.format == TEXTURE_RGBA8 && !texture.levels.empty() ? texture.levels[0].data() : NULL;
+		map.width = texture.width;
+		map.height = texture.height;
+		map.cutoff = material.alpha_cutoff;
+		accel.alpha_maps = host.alpha_maps.data();
+		accel.tri_indices = scene->mesh.indices.data();
+#if COMPRESSED_MESH
+		if (host.uvs.empty()) {
+			host.uvs.resize(scene->mesh.uvs.size());
+			std::transform(scene->mesh.uvs.begin(), scene->mesh.uvs.end(), host.uvs.begin(), packUV);
+		}
+		accel.tri_uvs = host.uvs.data();
+#else
+		accel.tri_uvs = scene->mesh.uvs.data();
+#endif
+	}
+
+	const bool has_tree = !scene->tlas_nodes_gpu.empty() && (scene->num_tris == 0 || accel.bvh_nodes != NULL || accel.wide_bvh_nodes != NULL);
+	if (accel.use_bvh && !has_tree) {
+		std::cout << "CPU render: the scene has no host BVH (BVH_BUILDER LBVH), testing every geom and tri" << std::endl;
+		accel.use_bvh = false;
+	}
+	if (accel.use_bvh && scene->render_settings.stackless_bvh) {
+		host.tlas_parents.resize(scene->tlas_nodes_gpu.size());
+		findHostParents(scene->tlas_nodes_gpu.data(), scene->tlas_nodes_gpu.size(), host.tlas_parents.data());
+		accel.tlas_parents = host.tlas_parents.data();
+		if (accel.bvh_nodes != NULL) {
+			host.bvh_parents.resize(scene->bvh_nodes_gpu.size());
+			for (const BLAS& blas : scene->blases) {
+				findHostParents(accel.bvh_nodes + blas.node_offset, blas.num_nodes, host.bvh_parents.data() + blas.node_offset);
+			}
+			accel.bvh_parents = host.bvh_parents.data();
+		}
+	}
+}
+
+// sRGB albedo texels to linear, what the device's sRGB texture reads do in hardware
+static float srgbToLinear(float c) {
+	return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+// nearest texel of the full size level, wrapping like the device textures. only RGBA8
+// images can be read on the host, block compressed ones leave the albedo untextured
+static glm::vec3 hostAlbedo(const Scene* scene, const Material& m, glm::vec2 uv) {
+	if (m.albedo_map < 0) {
+		return m.R;
+	}
+	const Texture& texture = scene->textures[m.albedo_map];
+	if (texture.format != TEXTURE_RGBA8 || texture.levels.empty()) {
+		return m.R;
+	}
+	float u = uv.x - floorf(uv.x);
+	float v = (1.0f - uv.y) - floorf(1.0f - uv.y);
+	int x = glm::min((int)(u * texture.width), texture.width - 1);
+	int y = glm::min((int)(v * texture.height), texture.height - 1);
+	const unsigned char* texel = &texture.levels[0][4 * (x + y * texture.width)];
+	glm::vec3 c = glm::vec3(texel[0], texel[1], texel[2]) / 255.0f;
+	if (texture.srgb) {
+		c = glm::vec3(srgbToLinear(c.x), srgbToLinear(c.y), srgbToLinear(c.z));
+	}
+	return m.R * c;
+}
+
+// nearest texel of the environment along d
+static glm::vec3 hostEnvironment(const Environment& environment, glm::vec3 d) {
+	float phi = atan2f(d.z, d.x);
+	if (phi < 0.0f) {
+		phi += TWO_PI;
+	}
+	glm::vec2 uv(phi / TWO_PI, acosf(glm::clamp(d.y, -1.0f, 1.0f)) / PI);
+	int x = glm::min((int)(uv.x * environment.width), environment.width - 1);
+	int y = glm::min((int)(uv.y * environment.height), environment.height - 1);
+	return environment.intensity * glm::vec3(environment.texels[x + y * environment.width]);
+}
+
+// camera ray of pixel (x, y), drawn from the same samples as generateCameraPath
+static void cameraRay(const Camera& cam, const RenderSettings& settings, float filter_radius, int x, int y, int iter,
+	glm::vec3& origin, glm::vec3& direction)
+{
+	Sampler rng(x + y * cam.resolution.x, iter, 0, STREAM_CAMERA, settings.sampler);
+	glm::vec2 offset = glm::vec2(0.0f);
+	if (settings.anti_aliasing) {
+		offset = glm::vec2(0.5f) + sampleFilter(settings.pixel_filter, filter_radius, rng.next2D());
+	}
+	origin = cam.position;
+	glm::vec3 forward = cam.view;
+	if (cam.lens_radius > 0.0f) {
+		float focalT = (cam.focal_distance / glm::length(cam.lookAt - cam.position));
+		glm::vec3 focal_point = cam.position + focalT * (cam.lookAt - cam.position);
+		origin = cam.position + glm::mat3(cam.right, cam.up, cam.view) * sampleLens(cam.lens_radius, rng.next2D());
+		forward = glm::normalize(focal_point - origin);
+	}
+	direction = glm::normalize(
+		forward - cam.right * cam.pixelLength.x * ((float)x + offset.x - (float)cam.resolution.x * 0.5f)
+		- cam.up * cam.pixelLength.y * ((float)y + offset.y - (float)cam.resolution.y * 0.5f)
+	);
+}
+
+// a tile's paths for one sample as a structure of arrays. every bounce traces the paths
+// still alive in pixel order, so neighbouring rays go through the traversal back to back
+// and find the nodes they share already in cache
+struct PathPacket {
+	glm::vec3 origin[CPU_PACKET_SIZE];
+	glm::vec3 direction[CPU_PACKET_SIZE];
+	glm::vec3 throughput[CPU_PACKET_SIZE];
+	glm::vec3 radiance[CPU_PACKET_SIZE];
+	int pixel[CPU_PACKET_SIZE];
+	int alive[CPU_PACKET_SIZE]; // packet slots still bouncing, compacted after every bounce
+	int num_alive;
+};
+
+// coherent rays as a structure of arrays, lane i of every array is ray i. the slab tests run on
+// every lane at once, the tri and analytic tests lane by lane on rays
+struct alignas(32) RayPacket {
+	float origin[3][CPU_RAY_PACKET_WIDTH];
+	float direction_inv[3][CPU_RAY_PACKET_WIDTH];
+	float t[CPU_RAY_PACKET_WIDTH]; // closest hit so far
+	Ray rays[CPU_RAY_PACKET_WIDTH];
+};
+
+static void setPacketRay(RayPacket& p, int lane, const Ray& r, float t) {
+	p.rays[lane] = r;
+	p.t[lane] = t;
+	for (int axis = 0; axis < 3; axis++) {
+		p.origin[axis][lane] = r.origin[axis];
+		p.direction_inv[axis][lane] = r.direction_inv[axis];
+	}
+}
+
+// lanes of active whose ray overlaps the box within [-epsilon, t], intersectAABB on all of them
+static int packetHitsAABB(const RayPacket& p, const glm::vec3& AABB_min, const glm::vec3& AABB_max, int active) {
+#ifdef __AVX__
+	__m256 t_near = _mm256_set1_ps(-FLT_MAX);
+	__m256 t_far = _mm256_set1_ps(FLT_MAX);
+	for (int axis = 0; axis < 3; axis++) {
+		__m256 o = _mm256_load_ps(p.origin[axis]);
+		__m256 inv = _mm256_load_ps(p.direction_inv[axis]);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(AABB_min[axis]), o), inv);
+		__m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(AABB_max[axis]), o), inv);
+		t_near = _mm256_max_ps(t_near, _mm256_min_ps(t1, t2));
+		t_far = _mm256_min_ps(t_far, _mm256_max_ps(t1, t2));
+	}
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(t_far, t_near, _CMP_GE_OQ),
+		_mm256_and_ps(_mm256_cmp_ps(t_far, _mm256_set1_ps(-0.0001f), _CMP_GE_OQ), _mm256_cmp_ps(t_near, _mm256_load_ps(p.t), _CMP_LE_OQ)));
+	return _mm256_movemask_ps(hit) & active;
+#else
+	int mask = 0;
+	for (int lane = 0; lane < CPU_RAY_PACKET_WIDTH; lane++) {
+		float t_near = -FLT_MAX;
+		float t_far = FLT_MAX;
+		for (int axis = 0; axis < 3; axis++) {
+			float t1 = (AABB_min[axis] - p.origin[axis][lane]) * p.direction_inv[axis][lane];
+			float t2 = (AABB_max[axis] - p.origin[axis][lane]) * p.direction_inv[axis][lane];
+			t_near = glm::max(t_near, glm::min(t1, t2));
+			t_far = glm::min(t_far, glm::max(t1, t2));
+		}
+		if (t_far >= t_near && t_far >= -0.0001f && t_near <= p.t[lane]) {
+			mask |= 1 << lane;
+		}
+	}
+	return mask & active;
+#endif
+}
+
+// lowest lane of a mask, its ray orders the children for the whole packet
+static int firstLane(int mask) {
+	int lane = 0;
+	while (!(mask & (1 << lane))) {
+		lane++;
+	}
+	return lane;
+}
+
+// one walk of a binary tree for every lane of active. a subtree is only tested against the
+// lanes that hit its parent, a leaf calls visit(leaf, lanes that reached it)
+template<class Visit>
+static void walkPacket(const BVHNode_GPU* nodes, const RayPacket& p, int active, Visit visit) {
+	int dir_signs = rayDirSigns(p.rays[firstLane(active)]);
+	int node_stack[BVH_STACK_SIZE];
+	int mask_stack[BVH_STACK_SIZE];
+	int stack_pointer = 0;
+	int cur_node_index = 0;
+	int cur_mask = active;
+	while (true) {
+		const BVHNode_GPU& node = nodes[cur_node_index];
+		int mask = packetHitsAABB(p, node.AABB_min, node.AABB_max, cur_mask);
+		if (mask != 0) {
+			if (!BVH_IS_LEAF(node)) {
+				int near_child, far_child;
+				orderChildren(node, cur_node_index, dir_signs, near_child, far_child);
+				node_stack[stack_pointer] = far_child;
+				mask_stack[stack_pointer] = mask;
+				stack_pointer++;
+				cur_node_index = near_child;
+				cur_mask = mask;
+				continue;
+			}
+			visit(node, mask);
+		}
+		if (stack_pointer == 0) {
+			break;
+		}
+		stack_pointer--;
+		cur_node_index = node_stack[stack_pointer];
+		cur_mask = mask_stack[stack_pointer];
+	}
+}
+
+// the closest hits of the packet's lanes: one TLAS walk they share, and one walk of the binary
+// BLAS of every mesh instance it reaches with the lanes in its object space. analytic geoms and
+// wide BLASes are tested lane by lane, the wide ones through the multi box test of their nodes
+static void traversePacket(const SceneAccel& accel, bool cull_backfaces, RayPacket& p, int active, int* hit_geoms, SceneHit* hits) {
+	TraversalStats traversal;
+	walkPacket(accel.tlas_nodes, p, active, [&](const BVHNode_GPU& leaf, int leaf_mask) {
+		for (int geom_index = leaf.tri_index; geom_index < leaf.tri_index + leaf.num_tris; geom_index++) {
+			const GeomGPU& geom = accel.geom_records[geom_index];
+			if (!(accel.geom_mask & (1 << geom.type))) {
+				continue;
+			}
+			if (geom.type != MESH || accel.bvh_nodes == NULL) {
+				for (int lane = 0; lane < CPU_RAY_PACKET_WIDTH; lane++) {
+					if ((leaf_mask & (1 << lane)) && intersectInstance<ClosestHit>(p.rays[lane], accel, geom_index, cull_backfaces, p.t[lane], hits[lane], traversal)) {
+						hit_geoms[lane] = geom_index;
+					}
+				}
+				continue;
+			}
+			const BLAS& blas = accel.blases[geom.blas_ID];
+			if (blas.num_tris == 0) {
+				continue;
+			}
+
+			RayPacket obj;
+			TriRay tri_rays[CPU_RAY_PACKET_WIDTH];
+			for (int lane = 0; lane < CPU_RAY_PACKET_WIDTH; lane++) {
+				const Ray& r = p.rays[lane];
+				setPacketRay(obj, lane, makeRay(toObjectSpace(geom, r.origin, 1.0f), toObjectSpace(geom, r.direction, 0.0f)), p.t[lane]);
+				tri_rays[lane] = makeTriRay(obj.rays[lane]);
+			}
+			const TriSource tris = blasTris(accel, blas);
+			const AlphaTest alpha = alphaTest(accel, geom, blas);
+			walkPacket(accel.bvh_nodes + blas.node_offset, obj, leaf_mask, [&](const BVHNode_GPU& blas_leaf, int blas_mask) {
+				for (int lane = 0; lane < CPU_RAY_PACKET_WIDTH; lane++) {
+					if (!(blas_mask & (1 << lane))) {
+						continue;
+					}
+					int hit_tri = intersectTriRange<ClosestHit>(tri_rays[lane], tris, blas_leaf.tri_index, blas_leaf.tri_index + blas_leaf.num_tris,
+						alpha, obj.t[lane], hits[lane].bary, traversal);
+					if (hit_tri != -1) {
+						hits[lane].tri = blas.tri_offset + hit_tri;
+						hit_geoms[lane] = geom_index;
+					}
+				}
+			});
+			for (int lane = 0; lane < CPU_RAY_PACKET_WIDTH; lane++) {
+				p.t[lane] = obj.t[lane];
+			}
+		}
+	});
+}
+
+// the rest of a bounce of packet slot i once its ray is traced: a naive path tracer, lights and
+// the environment are only found by the bsdf samples rather than through the MIS light rays the
+// kernels trace. returns false once the path is done
+static bool shadePath(const Scene* scene, const SceneAccel& accel, PathPacket& packet, int i, int depth, int iter,
+	int hit_geom, float t, const SceneHit& hit)
+{
+	if (hit_geom == -1) {
+		if (scene->environment.width > 0) {
+			packet.radiance[i] += packet.throughput[i] * hostEnvironment(scene->environment, packet.direction[i]);
+		}
+		return false;
+	}
+
+	const Geom& geom = accel.geoms[hit_geom];
+	Material material = scene->materials[geom.materialid];
+	if (material.emittance > 0.0f) {
+		packet.radiance[i] += packet.throughput[i] * material.R * material.emittance;
+		return false;
+	}
+
+	// shading normal and uv like shadeableHit, normal maps are left out
+	glm::vec3 normal;
+	glm::vec2 uv = glm::vec2(0.0f);
+	if (hit.tri == -1) {
+		normal = analyticHitNormal(geom, hit);
+	}
+	else {
+		const Mesh& mesh = scene->mesh;
+		glm::ivec3 tri = mesh.indices[hit.tri];
+		glm::vec3 obj_normal = hit.bary.x * mesh.normals[tri.x] + hit.bary.y * mesh.normals[tri.y] + hit.bary.z * mesh.normals[tri.z];
+		normal = glm::normalize(multiplyMV(geom.invTranspose, glm::vec4(obj_normal, 0.0f)));
+		uv = hit.bary.x * mesh.uvs[tri.x] + hit.bary.y * mesh.uvs[tri.y] + hit.bary.z * mesh.uvs[tri.z];
+	}
+	material.R = hostAlbedo(scene, material, uv);
+
+	// keyed like the scatter in shadeMaterialUber
+	Sampler rng(packet.pixel[i], iter, scene->state.traceDepth - depth, STREAM_SCATTER, scene->render_settings.sampler);
+	glm::vec3 intersect_point = packet.origin[i] + t * packet.direction[i];
+	scatterRay(packet.origin[i], packet.direction[i], packet.throughput[i], intersect_point, normal, material, rng);
+	return glm::max(packet.throughput[i].x, glm::max(packet.throughput[i].y, packet.throughput[i].z)) > 0.0f;
+}
+
+// one bounce of packet slot i on its own, single ray traversal
+static bool advancePath(const Scene* scene, const SceneAccel& accel, PathPacket& packet, int i, int depth, int iter) {
+	Ray r = makeRay(packet.origin[i], packet.direction[i]);
+	float t = MAX_INTERSECT_DIST;
+	SceneHit hit;
+	TraversalStats traversal;
+	int hit_geom = traverseScene<ClosestHit>(r, accel, depth == 0, -1, t, hit, traversal);
+	return shadePath(scene, accel, packet, i, depth, iter, hit_geom, t, hit);
+}
+
+// the camera rays of a tile, CPU_RAY_PACKET_WIDTH neighbouring pixels per packet
+static void advanceCameraPaths(const Scene* scene, const SceneAccel& accel, PathPacket& packet, int iter) {
+	int num_alive = 0;
+	for (int first = 0; first < packet.num_alive; first += CPU_RAY_PACKET_WIDTH) {
+		const int lanes = glm::min(CPU_RAY_PACKET_WIDTH, packet.num_alive - first);
+		RayPacket p;
+		int hit_geoms[CPU_RAY_PACKET_WIDTH];
+		SceneHit hits[CPU_RAY_PACKET_WIDTH];
+		for (int lane = 0; lane < CPU_RAY_PACKET_WIDTH; lane++) {
+			// the lanes past the end repeat the last ray, they're masked off
+			int i = packet.alive[first + glm::min(lane, lanes - 1)];
+			setPacketRay(p, lane, makeRay(packet.origin[i], packet.direction[i]), MAX_INTERSECT_DIST);
+			hit_geoms[lane] = -1;
+		}
+		traversePacket(accel, true, p, (1 << lanes) - 1, hit_geoms, hits);
+		for (int lane = 0; lane < lanes; lane++) {
+			int i = packet.alive[first + lane];
+			if (shadePath(scene, accel, packet, i, 0, iter, hit_geoms[lane], p.t[lane], hits[lane])) {
+				packet.alive[num_alive++] = i;
+			}
+		}
+	}
+	packet.num_alive = num_alive;
+}
+
+// samples first_iter .. last_iter of one tile, added into sums. tiles don't overlap, so no other
+// worker writes the same pixels
+static void renderTile(const Scene* scene, const SceneAccel& accel, const glm::ivec2& tile_min, int first_iter, int last_iter,
+	float filter_radius, PathPacket& packet, std::vector<glm::vec3>& sums)
+{
+	const Camera& cam = scene->state.camera;
+	const glm::ivec2 tile_max = glm::min(tile_min + glm::ivec2(CPU_TILE_SIZE), cam.resolution);
+	for (int iter = first_iter; iter <= last_iter; iter++) {
+		int n = 0;
+		for (int y = tile_min.y; y < tile_max.y; y++) {
+			for (int x = tile_min.x; x < tile_max.x; x++) {
+				cameraRay(cam, scene->render_settings, filter_radius, x, y, iter, packet.origin[n], packet.direction[n]);
+				packet.throughput[n] = glm::vec3(1.0f);
+				packet.radiance[n] = glm::vec3(0.0f);
+				packet.pixel[n] = x + y * cam.resolution.x;
+				packet.alive[n] = n;
+				n++;
+			}
+		}
+		packet.num_alive = n;
+
+		for (int depth = 0; depth < scene->state.traceDepth && packet.num_alive > 0; depth++) {
+#ifdef CPU_PACKET_TRAVERSAL
+			// camera rays are coherent enough to share a walk, bounces go one by one
+			if (depth == 0 && accel.use_bvh && accel.geoms_size > 0) {
+				advanceCameraPaths(scene, accel, packet, iter);
+				continue;
+			}
+#endif
+			int num_alive = 0;
+			for (int k = 0; k < packet.num_alive; k++) {
+				int i = packet.alive[k];
+				if (advancePath(scene, accel, packet, i, depth, iter)) {
+					packet.alive[num_alive++] = i;
+				}
+			}
+			packet.num_alive = num_alive;
+		}
+		for (int i = 0; i < n; i++) {
+			sums[packet.pixel[i]] += packet.radiance[i];
+		}
+	}
+}
+
+// a worker's share of the tiles, claimed front to back by whoever gets there first
+struct TileRange {
+	std::atomic<int> next;
+	int end;
+};
+
+// corners of the CPU_TILE_SIZE tiles covering the image, in scanline order
+static std::vector<glm::ivec2> imageTiles(const glm::ivec2& resolution) {
+	std::vector<glm::ivec2> tiles;
+	for (int y = 0; y < resolution.y; y += CPU_TILE_SIZE) {
+		for (int x = 0; x < resolution.x; x += CPU_TILE_SIZE) {
+			tiles.push_back(glm::ivec2(x, y));
+		}
+	}
+	return tiles;
+}
+
+float cpuRender(Scene* scene, int spp, int num_threads, std::vector<glm::vec3>& sums) {
+	auto start = std::chrono::steady_clock::now();
+	if (scene->lbvh_until_swap) {
+		// BVH_PROGRESSIVE, no device traces an LBVH in the meantime, so the host build runs first
+		std::vector<std::vector<BVHNode_GPU>> blas_nodes;
+		std::vector<std::vector<int>> blas_tri_order;
+		scene->computeTriBounds();
+		scene->buildHostBLASes(blas_nodes, blas_tri_order);
+		scene->swapInHostBLASes(blas_nodes, blas_tri_order);
+	}
+	HostAccel host;
+	buildHostAccel(scene, host);
+
+	const Camera& cam = scene->state.camera;
+	const std::vector<glm::ivec2> tiles = imageTiles(cam.resolution);
+	if (num_threads <= 0) {
+		num_threads = glm::max((int)std::thread::hardware_concurrency(), 1);
+	}
+	num_threads = glm::min(num_threads, glm::max((int)tiles.size(), 1));
+	sums.assign(cam.resolution.x * cam.resolution.y, glm::vec3(0.0f));
+
+	// every worker starts on a contiguous run of tiles and steals from the others' runs once
+	// its own is done, so a worker stuck on expensive tiles doesn't hold up the image
+	std::vector<TileRange> ranges(num_threads);
+	for (int w = 0; w < num_threads; w++) {
+		ranges[w].next = (int)((long long)tiles.size() * w / num_threads);
+		ranges[w].end = (int)((long long)tiles.size() * (w + 1) / num_threads);
+	}
+	const float filter_radius = pixelFilterRadius(scene->render_settings);
+	std::vector<std::thread> workers;
+	for (int w = 0; w < num_threads; w++) {
+		workers.push_back(std::thread([&, w]() {
+			std::unique_ptr<PathPacket> packet(new PathPacket());
+			for (int i = 0; i < num_threads; i++) {
+				TileRange& range = ranges[(w + i) % num_threads];
+				for (int tile = range.next++; tile < range.end; tile = range.next++) {
+					renderTile(scene, host.accel, tiles[tile], 1, spp, filter_radius, *packet, sums);
+				}
+			}
+		}));
+	}
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "CPU render: " << spp << " samples on " << num_threads << " thread(s), " << tiles.size() << " tiles in "
+		<< elapsed.count() << " s" << std::endl;
+	return elapsed.count();
+}
+
+struct CPUAssist {
+	Scene* scene;
+	HostAccel host;
+	std::vector<glm::ivec2> tiles;
+	int num_threads;
+	float filter_radius;
+	std::thread coordinator;
+
+	// guards everything below. claimed is the last sample handed to either side
+	std::mutex lock;
+	int claimed;
+	int last;
+	float gpu_seconds = 0.0f; // moving averages of a sample on each side, 0 until one is measured
+	float cpu_seconds = 0.0f;
+	int in_flight = 0; // the sample the host threads are tracing, 0 for none
+	std::chrono::steady_clock::time_point in_flight_start;
+	std::atomic<int> tiles_done;
+	std::atomic<bool> cancel; // the GPU took in_flight over, or the render stopped
+	bool stopping = false;
+
+	std::vector<glm::vec3> pending; // in_flight's radiance, only added to sums once it's whole
+	std::vector<glm::vec3> sums;
+	int samples = 0;
+};
+
+// how much longer the host threads need for in_flight, from their measured rate or else from
+// the share of its tiles done so far
+static float cpuAssistRemaining(const CPUAssist& assist) {
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - assist.in_flight_start;
+	if (assist.cpu_seconds > 0.0f) {
+		return glm::max(assist.cpu_seconds - elapsed.count(), 0.0f);
+	}
+	const float done = (float)assist.tiles_done / glm::max((float)assist.tiles.size(), 1.0f);
+	return done > 0.0f ? elapsed.count() * (1.0f - done) / done : FLT_MAX;
+}
+
+// one sample at a time across the worker threads, its tiles claimed like cpuRender's. a sample
+// is only taken while the GPU would still be busy with the rest for as long as it takes here,
+// so the host never holds up the end of the frame by more than the GPU needs to take it over
+static void cpuAssistLoop(CPUAssist* assist) {
+	while (true) {
+		int sample;
+		{
+			std::lock_guard<std::mutex> guard(assist->lock);
+			const bool in_time = assist->cpu_seconds == 0.0f || assist->gpu_seconds == 0.0f
+				|| assist->cpu_seconds <= (assist->last - assist->claimed - 1) * assist->gpu_seconds;
+			if (assist->stopping || assist->claimed >= assist->last || !in_time) {
+				return;
+			}
+			sample = ++assist->claimed;
+			assist->in_flight = sample;
+			assist->in_flight_start = std::chrono::steady_clock::now();
+			assist->tiles_done = 0;
+			assist->cancel = false;
+		}
+
+		std::fill(assist->pending.begin(), assist->pending.end(), glm::vec3(0.0f));
+		std::atomic<int> next_tile(0);
+		auto work = [&]() {
+			std::unique_ptr<PathPacket> packet(new PathPacket());
+			for (int tile = next_tile++; tile < (int)assist->tiles.size() && !assist->cancel; tile = next_tile++) {
+				renderTile(assist->scene, assist->host.accel, assist->tiles[tile], sample, sample, assist->filter_radius, *packet, assist->pending);
+				assist->tiles_done++;
+			}
+		};
+		std::vector<std::thread> workers;
+		for (int w = 1; w < assist->num_threads; w++) {
+			workers.push_back(std::thread(work));
+		}
+		work();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+
+		std::lock_guard<std::mutex> guard(assist->lock);
+		assist->in_flight = 0;
+		if (assist->cancel) {
+			continue;
+		}
+		std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - assist->in_flight_start;
+		assist->cpu_seconds = assist->cpu_seconds == 0.0f ? elapsed.count() : 0.75f * assist->cpu_seconds + 0.25f * elapsed.count();
+		for (size_t i = 0; i < assist->sums.size(); i++) {
+			assist->sums[i] += assist->pending[i];
+		}
+		assist->samples++;
+	}
+}
+
+CPUAssist* cpuAssistStart(Scene* scene, int num_threads, int first_sample, int last_sample) {
+	CPUAssist* assist = new CPUAssist();
+	assist->scene = scene;
+	buildHostAccel(scene, assist->host);
+	const Camera& cam = scene->state.camera;
+	assist->tiles = imageTiles(cam.resolution);
+	// one core stays with the thread feeding the GPU
+	if (num_threads <= 0) {
+		num_threads = glm::max((int)std::thread::hardware_concurrency() - 1, 1);
+	}
+	assist->num_threads = glm::min(num_threads, glm::max((int)assist->tiles.size(), 1));
+	assist->filter_radius = pixelFilterRadius(scene->render_settings);
+	assist->claimed = first_sample;
+	assist->last = last_sample;
+	assist->tiles_done = 0;
+	assist->cancel = false;
+	assist->pending.assign(cam.resolution.x * cam.resolution.y, glm::vec3(0.0f));
+	assist->sums.assign(cam.resolution.x * cam.resolution.y, glm::vec3(0.0f));
+	assist->coordinator = std::thread(cpuAssistLoop, assist);
+	return assist;
+}
+
+int cpuAssistClaim(CPUAssist* assist, float gpu_seconds) {
+	std::lock_guard<std::mutex> guard(assist->lock);
+	if (gpu_seconds > 0.0f) {
+		assist->gpu_seconds = assist->gpu_seconds == 0.0f ? gpu_seconds : 0.75f * assist->gpu_seconds + 0.25f * gpu_seconds;
+	}
+	if (assist->claimed < assist->last) {
+		return ++assist->claimed;
+	}
+	// nothing left to hand out, the GPU steals the host's sample if it would be done with it sooner
+	if (assist->in_flight != 0 && !assist->cancel && cpuAssistRemaining(*assist) > assist->gpu_seconds) {
+		assist->cancel = true;
+		return assist->in_flight;
+	}
+	return 0;
+}
+
+int cpuAssistFinish(CPUAssist* assist, bool drop_partial, std::vector<glm::vec3>& sums) {
+	{
+		std::lock_guard<std::mutex> guard(assist->lock);
+		assist->stopping = true;
+		if (drop_partial) {
+			assist->cancel = true;
+		}
+	}
+	assist->coordinator.join();
+	sums.swap(assist->sums);
+	const int samples = assist->samples;
+	std::cout << "CPU assist: " << samples << " sample(s) on " << assist->num_threads << " thread(s)";
+	if (assist->cpu_seconds > 0.0f) {
+		std::cout << ", " << assist->cpu_seconds << " s a sample against the GPU's " << assist->gpu_seconds << " s";
+	}
+	std::cout << std::endl;
+	delete assist;
+	return samples;
+}
+
+float cpuReplayRays(const RayCapture& capture, const std::vector<CapturedRay>& rays, bool any_hit, bool stackless, std::vector<int>& hit_geoms,
+	std::vector<int>& nodes) {
+	SceneAccel accel;
+	accel.geoms = const_cast<Geom*>(capture.geoms.data());
+	accel.geom_records = const_cast<GeomGPU*>(capture.geom_records.data());
+	accel.geoms_size = capture.geoms.size();
+	accel.tlas_nodes = const_cast<BVHNode_GPU*>(capture.tlas_nodes.data());
+	accel.blases = const_cast<BLAS*>(capture.blases.data());
+	accel.tris = const_cast<TriIntersect*>(capture.tris.data());
+	accel.bvh_nodes = capture.bvh_nodes.empty() ? NULL : const_cast<BVHNode_GPU*>(capture.bvh_nodes.data());
+	accel.wide_bvh_nodes = capture.wide_bvh_nodes.empty() ? NULL : const_cast<WideBVHNode_GPU*>(capture.wide_bvh_nodes.data());
+	accel.bvh_parents = NULL;
+	accel.tlas_parents = NULL;
+	std::vector<int> tlas_parents, bvh_parents;
+	if (stackless && !capture.tlas_nodes.empty()) {
+		tlas_parents.resize(capture.tlas_nodes.size());
+		findHostParents(accel.tlas_nodes, tlas_parents.size(), tlas_parents.data());
+		accel.tlas_parents = tlas_parents.data();
+		if (accel.bvh_nodes != NULL) {
+			bvh_parents.resize(capture.bvh_nodes.size());
+			for (const BLAS& blas : capture.blases) {
+				findHostParents(accel.bvh_nodes + blas.node_offset, blas.num_nodes, bvh_parents.data() + blas.node_offset);
+			}
+			accel.bvh_parents = bvh_parents.data();
+		}
+	}
+
+	hit_geoms.assign(rays.size(), -1);
+	nodes.assign(rays.size(), 0);
+	// chunks of rays small enough to balance and big enough that claiming one costs nothing
+	const int chunk = 1024;
+	const int num_chunks = (int)((rays.size() + chunk - 1) / chunk);
+	auto start = std::chrono::steady_clock::now();
+	utilityCore::parallelFor(num_chunks, [&](int c) {
+		const int end = glm::min((c + 1) * chunk, (int)rays.size());
+		for (int i = c * chunk; i < end; i++) {
+			const CapturedRay& captured = rays[i];
+			Ray r = makeRay(captured.origin, captured.direction);
+			float t = captured.t_max;
+			SceneHit hit;
+			TraversalStats traversal;
+			hit_geoms[i] = any_hit
+				? traverseScene<AnyHit>(r, accel, captured.cull_backfaces != 0, captured.ignore_geom, t, hit, traversal)
+				: traverseScene<ClosestHit>(r, accel, captured.cull_backfaces != 0, captured.ignore_geom, t, hit, traversal);
+			nodes[i] = traversal.nodes;
+		}
+	});
+	std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+
+class Scene;
+struct RayCapture;
+struct CapturedRay;
+
+// renders spp samples per pixel of the scene's camera on the host, without a CUDA device.
+// num_threads workers (0 for one per core) share the image in tiles, sums gets the per pixel
+// sum of samples like RenderState::image. returns the seconds it took
+float cpuRender(Scene* scene, int spp, int num_threads, std::vector<glm::vec3>& sums);
+
+// --hybrid, host threads rendering whole samples of the scene's camera next to the GPU. samples
+// are numbered like iterations and handed out one at a time to whichever side asks first, so
+// each is traced once. the host only takes one while its measured time for it is below what the
+// GPU needs for the rest, and the GPU takes the sample the host is on over at the end if it would
+// finish it sooner
+struct CPUAssist;
+// the host starts claiming samples first_sample + 1 .. last_sample, num_threads workers (0 for one
+// per core but one) share each sample in tiles
+CPUAssist* cpuAssistStart(Scene* scene, int num_threads, int first_sample, int last_sample);
+// the next sample for the GPU, 0 once there is none. gpu_seconds is how long its last one took, 0 if unknown
+int cpuAssistClaim(CPUAssist* assist, float gpu_seconds);
+// waits for the sample the host is on, or drops it with drop_partial, and frees assist. sums gets
+// the host's per pixel sums like RenderState::image, the return is how many samples they hold
+int cpuAssistFinish(CPUAssist* assist, bool drop_partial, std::vector<glm::vec3>& sums);
+
+// pathtraceReplayRays on the host: rays traced against capture's acceleration structure by
+// utilityCore::numThreads() workers, scalar rather than in packets since captured rays carry no
+// coherence guarantee. returns the ms it took
+float cpuReplayRays(const RayCapture& capture, const std::vector<CapturedRay>& rays, bool any_hit, bool stackless, std::vector<int>& hit_geoms,
+    std::vector<int>& nodes);
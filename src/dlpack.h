@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+// the DLPack tensor ABI (dmlc/dlpack 0.8, unversioned DLManagedTensor), just what the renderer
+// exports fill in. layout compatible with dlpack.h, so anything that takes a DLPack capsule
+// (torch.utils.dlpack, cupy, jax) takes these
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    kDLCPU = 1,
+    kDLCUDA = 2,
+    kDLCUDAHost = 3,
+} DLDeviceType;
+
+typedef struct {
+    DLDeviceType device_type;
+    int32_t device_id;
+} DLDevice;
+
+typedef enum {
+    kDLInt = 0,
+    kDLUInt = 1,
+    kDLFloat = 2,
+} DLDataTypeCode;
+
+typedef struct {
+    uint8_t code; // DLDataTypeCode
+    uint8_t bits;
+    uint16_t lanes;
+} DLDataType;
+
+typedef struct {
+    void* data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t* shape;
+    int64_t* strides; // in elements, NULL for compact row major
+    uint64_t byte_offset;
+} DLTensor;
+
+typedef struct DLManagedTensor {
+    DLTensor dl_tensor;
+    void* manager_ctx;
+    void (*deleter)(struct DLManagedTensor* self); // the consumer calls it once it's done with the tensor
+} DLManagedTensor;
+
+#ifdef __cplusplus
+}
+#endif
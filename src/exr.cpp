@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "exr.h"
+#include "utilities.h"
+
+// defined by the stb_image_write implementation in stb.cpp, a zlib stream freed with free()
+unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+// scanlines per chunk of ZIP_COMPRESSION
+#define EXR_ZIP_LINES 16
+
+static int pixelTypeSize(EXRPixelType type) {
+    return type == EXR_HALF ? 2 : 4;
+}
+
+void* EXRImage::addChannel(const std::string& name, EXRPixelType type) {
+    channels.push_back(EXRChannel());
+    EXRChannel& channel = channels.back();
+    channel.name = name;
+    channel.type = type;
+    channel.data.resize((size_t)width * height * pixelTypeSize(type));
+    return channel.data.data();
+}
+
+EXRImage cropEXR(const EXRImage& exr, int x, int y, int width, int height) {
+    EXRImage region;
+    region.width = width;
+    region.height = height;
+    for (const EXRChannel& channel : exr.channels) {
+        const int size = pixelTypeSize(channel.type);
+        unsigned char* out = (unsigned char*)region.addChannel(channel.name, channel.type);
+        for (int row = 0; row < height; row++) {
+            memcpy(out + (size_t)row * width * size, channel.data.data() + ((size_t)(y + row) * exr.width + x) * size, (size_t)width * size);
+        }
+    }
+    return region;
+}
+
+// exr is little endian throughout
+static void put32(std::vector<unsigned char>& out, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back((v >> (8 * i)) & 0xff);
+    }
+}
+
+static void putFloat(std::vector<unsigned char>& out, float f) {
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    put32(out, v);
+}
+
+static void putAttribute(std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value) {
+    out.insert(out.end(), name, name + strlen(name) + 1);
+    out.insert(out.end(), type, type + strlen(type) + 1);
+    put32(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// the bytes of lines [y0, y1): each line holds every channel's values in turn, channels
+// sorted by name
+static std::vector<unsigned char> chunkBytes(const EXRImage& exr, const std::vector<const EXRChannel*>& channels, int y0, int y1) {
+    std::vector<unsigned char> bytes;
+    for (int y = y0; y < y1; y++) {
+        for (const EXRChannel* channel : channels) {
+            const int line = exr.width * pixelTypeSize(channel->type);
+            const unsigned char* src = channel->data.data() + (size_t)y * line;
+            bytes.insert(bytes.end(), src, src + line);
+        }
+    }
+    return bytes;
+}
+
+// ZIP_COMPRESSION: bytes split into even and odd halves, delta coded, then deflated. stays
+// uncompressed when that doesn't make it smaller
+static std::vector<unsigned char> zipChunk(const std::vector<unsigned char>& raw) {
+    const int n = raw.size();
+    std::vector<unsigned char> tmp(n);
+    for (int i = 0; i < n; i++) {
+        tmp[(i & 1) ? (n + 1) / 2 + i / 2 : i / 2] = raw[i];
+    }
+    int prev = n > 0 ? tmp[0] : 0;
+    for (int i = 1; i < n; i++) {
+        int d = (int)tmp[i] - prev + (128 + 256);
+        prev = tmp[i];
+        tmp[i] = (unsigned char)d;
+    }
+
+    int zipped_size = 0;
+    unsigned char* zipped = stbi_zlib_compress(tmp.data(), n, &zipped_size, 8);
+    if (zipped == NULL || zipped_size >= n) {
+        free(zipped);
+        return raw;
+    }
+    std::vector<unsigned char> out(zipped, zipped + zipped_size);
+    free(zipped);
+    return out;
+}
+
+bool saveEXR(const EXRImage& exr, const std::string& filename) {
+    std::vector<const EXRChannel*> channels;
+    for (const EXRChannel& channel : exr.channels) {
+        channels.push_back(&channel);
+    }
+    std::sort(channels.begin(), channels.end(),
+        [](const EXRChannel* a, const EXRChannel* b) { return a->name < b->name; });
+
+    std::vector<unsigned char> header = { 0x76, 0x2f, 0x31, 0x01 };
+    put32(header, 2); // version 2, single part scanline
+
+    std::vector<unsigned char> value;
+    for (const EXRChannel* channel : channels) {
+        value.insert(value.end(), channel->name.begin(), channel->name.end());
+        value.push_back(0);
+        put32(value, channel->type);
+        put32(value, 0); // pLinear and reserved
+        put32(value, 1); // x and y sampling
+        put32(value, 1);
+    }
+    value.push_back(0);
+    putAttribute(header, "channels", "chlist", value);
+    putAttribute(header, "compression", "compression", std::vector<unsigned char>(1, 3));
+    value.clear();
+    put32(value, 0);
+    put32(value, 0);
+    put32(value, exr.width - 1);
+    put32(value, exr.height - 1);
+    putAttribute(header, "dataWindow", "box2i", value);
+    putAttribute(header, "displayWindow", "box2i", value);
+    putAttribute(header, "lineOrder", "lineOrder", std::vector<unsigned char>(1, 0));
+    value.clear();
+    putFloat(value, 1.0f);
+    putAttribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    putFloat(value, 0.0f);
+    putFloat(value, 0.0f);
+    putAttribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    putFloat(value, 1.0f);
+    putAttribute(header, "screenWindowWidth", "float", value);
+    header.push_back(0);
+
+    const int num_chunks = (exr.height + EXR_ZIP_LINES - 1) / EXR_ZIP_LINES;
+    std::vector<std::vector<unsigned char>> chunks(num_chunks);
+    utilityCore::parallelFor(num_chunks, [&](int c) {
+        const int y0 = c * EXR_ZIP_LINES;
+        chunks[c] = zipChunk(chunkBytes(exr, channels, y0, std::min(y0 + EXR_ZIP_LINES, exr.height)));
+    });
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cout << "ERROR: can't write " << filename << std::endl;
+        return false;
+    }
+    // offsets of each chunk from the start of the file, after the header and this table
+    uint64_t offset = header.size() + num_chunks * sizeof(uint64_t);
+    std::vector<unsigned char> table;
+    for (int c = 0; c < num_chunks; c++) {
+        put32(table, (uint32_t)offset);
+        put32(table, (uint32_t)(offset >> 32));
+        offset += 8 + chunks[c].size();
+    }
+    out.write((const char*)header.data(), header.size());
+    out.write((const char*)table.data(), table.size());
+    for (int c = 0; c < num_chunks; c++) {
+        std::vector<unsigned char> prefix;
+        put32(prefix, c * EXR_ZIP_LINES);
+        put32(prefix, chunks[c].size());
+        out.write((const char*)prefix.data(), prefix.size());
+        out.write((const char*)chunks[c].data(), chunks[c].size());
+    }
+    std::cout << "Saved " << filename << "." << std::endl;
+    return true;
+}
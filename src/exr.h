@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+enum EXRPixelType {
+    EXR_UINT = 0,
+    EXR_HALF = 1,
+    EXR_FLOAT = 2,
+};
+
+// one plane of an EXR image, width * height values of type, rows top to bottom
+struct EXRChannel {
+    std::string name; // R, G, B, or layer.name for extra channels
+    EXRPixelType type;
+    std::vector<unsigned char> data;
+};
+
+struct EXRImage {
+    int width = 0;
+    int height = 0;
+    std::vector<EXRChannel> channels; // any order, they are written sorted by name
+
+    // a zeroed plane of type, filled in place through the returned pointer
+    void* addChannel(const std::string& name, EXRPixelType type);
+};
+
+// a copy of the width x height region of exr at (x, y), every channel
+EXRImage cropEXR(const EXRImage& exr, int x, int y, int width, int height);
+
+// writes a single part scanline OpenEXR file, ZIP compressed in blocks of 16 scanlines that
+// are compressed in parallel. false if the file can't be written
+bool saveEXR(const EXRImage& exr, const std::string& filename);
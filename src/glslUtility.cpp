@@ -192,4 +192,29 @@ GLuint createProgram(const char *vertexShaderPath, const char *fragmentShaderPat
 
     return program;
 }
+
+GLuint createProgramFromSource(const char *vertexSource, const char *fragmentSource,
+                               const char *attributeLocations[], GLuint numberOfLocations) {
+    glslUtility::shaders_t shaders;
+    compileShader("Vertex", vertexSource, GL_VERTEX_SHADER, (GLint&)shaders.vertex);
+    compileShader("Fragment", fragmentSource, GL_FRAGMENT_SHADER, (GLint&)shaders.fragment);
+
+    GLuint program = glCreateProgram();
+
+    for (GLuint i = 0; i < numberOfLocations; ++i) {
+        glBindAttribLocation(program, i, attributeLocations[i]);
+    }
+
+    glslUtility::attachAndLinkProgram(program, shaders);
+    glDeleteShader(shaders.vertex);
+    glDeleteShader(shaders.fragment);
+
+    GLint linked;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
 }
@@ -12,6 +12,9 @@ namespace glslUtility {
 GLuint createDefaultProgram(const char *attributeLocations[], GLuint numberOfLocations);
 GLuint createProgram(const char *vertexShaderPath, const char *fragmentShaderPath,
                      const char *attributeLocations[], GLuint numberOfLocations);
+// same as createProgram from embedded sources, 0 if they don't compile and link
+GLuint createProgramFromSource(const char *vertexSource, const char *fragmentSource,
+                               const char *attributeLocations[], GLuint numberOfLocations);
 }
 
 #endif
@@ -0,0 +1,733 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <glm/gtc/quaternion.hpp>
+
+#include "gltf.h"
+
+#define GLB_MAGIC 0x46546C67u // "glTF"
+#define GLB_CHUNK_JSON 0x4E4F534Au
+#define GLB_CHUNK_BIN 0x004E4942u
+#define JSON_MAX_DEPTH 256
+
+#define GLTF_BYTE 5120
+#define GLTF_UNSIGNED_BYTE 5121
+#define GLTF_SHORT 5122
+#define GLTF_UNSIGNED_SHORT 5123
+#define GLTF_UNSIGNED_INT 5125
+#define GLTF_FLOAT 5126
+#define GLTF_TRIANGLES 4
+
+// just enough JSON for a glTF: objects keep their keys in order next to their values
+struct JSONValue {
+    enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+    Type type = JSON_NULL;
+    double number = 0.0; // also 1 / 0 for bools
+    std::string string;
+    std::vector<std::string> keys; // objects only, parallel to items
+    std::vector<JSONValue> items;
+
+    const JSONValue* get(const char* key) const {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (keys[i] == key) {
+                return &items[i];
+            }
+        }
+        return NULL;
+    }
+
+    double getNumber(const char* key, double fallback) const {
+        const JSONValue* v = get(key);
+        return v != NULL && v->type == JSON_NUMBER ? v->number : fallback;
+    }
+
+    int getInt(const char* key, int fallback) const {
+        return (int)getNumber(key, fallback);
+    }
+
+    const JSONValue* getArray(const char* key) const {
+        const JSONValue* v = get(key);
+        return v != NULL && v->type == JSON_ARRAY ? v : NULL;
+    }
+};
+
+class JSONParser {
+public:
+    JSONParser(const char* begin, const char* end) : p(begin), end(end) {}
+
+    bool parse(JSONValue& value) {
+        if (!parseValue(value, 0)) {
+            return false;
+        }
+        skipSpace();
+        return p == end;
+    }
+
+private:
+    const char* p;
+    const char* end;
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            p++;
+        }
+    }
+
+    bool literal(const char* word) {
+        size_t n = strlen(word);
+        if ((size_t)(end - p) < n || strncmp(p, word, n) != 0) {
+            return false;
+        }
+        p += n;
+        return true;
+    }
+
+    static void appendUTF8(std::string& out, unsigned int c) {
+        if (c < 0x80) {
+            out += (char)c;
+        }
+        else if (c < 0x800) {
+            out += (char)(0xC0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3F));
+        }
+        else {
+            out += (char)(0xE0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        }
+    }
+
+    bool parseString(std::string& out) {
+        if (p >= end || *p != '"') {
+            return false;
+        }
+        p++;
+        while (p < end && *p != '"') {
+            if (*p != '\\') {
+                out += *p++;
+                continue;
+            }
+            if (++p >= end) {
+                return false;
+            }
+            const char c = *p++;
+            switch (c) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                if (end - p < 4) {
+                    return false;
+                }
+                char hex[5] = { p[0], p[1], p[2], p[3], 0 };
+                appendUTF8(out, strtoul(hex, NULL, 16));
+                p += 4;
+                break;
+            }
+            default: out += c; break; // " \ /
+            }
+        }
+        if (p >= end) {
+            return false;
+        }
+        p++;
+        return true;
+    }
+
+    bool parseValue(JSONValue& v, int depth) {
+        skipSpace();
+        if (p >= end || depth > JSON_MAX_DEPTH) {
+            return false;
+        }
+        if (*p == '{') {
+            v.type = JSONValue::JSON_OBJECT;
+            p++;
+            skipSpace();
+            if (p < end && *p == '}') {
+                p++;
+                return true;
+            }
+            while (true) {
+                skipSpace();
+                v.keys.push_back(std::string());
+                if (!parseString(v.keys.back())) {
+                    return false;
+                }
+                skipSpace();
+                if (p >= end || *p++ != ':') {
+                    return false;
+                }
+                v.items.push_back(JSONValue());
+                if (!parseValue(v.items.back(), depth + 1)) {
+                    return false;
+                }
+                skipSpace();
+                if (p < end && *p == ',') {
+                    p++;
+                    continue;
+                }
+                return p < end && *p++ == '}';
+            }
+        }
+        if (*p == '[') {
+            v.type = JSONValue::JSON_ARRAY;
+            p++;
+            skipSpace();
+            if (p < end && *p == ']') {
+                p++;
+                return true;
+            }
+            while (true) {
+                v.items.push_back(JSONValue());
+                if (!parseValue(v.items.back(), depth + 1)) {
+                    return false;
+                }
+                skipSpace();
+                if (p < end && *p == ',') {
+                    p++;
+                    continue;
+                }
+                return p < end && *p++ == ']';
+            }
+        }
+        if (*p == '"') {
+            v.type = JSONValue::JSON_STRING;
+            return parseString(v.string);
+        }
+        if (literal("true")) {
+            v.type = JSONValue::JSON_BOOL;
+            v.number = 1.0;
+            return true;
+        }
+        if (literal("false")) {
+            v.type = JSONValue::JSON_BOOL;
+            return true;
+        }
+        if (literal("null")) {
+            return true;
+        }
+        // strtod stops at the end of the number, the buffer isn't null terminated past end though
+        char number[64];
+        size_t n = 0;
+        while (p + n < end && n + 1 < sizeof(number) && strchr("+-0123456789.eE", p[n]) != NULL) {
+            number[n] = p[n];
+            n++;
+        }
+        number[n] = 0;
+        char* number_end = NULL;
+        v.type = JSONValue::JSON_NUMBER;
+        v.number = strtod(number, &number_end);
+        if (n == 0 || number_end != number + n) {
+            return false;
+        }
+        p += n;
+        return true;
+    }
+};
+
+bool isGLTFPath(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string ext = path.substr(dot + 1);
+    for (char& c : ext) {
+        c = (char)tolower(c);
+    }
+    return ext == "gltf" || ext == "glb";
+}
+
+static uint32_t readU32(const unsigned char* b) {
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static std::vector<unsigned char> decodeBase64(const std::string& text) {
+    std::vector<unsigned char> out;
+    unsigned int bits = 0;
+    int num_bits = 0;
+    for (char c : text) {
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '+' || c == '-') value = 62;
+        else if (c == '/' || c == '_') value = 63;
+        else continue; // padding
+        bits = (bits << 6) | value;
+        num_bits += 6;
+        if (num_bits >= 8) {
+            num_bits -= 8;
+            out.push_back((unsigned char)(bits >> num_bits));
+        }
+    }
+    return out;
+}
+
+// uris are relative to the .gltf and may be percent encoded
+static std::string resolveURI(const std::string& gltf_path, const std::string& uri) {
+    std::string decoded;
+    for (size_t i = 0; i < uri.size(); ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size()) {
+            char hex[3] = { uri[i + 1], uri[i + 2], 0 };
+            decoded += (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        else {
+            decoded += uri[i];
+        }
+    }
+    size_t slash = gltf_path.find_last_of("/\\");
+    return slash == std::string::npos ? decoded : gltf_path.substr(0, slash + 1) + decoded;
+}
+
+static int componentCount(const std::string& type) {
+    if (type == "SCALAR") return 1;
+    if (type == "VEC2") return 2;
+    if (type == "VEC3") return 3;
+    if (type == "VEC4") return 4;
+    if (type == "MAT4") return 16;
+    return 0;
+}
+
+static size_t componentSize(int component_type) {
+    switch (component_type) {
+    case GLTF_BYTE:
+    case GLTF_UNSIGNED_BYTE: return 1;
+    case GLTF_SHORT:
+    case GLTF_UNSIGNED_SHORT: return 2;
+    case GLTF_UNSIGNED_INT:
+    case GLTF_FLOAT: return 4;
+    default: return 0;
+    }
+}
+
+static glm::mat4 nodeTransform(const JSONValue& node) {
+    const JSONValue* matrix = node.getArray("matrix");
+    if (matrix != NULL && matrix->items.size() == 16) {
+        // column major like glm
+        glm::mat4 m;
+        for (int i = 0; i < 16; ++i) {
+            m[i / 4][i % 4] = (float)matrix->items[i].number;
+        }
+        return m;
+    }
+    glm::mat4 m(1.0f);
+    const JSONValue* t = node.getArray("translation");
+    if (t != NULL && t->items.size() == 3) {
+        m[3] = glm::vec4(t->items[0].number, t->items[1].number, t->items[2].number, 1.0f);
+    }
+    const JSONValue* r = node.getArray("rotation");
+    if (r != NULL && r->items.size() == 4) {
+        // stored x y z w
+        glm::quat q((float)r->items[3].number, (float)r->items[0].number, (float)r->items[1].number, (float)r->items[2].number);
+        m = m * glm::mat4_cast(q);
+    }
+    const JSONValue* s = node.getArray("scale");
+    if (s != NULL && s->items.size() == 3) {
+        m = m * glm::mat4(glm::vec4(s->items[0].number, 0, 0, 0), glm::vec4(0, s->items[1].number, 0, 0),
+            glm::vec4(0, 0, s->items[2].number, 0), glm::vec4(0, 0, 0, 1));
+    }
+    return m;
+}
+
+// depth first over a node's subtree, a node reached twice (a broken asset's cycle) is skipped
+static void addInstances(const JSONValue& nodes, int node_ID, const glm::mat4& parent, std::set<int>& visited, GLTFAsset& asset) {
+    if (node_ID < 0 || (size_t)node_ID >= nodes.items.size() || !visited.insert(node_ID).second) {
+        return;
+    }
+    const JSONValue& node = nodes.items[node_ID];
+    const glm::mat4 transform = parent * nodeTransform(node);
+    const int mesh = node.getInt("mesh", -1);
+    if (mesh >= 0 && (size_t)mesh < asset.meshes.size()) {
+        GLTFInstance instance;
+        instance.mesh = mesh;
+        instance.transform = transform;
+        asset.instances.push_back(instance);
+    }
+    const JSONValue* children = node.getArray("children");
+    if (children != NULL) {
+        for (const JSONValue& child : children->items) {
+            addInstances(nodes, (int)child.number, transform, visited, asset);
+        }
+    }
+}
+
+static bool usableAccessor(const GLTFAsset& asset, int accessor) {
+    return accessor >= 0 && (size_t)accessor < asset.accessors.size() && !asset.accessors[accessor].sparse
+        && asset.accessors[accessor].buffer_view >= 0 && (size_t)asset.accessors[accessor].buffer_view < asset.buffer_views.size();
+}
+
+bool loadGLTF(const std::string& path, GLTFAsset& asset, std::string& error) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        error = "Cannot open file [" + path + "]";
+        return false;
+    }
+    asset = GLTFAsset();
+    asset.path = path;
+
+    // a .glb is a 12 byte header, the JSON chunk and an optional BIN chunk that is buffer 0
+    std::string json;
+    size_t bin_offset = 0;
+    size_t bin_length = 0;
+    unsigned char header[12];
+    if (file.read((char*)header, sizeof(header)) && readU32(header) == GLB_MAGIC) {
+        unsigned char chunk[8];
+        if (!file.read((char*)chunk, sizeof(chunk)) || readU32(chunk + 4) != GLB_CHUNK_JSON) {
+            error = path + " is not a valid .glb";
+            return false;
+        }
+        json.resize(readU32(chunk));
+        if (!file.read(&json[0], json.size())) {
+            error = path + " is cut short";
+            return false;
+        }
+        if (file.read((char*)chunk, sizeof(chunk)) && readU32(chunk + 4) == GLB_CHUNK_BIN) {
+            bin_offset = (size_t)file.tellg();
+            bin_length = readU32(chunk);
+        }
+    }
+    else {
+        file.clear();
+        file.seekg(0, std::ios::end);
+        json.resize((size_t)file.tellg());
+        file.seekg(0);
+        file.read(&json[0], json.size());
+    }
+
+    JSONValue root;
+    JSONParser parser(json.data(), json.data() + json.size());
+    if (!parser.parse(root) || root.type != JSONValue::JSON_OBJECT) {
+        error = path + " has malformed JSON";
+        return false;
+    }
+    const JSONValue* version = root.get("asset") != NULL ? root.get("asset")->get("version") : NULL;
+    if (version == NULL || version->string.empty() || version->string[0] != '2') {
+        error = path + " is not glTF 2.0";
+        return false;
+    }
+
+    const JSONValue* buffers = root.getArray("buffers");
+    for (size_t i = 0; buffers != NULL && i < buffers->items.size(); ++i) {
+        const JSONValue& b = buffers->items[i];
+        GLTFBuffer buffer;
+        buffer.byte_length = (size_t)b.getNumber("byteLength", 0);
+        const JSONValue* uri = b.get("uri");
+        if (uri == NULL) {
+            if (i != 0 || bin_length == 0) {
+                error = path + " has a buffer without data";
+                return false;
+            }
+            buffer.file = path;
+            buffer.file_offset = bin_offset;
+            buffer.byte_length = std::min(buffer.byte_length, bin_length);
+        }
+        else if (uri->string.compare(0, 5, "data:") == 0) {
+            size_t comma = uri->string.find(',');
+            if (comma == std::string::npos || uri->string.rfind(";base64", comma) == std::string::npos) {
+                error = path + " has a data uri that isn't base64";
+                return false;
+            }
+            buffer.data = decodeBase64(uri->string.substr(comma + 1));
+            buffer.byte_length = std::min(buffer.byte_length, buffer.data.size());
+        }
+        else {
+            buffer.file = resolveURI(path, uri->string);
+        }
+        asset.buffers.push_back(buffer);
+    }
+
+    const JSONValue* views = root.getArray("bufferViews");
+    for (size_t i = 0; views != NULL && i < views->items.size(); ++i) {
+        const JSONValue& v = views->items[i];
+        GLTFBufferView view;
+        view.buffer = v.getInt("buffer", -1);
+        view.byte_offset = (size_t)v.getNumber("byteOffset", 0);
+        view.byte_length = (size_t)v.getNumber("byteLength", 0);
+        view.byte_stride = (size_t)v.getNumber("byteStride", 0);
+        if (view.buffer < 0 || (size_t)view.buffer >= asset.buffers.size()) {
+            error = path + " has a buffer view without a buffer";
+            return false;
+        }
+        asset.buffer_views.push_back(view);
+    }
+
+    const JSONValue* accessors = root.getArray("accessors");
+    for (size_t i = 0; accessors != NULL && i < accessors->items.size(); ++i) {
+        const JSONValue& a = accessors->items[i];
+        GLTFAccessor accessor;
+        accessor.buffer_view = a.getInt("bufferView", -1);
+        accessor.byte_offset = (size_t)a.getNumber("byteOffset", 0);
+        accessor.component_type = a.getInt("componentType", 0);
+        accessor.normalized = a.get("normalized") != NULL && a.get("normalized")->number != 0.0;
+        accessor.count = a.getInt("count", 0);
+        accessor.components = a.get("type") != NULL ? componentCount(a.get("type")->string) : 0;
+        accessor.sparse = a.get("sparse") != NULL;
+        const JSONValue* min = a.getArray("min");
+        const JSONValue* max = a.getArray("max");
+        if (min != NULL && max != NULL && min->items.size() == 3 && max->items.size() == 3) {
+            accessor.min = glm::vec3(min->items[0].number, min->items[1].number, min->items[2].number);
+            accessor.max = glm::vec3(max->items[0].number, max->items[1].number, max->items[2].number);
+            accessor.has_bounds = true;
+        }
+        asset.accessors.push_back(accessor);
+    }
+
+    const JSONValue* meshes = root.getArray("meshes");
+    for (size_t m = 0; meshes != NULL && m < meshes->items.size(); ++m) {
+        asset.meshes.push_back(std::vector<GLTFPrimitive>());
+        const JSONValue* primitives = meshes->items[m].getArray("primitives");
+        for (size_t p = 0; primitives != NULL && p < primitives->items.size(); ++p) {
+            const JSONValue& prim = primitives->items[p];
+            const JSONValue* attributes = prim.get("attributes");
+            GLTFPrimitive primitive;
+            primitive.material = prim.getInt("material", -1);
+            primitive.indices = prim.getInt("indices", -1);
+            if (attributes != NULL) {
+                primitive.position = attributes->getInt("POSITION", -1);
+                primitive.normal = attributes->getInt("NORMAL", -1);
+                primitive.texcoord = attributes->getInt("TEXCOORD_0", -1);
+            }
+            // draco and meshopt compressed primitives have accessors without buffer views
+            if (prim.getInt("mode", GLTF_TRIANGLES) != GLTF_TRIANGLES || !usableAccessor(asset, primitive.position)
+                || asset.accessors[primitive.position].components != 3
+                || (primitive.indices >= 0 && !usableAccessor(asset, primitive.indices))) {
+                asset.skipped_primitives++;
+                continue;
+            }
+            if (!usableAccessor(asset, primitive.normal) || asset.accessors[primitive.normal].components != 3) {
+                primitive.normal = -1;
+            }
+            if (!usableAccessor(asset, primitive.texcoord) || asset.accessors[primitive.texcoord].components != 2) {
+                primitive.texcoord = -1;
+            }
+            asset.meshes.back().push_back(primitive);
+        }
+    }
+
+    // the default scene's root nodes, or every node no other node lists as a child
+    const JSONValue* nodes = root.getArray("nodes");
+    if (nodes != NULL) {
+        std::vector<int> roots;
+        const JSONValue* scenes = root.getArray("scenes");
+        const int scene = root.getInt("scene", 0);
+        if (scenes != NULL && scene >= 0 && (size_t)scene < scenes->items.size() && scenes->items[scene].getArray("nodes") != NULL) {
+            for (const JSONValue& n : scenes->items[scene].getArray("nodes")->items) {
+                roots.push_back((int)n.number);
+            }
+        }
+        else {
+            std::vector<bool> is_child(nodes->items.size(), false);
+            for (const JSONValue& node : nodes->items) {
+                const JSONValue* children = node.getArray("children");
+                for (size_t c = 0; children != NULL && c < children->items.size(); ++c) {
+                    int child = (int)children->items[c].number;
+                    if (child >= 0 && (size_t)child < is_child.size()) {
+                        is_child[child] = true;
+                    }
+                }
+            }
+            for (size_t n = 0; n < is_child.size(); ++n) {
+                if (!is_child[n]) {
+                    roots.push_back((int)n);
+                }
+            }
+        }
+        std::set<int> visited;
+        for (int n : roots) {
+            addInstances(*nodes, n, glm::mat4(1.0f), visited, asset);
+        }
+    }
+    if (asset.instances.empty()) {
+        error = path + " places no triangle meshes";
+        return false;
+    }
+    return true;
+}
+
+std::vector<int> gltfMeshMaterials(const GLTFAsset& asset, int mesh) {
+    std::vector<int> materials;
+    for (const GLTFPrimitive& primitive : asset.meshes[mesh]) {
+        if (std::find(materials.begin(), materials.end(), primitive.material) == materials.end()) {
+            materials.push_back(primitive.material);
+        }
+    }
+    return materials;
+}
+
+bool gltfMeshBounds(const GLTFAsset& asset, int mesh, int material, glm::vec3& AABB_min, glm::vec3& AABB_max) {
+    for (const GLTFPrimitive& primitive : asset.meshes[mesh]) {
+        if (primitive.material != material) {
+            continue;
+        }
+        const GLTFAccessor& accessor = asset.accessors[primitive.position];
+        if (!accessor.has_bounds) {
+            return false;
+        }
+        AABB_min = glm::min(AABB_min, accessor.min);
+        AABB_max = glm::max(AABB_max, accessor.max);
+    }
+    return true;
+}
+
+// size bytes at offset into a buffer, out of the file without a staging copy
+static bool readBuffer(const GLTFBuffer& buffer, size_t offset, size_t size, void* out) {
+    if (offset + size > buffer.byte_length && buffer.byte_length > 0) {
+        return false;
+    }
+    if (!buffer.data.empty()) {
+        if (offset + size > buffer.data.size()) {
+            return false;
+        }
+        memcpy(out, buffer.data.data() + offset, size);
+        return true;
+    }
+    std::ifstream file(buffer.file, std::ios::binary);
+    file.seekg(buffer.file_offset + offset);
+    return file.read((char*)out, size).good();
+}
+
+// where an accessor's elements start in its buffer and how far apart they are, false if they
+// don't fit in its buffer view
+static bool accessorLayout(const GLTFAsset& asset, const GLTFAccessor& accessor, size_t& offset, size_t& stride, size_t& span) {
+    const GLTFBufferView& view = asset.buffer_views[accessor.buffer_view];
+    const size_t element = accessor.components * componentSize(accessor.component_type);
+    stride = view.byte_stride > 0 ? view.byte_stride : element;
+    span = accessor.count > 0 ? (accessor.count - 1) * stride + element : 0;
+    offset = view.byte_offset + accessor.byte_offset;
+    return element > 0 && accessor.byte_offset + span <= view.byte_length;
+}
+
+// count * components floats into out
+static bool readFloats(const GLTFAsset& asset, int accessor_ID, float* out) {
+    const GLTFAccessor& accessor = asset.accessors[accessor_ID];
+    size_t offset, stride, span;
+    if (!accessorLayout(asset, accessor, offset, stride, span)) {
+        return false;
+    }
+    const GLTFBuffer& buffer = asset.buffers[asset.buffer_views[accessor.buffer_view].buffer];
+    if (accessor.component_type == GLTF_FLOAT && stride == accessor.components * sizeof(float)) {
+        return readBuffer(buffer, offset, span, out);
+    }
+
+    std::vector<unsigned char> bytes(span);
+    if (!readBuffer(buffer, offset, span, bytes.data())) {
+        return false;
+    }
+    const size_t size = componentSize(accessor.component_type);
+    for (int i = 0; i < accessor.count; ++i) {
+        for (int c = 0; c < accessor.components; ++c) {
+            const unsigned char* b = &bytes[i * stride + c * size];
+            float v = 0.0f;
+            switch (accessor.component_type) {
+            case GLTF_FLOAT: memcpy(&v, b, sizeof(float)); break;
+            case GLTF_UNSIGNED_BYTE: v = accessor.normalized ? *b / 255.0f : *b; break;
+            case GLTF_BYTE: v = accessor.normalized ? glm::max(*(const int8_t*)b / 127.0f, -1.0f) : *(const int8_t*)b; break;
+            case GLTF_UNSIGNED_SHORT: { uint16_t s; memcpy(&s, b, 2); v = accessor.normalized ? s / 65535.0f : s; break; }
+            case GLTF_SHORT: { int16_t s; memcpy(&s, b, 2); v = accessor.normalized ? glm::max(s / 32767.0f, -1.0f) : s; break; }
+            default: return false;
+            }
+            out[(size_t)i * accessor.components + c] = v;
+        }
+    }
+    return true;
+}
+
+// count vertex indices into out, 32 bit ones straight from the file
+static bool readIndices(const GLTFAsset& asset, int accessor_ID, unsigned int* out) {
+    const GLTFAccessor& accessor = asset.accessors[accessor_ID];
+    size_t offset, stride, span;
+    if (accessor.components != 1 || !accessorLayout(asset, accessor, offset, stride, span)) {
+        return false;
+    }
+    const GLTFBuffer& buffer = asset.buffers[asset.buffer_views[accessor.buffer_view].buffer];
+    if (accessor.component_type == GLTF_UNSIGNED_INT && stride == 4) {
+        return readBuffer(buffer, offset, span, out);
+    }
+
+    std::vector<unsigned char> bytes(span);
+    if (!readBuffer(buffer, offset, span, bytes.data())) {
+        return false;
+    }
+    for (int i = 0; i < accessor.count; ++i) {
+        const unsigned char* b = &bytes[i * stride];
+        if (accessor.component_type == GLTF_UNSIGNED_BYTE) {
+            out[i] = *b;
+        }
+        else if (accessor.component_type == GLTF_UNSIGNED_SHORT) {
+            uint16_t s;
+            memcpy(&s, b, 2);
+            out[i] = s;
+        }
+        else if (accessor.component_type == GLTF_UNSIGNED_INT) {
+            memcpy(&out[i], b, 4);
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool loadGLTFMesh(const GLTFAsset& asset, int mesh, int material, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals,
+    std::vector<glm::vec2>& uvs, std::vector<glm::ivec3>& indices, std::string& error) {
+    for (const GLTFPrimitive& primitive : asset.meshes[mesh]) {
+        if (primitive.material != material) {
+            continue;
+        }
+        const int num_vertices = asset.accessors[primitive.position].count;
+        const size_t base = positions.size();
+        positions.resize(base + num_vertices);
+        normals.resize(base + num_vertices, glm::vec3(0.0f));
+        uvs.resize(base + num_vertices, glm::vec2(0.0f));
+        bool ok = readFloats(asset, primitive.position, &positions[base].x);
+        if (ok && primitive.normal >= 0 && asset.accessors[primitive.normal].count == num_vertices) {
+            ok = readFloats(asset, primitive.normal, &normals[base].x);
+        }
+        if (ok && primitive.texcoord >= 0 && asset.accessors[primitive.texcoord].count == num_vertices) {
+            ok = readFloats(asset, primitive.texcoord, &uvs[base].x);
+        }
+
+        // the index buffer is read right into the tri array and offset in place, trailing
+        // indices that don't make a whole tri are dropped
+        const size_t first_tri = indices.size();
+        const int num_indices = primitive.indices >= 0 ? asset.accessors[primitive.indices].count : num_vertices;
+        std::vector<unsigned int> tail;
+        if (ok && primitive.indices >= 0) {
+            indices.resize(first_tri + num_indices / 3);
+            if (num_indices % 3 == 0) {
+                ok = readIndices(asset, primitive.indices, (unsigned int*)&indices[first_tri]);
+            }
+            else {
+                tail.resize(num_indices);
+                ok = readIndices(asset, primitive.indices, tail.data());
+                if (ok && !tail.empty()) {
+                    memcpy((void*)&indices[first_tri], tail.data(), (num_indices / 3) * sizeof(glm::ivec3));
+                }
+            }
+        }
+        else if (ok) {
+            for (int t = 0; t + 2 < num_vertices; t += 3) {
+                indices.push_back(glm::ivec3(t, t + 1, t + 2));
+            }
+        }
+        if (!ok) {
+            error = "can't read the buffers of mesh " + std::to_string(mesh) + " of " + asset.path;
+            return false;
+        }
+        for (size_t t = first_tri; t < indices.size(); ++t) {
+            if ((unsigned int)indices[t].x >= (unsigned int)num_vertices || (unsigned int)indices[t].y >= (unsigned int)num_vertices
+                || (unsigned int)indices[t].z >= (unsigned int)num_vertices) {
+                error = "mesh " + std::to_string(mesh) + " of " + asset.path + " has out of range indices";
+                return false;
+            }
+            indices[t] += glm::ivec3((int)base);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+// the parts of a glTF 2.0 asset (a .gltf and its buffers, or one .glb) a mesh OBJECT uses:
+// the triangle primitives of every mesh and the nodes that place them
+
+struct GLTFAccessor {
+    int buffer_view = -1;
+    size_t byte_offset = 0;
+    int component_type = 0; // GL enum, 5126 float, 5125 / 5123 / 5121 unsigned int / short / byte
+    bool normalized = false;
+    int count = 0;
+    int components = 1; // SCALAR 1, VEC2 2, VEC3 3
+    glm::vec3 min = glm::vec3(0.0f); // POSITION's, which the spec requires
+    glm::vec3 max = glm::vec3(0.0f);
+    bool has_bounds = false;
+    bool sparse = false; // sparse substitutions aren't applied, primitives using one are skipped
+};
+
+struct GLTFBufferView {
+    int buffer = 0;
+    size_t byte_offset = 0;
+    size_t byte_length = 0;
+    size_t byte_stride = 0; // 0 for tightly packed
+};
+
+// where a buffer's bytes are: a range of a file, or the decoded data of a data: uri
+struct GLTFBuffer {
+    std::string file;
+    size_t file_offset = 0; // the BIN chunk of a .glb
+    size_t byte_length = 0;
+    std::vector<unsigned char> data;
+};
+
+struct GLTFPrimitive {
+    int material = -1; // -1 for none
+    int position = -1; // accessor ids, -1 when missing
+    int normal = -1;
+    int texcoord = -1;
+    int indices = -1; // -1 for an unindexed primitive, whose vertices go in threes
+};
+
+struct GLTFInstance {
+    int mesh;
+    glm::mat4 transform; // node to asset space, with every parent node applied
+};
+
+struct GLTFAsset {
+    std::string path;
+    std::vector<GLTFAccessor> accessors;
+    std::vector<GLTFBufferView> buffer_views;
+    std::vector<GLTFBuffer> buffers;
+    std::vector<std::vector<GLTFPrimitive> > meshes; // triangle primitives only
+    std::vector<GLTFInstance> instances; // every node of the default scene that has a mesh
+    int skipped_primitives = 0; // points, lines, strips and sparse or unindexable ones
+};
+
+bool isGLTFPath(const std::string& path); // .gltf or .glb
+
+// reads the JSON of an asset, the first chunk of a .glb. the buffers are only located here,
+// loadGLTFMesh reads the parts it needs. false with error set if the asset can't be used
+bool loadGLTF(const std::string& path, GLTFAsset& asset, std::string& error);
+
+// the materials the primitives of mesh use, each once, -1 for primitives without one
+std::vector<int> gltfMeshMaterials(const GLTFAsset& asset, int mesh);
+
+// object space bounds of the primitives of mesh with material, from the POSITION min / max.
+// false if an accessor left them out
+bool gltfMeshBounds(const GLTFAsset& asset, int mesh, int material, glm::vec3& AABB_min, glm::vec3& AABB_max);
+
+// the primitives of mesh with material merged into one indexed mesh. tightly packed float
+// attributes and 32 bit indices are read straight from the file into the output arrays,
+// anything else is converted per element. missing normals and uvs are left zero
+bool loadGLTFMesh(const GLTFAsset& asset, int mesh, int material, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals,
+    std::vector<glm::vec2>& uvs, std::vector<glm::ivec3>& indices, std::string& error);
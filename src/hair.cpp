@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "hair.h"
+#include "utilities.h"
+
+// header bits saying which arrays follow it, in this order
+#define HAIR_SEGMENTS_BIT 1
+#define HAIR_POINTS_BIT 2
+#define HAIR_THICKNESS_BIT 4
+#define HAIR_TRANSPARENCY_BIT 8
+#define HAIR_COLORS_BIT 16
+
+// the 128 byte header, little endian like the arrays after it
+struct HairHeader {
+    char signature[4]; // "HAIR"
+    unsigned int hair_count;
+    unsigned int point_count;
+    unsigned int arrays;
+    unsigned int default_segments; // per strand, without a segments array
+    float default_thickness;
+    float default_transparency;
+    float default_color[3];
+    char info[88];
+};
+
+bool isHairPath(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string ext = path.substr(dot + 1);
+    for (char& c : ext) {
+        c = (char)tolower(c);
+    }
+    return ext == "hair";
+}
+
+bool loadHair(const std::string& path, std::vector<glm::vec4>& points, std::vector<int>& strand_points, std::string& error) {
+    utilityCore::MappedFile file;
+    if (!file.open(path)) {
+        error = "Cannot open file [" + path + "]";
+        return false;
+    }
+    HairHeader header;
+    if (file.size() < sizeof(HairHeader) || memcmp(file.data(), "HAIR", 4) != 0) {
+        error = path + " is not a .hair file";
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(HairHeader));
+    if (!(header.arrays & HAIR_POINTS_BIT)) {
+        error = path + " has no points";
+        return false;
+    }
+
+    // the arrays' sizes before anything is read, so a truncated file is caught up front
+    const size_t segments_bytes = header.arrays & HAIR_SEGMENTS_BIT ? header.hair_count * sizeof(unsigned short) : 0;
+    const size_t points_bytes = header.point_count * 3 * sizeof(float);
+    const size_t thickness_bytes = header.arrays & HAIR_THICKNESS_BIT ? header.point_count * sizeof(float) : 0;
+    if (file.size() < sizeof(HairHeader) + segments_bytes + points_bytes + thickness_bytes) {
+        error = path + " is truncated";
+        return false;
+    }
+    const unsigned char* segments = file.data() + sizeof(HairHeader);
+    const unsigned char* positions = segments + segments_bytes;
+    const unsigned char* thickness = positions + points_bytes;
+
+    strand_points.resize(header.hair_count);
+    size_t total = 0;
+    for (unsigned int h = 0; h < header.hair_count; h++) {
+        unsigned short count = (unsigned short)header.default_segments;
+        if (segments_bytes > 0) {
+            memcpy(&count, segments + h * sizeof(unsigned short), sizeof(unsigned short));
+        }
+        strand_points[h] = count + 1;
+        total += count + 1;
+    }
+    if (total != header.point_count) {
+        error = path + " has " + std::to_string(header.point_count) + " points but its strands take " + std::to_string(total);
+        return false;
+    }
+
+    points.resize(header.point_count);
+    utilityCore::parallelFor((header.point_count + 65535) / 65536, [&](int block) {
+        const size_t end = std::min((size_t)(block + 1) * 65536, (size_t)header.point_count);
+        for (size_t i = (size_t)block * 65536; i < end; i++) {
+            float p[3];
+            float t = header.default_thickness;
+            memcpy(p, positions + 3 * i * sizeof(float), sizeof(p));
+            if (thickness_bytes > 0) {
+                memcpy(&t, thickness + i * sizeof(float), sizeof(float));
+            }
+            points[i] = glm::vec4(p[0], p[1], p[2], 0.5f * t);
+        }
+    });
+    return true;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+// Cem Yuksel's binary .hair files, as groom tools and the public hair model sets write them. a
+// strand is a polyline of points, each with a thickness
+
+bool isHairPath(const std::string& path); // .hair
+
+// every strand of path as its points (xyz and radius, half the file's thickness) and the number
+// of points each strand has, in file order. files without thickness take their default one.
+// false with error set if the file can't be used
+bool loadHair(const std::string& path, std::vector<glm::vec4>& points, std::vector<int>& strand_points, std::string& error);
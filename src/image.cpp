@@ -1,44 +1,78 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <stb_image_write.h>
 
 #include "image.h"
 
-image::image(int x, int y) :
+image::image(int x, int y, bool ldr) :
         xSize(x),
         ySize(y),
-        pixels(new glm::vec3[x * y]) {
+        pixels(ldr ? NULL : new glm::vec3[x * y]),
+        bytes(ldr ? new unsigned char[3 * x * y] : NULL) {
 }
 
 image::~image() {
-    delete pixels;
+    delete[] pixels;
+    delete[] bytes;
 }
 
 void image::setPixel(int x, int y, const glm::vec3 &pixel) {
-    assert(x >= 0 && y >= 0 && x < xSize && y < ySize);
+    assert(x >= 0 && y >= 0 && x < xSize && y < ySize && pixels != NULL);
     pixels[(y * xSize) + x] = pixel;
 }
 
+void image::setPixel(int x, int y, unsigned char r, unsigned char g, unsigned char b) {
+    assert(x >= 0 && y >= 0 && x < xSize && y < ySize && bytes != NULL);
+    int i = y * xSize + x;
+    bytes[3 * i + 0] = r;
+    bytes[3 * i + 1] = g;
+    bytes[3 * i + 2] = b;
+}
+
+image* image::crop(int x, int y, int width, int height) const {
+    image* region = new image(width, height, pixels == NULL);
+    for (int row = 0; row < height; row++) {
+        const int from = (y + row) * xSize + x;
+        if (pixels != NULL) {
+            std::copy(pixels + from, pixels + from + width, region->pixels + row * width);
+        }
+        else {
+            std::copy(bytes + 3 * from, bytes + 3 * (from + width), region->bytes + 3 * row * width);
+        }
+    }
+    return region;
+}
+
 void image::savePNG(const std::string &baseFilename) {
-    unsigned char *bytes = new unsigned char[3 * xSize * ySize];
-    for (int y = 0; y < ySize; y++) {
-        for (int x = 0; x < xSize; x++) { 
-            int i = y * xSize + x;
-            glm::vec3 pix = glm::clamp(pixels[i], glm::vec3(), glm::vec3(1)) * 255.f;
-            bytes[3 * i + 0] = (unsigned char) pix.x;
-            bytes[3 * i + 1] = (unsigned char) pix.y;
-            bytes[3 * i + 2] = (unsigned char) pix.z;
+    unsigned char *out = bytes;
+    if (out == NULL) {
+        out = new unsigned char[3 * xSize * ySize];
+        for (int y = 0; y < ySize; y++) {
+            for (int x = 0; x < xSize; x++) {
+                int i = y * xSize + x;
+                glm::vec3 pix = glm::clamp(pixels[i], glm::vec3(), glm::vec3(1)) * 255.f;
+                out[3 * i + 0] = (unsigned char) pix.x;
+                out[3 * i + 1] = (unsigned char) pix.y;
+                out[3 * i + 2] = (unsigned char) pix.z;
+            }
         }
     }
 
     std::string filename = baseFilename + ".png";
-    stbi_write_png(filename.c_str(), xSize, ySize, 3, bytes, xSize * 3);
+    stbi_write_png(filename.c_str(), xSize, ySize, 3, out, xSize * 3);
     std::cout << "Saved " << filename << "." << std::endl;
 
-    delete[] bytes;
+    if (out != bytes) {
+        delete[] out;
+    }
 }
 
 void image::saveHDR(const std::string &baseFilename) {
+    if (pixels == NULL) {
+        std::cout << "ERROR: " << baseFilename << ".hdr needs the float image, it was read back quantized" << std::endl;
+        return;
+    }
     std::string filename = baseFilename + ".hdr";
     stbi_write_hdr(filename.c_str(), xSize, ySize, 3, (const float *) pixels);
     std::cout << "Saved " + filename + "." << std::endl;
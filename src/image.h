@@ -8,12 +8,16 @@ class image {
 private:
     int xSize;
     int ySize;
-    glm::vec3 *pixels;
+    glm::vec3 *pixels; // NULL for ldr images
+    unsigned char *bytes; // 8 bit rgb of ldr images, NULL otherwise
 
 public:
-    image(int x, int y);
+    // ldr images only hold already quantized colors (setPixel of bytes) and can only be saved as png
+    image(int x, int y, bool ldr = false);
     ~image();
     void setPixel(int x, int y, const glm::vec3 &pixel);
+    void setPixel(int x, int y, unsigned char r, unsigned char g, unsigned char b);
+    image* crop(int x, int y, int width, int height) const; // a copy of that region, ldr if this is, owned by the caller
     void savePNG(const std::string &baseFilename);
     void saveHDR(const std::string &baseFilename);
 };
@@ -1,7 +1,6 @@
 #pragma once
 
 #include "intersections.h"
-#include <thrust/random.h>
 
 
 //#define USE_SCHLICK_APPROX
@@ -11,13 +10,14 @@
  * Computes a cosine-weighted random direction in a hemisphere.
  * Used for diffuse lighting.
  */
-__host__ __device__
+__host__ __device__ inline
 glm::vec3 calculateRandomDirectionInHemisphere(
-        glm::vec3 normal, thrust::default_random_engine &rng, thrust::uniform_real_distribution<float>& u01) {
+        glm::vec3 normal, Sampler& rng) {
 
-    float up = sqrt(u01(rng)); // cos(theta)
+    glm::vec2 u = rng.next2D();
+    float up = sqrt(u.x); // cos(theta)
     float over = sqrt(1 - up * up); // sin(theta)
-    float around = u01(rng) * TWO_PI;
+    float around = u.y * TWO_PI;
 
     // Find a direction that is not the normal based off of whether or not the
     // normal's components are all equal to sqrt(1/3) or whether or not at
@@ -49,7 +49,7 @@ glm::vec3 calculateRandomDirectionInHemisphere(
 // and https://en.wikipedia.org/wiki/Schlick%27s_approximation
 // and https://en.wikipedia.org/wiki/Fresnel_equations
 
-__host__ __device__ glm::vec3 fresnelDielectric(float cos_theta_i, float etaT) {
+__host__ __device__ inline glm::vec3 fresnelDielectric(float cos_theta_i, float etaT) {
     
     // assume scene medium is air
     float etaI = 1.0f;
@@ -101,27 +101,100 @@ __host__ __device__ glm::vec3 fresnelDielectric(float cos_theta_i, float etaT) {
 #endif
 }
 
-__host__ __device__
-void scatterRay(
-        PathSegment& r,
+// GGX microfacet reflection, sampled by its distribution of visible normals following Heitz,
+// "Sampling the GGX Distribution of Visible Normals" (JCGT 2018). alpha is roughness squared, R
+// is the color at normal incidence for Schlick's Fresnel. n is flipped to the side wo is on
+
+__host__ __device__ inline float microfacetAlpha(const Material& m) {
+    return glm::max(m.roughness * m.roughness, 1e-3f);
+}
+
+__host__ __device__ inline float ggxD(float cos_h, float alpha) {
+    float a2 = alpha * alpha;
+    float d = cos_h * cos_h * (a2 - 1.0f) + 1.0f;
+    return a2 / (PI * d * d);
+}
+
+// smith masking of a direction cos_theta from the normal
+__host__ __device__ inline float ggxG1(float cos_theta, float alpha) {
+    float a2 = alpha * alpha;
+    return 2.0f * cos_theta / (cos_theta + sqrtf(a2 + (1.0f - a2) * cos_theta * cos_theta));
+}
+
+// f for light arriving along wi and leaving along wo, and pdf the pdf sampleMicrofacet has of wi
+__host__ __device__ inline glm::vec3 microfacetEval(const Material& m, glm::vec3 n, glm::vec3 wo, glm::vec3 wi, float& pdf) {
+    pdf = 0.0f;
+    if (glm::dot(n, wo) < 0.0f) {
+        n = -n;
+    }
+    float cos_o = glm::dot(n, wo);
+    float cos_i = glm::dot(n, wi);
+    if (cos_o <= 0.0f || cos_i <= 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    glm::vec3 h = glm::normalize(wo + wi);
+    float alpha = microfacetAlpha(m);
+    float D = ggxD(glm::dot(n, h), alpha);
+    float G1_o = ggxG1(cos_o, alpha);
+    glm::vec3 F = m.R + (glm::vec3(1.0f) - m.R) * powf(1.0f - glm::clamp(glm::dot(wo, h), 0.0f, 1.0f), 5.0f);
+    // visible normal pdf G1(wo) max(0, wo.h) D / cos_o through the reflection's jacobian 1 / (4 wo.h)
+    pdf = G1_o * D / (4.0f * cos_o);
+    return F * D * G1_o * ggxG1(cos_i, alpha) / (4.0f * cos_o * cos_i);
+}
+
+// wi reflected about a half vector drawn from the normals visible from wo, f and pdf as microfacetEval
+__host__ __device__ inline glm::vec3 sampleMicrofacet(const Material& m, glm::vec3 n, glm::vec3 wo, glm::vec2 u,
+        glm::vec3& wi, float& pdf) {
+    glm::vec3 ns = glm::dot(n, wo) < 0.0f ? -n : n;
+    glm::vec3 t = glm::normalize(glm::cross(glm::abs(ns.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), ns));
+    glm::vec3 b = glm::cross(ns, t);
+    float alpha = microfacetAlpha(m);
+
+    // wo stretched to the hemisphere configuration, where visible normals are a projected disc
+    glm::vec3 v = glm::normalize(glm::vec3(alpha * glm::dot(wo, t), alpha * glm::dot(wo, b), glm::max(glm::dot(wo, ns), 0.0f)));
+    float lensq = v.x * v.x + v.y * v.y;
+    glm::vec3 t1 = lensq > 0.0f ? glm::vec3(-v.y, v.x, 0.0f) / sqrtf(lensq) : glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 t2 = glm::cross(v, t1);
+    float r = sqrtf(u.x);
+    float phi = TWO_PI * u.y;
+    float p1 = r * cosf(phi);
+    float p2 = r * sinf(phi);
+    float s = 0.5f * (1.0f + v.z);
+    p2 = (1.0f - s) * sqrtf(glm::max(1.0f - p1 * p1, 0.0f)) + s * p2;
+    glm::vec3 nh = p1 * t1 + p2 * t2 + sqrtf(glm::max(1.0f - p1 * p1 - p2 * p2, 0.0f)) * v;
+    glm::vec3 h = glm::normalize(glm::vec3(alpha * nh.x, alpha * nh.y, glm::max(nh.z, 0.0f)));
+
+    wi = glm::reflect(-wo, h.x * t + h.y * b + h.z * ns);
+    return microfacetEval(m, n, wo, wi, pdf);
+}
+
+/**
+ * scatterRay with the BSDF fixed at compile time, type >= 0 folds every branch below down to
+ * that one for the per type shading kernels. -1 branches on m.type.
+ */
+template<int type>
+__host__ __device__ inline
+void scatterRayAs(
+        glm::vec3& origin,
+        glm::vec3& direction,
+        glm::vec3& throughput,
         glm::vec3 intersect,
         glm::vec3 normal,
         const Material &m,
-        thrust::default_random_engine &rng) {
+        Sampler &rng) {
 
+    const int bsdf = type >= 0 ? type : m.type;
     glm::vec3 wi = glm::vec3(0.0f);
     glm::vec3 f = glm::vec3(0.0f);
     float pdf = 0.0f;
     float absDot = 0.0f;
 
-    thrust::uniform_real_distribution<float> u01(0, 1);
-
     // Physically based BSDF sampling influenced by PBRT
     // https://www.pbr-book.org/3ed-2018/Reflection_Models/Specular_Reflection_and_Transmission
     // https://www.pbr-book.org/3ed-2018/Reflection_Models/Lambertian_Reflection
 
-    if (m.type == SPEC_BRDF) {
-        wi = glm::reflect(r.ray.direction, normal);
+    if (bsdf == SPEC_BRDF) {
+        wi = glm::reflect(direction, normal);
         absDot = glm::abs(glm::dot(normal, wi));
         pdf = 1.0f;
         if (absDot >= -0.0001f && absDot <= -0.0001f) {
@@ -131,17 +204,17 @@ void scatterRay(
             f = m.R / absDot;
         }
     }
-    else if (m.type == SPEC_BTDF) {
+    else if (bsdf == SPEC_BTDF) {
         // spec refl
         float eta = m.ior;
-        if (glm::dot(normal, r.ray.direction) < 0.0001f) {
+        if (glm::dot(normal, direction) < 0.0001f) {
             // outside
             eta = 1.0f / eta;
-            wi = glm::refract(r.ray.direction, normal, eta);
+            wi = glm::refract(direction, normal, eta);
         }
         else {
             // inside
-            wi = glm::refract(r.ray.direction, -normal, eta);
+            wi = glm::refract(direction, -normal, eta);
         }
         absDot = glm::abs(glm::dot(normal, wi));
         pdf = 1.0f;
@@ -156,12 +229,12 @@ void scatterRay(
             f = m.T / absDot;
         }
     }
-    else if (m.type == SPEC_GLASS) {
+    else if (bsdf == SPEC_GLASS) {
         // spec glass
         float eta = m.ior;
-        if (u01(rng) < 0.5f) {
+        if (rng.next() < 0.5f) {
             // spec refl
-            wi = glm::reflect(r.ray.direction, normal);
+            wi = glm::reflect(direction, normal);
             absDot = glm::abs(glm::dot(normal, wi));
             pdf = 1.0f;
             if (absDot == 0.0f) {
@@ -170,18 +243,18 @@ void scatterRay(
             else {
                 f = m.R / absDot;
             }
-            f *= fresnelDielectric(glm::dot(normal, r.ray.direction), m.ior);
+            f *= fresnelDielectric(glm::dot(normal, direction), m.ior);
         }
         else {
             // spec refr
-            if (glm::dot(normal, r.ray.direction) < 0.0f) {
+            if (glm::dot(normal, direction) < 0.0f) {
                 // outside
                 eta = 1.0f / eta;
-                wi = glm::refract(r.ray.direction, normal, eta);
+                wi = glm::refract(direction, normal, eta);
             }
             else {
                 // inside
-                wi = glm::refract(r.ray.direction, -normal, eta);
+                wi = glm::refract(direction, -normal, eta);
             }
             absDot = glm::abs(glm::dot(normal, wi));
             pdf = 1.0f;
@@ -195,23 +268,23 @@ void scatterRay(
             else {
                 f = m.T / absDot;
             }
-            f *= glm::vec3(1.0f) - fresnelDielectric(glm::dot(normal, r.ray.direction), m.ior);
+            f *= glm::vec3(1.0f) - fresnelDielectric(glm::dot(normal, direction), m.ior);
         }
         f *= 2.0f;
     }
-    else if (m.type == SPEC_PLASTIC) {
+    else if (bsdf == SPEC_PLASTIC) {
         // spec plastic
-        if (u01(rng) < 0.5f) {
+        if (rng.next() < 0.5f) {
             // diffuse
-            wi = glm::normalize(calculateRandomDirectionInHemisphere(normal, rng, u01));
+            wi = glm::normalize(calculateRandomDirectionInHemisphere(normal, rng));
             absDot = glm::abs(glm::dot(normal, wi));
             pdf = absDot * 0.31831f;
             f = m.R * 0.31831f;
-            f *= glm::vec3(1.0f) - fresnelDielectric(glm::dot(normal, r.ray.direction), m.ior);
+            f *= glm::vec3(1.0f) - fresnelDielectric(glm::dot(normal, direction), m.ior);
         }
         else {
             // spec refl
-            wi = glm::reflect(r.ray.direction, normal);
+            wi = glm::reflect(direction, normal);
             absDot = glm::abs(glm::dot(normal, wi));
             pdf = 1.0f;
             if (absDot == 0.0f) {
@@ -220,26 +293,76 @@ void scatterRay(
             else {
                 f = m.T / absDot;
             }
-            f *= fresnelDielectric(glm::dot(normal, r.ray.direction), m.ior);
+            f *= fresnelDielectric(glm::dot(normal, direction), m.ior);
         }
         f *= 2.0f;
     }
-    else if (m.type == MIRCROFACET_BRDF) {
-       
+    else if (bsdf == MIRCROFACET_BRDF) {
+        f = sampleMicrofacet(m, normal, -direction, rng.next2D(), wi, pdf);
+        absDot = glm::abs(glm::dot(normal, wi));
     }
     else {
         // diffuse
-        wi = glm::normalize(calculateRandomDirectionInHemisphere(normal, rng, u01));
+        wi = glm::normalize(calculateRandomDirectionInHemisphere(normal, rng));
         absDot = glm::abs(glm::dot(normal, wi));
         pdf = absDot * 0.31831f;
         f = m.R * 0.31831f;
     }
 
-    r.rayThroughput *=  f * absDot / pdf;
+    // a microfacet sample can reflect below the surface, nothing comes back along it
+    throughput *= pdf > 0.0f ? f * absDot / pdf : glm::vec3(0.0f);
 
     // Change ray direction
-    r.ray.direction = wi;
-    r.ray.direction_inv = glm::vec3(1.0f / wi.x, 1.0f / wi.y, 1.0f / wi.z);
-    r.ray.origin = intersect + (wi * 0.001f);
+    direction = wi;
+    origin = intersect + (wi * 0.001f);
 }
 
+__host__ __device__ inline
+void scatterRay(
+        glm::vec3& origin,
+        glm::vec3& direction,
+        glm::vec3& throughput,
+        glm::vec3 intersect,
+        glm::vec3 normal,
+        const Material &m,
+        Sampler &rng) {
+    scatterRayAs<-1>(origin, direction, throughput, intersect, normal, m, rng);
+}
+
+// offset from the pixel center distributed like the pixel filter, so every sample keeps weight
+// one and the accumulated image is already the filtered one without splatting into neighbours
+__host__ __device__ inline glm::vec2 sampleFilter(FilterType filter, float radius, glm::vec2 u) {
+    glm::vec2 t = 2.0f * u - 1.0f;
+    if (filter == FILTER_TENT) {
+        // inverse cdf of the triangle on [-1, 1] per axis
+        return radius * glm::vec2(
+            t.x < 0.0f ? sqrtf(1.0f + t.x) - 1.0f : 1.0f - sqrtf(1.0f - t.x),
+            t.y < 0.0f ? sqrtf(1.0f + t.y) - 1.0f : 1.0f - sqrtf(1.0f - t.y));
+    }
+    if (filter == FILTER_GAUSSIAN) {
+        // radial gaussian with sigma = radius / 3 truncated at radius, inverse cdf of the rayleigh
+        float r = radius / 3.0f * sqrtf(-2.0f * logf(1.0f - u.x * (1.0f - expf(-4.5f))));
+        float phi = TWO_PI * u.y;
+        return r * glm::vec2(cosf(phi), sinf(phi));
+    }
+    return radius * t;
+}
+
+// point on the lens disc in camera space
+// based on https://www.semanticscholar.org/paper/A-Low-Distortion-Map-Between-Disk-and-Square-Shirley-Chiu/43226a3916a85025acbb3a58c17f6dc0756b35ac?p2df
+__host__ __device__ inline glm::vec3 sampleLens(float lens_radius, glm::vec2 u) {
+    glm::vec2 sampleRemap = 2.0f * u - glm::vec2(1.0f);
+    if (sampleRemap.x == 0.0f && sampleRemap.y == 0.0f) {
+        return glm::vec3(0.0f);
+    }
+    float r, theta = 0.0f;
+    if (glm::abs(sampleRemap.x) > glm::abs(sampleRemap.y)) {
+        r = sampleRemap.x;
+        theta = (PI / 4.0f) * (sampleRemap.y / sampleRemap.x);
+    }
+    else {
+        r = sampleRemap.y;
+        theta = (PI / 2.0f) - (PI / 4.0f) * (sampleRemap.x / sampleRemap.y);
+    }
+    return lens_radius * r * glm::vec3(glm::cos(theta), glm::sin(theta), 0.0f);
+}
@@ -22,34 +22,148 @@ __host__ __device__ inline unsigned int utilhash(unsigned int a) {
     return a;
 }
 
+// streams of the counter based generator below, so kernels working on the same path bounce
+// don't draw the same numbers
+enum RandomStream {
+    STREAM_LIGHT = 0, // light choice and light / bsdf samples for MIS
+    STREAM_SCATTER = 1, // bsdf sample of the continuing path
+    STREAM_ROULETTE = 2,
+    STREAM_CAMERA = 3, // pixel jitter and thin lens sample
+    STREAM_PHOTON = 4, // CAUSTIC_PHOTONS emission and bounces, keyed by photon rather than pixel
+    STREAM_LIGHT_PATH = 5, // BDPT light subpaths, keyed by subpath
+    STREAM_MEDIUM = 6, // VOLUME delta tracking of the path's own ray
+    STREAM_TRANSMITTANCE = 7, // VOLUME ratio tracking of its light rays
+    STREAM_TIME = 8, // shutter time of a camera path, every ray of the path is traced at it
+};
+
+// pcg4d from "Hash Functions for GPU Rendering" (Jarzynski & Olano), four 32 bit outputs per call
+__host__ __device__ inline glm::uvec4 pcg4d(glm::uvec4 v) {
+    v = v * 1664525u + 1013904223u;
+    v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+    v ^= v >> 16u;
+    v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+    return v;
+}
+
+__host__ __device__ inline unsigned int reverseBits(unsigned int x) {
+#ifdef __CUDA_ARCH__
+    return __brev(x);
+#else
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+#endif
+}
+
+// hash based owen scrambling of a 32 bit fixed point value, every seed is another random
+// permutation that keeps the sequence stratified (Burley, "Practical Hash-based Owen Scrambling")
+__host__ __device__ inline unsigned int owenScramble(unsigned int x, unsigned int seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// point index of the first two sobol dimensions, 32 bit fixed point
+__host__ __device__ inline glm::uvec2 sobol2D(unsigned int index) {
+    glm::uvec2 p(reverseBits(index), 0u);
+    for (unsigned int v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            p.y ^= v;
+        }
+    }
+    return p;
+}
+
+/**
+ * Stateless counter based random numbers. A sample is the hash of (pixel, iteration, bounce,
+ * dimension), so there's no engine state to seed or keep in registers and the same key always
+ * gives the same sequence, whichever tile, device or render range it ends up in.
+ *
+ * SAMPLER_SOBOL draws dimensions in pairs from a padded, owen scrambled 2D sobol sequence
+ * indexed by the iteration. The scramble seeds hash the pixel, bounce and dimension but
+ * not the iteration, so each pixel's iterations stay stratified against each other and the
+ * pairs are decorrelated from one another.
+ */
+struct Sampler {
+    glm::uvec4 key; // pixel, iteration, bounce, next block of dimensions
+    glm::uvec4 bits; // unused outputs of the last block
+    int left;
+    bool sobol;
+
+    __host__ __device__ Sampler(int pixel, int iter, int bounce, RandomStream stream, SamplerType type)
+        : key((unsigned int)pixel, (unsigned int)iter, (unsigned int)bounce, (unsigned int)stream << 24), left(0),
+        sobol(type == SAMPLER_SOBOL) {}
+
+    // uniform in [0, 1)
+    __host__ __device__ float next() {
+        if (left == 0) {
+            if (sobol) {
+                glm::uvec4 seeds = pcg4d(glm::uvec4(key.x, 0u, key.z, key.w));
+                glm::uvec2 p = sobol2D(owenScramble(key.y - 1u, seeds.x)); // iterations count from 1
+                bits = glm::uvec4(owenScramble(p.x, seeds.y), owenScramble(p.y, seeds.z), 0u, 0u);
+                left = 2;
+            }
+            else {
+                bits = pcg4d(key);
+                left = 4;
+            }
+            key.w++;
+        }
+        unsigned int u = bits.x;
+        bits = glm::uvec4(bits.y, bits.z, bits.w, bits.x);
+        left--;
+        return (float)(u >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // two dimensions of one sample (a pixel position, a point on a light), from the same sobol pair
+    __host__ __device__ glm::vec2 next2D() {
+        if (sobol && left == 1) {
+            left = 0;
+        }
+        float u = next();
+        float v = next();
+        return glm::vec2(u, v);
+    }
+};
+
 // CHECKITOUT
 /**
  * Compute a point at parameter value `t` on ray `r`.
  * Falls slightly short so that it doesn't intersect the object it's hitting.
  */
-__host__ __device__ glm::vec3 getPointOnRay(Ray r, float t) {
+__host__ __device__ inline glm::vec3 getPointOnRay(Ray r, float t) {
     return r.origin + t * glm::normalize(r.direction);
 }
 
 /**
  * Multiplies a mat4 and a vec4 and returns a vec3 clipped from the vec4.
  */
-__host__ __device__ glm::vec3 multiplyMV(glm::mat4 m, glm::vec4 v) {
+__host__ __device__ inline glm::vec3 multiplyMV(glm::mat4 m, glm::vec4 v) {
     return glm::vec3(m * v);
 }
 
-__host__ __device__ float squareplaneIntersectionTest(Geom& squareplane, Ray& r, glm::vec3& normal) {
-    Ray q;
-    q.origin = multiplyMV(squareplane.inverseTransform, glm::vec4(r.origin, 1.0f));
-    q.direction = glm::normalize(multiplyMV(squareplane.inverseTransform, glm::vec4(r.direction, 0.0f)));
+// The analytic tests below take the ray already moved into object space by the 3x4 rows of
+// a GeomGPU, with the direction left unnormalized so t is the world space distance along the
+// original ray. The normal comes back in object space, only the closest hit gets transformed.
 
-    float t = glm::dot(glm::vec3(0.0f, 0.0f, 1.0f), (glm::vec3(0.5f, 0.5f, 0.0f) - q.origin)) / glm::dot(glm::vec3(0.0f, 0.0f, 1.0f), q.direction);
-    glm::vec3 objspaceIntersection = getPointOnRay(q, t);
+/**
+ * Test intersection between a ray and a transformed square plane. Untransformed, the plane
+ * covers -0.5 to 0.5 in x and y at z = 0 and faces +z.
+ */
+__host__ __device__ inline float squareplaneIntersectionTest(const glm::vec3& ro, const glm::vec3& rd, glm::vec3& normal) {
+    float t = -ro.z / rd.z;
+    glm::vec3 objspaceIntersection = ro + t * rd;
 
     if (t > 0.0001f && objspaceIntersection.x >= -0.5001f && objspaceIntersection.x <= 0.5001f && objspaceIntersection.y >= -0.5001f && objspaceIntersection.y <= 0.5001f) {
-        glm::vec3 intersectionPoint = multiplyMV(squareplane.transform, glm::vec4(objspaceIntersection, 1.0f));
-        normal = glm::normalize(multiplyMV(squareplane.invTranspose, glm::vec4(0.0f, 0.0f, 1.0f, 0.0f)));
-        return glm::length(r.origin - intersectionPoint);
+        normal = glm::vec3(0.0f, 0.0f, 1.0f);
+        return t;
     }
 
     return MAX_INTERSECT_DIST;
@@ -61,25 +175,19 @@ __host__ __device__ float squareplaneIntersectionTest(Geom& squareplane, Ray& r,
  * Test intersection between a ray and a transformed cube. Untransformed,
  * the cube ranges from -0.5 to 0.5 in each axis and is centered at the origin.
  *
- * @param intersectionPoint  Output parameter for point of intersection.
- * @param normal             Output parameter for surface normal.
- * @param outside            Output param for whether the ray came from outside.
- * @return                   Ray parameter `t` value. -1 if no intersection.
+ * @param normal             Output parameter for the object space surface normal.
+ * @return                   Ray parameter `t` value. MAX_INTERSECT_DIST if no intersection.
  */
-__host__ __device__ float boxIntersectionTest(Geom &box, Ray &r, glm::vec3 &normal) {
-    Ray q;
-    q.origin    =                multiplyMV(box.inverseTransform, glm::vec4(r.origin   , 1.0f));
-    q.direction = glm::normalize(multiplyMV(box.inverseTransform, glm::vec4(r.direction, 0.0f)));
-
+__host__ __device__ inline float boxIntersectionTest(const glm::vec3& ro, const glm::vec3& rd, glm::vec3 &normal) {
     float tmin = -1e38f;
     float tmax = 1e38f;
     glm::vec3 tmin_n;
     glm::vec3 tmax_n;
     for (int xyz = 0; xyz < 3; ++xyz) {
-        float qdxyz = q.direction[xyz];
+        float qdxyz = rd[xyz];
         /*if (glm::abs(qdxyz) > 0.00001f)*/ {
-            float t1 = (-0.5f - q.origin[xyz]) / qdxyz;
-            float t2 = (+0.5f - q.origin[xyz]) / qdxyz;
+            float t1 = (-0.5f - ro[xyz]) / qdxyz;
+            float t2 = (+0.5f - ro[xyz]) / qdxyz;
             float ta = glm::min(t1, t2);
             float tb = glm::max(t1, t2);
             glm::vec3 n;
@@ -100,43 +208,97 @@ __host__ __device__ float boxIntersectionTest(Geom &box, Ray &r, glm::vec3 &norm
             tmin = tmax;
             tmin_n = tmax_n;
         }
-        glm::vec3 intersectionPoint = multiplyMV(box.transform, glm::vec4(getPointOnRay(q, tmin), 1.0f));
-        normal = glm::normalize(multiplyMV(box.invTranspose, glm::vec4(tmin_n, 0.0f)));
-        return glm::length(r.origin - intersectionPoint);
+        normal = tmin_n;
+        return tmin;
     }
     return MAX_INTERSECT_DIST;
 }
 
+// a ray against one CURVES segment, the round cone that touches a sphere at each end. after
+// Quilez's rounded cone intersector: the cone's side between where it touches the spheres, then
+// the spheres themselves. rd is unit length here, unlike the unit shapes' rays. only hits from
+// outside in front of the origin count, strands being too thin to trace from inside.
+// MAX_INTERSECT_DIST if no intersection
+__host__ __device__ inline float curveSegmentIntersectionTest(const CurveSegment& segment, const glm::vec3& ro, const glm::vec3& rd, glm::vec3& normal) {
+    const float ra = segment.p0.w;
+    const float rb = segment.p1.w;
+    const glm::vec3 ba = glm::vec3(segment.p1) - glm::vec3(segment.p0);
+    const glm::vec3 oa = ro - glm::vec3(segment.p0);
+    const glm::vec3 ob = ro - glm::vec3(segment.p1);
+    const float rr = ra - rb;
+    const float m0 = glm::dot(ba, ba);
+    const float m1 = glm::dot(ba, oa);
+    const float m2 = glm::dot(ba, rd);
+    const float m3 = glm::dot(rd, oa);
+    const float m5 = glm::dot(oa, oa);
+    const float m6 = glm::dot(ob, rd);
+    const float m7 = glm::dot(ob, ob);
+
+    // one end sphere inside the other leaves no side, just the spheres
+    const float d2 = m0 - rr * rr;
+    if (d2 > 0.0f) {
+        const float k2 = d2 - m2 * m2;
+        const float k1 = d2 * m3 - m1 * m2 + m2 * rr * ra;
+        const float k0 = d2 * m5 - m1 * m1 + m1 * rr * ra * 2.0f - m0 * ra * ra;
+        const float h = k1 * k1 - k0 * k2;
+        if (h < 0.0f && k2 > 0.0f) {
+            // the spheres are inside the cone the ray misses. a ray steeper than the cone
+            // (k2 <= 0) always crosses it, h only rounds below 0 near its apex
+            return MAX_INTERSECT_DIST;
+        }
+        if (h >= 0.0f && k2 != 0.0f) {
+            const float t = (-sqrtf(h) - k1) / k2;
+            const float y = m1 - ra * rr + t * m2;
+            if (t > MIN_INTERSECT_DIST && y > 0.0f && y < d2) {
+                normal = glm::normalize(d2 * (oa + t * rd) - ba * y);
+                return t;
+            }
+        }
+    }
+
+    float t_hit = MAX_INTERSECT_DIST;
+    const float h1 = m3 * m3 - m5 + ra * ra;
+    if (h1 > 0.0f) {
+        const float t = -m3 - sqrtf(h1);
+        if (t > MIN_INTERSECT_DIST) {
+            t_hit = t;
+            normal = (oa + t * rd) / ra;
+        }
+    }
+    const float h2 = m6 * m6 - m7 + rb * rb;
+    if (h2 > 0.0f) {
+        const float t = -m6 - sqrtf(h2);
+        if (t > MIN_INTERSECT_DIST && t < t_hit) {
+            t_hit = t;
+            normal = (ob + t * rd) / rb;
+        }
+    }
+    return t_hit;
+}
+
 // CHECKITOUT
 /**
  * Test intersection between a ray and a transformed sphere. Untransformed,
  * the sphere always has radius 0.5 and is centered at the origin.
  *
- * @param intersectionPoint  Output parameter for point of intersection.
- * @param normal             Output parameter for surface normal.
- * @param outside            Output param for whether the ray came from outside.
- * @return                   Ray parameter `t` value. -1 if no intersection.
+ * @param normal             Output parameter for the object space surface normal.
+ * @return                   Ray parameter `t` value. MAX_INTERSECT_DIST if no intersection.
  */
-__host__ __device__ float sphereIntersectionTest(Geom &sphere, Ray &r, glm::vec3 &normal) {
+__host__ __device__ inline float sphereIntersectionTest(const glm::vec3& ro, const glm::vec3& rd, glm::vec3 &normal) {
     float radius = 0.5f;
 
-    glm::vec3 ro = multiplyMV(sphere.inverseTransform, glm::vec4(r.origin, 1.0f));
-    glm::vec3 rd = glm::normalize(multiplyMV(sphere.inverseTransform, glm::vec4(r.direction, 0.0f)));
-
-    Ray rt;
-    rt.origin = ro;
-    rt.direction = rd;
-
-    float vDotDirection = glm::dot(rt.origin, rt.direction);
-    float radicand = vDotDirection * vDotDirection - (glm::dot(rt.origin, rt.origin) - powf(radius, 2.0f));
+    // rd isn't unit length, so the quadratic keeps its a term
+    float a = glm::dot(rd, rd);
+    float vDotDirection = glm::dot(ro, rd);
+    float radicand = vDotDirection * vDotDirection - a * (glm::dot(ro, ro) - radius * radius);
     if (radicand < 0.0f) {
         return MAX_INTERSECT_DIST;
     }
 
     float squareRoot = sqrt(radicand);
     float firstTerm = -vDotDirection;
-    float t1 = firstTerm + squareRoot;
-    float t2 = firstTerm - squareRoot;
+    float t1 = (firstTerm + squareRoot) / a;
+    float t2 = (firstTerm - squareRoot) / a;
 
     float t = 0.0f;
     if (t1 < 0.0f && t2 < 0.0f) {
@@ -147,42 +309,6 @@ __host__ __device__ float sphereIntersectionTest(Geom &sphere, Ray &r, glm::vec3
         t = max(t1, t2);
     }
 
-    glm::vec3 objspaceIntersection = getPointOnRay(rt, t);
-
-    glm::vec3 intersectionPoint = multiplyMV(sphere.transform, glm::vec4(objspaceIntersection, 1.0f));
-    normal = glm::normalize(multiplyMV(sphere.invTranspose, glm::vec4(objspaceIntersection, 0.0f)));
-
-    return glm::length(r.origin - intersectionPoint);
-}
-
-
-// CHECKITOUT
-/**
- * Test intersection between a ray and a triangle.
- *
- * @param intersectionPoint  Output parameter for point of intersection.
- * @param normal             Output parameter for surface normal.
- * @param outside            Output param for whether the ray came from outside.
- * @return                   Ray parameter `t` value. -1 if no intersection.
- */
-__host__ __device__ float triIntersectionTest(Tri &tri, Ray &r, glm::vec3& normal) {
-    //glm::vec3 bary_coords;
-    //t = glm::intersectRayTriangle(pathSegment.ray.origin, pathSegment.ray.direction, tri.p0, tri.p1, tri.p2, bary_coords);
-        //1. Ray-plane intersection
-    float t = glm::dot(tri.plane_normal, (tri.p0 - r.origin)) / glm::dot(tri.plane_normal, r.direction);
-    if (t < 0.0f) return t;
-
-    glm::vec3 P = r.origin + t * r.direction;
-    //2. Barycentric test
-    float S = 0.5f * glm::length(glm::cross(tri.p0 - tri.p1, tri.p0 - tri.p2));
-    float s1 = 0.5f * glm::length(glm::cross(P - tri.p1, P - tri.p2)) / S;
-    float s2 = 0.5f * glm::length(glm::cross(P - tri.p2, P - tri.p0)) / S;
-    float s3 = 0.5f * glm::length(glm::cross(P - tri.p0, P - tri.p1)) / S;
-    float sum = s1 + s2 + s3;
-
-    if (s1 >= 0 && s1 <= 1 && s2 >= 0 && s2 <= 1 && s3 >= 0 && s3 <= 1 && sum == 1.0f) {
-        normal = tri.plane_normal;
-        return t;
-    }
-    return -1.0f;
+    normal = ro + t * rd;
+    return t;
 }
@@ -0,0 +1,345 @@
+#include <cmath>
+#include <cstdint>
+
+#include "jpeg.h"
+#include "utilities.h"
+
+// natural (row major) index of the k-th coefficient in zigzag order
+static const int ZIGZAG[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// the example tables of the standard's Annex K, row major
+static const int LUMA_QUANT[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99,
+};
+
+static const int CHROMA_QUANT[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+// Huffman tables as DHT stores them: how many codes of each length 1..16, then the symbols
+static const unsigned char DC_LUMA_BITS[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char DC_CHROMA_BITS[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char DC_VALUES[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const unsigned char AC_LUMA_BITS[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char AC_LUMA_VALUES[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+static const unsigned char AC_CHROMA_BITS[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char AC_CHROMA_VALUES[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+struct HuffmanCode {
+    uint16_t code = 0;
+    uint8_t length = 0;
+};
+
+// canonical codes by symbol, from the code counts per length
+static void buildCodes(const unsigned char* bits, const unsigned char* values, HuffmanCode* codes) {
+    int code = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; length++) {
+        for (int i = 0; i < bits[length - 1]; i++) {
+            codes[values[k]].code = (uint16_t)code;
+            codes[values[k]].length = (uint8_t)length;
+            code++;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+// MSB first, an 0xff byte is followed by a stuffed 0x00 so it can't read as a marker
+struct BitWriter {
+    std::vector<unsigned char> bytes;
+    uint32_t buffer = 0;
+    int count = 0;
+
+    void put(uint32_t bits, int length) {
+        buffer = (buffer << length) | (bits & ((1u << length) - 1));
+        count += length;
+        while (count >= 8) {
+            unsigned char byte = (unsigned char)(buffer >> (count - 8));
+            bytes.push_back(byte);
+            if (byte == 0xff) {
+                bytes.push_back(0);
+            }
+            count -= 8;
+        }
+    }
+
+    // the end of a restart interval, padded with 1 bits
+    void flush() {
+        if (count > 0) {
+            put(0x7f, 8 - count);
+        }
+    }
+};
+
+// category of v (its bit length) and the bits that go after its code, negative values as
+// v - 1 in that many bits
+static int category(int v) {
+    int a = v < 0 ? -v : v;
+    int bits = 0;
+    while (a > 0) {
+        bits++;
+        a >>= 1;
+    }
+    return bits;
+}
+
+struct JPEGTables {
+    float luma_scale[64]; // what the AAN DCT's outputs are multiplied by to quantize them, row major
+    float chroma_scale[64];
+    int luma_quant[64];
+    int chroma_quant[64];
+    HuffmanCode dc_luma[12], dc_chroma[12], ac_luma[256], ac_chroma[256];
+};
+
+// the scaled 8 point DCT of Arai, Agui and Nakajima, 5 multiplies. in place on the 8 values
+// stride apart, output k comes out
+// 8 aanScale(k) times too large for a quarter scaled DCT, which the quantizers take out
+static void aanDCT(float* d, int stride) {
+    float tmp0 = d[0] + d[7 * stride], tmp7 = d[0] - d[7 * stride];
+    float tmp1 = d[stride] + d[6 * stride], tmp6 = d[stride] - d[6 * stride];
+    float tmp2 = d[2 * stride] + d[5 * stride], tmp5 = d[2 * stride] - d[5 * stride];
+    float tmp3 = d[3 * stride] + d[4 * stride], tmp4 = d[3 * stride] - d[4 * stride];
+
+    // even part
+    float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+    d[0] = tmp10 + tmp11;
+    d[4 * stride] = tmp10 - tmp11;
+    float z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2 * stride] = tmp13 + z1;
+    d[6 * stride] = tmp13 - z1;
+
+    // odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    float z5 = (tmp10 - tmp12) * 0.382683433f;
+    float z2 = 0.541196100f * tmp10 + z5;
+    float z4 = 1.306562965f * tmp12 + z5;
+    float z3 = tmp11 * 0.707106781f;
+    float z11 = tmp7 + z3, z13 = tmp7 - z3;
+    d[5 * stride] = z13 + z2;
+    d[3 * stride] = z13 - z2;
+    d[stride] = z11 + z4;
+    d[7 * stride] = z11 - z4;
+}
+
+// 1 for k 0, sqrt(2) cos(k pi / 16) otherwise
+static float aanScale(int k) {
+    return k == 0 ? 1.0f : std::sqrt(2.0f) * std::cos(k * PI / 16.0f);
+}
+
+// the 2D DCT of block (level shifted samples, row major, overwritten) quantized, in zigzag order
+static void transformBlock(float* block, const float* scale, int* out) {
+    for (int y = 0; y < 8; y++) {
+        aanDCT(block + y * 8, 1);
+    }
+    for (int x = 0; x < 8; x++) {
+        aanDCT(block + x, 8);
+    }
+    for (int k = 0; k < 64; k++) {
+        // the largest the standard Huffman tables have categories for
+        const int limit = k == 0 ? 2047 : 1023;
+        out[k] = std::max(-limit, std::min(limit, (int)std::lround(block[ZIGZAG[k]] * scale[ZIGZAG[k]])));
+    }
+}
+
+static void encodeBlock(BitWriter& writer, const int* coefficients, int& dc_predictor, const HuffmanCode* dc, const HuffmanCode* ac) {
+    int diff = coefficients[0] - dc_predictor;
+    dc_predictor = coefficients[0];
+    int size = category(diff);
+    writer.put(dc[size].code, dc[size].length);
+    if (size > 0) {
+        writer.put(diff < 0 ? diff - 1 : diff, size);
+    }
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        int v = coefficients[k];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run >= 16) {
+            writer.put(ac[0xf0].code, ac[0xf0].length); // 16 zeros
+            run -= 16;
+        }
+        size = category(v);
+        int symbol = (run << 4) | size;
+        writer.put(ac[symbol].code, ac[symbol].length);
+        writer.put(v < 0 ? v - 1 : v, size);
+        run = 0;
+    }
+    if (run > 0) {
+        writer.put(ac[0x00].code, ac[0x00].length); // end of block
+    }
+}
+
+static void putMarker(std::vector<unsigned char>& out, unsigned char marker) {
+    out.push_back(0xff);
+    out.push_back(marker);
+}
+
+static void put16(std::vector<unsigned char>& out, int v) {
+    out.push_back((v >> 8) & 0xff);
+    out.push_back(v & 0xff);
+}
+
+static void putHuffmanTable(std::vector<unsigned char>& out, int id, const unsigned char* bits, const unsigned char* values, int num_values) {
+    out.push_back((unsigned char)id);
+    out.insert(out.end(), bits, bits + 16);
+    out.insert(out.end(), values, values + num_values);
+}
+
+void encodeJPEG(const unsigned char* rgb, int width, int height, int quality, std::vector<unsigned char>& out) {
+    JPEGTables tables;
+    // libjpeg's quality scaling
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    for (int i = 0; i < 64; i++) {
+        tables.luma_quant[i] = std::max(1, std::min(255, (LUMA_QUANT[i] * scale + 50) / 100));
+        tables.chroma_quant[i] = std::max(1, std::min(255, (CHROMA_QUANT[i] * scale + 50) / 100));
+        const float aan = 8.0f * aanScale(i / 8) * aanScale(i % 8);
+        tables.luma_scale[i] = 1.0f / (tables.luma_quant[i] * aan);
+        tables.chroma_scale[i] = 1.0f / (tables.chroma_quant[i] * aan);
+    }
+    buildCodes(DC_LUMA_BITS, DC_VALUES, tables.dc_luma);
+    buildCodes(DC_CHROMA_BITS, DC_VALUES, tables.dc_chroma);
+    buildCodes(AC_LUMA_BITS, AC_LUMA_VALUES, tables.ac_luma);
+    buildCodes(AC_CHROMA_BITS, AC_CHROMA_VALUES, tables.ac_chroma);
+
+    // one interleaved MCU of a Y, a Cb and a Cr block per 8x8 pixels, edges repeat the last pixel
+    const int mcus_x = (width + 7) / 8;
+    const int mcus_y = (height + 7) / 8;
+    std::vector<BitWriter> rows(mcus_y);
+    utilityCore::parallelFor(mcus_y, [&](int my) {
+        BitWriter& writer = rows[my];
+        int dc[3] = { 0, 0, 0 };
+        float blocks[3][64];
+        int coefficients[64];
+        for (int mx = 0; mx < mcus_x; mx++) {
+            for (int y = 0; y < 8; y++) {
+                for (int x = 0; x < 8; x++) {
+                    int px = std::min(mx * 8 + x, width - 1);
+                    int py = std::min(my * 8 + y, height - 1);
+                    const unsigned char* p = rgb + ((size_t)py * width + px) * 3;
+                    float r = p[0], g = p[1], b = p[2];
+                    blocks[0][y * 8 + x] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+                    blocks[1][y * 8 + x] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    blocks[2][y * 8 + x] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+            }
+            for (int c = 0; c < 3; c++) {
+                transformBlock(blocks[c], c == 0 ? tables.luma_scale : tables.chroma_scale, coefficients);
+                encodeBlock(writer, coefficients, dc[c], c == 0 ? tables.dc_luma : tables.dc_chroma, c == 0 ? tables.ac_luma : tables.ac_chroma);
+            }
+        }
+        writer.flush();
+    });
+
+    out.clear();
+    putMarker(out, 0xd8); // SOI
+    putMarker(out, 0xe0); // APP0, JFIF 1.1 with no density or thumbnail
+    put16(out, 16);
+    const unsigned char jfif[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    out.insert(out.end(), jfif, jfif + sizeof(jfif));
+
+    putMarker(out, 0xdb); // DQT, both tables in zigzag order
+    put16(out, 2 + 2 * 65);
+    out.push_back(0);
+    for (int k = 0; k < 64; k++) {
+        out.push_back((unsigned char)tables.luma_quant[ZIGZAG[k]]);
+    }
+    out.push_back(1);
+    for (int k = 0; k < 64; k++) {
+        out.push_back((unsigned char)tables.chroma_quant[ZIGZAG[k]]);
+    }
+
+    putMarker(out, 0xc0); // SOF0, 3 components without subsampling
+    put16(out, 8 + 3 * 3);
+    out.push_back(8);
+    put16(out, height);
+    put16(out, width);
+    out.push_back(3);
+    for (int c = 0; c < 3; c++) {
+        out.push_back((unsigned char)(c + 1));
+        out.push_back(0x11);
+        out.push_back(c == 0 ? 0 : 1);
+    }
+
+    putMarker(out, 0xc4); // DHT
+    put16(out, 2 + 4 * 17 + 12 + 12 + 162 + 162);
+    putHuffmanTable(out, 0x00, DC_LUMA_BITS, DC_VALUES, 12);
+    putHuffmanTable(out, 0x10, AC_LUMA_BITS, AC_LUMA_VALUES, 162);
+    putHuffmanTable(out, 0x01, DC_CHROMA_BITS, DC_VALUES, 12);
+    putHuffmanTable(out, 0x11, AC_CHROMA_BITS, AC_CHROMA_VALUES, 162);
+
+    putMarker(out, 0xdd); // DRI, a restart interval per row of MCUs
+    put16(out, 4);
+    put16(out, mcus_x);
+
+    putMarker(out, 0xda); // SOS
+    put16(out, 6 + 2 * 3);
+    out.push_back(3);
+    for (int c = 0; c < 3; c++) {
+        out.push_back((unsigned char)(c + 1));
+        out.push_back(c == 0 ? 0x00 : 0x11);
+    }
+    out.push_back(0);
+    out.push_back(63);
+    out.push_back(0);
+
+    for (int my = 0; my < mcus_y; my++) {
+        if (my > 0) {
+            putMarker(out, (unsigned char)(0xd0 + (my - 1) % 8)); // RSTn
+        }
+        out.insert(out.end(), rows[my].bytes.begin(), rows[my].bytes.end());
+    }
+    putMarker(out, 0xd9); // EOI
+}
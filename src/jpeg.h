@@ -0,0 +1,8 @@
+#pragma once
+
+#include <vector>
+
+// baseline JPEG of width * height 8 bit RGB pixels (rows top to bottom) with the standard
+// quantization and Huffman tables, quality 1 to 100 like libjpeg's. every row of 8x8 blocks is
+// a restart interval of its own, so the rows are transformed and entropy coded in parallel
+void encodeJPEG(const unsigned char* rgb, int width, int height, int quality, std::vector<unsigned char>& out);
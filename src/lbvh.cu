@@ -0,0 +1,277 @@
+#include <cfloat>
+#include <iostream>
+#include <thrust/execution_policy.h>
+#include <thrust/device_ptr.h>
+#include <thrust/sort.h>
+#include <thrust/transform_reduce.h>
+
+#include "lbvh.h"
+#include "glm/glm.hpp"
+
+#define LBVH_BLOCK_SIZE 128
+
+// hierarchy node before it gets flattened. internal nodes are [0, n - 1), leaf j is n - 1 + j
+struct LBVHNode {
+	glm::vec3 AABB_min;
+	glm::vec3 AABB_max;
+	int left;
+	int right;
+	int parent;
+	int size; // nodes in this subtree, used to find the depth first offsets
+	int axis;
+	int first; // internal nodes, the subtree's first leaf
+};
+
+struct CentroidOf {
+	__host__ __device__ glm::vec3 operator()(const TriBounds& b) const { return b.AABB_centroid; }
+};
+
+struct Vec3Min {
+	__host__ __device__ glm::vec3 operator()(const glm::vec3& a, const glm::vec3& b) const { return glm::min(a, b); }
+};
+
+struct Vec3Max {
+	__host__ __device__ glm::vec3 operator()(const glm::vec3& a, const glm::vec3& b) const { return glm::max(a, b); }
+};
+
+// length of the common prefix of keys i and j. a key is the morton code over the tri's index, so
+// every key is unique and tris sharing a code split down the middle of their run (Karras 2012,
+// section 4) instead of chaining
+__device__ int commonPrefix(const unsigned long long* keys, int n, int i, int j) {
+	if (j < 0 || j >= n) {
+		return -1;
+	}
+	return __clzll(keys[i] ^ keys[j]);
+}
+
+__global__ void computeTriBounds(int n, const glm::vec3* positions, const glm::ivec3* indices, TriBounds* bounds) {
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx < n) {
+		glm::ivec3 tri = indices[idx];
+		glm::vec3 p0 = positions[tri.x];
+		glm::vec3 p1 = positions[tri.y];
+		glm::vec3 p2 = positions[tri.z];
+		TriBounds b;
+		b.AABB_min = glm::min(glm::min(p0, p1), p2);
+		b.AABB_max = glm::max(glm::max(p0, p1), p2);
+		b.AABB_centroid = (p0 + p1 + p2) / 3.0f;
+		b.tri_ID = idx;
+		bounds[idx] = b;
+	}
+}
+
+__global__ void computeMortonCodes(int n, const TriBounds* bounds, glm::vec3 centroid_min, glm::vec3 centroid_extent_inv,
+	unsigned long long* keys, int* tri_IDs) {
+	int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx < n) {
+		unsigned int code = morton3D((bounds[idx].AABB_centroid - centroid_min) * centroid_extent_inv);
+		keys[idx] = ((unsigned long long)code << 32) | (unsigned int)idx;
+		tri_IDs[idx] = idx;
+	}
+}
+
+// one thread per internal node, finds the key range the node covers and where it splits
+__global__ void buildHierarchy(int n, const unsigned long long* codes, LBVHNode* nodes) {
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	if (i >= n - 1) {
+		return;
+	}
+
+	// direction of the range
+	int d = (commonPrefix(codes, n, i, i + 1) - commonPrefix(codes, n, i, i - 1)) >= 0 ? 1 : -1;
+
+	// upper bound for the range length, then binary search the other end
+	int prefix_min = commonPrefix(codes, n, i, i - d);
+	int l_max = 2;
+	while (commonPrefix(codes, n, i, i + l_max * d) > prefix_min) {
+		l_max *= 2;
+	}
+	int l = 0;
+	for (int t = l_max / 2; t >= 1; t /= 2) {
+		if (commonPrefix(codes, n, i, i + (l + t) * d) > prefix_min) {
+			l += t;
+		}
+	}
+	int j = i + l * d;
+
+	// binary search the split position
+	int prefix_node = commonPrefix(codes, n, i, j);
+	int s = 0;
+	int divisor = 2;
+	while (true) {
+		int t = (l + divisor - 1) / divisor;
+		if (commonPrefix(codes, n, i, i + (s + t) * d) > prefix_node) {
+			s += t;
+		}
+		if (t <= 1) {
+			break;
+		}
+		divisor *= 2;
+	}
+	int split = i + s * d + glm::min(d, 0);
+
+	int first = glm::min(i, j);
+	int last = glm::max(i, j);
+	int left = (first == split) ? (n - 1 + split) : split;
+	int right = (last == split + 1) ? (n - 1 + split + 1) : split + 1;
+
+	nodes[i].left = left;
+	nodes[i].right = right;
+	nodes[i].first = first;
+	nodes[left].parent = i;
+	nodes[right].parent = i;
+
+	// the highest differing morton bit tells which axis this node splits (x, y, z interleaved from the
+	// top), a run of one code only differs in the index below it
+	unsigned int diff = (unsigned int)((codes[first] ^ codes[last]) >> 32);
+	nodes[i].axis = diff == 0 ? 0 : 2 - ((31 - __clz(diff)) % 3);
+}
+
+// one thread per leaf, walks up and the second child to arrive at a node merges it
+__global__ void refitHierarchy(int n, const TriBounds* bounds, const int* tri_IDs, LBVHNode* nodes, int* visit_counts) {
+	int j = blockIdx.x * blockDim.x + threadIdx.x;
+	if (j >= n) {
+		return;
+	}
+
+	int leaf = n - 1 + j;
+	TriBounds b = bounds[tri_IDs[j]];
+	nodes[leaf].AABB_min = b.AABB_min;
+	nodes[leaf].AABB_max = b.AABB_max;
+	nodes[leaf].size = 1;
+	nodes[leaf].left = -1;
+	nodes[leaf].right = -1;
+
+	int cur = nodes[leaf].parent;
+	while (cur != -1) {
+		__threadfence();
+		if (atomicAdd(&visit_counts[cur], 1) == 0) {
+			// sibling subtree isn't done yet, its thread will carry on
+			return;
+		}
+		const LBVHNode& left = nodes[nodes[cur].left];
+		const LBVHNode& right = nodes[nodes[cur].right];
+		nodes[cur].AABB_min = glm::min(loadVolatile(left.AABB_min), loadVolatile(right.AABB_min));
+		nodes[cur].AABB_max = glm::max(loadVolatile(left.AABB_max), loadVolatile(right.AABB_max));
+		nodes[cur].size = 1 + *(const volatile int*)&left.size + *(const volatile int*)&right.size;
+		cur = nodes[cur].parent;
+	}
+}
+
+// one thread per node, the depth first index is accumulated on the way up to the root. leaves
+// also count the nodes on the way, the deepest goes to max_depth (the root is depth 1). an
+// internal node at depth BVH_STACK_SIZE becomes one leaf over its subtree's tris (counted in
+// num_collapsed) so the walk never pushes past the traversal stack, the nodes under it stay
+// in their slots as empty leaves nothing links to
+__global__ void flattenHierarchy(int n, const LBVHNode* nodes, BVHNode_GPU* bvh_nodes, int* max_depth, int* num_collapsed) {
+	int x = blockIdx.x * blockDim.x + threadIdx.x;
+	if (x >= 2 * n - 1) {
+		return;
+	}
+
+	int dfs_index = 0;
+	int depth = 1;
+	int cur = x;
+	while (nodes[cur].parent != -1) {
+		const LBVHNode& parent = nodes[nodes[cur].parent];
+		dfs_index += (parent.right == cur) ? 1 + nodes[parent.left].size : 1;
+		cur = nodes[cur].parent;
+		depth++;
+	}
+	if (x >= n - 1) {
+		atomicMax(max_depth, depth);
+	}
+
+	const LBVHNode& node = nodes[x];
+	BVHNode_GPU gpu_node;
+	gpu_node.AABB_min = node.AABB_min;
+	gpu_node.AABB_max = node.AABB_max;
+	if (depth > BVH_STACK_SIZE) {
+		gpu_node.AABB_min = glm::vec3(FLT_MAX);
+		gpu_node.AABB_max = glm::vec3(-FLT_MAX);
+		gpu_node.tri_index = 0;
+		gpu_node.num_tris = 0;
+	}
+	else if (x < n - 1 && depth == BVH_STACK_SIZE) {
+		// a subtree's leaves are one run of the sorted keys, (size + 1) / 2 of them
+		gpu_node.tri_index = node.first;
+		gpu_node.num_tris = (node.size + 1) / 2;
+		atomicAdd(num_collapsed, 1);
+	}
+	else if (x >= n - 1) {
+		gpu_node.tri_index = x - (n - 1);
+		gpu_node.num_tris = 1;
+	}
+	else {
+		gpu_node.offset_to_second_child = dfs_index + 1 + nodes[node.left].size;
+		gpu_node.num_tris = BVH_INNER_NODE(node.axis, false);
+	}
+	bvh_nodes[dfs_index] = gpu_node;
+}
+
+void buildLBVH(const glm::vec3* dev_positions, const glm::ivec3* dev_indices, int num_tris, int* dev_leaf_tri_IDs, BVHNode_GPU* dev_nodes) {
+	const int n = num_tris;
+	if (n <= 0) {
+		return;
+	}
+	const int num_nodes = 2 * n - 1;
+	const dim3 blocks_tris = (n + LBVH_BLOCK_SIZE - 1) / LBVH_BLOCK_SIZE;
+	const dim3 blocks_nodes = (num_nodes + LBVH_BLOCK_SIZE - 1) / LBVH_BLOCK_SIZE;
+
+	TriBounds* dev_bounds = NULL;
+	unsigned long long* dev_codes = NULL;
+	// sorted along with the morton codes, ends up as the leaf order
+	int* dev_tri_IDs = dev_leaf_tri_IDs;
+	LBVHNode* dev_lbvh_nodes = NULL;
+	int* dev_visit_counts = NULL;
+	cudaMalloc(&dev_bounds, n * sizeof(TriBounds));
+	cudaMalloc(&dev_codes, n * sizeof(unsigned long long));
+	cudaMalloc(&dev_lbvh_nodes, num_nodes * sizeof(LBVHNode));
+	cudaMalloc(&dev_visit_counts, (n + 2) * sizeof(int));
+	cudaMemset(dev_visit_counts, 0, (n + 2) * sizeof(int));
+	// the slots after the visit counts
+	int* dev_max_depth = dev_visit_counts + n;
+	int* dev_num_collapsed = dev_visit_counts + n + 1;
+	// root has no parent, every other parent gets written by buildHierarchy
+	cudaMemset(dev_lbvh_nodes, 0xFF, num_nodes * sizeof(LBVHNode));
+
+	computeTriBounds << <blocks_tris, LBVH_BLOCK_SIZE >> > (n, dev_positions, dev_indices, dev_bounds);
+
+	// morton codes are relative to the centroid bounds
+	thrust::device_ptr<TriBounds> thrust_bounds = thrust::device_pointer_cast(dev_bounds);
+	glm::vec3 centroid_min = thrust::transform_reduce(thrust::device, thrust_bounds, thrust_bounds + n, CentroidOf(), glm::vec3(FLT_MAX), Vec3Min());
+	glm::vec3 centroid_max = thrust::transform_reduce(thrust::device, thrust_bounds, thrust_bounds + n, CentroidOf(), glm::vec3(-FLT_MAX), Vec3Max());
+	glm::vec3 centroid_extent = centroid_max - centroid_min;
+	glm::vec3 centroid_extent_inv = glm::vec3(
+		centroid_extent.x > 0.0f ? 1.0f / centroid_extent.x : 0.0f,
+		centroid_extent.y > 0.0f ? 1.0f / centroid_extent.y : 0.0f,
+		centroid_extent.z > 0.0f ? 1.0f / centroid_extent.z : 0.0f);
+
+	computeMortonCodes << <blocks_tris, LBVH_BLOCK_SIZE >> > (n, dev_bounds, centroid_min, centroid_extent_inv, dev_codes, dev_tri_IDs);
+
+	// unsigned keys with no comparator go down thrust's radix sort path
+	thrust::sort_by_key(thrust::device, thrust::device_pointer_cast(dev_codes), thrust::device_pointer_cast(dev_codes) + n,
+		thrust::device_pointer_cast(dev_tri_IDs));
+
+	if (n > 1) {
+		buildHierarchy << <blocks_tris, LBVH_BLOCK_SIZE >> > (n, dev_codes, dev_lbvh_nodes);
+	}
+	refitHierarchy << <blocks_tris, LBVH_BLOCK_SIZE >> > (n, dev_bounds, dev_tri_IDs, dev_lbvh_nodes, dev_visit_counts);
+	flattenHierarchy << <blocks_nodes, LBVH_BLOCK_SIZE >> > (n, dev_lbvh_nodes, dev_nodes, dev_max_depth, dev_num_collapsed);
+
+	// unique keys keep a run of equal codes balanced, but a dense cluster can still take all 30
+	// morton bits plus the index bits below them, past what the traversal stack holds
+	int max_depth = 0;
+	int num_collapsed = 0;
+	cudaMemcpy(&max_depth, dev_max_depth, sizeof(int), cudaMemcpyDeviceToHost);
+	cudaMemcpy(&num_collapsed, dev_num_collapsed, sizeof(int), cudaMemcpyDeviceToHost);
+	if (num_collapsed > 0) {
+		std::cout << "LBVH depth " << max_depth << " is past the traversal stack size of " << BVH_STACK_SIZE << ", "
+			<< num_collapsed << " subtrees collapsed into leaves" << std::endl;
+	}
+
+	cudaFree(dev_bounds);
+	cudaFree(dev_codes);
+	cudaFree(dev_lbvh_nodes);
+	cudaFree(dev_visit_counts);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "sceneStructs.h"
+
+// spreads the low 10 bits of v so there are two zero bits between each
+__host__ __device__ inline unsigned int expandBits(unsigned int v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// morton code of p in [0, 1]^3 on a 2^bits grid per axis (bits <= 10), x in the highest bit of each triple
+__host__ __device__ inline unsigned int morton3D(glm::vec3 p, int bits = 10) {
+    const float cells = (float)(1 << bits);
+    p = glm::clamp(p * cells, glm::vec3(0.0f), glm::vec3(cells - 1.0f));
+    return (expandBits((unsigned int)p.x) << 2) | (expandBits((unsigned int)p.y) << 1) | expandBits((unsigned int)p.z);
+}
+
+// reads a box corner another thread just wrote, past any cached copy
+__device__ inline glm::vec3 loadVolatile(const glm::vec3& v) {
+    const volatile float* p = (const volatile float*)&v;
+    return glm::vec3(p[0], p[1], p[2]);
+}
+
+// Linear BVH built entirely on the device (Karras 2012, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees").
+// dev_positions / dev_indices hold the mesh in load order, dev_leaf_tri_IDs receives the
+// tri id each leaf slot references (num_tris entries) and dev_nodes needs room for
+// 2 * num_tris - 1 nodes, written in the same depth first layout reformatBVHToGPU
+// produces (left child next to its parent, one tri per leaf).
+void buildLBVH(const glm::vec3* dev_positions, const glm::ivec3* dev_indices, int num_tris, int* dev_leaf_tri_IDs, BVHNode_GPU* dev_nodes);
@@ -3,10 +3,28 @@
 
 #include "main.h"
 #include "preview.h"
+#include "raster.h"
+#include "cpu_render.h"
+#include "remote.h"
 #include <cstring>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <random>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/packing.hpp>
+#include <stb_image.h>
 
 
+// NOISE_TARGET is tested every this many samples, the estimate reads back every pixel's statistics
+#define NOISE_CHECK_INTERVAL 8
+
 static std::string startTimeString;
+static std::chrono::steady_clock::time_point launchTime; // for reportStartup
 
 // For camera controls
 static bool leftMousePressed = false;
@@ -14,9 +32,38 @@ static bool rightMousePressed = false;
 static bool middleMousePressed = false;
 static double lastX;
 static double lastY;
+static glm::ivec2 probePixel(-1); // ctrl click, dev_image pixel pathtrace_Single traces after this frame
+static glm::ivec2 cropAnchor(-1); // shift drag, the window pixel the crop rectangle started at
 
 static bool camchanged = true;
+static bool scenechanged = true; // scene data needs uploading before the next frame
+
+// kept to re-read the scene file on reload
+static std::string sceneFileName;
+static std::vector<std::string> sceneOverrides;
+// when the interactive render restarted and whether it met its time or noise target since
+static std::chrono::steady_clock::time_point renderStart;
+static bool renderStopped = false;
+static std::chrono::steady_clock::time_point lastCameraMove; // PREVIEW_IDLE counts from here
+static std::chrono::steady_clock::time_point lastBatch; // start of the previous frame's iterations
+static bool lastBatchTimed = false; // it traced iterations, so the time since lastBatch was spent on them
+static float batchIterations = 1.0f; // ITERATIONS_PER_FRAME 0, fractional so small corrections add up
 static float dtheta = 0, dphi = 0;
+// a save whose readback is in flight, written out by pollImageSave once it lands
+static bool savePending = false;
+static ImageReadback saveKind = READBACK_LDR; // what the save's extension needs read back
+static std::string saveFilename;
+static int saveSamples = 0;
+// png / hdr encoding runs here so saving doesn't stall the render loop
+static std::thread imageWriter;
+// STREAM_MESHES, the full scene is built here while the window shows its mesh proxies
+static std::thread meshStreamer;
+static std::atomic<bool> meshStreamDone(false);
+static Scene* streamedScene = NULL; // NULL when the load threw
+// WATCH_SCENE, the scene file as last parsed and the modification times of it and its inputs
+static Scene* watchedParse = NULL;
+static std::map<std::string, long long> watchedTimes;
+static std::chrono::steady_clock::time_point lastWatchPoll;
 static glm::vec3 cammove;
 
 float zoom, theta, phi;
@@ -27,6 +74,7 @@ Scene* scene;
 GuiDataContainer* guiData;
 RenderState* renderState;
 int iteration;
+int firstIteration = 0; // iterations up to this one belong to another node's --range, the image holds the rest
 
 int cur_x;
 int cur_y;
@@ -40,16 +88,169 @@ int height;
 
 int main(int argc, char** argv) {
 	startTimeString = currentTimeString();
+	launchTime = std::chrono::steady_clock::now();
 
 	if (argc < 2) {
-		printf("Usage: %s SCENEFILE.txt\n", argv[0]);
+		printf("Usage: %s SCENEFILE.txt [--headless] [--spp N] [--time SECONDS] [--out FILE] [--probe X Y] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s SCENEFILE.txt --cpu [--threads N] [--spp N] [--out FILE] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s SCENEFILE.txt --hybrid [--threads N] [--spp N] [--time SECONDS] [--out FILE] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s SCENEFILE.txt --serve PORT [--bind ADDRESS] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s SCENEFILE.txt --sequence TRACK.txt [--spp N] [--time SECONDS] [--out FILE] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s SCENEFILE.txt --dataset SPEC.txt [--spp N] [--out FILE] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s SCENEFILE.txt --resume [--checkpoint FILE] [--spp N] [--time SECONDS] [--out FILE] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s SCENEFILE.txt --range FIRST COUNT [--checkpoint FILE] [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s --merge OUT PARTIAL.ckpt [PARTIAL.ckpt ...]\n", argv[0]);
+		printf("       %s --replay-rays FILE.rays [--repeat N] [--cpu] [--stackless]\n", argv[0]);
+		printf("       %s --bvh-report SCENEFILE.txt [KEY=VALUE ...]\n", argv[0]);
+		printf("       %s --batch JOBS.txt [--update-references]\n", argv[0]);
+		printf("       %s --jobs PORT [--bind ADDRESS] [--job-dir DIR] [--cache N] [--progress SECONDS] [--concurrent N]\n", argv[0]);
+		printf("       %s --benchmark [JOBS.txt] [--json FILE] [--csv FILE] [--baseline FILE.csv [--tolerance T] [--min-ms MS]] [--update-references]\n", argv[0]);
 		return 1;
 	}
 
+	if (strcmp(argv[1], "--benchmark") == 0) {
+		int status = renderBenchmark(std::vector<std::string>(argv + 2, argv + argc));
+		finishImageWrites();
+		return status;
+	}
+
+	if (strcmp(argv[1], "--replay-rays") == 0) {
+		if (argc < 3) {
+			printf("Usage: %s --replay-rays FILE.rays [--repeat N] [--cpu] [--stackless]\n", argv[0]);
+			return 1;
+		}
+		int repeat = 10;
+		bool cpu = false;
+		bool stackless = false;
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+				repeat = atoi(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--cpu") == 0) {
+				cpu = true;
+			}
+			else if (strcmp(argv[i], "--stackless") == 0) {
+				stackless = true;
+			}
+		}
+		return replayRayCapture(argv[2], repeat, cpu, stackless);
+	}
+
+	if (strcmp(argv[1], "--merge") == 0) {
+		if (argc < 4) {
+			printf("Usage: %s --merge OUT PARTIAL.ckpt [PARTIAL.ckpt ...]\n", argv[0]);
+			return 1;
+		}
+		int status = mergePartials(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+		finishImageWrites();
+		return status;
+	}
+
+	if (strcmp(argv[1], "--bvh-report") == 0) {
+		if (argc < 3) {
+			printf("Usage: %s --bvh-report SCENEFILE.txt [KEY=VALUE ...]\n", argv[0]);
+			return 1;
+		}
+		// the scene load prints the report, nothing is rendered
+		std::vector<std::string> overrides(argv + 3, argv + argc);
+		overrides.push_back("BVH_REPORT=1");
+		try {
+			delete new Scene(argv[2], overrides);
+		}
+		catch (const std::exception& e) {
+			cout << "ERROR: " << e.what() << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--jobs") == 0) {
+		if (argc < 3) {
+			printf("Usage: %s --jobs PORT [--cache N] [--progress SECONDS] [--concurrent N]\n", argv[0]);
+			return 1;
+		}
+		int status = renderJobServer(std::vector<std::string>(argv + 2, argv + argc));
+		finishImageWrites();
+		return status;
+	}
+
+	if (strcmp(argv[1], "--batch") == 0) {
+		if (argc < 3) {
+			printf("Usage: %s --batch JOBS.txt [--update-references]\n", argv[0]);
+			return 1;
+		}
+		int status = renderBatch(argv[2], NULL, argc > 3 && strcmp(argv[3], "--update-references") == 0);
+		finishImageWrites();
+		return status;
+	}
+
 	const char* sceneFile = argv[1];
 
-	// Load scene file
-	scene = new Scene(sceneFile);
+	// --flags pick the batch mode, anything else after the scene file overrides its
+	// SETTINGS block, e.g. BVH_BUILDER=SAH BVH_BINS=32
+	HeadlessOptions headless;
+	std::vector<std::string> settingOverrides;
+	parseJobArgs(std::vector<std::string>(argv + 2, argv + argc), headless, settingOverrides);
+	headless.scene_key = sceneKey(sceneFile, settingOverrides);
+
+	// Load scene file, STREAM_MESHES only stands in proxies for the window
+	try {
+		scene = new Scene(sceneFile, settingOverrides, !headless.enabled && !headless.cpu);
+	}
+	catch (const std::exception& e) {
+		cout << "ERROR: " << e.what() << endl;
+		return 1;
+	}
+	sceneFileName = sceneFile;
+	sceneOverrides = settingOverrides;
+
+	if (headless.cpu) {
+		// host only, no device is initialized
+		renderState = &scene->state;
+		applyCameraOverrides(headless, scene->state.camera);
+		width = renderState->camera.resolution.x;
+		height = renderState->camera.resolution.y;
+		iteration = headless.spp > 0 ? headless.spp : renderState->iterations;
+		cpuRender(scene, iteration, headless.cpu_threads, renderState->image);
+		image* img = buildImage(renderState->image, iteration, glm::ivec2(width, height));
+		saveImageFile(*img, headless.out.empty() ? defaultImageName() : headless.out);
+		delete img;
+		delete scene;
+		return 0;
+	}
+
+	if (headless.enabled) {
+		renderState = &scene->state;
+		applyCameraOverrides(headless, scene->state.camera);
+		applyAutoTune(scene, sceneFile, settingOverrides);
+		pathtraceInit(scene);
+		reportStartup("the first iteration");
+		int status = 0;
+		if (headless.serve_port > 0) {
+			status = renderRemote(headless);
+		}
+		else if (!headless.dataset.empty()) {
+			status = renderDataset(headless);
+		}
+		else if (headless.sequence.empty()) {
+			status = renderJob(headless).passed ? 0 : 1;
+		}
+		else {
+			status = renderSequence(headless);
+		}
+		finishImageWrites();
+		pathtraceFree();
+		delete scene;
+		return status;
+	}
+
+	// the PBO lives on the first device, iterations traced anywhere else couldn't be shown
+	if (scene->render_settings.num_gpus != 1) {
+		cout << "NUM_GPUS only applies to headless renders, using one device" << endl;
+		scene->render_settings.num_gpus = 1;
+		sceneOverrides.push_back("NUM_GPUS=1");
+	}
+	applyAutoTune(scene, sceneFileName, sceneOverrides);
 
 	//Create Instance for ImGUIData
 	guiData = new GuiDataContainer();
@@ -63,164 +264,3506 @@ int main(int argc, char** argv) {
 	width = cam.resolution.x;
 	height = cam.resolution.y;
 
-	glm::vec3 view = cam.view;
-	glm::vec3 up = cam.up;
-	glm::vec3 right = glm::cross(view, up);
-	up = glm::cross(right, view);
-
-	cameraPosition = cam.position;
-
-	// compute phi (horizontal) and theta (vertical) relative 3D axis
-	// so, (0 0 1) is forward, (0 1 0) is up
-	glm::vec3 viewXZ = glm::vec3(view.x, 0.0f, view.z);
-	glm::vec3 viewZY = glm::vec3(0.0f, view.y, view.z);
-	phi = glm::acos(glm::dot(glm::normalize(viewXZ), glm::vec3(0, 0, -1)));
-	theta = glm::acos(glm::dot(glm::normalize(viewZY), glm::vec3(0, 1, 0)));
-	ogLookAt = cam.lookAt;
-	zoom = glm::length(cam.position - ogLookAt);
+	resetCameraControls();
 
 	// Initialize CUDA and GL components
-	init();
+	{
+		PhaseTimer phase(PHASE_GL_INIT);
+		init();
+	}
 
 	// Initialize ImGui Data
 	InitImguiData(guiData);
 	InitDataContainer(guiData);
 
-	// GLFW main loop
+	if (scene->mesh_proxies) {
+		meshStreamer = std::thread([]() {
+			try {
+				streamedScene = new Scene(sceneFileName, sceneOverrides);
+			}
+			catch (const std::exception& e) {
+				cout << "STREAM_MESHES: " << e.what() << endl;
+			}
+			meshStreamDone = true;
+		});
+	}
+
+	if (scene->render_settings.render_thread) {
+		startRenderThread();
+	}
+
+	// GLFW main loop, which stops the render thread
 	mainLoop();
+	finishImageWrites();
+	delete watchedParse;
+	if (meshStreamer.joinable()) {
+		// nothing to cancel, the load has to finish before it can be thrown away
+		meshStreamer.join();
+		delete streamedScene;
+	}
 
 	return 0;
 }
 
-void saveImage() {
-	float samples = iteration;
-	// output image file
-	image img(width, height);
+// sums of a resolution.x x resolution.y image averaged over samples and flipped into an image,
+// owned by the caller
+image* buildImage(const std::vector<glm::vec3>& sums, int samples, glm::ivec2 resolution) {
+	image* img = new image(resolution.x, resolution.y);
 
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			int index = x + (y * width);
-			glm::vec3 pix = renderState->image[index];
-			img.setPixel(width - 1 - x, y, glm::vec3(pix) / samples);
+	for (int x = 0; x < resolution.x; x++) {
+		for (int y = 0; y < resolution.y; y++) {
+			int index = x + (y * resolution.x);
+			glm::vec3 pix = sums[index];
+			img->setPixel(resolution.x - 1 - x, y, glm::vec3(pix) / (float)samples);
 		}
 	}
+	return img;
+}
 
-	std::string filename = renderState->imageName;
-	std::ostringstream ss;
-	ss << filename << "." << startTimeString << "." << samples << "samp";
-	filename = ss.str();
+// display colors as pathtraceRetrieveLDRImage returns them, flipped like buildImage
+image* buildLDRImage(const std::vector<uchar4>& pixels, glm::ivec2 resolution) {
+	image* img = new image(resolution.x, resolution.y, true);
+
+	for (int x = 0; x < resolution.x; x++) {
+		for (int y = 0; y < resolution.y; y++) {
+			const uchar4& pix = pixels[x + (y * resolution.x)];
+			img->setPixel(resolution.x - 1 - x, y, pix.x, pix.y, pix.z);
+		}
+	}
+	return img;
+}
+
+bool hasExtension(const std::string& filename, const char* extension) {
+	std::string::size_type dot = filename.rfind('.');
+	return dot != std::string::npos && filename.substr(dot) == extension;
+}
+
+// png gets the display colors, hdr the float sums and exr half floats
+ImageReadback imageReadbackFor(const std::string& filename) {
+	if (hasExtension(filename, ".hdr")) {
+		return READBACK_FLOAT;
+	}
+	return hasExtension(filename, ".exr") ? READBACK_HALF : READBACK_LDR;
+}
+
+// a .hdr extension saves Radiance HDR, anything else a png (savePNG adds the extension)
+void saveImageFile(image& img, const std::string& filename) {
+	std::string base = filename;
+	bool hdr = hasExtension(filename, ".hdr");
+	std::string::size_type dot = base.rfind('.');
+	if (hdr || (dot != std::string::npos && base.substr(dot) == ".png")) {
+		base = base.substr(0, dot);
+	}
 
 	// CHECKITOUT
-	img.savePNG(filename);
-	//img.saveHDR(filename);  // Save a Radiance HDR file
+	if (hdr) {
+		img.saveHDR(base);  // Save a Radiance HDR file
+	}
+	else {
+		img.savePNG(base);
+	}
 }
 
-void runCuda() {
-	if (camchanged) {
-		iteration = 0;
-		Camera& cam = renderState->camera;
-		cameraPosition.x = zoom * sin(phi) * sin(theta);
-		cameraPosition.y = zoom * cos(theta);
-		cameraPosition.z = zoom * cos(phi) * sin(theta);
-
-		cam.view = -glm::normalize(cameraPosition);
-		glm::vec3 v = cam.view;
-		glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
-		glm::vec3 r = glm::cross(v, u);
-		cam.up = glm::cross(r, v);
-		cam.right = r;
-
-		cam.position = cameraPosition;
-		cameraPosition += cam.lookAt;
-		cam.position = cameraPosition;
-		camchanged = false;
+// runs write on imageWriter. waits for the previous write first, so at most one image is
+// waiting on the encoder
+void runOnImageWriter(const std::function<void()>& write) {
+	if (imageWriter.joinable()) {
+		imageWriter.join();
 	}
+	imageWriter = std::thread(write);
+}
 
-	// Map OpenGL buffer object for writing from CUDA on a single GPU
-	// No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
-	if (iteration == 0) {
-		pathtraceFree();
-		pathtraceInit(scene);
+// VIEWS, one view of the packed image: the suffix its file gets and its x, y, width, height in
+// saved image coordinates, the same split viewRay lays the views out in
+struct ImageView {
+	const char* suffix;
+	glm::ivec4 rect;
+};
+
+// the views an image of resolution is split into when it's saved, none when it's saved whole
+std::vector<ImageView> imageViews(const glm::ivec2& resolution, ViewLayout layout) {
+	std::vector<ImageView> views;
+	if (layout == VIEWS_STEREO) {
+		const int view_w = resolution.x / 2;
+		views.push_back({ "_left", glm::ivec4(0, 0, view_w, resolution.y) });
+		views.push_back({ "_right", glm::ivec4(view_w, 0, view_w, resolution.y) });
 	}
+	else if (layout == VIEWS_CUBEMAP) {
+		static const char* faces[6] = { "_px", "_nx", "_py", "_ny", "_pz", "_nz" };
+		const glm::ivec2 face = resolution / glm::ivec2(3, 2);
+		for (int i = 0; i < 6; i++) {
+			views.push_back({ faces[i], glm::ivec4((i % 3) * face.x, (i / 3) * face.y, face.x, face.y) });
+		}
+	}
+	return views;
+}
 
-	if (iteration < renderState->iterations) {
-		uchar4* pbo_dptr = NULL;
-		iteration++;
-		cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+// the views of the images this render saves, none while baking
+ViewLayout savedViews() {
+	return scene->bake_texels.empty() ? scene->render_settings.views : VIEWS_NONE;
+}
 
-		// execute the kernel
-		int frame = 0;
-		pathtrace(pbo_dptr, frame, iteration);
+// filename with suffix before its extension
+std::string viewFilename(const std::string& filename, const char* suffix) {
+	const size_t dot = filename.find_last_of('.');
+	const size_t slash = filename.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+		return filename + suffix;
+	}
+	return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
 
-		// unmap buffer object
-		cudaGLUnmapBufferObject(pbo);
+// encodes img on imageWriter and deletes it after
+void writeImageAsync(image* img, const std::string& filename) {
+	runOnImageWriter([img, filename]() {
+		saveImageFile(*img, filename);
+		delete img;
+	});
+}
+
+// writeImageAsync, a file per view with VIEWS
+void writeViewsAsync(image* img, const std::string& filename) {
+	const std::vector<ImageView> views = imageViews(glm::ivec2(width, height), savedViews());
+	if (views.empty()) {
+		writeImageAsync(img, filename);
+		return;
 	}
-	/*else {
-		saveImage();
-		pathtraceFree();
-		cudaDeviceReset();
-		exit(EXIT_SUCCESS);
-	}*/
+	runOnImageWriter([img, filename, views]() {
+		for (const ImageView& view : views) {
+			image* region = img->crop(view.rect.x, view.rect.y, view.rect.z, view.rect.w);
+			saveImageFile(*region, viewFilename(filename, view.suffix));
+			delete region;
+		}
+		delete img;
+	});
 }
 
-void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
-	if (action == GLFW_PRESS) {
-		switch (key) {
-		case GLFW_KEY_ESCAPE:
-			saveImage();
-			glfwSetWindowShouldClose(window, GL_TRUE);
-			break;
-		case GLFW_KEY_S:
-			saveImage();
-			break;
-		case GLFW_KEY_SPACE:
-			camchanged = true;
-			renderState = &scene->state;
-			Camera& cam = renderState->camera;
-			cam.lookAt = ogLookAt;
-			break;
+// starts reading back the current samples for a save, pollImageSave writes it once it lands
+void requestImageSave(const std::string& filename) {
+	if (savePending) {
+		pollImageSave(true);
+	}
+	saveKind = imageReadbackFor(filename);
+	pathtraceRequestImage(iteration - firstIteration, saveKind);
+	savePending = true;
+	saveFilename = filename;
+	saveSamples = iteration - firstIteration;
+}
+
+// hands a requested save to the encoder once its readback is done, or waits for it with wait
+void pollImageSave(bool wait) {
+	if (!savePending || (!wait && !pathtraceImageReady())) {
+		return;
+	}
+	savePending = false;
+	if (saveKind == READBACK_LDR) {
+		std::vector<uchar4> pixels;
+		pathtraceRetrieveLDRImage(saveSamples, pixels);
+		writeViewsAsync(buildLDRImage(pixels, glm::ivec2(width, height)), saveFilename);
+	}
+	else if (saveKind == READBACK_HALF) {
+		EXRImage* exr = new EXRImage();
+		pathtraceRetrieveHalfImage(saveSamples, *exr);
+		const std::string filename = saveFilename;
+		const std::vector<ImageView> views = imageViews(glm::ivec2(width, height), savedViews());
+		runOnImageWriter([exr, filename, views]() {
+			if (views.empty()) {
+				saveEXR(*exr, filename);
+			}
+			for (const ImageView& view : views) {
+				saveEXR(cropEXR(*exr, view.rect.x, view.rect.y, view.rect.z, view.rect.w), viewFilename(filename, view.suffix));
+			}
+			delete exr;
+		});
+	}
+	else {
+		pathtraceRetrieveImage();
+		writeViewsAsync(buildImage(renderState->image, saveSamples, glm::ivec2(width, height)), saveFilename);
+	}
+}
+
+// every requested save on disk, called before exiting
+void finishImageWrites() {
+	pollImageSave(true);
+	if (imageWriter.joinable()) {
+		imageWriter.join();
+	}
+}
+
+// averages the accumulated samples and writes them out. only the readback is waited on,
+// the file is encoded in the background
+void writeImage(const std::string& filename) {
+	requestImageSave(filename);
+	pollImageSave(true);
+}
+
+std::string defaultImageName() {
+	std::ostringstream ss;
+	ss << renderState->imageName << "." << startTimeString << "." << iteration << "samp";
+	return ss.str();
+}
+
+void saveImage() {
+	writeImage(defaultImageName());
+}
+
+void parseJobArgs(const std::vector<std::string>& args, HeadlessOptions& options, std::vector<std::string>& setting_overrides) {
+	for (int i = 0; i < args.size(); ++i) {
+		if (args[i] == "--headless") {
+			options.enabled = true;
+		}
+		else if (args[i] == "--spp" && i + 1 < args.size()) {
+			options.spp = atoi(args[++i].c_str());
+		}
+		else if (args[i] == "--time" && i + 1 < args.size()) {
+			options.time_budget = atof(args[++i].c_str());
+		}
+		else if (args[i] == "--out" && i + 1 < args.size()) {
+			options.out = args[++i];
+		}
+		else if (args[i] == "--checkpoint" && i + 1 < args.size()) {
+			options.checkpoint = args[++i];
+		}
+		else if (args[i] == "--range" && i + 2 < args.size()) {
+			options.enabled = true;
+			options.range_first = glm::max(atoi(args[i + 1].c_str()), 0);
+			options.range_count = glm::max(atoi(args[i + 2].c_str()), 1);
+			i += 2;
+		}
+		else if (args[i] == "--cpu") {
+			options.enabled = true;
+			options.cpu = true;
+		}
+		else if (args[i] == "--hybrid") {
+			options.enabled = true;
+			options.hybrid = true;
+		}
+		else if (args[i] == "--threads" && i + 1 < args.size()) {
+			options.cpu_threads = atoi(args[++i].c_str());
+		}
+		else if (args[i] == "--reference" && i + 1 < args.size()) {
+			options.reference = args[++i];
+		}
+		else if (args[i] == "--max-rmse" && i + 1 < args.size()) {
+			options.max_rmse = atof(args[++i].c_str());
+		}
+		else if (args[i] == "--update-references") {
+			options.update_references = true;
+		}
+		else if (args[i] == "--probe" && i + 2 < args.size()) {
+			options.probe = glm::ivec2(atoi(args[i + 1].c_str()), atoi(args[i + 2].c_str()));
+			i += 2;
+		}
+		else if (args[i] == "--resume") {
+			options.enabled = true;
+			options.resume = true;
+		}
+		else if (args[i] == "--serve" && i + 1 < args.size()) {
+			options.enabled = true;
+			options.serve_port = atoi(args[++i].c_str());
+		}
+		else if (args[i] == "--bind" && i + 1 < args.size()) {
+			options.bind_address = args[++i];
+		}
+		else if (args[i] == "--sequence" && i + 1 < args.size()) {
+			options.enabled = true;
+			options.sequence = args[++i];
+		}
+		else if (args[i] == "--dataset" && i + 1 < args.size()) {
+			options.enabled = true;
+			options.dataset = args[++i];
+		}
+		else if ((args[i] == "--eye" || args[i] == "--lookat") && i + 3 < args.size()) {
+			glm::vec3 v(atof(args[i + 1].c_str()), atof(args[i + 2].c_str()), atof(args[i + 3].c_str()));
+			if (args[i] == "--eye") {
+				options.has_eye = true;
+				options.eye = v;
+			}
+			else {
+				options.has_lookat = true;
+				options.lookat = v;
+			}
+			i += 3;
+		}
+		else {
+			setting_overrides.push_back(args[i]);
 		}
 	}
 }
 
-void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
-	if (MouseOverImGuiWindow())
-	{
+void applyCameraOverrides(const HeadlessOptions& options, Camera& cam) {
+	if (options.has_eye) {
+		cam.position = options.eye;
+	}
+	if (options.has_lookat) {
+		cam.lookAt = options.lookat;
+	}
+	if (options.has_eye || options.has_lookat) {
+		Scene::updateCameraBasis(cam);
+	}
+}
+
+// why a render with settings should stop before its sample count after iter iterations, NULL
+// while it keeps going
+const char* renderStopReason(const RenderSettings& settings, int iter, float elapsed, float time_budget) {
+	if (time_budget > 0.0f && elapsed >= time_budget) {
+		return "time budget";
+	}
+	if (settings.noise_target > 0.0f && iter % NOISE_CHECK_INTERVAL == 0) {
+		float noise = pathtraceNoiseEstimate();
+		if (noise >= 0.0f && noise <= settings.noise_target) {
+			return "noise target";
+		}
+	}
+	return NULL;
+}
+
+// samples, time and throughput of a finished render, plus the noise estimate when there's one
+// time from launch to what the caller is about to do, and how much of it each startup phase took
+void reportStartup(const char* until) {
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - launchTime;
+	printf("Startup: %.1f ms to %s\n", elapsed.count(), until);
+	for (int p = 0; p < NUM_STARTUP_PHASES; p++) {
+		if (startupPhaseMs(p) > 0.0) {
+			printf("  %-16s %9.1f ms\n", startupPhaseName(p), startupPhaseMs(p));
+		}
+	}
+}
+
+void reportRender(float elapsed, const char* stop_reason) {
+	const int samples = iteration - firstIteration;
+	cout << "Rendered " << samples << " samples in " << elapsed << " s (" << samples / glm::max(elapsed, 1e-6f) << " samples/s)";
+	float noise = pathtraceNoiseEstimate();
+	if (noise >= 0.0f) {
+		cout << ", noise estimate " << noise;
+	}
+	if (stop_reason != NULL) {
+		cout << ", stopped at the " << stop_reason;
+	}
+	cout << endl;
+}
+
+// render farm mode: no window, GL context or PBO, pathtrace only accumulates into dev_image.
+// stops at the sample count (the scene's ITERATIONS by default), the time budget (--time, else TIME_BUDGET)
+// or NOISE_TARGET, whichever is first. expects pathtraceInit to have been called for the current scene
+JobResult renderJob(const HeadlessOptions& options) {
+	auto start = std::chrono::steady_clock::now();
+	const char* stop_reason = NULL;
+	JobResult result = renderSamples(options, stop_reason, true);
+
+	// a range only holds part of the samples, its checkpoint is the output
+	if (options.range_first >= 0) {
+		cout << "Partial of iterations " << options.range_first + 1 << " to " << iteration << " in " << checkpointFilename(options) << endl;
+	}
+	else if (options.out.empty()) {
+		saveImage();
+	}
+	else {
+		writeImage(options.out);
+	}
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	reportRender(elapsed.count(), stop_reason);
+
+	if (options.probe.x >= 0) {
+		// saved images are flipped left to right from dev_image
+		pathtrace_Single(NULL, iteration, width - 1 - options.probe.x, options.probe.y);
+		reportProbe(pathtraceProbe());
+		writeProbeCSV(pathtraceProbe(), (options.out.empty() ? std::string("probe") : options.out) + ".probe.csv");
+	}
+
+	if (!options.reference.empty()) {
+		result.rmse = compareToReference(options.reference, result.samples, options.update_references);
+		result.passed = result.rmse <= options.max_rmse;
+		if (result.rmse >= 0.0f) {
+			printf("%s: RMSE %.5f against %s (max %.5f)\n", result.passed ? "PASS" : "FAIL", result.rmse, options.reference.c_str(),
+				options.max_rmse);
+		}
+		else if (result.rmse < -1.5f) {
+			// couldn't be compared at all
+			result.passed = false;
+		}
+	}
+	return result;
+}
+
+// a pathtrace_Single run on stdout: the averages over its samples and every bounce of the
+// slowest one, the pixel in saved image coordinates like --probe takes it
+void reportProbe(const PathProbe& probe) {
+	if (probe.x < 0) {
 		return;
 	}
-	leftMousePressed = (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS);
-	rightMousePressed = (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS);
-	middleMousePressed = (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_PRESS);
+	const int samples = probe.num_bounces.size();
+	double bounces = 0.0, nodes = 0.0;
+	long long total_cycles = 0;
+	int slowest = 0;
+	long long slowest_cycles = -1;
+	for (int k = 0; k < samples; k++) {
+		const long long cycles = probeSampleCycles(probe, k);
+		total_cycles += cycles;
+		bounces += probe.num_bounces[k];
+		for (int b = 0; b < probe.num_bounces[k]; b++) {
+			nodes += probe.bounces[k * probe.max_bounces + b].nodes;
+		}
+		if (cycles > slowest_cycles) {
+			slowest_cycles = cycles;
+			slowest = k;
+		}
+	}
+	printf("Probe of pixel (%d, %d): %d samples from iteration %d, %.2f bounces, %.1f nodes per bounce and %.2f us per sample on average\n",
+		width - 1 - probe.x, probe.y, samples, probe.first_iteration, bounces / glm::max(samples, 1), nodes / glm::max(bounces, 1.0),
+		probeMicroseconds(probe, total_cycles) / glm::max(samples, 1));
+	const glm::vec3& L = probe.radiance[slowest];
+	printf("  slowest sample %d (iteration %d): %.2f us, radiance (%g %g %g)\n", slowest, probe.first_iteration + slowest,
+		probeMicroseconds(probe, slowest_cycles), L.x, L.y, L.z);
+	for (int b = 0; b < probe.num_bounces[slowest]; b++) {
+		const ProbeBounce& bounce = probe.bounces[slowest * probe.max_bounces + b];
+		printf("  bounce %d: geom %d material %d t %g%s, MIS weights light %.3f bsdf %.3f, %d nodes %d tris, %.2f us, throughput %g\n",
+			b, bounce.geom, bounce.material, bounce.t, bounce.specular ? " specular" : "", bounce.light_weight, bounce.bsdf_weight,
+			bounce.nodes, bounce.tris, probeMicroseconds(probe, bounce.cycles), bounce.throughput);
+	}
 }
 
-void mousePositionCallback(GLFWwindow* window, double xpos, double ypos) {
-	if (xpos == lastX || ypos == lastY) return; // otherwise, clicking back into window causes re-start
-	if (leftMousePressed) {
-		// compute new camera parameters
-		phi -= ((xpos - lastX) / width) * 2.5f;
-		theta -= ((ypos - lastY) / height) * 2.5f;
-		theta = std::fmax(0.001f, std::fmin(theta, PI));
-		camchanged = true;
+// one row per bounce of every probe sample
+bool writeProbeCSV(const PathProbe& probe, const std::string& filename) {
+	FILE* f = fopen(filename.c_str(), "w");
+	if (f == NULL) {
+		cout << "Can't write " << filename << endl;
+		return false;
 	}
-	else if (rightMousePressed) {
-		zoom += ((ypos - lastY) / height) * 7.5f;
-		zoom = std::fmax(0.1f, zoom);
-		camchanged = true;
+	fprintf(f, "sample,iteration,bounce,geom,material,t,specular,light_weight,bsdf_weight,nodes,tris,us,throughput\n");
+	for (int k = 0; k < (int)probe.num_bounces.size(); k++) {
+		for (int b = 0; b < probe.num_bounces[k]; b++) {
+			const ProbeBounce& bounce = probe.bounces[k * probe.max_bounces + b];
+			fprintf(f, "%d,%d,%d,%d,%d,%g,%d,%g,%g,%d,%d,%.3f,%g\n", k, probe.first_iteration + k, b, bounce.geom, bounce.material,
+				bounce.t, bounce.specular ? 1 : 0, bounce.light_weight, bounce.bsdf_weight, bounce.nodes, bounce.tris,
+				probeMicroseconds(probe, bounce.cycles), bounce.throughput);
+		}
 	}
-	else if (middleMousePressed) {
-		renderState = &scene->state;
-		Camera& cam = renderState->camera;
-		glm::vec3 forward = cam.view;
-		forward.y = 0.0f;
-		forward = glm::normalize(forward);
-		glm::vec3 right = cam.right;
-		right.y = 0.0f;
-		right = glm::normalize(right);
-
-		cam.lookAt -= (float)(xpos - lastX) * right * 0.01f;
-		cam.lookAt += (float)(ypos - lastY) * forward * 0.01f;
-		camchanged = true;
+	fclose(f);
+	cout << "Probe bounces in " << filename << endl;
+	return true;
+}
+
+// RMSE of the current render's averaged radiance, over every pixel and channel, against the
+// .hdr at reference. the sampler is seeded by pixel and iteration only, so the same build, scene
+// and sample count render the same image and a small tolerance only has to absorb float
+// differences between GPUs and compilers. update writes the render as the reference instead and
+// -1 comes back, -2 when there's no reference or it can't be compared
+float compareToReference(const std::string& reference, int samples, bool update) {
+	pathtraceRetrieveImage();
+	if (update) {
+		image* img = buildImage(renderState->image, samples, glm::ivec2(width, height));
+		saveImageFile(*img, reference);
+		delete img;
+		cout << "Wrote the reference " << reference << endl;
+		return -1.0f;
 	}
-	lastX = xpos;
-	lastY = ypos;
+	int ref_width, ref_height, channels;
+	float* ref = stbi_loadf(reference.c_str(), &ref_width, &ref_height, &channels, 3);
+	if (ref == NULL) {
+		std::ifstream exists(reference);
+		if (exists.good()) {
+			cout << "FAIL: can't read the reference " << reference << endl;
+		}
+		else {
+			cout << "FAIL: no reference at " << reference << ", --update-references writes one" << endl;
+		}
+		return -2.0f;
+	}
+	if (ref_width != width || ref_height != height) {
+		cout << "FAIL: " << reference << " is " << ref_width << " x " << ref_height << ", the render " << width << " x " << height << endl;
+		stbi_image_free(ref);
+		return -2.0f;
+	}
+	// the reference was written through buildImage, flipped left to right
+	double sum_sq = 0.0;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			glm::vec3 pix = renderState->image[x + y * width] / (float)glm::max(samples, 1);
+			const float* r = ref + 3 * ((width - 1 - x) + y * width);
+			glm::vec3 d = pix - glm::vec3(r[0], r[1], r[2]);
+			sum_sq += glm::dot(d, d);
+		}
+	}
+	stbi_image_free(ref);
+	return (float)sqrt(sum_sq / (3.0 * width * height));
+}
+
+// --hybrid, the host's samples only add up with the device's when both trace the same plain
+// image. a checkpoint (and a --range) holds one sum and one count for the device's iterations
+static bool hybridApplies(const Scene* scene, bool checkpoints) {
+	const RenderSettings& settings = scene->render_settings;
+	if (checkpoints) {
+		cout << "--hybrid is ignored with checkpoints, --resume and --range" << endl;
+		return false;
+	}
+	if (scene->host_geometry_released) {
+		cout << "--hybrid is ignored with FREE_HOST_GEOMETRY, the host has no mesh left to trace" << endl;
+		return false;
+	}
+	if (scene->lbvh_until_swap) {
+		cout << "--hybrid is ignored with BVH_PROGRESSIVE, the host trees change under the CPU threads" << endl;
+		return false;
+	}
+	if (settings.adaptive_threshold > 0.0f || settings.noise_target > 0.0f || settings.outlier_buckets > 0 || settings.deterministic
+		|| (settings.crop.z > 0 && settings.crop.w > 0) || !scene->bake_texels.empty() || settings.views != VIEWS_NONE) {
+		cout << "--hybrid is ignored with ADAPTIVE_THRESHOLD, NOISE_TARGET, OUTLIER_BUCKETS, DETERMINISTIC, CROP, BAKE and VIEWS" << endl;
+		return false;
+	}
+	return true;
+}
+
+// the sample loop of renderJob, stop_reason is left NULL when it reached the sample count.
+// with checkpoints it resumes from options' checkpoint when asked to, writes one every
+// CHECKPOINT_INTERVAL seconds and a last one when it is done. a --range always checkpoints,
+// the last one is its partial
+JobResult renderSamples(const HeadlessOptions& options, const char*& stop_reason, bool checkpoints) {
+	renderState = &scene->state;
+	width = renderState->camera.resolution.x;
+	height = renderState->camera.resolution.y;
+	const bool range = checkpoints && options.range_first >= 0;
+	firstIteration = range ? options.range_first : 0;
+	int spp = range ? firstIteration + options.range_count : options.spp > 0 ? options.spp : renderState->iterations;
+	float time_budget = options.time_budget > 0.0f ? options.time_budget : scene->render_settings.time_budget;
+
+	InitDataContainer(NULL);
+	pathtraceResetStats();
+
+	auto start = std::chrono::steady_clock::now();
+	stop_reason = NULL;
+	iteration = firstIteration;
+
+	const float checkpoint_interval = checkpoints ? scene->render_settings.checkpoint_interval : 0.0f;
+	checkpoints = checkpoints && (checkpoint_interval > 0.0f || options.resume || range);
+	const std::string checkpoint_file = checkpoints ? checkpointFilename(options) : std::string();
+	unsigned long long checkpoint_key = 0;
+	if (checkpoints) {
+		// the same scene and settings from a different camera or depth isn't the same image
+		const Camera& cam = renderState->camera;
+		checkpoint_key = utilityCore::hashBytes(&cam.position, sizeof(cam.position), options.scene_key);
+		checkpoint_key = utilityCore::hashBytes(&cam.lookAt, sizeof(cam.lookAt), checkpoint_key);
+		checkpoint_key = utilityCore::hashBytes(&cam.up, sizeof(cam.up), checkpoint_key);
+		checkpoint_key = utilityCore::hashBytes(&renderState->traceDepth, sizeof(renderState->traceDepth), checkpoint_key);
+	}
+	if (checkpoints && options.resume) {
+		RenderCheckpoint checkpoint;
+		if (!readCheckpoint(checkpoint_file, checkpoint)) {
+			cout << "No checkpoint at " << checkpoint_file << ", starting from the first sample" << endl;
+		}
+		else if (checkpoint.scene_key != checkpoint_key) {
+			cout << checkpoint_file << " was rendered from another scene, settings or camera, starting from the first sample" << endl;
+		}
+		else if (checkpoint.first_iteration != firstIteration) {
+			cout << checkpoint_file << " starts after iteration " << checkpoint.first_iteration << ", not " << firstIteration
+				<< ", starting from the first sample" << endl;
+		}
+		else if (pathtraceLoadAccumulation(checkpoint)) {
+			iteration = checkpoint.iteration;
+			cout << "Resuming from " << checkpoint_file << " at " << iteration - firstIteration << " samples" << endl;
+		}
+	}
+	auto last_checkpoint = start;
+
+	// --hybrid, the host's samples are merged into the device's sums once the frame is done. the
+	// GPU's count stays in iteration until then
+	CPUAssist* assist = NULL;
+	if (options.hybrid && hybridApplies(scene, checkpoints)) {
+		assist = cpuAssistStart(scene, options.cpu_threads, iteration, spp);
+	}
+	float gpu_seconds = 0.0f;
+
+	const int save_interval = assist != NULL ? 0 : scene->render_settings.save_interval;
+	while ((assist != NULL || iteration < spp) && stop_reason == NULL) {
+		auto sample_start = std::chrono::steady_clock::now();
+		const int sample = assist != NULL ? cpuAssistClaim(assist, gpu_seconds) : iteration + 1;
+		if (sample == 0) {
+			break;
+		}
+		iteration++;
+		pathtrace(NULL, 0, sample);
+		std::chrono::duration<float> sample_time = std::chrono::steady_clock::now() - sample_start;
+		gpu_seconds = sample_time.count();
+		saveRayCapture();
+		if (save_interval > 0 && iteration % save_interval == 0 && iteration < spp) {
+			requestImageSave(defaultImageName());
+		}
+		pollImageSave(false);
+
+		std::chrono::duration<float> since_checkpoint = std::chrono::steady_clock::now() - last_checkpoint;
+		if (checkpoint_interval > 0.0f && since_checkpoint.count() >= checkpoint_interval && iteration < spp) {
+			saveCheckpoint(checkpoint_file, checkpoint_key);
+			last_checkpoint = std::chrono::steady_clock::now();
+		}
+
+		std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+		stop_reason = renderStopReason(scene->render_settings, iteration, elapsed.count(), time_budget);
+		if (options.on_iteration && !options.on_iteration()) {
+			stop_reason = "cancel request";
+		}
+	}
+
+	// the next job may free the buffers a progressive save is reading
+	pollImageSave(true);
+	if (assist != NULL) {
+		std::vector<glm::vec3> cpu_sums;
+		const int gpu_samples = iteration - firstIteration;
+		const int cpu_samples = cpuAssistFinish(assist, stop_reason != NULL, cpu_sums);
+		if (cpu_samples > 0) {
+			RenderCheckpoint merged;
+			pathtraceReadAccumulation(merged);
+			for (size_t i = 0; i < merged.image.size() && i < cpu_sums.size(); i++) {
+				merged.image[i] += cpu_sums[i];
+			}
+			pathtraceLoadAccumulation(merged);
+			iteration += cpu_samples;
+		}
+		printf("Hybrid: %d GPU and %d CPU samples, the CPU took %.1f%% of the frame\n", gpu_samples, cpu_samples,
+			100.0f * cpu_samples / glm::max(gpu_samples + cpu_samples, 1));
+	}
+	if (checkpoints) {
+		// a later --resume with more samples carries on from here
+		saveCheckpoint(checkpoint_file, checkpoint_key);
+	}
+
+	JobResult result;
+	result.stats = pathtraceGetStats();
+	std::chrono::duration<float> render_time = std::chrono::steady_clock::now() - start;
+	result.samples = iteration - firstIteration;
+	result.seconds = render_time.count();
+	return result;
+}
+
+// overrides that only decide which pixels get samples, not what they converge to. a --resume can
+// change them, so a render with the per pixel statistics is refined where it's still noisy
+static bool samplePlacementOverride(const std::string& o) {
+	static const char* names[] = { "ADAPTIVE_THRESHOLD", "ADAPTIVE_MIN_SPP", "NOISE_TARGET", "SAMPLE_STATS" };
+	for (const char* name : names) {
+		const size_t length = strlen(name);
+		if (o.compare(0, length, name) == 0 && (o.size() == length || o[length] == '=')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// what a checkpoint has to match besides the camera, the scene file's contents and the overrides
+unsigned long long sceneKey(const std::string& scene_file, const std::vector<std::string>& overrides) {
+	std::ifstream file(scene_file, std::ios::binary);
+	std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	unsigned long long key = utilityCore::hashBytes(contents.data(), contents.size());
+	for (const std::string& o : overrides) {
+		if (!samplePlacementOverride(o)) {
+			key = utilityCore::hashBytes(o.c_str(), o.size() + 1, key);
+		}
+	}
+	return key;
+}
+
+std::string checkpointFilename(const HeadlessOptions& options) {
+	if (!options.checkpoint.empty()) {
+		return options.checkpoint;
+	}
+	std::string base = options.out.empty() ? renderState->imageName : options.out;
+	std::string::size_type dot = base.rfind('.');
+	if (dot != std::string::npos && base.find_first_of("/\\", dot) == std::string::npos) {
+		base = base.substr(0, dot);
+	}
+	return base + ".ckpt";
+}
+
+// bump whenever the layout below changes
+#define CHECKPOINT_VERSION 3
+
+// a checkpoint file is this header followed by the image sums and, with has_stats, the
+// luminance_sq and sample_counts arrays, width * height of each, then with has_fixed the
+// DETERMINISTIC integer sums, 3 per pixel. the sums cover iterations first_iteration + 1 ..
+// iteration, a --range partial starts past 0
+struct CheckpointHeader {
+	char magic[4];
+	int version;
+	int width;
+	int height;
+	int first_iteration;
+	int iteration;
+	int has_stats;
+	int has_fixed;
+	unsigned long long scene_key;
+};
+
+// written next to filename and renamed over it, so a kill mid write leaves the last one intact
+bool writeCheckpoint(const RenderCheckpoint& checkpoint, const std::string& filename) {
+	const std::string tmp = filename + ".tmp";
+	std::ofstream out(tmp, std::ios::binary);
+	if (!out.is_open()) {
+		cout << "ERROR: can't write checkpoint " << tmp << endl;
+		return false;
+	}
+	CheckpointHeader header;
+	memcpy(header.magic, "PTCP", 4);
+	header.version = CHECKPOINT_VERSION;
+	header.width = checkpoint.width;
+	header.height = checkpoint.height;
+	header.first_iteration = checkpoint.first_iteration;
+	header.iteration = checkpoint.iteration;
+	header.has_stats = !checkpoint.sample_counts.empty();
+	header.has_fixed = !checkpoint.fixed_image.empty();
+	header.scene_key = checkpoint.scene_key;
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)checkpoint.image.data(), checkpoint.image.size() * sizeof(glm::vec3));
+	if (header.has_stats) {
+		out.write((const char*)checkpoint.luminance_sq.data(), checkpoint.luminance_sq.size() * sizeof(float));
+		out.write((const char*)checkpoint.sample_counts.data(), checkpoint.sample_counts.size() * sizeof(int));
+	}
+	if (header.has_fixed) {
+		out.write((const char*)checkpoint.fixed_image.data(), checkpoint.fixed_image.size() * sizeof(unsigned long long));
+	}
+	out.close();
+	if (out.fail()) {
+		cout << "ERROR: can't write checkpoint " << tmp << endl;
+		return false;
+	}
+	// rename doesn't replace an existing file everywhere
+	std::remove(filename.c_str());
+	if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+		cout << "ERROR: can't move " << tmp << " to " << filename << endl;
+		return false;
+	}
+	cout << "Checkpoint " << filename << " at " << checkpoint.iteration - checkpoint.first_iteration << " samples" << endl;
+	return true;
+}
+
+bool readCheckpoint(const std::string& filename, RenderCheckpoint& checkpoint) {
+	std::ifstream in(filename, std::ios::binary);
+	CheckpointHeader header;
+	if (!in.is_open() || !in.read((char*)&header, sizeof(header)) || memcmp(header.magic, "PTCP", 4) != 0
+		|| header.version != CHECKPOINT_VERSION || header.width <= 0 || header.height <= 0) {
+		return false;
+	}
+	const int pixelcount = header.width * header.height;
+	checkpoint.width = header.width;
+	checkpoint.height = header.height;
+	checkpoint.first_iteration = header.first_iteration;
+	checkpoint.iteration = header.iteration;
+	checkpoint.scene_key = header.scene_key;
+	checkpoint.image.resize(pixelcount);
+	checkpoint.luminance_sq.resize(header.has_stats ? pixelcount : 0);
+	checkpoint.sample_counts.resize(header.has_stats ? pixelcount : 0);
+	checkpoint.fixed_image.resize(header.has_fixed ? 3 * pixelcount : 0);
+	in.read((char*)checkpoint.image.data(), pixelcount * sizeof(glm::vec3));
+	in.read((char*)checkpoint.luminance_sq.data(), checkpoint.luminance_sq.size() * sizeof(float));
+	in.read((char*)checkpoint.sample_counts.data(), checkpoint.sample_counts.size() * sizeof(int));
+	in.read((char*)checkpoint.fixed_image.data(), checkpoint.fixed_image.size() * sizeof(unsigned long long));
+	return !in.fail();
+}
+
+// reads the accumulation back now and writes it on imageWriter, rendering goes on meanwhile
+void saveCheckpoint(const std::string& filename, unsigned long long key) {
+	RenderCheckpoint* checkpoint = new RenderCheckpoint();
+	pathtraceReadAccumulation(*checkpoint);
+	checkpoint->first_iteration = firstIteration;
+	checkpoint->iteration = iteration;
+	checkpoint->scene_key = key;
+	runOnImageWriter([checkpoint, filename]() {
+		writeCheckpoint(*checkpoint, filename);
+		delete checkpoint;
+	});
+}
+
+// bump whenever the layout below or a struct in it changes
+#define RAY_CAPTURE_VERSION 2
+
+// a .rays file is this header followed by the arrays of RayCapture in its order, counts[i] of
+// each. the sizes are checked on read, a file only replays on builds with the same layouts
+struct RayCaptureHeader {
+	char magic[4];
+	int version;
+	int iteration;
+	int bounce;
+	int wide_bvh_width;
+	int struct_sizes[8];
+	unsigned long long counts[9];
+};
+
+static void rayCaptureSizes(int* sizes) {
+	sizes[0] = sizeof(CapturedRay);
+	sizes[1] = sizeof(Geom);
+	sizes[2] = sizeof(GeomGPU);
+	sizes[3] = sizeof(BVHNode_GPU);
+	sizes[4] = sizeof(BLAS);
+	sizes[5] = sizeof(TriIntersect);
+	sizes[6] = sizeof(WideBVHNode_GPU);
+	sizes[7] = 0;
+}
+
+template <typename T>
+static void writeArray(std::ofstream& out, const std::vector<T>& values) {
+	out.write((const char*)values.data(), values.size() * sizeof(T));
+}
+
+template <typename T>
+static void readArray(std::ifstream& in, std::vector<T>& values, unsigned long long count) {
+	values.resize(count);
+	in.read((char*)values.data(), count * sizeof(T));
+}
+
+bool writeRayCapture(const RayCapture& capture, const std::string& filename) {
+	std::ofstream out(filename, std::ios::binary);
+	if (!out.is_open()) {
+		cout << "ERROR: can't write ray capture " << filename << endl;
+		return false;
+	}
+	RayCaptureHeader header = {};
+	memcpy(header.magic, "PTRC", 4);
+	header.version = RAY_CAPTURE_VERSION;
+	header.iteration = capture.iteration;
+	header.bounce = capture.bounce;
+	header.wide_bvh_width = WIDE_BVH_WIDTH;
+	rayCaptureSizes(header.struct_sizes);
+	header.counts[0] = capture.path_rays.size();
+	header.counts[1] = capture.shadow_rays.size();
+	header.counts[2] = capture.geoms.size();
+	header.counts[3] = capture.geom_records.size();
+	header.counts[4] = capture.tlas_nodes.size();
+	header.counts[5] = capture.blases.size();
+	header.counts[6] = capture.tris.size();
+	header.counts[7] = capture.bvh_nodes.size();
+	header.counts[8] = capture.wide_bvh_nodes.size();
+	out.write((const char*)&header, sizeof(header));
+	writeArray(out, capture.path_rays);
+	writeArray(out, capture.shadow_rays);
+	writeArray(out, capture.geoms);
+	writeArray(out, capture.geom_records);
+	writeArray(out, capture.tlas_nodes);
+	writeArray(out, capture.blases);
+	writeArray(out, capture.tris);
+	writeArray(out, capture.bvh_nodes);
+	writeArray(out, capture.wide_bvh_nodes);
+	out.close();
+	if (out.fail()) {
+		cout << "ERROR: can't write ray capture " << filename << endl;
+		return false;
+	}
+	cout << "Ray capture " << filename << endl;
+	return true;
+}
+
+bool readRayCapture(const std::string& filename, RayCapture& capture) {
+	std::ifstream in(filename, std::ios::binary);
+	RayCaptureHeader header;
+	int sizes[8];
+	rayCaptureSizes(sizes);
+	if (!in.is_open() || !in.read((char*)&header, sizeof(header)) || memcmp(header.magic, "PTRC", 4) != 0
+		|| header.version != RAY_CAPTURE_VERSION) {
+		cout << "ERROR: " << filename << " isn't a ray capture" << endl;
+		return false;
+	}
+	if (header.wide_bvh_width != WIDE_BVH_WIDTH || memcmp(header.struct_sizes, sizes, sizeof(sizes)) != 0) {
+		cout << "ERROR: " << filename << " was captured by a build with other BVH or ray layouts" << endl;
+		return false;
+	}
+	capture.iteration = header.iteration;
+	capture.bounce = header.bounce;
+	readArray(in, capture.path_rays, header.counts[0]);
+	readArray(in, capture.shadow_rays, header.counts[1]);
+	readArray(in, capture.geoms, header.counts[2]);
+	readArray(in, capture.geom_records, header.counts[3]);
+	readArray(in, capture.tlas_nodes, header.counts[4]);
+	readArray(in, capture.blases, header.counts[5]);
+	readArray(in, capture.tris, header.counts[6]);
+	readArray(in, capture.bvh_nodes, header.counts[7]);
+	readArray(in, capture.wide_bvh_nodes, header.counts[8]);
+	if (in.fail()) {
+		cout << "ERROR: " << filename << " is cut short" << endl;
+		return false;
+	}
+	return true;
+}
+
+// CAPTURE_RAYS, writes <OUTFILE>.rays once the iteration it names has been traced
+void saveRayCapture() {
+	RayCapture capture;
+	if (pathtraceTakeRayCapture(capture)) {
+		writeRayCapture(capture, scene->state.imageName + ".rays");
+	}
+}
+
+// --replay-rays: the captured path rays and shadow rays traced by themselves, the GPU's best of
+// repeat runs and with cpu the host traversal too, whose hits are checked against the GPU's.
+// stackless walks the binary trees like STACKLESS_BVH on both
+int replayRayCapture(const std::string& filename, int repeat, bool cpu, bool stackless) {
+	RayCapture capture;
+	if (!readRayCapture(filename, capture)) {
+		return 1;
+	}
+	cout << filename << ": iteration " << capture.iteration << ", bounce " << capture.bounce << ", " << capture.geoms.size()
+		<< " geoms, " << capture.tris.size() << " tris" << endl;
+	int status = 0;
+	for (int set = 0; set < 2; set++) {
+		const bool shadow = set == 1;
+		const std::vector<CapturedRay>& rays = shadow ? capture.shadow_rays : capture.path_rays;
+		if (rays.empty()) {
+			continue;
+		}
+		std::vector<int> hit_geoms, nodes;
+		const float gpu_ms = pathtraceReplayRays(capture, rays, shadow, stackless, repeat, hit_geoms, nodes);
+		long long hits = 0, total_nodes = 0;
+		for (size_t i = 0; i < rays.size(); i++) {
+			hits += hit_geoms[i] != -1;
+			total_nodes += nodes[i];
+		}
+		const char* name = shadow ? "shadow" : capture.bounce == 0 ? "camera" : "bounce";
+		printf("%s rays: %zu, %.1f%% %s, %.1f nodes per ray\n", name, rays.size(), 100.0 * hits / rays.size(),
+			shadow ? "occluded" : "hit", (double)total_nodes / rays.size());
+		printf("  GPU: %.3f ms, %.1f Mrays/s (best of %d)\n", gpu_ms, rays.size() / (gpu_ms * 1000.0), glm::max(repeat, 1));
+		if (cpu) {
+			std::vector<int> cpu_hit_geoms, cpu_nodes;
+			const float cpu_ms = cpuReplayRays(capture, rays, shadow, stackless, cpu_hit_geoms, cpu_nodes);
+			size_t matching = 0;
+			for (size_t i = 0; i < rays.size(); i++) {
+				// any hit rays can stop on different occluders, only whether they were stopped has to agree
+				matching += shadow ? (cpu_hit_geoms[i] != -1) == (hit_geoms[i] != -1) : cpu_hit_geoms[i] == hit_geoms[i];
+			}
+			printf("  CPU: %.3f ms, %.1f Mrays/s on %d threads, %zu / %zu hits match the GPU\n", cpu_ms, rays.size() / (cpu_ms * 1000.0),
+				utilityCore::numThreads(), matching, rays.size());
+			if (matching != rays.size()) {
+				status = 1;
+			}
+		}
+	}
+	return status;
+}
+
+// sums the --range partials of one frame and writes out the image, or a merged checkpoint
+// for a .ckpt out so nodes can merge in stages. the partials have to share scene, settings,
+// camera and resolution, overlapping ranges are merged but counted twice
+int mergePartials(const std::string& out, const std::vector<std::string>& partials) {
+	RenderCheckpoint merged;
+	std::vector<glm::ivec2> ranges;
+	for (const std::string& file : partials) {
+		RenderCheckpoint partial;
+		if (!readCheckpoint(file, partial)) {
+			cout << "ERROR: " << file << " isn't a checkpoint" << endl;
+			return 1;
+		}
+		if (ranges.empty()) {
+			merged = partial;
+		}
+		else if (partial.width != merged.width || partial.height != merged.height || partial.scene_key != merged.scene_key
+			|| partial.sample_counts.size() != merged.sample_counts.size() || partial.fixed_image.size() != merged.fixed_image.size()) {
+			cout << "ERROR: " << file << " was rendered from another scene, settings, camera or resolution than " << partials[0] << endl;
+			return 1;
+		}
+		else {
+			for (int i = 0; i < merged.image.size(); i++) {
+				merged.image[i] += partial.image[i];
+			}
+			for (int i = 0; i < merged.sample_counts.size(); i++) {
+				merged.luminance_sq[i] += partial.luminance_sq[i];
+				merged.sample_counts[i] += partial.sample_counts[i];
+			}
+			for (int i = 0; i < merged.fixed_image.size(); i++) {
+				merged.fixed_image[i] += partial.fixed_image[i];
+			}
+		}
+		ranges.push_back(glm::ivec2(partial.first_iteration, partial.iteration));
+	}
+	// DETERMINISTIC partials add up exactly, the image is what one render of all of them would hold
+	for (int i = 0; i < (int)merged.fixed_image.size() / 3; i++) {
+		merged.image[i] = resolveFixedSum(&merged.fixed_image[3 * i]);
+	}
+
+	std::sort(ranges.begin(), ranges.end(), [](const glm::ivec2& a, const glm::ivec2& b) { return a.x < b.x; });
+	int samples = 0;
+	bool contiguous = true;
+	for (int i = 0; i < ranges.size(); i++) {
+		samples += ranges[i].y - ranges[i].x;
+		if (i > 0 && ranges[i].x < ranges[i - 1].y) {
+			cout << "WARNING: iterations " << ranges[i].x + 1 << " to " << glm::min(ranges[i].y, ranges[i - 1].y)
+				<< " are in more than one partial, their samples count twice" << endl;
+		}
+		contiguous = contiguous && (i == 0 || ranges[i].x == ranges[i - 1].y);
+	}
+	cout << "Merged " << partials.size() << " partials, " << samples << " samples" << endl;
+
+	if (hasExtension(out, ".ckpt")) {
+		// a resume can only carry on from the end of an unbroken range
+		merged.first_iteration = ranges.front().x;
+		merged.iteration = contiguous ? ranges.back().y : merged.first_iteration + samples;
+		if (!contiguous) {
+			cout << "WARNING: the ranges have gaps, resuming " << out << " would repeat samples" << endl;
+		}
+		return writeCheckpoint(merged, out) ? 0 : 1;
+	}
+
+	width = merged.width;
+	height = merged.height;
+	samples = glm::max(samples, 1);
+	ImageReadback kind = imageReadbackFor(out);
+	if (kind == READBACK_FLOAT) {
+		writeImageAsync(buildImage(merged.image, samples, glm::ivec2(width, height)), out);
+	}
+	else if (kind == READBACK_LDR) {
+		std::vector<uchar4> pixels(merged.image.size());
+		const ToneMapping tone = hostToneMapping(scene->render_settings, merged.image, samples);
+		for (int i = 0; i < pixels.size(); i++) {
+			pixels[i] = displayColor(merged.image[i], samples, tone);
+		}
+		writeImageAsync(buildLDRImage(pixels, glm::ivec2(width, height)), out);
+	}
+	else {
+		EXRImage* exr = new EXRImage();
+		exr->width = width;
+		exr->height = height;
+		unsigned short* planes[3];
+		planes[0] = (unsigned short*)exr->addChannel("R", EXR_HALF);
+		planes[1] = (unsigned short*)exr->addChannel("G", EXR_HALF);
+		planes[2] = (unsigned short*)exr->addChannel("B", EXR_HALF);
+		unsigned int* counts = merged.sample_counts.empty() ? NULL : (unsigned int*)exr->addChannel("samples", EXR_UINT);
+		float* variance = merged.sample_counts.empty() ? NULL : (float*)exr->addChannel("variance", EXR_FLOAT);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				int index = x + (y * width);
+				int flipped = (width - 1 - x) + (y * width);
+				glm::vec3 pix = merged.image[index] / (float)samples;
+				for (int c = 0; c < 3; c++) {
+					planes[c][flipped] = glm::packHalf1x16(pix[c]);
+				}
+				if (counts != NULL) {
+					counts[flipped] = merged.sample_counts[index];
+					variance[flipped] = meanVariance(luminance(pix), merged.luminance_sq[index], merged.sample_counts[index]);
+				}
+			}
+		}
+		runOnImageWriter([exr, out]() {
+			saveEXR(*exr, out);
+			delete exr;
+		});
+	}
+	return 0;
+}
+
+bool loadSequence(const std::string& filename, Sequence& sequence) {
+	std::ifstream fp_in(filename);
+	if (!fp_in.is_open()) {
+		cout << "Error reading sequence file " << filename << endl;
+		return false;
+	}
+
+	std::string line;
+	while (utilityCore::safeGetline(fp_in, line)) {
+		std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+		if (tokens.empty() || tokens[0][0] == '#') {
+			continue;
+		}
+		if (tokens[0] == "FRAMES" && tokens.size() > 1) {
+			sequence.frames = glm::max(atoi(tokens[1].c_str()), 1);
+			continue;
+		}
+
+		// KEY FRAME CAMERA [EYE X Y Z] [LOOKAT X Y Z] or KEY FRAME OBJECT ID [TRANS X Y Z] [ROTAT X Y Z] [SCALE X Y Z]
+		bool camera = tokens.size() > 2 && tokens[2] == "CAMERA";
+		bool object = tokens.size() > 3 && tokens[2] == "OBJECT";
+		if (tokens[0] != "KEY" || (!camera && !object)) {
+			cout << "WARNING: ignoring sequence line " << line << endl;
+			continue;
+		}
+		int frame = atoi(tokens[1].c_str());
+		int object_id = camera ? -1 : atoi(tokens[3].c_str());
+		for (int i = camera ? 3 : 4; i + 3 < tokens.size(); i += 4) {
+			const std::string& channel = tokens[i];
+			glm::vec3 value(atof(tokens[i + 1].c_str()), atof(tokens[i + 2].c_str()), atof(tokens[i + 3].c_str()));
+
+			SequenceTrack* track = NULL;
+			for (SequenceTrack& t : sequence.tracks) {
+				if (t.object_id == object_id && t.channel == channel) {
+					track = &t;
+				}
+			}
+			if (track == NULL) {
+				sequence.tracks.push_back(SequenceTrack());
+				track = &sequence.tracks.back();
+				track->object_id = object_id;
+				track->channel = channel;
+			}
+			track->keys.push_back(std::make_pair(frame, value));
+		}
+	}
+
+	for (SequenceTrack& track : sequence.tracks) {
+		std::stable_sort(track.keys.begin(), track.keys.end(),
+			[](const std::pair<int, glm::vec3>& a, const std::pair<int, glm::vec3>& b) { return a.first < b.first; });
+	}
+	return true;
+}
+
+// linear between the keys around frame, held before the first and after the last
+glm::vec3 sampleTrack(const SequenceTrack& track, int frame) {
+	if (frame <= track.keys.front().first) {
+		return track.keys.front().second;
+	}
+	for (int k = 1; k < track.keys.size(); ++k) {
+		if (frame <= track.keys[k].first) {
+			const std::pair<int, glm::vec3>& a = track.keys[k - 1];
+			const std::pair<int, glm::vec3>& b = track.keys[k];
+			float t = (float)(frame - a.first) / glm::max(b.first - a.first, 1);
+			return glm::mix(a.second, b.second, t);
+		}
+	}
+	return track.keys.back().second;
+}
+
+// name without its .png, .hdr or .exr, and that extension (png if it has none) for numbered outputs
+static void splitImageName(const std::string& name, std::string& base, std::string& extension) {
+	base = name;
+	extension = ".png";
+	std::string::size_type dot = base.rfind('.');
+	if (dot != std::string::npos && (base.substr(dot) == ".png" || base.substr(dot) == ".hdr" || base.substr(dot) == ".exr")) {
+		extension = base.substr(dot);
+		base = base.substr(0, dot);
+	}
+}
+
+// renders every frame of options.sequence with the scene resident on the device, only the
+// camera and the keyed geoms' transforms change between frames. frame N goes to
+// <out>.NNNN.<ext> (the scene's OUTFILE and png by default), written on a background thread
+// while the next frame traces. expects pathtraceInit to have been called for the scene
+int renderSequence(const HeadlessOptions& options) {
+	Sequence sequence;
+	if (!loadSequence(options.sequence, sequence)) {
+		return 1;
+	}
+
+	std::string base, extension;
+	splitImageName(options.out.empty() ? scene->state.imageName : options.out, base, extension);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < sequence.frames; ++frame) {
+		Camera& cam = scene->state.camera;
+		bool geoms_changed = false;
+		for (const SequenceTrack& track : sequence.tracks) {
+			glm::vec3 value = sampleTrack(track, frame);
+			if (track.object_id == -1) {
+				if (track.channel == "EYE") {
+					cam.position = value;
+				}
+				else if (track.channel == "LOOKAT") {
+					cam.lookAt = value;
+				}
+				continue;
+			}
+			if (track.object_id < 0 || track.object_id >= scene->geom_IDs.size()) {
+				continue;
+			}
+			Geom& geom = scene->geoms[scene->geom_IDs[track.object_id]];
+			if (track.channel == "TRANS") {
+				geom.translation = value;
+			}
+			else if (track.channel == "ROTAT") {
+				geom.rotation = value;
+			}
+			else if (track.channel == "SCALE") {
+				geom.scale = value;
+			}
+			geoms_changed = true;
+		}
+		Scene::updateCameraBasis(cam);
+		if (geoms_changed) {
+			for (Geom& geom : scene->geoms) {
+				geom.transform = utilityCore::buildTransformationMatrix(geom.translation, geom.rotation, geom.scale);
+				geom.inverseTransform = glm::inverse(geom.transform);
+				geom.invTranspose = glm::inverseTranspose(geom.transform);
+			}
+			pathtraceUpdateGeoms();
+		}
+		pathtraceResetImage();
+
+		const char* stop_reason = NULL;
+		JobResult result = renderSamples(options, stop_reason);
+
+		char frame_number[16];
+		snprintf(frame_number, sizeof(frame_number), ".%04d", frame);
+		writeImage(base + frame_number + extension);
+
+		cout << "Frame " << frame + 1 << " / " << sequence.frames << ": ";
+		reportRender(result.seconds, stop_reason);
+	}
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	cout << "Rendered " << sequence.frames << " frames in " << elapsed.count() << " s" << endl;
+	return 0;
+}
+
+bool loadDatasetSpec(const std::string& filename, DatasetSpec& spec) {
+	std::ifstream fp_in(filename);
+	if (!fp_in.is_open()) {
+		cout << "Error reading dataset file " << filename << endl;
+		return false;
+	}
+
+	std::string line;
+	while (utilityCore::safeGetline(fp_in, line)) {
+		std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+		if (tokens.empty() || tokens[0][0] == '#') {
+			continue;
+		}
+		std::vector<float> v;
+		for (int i = 1; i < tokens.size(); i++) {
+			v.push_back(atof(tokens[i].c_str()));
+		}
+		if (tokens[0] == "VIEWS" && v.size() >= 1) {
+			spec.views = glm::max((int)v[0], 1);
+		}
+		else if (tokens[0] == "SEED" && v.size() >= 1) {
+			spec.seed = (unsigned int)atoi(tokens[1].c_str());
+		}
+		else if (tokens[0] == "CONTEXTS" && v.size() >= 1) {
+			spec.contexts = glm::max((int)v[0], 1);
+		}
+		// EYE and LOOKAT MIN_X MIN_Y MIN_Z MAX_X MAX_Y MAX_Z
+		else if (tokens[0] == "EYE" && v.size() >= 6) {
+			spec.has_eye = true;
+			spec.eye_min = glm::vec3(v[0], v[1], v[2]);
+			spec.eye_max = glm::vec3(v[3], v[4], v[5]);
+		}
+		else if (tokens[0] == "LOOKAT" && v.size() >= 6) {
+			spec.has_lookat = true;
+			spec.lookat_min = glm::vec3(v[0], v[1], v[2]);
+			spec.lookat_max = glm::vec3(v[3], v[4], v[5]);
+		}
+		// ORBIT X Y Z RADIUS_MIN RADIUS_MAX ELEVATION_MIN ELEVATION_MAX
+		else if (tokens[0] == "ORBIT" && v.size() >= 7) {
+			spec.orbit = true;
+			spec.orbit_center = glm::vec3(v[0], v[1], v[2]);
+			spec.orbit_radius = glm::vec2(v[3], v[4]);
+			spec.orbit_elevation = glm::vec2(v[5], v[6]);
+		}
+		// COLOR MATERIAL_ID AMOUNT and EMITTANCE MATERIAL_ID MIN MAX
+		else if ((tokens[0] == "COLOR" && v.size() >= 2) || (tokens[0] == "EMITTANCE" && v.size() >= 3)) {
+			DatasetJitter* jitter = NULL;
+			for (DatasetJitter& j : spec.jitters) {
+				if (j.material_id == (int)v[0]) {
+					jitter = &j;
+				}
+			}
+			if (jitter == NULL) {
+				spec.jitters.push_back(DatasetJitter());
+				jitter = &spec.jitters.back();
+				jitter->material_id = (int)v[0];
+			}
+			if (tokens[0] == "COLOR") {
+				jitter->color = v[1];
+			}
+			else {
+				jitter->emittance = glm::vec2(v[1], v[2]);
+			}
+		}
+		else {
+			cout << "WARNING: ignoring dataset line " << line << endl;
+		}
+	}
+	return true;
+}
+
+// the camera and jittered materials of one view, drawn with a seed of the view's own so the view
+// comes out the same whichever context renders it. label is its line of the views file
+static void drawDatasetView(const DatasetSpec& spec, int view, const Camera& base_camera, const std::vector<Material>& base_materials,
+	Camera& cam, std::vector<Material>& materials, std::string& label)
+{
+	std::mt19937 rng(spec.seed * 2654435761u + (unsigned int)view);
+	std::uniform_real_distribution<float> u(0.0f, 1.0f);
+	auto inBox = [&](const glm::vec3& box_min, const glm::vec3& box_max) {
+		glm::vec3 t;
+		for (int c = 0; c < 3; c++) {
+			t[c] = u(rng);
+		}
+		return glm::mix(box_min, box_max, t);
+	};
+
+	cam = base_camera;
+	if (spec.orbit) {
+		const float azimuth = TWO_PI * u(rng);
+		const float elevation = glm::radians(glm::mix(spec.orbit_elevation.x, spec.orbit_elevation.y, u(rng)));
+		const float radius = glm::mix(spec.orbit_radius.x, spec.orbit_radius.y, u(rng));
+		cam.position = spec.orbit_center
+			+ radius * glm::vec3(cos(elevation) * sin(azimuth), sin(elevation), cos(elevation) * cos(azimuth));
+		cam.lookAt = spec.orbit_center;
+	}
+	else if (spec.has_eye) {
+		cam.position = inBox(spec.eye_min, spec.eye_max);
+	}
+	if (spec.has_lookat) {
+		cam.lookAt = inBox(spec.lookat_min, spec.lookat_max);
+	}
+	Scene::updateCameraBasis(cam);
+
+	std::ostringstream ss;
+	ss << view << " EYE " << cam.position.x << " " << cam.position.y << " " << cam.position.z
+		<< " LOOKAT " << cam.lookAt.x << " " << cam.lookAt.y << " " << cam.lookAt.z;
+	materials = base_materials;
+	for (const DatasetJitter& jitter : spec.jitters) {
+		if (jitter.material_id < 0 || jitter.material_id >= materials.size()) {
+			continue;
+		}
+		Material& material = materials[jitter.material_id];
+		for (int c = 0; c < 3; c++) {
+			material.R[c] = glm::clamp(material.R[c] * (1.0f + jitter.color * (2.0f * u(rng) - 1.0f)), 0.0f, 1.0f);
+		}
+		if (jitter.emittance.x >= 0.0f) {
+			material.emittance = glm::mix(jitter.emittance.x, jitter.emittance.y, u(rng));
+		}
+		ss << " MATERIAL " << jitter.material_id << " RGB " << material.R.x << " " << material.R.y << " " << material.R.z
+			<< " EMITTANCE " << material.emittance;
+	}
+	label = ss.str();
+}
+
+// the context's image of samples samples to filename: read back here, encoded on writer once the
+// write it had before is done. context_scene is the context's, for the resolution and the sums
+static void writeContextImage(Scene* context_scene, int samples, const std::string& filename, std::thread& writer) {
+	const glm::ivec2 resolution = context_scene->state.camera.resolution;
+	std::function<void()> write;
+	const ImageReadback kind = imageReadbackFor(filename);
+	if (kind == READBACK_LDR) {
+		std::vector<uchar4> pixels;
+		pathtraceRetrieveLDRImage(samples, pixels);
+		image* img = buildLDRImage(pixels, resolution);
+		write = [img, filename]() {
+			saveImageFile(*img, filename);
+			delete img;
+		};
+	}
+	else if (kind == READBACK_HALF) {
+		EXRImage* exr = new EXRImage();
+		pathtraceRetrieveHalfImage(samples, *exr);
+		write = [exr, filename]() {
+			saveEXR(*exr, filename);
+			delete exr;
+		};
+	}
+	else {
+		pathtraceRetrieveImage();
+		image* img = buildImage(context_scene->state.image, samples, resolution);
+		write = [img, filename]() {
+			saveImageFile(*img, filename);
+			delete img;
+		};
+	}
+	if (writer.joinable()) {
+		writer.join();
+	}
+	writer = std::thread(write);
+}
+
+// traces views off next_view until there are none left, in the calling thread's renderer context
+// with context_scene uploaded. a view only moves the camera and uploads the jittered materials
+static void renderDatasetViews(Scene* context_scene, const DatasetSpec& spec, int spp, const std::string& base, const std::string& extension,
+	const Camera& base_camera, const std::vector<Material>& base_materials, std::atomic<int>& next_view, std::vector<std::string>& labels)
+{
+	std::thread writer;
+	std::vector<Material> materials;
+	for (int view = next_view++; view < spec.views; view = next_view++) {
+		drawDatasetView(spec, view, base_camera, base_materials, context_scene->state.camera, materials, labels[view]);
+		for (const DatasetJitter& jitter : spec.jitters) {
+			if (jitter.material_id >= 0 && jitter.material_id < materials.size()) {
+				context_scene->materials[jitter.material_id] = materials[jitter.material_id];
+				pathtraceUpdateMaterial(jitter.material_id);
+			}
+		}
+		pathtraceResetImage();
+		for (int i = 1; i <= spp; i++) {
+			pathtrace(DisplayTarget(), 0, i);
+		}
+		char view_number[16];
+		snprintf(view_number, sizeof(view_number), ".%05d", view);
+		writeContextImage(context_scene, spp, base + view_number + extension, writer);
+	}
+	if (writer.joinable()) {
+		writer.join();
+	}
+}
+
+// renders the views of options.dataset with the scene resident, each only moves the camera and
+// uploads the jittered materials. view N goes to <out>.NNNNN.<ext> (the scene's OUTFILE and png
+// by default) and its camera and materials to a line of <out>.views.txt, the images encoded in
+// the background while the next views trace. CONTEXTS > 1 traces that many views at once, the
+// others on threads of their own (renderer contexts with their own streams and copies of the
+// scene), which keeps the device busy at the small resolutions datasets are rendered at.
+// expects pathtraceInit to have been called for the scene
+int renderDataset(const HeadlessOptions& options) {
+	DatasetSpec spec;
+	if (!loadDatasetSpec(options.dataset, spec)) {
+		return 1;
+	}
+	std::string base, extension;
+	splitImageName(options.out.empty() ? scene->state.imageName : options.out, base, extension);
+	const int spp = options.spp > 0 ? options.spp : scene->state.iterations;
+	if (spec.contexts > 1 && scene->host_geometry_released) {
+		cout << "CONTEXTS: FREE_HOST_GEOMETRY left nothing to copy, rendering on one context" << endl;
+		spec.contexts = 1;
+	}
+
+	const Camera base_camera = scene->state.camera;
+	const std::vector<Material> base_materials = scene->materials;
+	std::vector<std::string> labels(spec.views);
+	std::atomic<int> next_view(0);
+	auto start = std::chrono::steady_clock::now();
+	// copied before the first view changes the scene's materials
+	std::vector<Scene*> copies;
+	for (int c = 1; c < spec.contexts; c++) {
+		copies.push_back(new Scene(*scene));
+	}
+	std::vector<std::thread> contexts;
+	for (Scene* copy : copies) {
+		contexts.push_back(std::thread([&, copy]() {
+			pathtraceInit(copy);
+			renderDatasetViews(copy, spec, spp, base, extension, base_camera, base_materials, next_view, labels);
+			pathtraceFree();
+			delete copy;
+		}));
+	}
+	renderDatasetViews(scene, spec, spp, base, extension, base_camera, base_materials, next_view, labels);
+	for (std::thread& context : contexts) {
+		context.join();
+	}
+	scene->state.camera = base_camera;
+	scene->materials = base_materials;
+
+	std::ofstream views(base + ".views.txt");
+	for (const std::string& label : labels) {
+		views << label << "\n";
+	}
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	cout << "Rendered " << spec.views << " views of " << spp << " samples in " << elapsed.count() << " s ("
+		<< spec.views / glm::max(elapsed.count(), 1e-6f) << " views/s)" << endl;
+	return 0;
+}
+
+// renders every line of job_file headless, one after the other in this process. a line is
+// SCENEFILE [--spp N] [--time SECONDS] [--out FILE] [--eye X Y Z] [--lookat X Y Z] [KEY=VALUE ...],
+// empty lines and lines starting with # are skipped. consecutive jobs on the same scene file and
+// settings only change the camera and keep everything on the device, other scenes of the same
+// resolution keep the pixel buffers and only upload their geometry. results, if given, gets
+// every job's render time and stats. update_references gives every job --update-references
+int renderBatch(const char* job_file, std::vector<BenchmarkResult>* results, bool update_references) {
+	std::ifstream fp_jobs(job_file);
+	if (!fp_jobs.is_open()) {
+		cout << "Error reading batch file " << job_file << endl;
+		return 1;
+	}
+
+	std::string loaded_file;
+	std::vector<std::string> loaded_overrides;
+	Camera loaded_camera;
+	double startup_ms[NUM_STARTUP_PHASES] = {};
+	scene = NULL;
+
+	int num_jobs = 0;
+	int failed_jobs = 0; // didn't match their --reference
+	auto start = std::chrono::steady_clock::now();
+	std::string line;
+	while (utilityCore::safeGetline(fp_jobs, line)) {
+		std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+		if (tokens.empty() || tokens[0][0] == '#') {
+			continue;
+		}
+
+		HeadlessOptions options;
+		std::vector<std::string> overrides;
+		parseJobArgs(std::vector<std::string>(tokens.begin() + 1, tokens.end()), options, overrides);
+		options.scene_key = sceneKey(tokens[0], overrides);
+		options.update_references = options.update_references || update_references;
+
+		if (scene != NULL && tokens[0] == loaded_file && overrides == loaded_overrides) {
+			// camera variation, scene data stays resident
+			scene->state.camera = loaded_camera;
+			pathtraceResetImage();
+			std::fill(startup_ms, startup_ms + NUM_STARTUP_PHASES, 0.0);
+		}
+		else {
+			if (scene != NULL) {
+				pathtraceFreeScene();
+				delete scene;
+			}
+			// AUTO_TUNE loads and uploads the scene over and over, only this job's own load and
+			// upload count towards its startup phases
+			resetStartupPhases();
+			scene = new Scene(tokens[0], overrides);
+			for (int p = 0; p < NUM_STARTUP_PHASES; p++) {
+				startup_ms[p] = startupPhaseMs(p);
+			}
+			applyAutoTune(scene, tokens[0], overrides);
+			loaded_file = tokens[0];
+			loaded_overrides = overrides;
+			loaded_camera = scene->state.camera;
+			resetStartupPhases();
+			pathtraceInit(scene);
+			for (int p = 0; p < NUM_STARTUP_PHASES; p++) {
+				startup_ms[p] += startupPhaseMs(p);
+			}
+		}
+		applyCameraOverrides(options, scene->state.camera);
+
+		JobResult job = renderJob(options);
+		if (!job.passed) {
+			failed_jobs++;
+		}
+		if (results != NULL) {
+			BenchmarkResult result;
+			result.scene = tokens[0];
+			for (int i = 1; i < tokens.size(); i++) {
+				result.settings += (i > 1 ? " " : "") + tokens[i];
+			}
+			result.resolution = scene->state.camera.resolution;
+			result.job = job;
+			std::copy(startup_ms, startup_ms + NUM_STARTUP_PHASES, result.startup_ms);
+			results->push_back(result);
+		}
+		num_jobs++;
+	}
+
+	if (scene != NULL) {
+		pathtraceFree();
+		delete scene;
+	}
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	cout << "Batch of " << num_jobs << " jobs done in " << elapsed.count() << " s" << endl;
+	if (failed_jobs > 0) {
+		cout << failed_jobs << " of them didn't match their reference" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+// AUTO_TUNE, the pipeline options tried for a scene. upload ones are read in pathtraceInit and
+// reload the scene for every value, the rest are switched on the uploaded scene between runs
+struct TuneOption {
+	const char* key;
+	std::vector<const char*> values; // as KEY=VALUE[,VALUE] overrides take them
+	bool upload;
+};
+
+static const std::vector<TuneOption>& tuneOptions() {
+	static const std::vector<TuneOption> options = {
+		{ "CACHE_FIRST_BOUNCE", { "0", "1" }, true },
+		{ "BLOCK_SIZE", { "all,0", "all,128", "all,256" }, true },
+		{ "PATH_ORDER", { "SCANLINE", "TILES", "MORTON" }, true },
+		{ "STREAM_COMPACT", { "NONE", "THRUST", "SCAN", "WARP" }, false },
+		{ "SORT_MATERIALS", { "0", "1" }, false },
+		{ "FUSED_SHADING", { "0", "1" }, false },
+	};
+	return options;
+}
+
+static bool applyOverride(Scene* s, const std::string& setting) {
+	std::string line = setting;
+	std::replace(line.begin(), line.end(), '=', ' ');
+	std::replace(line.begin(), line.end(), ',', ' ');
+	std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+	return tokens.size() >= 2 && s->applySetting(tokens);
+}
+
+// seconds per iteration of the uploaded scene, after a few warm up iterations
+static float timeIterations(int iterations) {
+	const int warmup = 2;
+	pathtraceResetImage();
+	for (int i = 1; i <= warmup; i++) {
+		pathtrace(NULL, 0, i);
+	}
+	pathtraceResetStats();
+	auto start = std::chrono::steady_clock::now();
+	for (int i = warmup + 1; i <= warmup + iterations; i++) {
+		pathtrace(NULL, 0, i);
+	}
+	// waits for every device to finish the iterations
+	pathtraceGetStats();
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / iterations;
+}
+
+// the tuned overrides cached for key in <scene file>.tune, one "key override..." line per scene
+// settings and GPU
+static bool readTuneCache(const std::string& path, unsigned long long key, std::vector<std::string>& tuned) {
+	std::ifstream file(path);
+	std::string line;
+	while (utilityCore::safeGetline(file, line)) {
+		std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+		if (!tokens.empty() && strtoull(tokens[0].c_str(), NULL, 16) == key) {
+			tuned.assign(tokens.begin() + 1, tokens.end());
+			return true;
+		}
+	}
+	return false;
+}
+
+static void writeTuneCache(const std::string& path, unsigned long long key, const std::vector<std::string>& tuned) {
+	std::vector<std::string> lines;
+	{
+		std::ifstream file(path);
+		std::string line;
+		while (utilityCore::safeGetline(file, line)) {
+			std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+			if (!tokens.empty() && strtoull(tokens[0].c_str(), NULL, 16) != key) {
+				lines.push_back(line);
+			}
+		}
+	}
+	char key_hex[17];
+	snprintf(key_hex, sizeof(key_hex), "%016llx", key);
+	std::string entry = key_hex;
+	for (const std::string& t : tuned) {
+		entry += " " + t;
+	}
+	lines.push_back(entry);
+	std::ofstream file(path);
+	for (const std::string& line : lines) {
+		file << line << "\n";
+	}
+}
+
+// AUTO_TUNE: the fastest values of the tuneOptions for scene_file with overrides on this GPU,
+// as overrides to apply on top. one option at a time, each keeping the fastest values found
+// so far, which takes a handful of short renders instead of every combination. options the
+// overrides already set are left alone, and CACHE_FIRST_BOUNCE is only tried when it renders
+// the same image, without anti-aliasing and depth of field. the pick is cached in
+// <scene file>.tune by the scene's contents, the overrides and the GPU. leaves no scene uploaded
+std::vector<std::string> autotuneScene(const std::string& scene_file, const std::vector<std::string>& overrides, int iterations) {
+	cudaDeviceProp prop;
+	cudaGetDeviceProperties(&prop, 0);
+	int device_count = 1;
+	cudaGetDeviceCount(&device_count);
+	unsigned long long key = sceneKey(scene_file, overrides);
+	key = utilityCore::hashBytes(prop.name, strlen(prop.name), key);
+	key = utilityCore::hashBytes(&device_count, sizeof(device_count), key);
+	key = utilityCore::hashBytes(&iterations, sizeof(iterations), key);
+
+	const std::string cache_file = scene_file + ".tune";
+	std::vector<std::string> tuned;
+	if (readTuneCache(cache_file, key, tuned)) {
+		cout << "AUTO_TUNE: using the options cached in " << cache_file << ":";
+		for (const std::string& t : tuned) {
+			cout << " " << t;
+		}
+		cout << endl;
+		return tuned;
+	}
+
+	std::vector<std::string> base = overrides;
+	base.push_back("AUTO_TUNE=0");
+	// the window's GL context doesn't exist yet when it tunes
+	base.push_back("RASTER_PRIMARY=0");
+	std::vector<const TuneOption*> options;
+	for (const TuneOption& option : tuneOptions()) {
+		bool overridden = false;
+		for (const std::string& o : overrides) {
+			overridden = overridden || o.compare(0, strlen(option.key) + 1, std::string(option.key) + "=") == 0;
+		}
+		if (!overridden) {
+			options.push_back(&option);
+		}
+	}
+
+	cout << "AUTO_TUNE: timing " << iterations << " iterations per option on " << prop.name << endl;
+	std::vector<std::string> chosen;
+	Scene* tune_scene = NULL;
+	float best_time = -1.0f;
+	for (int pass = 0; pass < 2; pass++) {
+		// upload options first, the rest then only need the one upload of the fastest of those
+		const bool upload = pass == 0;
+		for (const TuneOption* option : options) {
+			if (option->upload != upload) {
+				continue;
+			}
+			std::string best_value;
+			for (const char* value : option->values) {
+				const std::string setting = std::string(option->key) + "=" + value;
+				if (upload || tune_scene == NULL) {
+					if (tune_scene != NULL) {
+						pathtraceFreeScene();
+						delete tune_scene;
+					}
+					std::vector<std::string> job = base;
+					job.insert(job.end(), chosen.begin(), chosen.end());
+					job.push_back(setting);
+					tune_scene = new Scene(scene_file, job);
+					const RenderSettings& settings = tune_scene->render_settings;
+					if (settings.cache_first_bounce && (settings.anti_aliasing || tune_scene->state.camera.lens_radius > 0.0f)) {
+						// the cached pinhole rays would change the image
+						delete tune_scene;
+						tune_scene = NULL;
+						continue;
+					}
+					pathtraceInit(tune_scene);
+				}
+				else {
+					applyOverride(tune_scene, setting);
+				}
+				const float seconds = timeIterations(iterations);
+				printf("  %-28s %8.2f ms/iteration\n", setting.c_str(), seconds * 1000.0f);
+				if (best_value.empty() || seconds < best_time) {
+					best_value = setting;
+					best_time = seconds;
+				}
+			}
+			if (!upload && tune_scene != NULL) {
+				applyOverride(tune_scene, best_value);
+			}
+			if (!best_value.empty()) {
+				chosen.push_back(best_value);
+			}
+		}
+		if (upload && tune_scene != NULL) {
+			// the runs below start from the fastest upload options
+			pathtraceFreeScene();
+			delete tune_scene;
+			tune_scene = NULL;
+		}
+	}
+	if (tune_scene != NULL) {
+		pathtraceFreeScene();
+		delete tune_scene;
+	}
+
+	cout << "AUTO_TUNE: picked";
+	for (const std::string& t : chosen) {
+		cout << " " << t;
+	}
+	cout << ", cached in " << cache_file << endl;
+	writeTuneCache(cache_file, key, chosen);
+	return chosen;
+}
+
+// runs AUTO_TUNE for s when it asks for it and applies the options it picked, before s is uploaded
+void applyAutoTune(Scene* s, const std::string& scene_file, const std::vector<std::string>& overrides) {
+	if (s->render_settings.auto_tune <= 0) {
+		return;
+	}
+	for (const std::string& setting : autotuneScene(scene_file, overrides, s->render_settings.auto_tune)) {
+		applyOverride(s, setting);
+	}
+}
+
+std::string jsonString(const std::string& str) {
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+// rays per second over the whole job, in millions
+float mraysPerSecond(const JobResult& job) {
+	return job.stats.rays / glm::max(job.seconds, 1e-6f) * 1e-6f;
+}
+
+float nodesPerRay(const JobResult& job) {
+	return job.stats.rays > 0 ? (float)job.stats.bvh_nodes / job.stats.rays : 0.0f;
+}
+
+void writeBenchmarkJSON(const std::string& filename, const std::string& gpu, const std::vector<BenchmarkResult>& results) {
+	std::ofstream out(filename);
+	out << "{\n  \"gpu\": " << jsonString(gpu) << ",\n  \"jobs\": [\n";
+	for (int i = 0; i < results.size(); i++) {
+		const BenchmarkResult& r = results[i];
+		const JobResult& job = r.job;
+		out << "    {\n";
+		out << "      \"scene\": " << jsonString(r.scene) << ",\n";
+		out << "      \"settings\": " << jsonString(r.settings) << ",\n";
+		out << "      \"width\": " << r.resolution.x << ", \"height\": " << r.resolution.y << ",\n";
+		out << "      \"samples\": " << job.samples << ", \"seconds\": " << job.seconds << ",\n";
+		out << "      \"samples_per_second\": " << job.samples / glm::max(job.seconds, 1e-6f) << ",\n";
+		out << "      \"rays\": " << job.stats.rays << ", \"mrays_per_second\": " << mraysPerSecond(job) << ",\n";
+		out << "      \"bvh_nodes_per_ray\": " << nodesPerRay(job) << ",\n";
+		out << "      \"device_mb\": " << job.stats.device_bytes / (1024.0 * 1024.0) << ",\n";
+		out << "      \"block_sizes\": {";
+		for (int k = 0; k < NUM_LAUNCH_KERNELS; k++) {
+			out << (k > 0 ? "," : "") << "\n        " << jsonString(launchKernelName(k)) << ": { \"threads\": " << job.stats.block_sizes[k]
+				<< ", \"occupancy\": " << job.stats.occupancy[k] << " }";
+		}
+		out << "\n      },\n";
+		out << "      \"ray_stats\": {";
+		for (int q = 0; q < NUM_TRACE_QUERIES; q++) {
+			unsigned long long rays = job.stats.counters[STAT_RAYS + q];
+			out << "\n        " << jsonString(traceQueryName(q)) << ": { \"rays\": " << rays
+				<< ", \"nodes_per_ray\": " << (rays > 0 ? (double)job.stats.counters[STAT_NODES + q] / rays : 0.0)
+				<< ", \"tris_per_ray\": " << (rays > 0 ? (double)job.stats.counters[STAT_TRIS + q] / rays : 0.0) << " },";
+		}
+		out << "\n        \"escaped\": " << job.stats.counters[STAT_ESCAPED] << ", \"roulette_kills\": " << job.stats.counters[STAT_ROULETTE_KILLS]
+			<< ", \"specular_bounces\": " << job.stats.counters[STAT_SPECULAR_BOUNCES] << ",\n        \"paths_per_bounce\": [";
+		for (int b = 0; b < MAX_STAT_BOUNCES; b++) {
+			out << (b > 0 ? ", " : "") << job.stats.counters[STAT_BOUNCE_RAYS + b];
+		}
+		out << "]\n      },\n";
+		out << "      \"startup_ms\": {";
+		for (int p = 0; p < NUM_STARTUP_PHASES; p++) {
+			out << (p > 0 ? "," : "") << "\n        " << jsonString(startupPhaseName(p)) << ": " << r.startup_ms[p];
+		}
+		out << "\n      },\n";
+		out << "      \"stage_ms_per_sample\": {";
+		bool first = true;
+		for (int s = 0; s < NUM_RENDER_STAGES; s++) {
+			if (job.stats.stage_ms[s] > 0.0) {
+				out << (first ? "" : ",") << "\n        " << jsonString(renderStageName(s)) << ": " << job.stats.stage_ms[s] / glm::max(job.samples, 1);
+				first = false;
+			}
+		}
+		out << "\n      }\n    }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+// one row per job, every stage gets a column so rows of different runs line up
+void writeBenchmarkCSV(const std::string& filename, const std::string& gpu, const std::vector<BenchmarkResult>& results) {
+	std::ofstream out(filename);
+	out << "gpu,scene,settings,width,height,samples,seconds,samples_per_second,rays,mrays_per_second,bvh_nodes_per_ray,device_mb";
+	for (int s = 0; s < NUM_RENDER_STAGES; s++) {
+		out << "," << renderStageName(s) << " ms";
+	}
+	for (int k = 0; k < NUM_LAUNCH_KERNELS; k++) {
+		out << "," << launchKernelName(k) << " threads," << launchKernelName(k) << " occupancy";
+	}
+	out << "\n";
+	for (const BenchmarkResult& r : results) {
+		const JobResult& job = r.job;
+		out << jsonString(gpu) << "," << jsonString(r.scene) << "," << jsonString(r.settings) << ","
+			<< r.resolution.x << "," << r.resolution.y << "," << job.samples << "," << job.seconds << ","
+			<< job.samples / glm::max(job.seconds, 1e-6f) << "," << job.stats.rays << "," << mraysPerSecond(job) << "," << nodesPerRay(job) << ","
+			<< job.stats.device_bytes / (1024.0 * 1024.0);
+		for (int s = 0; s < NUM_RENDER_STAGES; s++) {
+			out << "," << job.stats.stage_ms[s] / glm::max(job.samples, 1);
+		}
+		for (int k = 0; k < NUM_LAUNCH_KERNELS; k++) {
+			out << "," << job.stats.block_sizes[k] << "," << job.stats.occupancy[k];
+		}
+		out << "\n";
+	}
+}
+
+// the fields of one writeBenchmarkCSV line, with the jsonString quoting of the strings undone
+static std::vector<std::string> splitCSVLine(const std::string& line) {
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+	for (int i = 0; i < line.size(); i++) {
+		const char c = line[i];
+		if (quoted && c == '\\' && i + 1 < line.size()) {
+			fields.back() += line[++i];
+		}
+		else if (c == '"') {
+			quoted = !quoted;
+		}
+		else if (c == ',' && !quoted) {
+			fields.push_back(std::string());
+		}
+		else {
+			fields.back() += c;
+		}
+	}
+	return fields;
+}
+
+// --baseline: every stage of every job that also ran in filename, a --csv of an earlier run,
+// against its time per sample there. a stage over tolerance slower, and over min_ms so noise in
+// the tiny ones doesn't count, is a regression. only runs on the same GPU are compared. returns
+// the number of regressions, -1 when the baseline can't be read
+int checkBaseline(const std::string& filename, const std::vector<BenchmarkResult>& results, float tolerance, float min_ms) {
+	std::ifstream file(filename);
+	std::string line;
+	if (!utilityCore::safeGetline(file, line)) {
+		cout << "Can't read the baseline " << filename << endl;
+		return -1;
+	}
+	const std::vector<std::string> header = splitCSVLine(line);
+	std::vector<std::vector<std::string>> rows;
+	while (utilityCore::safeGetline(file, line)) {
+		if (!line.empty()) {
+			rows.push_back(splitCSVLine(line));
+		}
+	}
+
+	cudaDeviceProp prop;
+	cudaGetDeviceProperties(&prop, 0);
+	int regressions = 0;
+	int compared = 0;
+	cout << "Against " << filename << " (" << tolerance * 100.0f << "% tolerance):" << endl;
+	for (const BenchmarkResult& r : results) {
+		const std::vector<std::string>* row = NULL;
+		for (const std::vector<std::string>& candidate : rows) {
+			if (candidate.size() == header.size() && candidate[0] == prop.name && candidate[1] == r.scene && candidate[2] == r.settings) {
+				row = &candidate;
+			}
+		}
+		if (row == NULL) {
+			printf("  %-32s not in the baseline for this GPU\n", r.scene.c_str());
+			continue;
+		}
+		compared++;
+		for (int s = 0; s < NUM_RENDER_STAGES; s++) {
+			const std::vector<std::string>::const_iterator column = std::find(header.begin(), header.end(), std::string(renderStageName(s)) + " ms");
+			if (column == header.end()) {
+				continue;
+			}
+			const float before = atof((*row)[column - header.begin()].c_str());
+			const float now = r.job.stats.stage_ms[s] / glm::max(r.job.samples, 1);
+			if (now > min_ms && now > before * (1.0f + tolerance)) {
+				printf("  REGRESSION %-32s %-24s %9.3f ms/sample, was %.3f\n", r.scene.c_str(), renderStageName(s), now, before);
+				regressions++;
+			}
+		}
+	}
+	printf("  %d of %d jobs compared, %d stage regressions\n", compared, (int)results.size(), regressions);
+	return regressions;
+}
+
+// renders a job file like --batch (scenes/benchmark.txt by default) and reports every job's
+// throughput, device memory and GPU time per sample for each stage. stage times come from
+// the same non blocking events the GUI shows, BLOCKING_TIMERS=1 in a job separates them fully
+int renderBenchmark(const std::vector<std::string>& args) {
+	std::string job_file = "scenes/benchmark.txt";
+	std::string json_file;
+	std::string csv_file;
+	std::string baseline_file;
+	float tolerance = 0.1f;
+	float min_ms = 0.05f;
+	bool update_references = false;
+	for (int i = 0; i < args.size(); ++i) {
+		if (args[i] == "--json" && i + 1 < args.size()) {
+			json_file = args[++i];
+		}
+		else if (args[i] == "--baseline" && i + 1 < args.size()) {
+			baseline_file = args[++i];
+		}
+		else if (args[i] == "--tolerance" && i + 1 < args.size()) {
+			tolerance = glm::max((float)atof(args[++i].c_str()), 0.0f);
+		}
+		else if (args[i] == "--min-ms" && i + 1 < args.size()) {
+			min_ms = glm::max((float)atof(args[++i].c_str()), 0.0f);
+		}
+		else if (args[i] == "--csv" && i + 1 < args.size()) {
+			csv_file = args[++i];
+		}
+		else if (args[i] == "--update-references") {
+			update_references = true;
+		}
+		else {
+			job_file = args[i];
+		}
+	}
+
+	std::vector<BenchmarkResult> results;
+	// a job that missed its --reference still reports its times
+	int status = renderBatch(job_file.c_str(), &results, update_references);
+	if (results.empty()) {
+		return status;
+	}
+
+	cudaDeviceProp prop;
+	cudaGetDeviceProperties(&prop, 0);
+	const std::string gpu = prop.name;
+
+	cout << "Benchmark on " << gpu << ":" << endl;
+	for (const BenchmarkResult& r : results) {
+		printf("  %-32s %6d spp %9.2f s %9.1f Mrays/s %6.1f nodes/ray %8.1f MB\n", r.scene.c_str(), r.job.samples, r.job.seconds,
+			mraysPerSecond(r.job), nodesPerRay(r.job), r.job.stats.device_bytes / (1024.0 * 1024.0));
+		for (int s = 0; s < NUM_RENDER_STAGES; s++) {
+			if (r.job.stats.stage_ms[s] > 0.0) {
+				printf("    %-24s %9.3f ms/sample\n", renderStageName(s), r.job.stats.stage_ms[s] / glm::max(r.job.samples, 1));
+			}
+		}
+		printf("    block sizes:");
+		for (int k = 0; k < NUM_LAUNCH_KERNELS; k++) {
+			printf(" %s %d (%.0f%%)", launchKernelName(k), r.job.stats.block_sizes[k], r.job.stats.occupancy[k] * 100.0f);
+		}
+		printf("\n");
+	}
+	if (!json_file.empty()) {
+		writeBenchmarkJSON(json_file, gpu, results);
+	}
+	if (!csv_file.empty()) {
+		writeBenchmarkCSV(csv_file, gpu, results);
+	}
+	if (!baseline_file.empty() && checkBaseline(baseline_file, results, tolerance, min_ms) != 0) {
+		status = 1;
+	}
+	return status;
+}
+
+// RENDER_THREAD, the window's event loop and the render on threads of their own. the render
+// thread owns the scene and the device, the window works on copies of what it shows: it
+// hands what the mouse and the GUI changed over as a RenderRequest and picks up images,
+// stats and the scene's materials and geoms through TripleBuffers, neither waits on the other
+
+// what the window changed since the render thread last looked, merged while it's waiting
+struct RenderRequest {
+	unsigned scene_generation = 0; // of the SceneMirror the edits were made on, stale ones are dropped
+	bool camera_moved = false;
+	Camera camera;
+	RenderSettings settings;
+	bool restart = false;
+	std::map<int, Material> materials; // edited materials and geoms by index
+	std::map<int, Geom> geoms;
+	glm::ivec2 probe = glm::ivec2(-1);
+	bool save = false;
+	bool reload = false;
+};
+
+// the scene as the GUI shows and edits it, published whenever the render thread changed it
+struct SceneMirror {
+	unsigned generation = 0; // bumped by every replaceScene
+	unsigned camera_generation = 0; // bumped when the scene file's camera replaced the current one
+	RenderSettings settings;
+	Camera camera;
+	std::vector<Material> materials;
+	std::vector<Geom> geoms;
+};
+
+// what the title and the GUI's stats show, after every frame of the render thread
+struct RenderStatus {
+	int iteration = 0;
+	GuiDataContainer gui;
+};
+
+static bool renderThreaded = false; // set before the render thread starts
+static std::thread renderThread;
+static std::atomic<bool> renderThreadStop(false);
+static bool renderThreadSave = false; // stopRenderThread asked for the image on the way out
+static std::atomic<RenderRequest*> renderRequest(NULL); // taken by the render thread, put back by the window
+static RenderRequest pendingRequest; // window only, the changes of the frame it's on
+static utilityCore::TripleBuffer<uchar4*> displayImages; // device images, the window copies the newest into the PBO
+static utilityCore::TripleBuffer<RenderStatus> renderStatus;
+static utilityCore::TripleBuffer<SceneMirror> sceneMirrors; // the GUI edits the front one in place
+static utilityCore::TripleBuffer<PathProbe> probeResults;
+static GuiDataContainer renderGuiData; // what pathtrace fills in on the render thread
+static unsigned sceneGeneration = 0; // render thread only
+static unsigned cameraGeneration = 0;
+static Camera uiCamera; // window only, what the mouse moves
+static uchar4* remoteImage = NULL; // --serve, what the display kernels write instead of the PBO
+static bool remoteFrame = false; // it holds a frame that wasn't sent
+static unsigned uiCameraGeneration = 0;
+
+// the camera the mouse and keys move
+static Camera& controlCamera() {
+	return renderThreaded ? uiCamera : renderState->camera;
+}
+
+bool renderThreadRunning() {
+	return renderThreaded;
+}
+
+RenderSettings& guiSettings() {
+	return renderThreaded ? sceneMirrors.front().settings : scene->render_settings;
+}
+
+std::vector<Material>& guiMaterials() {
+	return renderThreaded ? sceneMirrors.front().materials : scene->materials;
+}
+
+std::vector<Geom>& guiGeoms() {
+	return renderThreaded ? sceneMirrors.front().geoms : scene->geoms;
+}
+
+const PathProbe& guiProbe() {
+	return renderThreaded ? probeResults.front() : pathtraceProbe();
+}
+
+int guiIteration() {
+	return renderThreaded ? renderStatus.front().iteration : iteration;
+}
+
+void guiRestart() {
+	if (renderThreaded) {
+		pendingRequest.restart = true;
+	}
+	else {
+		iteration = 0;
+	}
+}
+
+void guiMaterialEdited(int material_ID) {
+	if (renderThreaded) {
+		pendingRequest.materials[material_ID] = sceneMirrors.front().materials[material_ID];
+		pendingRequest.scene_generation = sceneMirrors.front().generation;
+	}
+	else {
+		pathtraceUpdateMaterial(material_ID);
+	}
+}
+
+void guiGeomEdited(int geom_ID) {
+	if (renderThreaded) {
+		pendingRequest.geoms[geom_ID] = sceneMirrors.front().geoms[geom_ID];
+		pendingRequest.scene_generation = sceneMirrors.front().generation;
+	}
+	else {
+		pathtraceUpdateGeom(geom_ID);
+	}
+}
+
+// the render thread's scene for the GUI, or the window's before the render thread starts
+static void publishScene() {
+	SceneMirror& mirror = sceneMirrors.back();
+	mirror.generation = sceneGeneration;
+	mirror.camera_generation = cameraGeneration;
+	mirror.settings = scene->render_settings;
+	mirror.camera = scene->state.camera;
+	mirror.materials = scene->materials;
+	mirror.geoms = scene->geoms;
+	sceneMirrors.publish();
+}
+
+// where a frame's image goes: the PBO or with DISPLAY_SURFACE the window's texture, with
+// RENDER_THREAD the back display image the window picks up once it's published and with
+// --serve the image the viewers are sent
+static DisplayTarget mapDisplay() {
+	if (renderThreaded) {
+		return displayImages.back();
+	}
+	if (remoteImage != NULL) {
+		return remoteImage;
+	}
+	if (displaySurfaceEnabled()) {
+		return DisplayTarget::onSurface(mapDisplaySurface());
+	}
+	uchar4* pbo_dptr = NULL;
+	cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+	return pbo_dptr;
+}
+
+static void unmapDisplay() {
+	if (renderThreaded) {
+		cudaStreamSynchronize(0);
+		displayImages.publish();
+		return;
+	}
+	if (remoteImage != NULL) {
+		remoteFrame = true;
+		return;
+	}
+	if (displaySurfaceEnabled()) {
+		unmapDisplaySurface();
+		return;
+	}
+	cudaGLUnmapBufferObject(pbo);
+}
+
+// the orbit controls (phi, theta, zoom around lookAt) applied to cam
+static void orbitCamera(Camera& cam) {
+	cameraPosition.x = zoom * sin(phi) * sin(theta);
+	cameraPosition.y = zoom * cos(theta);
+	cameraPosition.z = zoom * cos(phi) * sin(theta);
+
+	cam.view = -glm::normalize(cameraPosition);
+	glm::vec3 v = cam.view;
+	glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
+	glm::vec3 r = glm::cross(v, u);
+	cam.up = glm::cross(r, v);
+	cam.right = r;
+
+	cam.position = cameraPosition;
+	cameraPosition += cam.lookAt;
+	cam.position = cameraPosition;
+}
+
+// the render restarts from the camera it was given, previous is where it had been
+static void cameraMoved(const Camera& previous) {
+	const int previous_iteration = iteration;
+	iteration = 0;
+	lastCameraMove = std::chrono::steady_clock::now();
+
+	// TEMPORAL_HISTORY carries the old view's samples over instead of starting from nothing
+	if (!scenechanged && previous_iteration > 0) {
+		iteration = pathtraceReprojectImage(previous, previous_iteration);
+		if (iteration > 0) {
+			renderStart = lastCameraMove;
+			renderStopped = false;
+		}
+	}
+}
+
+static void pollMeshStream() {
+	if (meshStreamDone) {
+		// the meshes are in, the proxy scene steps aside for the full one
+		meshStreamer.join();
+		meshStreamDone = false;
+		if (streamedScene != NULL) {
+			replaceScene(streamedScene);
+			streamedScene = NULL;
+		}
+	}
+}
+
+// uploads what changed, then the preview or a batch of iterations and the probe. false when
+// there was nothing left to trace
+static bool renderFrame() {
+	bool traced = true;
+	if (scenechanged) {
+		// first frame or a reload, the previous scene's data was already freed
+		pathtraceInit(scene);
+		scenechanged = false;
+		iteration = 0;
+	}
+	else if (iteration == 0) {
+		// camera moved, geometry and buffers stay resident and only the image restarts
+		pathtraceResetImage();
+	}
+	if (iteration == 0) {
+		renderStart = std::chrono::steady_clock::now();
+		renderStopped = false;
+	}
+
+	// PREVIEW_SCALE, low resolution single samples while the camera moves, the accumulation
+	// only starts once it has rested for PREVIEW_IDLE
+	const RenderSettings& settings = scene->render_settings;
+	std::chrono::duration<float> still = std::chrono::steady_clock::now() - lastCameraMove;
+	if (settings.preview_scale > 1 && iteration == 0 && still.count() < settings.preview_idle) {
+		pathtracePreview(mapDisplay());
+		unmapDisplay();
+	}
+	else if (iteration < renderState->iterations && !renderStopped) {
+		// redrawn only after the camera or the geometry changed
+		if (!renderThreaded) {
+			rasterVisibility(scene);
+		}
+
+		// ITERATIONS_PER_FRAME 0 scales the batch by how far the last frame was off target,
+		// at most doubling or halving it so a single slow frame doesn't swing it too far
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (settings.iterations_per_frame == 0 && lastBatchTimed) {
+			std::chrono::duration<float, std::milli> frame_time = now - lastBatch;
+			float scale = settings.frame_time_target / glm::max(frame_time.count(), 1e-3f);
+			batchIterations = glm::clamp(batchIterations * glm::clamp(scale, 0.5f, 2.0f), 1.0f, 1024.0f);
+		}
+		lastBatch = now;
+		lastBatchTimed = true;
+		int batch = settings.iterations_per_frame > 0 ? settings.iterations_per_frame : (int)batchIterations;
+		batch = glm::min(batch, (int)renderState->iterations - iteration);
+
+		// Map OpenGL buffer object for writing from CUDA on a single GPU
+		// No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
+		DisplayTarget pbo_dptr = mapDisplay();
+
+		// only the batch's last iteration is displayed
+		bool displayed = false;
+		for (int i = 0; i < batch && !renderStopped && !renderThreadStop; i++) {
+			// an iteration TILE_ORDER split goes on where it stopped
+			if (!pathtraceIterationSplit()) {
+				iteration++;
+			}
+			displayed = i == batch - 1;
+
+			// execute the kernel
+			int frame = 0;
+			if (!pathtrace(displayed ? pbo_dptr : DisplayTarget(), frame, iteration)) {
+				break;
+			}
+			saveRayCapture();
+
+			const int save_interval = settings.save_interval;
+			if (save_interval > 0 && iteration % save_interval == 0) {
+				requestImageSave(defaultImageName());
+			}
+
+			std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - renderStart;
+			const char* stop_reason = renderStopReason(settings, iteration, elapsed.count(), settings.time_budget);
+			if (stop_reason != NULL || iteration == renderState->iterations) {
+				renderStopped = stop_reason != NULL;
+				reportRender(elapsed.count(), stop_reason);
+			}
+		}
+		if (!displayed) {
+			pathtraceDisplay(pbo_dptr, iteration);
+		}
+
+		// unmap buffer object
+		unmapDisplay();
+	}
+	else {
+		lastBatchTimed = false;
+		traced = false;
+	}
+	if (probePixel.x >= 0) {
+		pathtrace_Single(mapDisplay(), iteration, probePixel.x, probePixel.y);
+		unmapDisplay();
+		reportProbe(pathtraceProbe());
+		if (renderThreaded) {
+			probeResults.back() = pathtraceProbe();
+			probeResults.publish();
+		}
+		probePixel = glm::ivec2(-1);
+	}
+	pollImageSave(false);
+	return traced;
+}
+
+// on the render thread, what the window sent since the last frame
+static void applyRenderRequest(const RenderRequest& request) {
+	if (request.scene_generation == sceneGeneration) {
+		// the GUI's settings are copies of these, anything it didn't touch stays as it is
+		scene->render_settings = request.settings;
+		for (const auto& edit : request.materials) {
+			scene->materials[edit.first] = edit.second;
+			if (!scenechanged) {
+				pathtraceUpdateMaterial(edit.first);
+			}
+		}
+		for (const auto& edit : request.geoms) {
+			scene->geoms[edit.first] = edit.second;
+		}
+		if (!scenechanged && request.geoms.size() == 1) {
+			pathtraceUpdateGeom(request.geoms.begin()->first);
+		}
+		else if (!scenechanged && !request.geoms.empty()) {
+			pathtraceUpdateGeoms();
+		}
+		if (!request.materials.empty() || !request.geoms.empty()) {
+			iteration = 0;
+		}
+	}
+	if (request.camera_moved) {
+		const Camera previous = scene->state.camera;
+		scene->state.camera = request.camera;
+		cameraMoved(previous);
+	}
+	if (request.restart) {
+		iteration = 0;
+	}
+	if (request.probe.x >= 0) {
+		probePixel = request.probe;
+	}
+	if (request.save) {
+		requestImageSave(defaultImageName());
+	}
+	if (request.reload) {
+		reloadScene();
+	}
+}
+
+static void renderThreadLoop() {
+	// the renderer's state is per thread, the one it fills in is this thread's
+	InitDataContainer(&renderGuiData);
+	while (!renderThreadStop) {
+		RenderRequest* request = renderRequest.exchange(NULL);
+		if (request != NULL) {
+			applyRenderRequest(*request);
+			delete request;
+		}
+		pollSceneWatch();
+		pollMeshStream();
+		const bool traced = renderFrame();
+
+		RenderStatus& status = renderStatus.back();
+		status.iteration = iteration;
+		status.gui = renderGuiData;
+		renderStatus.publish();
+		if (!traced) {
+			// done or stopped, nothing to do until the window changes something
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	}
+	// the image only exists in this thread's renderer context, saves are finished before it goes
+	if (renderThreadSave) {
+		saveImage();
+	}
+	pollImageSave(true);
+	cudaDeviceSynchronize();
+}
+
+// the window's side of a frame: the changes since the last go to the render thread, the
+// newest image, stats and scene it finished come back
+static void syncRenderThread() {
+	if (sceneMirrors.update() && sceneMirrors.front().camera_generation != uiCameraGeneration) {
+		// the scene file's camera, the orbit controls start over from it
+		uiCamera = sceneMirrors.front().camera;
+		uiCameraGeneration = sceneMirrors.front().camera_generation;
+		resetCameraControls();
+		camchanged = true;
+	}
+	const SceneMirror& mirror = sceneMirrors.front();
+	if (pendingRequest.scene_generation != mirror.generation) {
+		// made on a scene that was replaced since
+		pendingRequest.materials.clear();
+		pendingRequest.geoms.clear();
+	}
+	if (camchanged) {
+		orbitCamera(uiCamera);
+		camchanged = false;
+		pendingRequest.camera_moved = true;
+	}
+
+	RenderRequest* request = renderRequest.exchange(NULL);
+	if (request == NULL) {
+		request = new RenderRequest(pendingRequest);
+	}
+	else {
+		// the render thread hasn't got to the last one yet
+		if (request->scene_generation != mirror.generation) {
+			request->materials.clear();
+			request->geoms.clear();
+		}
+		request->camera_moved |= pendingRequest.camera_moved;
+		request->restart |= pendingRequest.restart;
+		for (const auto& edit : pendingRequest.materials) {
+			request->materials[edit.first] = edit.second;
+		}
+		for (const auto& edit : pendingRequest.geoms) {
+			request->geoms[edit.first] = edit.second;
+		}
+		if (pendingRequest.probe.x >= 0) {
+			request->probe = pendingRequest.probe;
+		}
+		request->save |= pendingRequest.save;
+		request->reload |= pendingRequest.reload;
+	}
+	request->scene_generation = mirror.generation;
+	request->camera = uiCamera;
+	request->settings = mirror.settings;
+	renderRequest.store(request);
+	pendingRequest = RenderRequest();
+	pendingRequest.scene_generation = mirror.generation;
+
+	if (renderStatus.update()) {
+		*guiData = renderStatus.front().gui;
+	}
+	probeResults.update();
+	if (displayImages.update()) {
+		copyToPBO(displayImages.front());
+	}
+}
+
+// RENDER_THREAD, once the window and the scene are set up. rasterized camera rays need the
+// window's GL context, so they're traced
+void startRenderThread() {
+	renderThreaded = true;
+	if (scene->render_settings.raster_primary) {
+		cout << "RASTER_PRIMARY draws with the window's GL context, camera rays are traced on the render thread" << endl;
+		scene->render_settings.raster_primary = false;
+	}
+	for (int i = 0; i < 3; i++) {
+		cudaMalloc((void**)&displayImages.slot(i), width * height * sizeof(uchar4));
+		cudaMemset(displayImages.slot(i), 0, width * height * sizeof(uchar4));
+	}
+	initDisplayCopy();
+	uiCamera = scene->state.camera;
+	publishScene();
+	sceneMirrors.update();
+	pendingRequest.scene_generation = sceneMirrors.front().generation;
+	renderThread = std::thread(renderThreadLoop);
+}
+
+// waits for the iteration the render thread is on, after this the window owns the scene. with
+// save the render thread saves the image before it exits
+void stopRenderThread(bool save) {
+	if (!renderThread.joinable()) {
+		return;
+	}
+	renderThreadSave = save;
+	renderThreadStop = true;
+	renderThread.join();
+	delete renderRequest.exchange(NULL);
+	for (int i = 0; i < 3; i++) {
+		cudaFree(displayImages.slot(i));
+	}
+	freeDisplayCopy();
+}
+
+void runCuda() {
+	if (renderThreaded) {
+		if (renderThread.joinable()) {
+			syncRenderThread();
+		}
+		return;
+	}
+	pollSceneWatch();
+	pollMeshStream();
+
+	if (camchanged) {
+		const Camera previous = renderState->camera;
+		orbitCamera(renderState->camera);
+		camchanged = false;
+		cameraMoved(previous);
+	}
+	renderFrame();
+}
+
+// the orbit controls (phi, theta, zoom around lookAt) picked up from the scene's camera
+void resetCameraControls() {
+	const Camera& cam = controlCamera();
+	glm::vec3 view = cam.view;
+	glm::vec3 up = cam.up;
+	glm::vec3 right = glm::cross(view, up);
+	up = glm::cross(right, view);
+
+	cameraPosition = cam.position;
+
+	// compute phi (horizontal) and theta (vertical) relative 3D axis
+	// so, (0 0 1) is forward, (0 1 0) is up
+	glm::vec3 viewXZ = glm::vec3(view.x, 0.0f, view.z);
+	glm::vec3 viewZY = glm::vec3(0.0f, view.y, view.z);
+	phi = glm::acos(glm::dot(glm::normalize(viewXZ), glm::vec3(0, 0, -1)));
+	theta = glm::acos(glm::dot(glm::normalize(viewZY), glm::vec3(0, 1, 0)));
+	ogLookAt = cam.lookAt;
+	zoom = glm::length(cam.position - ogLookAt);
+}
+
+// swaps reloaded in for the current scene, the current camera is kept. the window can't be
+// resized so a changed resolution keeps the old scene
+void replaceScene(Scene* reloaded) {
+	if (reloaded->state.camera.resolution != scene->state.camera.resolution) {
+		cout << "Resolution changed, restart to load " << sceneFileName << endl;
+		delete reloaded;
+		return;
+	}
+	reloaded->state.camera = scene->state.camera;
+	reloaded->render_settings.num_gpus = 1;
+	reloaded->render_settings.raster_primary &= !renderThreaded;
+
+	pathtraceFreeScene();
+	delete scene;
+	scene = reloaded;
+	renderState = &scene->state;
+	scenechanged = true;
+	if (renderThreaded) {
+		sceneGeneration++;
+		publishScene();
+	}
+}
+
+// re-reads the scene file
+void reloadScene() {
+	if (meshStreamer.joinable()) {
+		cout << "The scene's meshes are still loading" << endl;
+		return;
+	}
+	Scene* reloaded = NULL;
+	try {
+		reloaded = new Scene(sceneFileName, sceneOverrides);
+	}
+	catch (const std::exception& e) {
+		// keep rendering the scene that's loaded
+		cout << "ERROR: " << e.what() << endl;
+		return;
+	}
+	replaceScene(reloaded);
+}
+
+static bool sameMaterial(const Material& a, const Material& b) {
+	return a.R == b.R && a.T == b.T && a.type == b.type && a.ior == b.ior && a.emittance == b.emittance
+		&& a.roughness == b.roughness && a.albedo_map == b.albedo_map && a.normal_map == b.normal_map
+		&& a.alpha_map == b.alpha_map && a.alpha_cutoff == b.alpha_cutoff;
+}
+
+static bool samePortals(const std::vector<EnvironmentPortal>& a, const std::vector<EnvironmentPortal>& b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); i++) {
+		if (a[i].corner != b[i].corner || a[i].edge_u != b[i].edge_u || a[i].edge_v != b[i].edge_v) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool sameCamera(const RenderState& a, const RenderState& b) {
+	const Camera& ca = a.camera;
+	const Camera& cb = b.camera;
+	return ca.position == cb.position && ca.lookAt == cb.lookAt && ca.up == cb.up && ca.fov == cb.fov
+		&& ca.focal_distance == cb.focal_distance && ca.lens_radius == cb.lens_radius;
+}
+
+// what can't be patched into the uploaded scene: new or retyped geoms, other meshes, textures
+// or settings, a geom that starts or stops emitting (lights are gathered at load). NULL when
+// parsed can be applied with applySceneEdits
+static const char* sceneReloadReason(const Scene& old, const Scene& parsed) {
+	if (parsed.state.camera.resolution != old.state.camera.resolution || parsed.state.traceDepth != old.state.traceDepth) {
+		return "resolution or depth";
+	}
+	if (parsed.setting_lines != old.setting_lines) {
+		return "settings";
+	}
+	if (parsed.environment.path != old.environment.path || parsed.environment.intensity != old.environment.intensity
+		|| !samePortals(parsed.environment.portals, old.environment.portals)) {
+		return "environment";
+	}
+	// the loaded scene's LODS come after the sources the file names, a parse has none
+	const size_t old_sources = std::count_if(old.mesh_sources.begin(), old.mesh_sources.end(), [](const MeshSource& source) { return source.lod_of == -1; });
+	if (parsed.geoms.size() != old.geoms.size() || parsed.materials.size() != old.materials.size()
+		|| parsed.mesh_sources.size() != old_sources || parsed.textures.size() != old.textures.size()) {
+		return "objects, materials or textures added or removed";
+	}
+	for (int i = 0; i < parsed.mesh_sources.size(); i++) {
+		const MeshSource& a = old.mesh_sources[i];
+		const MeshSource& b = parsed.mesh_sources[i];
+		if (a.path != b.path || a.subdiv_segments != b.subdiv_segments || a.displacement_map != b.displacement_map
+			|| a.displacement_scale != b.displacement_scale || a.lod_levels != b.lod_levels) {
+			return "meshes";
+		}
+	}
+	if (parsed.curve_sources != old.curve_sources) {
+		return "curves";
+	}
+	if (parsed.volume_sources != old.volume_sources || parsed.volume_media.size() != old.volume_media.size()) {
+		return "volumes";
+	}
+	for (int i = 0; i < parsed.volume_media.size(); i++) {
+		// placeVolumes copies the media into the uploaded volumes
+		if (parsed.volume_media[i].density != old.volume_media[i].density || parsed.volume_media[i].anisotropy != old.volume_media[i].anisotropy) {
+			return "volumes";
+		}
+	}
+	for (int i = 0; i < parsed.textures.size(); i++) {
+		if (parsed.textures[i].path != old.textures[i].path || parsed.textures[i].srgb != old.textures[i].srgb) {
+			return "textures";
+		}
+	}
+	for (int i = 0; i < parsed.geoms.size(); i++) {
+		const Geom& a = old.geoms[i];
+		const Geom& b = parsed.geoms[i];
+		if (a.type != b.type || a.blas_ID != b.blas_ID
+			|| (old.materials[a.materialid].emittance > 0.0f) != (parsed.materials[b.materialid].emittance > 0.0f)) {
+			return "object types or lights";
+		}
+		// the moving geoms' keys and the TLAS end boxes are sized on upload
+		if (a.moving != b.moving) {
+			return "moving geoms";
+		}
+	}
+	for (int i = 0; i < parsed.materials.size(); i++) {
+		if ((old.materials[i].emittance > 0.0f) != (parsed.materials[i].emittance > 0.0f)) {
+			return "lights";
+		}
+		// traversal reads the cutouts from their own table, built on upload
+		if (old.materials[i].alpha_map != parsed.materials[i].alpha_map || old.materials[i].alpha_cutoff != parsed.materials[i].alpha_cutoff) {
+			return "alpha maps";
+		}
+	}
+	return NULL;
+}
+
+// copies what changed between two parses of the scene file into the current scene and uploads
+// it piecewise. both parses hold geoms in load order, geom_IDs finds them after the TLAS build
+// reordered them. parts the file didn't change keep any GUI edits
+static void applySceneEdits(const Scene& old, const Scene& parsed) {
+	int num_materials = 0;
+	for (int i = 0; i < parsed.materials.size(); i++) {
+		if (!sameMaterial(parsed.materials[i], old.materials[i])) {
+			scene->materials[i] = parsed.materials[i];
+			pathtraceUpdateMaterial(i);
+			num_materials++;
+		}
+	}
+	std::vector<int> moved;
+	for (int i = 0; i < parsed.geoms.size(); i++) {
+		const Geom& from = parsed.geoms[i];
+		if (from.transform == old.geoms[i].transform && from.materialid == old.geoms[i].materialid
+			&& (!from.moving || from.end_transform == old.geoms[i].end_transform)) {
+			continue;
+		}
+		Geom& geom = scene->geoms[scene->geom_IDs[i]];
+		geom.translation = from.translation;
+		geom.rotation = from.rotation;
+		geom.scale = from.scale;
+		geom.transform = from.transform;
+		geom.inverseTransform = from.inverseTransform;
+		geom.invTranspose = from.invTranspose;
+		geom.end_transform = from.end_transform;
+		geom.materialid = from.materialid;
+		moved.push_back(scene->geom_IDs[i]);
+	}
+	if (moved.size() == 1) {
+		pathtraceUpdateGeom(moved[0]);
+	}
+	else if (!moved.empty()) {
+		pathtraceUpdateGeoms();
+	}
+	scene->state.iterations = parsed.state.iterations;
+	scene->state.imageName = parsed.state.imageName;
+	cout << "WATCH_SCENE: updated " << num_materials << " material(s) and " << moved.size() << " geom(s)" << endl;
+	iteration = 0;
+}
+
+static void watchInputs(const Scene& parsed) {
+	watchedTimes.clear();
+	watchedTimes[sceneFileName] = utilityCore::fileModifiedTime(sceneFileName);
+	for (const std::string& file : parsed.inputFiles()) {
+		watchedTimes[file] = utilityCore::fileModifiedTime(file);
+	}
+}
+
+// WATCH_SCENE, a few times a second. a saved scene file is parsed again without its meshes or
+// images and compared with the last parse: camera, material and transform edits are uploaded
+// into the running scene, anything else (or a saved mesh, texture or environment map) reloads it
+void pollSceneWatch() {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (!scene->render_settings.watch_scene || meshStreamer.joinable() || now - lastWatchPoll < std::chrono::milliseconds(500)) {
+		return;
+	}
+	lastWatchPoll = now;
+
+	bool scene_saved = false, inputs_saved = false;
+	for (const auto& watched : watchedTimes) {
+		if (utilityCore::fileModifiedTime(watched.first) != watched.second) {
+			(watched.first == sceneFileName ? scene_saved : inputs_saved) = true;
+		}
+	}
+	if (watchedParse != NULL && !scene_saved && !inputs_saved) {
+		return;
+	}
+
+	Scene* parsed = NULL;
+	try {
+		parsed = new Scene(sceneFileName, sceneOverrides, false, true);
+	}
+	catch (const std::exception& e) {
+		// likely saved half way through an edit, keep rendering and wait for the next save
+		cout << "WATCH_SCENE: " << e.what() << endl;
+		watchedTimes[sceneFileName] = utilityCore::fileModifiedTime(sceneFileName);
+		return;
+	}
+	watchInputs(*parsed);
+	if (watchedParse == NULL) {
+		watchedParse = parsed; // the first poll, what later saves are compared against
+		return;
+	}
+
+	const bool camera_edited = !sameCamera(parsed->state, watchedParse->state);
+	const char* reason = inputs_saved ? "a mesh, texture or environment file" : sceneReloadReason(*watchedParse, *parsed);
+	if (reason != NULL) {
+		cout << "WATCH_SCENE: " << reason << " changed, reloading the scene" << endl;
+		reloadScene();
+	}
+	else {
+		applySceneEdits(*watchedParse, *parsed);
+	}
+	if (camera_edited && scene->state.camera.resolution == parsed->state.camera.resolution) {
+		// the file's camera replaces wherever the mouse had moved it
+		scene->state.camera = parsed->state.camera;
+		if (renderThreaded) {
+			cameraGeneration++; // the window resets its controls when it sees the new mirror
+		}
+		else {
+			resetCameraControls();
+			camchanged = true;
+		}
+	}
+	if (renderThreaded) {
+		publishScene();
+	}
+	delete watchedParse;
+	watchedParse = parsed;
+}
+
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+	if (action == GLFW_PRESS) {
+		switch (key) {
+		case GLFW_KEY_ESCAPE:
+			if (renderThreaded) {
+				stopRenderThread(true);
+			}
+			else {
+				saveImage();
+			}
+			glfwSetWindowShouldClose(window, GL_TRUE);
+			break;
+		case GLFW_KEY_S:
+			if (renderThreaded) {
+				pendingRequest.save = true;
+			}
+			else {
+				requestImageSave(defaultImageName());
+			}
+			break;
+		case GLFW_KEY_R:
+			if (renderThreaded) {
+				pendingRequest.reload = true;
+			}
+			else {
+				reloadScene();
+			}
+			break;
+		case GLFW_KEY_SPACE:
+			camchanged = true;
+			Camera& cam = controlCamera();
+			cam.lookAt = ogLookAt;
+			break;
+		}
+	}
+}
+
+void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
+	if (MouseOverImGuiWindow())
+	{
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && (mods & GLFW_MOD_CONTROL)) {
+		// probe the pixel under the cursor instead of turning the camera, the display is flipped
+		// left to right from dev_image
+		double xpos, ypos;
+		glfwGetCursorPos(window, &xpos, &ypos);
+		(renderThreaded ? pendingRequest.probe : probePixel) = glm::ivec2(width - 1 - (int)xpos, (int)ypos);
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && (mods & GLFW_MOD_SHIFT)) {
+		// drag out the CROP rectangle, the window shows the image the way it's saved
+		double xpos, ypos;
+		glfwGetCursorPos(window, &xpos, &ypos);
+		cropAnchor = glm::ivec2((int)xpos, (int)ypos);
+		return;
+	}
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE && cropAnchor.x >= 0) {
+		cropAnchor = glm::ivec2(-1);
+		return;
+	}
+	leftMousePressed = (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS);
+	rightMousePressed = (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS);
+	middleMousePressed = (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_PRESS);
+}
+
+// the mouse's camera controls, dx and dy in window pixels. --serve's viewer sends the same
+static void orbitBy(double dx, double dy) {
+	// compute new camera parameters
+	phi -= (dx / width) * 2.5f;
+	theta -= (dy / height) * 2.5f;
+	theta = std::fmax(0.001f, std::fmin(theta, PI));
+	camchanged = true;
+}
+
+static void zoomBy(double dy) {
+	zoom += (dy / height) * 7.5f;
+	zoom = std::fmax(0.1f, zoom);
+	camchanged = true;
+}
+
+static void panBy(double dx, double dy) {
+	Camera& cam = controlCamera();
+	glm::vec3 forward = cam.view;
+	forward.y = 0.0f;
+	forward = glm::normalize(forward);
+	glm::vec3 right = cam.right;
+	right.y = 0.0f;
+	right = glm::normalize(right);
+
+	cam.lookAt -= (float)dx * right * 0.01f;
+	cam.lookAt += (float)dy * forward * 0.01f;
+	camchanged = true;
+}
+
+void mousePositionCallback(GLFWwindow* window, double xpos, double ypos) {
+	if (guiSettings().tile_order == TILE_CURSOR) {
+		// dev_image is flipped left to right from the window
+		guiSettings().tile_focus = glm::ivec2(width - 1 - (int)xpos, (int)ypos);
+	}
+	if (xpos == lastX || ypos == lastY) return; // otherwise, clicking back into window causes re-start
+	if (cropAnchor.x >= 0) {
+		const glm::ivec2 corner = glm::clamp(glm::ivec2((int)xpos, (int)ypos), glm::ivec2(0), glm::ivec2(width, height));
+		const glm::ivec2 lo = glm::min(cropAnchor, corner);
+		guiSettings().crop = glm::ivec4(lo, glm::abs(corner - cropAnchor));
+	}
+	else if (leftMousePressed) {
+		orbitBy(xpos - lastX, ypos - lastY);
+	}
+	else if (rightMousePressed) {
+		zoomBy(ypos - lastY);
+	}
+	else if (middleMousePressed) {
+		panBy(xpos - lastX, ypos - lastY);
+	}
+	lastX = xpos;
+	lastY = ypos;
+}
+
+// --serve PORT, the render without a window: it streams to browsers instead (see RemoteServer)
+// and takes their camera moves. each displayed frame's colors are copied back as they are, 4
+// bytes a pixel, and sent as a JPEG to every viewer that took the last one. runs until a viewer
+// presses q, which saves the image like ESC does. expects pathtraceInit for the current scene
+int renderRemote(const HeadlessOptions& options) {
+	RemoteServer server;
+	std::string error;
+	if (!server.listen(options.serve_port, options.bind_address, error)) {
+		cout << "--serve: " << error << endl;
+		return 1;
+	}
+	cout << "Serving the render on http://" << options.bind_address << ":" << options.serve_port << "/" << endl;
+
+	renderState = &scene->state;
+	width = renderState->camera.resolution.x;
+	height = renderState->camera.resolution.y;
+	resetCameraControls();
+	scenechanged = false;
+	camchanged = false;
+	iteration = 0;
+	cudaMalloc((void**)&remoteImage, width * height * sizeof(uchar4));
+	cudaMemset(remoteImage, 0, width * height * sizeof(uchar4));
+
+	std::vector<uchar4> pixels(width * height);
+	std::vector<unsigned char> jpeg;
+	std::vector<RemoteCommand> commands;
+	bool quit = false;
+	bool traced = true;
+	while (!quit) {
+		// waits on the viewers only when the render has nothing left to do
+		commands.clear();
+		server.poll(traced ? 0 : 10, commands);
+		for (const RemoteCommand& command : commands) {
+			if (command.action == "orbit") {
+				orbitBy(command.dx, command.dy);
+			}
+			else if (command.action == "zoom") {
+				zoomBy(command.dy);
+			}
+			else if (command.action == "pan") {
+				panBy(command.dx, command.dy);
+			}
+			else if (command.action == "reset") {
+				renderState->camera.lookAt = ogLookAt;
+				camchanged = true;
+			}
+			else if (command.action == "save") {
+				requestImageSave(defaultImageName());
+			}
+			else if (command.action == "quit") {
+				quit = true;
+			}
+		}
+		if (camchanged) {
+			const Camera previous = renderState->camera;
+			orbitCamera(renderState->camera);
+			camchanged = false;
+			cameraMoved(previous);
+		}
+
+		remoteFrame = false;
+		traced = renderFrame();
+		if (remoteFrame && server.streaming()) {
+			cudaMemcpy(pixels.data(), remoteImage, width * height * sizeof(uchar4), cudaMemcpyDeviceToHost);
+			encodeFrame(pixels, width, height, scene->render_settings.remote_quality, jpeg);
+			server.sendFrame(jpeg);
+		}
+	}
+	saveImage();
+	cudaFree(remoteImage);
+	remoteImage = NULL;
+	return 0;
+}
+
+// --jobs, a render the server was sent
+struct ServerJob {
+	int id;
+	int priority; // higher goes first, equal ones in the order they came in
+	std::string line; // as a --batch file line takes it, the scene file first
+	std::string state; // queued, loading, rendering, done, failed or cancelled
+	std::string message; // why it failed, or where its scene came from
+	int samples = 0;
+	int spp = 0;
+	std::vector<unsigned char> preview; // JPEG of the latest progressive result, empty before the first
+	int preview_frame = 0; // --concurrent, the server's count of previews when this one came in
+};
+
+// a loaded scene the job server keeps for later jobs on it
+struct CachedScene {
+	std::string file;
+	std::vector<std::string> overrides;
+	unsigned long long key; // sceneKey when it was loaded, an edit to the file doesn't match
+	Scene* scene;
+	Camera camera; // as loaded, each job's --eye and --lookat move a copy of it
+};
+
+// --jobs --concurrent, a job on a worker thread of its own. the thread is a renderer context of
+// its own (the pathtrace state is per thread), so it uploads its copy of the scene and traces on
+// its own default stream next to the other workers. stops at the sample count, the time budget,
+// NOISE_TARGET or a cancel and saves what it has. job is only touched under lock
+static void renderConcurrentJob(Scene* job_scene, const HeadlessOptions& options, float progress_interval, ServerJob& job,
+	std::mutex& lock, int& preview_frames)
+{
+	const RenderSettings& settings = job_scene->render_settings;
+	const glm::ivec2 resolution = job_scene->state.camera.resolution;
+	const int spp = options.spp > 0 ? options.spp : job_scene->state.iterations;
+	const float time_budget = options.time_budget > 0.0f ? options.time_budget : settings.time_budget;
+	pathtraceInit(job_scene);
+
+	auto start = std::chrono::steady_clock::now();
+	auto last_progress = start;
+	const char* stop_reason = NULL;
+	int samples = 0;
+	std::vector<uchar4> pixels;
+	std::vector<unsigned char> preview;
+	while (samples < spp && stop_reason == NULL) {
+		samples++;
+		pathtrace(DisplayTarget(), 0, samples);
+		std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+		stop_reason = renderStopReason(settings, samples, elapsed.count(), time_budget);
+
+		std::chrono::duration<float> since_progress = std::chrono::steady_clock::now() - last_progress;
+		const bool progress = since_progress.count() >= progress_interval;
+		if (progress) {
+			pathtraceRetrieveLDRImage(samples, pixels);
+			encodeFrame(pixels, resolution.x, resolution.y, settings.remote_quality, preview);
+			last_progress = std::chrono::steady_clock::now();
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		job.samples = samples;
+		if (progress) {
+			job.preview.swap(preview);
+			job.preview_frame = ++preview_frames;
+		}
+		if (job.state != "rendering") {
+			stop_reason = "cancel request";
+		}
+	}
+
+	// a cancelled job still saves what it has
+	std::ostringstream name;
+	name << job_scene->state.imageName << "." << startTimeString << "." << samples << "samp";
+	const std::string filename = options.out.empty() ? name.str() : options.out;
+	const ImageReadback kind = imageReadbackFor(filename);
+	pathtraceRetrieveLDRImage(samples, pixels);
+	encodeFrame(pixels, resolution.x, resolution.y, settings.remote_quality, preview);
+	if (kind == READBACK_LDR) {
+		image* img = buildLDRImage(pixels, resolution);
+		saveImageFile(*img, filename);
+		delete img;
+	}
+	else if (kind == READBACK_HALF) {
+		EXRImage exr;
+		pathtraceRetrieveHalfImage(samples, exr);
+		saveEXR(exr, filename);
+	}
+	else {
+		pathtraceRetrieveImage();
+		image* img = buildImage(job_scene->state.image, samples, resolution);
+		saveImageFile(*img, filename);
+		delete img;
+	}
+	std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+	pathtraceFree();
+	delete job_scene;
+
+	std::lock_guard<std::mutex> guard(lock);
+	cout << "Job " << job.id << ": " << samples << " samples in " << elapsed.count() << " s"
+		<< (stop_reason != NULL ? std::string(", stopped at the ") + stop_reason : std::string()) << ", saved " << filename << endl;
+	job.samples = samples;
+	job.preview.swap(preview);
+	job.preview_frame = ++preview_frames;
+	if (job.state == "rendering") {
+		job.state = "done";
+	}
+}
+
+static std::string jobStatus(const ServerJob& job) {
+	std::ostringstream ss;
+	ss << job.id << " " << job.state << " " << job.priority << " " << job.samples << "/" << job.spp << " " << job.line;
+	if (!job.message.empty()) {
+		ss << " (" << job.message << ")";
+	}
+	return ss.str();
+}
+
+// a submitted job's file names are relative to the server's --job-dir and may not leave it,
+// so a client can't have the server write anywhere else it could
+static bool insideJobDir(const std::string& path) {
+	if (path.empty()) {
+		return true;
+	}
+	if (path[0] == '/' || path[0] == '\\' || path.find(':') != std::string::npos) {
+		return false;
+	}
+	size_t start = 0;
+	while (start <= path.size()) {
+		size_t end = path.find_first_of("/\\", start);
+		if (end == std::string::npos) {
+			end = path.size();
+		}
+		if (path.compare(start, end - start, "..") == 0 && end - start == 2) {
+			return false;
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+// where a job's files go: its own names under job_dir, and the scene's OUTFILE name there too
+static void placeJobFiles(const std::string& job_dir, HeadlessOptions& options) {
+	for (std::string* path : { &options.out, &options.checkpoint, &options.reference }) {
+		if (!path->empty()) {
+			*path = job_dir + "/" + *path;
+		}
+	}
+}
+
+static std::string jobDirName(const std::string& job_dir, const std::string& name) {
+	return job_dir + "/" + name.substr(name.find_last_of("/\\") + 1);
+}
+
+// --jobs PORT, a server a render farm sends jobs to over HTTP instead of starting a process per
+// job. the last --cache scenes the jobs named (4 by default) stay loaded, BVHs and all, and the
+// one the last job rendered stays on the device, so another job of the same scene starts without
+// a load or upload and one of a cached scene only uploads it. waiting jobs go by priority. a
+// running job's display colors go out every --progress seconds to /stream and its /preview.
+// every file a job writes lands in --job-dir (the working directory by default), and the server
+// only listens on loopback unless --bind says otherwise. runs until /quit, which stops the
+// running job where it is. --concurrent N renders up to N jobs at once instead, each on a thread
+// of its own with its own copy of the scene (see renderConcurrentJob), so nothing stays resident
+// and every job uploads
+int renderJobServer(const std::vector<std::string>& args) {
+	int port = 0;
+	int cache_size = 4;
+	int concurrent = 1;
+	float progress_interval = 1.0f;
+	std::string bind_address = "127.0.0.1";
+	std::string job_dir = ".";
+	for (int i = 0; i < args.size(); i++) {
+		if (args[i] == "--bind" && i + 1 < args.size()) {
+			bind_address = args[++i];
+		}
+		else if (args[i] == "--job-dir" && i + 1 < args.size()) {
+			job_dir = args[++i];
+		}
+		else if (args[i] == "--cache" && i + 1 < args.size()) {
+			cache_size = glm::max(atoi(args[++i].c_str()), 1);
+		}
+		else if (args[i] == "--concurrent" && i + 1 < args.size()) {
+			concurrent = glm::max(atoi(args[++i].c_str()), 1);
+		}
+		else if (args[i] == "--progress" && i + 1 < args.size()) {
+			progress_interval = atof(args[++i].c_str());
+		}
+		else {
+			port = atoi(args[i].c_str());
+		}
+	}
+
+	RemoteServer server;
+	std::deque<ServerJob> jobs; // ids start at 1, job id is jobs[id - 1]. a deque so workers' references stay put
+	std::mutex lock; // jobs, with --concurrent workers
+	int preview_frames = 0;
+	int running = -1; // index into jobs
+	bool quit = false;
+	server.handler = [&](const std::string& path, std::string& status, std::string& type, std::string& body) {
+		std::lock_guard<std::mutex> guard(lock);
+		const std::string route = path.substr(0, path.find('?'));
+		const int id = atoi(queryValue(path, "id").c_str());
+		ServerJob* job = id >= 1 && id <= jobs.size() ? &jobs[id - 1] : NULL;
+		if (route == "/" || route == "/jobs") {
+			for (const ServerJob& j : jobs) {
+				body += jobStatus(j) + "\n";
+			}
+		}
+		else if (route == "/submit") {
+			const std::string line = queryValue(path, "job");
+			std::vector<std::string> tokens = utilityCore::tokenizeString(line);
+			HeadlessOptions options;
+			std::vector<std::string> overrides;
+			if (!tokens.empty()) {
+				parseJobArgs(std::vector<std::string>(tokens.begin() + 1, tokens.end()), options, overrides);
+			}
+			if (tokens.empty()) {
+				status = "400 Bad Request";
+				body = "no job, send /submit?job=SCENEFILE.txt [--spp N] [--out FILE] ...\n";
+			}
+			else if (options.cpu || options.serve_port > 0 || !options.sequence.empty() || !options.dataset.empty()) {
+				status = "400 Bad Request";
+				body = "--cpu, --serve, --sequence and --dataset jobs can't be queued\n";
+			}
+			else if (!insideJobDir(options.out) || !insideJobDir(options.checkpoint) || !insideJobDir(options.reference)
+				|| std::any_of(overrides.begin(), overrides.end(), [](const std::string& o) { return o.compare(0, 13, "BVH_CACHE_DIR") == 0; })) {
+				status = "400 Bad Request";
+				body = "--out, --checkpoint and --reference have to be relative paths inside the job directory, and BVH_CACHE_DIR can't be set\n";
+			}
+			else if (concurrent > 1 && (!options.reference.empty() || options.probe.x >= 0 || options.range_first >= 0
+				|| options.resume || !options.checkpoint.empty())) {
+				status = "400 Bad Request";
+				body = "--reference, --probe, --range, --resume and --checkpoint jobs need a server without --concurrent\n";
+			}
+			else {
+				ServerJob submitted;
+				submitted.id = (int)jobs.size() + 1;
+				submitted.priority = atoi(queryValue(path, "priority").c_str());
+				submitted.line = line;
+				submitted.state = "queued";
+				jobs.push_back(submitted);
+				body = std::to_string(submitted.id) + "\n";
+			}
+		}
+		else if (route == "/status" || route == "/preview" || route == "/cancel") {
+			if (job == NULL) {
+				status = "404 Not Found";
+				body = "no job " + queryValue(path, "id") + "\n";
+			}
+			else if (route == "/status") {
+				body = jobStatus(*job) + "\n";
+			}
+			else if (route == "/preview") {
+				if (job->preview.empty()) {
+					status = "404 Not Found";
+					body = "job " + std::to_string(job->id) + " has no progressive result yet\n";
+				}
+				else {
+					type = "image/jpeg";
+					body.assign(job->preview.begin(), job->preview.end());
+				}
+			}
+			else if (job->state == "queued" || job->state == "loading" || job->state == "rendering") {
+				// a running job stops after the iteration it's on
+				job->state = "cancelled";
+			}
+		}
+		else if (route == "/quit") {
+			quit = true;
+		}
+		else {
+			return false;
+		}
+		return true;
+	};
+
+	std::string error;
+	if (!server.listen(port, bind_address, error)) {
+		cout << "--jobs: " << error << endl;
+		return 1;
+	}
+	cout << "Taking jobs on http://" << bind_address << ":" << port << "/submit?job=..., writing them to " << job_dir << endl;
+
+	std::vector<CachedScene> cache; // most recently used first
+	Scene* resident = NULL; // the scene the device has, never with --concurrent
+	bool initialized = false; // pathtraceInit ran, the arenas are allocated
+	scene = NULL;
+	// the job's scene to the front of cache, loading it unless an entry still matches the file.
+	// false, with the job failed, if it doesn't load
+	auto cacheScene = [&](ServerJob& job, const std::string& file, const std::vector<std::string>& overrides, unsigned long long key) {
+		int cached = -1;
+		for (int i = 0; i < cache.size(); i++) {
+			if (cache[i].file == file && cache[i].overrides == overrides) {
+				cached = i;
+			}
+		}
+		// the file changed since, or FREE_HOST_GEOMETRY left nothing to upload again
+		if (cached >= 0 && (cache[cached].key != key
+			|| (cache[cached].scene != resident && cache[cached].scene->host_geometry_released))) {
+			if (cache[cached].scene == resident) {
+				pathtraceFreeScene();
+				resident = NULL;
+			}
+			delete cache[cached].scene;
+			cache.erase(cache.begin() + cached);
+			cached = -1;
+		}
+		std::string message;
+		if (cached >= 0) {
+			std::rotate(cache.begin(), cache.begin() + cached, cache.begin() + cached + 1);
+			message = cache[0].scene == resident ? "scene resident" : "scene cached";
+		}
+		else {
+			// AUTO_TUNE uploads the scene it loads, nothing else can be on the device
+			if (resident != NULL) {
+				pathtraceFreeScene();
+				resident = NULL;
+			}
+			CachedScene entry;
+			try {
+				entry.scene = new Scene(file, overrides);
+			}
+			catch (const std::exception& e) {
+				std::lock_guard<std::mutex> guard(lock);
+				job.state = "failed";
+				job.message = e.what();
+				return false;
+			}
+			applyAutoTune(entry.scene, file, overrides);
+			entry.scene->state.imageName = jobDirName(job_dir, entry.scene->state.imageName);
+			entry.file = file;
+			entry.overrides = overrides;
+			entry.key = key;
+			entry.camera = entry.scene->state.camera;
+			cache.insert(cache.begin(), entry);
+			message = "scene loaded";
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		job.message = message;
+		return true;
+	};
+	std::vector<RemoteCommand> commands; // nothing sends camera moves here
+	std::vector<uchar4> pixels;
+
+	// the worker threads, each marks itself done once its job is saved
+	struct Worker {
+		std::thread thread;
+		bool done = false;
+	};
+	std::list<Worker> workers;
+	int streamed_frame = 0;
+	while (!quit && concurrent > 1) {
+		commands.clear();
+		server.poll(10, commands);
+		std::unique_lock<std::mutex> guard(lock);
+		for (auto w = workers.begin(); w != workers.end();) {
+			if (w->done) {
+				w->thread.join();
+				w = workers.erase(w);
+			}
+			else {
+				++w;
+			}
+		}
+		const ServerJob* newest = NULL;
+		for (const ServerJob& job : jobs) {
+			if (job.preview_frame > streamed_frame && (newest == NULL || job.preview_frame > newest->preview_frame)) {
+				newest = &job;
+			}
+		}
+		if (newest != NULL) {
+			server.sendFrame(newest->preview);
+			streamed_frame = newest->preview_frame;
+		}
+		if (workers.size() >= concurrent) {
+			continue;
+		}
+		running = -1;
+		for (int i = 0; i < jobs.size(); i++) {
+			if (jobs[i].state == "queued" && (running < 0 || jobs[i].priority > jobs[running].priority)) {
+				running = i;
+			}
+		}
+		if (running < 0) {
+			continue;
+		}
+		ServerJob& job = jobs[running];
+		job.state = "loading";
+		const std::vector<std::string> tokens = utilityCore::tokenizeString(job.line);
+		guard.unlock();
+
+		HeadlessOptions options;
+		std::vector<std::string> overrides;
+		parseJobArgs(std::vector<std::string>(tokens.begin() + 1, tokens.end()), options, overrides);
+		placeJobFiles(job_dir, options);
+		auto load_start = std::chrono::steady_clock::now();
+		if (!cacheScene(job, tokens[0], overrides, sceneKey(tokens[0], overrides))) {
+			continue;
+		}
+		// the worker's own copy, the cached one stays as loaded for the next job
+		Scene* job_scene = new Scene(*cache[0].scene);
+		job_scene->state.camera = cache[0].camera;
+		applyCameraOverrides(options, job_scene->state.camera);
+		while (cache.size() > cache_size) {
+			delete cache.back().scene;
+			cache.pop_back();
+		}
+		std::chrono::duration<float, std::milli> load_time = std::chrono::steady_clock::now() - load_start;
+
+		guard.lock();
+		job.message += ", copied in " + std::to_string((int)load_time.count()) + " ms";
+		if (job.state != "loading") {
+			delete job_scene;
+			continue;
+		}
+		job.state = "rendering";
+		job.spp = options.spp > 0 ? options.spp : job_scene->state.iterations;
+		workers.emplace_back();
+		Worker& worker = workers.back();
+		worker.thread = std::thread([job_scene, options, progress_interval, &job, &lock, &preview_frames, &worker]() {
+			renderConcurrentJob(job_scene, options, progress_interval, job, lock, preview_frames);
+			std::lock_guard<std::mutex> guard(lock);
+			worker.done = true;
+		});
+	}
+	{
+		// the running jobs stop where they are and save
+		std::unique_lock<std::mutex> guard(lock);
+		for (ServerJob& job : jobs) {
+			if (job.state == "rendering") {
+				job.state = "cancelled";
+			}
+		}
+	}
+	for (Worker& worker : workers) {
+		worker.thread.join();
+	}
+
+	while (!quit && concurrent == 1) {
+		commands.clear();
+		server.poll(10, commands);
+		for (int i = 0; i < jobs.size(); i++) {
+			if (jobs[i].state == "queued" && (running < 0 || jobs[i].priority > jobs[running].priority)) {
+				running = i;
+			}
+		}
+		if (running < 0) {
+			continue;
+		}
+
+		std::vector<std::string> tokens = utilityCore::tokenizeString(jobs[running].line);
+		HeadlessOptions options;
+		std::vector<std::string> overrides;
+		parseJobArgs(std::vector<std::string>(tokens.begin() + 1, tokens.end()), options, overrides);
+		placeJobFiles(job_dir, options);
+		options.scene_key = sceneKey(tokens[0], overrides);
+		jobs[running].state = "loading";
+		auto load_start = std::chrono::steady_clock::now();
+		if (!cacheScene(jobs[running], tokens[0], overrides, options.scene_key)) {
+			running = -1;
+			continue;
+		}
+
+		scene = cache[0].scene;
+		scene->state.camera = cache[0].camera;
+		applyCameraOverrides(options, scene->state.camera);
+		if (resident == scene) {
+			pathtraceResetImage();
+		}
+		else {
+			if (resident != NULL) {
+				pathtraceFreeScene();
+			}
+			pathtraceInit(scene);
+			resident = scene;
+			initialized = true;
+		}
+		while (cache.size() > cache_size) {
+			delete cache.back().scene;
+			cache.pop_back();
+		}
+		std::chrono::duration<float, std::milli> load_time = std::chrono::steady_clock::now() - load_start;
+		jobs[running].message += ", started in " + std::to_string((int)load_time.count()) + " ms";
+
+		if (jobs[running].state == "loading") {
+			jobs[running].state = "rendering";
+			jobs[running].spp = options.spp > 0 ? options.spp : scene->state.iterations;
+			auto last_progress = std::chrono::steady_clock::now();
+			options.on_iteration = [&]() {
+				jobs[running].samples = iteration - firstIteration;
+				commands.clear();
+				server.poll(0, commands);
+				std::chrono::duration<float> since_progress = std::chrono::steady_clock::now() - last_progress;
+				// a progressive save's readback has the staging buffers
+				if (since_progress.count() >= progress_interval && !savePending) {
+					pathtraceRetrieveLDRImage(iteration - firstIteration, pixels);
+					encodeFrame(pixels, width, height, scene->render_settings.remote_quality, jobs[running].preview);
+					server.sendFrame(jobs[running].preview);
+					last_progress = std::chrono::steady_clock::now();
+				}
+				return !quit && jobs[running].state == "rendering";
+			};
+			// a cancelled job still saves what it has
+			JobResult result = renderJob(options);
+			jobs[running].samples = result.samples;
+			pathtraceRetrieveLDRImage(result.samples, pixels);
+			encodeFrame(pixels, width, height, scene->render_settings.remote_quality, jobs[running].preview);
+			server.sendFrame(jobs[running].preview);
+			if (jobs[running].state == "rendering") {
+				jobs[running].state = result.passed ? "done" : "failed";
+			}
+			if (!result.passed) {
+				jobs[running].message += ", RMSE " + std::to_string(result.rmse) + " against " + options.reference;
+			}
+		}
+		running = -1;
+	}
+
+	if (initialized) {
+		pathtraceFree();
+	}
+	for (CachedScene& entry : cache) {
+		delete entry.scene;
+	}
+	scene = NULL;
+	return 0;
 }
@@ -17,6 +17,7 @@
 #include <sstream>
 #include <stdlib.h>
 #include <string>
+#include <functional>
 
 #include "sceneStructs.h"
 #include "image.h"
@@ -38,7 +39,149 @@ extern int iteration;
 extern int width;
 extern int height;
 
+// command line batch rendering, see renderHeadless
+struct HeadlessOptions {
+    bool enabled = false;
+    int spp = 0; // 0 renders the scene's ITERATIONS
+    float time_budget = 0.0f; // seconds, 0 for no limit
+    std::string out; // empty uses the usual timestamped name
+    bool has_eye = false; // camera overrides
+    bool has_lookat = false;
+    glm::vec3 eye;
+    glm::vec3 lookat;
+    std::string sequence; // --sequence track file, renders its frames instead of one image
+    std::string dataset; // --dataset spec file, renders its randomized views instead of one image
+    std::string checkpoint; // --checkpoint file, empty uses <out or OUTFILE>.ckpt
+    bool resume = false; // --resume carries on from the checkpoint if it matches the scene
+    unsigned long long scene_key = 0; // sceneKey of the scene file and overrides the job renders
+    int range_first = -1; // --range FIRST COUNT renders iterations FIRST + 1 .. FIRST + COUNT into a partial for --merge
+    int range_count = 0;
+    bool cpu = false; // --cpu renders on the host with cpuRender, which reads spp, out and the camera overrides
+    int cpu_threads = 0; // --threads for --cpu and --hybrid, 0 for one per core (but one with --hybrid)
+    bool hybrid = false; // --hybrid, host threads render samples of the frame alongside the GPU, see cpuAssistStart
+    std::string reference; // --reference FILE, a .hdr the render has to match. a missing one fails the job
+    bool update_references = false; // --update-references writes the render to reference instead of comparing
+    float max_rmse = 0.01f; // --max-rmse, the RMSE of the averaged radiance against reference the job still passes at
+    glm::ivec2 probe = glm::ivec2(-1); // --probe X Y, pixel of the saved image pathtrace_Single traces once the render is done
+    int serve_port = 0; // --serve PORT streams the render to browsers instead, see renderRemote
+    std::string bind_address = "127.0.0.1"; // --bind, the interface --serve listens on, 0.0.0.0 lets other hosts in
+    std::function<bool()> on_iteration; // called after every iteration renderSamples traces, false stops the render
+};
+
+// one keyframed channel of a --sequence file, interpolated linearly between its keys
+struct SequenceTrack {
+    int object_id; // scene file OBJECT id, -1 for the camera
+    std::string channel; // EYE or LOOKAT for the camera, TRANS, ROTAT or SCALE for objects
+    std::vector<std::pair<int, glm::vec3>> keys; // (frame, value) in frame order
+};
+
+struct Sequence {
+    int frames = 1;
+    std::vector<SequenceTrack> tracks;
+};
+
+// a --dataset file: how many views and what's drawn at random for each of them
+struct DatasetJitter {
+    int material_id; // scene file MATERIAL id
+    float color = 0.0f; // COLOR, each channel of R scaled by 1 + uniform(-color, color)
+    glm::vec2 emittance = glm::vec2(-1.0f); // EMITTANCE, uniform between the two, negative keeps the scene's
+};
+
+struct DatasetSpec {
+    int views = 1;
+    unsigned int seed = 0;
+    int contexts = 1; // renderer contexts tracing views side by side, each with its own copy of the scene
+    bool has_eye = false; // EYE box, else the scene's
+    glm::vec3 eye_min, eye_max;
+    bool has_lookat = false; // LOOKAT box, else the scene's or the orbit center
+    glm::vec3 lookat_min, lookat_max;
+    bool orbit = false; // ORBIT, eyes on a shell around center instead of the EYE box
+    glm::vec3 orbit_center;
+    glm::vec2 orbit_radius;
+    glm::vec2 orbit_elevation; // degrees above the center's horizon
+    std::vector<DatasetJitter> jitters;
+};
+
+// what renderJob finished, the time and stats stop before the image is saved
+struct JobResult {
+    int samples = 0;
+    float seconds = 0.0f;
+    PathtraceStats stats;
+    float rmse = -1.0f; // against --reference, -1 without one
+    bool passed = true; // false when rmse is over --max-rmse
+};
+
+// one job of a --benchmark run
+struct BenchmarkResult {
+    std::string scene;
+    std::string settings; // the job's flags and overrides as written
+    glm::ivec2 resolution;
+    JobResult job;
+    double startup_ms[NUM_STARTUP_PHASES] = {}; // the scene load and upload it started with, 0 when it reused the last job's scene
+};
+
+void parseJobArgs(const std::vector<std::string>& args, HeadlessOptions& options, std::vector<std::string>& setting_overrides);
+void applyCameraOverrides(const HeadlessOptions& options, Camera& cam);
+const char* renderStopReason(const RenderSettings& settings, int iter, float elapsed, float time_budget);
+void reportStartup(const char* until);
+void reportRender(float elapsed, const char* stop_reason);
+JobResult renderJob(const HeadlessOptions& options);
+JobResult renderSamples(const HeadlessOptions& options, const char*& stop_reason, bool checkpoints = false);
+unsigned long long sceneKey(const std::string& scene_file, const std::vector<std::string>& overrides);
+std::string checkpointFilename(const HeadlessOptions& options);
+bool writeCheckpoint(const RenderCheckpoint& checkpoint, const std::string& filename);
+bool readCheckpoint(const std::string& filename, RenderCheckpoint& checkpoint);
+void saveCheckpoint(const std::string& filename, unsigned long long key);
+int mergePartials(const std::string& out, const std::vector<std::string>& partials);
+bool writeRayCapture(const RayCapture& capture, const std::string& filename);
+bool readRayCapture(const std::string& filename, RayCapture& capture);
+void saveRayCapture();
+int replayRayCapture(const std::string& filename, int repeat, bool cpu, bool stackless);
+bool loadSequence(const std::string& filename, Sequence& sequence);
+glm::vec3 sampleTrack(const SequenceTrack& track, int frame);
+int renderSequence(const HeadlessOptions& options);
+bool loadDatasetSpec(const std::string& filename, DatasetSpec& spec);
+int renderDataset(const HeadlessOptions& options);
+int renderRemote(const HeadlessOptions& options);
+int renderJobServer(const std::vector<std::string>& args);
+int renderBatch(const char* job_file, std::vector<BenchmarkResult>* results = NULL, bool update_references = false);
+int renderBenchmark(const std::vector<std::string>& args);
+float compareToReference(const std::string& reference, int samples, bool update);
+void reportProbe(const PathProbe& probe);
+bool writeProbeCSV(const PathProbe& probe, const std::string& filename);
+int checkBaseline(const std::string& filename, const std::vector<BenchmarkResult>& results, float tolerance, float min_ms);
+std::vector<std::string> autotuneScene(const std::string& scene_file, const std::vector<std::string>& overrides, int iterations);
+void applyAutoTune(Scene* s, const std::string& scene_file, const std::vector<std::string>& overrides);
+image* buildImage(const std::vector<glm::vec3>& sums, int samples, glm::ivec2 resolution);
+image* buildLDRImage(const std::vector<uchar4>& pixels, glm::ivec2 resolution);
+bool hasExtension(const std::string& filename, const char* extension);
+ImageReadback imageReadbackFor(const std::string& filename);
+void saveImageFile(image& img, const std::string& filename);
+void runOnImageWriter(const std::function<void()>& write);
+void writeImageAsync(image* img, const std::string& filename);
+void requestImageSave(const std::string& filename);
+void pollImageSave(bool wait);
+void finishImageWrites();
+void writeImage(const std::string& filename);
+std::string defaultImageName();
 void runCuda();
+void replaceScene(Scene* reloaded);
+void reloadScene();
+void resetCameraControls();
+void pollSceneWatch();
+// RENDER_THREAD, see startRenderThread. the GUI edits what these return: the scene itself, or
+// the window's copy of it whose edits the render thread picks up next frame
+void startRenderThread();
+void stopRenderThread(bool save = false);
+bool renderThreadRunning();
+RenderSettings& guiSettings();
+std::vector<Material>& guiMaterials();
+std::vector<Geom>& guiGeoms();
+const PathProbe& guiProbe();
+int guiIteration();
+void guiRestart();
+void guiMaterialEdited(int material_ID);
+void guiGeomEdited(int geom_ID);
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
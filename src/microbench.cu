@@ -0,0 +1,258 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cuda_runtime.h>
+
+#include "sceneStructs.h"
+#include "intersections.h"
+#include "interactions.h"
+#include "traversal.h"
+
+// the per ray and per bounce routines of intersections.h, traversal.h and interactions.h timed
+// on their own, on the host over one thread and on the GPU over arrays of random inputs. built
+// with BUILD_MICROBENCH: microbench [COUNT] [REPEAT]
+
+#define MICROBENCH_BLOCK_SIZE 128
+#define TRIS_PER_RAY 8 // tris each ray of the tri test is shot at, about one BLAS leaf
+
+struct RayInput {
+	glm::vec3 origin;
+	glm::vec3 direction;
+};
+
+struct ScatterInput {
+	glm::vec3 direction;
+	glm::vec3 normal;
+};
+
+// every op maps input i to one float, which keeps the whole routine live and is compared
+// between the host and the GPU
+struct SphereOp {
+	const RayInput* rays;
+	__host__ __device__ float operator()(int i) const {
+		glm::vec3 normal(0.0f);
+		float t = sphereIntersectionTest(rays[i].origin, rays[i].direction, normal);
+		return t + normal.x + normal.y + normal.z;
+	}
+};
+
+struct BoxOp {
+	const RayInput* rays;
+	__host__ __device__ float operator()(int i) const {
+		glm::vec3 normal(0.0f);
+		float t = boxIntersectionTest(rays[i].origin, rays[i].direction, normal);
+		return t + normal.x + normal.y + normal.z;
+	}
+};
+
+struct SquarePlaneOp {
+	const RayInput* rays;
+	__host__ __device__ float operator()(int i) const {
+		glm::vec3 normal(0.0f);
+		float t = squareplaneIntersectionTest(rays[i].origin, rays[i].direction, normal);
+		return t + normal.z;
+	}
+};
+
+// one TriRay set up per ray and tested against TRIS_PER_RAY tris, the closest t and its weights
+struct TriOp {
+	const RayInput* rays;
+	const TriIntersect* tris;
+	__host__ __device__ float operator()(int i) const {
+		TriRay tr = makeTriRay(makeRay(rays[i].origin, rays[i].direction));
+		float t_closest = MAX_INTERSECT_DIST;
+		glm::vec3 bary(0.0f);
+		for (int j = 0; j < TRIS_PER_RAY; j++) {
+			float t;
+			glm::vec3 s;
+			if (intersectTri(tris[i * TRIS_PER_RAY + j], tr, t, s) && t > MIN_INTERSECT_DIST && t < t_closest) {
+				t_closest = t;
+				bary = s;
+			}
+		}
+		return t_closest + bary.x;
+	}
+};
+
+struct FresnelOp {
+	const float* cos_theta;
+	__host__ __device__ float operator()(int i) const {
+		return fresnelDielectric(cos_theta[i], 1.5f).x;
+	}
+};
+
+// bsdf >= 0 shades every input with that material, -1 cycles through them all so a warp
+// diverges like a mixed scene does
+struct ScatterOp {
+	const ScatterInput* inputs;
+	const Material* materials;
+	int bsdf;
+	__host__ __device__ float operator()(int i) const {
+		const Material& m = materials[bsdf >= 0 ? bsdf : i % NUM_BSDF_TYPES];
+		glm::vec3 origin(0.0f);
+		glm::vec3 direction = inputs[i].direction;
+		glm::vec3 throughput(1.0f);
+		Sampler rng(i, 1, 0, STREAM_SCATTER, SAMPLER_RANDOM);
+		scatterRay(origin, direction, throughput, glm::vec3(0.0f), inputs[i].normal, m, rng);
+		return glm::dot(direction, glm::vec3(1.0f, 2.0f, 3.0f)) + throughput.x + throughput.y + throughput.z;
+	}
+};
+
+template <typename Op>
+__global__ void benchKernel(Op op, int count, float* out) {
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	if (i < count) {
+		out[i] = op(i);
+	}
+}
+
+static void checkCUDA(const char* msg) {
+	cudaError_t err = cudaGetLastError();
+	if (err != cudaSuccess) {
+		fprintf(stderr, "CUDA error: %s: %s\n", msg, cudaGetErrorString(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+template <typename T>
+static T* upload(const std::vector<T>& values) {
+	T* dev = NULL;
+	cudaMalloc(&dev, values.size() * sizeof(T));
+	cudaMemcpy(dev, values.data(), values.size() * sizeof(T), cudaMemcpyHostToDevice);
+	checkCUDA("upload");
+	return dev;
+}
+
+// best of repeat runs of both sides, and how many outputs agree within a relative 1e-3 (the GPU
+// contracts multiplies and adds into fmas the host doesn't)
+template <typename Op>
+static void bench(const char* name, const Op& host_op, const Op& dev_op, int count, int repeat, float* dev_out) {
+	std::vector<float> host_out(count), gpu_out(count);
+	double host_ms = 1e30;
+	for (int r = 0; r < repeat; r++) {
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; i++) {
+			host_out[i] = host_op(i);
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		host_ms = glm::min(host_ms, elapsed.count());
+	}
+
+	const int blocks = (count + MICROBENCH_BLOCK_SIZE - 1) / MICROBENCH_BLOCK_SIZE;
+	cudaEvent_t start, stop;
+	cudaEventCreate(&start);
+	cudaEventCreate(&stop);
+	benchKernel<<<blocks, MICROBENCH_BLOCK_SIZE>>>(dev_op, count, dev_out); // warm up
+	float gpu_ms = 1e30f;
+	for (int r = 0; r < repeat; r++) {
+		float ms;
+		cudaEventRecord(start);
+		benchKernel<<<blocks, MICROBENCH_BLOCK_SIZE>>>(dev_op, count, dev_out);
+		cudaEventRecord(stop);
+		cudaEventSynchronize(stop);
+		cudaEventElapsedTime(&ms, start, stop);
+		gpu_ms = glm::min(gpu_ms, ms);
+	}
+	cudaEventDestroy(start);
+	cudaEventDestroy(stop);
+	checkCUDA(name);
+	cudaMemcpy(gpu_out.data(), dev_out, count * sizeof(float), cudaMemcpyDeviceToHost);
+
+	int agree = 0;
+	for (int i = 0; i < count; i++) {
+		agree += glm::abs(host_out[i] - gpu_out[i]) <= 1e-3f * glm::max(1.0f, glm::abs(host_out[i]));
+	}
+	printf("%-22s %10.2f %12.1f %12.1f %10.3f%%\n", name, host_ms * 1e6 / count, count / (host_ms * 1e3),
+		count / (gpu_ms * 1e3), 100.0 * agree / count);
+}
+
+int main(int argc, char** argv) {
+	const int count = argc > 1 ? atoi(argv[1]) : 1 << 20;
+	const int repeat = argc > 2 ? glm::max(atoi(argv[2]), 1) : 5;
+	if (count < 1) {
+		printf("Usage: %s [COUNT] [REPEAT]\n", argv[0]);
+		return 1;
+	}
+
+	cudaDeviceProp prop;
+	cudaGetDeviceProperties(&prop, 0);
+	checkCUDA("cudaGetDeviceProperties");
+	printf("%d inputs, best of %d, %s\n\n", count, repeat, prop.name);
+
+	// fixed seed, every run times the same inputs
+	std::mt19937 gen(565);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::normal_distribution<float> normal_dist;
+	auto randomDirection = [&]() {
+		return glm::normalize(glm::vec3(normal_dist(gen), normal_dist(gen), normal_dist(gen)));
+	};
+
+	// rays from a sphere of radius 2 around the unit shapes toward a point near them, most hit.
+	// the tris sit in the same region
+	std::vector<RayInput> rays(count);
+	for (int i = 0; i < count; i++) {
+		rays[i].origin = 2.0f * randomDirection();
+		glm::vec3 target = 0.6f * glm::vec3(unit(gen), unit(gen), unit(gen));
+		rays[i].direction = glm::normalize(target - rays[i].origin);
+	}
+	std::vector<TriIntersect> tris((size_t)count * TRIS_PER_RAY);
+	for (size_t i = 0; i < tris.size(); i++) {
+		glm::vec3 center = 0.5f * glm::vec3(unit(gen), unit(gen), unit(gen));
+		tris[i].p0 = center + 0.3f * glm::vec3(unit(gen), unit(gen), unit(gen));
+		tris[i].p1 = center + 0.3f * glm::vec3(unit(gen), unit(gen), unit(gen));
+		tris[i].p2 = center + 0.3f * glm::vec3(unit(gen), unit(gen), unit(gen));
+	}
+	std::vector<float> cos_theta(count);
+	std::vector<ScatterInput> scatter(count);
+	for (int i = 0; i < count; i++) {
+		cos_theta[i] = unit(gen);
+		scatter[i].normal = randomDirection();
+		scatter[i].direction = randomDirection();
+		if (glm::dot(scatter[i].direction, scatter[i].normal) > 0.0f) {
+			scatter[i].direction = -scatter[i].direction; // incoming, against the normal
+		}
+	}
+	std::vector<Material> materials(NUM_BSDF_TYPES);
+	for (int b = 0; b < NUM_BSDF_TYPES; b++) {
+		materials[b].R = glm::vec3(0.8f, 0.6f, 0.4f);
+		materials[b].T = glm::vec3(0.9f);
+		materials[b].type = (BSDF)b;
+		materials[b].ior = 1.5f;
+		materials[b].emittance = 0.0f;
+	}
+
+	RayInput* dev_rays = upload(rays);
+	TriIntersect* dev_tris = upload(tris);
+	float* dev_cos_theta = upload(cos_theta);
+	ScatterInput* dev_scatter = upload(scatter);
+	Material* dev_materials = upload(materials);
+	float* dev_out = NULL;
+	cudaMalloc(&dev_out, count * sizeof(float));
+	checkCUDA("cudaMalloc");
+
+	printf("%-22s %10s %12s %12s %11s\n", "routine", "host ns", "host Mops/s", "GPU Mops/s", "agree");
+	bench("sphere", SphereOp{ rays.data() }, SphereOp{ dev_rays }, count, repeat, dev_out);
+	bench("box", BoxOp{ rays.data() }, BoxOp{ dev_rays }, count, repeat, dev_out);
+	bench("square plane", SquarePlaneOp{ rays.data() }, SquarePlaneOp{ dev_rays }, count, repeat, dev_out);
+	bench("tri x8", TriOp{ rays.data(), tris.data() }, TriOp{ dev_rays, dev_tris }, count, repeat, dev_out);
+	bench("fresnelDielectric", FresnelOp{ cos_theta.data() }, FresnelOp{ dev_cos_theta }, count, repeat, dev_out);
+	const char* bsdf_names[NUM_BSDF_TYPES] = { "diffuse brdf", "diffuse btdf", "spec brdf", "spec btdf", "spec glass",
+		"spec plastic", "microfacet brdf" };
+	char name[64];
+	for (int b = -1; b < NUM_BSDF_TYPES; b++) {
+		snprintf(name, sizeof(name), "scatterRay %s", b >= 0 ? bsdf_names[b] : "mixed");
+		bench(name, ScatterOp{ scatter.data(), materials.data(), b }, ScatterOp{ dev_scatter, dev_materials, b }, count,
+			repeat, dev_out);
+	}
+
+	cudaFree(dev_rays);
+	cudaFree(dev_tris);
+	cudaFree(dev_cos_theta);
+	cudaFree(dev_scatter);
+	cudaFree(dev_materials);
+	cudaFree(dev_out);
+	return 0;
+}
@@ -0,0 +1,486 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <optix.h>
+#include <optix_stubs.h>
+#include <optix_function_table_definition.h>
+
+#include "optix_backend.h"
+#include "pathtrace.h"
+
+#define OPTIX_BLOCK_SIZE 128
+
+// OptiX takes driver API streams, where 0 is the legacy default stream that every other stream
+// waits on. its work goes on the calling renderer thread's default stream instead, with the rest
+// of that thread's launches
+#define OPTIX_STREAM ((CUstream)cudaStreamPerThread)
+
+#define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#define checkOptix(call) checkOptixFn(call, #call, FILENAME, __LINE__)
+static bool checkOptixFn(OptixResult result, const char* call, const char* file, int line) {
+	if (result == OPTIX_SUCCESS) {
+		return true;
+	}
+	fprintf(stderr, "OptiX error: %s (%s) at %s:%d\n", optixGetErrorName(result), call, file, line);
+	return false;
+}
+
+// the SBT records carry no data, the programs read everything from the launch params
+struct alignas(OPTIX_SBT_RECORD_ALIGNMENT) SbtRecord {
+	char header[OPTIX_SBT_RECORD_HEADER_SIZE];
+};
+
+enum OptixGroup {
+	GROUP_RAYGEN,
+	GROUP_MISS,
+	GROUP_TRI_HITS,
+	GROUP_ANALYTIC_HITS,
+};
+
+// SBT offset of each instance kind, its GAS has one build input with one record
+#define SBT_TRIS 0
+#define SBT_ANALYTIC 1
+
+static void contextLog(unsigned int level, const char* tag, const char* message, void*) {
+	if (level <= 2) {
+		std::cout << "OptiX [" << tag << "]: " << message << std::endl;
+	}
+}
+
+bool optixInitDevice(OptixScene& optix) {
+	if (optix.pipeline != NULL) {
+		return true;
+	}
+	cudaFree(0);
+	if (!checkOptix(optixInit())) {
+		return false;
+	}
+	OptixDeviceContextOptions context_options = {};
+	context_options.logCallbackFunction = &contextLog;
+	context_options.logCallbackLevel = 4;
+	if (!checkOptix(optixDeviceContextCreate(0, &context_options, &optix.context))) {
+		return false;
+	}
+
+	std::ifstream ptx_file(OPTIX_PTX_PATH);
+	if (!ptx_file) {
+		std::cout << "ERROR: can't read the OptiX programs at " << OPTIX_PTX_PATH << std::endl;
+		return false;
+	}
+	std::stringstream ptx;
+	ptx << ptx_file.rdbuf();
+	const std::string ptx_source = ptx.str();
+
+	OptixModuleCompileOptions module_options = {};
+	module_options.optLevel = OPTIX_COMPILE_OPTIMIZATION_DEFAULT;
+	module_options.debugLevel = OPTIX_COMPILE_DEBUG_LEVEL_NONE;
+
+	// IAS over GASes, 8 payload values for the hit and 3 attributes for the analytic normal
+	OptixPipelineCompileOptions pipeline_options = {};
+	pipeline_options.usesMotionBlur = 0;
+	pipeline_options.traversableGraphFlags = OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_SINGLE_LEVEL_INSTANCING;
+	pipeline_options.numPayloadValues = 8;
+	pipeline_options.numAttributeValues = 3;
+	pipeline_options.exceptionFlags = OPTIX_EXCEPTION_FLAG_NONE;
+	pipeline_options.pipelineLaunchParamsVariableName = "params";
+	pipeline_options.usesPrimitiveTypeFlags = OPTIX_PRIMITIVE_TYPE_FLAGS_TRIANGLE | OPTIX_PRIMITIVE_TYPE_FLAGS_CUSTOM;
+
+	char log[2048];
+	size_t log_size = sizeof(log);
+#if OPTIX_VERSION >= 70700
+	OptixResult module_result = optixModuleCreate(optix.context, &module_options, &pipeline_options,
+		ptx_source.c_str(), ptx_source.size(), log, &log_size, &optix.module);
+#else
+	OptixResult module_result = optixModuleCreateFromPTX(optix.context, &module_options, &pipeline_options,
+		ptx_source.c_str(), ptx_source.size(), log, &log_size, &optix.module);
+#endif
+	if (!checkOptix(module_result)) {
+		std::cout << log << std::endl;
+		return false;
+	}
+
+	OptixProgramGroupDesc descs[4] = {};
+	descs[GROUP_RAYGEN].kind = OPTIX_PROGRAM_GROUP_KIND_RAYGEN;
+	descs[GROUP_RAYGEN].raygen.module = optix.module;
+	descs[GROUP_RAYGEN].raygen.entryFunctionName = "__raygen__trace";
+	descs[GROUP_MISS].kind = OPTIX_PROGRAM_GROUP_KIND_MISS;
+	descs[GROUP_MISS].miss.module = optix.module;
+	descs[GROUP_MISS].miss.entryFunctionName = "__miss__trace";
+	descs[GROUP_TRI_HITS].kind = OPTIX_PROGRAM_GROUP_KIND_HITGROUP;
+	descs[GROUP_TRI_HITS].hitgroup.moduleCH = optix.module;
+	descs[GROUP_TRI_HITS].hitgroup.entryFunctionNameCH = "__closesthit__trace";
+	descs[GROUP_TRI_HITS].hitgroup.moduleAH = optix.module;
+	descs[GROUP_TRI_HITS].hitgroup.entryFunctionNameAH = "__anyhit__trace";
+	descs[GROUP_ANALYTIC_HITS] = descs[GROUP_TRI_HITS];
+	descs[GROUP_ANALYTIC_HITS].hitgroup.moduleIS = optix.module;
+	descs[GROUP_ANALYTIC_HITS].hitgroup.entryFunctionNameIS = "__intersection__analytic";
+
+	OptixProgramGroupOptions group_options = {};
+	log_size = sizeof(log);
+	if (!checkOptix(optixProgramGroupCreate(optix.context, descs, 4, &group_options, log, &log_size, optix.groups))) {
+		std::cout << log << std::endl;
+		return false;
+	}
+
+	OptixPipelineLinkOptions link_options = {};
+	link_options.maxTraceDepth = 1;
+	log_size = sizeof(log);
+	if (!checkOptix(optixPipelineCreate(optix.context, &pipeline_options, &link_options, optix.groups, 4, log, &log_size, &optix.pipeline))) {
+		std::cout << log << std::endl;
+		return false;
+	}
+
+	// raygen, miss, then the hit groups in SBT_TRIS, SBT_ANALYTIC order
+	SbtRecord records[4];
+	for (int g = 0; g < 4; g++) {
+		optixSbtRecordPackHeader(optix.groups[g], &records[g]);
+	}
+	SbtRecord* dev_records;
+	cudaMalloc(&dev_records, sizeof(records));
+	cudaMemcpy(dev_records, records, sizeof(records), cudaMemcpyHostToDevice);
+	optix.sbt.raygenRecord = (CUdeviceptr)&dev_records[GROUP_RAYGEN];
+	optix.sbt.missRecordBase = (CUdeviceptr)&dev_records[GROUP_MISS];
+	optix.sbt.missRecordStrideInBytes = sizeof(SbtRecord);
+	optix.sbt.missRecordCount = 1;
+	optix.sbt.hitgroupRecordBase = (CUdeviceptr)&dev_records[GROUP_TRI_HITS];
+	optix.sbt.hitgroupRecordStrideInBytes = sizeof(SbtRecord);
+	optix.sbt.hitgroupRecordCount = 2;
+
+	cudaMalloc(&optix.dev_params, sizeof(OptixLaunchParams));
+	return true;
+}
+
+// ids of the three vertices tri i has in dev_tris read as a float3 array, one TriIntersect is
+// four float3s wide so tri i starts at vertex 4i
+__global__ void fillTriVertexIDs(int num_tris, unsigned int* vertex_ids) {
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	if (i < num_tris) {
+		vertex_ids[3 * i + 0] = 4 * i + 0;
+		vertex_ids[3 * i + 1] = 4 * i + 1;
+		vertex_ids[3 * i + 2] = 4 * i + 2;
+	}
+}
+
+static OptixBuildInput blasBuildInput(const OptixScene& optix, const BLAS& blas, const TriIntersect* dev_tris, CUdeviceptr& vertices,
+	const unsigned int& flags) {
+	static_assert(sizeof(TriIntersect) == 4 * sizeof(float3), "a TriIntersect has to be four float3s for the GAS to index it as vertices");
+	vertices = (CUdeviceptr)(dev_tris + blas.tri_offset);
+	OptixBuildInput input = {};
+	input.type = OPTIX_BUILD_INPUT_TYPE_TRIANGLES;
+	input.triangleArray.vertexFormat = OPTIX_VERTEX_FORMAT_FLOAT3;
+	input.triangleArray.vertexStrideInBytes = sizeof(float3);
+	input.triangleArray.numVertices = 4 * blas.num_tris;
+	input.triangleArray.vertexBuffers = &vertices;
+	input.triangleArray.indexFormat = OPTIX_INDICES_FORMAT_UNSIGNED_INT3;
+	input.triangleArray.indexStrideInBytes = 3 * sizeof(unsigned int);
+	input.triangleArray.numIndexTriplets = blas.num_tris;
+	input.triangleArray.indexBuffer = (CUdeviceptr)optix.dev_tri_vertex_ids;
+	input.triangleArray.flags = &flags;
+	input.triangleArray.numSbtRecords = 1;
+	return input;
+}
+
+// builds one acceleration structure into new arena memory, or with a NULL arena refits the one
+// already in buffer in place
+static OptixTraversableHandle buildAccel(const OptixScene& optix, const OptixBuildInput& input, unsigned int build_flags,
+	CUdeviceptr& buffer, size_t& buffer_bytes, DeviceArena* arena, DeviceArena& scratch) {
+	const bool update = arena == NULL;
+	OptixAccelBuildOptions options = {};
+	options.buildFlags = build_flags;
+	options.operation = update ? OPTIX_BUILD_OPERATION_UPDATE : OPTIX_BUILD_OPERATION_BUILD;
+	OptixAccelBufferSizes sizes;
+	checkOptix(optixAccelComputeMemoryUsage(optix.context, &options, &input, 1, &sizes));
+	if (!update) {
+		buffer = (CUdeviceptr)arena->allocBytes(sizes.outputSizeInBytes, MEM_BVH, OPTIX_ACCEL_BUFFER_BYTE_ALIGNMENT);
+		buffer_bytes = sizes.outputSizeInBytes;
+	}
+	size_t temp_bytes = update ? sizes.tempUpdateSizeInBytes : sizes.tempSizeInBytes;
+	CUdeviceptr temp = (CUdeviceptr)scratch.allocBytes(temp_bytes, MEM_SCRATCH, OPTIX_ACCEL_BUFFER_BYTE_ALIGNMENT);
+	OptixTraversableHandle handle = 0;
+	checkOptix(optixAccelBuild(optix.context, OPTIX_STREAM, &options, &input, 1, temp, temp_bytes, buffer, buffer_bytes, &handle, NULL, 0));
+	return handle;
+}
+
+// instance i is geom i, meshes point at their BLAS's GAS, curves at their set's and analytic geoms at their shape's.
+// the mask bit is the geom type so the ray's mask does what geom_mask does in software
+static void buildInstances(OptixScene& optix, const Scene* scene, DeviceArena& scratch, bool rebuild) {
+	std::vector<OptixInstance> instances(scene->geoms.size());
+	for (size_t i = 0; i < scene->geoms.size(); i++) {
+		const Geom& geom = scene->geoms[i];
+		OptixInstance& instance = instances[i];
+		memset(&instance, 0, sizeof(OptixInstance));
+		// row major 3x4 object to world
+		for (int row = 0; row < 3; row++) {
+			for (int col = 0; col < 4; col++) {
+				instance.transform[4 * row + col] = geom.transform[col][row];
+			}
+		}
+		instance.instanceId = i;
+		instance.visibilityMask = 1 << geom.type;
+		instance.flags = OPTIX_INSTANCE_FLAG_NONE;
+		if (geom.type == MESH) {
+			instance.sbtOffset = SBT_TRIS;
+			instance.traversableHandle = optix.blas_handles[geom.blas_ID];
+			if (instance.traversableHandle == 0) {
+				instance.visibilityMask = 0;
+			}
+		}
+		else if (geom.type == CURVES) {
+			instance.sbtOffset = SBT_ANALYTIC;
+			instance.traversableHandle = optix.curve_handles[geom.blas_ID];
+			if (instance.traversableHandle == 0) {
+				instance.visibilityMask = 0;
+			}
+		}
+		else if (geom.type == VOLUME) {
+			// no surface to hit, the kernels delta track volumes after the launch
+			instance.sbtOffset = SBT_ANALYTIC;
+			instance.traversableHandle = optix.analytic_handles[1];
+			instance.visibilityMask = 0;
+		}
+		else {
+			instance.sbtOffset = SBT_ANALYTIC;
+			instance.traversableHandle = optix.analytic_handles[geom.type == SPHERE ? 0 : geom.type == CUBE ? 1 : 2];
+		}
+	}
+	cudaMemcpy(optix.dev_instances, instances.data(), instances.size() * sizeof(OptixInstance), cudaMemcpyHostToDevice);
+
+	OptixBuildInput input = {};
+	input.type = OPTIX_BUILD_INPUT_TYPE_INSTANCES;
+	input.instanceArray.instances = (CUdeviceptr)optix.dev_instances;
+	input.instanceArray.numInstances = instances.size();
+	// the IAS is small, a rebuild into the same buffer keeps it tight as geoms move
+	OptixAccelBuildOptions options = {};
+	options.buildFlags = OPTIX_BUILD_FLAG_PREFER_FAST_TRACE;
+	options.operation = OPTIX_BUILD_OPERATION_BUILD;
+	OptixAccelBufferSizes sizes;
+	checkOptix(optixAccelComputeMemoryUsage(optix.context, &options, &input, 1, &sizes));
+	if (rebuild && sizes.outputSizeInBytes > optix.ias_bytes) {
+		std::cout << "ERROR: the rebuilt OptiX IAS doesn't fit its buffer" << std::endl;
+		return;
+	}
+	CUdeviceptr temp = (CUdeviceptr)scratch.allocBytes(sizes.tempSizeInBytes, MEM_SCRATCH, OPTIX_ACCEL_BUFFER_BYTE_ALIGNMENT);
+	checkOptix(optixAccelBuild(optix.context, OPTIX_STREAM, &options, &input, 1, temp, sizes.tempSizeInBytes, optix.ias_buffer, optix.ias_bytes,
+		&optix.ias, NULL, 0));
+}
+
+void optixBuildScene(OptixScene& optix, const Scene* scene, const TriIntersect* dev_tris, DeviceArena& arena, DeviceArena& scratch) {
+	optixFreeScene(optix);
+
+	// every BLAS indexes its own stretch of dev_tris the same way, so one index buffer as
+	// long as the largest BLAS serves all of them
+	int max_tris = 0;
+	for (const BLAS& blas : scene->blases) {
+		max_tris = glm::max(max_tris, blas.num_tris);
+	}
+	if (max_tris > 0) {
+		optix.dev_tri_vertex_ids = arena.alloc<unsigned int>(3 * max_tris, MEM_BVH);
+		fillTriVertexIDs << <(max_tris + OPTIX_BLOCK_SIZE - 1) / OPTIX_BLOCK_SIZE, OPTIX_BLOCK_SIZE >> > (max_tris, optix.dev_tri_vertex_ids);
+	}
+
+	// refits update the GAS in place, so meshes keep the update flag
+	const unsigned int tri_flags = OPTIX_GEOMETRY_FLAG_NONE;
+	optix.blas_handles.assign(scene->blases.size(), 0);
+	optix.blas_buffers.assign(scene->blases.size(), 0);
+	optix.blas_bytes.assign(scene->blases.size(), 0);
+	for (size_t b = 0; b < scene->blases.size(); b++) {
+		const BLAS& blas = scene->blases[b];
+		if (blas.num_tris == 0) {
+			continue;
+		}
+		CUdeviceptr vertices;
+		OptixBuildInput input = blasBuildInput(optix, blas, dev_tris, vertices, tri_flags);
+		optix.blas_handles[b] = buildAccel(optix, input, OPTIX_BUILD_FLAG_PREFER_FAST_TRACE | OPTIX_BUILD_FLAG_ALLOW_UPDATE,
+			optix.blas_buffers[b], optix.blas_bytes[b], &arena, scratch);
+	}
+
+	// one box around each unit shape, see intersections.h. the plane gets a sliver of depth
+	const OptixAabb shape_boxes[3] = {
+		{ -0.5f, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f },
+		{ -0.5f, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f },
+		{ -0.5001f, -0.5001f, -0.0001f, 0.5001f, 0.5001f, 0.0001f },
+	};
+	OptixAabb* dev_shape_boxes = scratch.alloc<OptixAabb>(3, MEM_SCRATCH);
+	cudaMemcpy(dev_shape_boxes, shape_boxes, sizeof(shape_boxes), cudaMemcpyHostToDevice);
+	const unsigned int analytic_flags = OPTIX_GEOMETRY_FLAG_NONE;
+	for (int s = 0; s < 3; s++) {
+		CUdeviceptr boxes = (CUdeviceptr)(dev_shape_boxes + s);
+		OptixBuildInput input = {};
+		input.type = OPTIX_BUILD_INPUT_TYPE_CUSTOM_PRIMITIVES;
+		input.customPrimitiveArray.aabbBuffers = &boxes;
+		input.customPrimitiveArray.numPrimitives = 1;
+		input.customPrimitiveArray.flags = &analytic_flags;
+		input.customPrimitiveArray.numSbtRecords = 1;
+		CUdeviceptr buffer;
+		size_t bytes;
+		optix.analytic_handles[s] = buildAccel(optix, input, OPTIX_BUILD_FLAG_PREFER_FAST_TRACE, buffer, bytes, &arena, scratch);
+	}
+
+	// a curve set is a single box too, __intersection__analytic walks the set's own BVH inside it
+	optix.curve_handles.assign(scene->curve_sets.size(), 0);
+	if (!scene->curve_sets.empty()) {
+		std::vector<OptixAabb> curve_boxes(scene->curve_sets.size());
+		for (size_t c = 0; c < scene->curve_sets.size(); c++) {
+			const CurveSet& set = scene->curve_sets[c];
+			curve_boxes[c] = { set.AABB_min.x, set.AABB_min.y, set.AABB_min.z, set.AABB_max.x, set.AABB_max.y, set.AABB_max.z };
+		}
+		OptixAabb* dev_curve_boxes = scratch.alloc<OptixAabb>(curve_boxes.size(), MEM_SCRATCH);
+		cudaMemcpy(dev_curve_boxes, curve_boxes.data(), curve_boxes.size() * sizeof(OptixAabb), cudaMemcpyHostToDevice);
+		for (size_t c = 0; c < scene->curve_sets.size(); c++) {
+			if (scene->curve_sets[c].num_segments == 0) {
+				continue;
+			}
+			CUdeviceptr boxes = (CUdeviceptr)(dev_curve_boxes + c);
+			OptixBuildInput input = {};
+			input.type = OPTIX_BUILD_INPUT_TYPE_CUSTOM_PRIMITIVES;
+			input.customPrimitiveArray.aabbBuffers = &boxes;
+			input.customPrimitiveArray.numPrimitives = 1;
+			input.customPrimitiveArray.flags = &analytic_flags;
+			input.customPrimitiveArray.numSbtRecords = 1;
+			CUdeviceptr buffer;
+			size_t bytes;
+			optix.curve_handles[c] = buildAccel(optix, input, OPTIX_BUILD_FLAG_PREFER_FAST_TRACE, buffer, bytes, &arena, scratch);
+		}
+	}
+
+	if (scene->geoms.empty()) {
+		return;
+	}
+	optix.dev_instances = arena.alloc<OptixInstance>(scene->geoms.size(), MEM_BVH, OPTIX_INSTANCE_BYTE_ALIGNMENT);
+	// the instance count never changes with the scene, size the IAS once for every rebuild
+	OptixBuildInput input = {};
+	input.type = OPTIX_BUILD_INPUT_TYPE_INSTANCES;
+	input.instanceArray.instances = (CUdeviceptr)optix.dev_instances;
+	input.instanceArray.numInstances = scene->geoms.size();
+	OptixAccelBuildOptions options = {};
+	options.buildFlags = OPTIX_BUILD_FLAG_PREFER_FAST_TRACE;
+	options.operation = OPTIX_BUILD_OPERATION_BUILD;
+	OptixAccelBufferSizes sizes;
+	checkOptix(optixAccelComputeMemoryUsage(optix.context, &options, &input, 1, &sizes));
+	optix.ias_bytes = sizes.outputSizeInBytes;
+	optix.ias_buffer = (CUdeviceptr)arena.allocBytes(optix.ias_bytes, MEM_BVH, OPTIX_ACCEL_BUFFER_BYTE_ALIGNMENT);
+	buildInstances(optix, scene, scratch, false);
+}
+
+void optixRefitBLAS(OptixScene& optix, const Scene* scene, int blas_ID, const TriIntersect* dev_tris, DeviceArena& scratch) {
+	if (optix.blas_handles[blas_ID] == 0) {
+		return;
+	}
+	const unsigned int tri_flags = OPTIX_GEOMETRY_FLAG_NONE;
+	CUdeviceptr vertices;
+	OptixBuildInput input = blasBuildInput(optix, scene->blases[blas_ID], dev_tris, vertices, tri_flags);
+	optix.blas_handles[blas_ID] = buildAccel(optix, input, OPTIX_BUILD_FLAG_PREFER_FAST_TRACE | OPTIX_BUILD_FLAG_ALLOW_UPDATE,
+		optix.blas_buffers[blas_ID], optix.blas_bytes[blas_ID], NULL, scratch);
+	buildInstances(optix, scene, scratch, true);
+}
+
+void optixUpdateInstances(OptixScene& optix, const Scene* scene, DeviceArena& scratch) {
+	if (optix.dev_instances != NULL) {
+		buildInstances(optix, scene, scratch, true);
+	}
+}
+
+void optixTraceQuery(OptixScene& optix, OptixLaunchParams params) {
+	if (params.num_rays == 0) {
+		return;
+	}
+	params.handle = optix.ias;
+	cudaMemcpyAsync(optix.dev_params, &params, sizeof(OptixLaunchParams), cudaMemcpyHostToDevice, 0);
+	checkOptix(optixLaunch(optix.pipeline, OPTIX_STREAM, (CUdeviceptr)optix.dev_params, sizeof(OptixLaunchParams), &optix.sbt, params.num_rays, 1, 1));
+}
+
+bool optixInitDenoiser(OptixScene& optix, glm::ivec2 resolution, DeviceArena& arena) {
+	OptixDenoiserOptions options = {};
+	options.guideAlbedo = 1;
+	options.guideNormal = 1;
+	if (!checkOptix(optixDenoiserCreate(optix.context, OPTIX_DENOISER_MODEL_KIND_HDR, &options, &optix.denoiser))) {
+		optix.denoiser = NULL;
+		return false;
+	}
+	OptixDenoiserSizes sizes;
+	checkOptix(optixDenoiserComputeMemoryResources(optix.denoiser, resolution.x, resolution.y, &sizes));
+	optix.denoiser_resolution = resolution;
+	optix.denoiser_state_bytes = sizes.stateSizeInBytes;
+	optix.denoiser_scratch_bytes = sizes.withoutOverlapScratchSizeInBytes;
+	optix.denoiser_state = (CUdeviceptr)arena.allocBytes(optix.denoiser_state_bytes, MEM_IMAGE);
+	optix.denoiser_scratch = (CUdeviceptr)arena.allocBytes(optix.denoiser_scratch_bytes, MEM_IMAGE);
+	optix.denoiser_intensity = (CUdeviceptr)arena.alloc<float>(1, MEM_IMAGE);
+	return checkOptix(optixDenoiserSetup(optix.denoiser, OPTIX_STREAM, resolution.x, resolution.y, optix.denoiser_state, optix.denoiser_state_bytes,
+		optix.denoiser_scratch, optix.denoiser_scratch_bytes));
+}
+
+static OptixImage2D denoiserImage(const OptixScene& optix, const glm::vec3* pixels) {
+	OptixImage2D image = {};
+	image.data = (CUdeviceptr)pixels;
+	image.width = optix.denoiser_resolution.x;
+	image.height = optix.denoiser_resolution.y;
+	image.rowStrideInBytes = optix.denoiser_resolution.x * sizeof(glm::vec3);
+	image.pixelStrideInBytes = sizeof(glm::vec3);
+	image.format = OPTIX_PIXEL_FORMAT_FLOAT3;
+	return image;
+}
+
+void optixDenoise(OptixScene& optix, const glm::vec3* color, const glm::vec3* albedo, const glm::vec3* normal, glm::vec3* output) {
+	OptixDenoiserLayer layer = {};
+	layer.input = denoiserImage(optix, color);
+	layer.output = denoiserImage(optix, output);
+	OptixDenoiserGuideLayer guides = {};
+	guides.albedo = denoiserImage(optix, albedo);
+	guides.normal = denoiserImage(optix, normal);
+
+	checkOptix(optixDenoiserComputeIntensity(optix.denoiser, OPTIX_STREAM, &layer.input, optix.denoiser_intensity,
+		optix.denoiser_scratch, optix.denoiser_scratch_bytes));
+	OptixDenoiserParams params = {};
+	params.hdrIntensity = optix.denoiser_intensity;
+	params.blendFactor = 0.0f;
+	checkOptix(optixDenoiserInvoke(optix.denoiser, OPTIX_STREAM, &params, optix.denoiser_state, optix.denoiser_state_bytes,
+		&guides, &layer, 1, 0, 0, optix.denoiser_scratch, optix.denoiser_scratch_bytes));
+}
+
+void optixFreeDenoiser(OptixScene& optix) {
+	if (optix.denoiser != NULL) {
+		optixDenoiserDestroy(optix.denoiser);
+	}
+	optix.denoiser = NULL;
+	optix.denoiser_resolution = glm::ivec2(0);
+	optix.denoiser_state = 0;
+	optix.denoiser_state_bytes = 0;
+	optix.denoiser_scratch = 0;
+	optix.denoiser_scratch_bytes = 0;
+	optix.denoiser_intensity = 0;
+}
+
+void optixFreeScene(OptixScene& optix) {
+	optix.blas_handles.clear();
+	optix.blas_buffers.clear();
+	optix.blas_bytes.clear();
+	for (int s = 0; s < 3; s++) {
+		optix.analytic_handles[s] = 0;
+	}
+	optix.curve_handles.clear();
+	optix.dev_tri_vertex_ids = NULL;
+	optix.dev_instances = NULL;
+	optix.ias_buffer = 0;
+	optix.ias_bytes = 0;
+	optix.ias = 0;
+}
+
+void optixFreeDevice(OptixScene& optix) {
+	optixFreeScene(optix);
+	optixFreeDenoiser(optix);
+	if (optix.pipeline != NULL) {
+		optixPipelineDestroy(optix.pipeline);
+		for (int g = 0; g < 4; g++) {
+			optixProgramGroupDestroy(optix.groups[g]);
+		}
+		optixModuleDestroy(optix.module);
+		cudaFree((void*)optix.sbt.raygenRecord);
+		cudaFree(optix.dev_params);
+	}
+	if (optix.context != NULL) {
+		optixDeviceContextDestroy(optix.context);
+	}
+	optix = OptixScene();
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <optix_types.h>
+#include "sceneStructs.h"
+
+class Scene;
+class DeviceArena; // pathtrace.h, the device programs don't need it
+
+// everything the raygen and hit programs of one optixLaunch read
+struct OptixLaunchParams {
+    OptixTraversableHandle handle;
+    SceneAccel accel; // geom records and blases for the hit programs
+    int query; // TraceQuery
+    int num_rays;
+    const int* path_list; // ray i traces path path_list[i], NULL for path i
+    PathSegments paths;
+    const ShadowRay* shadow_rays; // TRACE_SHADOW_RAYS
+    const MISLightRay* light_rays; // TRACE_BSDF_LIGHT_RAYS
+    const float* reuse_t; // TRACE_PATHS with REUSE_BSDF_RAY, paths past their camera ray with t >= 0 already have their hit
+    int camera_bounces; // TRACE_PATHS paths with this many bounces left are camera rays and skip the back of analytic geoms, -1 otherwise
+    TracedHit* hits; // path index i of the query's slots
+};
+
+// one device's OptiX context and pipeline, made on first use and kept across scenes, plus the
+// acceleration structures of the scene it has now. the instance of geom i has instanceId i
+struct OptixScene {
+    OptixDeviceContext context = NULL;
+    OptixModule module = NULL;
+    OptixProgramGroup groups[4] = {}; // raygen, miss, tri hits, analytic hits
+    OptixPipeline pipeline = NULL;
+    OptixShaderBindingTable sbt = {};
+    OptixLaunchParams* dev_params = NULL;
+
+    // scene arena memory, gone with the scene
+    std::vector<OptixTraversableHandle> blas_handles; // one GAS per BLAS, 0 for empty ones
+    std::vector<CUdeviceptr> blas_buffers;
+    std::vector<size_t> blas_bytes;
+    OptixTraversableHandle analytic_handles[3] = {}; // unit sphere, cube and square plane
+    std::vector<OptixTraversableHandle> curve_handles; // one box per curve set, 0 for empty ones
+    unsigned int* dev_tri_vertex_ids = NULL; // shared index buffer, see optixBuildScene
+    OptixInstance* dev_instances = NULL;
+    CUdeviceptr ias_buffer = 0;
+    size_t ias_bytes = 0;
+    OptixTraversableHandle ias = 0;
+
+    // DENOISE, the HDR denoiser of one resolution. pixel arena memory, gone with the pixel buffers
+    OptixDenoiser denoiser = NULL;
+    glm::ivec2 denoiser_resolution = glm::ivec2(0);
+    CUdeviceptr denoiser_state = 0;
+    size_t denoiser_state_bytes = 0;
+    CUdeviceptr denoiser_scratch = 0;
+    size_t denoiser_scratch_bytes = 0;
+    CUdeviceptr denoiser_intensity = 0; // one float, the input's log average the HDR model scales by
+};
+
+// false when there's no OptiX capable driver, the scene then keeps tracing in software
+bool optixInitDevice(OptixScene& optix);
+
+// a GAS over the tris of every BLAS, read straight out of dev_tris, and one over each analytic
+// shape, then the IAS over geoms with their transforms
+void optixBuildScene(OptixScene& optix, const Scene* scene, const TriIntersect* dev_tris, DeviceArena& arena, DeviceArena& scratch);
+
+// the tris of blas_ID were rebaked in place, refits its GAS and rebuilds the IAS over the new box
+void optixRefitBLAS(OptixScene& optix, const Scene* scene, int blas_ID, const TriIntersect* dev_tris, DeviceArena& scratch);
+
+// geom transforms changed, the IAS is rebuilt over the same GASes
+void optixUpdateInstances(OptixScene& optix, const Scene* scene, DeviceArena& scratch);
+
+// traces the query's rays and leaves a TracedHit per path in params.hits
+void optixTraceQuery(OptixScene& optix, OptixLaunchParams params);
+
+// the denoiser for resolution with albedo and normal guides, its state and scratch out of
+// arena. false when the device can't make it
+bool optixInitDenoiser(OptixScene& optix, glm::ivec2 resolution, DeviceArena& arena);
+
+// color, albedo and normal hold a float3 per pixel of the denoiser's resolution, averaged over
+// the samples and the normals in camera space. the denoised color goes to output
+void optixDenoise(OptixScene& optix, const glm::vec3* color, const glm::vec3* albedo, const glm::vec3* normal, glm::vec3* output);
+
+// destroys the denoiser, its memory went with the arena
+void optixFreeDenoiser(OptixScene& optix);
+
+// forgets the scene's structures, their memory went with the scene arena
+void optixFreeScene(OptixScene& optix);
+
+// destroys the pipeline and context
+void optixFreeDevice(OptixScene& optix);
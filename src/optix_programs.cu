@@ -0,0 +1,156 @@
+// OptiX device programs, compiled on their own to the PTX module optix_backend.cu loads
+#include <optix.h>
+
+#include "optix_backend.h"
+#include "intersections.h"
+#include "traversal.h"
+
+extern "C" {
+	__constant__ OptixLaunchParams params;
+}
+
+// payload: t, geom, tri, two barycentrics and the object space normal of analytic hits
+__device__ void setHitPayload(float t, int geom, int tri, float u, float v, glm::vec3 normal) {
+	optixSetPayload_0(__float_as_uint(t));
+	optixSetPayload_1((unsigned int)geom);
+	optixSetPayload_2((unsigned int)tri);
+	optixSetPayload_3(__float_as_uint(u));
+	optixSetPayload_4(__float_as_uint(v));
+	optixSetPayload_5(__float_as_uint(normal.x));
+	optixSetPayload_6(__float_as_uint(normal.y));
+	optixSetPayload_7(__float_as_uint(normal.z));
+}
+
+extern "C" __global__ void __raygen__trace() {
+	const int index = optixGetLaunchIndex().x;
+	const int path_index = params.path_list != NULL ? params.path_list[index] : index;
+	TracedHit& out = params.hits[params.query * params.accel.traced_stride + path_index];
+
+	// the same early outs the software trace sites take, nothing reads these slots
+	if (params.paths.remainingBounces[path_index] == 0) {
+		return;
+	}
+	glm::vec3 origin, direction;
+	float t_max = MAX_INTERSECT_DIST;
+	if (params.query == TRACE_PATHS) {
+		if (params.reuse_t != NULL && params.paths.remainingBounces[path_index] != params.camera_bounces
+			&& params.reuse_t[path_index] >= 0.0f) {
+			return;
+		}
+		origin = params.paths.origin[path_index];
+		direction = params.paths.direction[path_index];
+	}
+	else {
+		if (params.paths.prev_hit_was_specular[path_index]) {
+			return;
+		}
+		if (params.query == TRACE_SHADOW_RAYS) {
+			const ShadowRay& r = params.shadow_rays[path_index];
+			origin = r.origin;
+			direction = unpackDirection(r.direction);
+			t_max = r.t_max;
+		}
+		else {
+			const MISLightRay& r = params.light_rays[path_index];
+			if (r.light_index < 0) {
+				return;
+			}
+			origin = r.origin;
+			direction = unpackDirection(r.direction);
+		}
+	}
+
+	// the anyhit program skips the light of a shadow ray and stops at the first occluder. other rays
+	// only run it for the ALPHA_MAP cutouts
+	unsigned int ray_flags = params.query == TRACE_SHADOW_RAYS ? OPTIX_RAY_FLAG_TERMINATE_ON_FIRST_HIT
+		: params.accel.alpha_maps != NULL ? OPTIX_RAY_FLAG_NONE : OPTIX_RAY_FLAG_DISABLE_ANYHIT;
+	unsigned int p0 = __float_as_uint(MAX_INTERSECT_DIST), p1 = (unsigned int)-1, p2 = (unsigned int)-1, p3 = 0, p4 = 0, p5 = 0, p6 = 0, p7 = 0;
+	optixTrace(params.handle, make_float3(origin.x, origin.y, origin.z), make_float3(direction.x, direction.y, direction.z),
+		0.0f, t_max, 0.0f, params.accel.geom_mask & 0xFF, ray_flags, 0, 1, 0,
+		p0, p1, p2, p3, p4, p5, p6, p7);
+
+	out.t = __uint_as_float(p0);
+	out.geom = (int)p1;
+	out.tri = (int)p2;
+	float u = __uint_as_float(p3);
+	float v = __uint_as_float(p4);
+	out.bary = glm::vec3(1.0f - u - v, u, v);
+	out.normal = glm::vec3(__uint_as_float(p5), __uint_as_float(p6), __uint_as_float(p7));
+}
+
+extern "C" __global__ void __miss__trace() {
+	optixSetPayload_1((unsigned int)-1);
+}
+
+// geoms whose instance the ray is in, tris report the hardware barycentrics of p1 and p2
+extern "C" __global__ void __closesthit__trace() {
+	const int geom_index = optixGetInstanceId();
+	const float t = optixGetRayTmax();
+	if (optixIsTriangleHit()) {
+		const BLAS& blas = params.accel.blases[params.accel.geom_records[geom_index].blas_ID];
+		const float2 uv = optixGetTriangleBarycentrics();
+		setHitPayload(t, geom_index, blas.tri_offset + optixGetPrimitiveIndex(), uv.x, uv.y, glm::vec3(0.0f));
+	}
+	else {
+		glm::vec3 normal(__uint_as_float(optixGetAttribute_0()), __uint_as_float(optixGetAttribute_1()), __uint_as_float(optixGetAttribute_2()));
+		setHitPayload(t, geom_index, -1, 0.0f, 0.0f, normal);
+	}
+}
+
+// tris cut away by their instance's ALPHA_MAP aren't hit, and the geom of the light a shadow ray
+// was aimed at doesn't occlude it
+extern "C" __global__ void __anyhit__trace() {
+	if (optixIsTriangleHit() && params.accel.alpha_maps != NULL) {
+		const GeomGPU& geom = params.accel.geom_records[optixGetInstanceId()];
+		const float2 uv = optixGetTriangleBarycentrics();
+		if (!alphaCovers(alphaTest(params.accel, geom, params.accel.blases[geom.blas_ID]), optixGetPrimitiveIndex(), glm::vec3(1.0f - uv.x - uv.y, uv.x, uv.y))) {
+			optixIgnoreIntersection();
+			return;
+		}
+	}
+	if (params.query != TRACE_SHADOW_RAYS) {
+		return;
+	}
+	const ShadowRay& r = params.shadow_rays[params.path_list != NULL ? params.path_list[optixGetLaunchIndex().x] : optixGetLaunchIndex().x];
+	if ((int)optixGetInstanceId() == r.light_ID) {
+		optixIgnoreIntersection();
+	}
+}
+
+// spheres, cubes, square planes and curves in their object space. optix hands the ray over through the
+// instance transform without normalizing it, so t is the world distance like intersectInstance
+extern "C" __global__ void __intersection__analytic() {
+	const GeomGPU& geom = params.accel.geom_records[optixGetInstanceId()];
+	const float3 o = optixGetObjectRayOrigin();
+	const float3 d = optixGetObjectRayDirection();
+	glm::vec3 obj_origin(o.x, o.y, o.z);
+	glm::vec3 obj_direction(d.x, d.y, d.z);
+
+	float t = MAX_INTERSECT_DIST;
+	glm::vec3 normal;
+	if (geom.type == CURVES) {
+		TraversalStats traversal;
+		t = intersectCurves<ClosestHit>(params.accel, params.accel.curve_sets[geom.blas_ID], makeRay(obj_origin, obj_direction), optixGetRayTmax(),
+			normal, traversal);
+	}
+	else if (geom.type == SPHERE) {
+		t = sphereIntersectionTest(obj_origin, obj_direction, normal);
+	}
+	else if (geom.type == SQUAREPLANE) {
+		t = squareplaneIntersectionTest(obj_origin, obj_direction, normal);
+	}
+	else {
+		t = boxIntersectionTest(obj_origin, obj_direction, normal);
+	}
+	if (t >= MAX_INTERSECT_DIST) {
+		return;
+	}
+	if (params.camera_bounces >= 0 && glm::dot(normal, obj_direction) > 0.0f) {
+		const int index = optixGetLaunchIndex().x;
+		const int path_index = params.path_list != NULL ? params.path_list[index] : index;
+		if (params.paths.remainingBounces[path_index] == params.camera_bounces) {
+			return;
+		}
+	}
+	optixReportIntersection(t, 0, __float_as_uint(normal.x), __float_as_uint(normal.y), __float_as_uint(normal.z));
+}
@@ -1,19 +1,302 @@
 #pragma once
 
+#include <cmath>
 #include <vector>
 #include "scene.h"
+#include "exr.h"
+#include "profiling.h"
 #include <chrono>
+#include <algorithm>
+#include <stdexcept>
 #include <cuda.h>
 #include <cuda_runtime.h>
 
+// AUTO_EXPOSURE meters the image with a histogram of EXPOSURE_BINS bins of log2 luminance,
+// from EXPOSURE_MIN_EV to EXPOSURE_MAX_EV
+#define EXPOSURE_BINS 64
+#define EXPOSURE_MIN_EV -12.0f
+#define EXPOSURE_MAX_EV 12.0f
+#define EXPOSURE_MIDDLE_GREY 0.18f
+
+__host__ __device__ inline float displayLuminance(const glm::vec3& c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// -1 for black, which doesn't count towards the exposure
+__host__ __device__ inline int exposureBin(float luminance) {
+    if (!(luminance > 0.0f)) {
+        return -1;
+    }
+    const float t = (log2f(luminance) - EXPOSURE_MIN_EV) / (EXPOSURE_MAX_EV - EXPOSURE_MIN_EV);
+    return glm::clamp((int)(t * EXPOSURE_BINS), 0, EXPOSURE_BINS - 1);
+}
+
+// the scale that brings the mean log luminance of the pixels between the 50th and 95th
+// percentile to middle grey, so a dark background or a few highlights don't swing it. 1 for a
+// black image
+__host__ __device__ inline float exposureScale(const int* histogram) {
+    int total = 0;
+    for (int b = 0; b < EXPOSURE_BINS; b++) {
+        total += histogram[b];
+    }
+    const float low = 0.5f * total;
+    const float high = 0.95f * total;
+    float below = 0.0f;
+    float weight = 0.0f;
+    float log_sum = 0.0f;
+    for (int b = 0; b < EXPOSURE_BINS; b++) {
+        // the part of the bin inside the percentile range
+        const float count = glm::max(glm::min((float)histogram[b], high - below) - glm::max(low - below, 0.0f), 0.0f);
+        log_sum += count * (EXPOSURE_MIN_EV + (b + 0.5f) * (EXPOSURE_MAX_EV - EXPOSURE_MIN_EV) / EXPOSURE_BINS);
+        weight += count;
+        below += histogram[b];
+    }
+    return weight > 0.0f ? EXPOSURE_MIDDLE_GREY / exp2f(log_sum / weight) : 1.0f;
+}
+
+// how displayColor maps an averaged radiance to the display
+struct ToneMapping {
+    ToneMap op = TONEMAP_REINHARD;
+    float scale = 1.0f; // 2^EXPOSURE, times the metered scale when it's folded in on the host
+    const float* auto_scale = NULL; // AUTO_EXPOSURE's metered scale in device memory, NULL without
+    bool raw = false; // debug views are shown as is
+};
+
+// Uncharted 2's filmic curve (John Hable)
+__host__ __device__ inline glm::vec3 hableCurve(const glm::vec3& x) {
+    const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+    return (x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F) - E / F;
+}
+
+__host__ __device__ inline glm::vec3 toneMapped(const glm::vec3& x, ToneMap op) {
+    switch (op) {
+    case TONEMAP_ACES:
+        // Narkowicz's fit of the ACES reference transform
+        return glm::clamp((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f, 1.0f);
+    case TONEMAP_FILMIC:
+        return hableCurve(2.0f * x) / hableCurve(glm::vec3(11.2f));
+    case TONEMAP_LINEAR:
+        return x;
+    default:
+        // reinhard (HDR)
+        return x / (x + glm::vec3(1.0f));
+    }
+}
+
+// accumulated sum of iter samples to its 8 bit display color, what the window shows and
+// LDR saves write
+__host__ __device__ inline uchar4 displayColor(glm::vec3 pix, int iter, const ToneMapping& tone) {
+    pix /= iter;
+
+    // debug views are shown as is
+    if (!tone.raw) {
+        float scale = tone.scale;
+        if (tone.auto_scale != NULL) {
+            scale *= *tone.auto_scale;
+        }
+        pix = toneMapped(pix * scale, tone.op);
+
+        // gamma correction
+        pix = glm::pow(pix, glm::vec3(0.454545f));
+    }
+
+    glm::ivec3 color;
+    color.x = glm::clamp((int)(pix.x * 255.0), 0, 255);
+    color.y = glm::clamp((int)(pix.y * 255.0), 0, 255);
+    color.z = glm::clamp((int)(pix.z * 255.0), 0, 255);
+    return make_uchar4(color.x, color.y, color.z, 0);
+}
+
+// settings' ToneMapping for the sums of samples iterations in image, on the host. AUTO_EXPOSURE
+// meters the image here and folds it into the scale
+ToneMapping hostToneMapping(const RenderSettings& settings, const std::vector<glm::vec3>& image, int samples);
+
+// where display colors go: a uchar4 buffer (the PBO, an LDR readback, a render thread image) or,
+// with DISPLAY_SURFACE, a surface over the window's texture. a NULL buffer converts to an empty
+// target, which traces without displaying
+struct DisplayTarget {
+    uchar4* pixels;
+    cudaSurfaceObject_t surface;
+    DisplayTarget(uchar4* pixels = NULL) : pixels(pixels), surface(0) {}
+    static DisplayTarget onSurface(cudaSurfaceObject_t surface) {
+        DisplayTarget target;
+        target.surface = surface;
+        return target;
+    }
+    bool empty() const { return pixels == NULL && surface == 0; }
+};
+
 void InitDataContainer(GuiDataContainer* guiData);
 void pathtraceInit(Scene *scene);
 void pathtraceFree();
-void pathtrace(uchar4 *pbo, int frame, int iteration);
+void pathtraceFreeScene(); // drops the scene's device data but keeps the pixel buffers
+void pathtraceFreePixels();
+void pathtraceResetImage(); // restart accumulation, everything else stays on the device
+float pixelFilterRadius(const RenderSettings& settings); // FILTER_RADIUS in pixels, the filter's own default for 0
+// new object space positions for every vertex of blas_ID (mesh_sources order), the tris are
+// rebaked and the BLAS and TLAS boxes refit in place. rebuilds every BLAS from the host mesh
+// when the refit's SAH cost passes BVH_REFIT_REBUILD times the built tree's or with BVH_WIDE
+void pathtraceRefitMesh(int blas_ID, const std::vector<glm::vec3>& positions);
+void pathtraceUpdateGeoms(); // uploads the host geoms (same order, new transforms) and refits the TLAS
+void pathtraceUpdateGeom(int geom_ID); // uploads one moved host geom and refits the TLAS, light tables only when it emits
+void pathtraceUpdateMaterial(int material_ID); // uploads one edited host material, reweighs the lights when it's emissive
+// RASTER_PRIMARY, raster.cpp draws the visibility buffer the next iteration's camera rays take
+// their first hits from: per pixel the geom and its BLAS local tri (-1 for analytic geoms) under
+// the pixel corner, geom -1 where there's nothing
+glm::ivec2* pathtraceVisibilityTarget(); // where it goes, NULL when it's up to date or the camera rays can't use it
+void pathtraceCopyTriPositions(glm::vec3* positions); // 3 object space vertices per tri, each BLAS at its tri_offset
+void pathtraceVisibilityDrawn(); // the target holds the ids for the current camera and geometry
+// an empty pbo traces without displaying. false when TILE_ORDER split a displayed iteration at
+// FRAME_TIME_TARGET, the next call with the same iteration traces the rest of it
+bool pathtrace(DisplayTarget pbo, int frame, int iteration);
+bool pathtraceIterationSplit(); // the last pathtrace left its iteration unfinished
+// TEMPORAL_HISTORY, reprojects the accumulation of samples samples seen from previous into the
+// scene's camera in place of resetting it, returns how many samples it counts as. 0 when it
+// can't, reset the image then
+int pathtraceReprojectImage(const Camera& previous, int samples);
+void pathtraceDisplay(DisplayTarget pbo, int iteration); // just the display an iteration given a pbo ends with
+// PREVIEW_SCALE, one sample per pixel at 1/PREVIEW_SCALE of the resolution with PREVIEW_DEPTH
+// bounces, stretched over the window. it overwrites the accumulation, reset the image after it
+void pathtracePreview(DisplayTarget pbo);
+enum ImageReadback {
+    READBACK_FLOAT, // the accumulated sums, into state.image
+    READBACK_LDR, // tonemapped 8 bit display colors of samples
+    READBACK_HALF, // half float average of samples for EXR
+};
+
+// starts an async readback of the accumulated image, no-op while one is pending
+void pathtraceRequestImage(int samples, ImageReadback kind);
+bool pathtraceImageReady(); // the pending readback has landed, the retrieve won't wait
+void pathtraceRetrieveImage(); // accumulated sum into state.image, waits for the pending readback
+void pathtraceRetrieveLDRImage(int samples, std::vector<uchar4>& pixels); // display colors, row major like dev_image
+void pathtraceRetrieveHalfImage(int samples, EXRImage& exr); // flipped like saved images, ready for saveEXR
+// per pixel device buffers the renderer API exports. the guides are sums like dev_image and only
+// kept with DENOISE or ATROUS_ITERATIONS, the counts only with ADAPTIVE_THRESHOLD
+enum DeviceBuffer {
+    BUFFER_IMAGE, // glm::vec3 accumulated radiance
+    BUFFER_ALBEDO, // glm::vec3 first hit albedo
+    BUFFER_NORMAL, // glm::vec3 first hit camera space normal
+    BUFFER_POSITION, // glm::vec3 first hit world position
+    BUFFER_SAMPLE_COUNTS, // int samples per pixel
+};
+// the first device's buffer (row major like dev_image) once the iterations in flight are done,
+// NULL when it isn't kept. the other devices' iterations aren't in it, retrieve those
+const void* pathtraceDeviceBuffer(DeviceBuffer buffer);
+
+// Rec. 709 luminance
+__host__ __device__ inline float luminance(const glm::vec3& c) {
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// the variance of a pixel's mean luminance, its squared standard error, from the sum of its n
+// samples' squared luminances. what the variance channel of exr saves holds, infinite below 2 samples
+__host__ __device__ inline float meanVariance(float mean, float luminance_sq, int n) {
+    if (n < 2) {
+        return INFINITY;
+    }
+    return glm::max(luminance_sq / n - mean * mean, 0.0f) / (n - 1);
+}
+
+// what a progressive render needs to carry on where it stopped. every random number is keyed
+// on the iteration, so the count is all the RNG state there is
+struct RenderCheckpoint {
+    int width = 0;
+    int height = 0;
+    int first_iteration = 0; // the sums hold iterations first_iteration + 1 .. iteration
+    int iteration = 0;
+    unsigned long long scene_key = 0; // scene file, settings and camera it was rendered with
+    std::vector<glm::vec3> image; // accumulated sums of every device
+    std::vector<float> luminance_sq; // adaptive sampling statistics, empty when they aren't kept
+    std::vector<int> sample_counts;
+    std::vector<unsigned long long> fixed_image; // DETERMINISTIC integer sums, 3 per pixel, empty when they aren't kept
+};
+// DETERMINISTIC sums count units of 2^-24, image is them over the scale rounded to float
+#define FIXED_IMAGE_SCALE 16777216.0
+glm::vec3 resolveFixedSum(const unsigned long long* sum);
+void pathtraceReadAccumulation(RenderCheckpoint& checkpoint); // image and statistics, waits for the device
+bool pathtraceLoadAccumulation(const RenderCheckpoint& checkpoint); // onto the first device, false if the buffers differ
+float pathtraceNoiseEstimate();
+
+// CAPTURE_RAYS: the rays of one bounce of one iteration and the acceleration structure they were
+// traced against, so traversal can be benchmarked by itself on the same rays every run
+struct CapturedRay {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float t_max; // MAX_INTERSECT_DIST for path rays, the distance to the light for shadow rays
+    int ignore_geom; // the light a shadow ray aims at, -1 for path rays
+    int cull_backfaces; // camera rays skip the back of analytic geoms
+};
+
+struct RayCapture {
+    int iteration = 0;
+    int bounce = 0; // 0 for the camera rays
+    std::vector<CapturedRay> path_rays; // traced for their closest hit
+    std::vector<CapturedRay> shadow_rays; // the light samples of the bounce's hits, traced for any hit
+    // dev_accel's buffers as the device had them, one of bvh_nodes and wide_bvh_nodes is empty
+    std::vector<Geom> geoms;
+    std::vector<GeomGPU> geom_records;
+    std::vector<BVHNode_GPU> tlas_nodes;
+    std::vector<BLAS> blases;
+    std::vector<TriIntersect> tris;
+    std::vector<BVHNode_GPU> bvh_nodes;
+    std::vector<WideBVHNode_GPU> wide_bvh_nodes;
+};
+
+// hands over the capture once CAPTURE_RAYS's iteration was traced, false until then
+bool pathtraceTakeRayCapture(RayCapture& capture);
+// traces rays against capture's acceleration structure on the current device, repeat timed runs
+// after a warm up one, without a scene or pathtraceInit. hit_geoms and nodes get each ray's hit
+// geom (-1 for none) and TLAS and BLAS nodes. stackless walks them like STACKLESS_BVH. returns the
+// fastest run's ms
+float pathtraceReplayRays(const RayCapture& capture, const std::vector<CapturedRay>& rays, bool any_hit, bool stackless, int repeat,
+    std::vector<int>& hit_geoms, std::vector<int>& nodes);
+
+// path probe: PROBE_SAMPLES paths through one pixel, every bounce of every one recorded so the
+// expensive ones (long glass chains, traversal hot spots) show up without instrumenting the whole
+// frame. the paths are traced one thread each on the bound device, apart from the image
+struct ProbeBounce {
+    float t; // MAX_INTERSECT_DIST for a miss
+    int geom; // -1 for a miss
+    int material; // -1 for a miss
+    bool specular;
+    float light_weight; // MIS weights of the light sample and the bsdf sample, 0 when there was none
+    float bsdf_weight;
+    int nodes; // TLAS and BLAS nodes the path ray visited
+    int tris; // ray / tri tests
+    long long cycles; // clock64 cycles the bounce's intersection, MIS rays and shading took
+    float throughput; // largest channel of the throughput after shading
+};
+
+struct PathProbe {
+    int x = -1; // pixel, -1 before the first probe
+    int y = -1;
+    int first_iteration = 0; // sample k is traced like iteration first_iteration + k traces the pixel
+    int max_bounces = 0; // bounces per sample in bounces, the scene's DEPTH
+    float clock_khz = 0.0f; // what cycles count in
+    std::vector<int> num_bounces; // per sample
+    std::vector<glm::vec3> radiance; // per sample
+    std::vector<ProbeBounce> bounces; // sample k's are [k * max_bounces, k * max_bounces + num_bounces[k])
+};
 
-void pathtraceInit_Single(Scene* scene);
+void pathtraceInit_Single(Scene* scene); // after pathtraceInit, the probe's paths on the bound device
 void pathtraceFree_Single();
-void pathtrace_Single(uchar4* pbo, int frame, int x, int y);
+// probes pixel (x, y) of the image (dev_image's row major order, saves are flipped left to right)
+// with the samples iterations frame + 1 .. frame + PROBE_SAMPLES would trace there. a non empty
+// pbo then shows the accumulation of frame iterations with the pixel marked
+void pathtrace_Single(DisplayTarget pbo, int frame, int x, int y);
+const PathProbe& pathtraceProbe(); // the last pathtrace_Single's, waits for nothing
+
+inline long long probeSampleCycles(const PathProbe& probe, int sample) {
+    long long cycles = 0;
+    for (int b = 0; b < probe.num_bounces[sample]; b++) {
+        cycles += probe.bounces[sample * probe.max_bounces + b].cycles;
+    }
+    return cycles;
+}
+
+inline double probeMicroseconds(const PathProbe& probe, long long cycles) {
+    return cycles * 1000.0 / std::max(probe.clock_khz, 1.0f);
+}
 
 /**
         * This class is used for timing the performance
@@ -107,3 +390,412 @@ private:
     float prev_elapsed_time_cpu_milliseconds = 0.f;
     float prev_elapsed_time_gpu_milliseconds = 0.f;
 };
+
+// frames of events kept in flight before the oldest one is read back
+#define STAGE_TIMER_FRAMES 4
+
+enum RenderStage {
+    STAGE_GENERATE_RAYS,
+    STAGE_FIRST_BOUNCE_CACHE,
+    STAGE_RAY_SORT,
+    STAGE_INTERSECT,
+    STAGE_SORT,
+    STAGE_MIS_RAYS,
+    STAGE_LIGHT_RAY_COMPACT, // COMPACT_LIGHT_RAYS index list of the paths with MIS rays
+    STAGE_LIGHT_RAYS, // occlusion of the light sampled and hits of the bsdf sampled MIS rays
+    STAGE_SHADE, // Russian roulette runs at the end of it
+    STAGE_COMPACT,
+    STAGE_PERSISTENT,
+    STAGE_GRAPH,
+    STAGE_ADAPTIVE,
+    STAGE_GATHER,
+    STAGE_DENOISE,
+    STAGE_DISPLAY,
+    NUM_RENDER_STAGES,
+};
+
+inline const char* renderStageName(int stage)
+{
+    static const char* names[NUM_RENDER_STAGES] = {
+        "generate rays", "first bounce cache", "ray sort", "intersect", "material sort", "MIS rays",
+        "light ray compaction", "MIS light rays", "shade",
+        "stream compaction", "persistent threads", "iteration graph", "adaptive sampling", "final gather", "denoise", "display",
+    };
+    return names[stage];
+}
+
+// bounces RAY_STATS keeps a path ray count of, deeper ones add to the last
+#define MAX_STAT_BOUNCES 16
+
+// RAY_STATS counters, the ray ones are laid out by TraceQuery
+enum RayStat {
+    STAT_RAYS, // + TraceQuery, rays intersectScene traced
+    STAT_NODES = STAT_RAYS + NUM_TRACE_QUERIES, // + TraceQuery, TLAS and BLAS nodes they fetched
+    STAT_TRIS = STAT_NODES + NUM_TRACE_QUERIES, // + TraceQuery, ray / tri tests
+    STAT_ESCAPED = STAT_TRIS + NUM_TRACE_QUERIES, // paths that left the scene
+    STAT_ROULETTE_KILLS,
+    STAT_SPECULAR_BOUNCES,
+    STAT_BOUNCE_RAYS, // + bounce, path rays traced at each bounce, 0 is the camera rays
+    NUM_RAY_STATS = STAT_BOUNCE_RAYS + MAX_STAT_BOUNCES,
+};
+
+inline const char* traceQueryName(int query)
+{
+    static const char* names[NUM_TRACE_QUERIES] = { "path", "shadow", "bsdf light" };
+    return names[query];
+}
+
+/**
+        * Per stage GPU timing without stalling the render loop.
+        * Stage begin / end only record events into the current frame of a ring,
+        * the frame STAGE_TIMER_FRAMES back is read when its slot gets reused,
+        * by then its events have long completed
+        * Uncopyable and unmovable
+        */
+
+class StageTimer
+{
+public:
+    StageTimer() {}
+
+    ~StageTimer()
+    {
+        for (Frame& frame : frames) {
+            for (cudaEvent_t e : frame.events) {
+                cudaEventDestroy(e);
+            }
+        }
+    }
+
+    // blocking waits for every stage to finish like PerformanceTimer does, timings then
+    // isolate single kernels but the GPU idles between them
+    void setBlocking(bool b) { blocking = b; }
+
+    void begin(RenderStage stage, int bounce = 0)
+    {
+        if (stage_open) { throw std::runtime_error("Stage timer already started"); }
+        stage_open = true;
+
+        Frame& frame = frames[current_frame];
+        Record rec;
+        rec.stage = stage;
+        rec.bounce = bounce;
+        rec.start = nextEvent(frame);
+        rec.end = nextEvent(frame);
+        cudaEventRecord(rec.start);
+        frame.records.push_back(rec);
+        profilePush(renderStageName(stage), bounce);
+    }
+
+    void end()
+    {
+        if (!stage_open) { throw std::runtime_error("Stage timer not started"); }
+        stage_open = false;
+
+        profilePop();
+        const Record& rec = frames[current_frame].records.back();
+        cudaEventRecord(rec.end);
+        if (blocking) {
+            cudaEventSynchronize(rec.end);
+        }
+    }
+
+    // closes this frame and resolves the oldest one, whose slot comes up next
+    void endFrame()
+    {
+        current_frame = (current_frame + 1) % STAGE_TIMER_FRAMES;
+        Frame& frame = frames[current_frame];
+        if (!frame.records.empty()) {
+            resolve(frame);
+        }
+        frame.records.clear();
+        frame.num_events = 0;
+    }
+
+    // resolves every frame still in flight, waits for the GPU to catch up
+    void flush()
+    {
+        for (int i = 0; i < STAGE_TIMER_FRAMES; i++) {
+            endFrame();
+        }
+    }
+
+    // totals of the last resolved frame
+    float getStageMs(int stage) const { return stage_ms[stage]; }
+
+    float getBounceMs(int stage, int bounce) const
+    {
+        return bounce < bounce_ms[stage].size() ? bounce_ms[stage][bounce] : 0.f;
+    }
+
+    // sums of every frame resolved since resetTotals
+    double getTotalMs(int stage) const { return total_ms[stage]; }
+
+    void resetTotals()
+    {
+        for (int s = 0; s < NUM_RENDER_STAGES; s++) {
+            total_ms[s] = 0.0;
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer(StageTimer&&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+    StageTimer& operator=(StageTimer&&) = delete;
+
+private:
+    struct Record {
+        RenderStage stage;
+        int bounce;
+        cudaEvent_t start;
+        cudaEvent_t end;
+    };
+
+    struct Frame {
+        std::vector<cudaEvent_t> events; // pool, grows to the most events one frame used
+        int num_events = 0;
+        std::vector<Record> records;
+    };
+
+    cudaEvent_t nextEvent(Frame& frame)
+    {
+        if (frame.num_events == frame.events.size()) {
+            cudaEvent_t e;
+            cudaEventCreate(&e);
+            frame.events.push_back(e);
+        }
+        return frame.events[frame.num_events++];
+    }
+
+    void resolve(Frame& frame)
+    {
+        // only waits if the GPU is a whole ring of frames behind
+        cudaEventSynchronize(frame.records.back().end);
+        for (int s = 0; s < NUM_RENDER_STAGES; s++) {
+            stage_ms[s] = 0.f;
+            bounce_ms[s].clear();
+        }
+        for (const Record& rec : frame.records) {
+            float ms = 0.f;
+            cudaEventElapsedTime(&ms, rec.start, rec.end);
+            stage_ms[rec.stage] += ms;
+            total_ms[rec.stage] += ms;
+            if (bounce_ms[rec.stage].size() <= rec.bounce) {
+                bounce_ms[rec.stage].resize(rec.bounce + 1, 0.f);
+            }
+            bounce_ms[rec.stage][rec.bounce] += ms;
+        }
+    }
+
+    Frame frames[STAGE_TIMER_FRAMES];
+    int current_frame = 0;
+    bool stage_open = false;
+    bool blocking = false;
+
+    float stage_ms[NUM_RENDER_STAGES] = {};
+    double total_ms[NUM_RENDER_STAGES] = {};
+    std::vector<float> bounce_ms[NUM_RENDER_STAGES];
+};
+
+// alignment of every DeviceArena sub-allocation unless asked otherwise, matches cudaMalloc
+#define DEVICE_ARENA_ALIGNMENT 256
+
+enum MemCategory {
+    MEM_IMAGE,
+    MEM_PATHS,
+    MEM_INTERSECTIONS,
+    MEM_MIS,
+    MEM_SORT,
+    MEM_SCRATCH,
+    MEM_GEOMETRY,
+    MEM_BVH,
+    MEM_MATERIALS,
+    NUM_MEM_CATEGORIES,
+};
+
+inline const char* memCategoryName(int category)
+{
+    static const char* names[NUM_MEM_CATEGORIES] = {
+        "image", "paths", "intersections", "MIS rays", "material sort", "scratch",
+        "geometry", "BVH", "lights / materials",
+    };
+    return names[category];
+}
+
+/**
+        * Bump allocator over device memory.
+        * Buffers are carved out of a few large cudaMalloc blocks and only go away
+        * all at once on reset, which keeps the blocks for the next round. When a round
+        * spills into extra blocks, reset swaps them for one block at the high water mark
+        * so later rounds of the same size are a single allocation
+        * A managed arena takes its blocks from cudaMallocManaged instead, so they can
+        * be bigger than the device and the driver pages them in as kernels touch them
+        * Uncopyable and unmovable
+        */
+
+class DeviceArena
+{
+public:
+    DeviceArena() {}
+    explicit DeviceArena(bool managed) : managed(managed) {}
+
+    ~DeviceArena()
+    {
+        release();
+    }
+
+    template <typename T>
+    T* alloc(size_t count, MemCategory category, size_t alignment = DEVICE_ARENA_ALIGNMENT)
+    {
+        return static_cast<T*>(allocBytes(count * sizeof(T), category, alignment));
+    }
+
+    void* allocBytes(size_t bytes, MemCategory category, size_t alignment = DEVICE_ARENA_ALIGNMENT)
+    {
+        if (bytes == 0) {
+            return nullptr;
+        }
+        size_t offset = blocks.empty() ? 0 : alignUp(blocks.back().used, alignment);
+        if (blocks.empty() || offset + bytes > blocks.back().size) {
+            // at least double what's reserved so a growing round doesn't add many blocks
+            Block block;
+            block.size = std::max(alignUp(bytes, DEVICE_ARENA_ALIGNMENT), capacity());
+            allocBlock(block);
+            blocks.push_back(block);
+            offset = 0;
+        }
+        Block& block = blocks.back();
+        block.used = offset + bytes;
+
+        used_bytes += bytes;
+        high_water = std::max(high_water, used());
+        category_bytes[category] += bytes;
+        category_peak[category] = std::max(category_peak[category], category_bytes[category]);
+        return block.ptr + offset;
+    }
+
+    // every pointer handed out so far is invalid afterwards
+    void reset()
+    {
+        if (blocks.size() > 1) {
+            // each boundary between old blocks can cost another alignment of padding
+            size_t size = high_water + blocks.size() * DEVICE_ARENA_ALIGNMENT;
+            release();
+            Block block;
+            block.size = size;
+            allocBlock(block);
+            blocks.push_back(block);
+        }
+        for (Block& block : blocks) {
+            block.used = 0;
+        }
+        used_bytes = 0;
+        for (int c = 0; c < NUM_MEM_CATEGORIES; c++) {
+            category_bytes[c] = 0;
+        }
+    }
+
+    // hands the blocks back to the driver, peaks are kept
+    void release()
+    {
+        for (Block& block : blocks) {
+            cudaFree(block.ptr);
+        }
+        blocks.clear();
+        used_bytes = 0;
+        for (int c = 0; c < NUM_MEM_CATEGORIES; c++) {
+            category_bytes[c] = 0;
+        }
+    }
+
+    size_t capacity() const
+    {
+        size_t total = 0;
+        for (const Block& block : blocks) {
+            total += block.size;
+        }
+        return total;
+    }
+
+    // exchanges blocks and counters, used to keep one arena per device behind the same name
+    void swap(DeviceArena& other)
+    {
+        std::swap(blocks, other.blocks);
+        std::swap(managed, other.managed);
+        std::swap(used_bytes, other.used_bytes);
+        std::swap(high_water, other.high_water);
+        std::swap(category_bytes, other.category_bytes);
+        std::swap(category_peak, other.category_peak);
+    }
+
+    // requested bytes, without alignment padding
+    size_t getBytes(int category) const { return category_bytes[category]; }
+    size_t getPeakBytes(int category) const { return category_peak[category]; }
+    size_t getUsedBytes() const { return used_bytes; }
+    int getNumBlocks() const { return blocks.size(); }
+
+    DeviceArena(const DeviceArena&) = delete;
+    DeviceArena(DeviceArena&&) = delete;
+    DeviceArena& operator=(const DeviceArena&) = delete;
+    DeviceArena& operator=(DeviceArena&&) = delete;
+
+private:
+    struct Block {
+        char* ptr = nullptr;
+        size_t size = 0;
+        size_t used = 0;
+    };
+
+    void allocBlock(Block& block)
+    {
+        PhaseTimer phase(PHASE_GPU_ALLOC);
+        if (!managed) {
+            if (cudaMalloc(&block.ptr, block.size) != cudaSuccess) {
+                throw std::runtime_error("DeviceArena out of device memory");
+            }
+            return;
+        }
+        if (cudaMallocManaged(&block.ptr, block.size, cudaMemAttachGlobal) != cudaSuccess) {
+            throw std::runtime_error("DeviceArena out of managed memory");
+        }
+        // pages live on the host and get read duplicated onto whichever device faults on them,
+        // the driver evicts the least recently used copies once the device is full
+        int device = 0;
+        cudaGetDevice(&device);
+        cudaMemAdvise(block.ptr, block.size, cudaMemAdviseSetPreferredLocation, cudaCpuDeviceId);
+        cudaMemAdvise(block.ptr, block.size, cudaMemAdviseSetReadMostly, device);
+    }
+
+    static size_t alignUp(size_t x, size_t alignment) { return (x + alignment - 1) / alignment * alignment; }
+
+    // bytes taken from the blocks including padding
+    size_t used() const
+    {
+        size_t total = 0;
+        for (const Block& block : blocks) {
+            total += block.used;
+        }
+        return total;
+    }
+
+    std::vector<Block> blocks;
+    bool managed = false;
+    size_t used_bytes = 0;
+    size_t high_water = 0;
+    size_t category_bytes[NUM_MEM_CATEGORIES] = {};
+    size_t category_peak[NUM_MEM_CATEGORIES] = {};
+};
+
+// totals over every device since pathtraceResetStats, for the benchmark mode
+struct PathtraceStats {
+    double stage_ms[NUM_RENDER_STAGES] = {};
+    unsigned long long rays = 0; // every ray intersectScene traced, 0 without RAY_STATS
+    unsigned long long bvh_nodes = 0; // TLAS and BLAS nodes those rays fetched
+    unsigned long long counters[NUM_RAY_STATS] = {}; // by RayStat, rays and bvh_nodes are sums of these
+    size_t device_bytes = 0; // reserved by the device arenas
+    int block_sizes[NUM_LAUNCH_KERNELS] = {}; // threads per block of each LaunchKernel on the first device
+    float occupancy[NUM_LAUNCH_KERNELS] = {}; // resident threads per SM that gives, over the SM's maximum
+};
+
+void pathtraceResetStats();
+PathtraceStats pathtraceGetStats(); // waits for the stage timers to resolve
@@ -0,0 +1,428 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <sstream>
+
+#include "ply.h"
+#include "utilities.h"
+
+#define PLY_BLOCK_SIZE (1 << 16) // vertices or faces decoded per parallelFor task
+
+enum PLYType { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+struct PLYProperty {
+    std::string name;
+    PLYType type = PLY_NONE; // of the values, list entries for a list
+    PLYType count_type = PLY_NONE; // lists only
+    size_t offset = 0; // from the start of the element, fixed size elements only
+};
+
+struct PLYElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PLYProperty> properties;
+    size_t stride = 0; // bytes per element, 0 when some property is a list
+
+    int find(const char* a, const char* b = NULL, const char* c = NULL) const {
+        for (size_t i = 0; i < properties.size(); ++i) {
+            const std::string& n = properties[i].name;
+            if (n == a || (b != NULL && n == b) || (c != NULL && n == c)) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+};
+
+static PLYType parseType(const std::string& name) {
+    if (name == "char" || name == "int8") return PLY_INT8;
+    if (name == "uchar" || name == "uint8") return PLY_UINT8;
+    if (name == "short" || name == "int16") return PLY_INT16;
+    if (name == "ushort" || name == "uint16") return PLY_UINT16;
+    if (name == "int" || name == "int32") return PLY_INT32;
+    if (name == "uint" || name == "uint32") return PLY_UINT32;
+    if (name == "float" || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_NONE;
+}
+
+static size_t typeSize(PLYType type) {
+    switch (type) {
+    case PLY_INT8:
+    case PLY_UINT8: return 1;
+    case PLY_INT16:
+    case PLY_UINT16: return 2;
+    case PLY_INT32:
+    case PLY_UINT32:
+    case PLY_FLOAT32: return 4;
+    case PLY_FLOAT64: return 8;
+    default: return 0;
+    }
+}
+
+// one value of type at p, byte swapped for a big endian file (hosts are little endian)
+static double readValue(const unsigned char* p, PLYType type, bool swap) {
+    unsigned char b[8];
+    const size_t size = typeSize(type);
+    if (swap) {
+        for (size_t i = 0; i < size; ++i) {
+            b[i] = p[size - 1 - i];
+        }
+    }
+    else {
+        memcpy(b, p, size);
+    }
+    switch (type) {
+    case PLY_INT8: return (double)*(const int8_t*)b;
+    case PLY_UINT8: return (double)b[0];
+    case PLY_INT16: { int16_t v; memcpy(&v, b, 2); return v; }
+    case PLY_UINT16: { uint16_t v; memcpy(&v, b, 2); return v; }
+    case PLY_INT32: { int32_t v; memcpy(&v, b, 4); return v; }
+    case PLY_UINT32: { uint32_t v; memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT32: { float v; memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT64: { double v; memcpy(&v, b, 8); return v; }
+    default: return 0.0;
+    }
+}
+
+// a vertex index, the float conversion of readValue would round large ones
+static long long readIndex(const unsigned char* p, PLYType type, bool swap) {
+    if (type == PLY_INT32 || type == PLY_UINT32) {
+        uint32_t v;
+        if (swap) {
+            v = (uint32_t)p[3] | ((uint32_t)p[2] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[0] << 24);
+        }
+        else {
+            memcpy(&v, p, 4);
+        }
+        return type == PLY_INT32 ? (long long)(int32_t)v : (long long)v;
+    }
+    return (long long)readValue(p, type, swap);
+}
+
+// bytes one element of a list carrying element takes at p, 0 if it runs past end
+static size_t elementSize(const PLYElement& element, const unsigned char* p, const unsigned char* end, bool swap) {
+    size_t size = 0;
+    for (const PLYProperty& prop : element.properties) {
+        if (prop.count_type == PLY_NONE) {
+            size += typeSize(prop.type);
+            continue;
+        }
+        if (p + size + typeSize(prop.count_type) > end) {
+            return 0;
+        }
+        const long long count = readIndex(p + size, prop.count_type, swap);
+        size += typeSize(prop.count_type) + (count > 0 ? count : 0) * typeSize(prop.type);
+    }
+    return p + size <= end ? size : 0;
+}
+
+bool isPLYPath(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string ext = path.substr(dot + 1);
+    for (char& c : ext) {
+        c = (char)tolower(c);
+    }
+    return ext == "ply";
+}
+
+bool loadPLY(const std::string& path, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals, std::vector<glm::vec2>& uvs,
+    std::vector<glm::ivec3>& indices, glm::vec3& AABB_min, glm::vec3& AABB_max, int& bad_faces, std::string& error, bool bounds_only) {
+    utilityCore::MappedFile file;
+    if (!file.open(path)) {
+        error = "Cannot open file [" + path + "]";
+        return false;
+    }
+    const unsigned char* const begin = file.data();
+    const unsigned char* const end = begin + file.size();
+
+    // the header is text up to and including the end_header line
+    const char* header_end = NULL;
+    static const char end_header[] = "end_header";
+    for (const unsigned char* p = begin; p + sizeof(end_header) - 1 <= end; ++p) {
+        if ((p == begin || p[-1] == '\n') && memcmp(p, end_header, sizeof(end_header) - 1) == 0) {
+            header_end = (const char*)p;
+            break;
+        }
+    }
+    if (file.size() < 3 || memcmp(begin, "ply", 3) != 0 || header_end == NULL) {
+        error = path + " is not a PLY file";
+        return false;
+    }
+    const unsigned char* data = (const unsigned char*)memchr(header_end, '\n', end - (const unsigned char*)header_end);
+    if (data == NULL) {
+        error = path + " has no data after its header";
+        return false;
+    }
+    data++;
+
+    std::istringstream header(std::string((const char*)begin, header_end));
+    std::string line;
+    bool swap = false;
+    bool has_format = false;
+    std::vector<PLYElement> elements;
+    while (std::getline(header, line)) {
+        std::istringstream tokens(line);
+        std::string keyword;
+        tokens >> keyword;
+        if (keyword == "format") {
+            std::string format;
+            tokens >> format;
+            if (format == "ascii") {
+                error = path + " is an ascii PLY, only binary ones are read";
+                return false;
+            }
+            swap = format == "binary_big_endian";
+            has_format = swap || format == "binary_little_endian";
+        }
+        else if (keyword == "element") {
+            PLYElement element;
+            tokens >> element.name >> element.count;
+            elements.push_back(element);
+        }
+        else if (keyword == "property" && !elements.empty()) {
+            PLYProperty prop;
+            std::string type;
+            tokens >> type;
+            if (type == "list") {
+                std::string count_type;
+                tokens >> count_type >> type;
+                prop.count_type = parseType(count_type);
+                if (prop.count_type == PLY_NONE || prop.count_type == PLY_FLOAT32 || prop.count_type == PLY_FLOAT64) {
+                    error = path + " has a list with an unknown count type";
+                    return false;
+                }
+            }
+            prop.type = parseType(type);
+            tokens >> prop.name;
+            if (prop.type == PLY_NONE) {
+                error = path + " has a property of unknown type " + type;
+                return false;
+            }
+            elements.back().properties.push_back(prop);
+        }
+    }
+    if (!has_format) {
+        error = path + " has no binary format line";
+        return false;
+    }
+
+    // fixed size elements get their stride and property offsets, the others are walked
+    for (PLYElement& element : elements) {
+        size_t offset = 0;
+        for (PLYProperty& prop : element.properties) {
+            if (prop.count_type != PLY_NONE) {
+                offset = 0;
+                break;
+            }
+            prop.offset = offset;
+            offset += typeSize(prop.type);
+        }
+        element.stride = offset;
+    }
+
+    // where the vertex and face elements start, any other element before them is skipped
+    const PLYElement* vertex = NULL;
+    const PLYElement* face = NULL;
+    const unsigned char* vertex_data = NULL;
+    const unsigned char* face_data = NULL;
+    const unsigned char* p = data;
+    for (const PLYElement& element : elements) {
+        if (element.name == "vertex") {
+            vertex = &element;
+            vertex_data = p;
+        }
+        else if (element.name == "face") {
+            face = &element;
+            face_data = p;
+        }
+        if (element.stride > 0) {
+            if ((size_t)(end - p) / element.stride < element.count) {
+                error = path + " is cut short in its " + element.name + " element";
+                return false;
+            }
+            p += element.count * element.stride;
+        }
+        else if (&element == face) {
+            break; // nothing after the faces is needed
+        }
+        else {
+            for (size_t i = 0; i < element.count; ++i) {
+                size_t size = elementSize(element, p, end, swap);
+                if (size == 0) {
+                    error = path + " is cut short in its " + element.name + " element";
+                    return false;
+                }
+                p += size;
+            }
+        }
+    }
+
+    const int x = vertex != NULL ? vertex->find("x") : -1;
+    const int y = vertex != NULL ? vertex->find("y") : -1;
+    const int z = vertex != NULL ? vertex->find("z") : -1;
+    if (x < 0 || y < 0 || z < 0 || vertex->stride == 0) {
+        error = path + " has no fixed size vertex element with x y z";
+        return false;
+    }
+    if (vertex->count > (size_t)INT32_MAX) {
+        error = path + " has more vertices than a mesh can index";
+        return false;
+    }
+    const int nx = vertex->find("nx"), ny = vertex->find("ny"), nz = vertex->find("nz");
+    const int u = vertex->find("u", "s", "texture_u"), v = vertex->find("v", "t", "texture_v");
+    const bool has_normals = nx >= 0 && ny >= 0 && nz >= 0;
+    const bool has_uvs = u >= 0 && v >= 0;
+
+    // vertices, each block keeps its own bounds until they're merged below
+    const int num_vertices = (int)vertex->count;
+    const int num_vertex_blocks = (num_vertices + PLY_BLOCK_SIZE - 1) / PLY_BLOCK_SIZE;
+    std::vector<glm::vec3> block_min(num_vertex_blocks, glm::vec3(FLT_MAX)), block_max(num_vertex_blocks, glm::vec3(-FLT_MAX));
+    if (!bounds_only) {
+        positions.resize(num_vertices);
+        normals.assign(num_vertices, glm::vec3(0.0f));
+        uvs.assign(num_vertices, glm::vec2(0.0f));
+    }
+    const std::vector<PLYProperty>& vp = vertex->properties;
+    utilityCore::parallelFor(num_vertex_blocks, [&](int b) {
+        const int last = std::min((b + 1) * PLY_BLOCK_SIZE, num_vertices);
+        for (int i = b * PLY_BLOCK_SIZE; i < last; ++i) {
+            const unsigned char* e = vertex_data + (size_t)i * vertex->stride;
+            glm::vec3 position((float)readValue(e + vp[x].offset, vp[x].type, swap), (float)readValue(e + vp[y].offset, vp[y].type, swap),
+                (float)readValue(e + vp[z].offset, vp[z].type, swap));
+            block_min[b] = glm::min(block_min[b], position);
+            block_max[b] = glm::max(block_max[b], position);
+            if (bounds_only) {
+                continue;
+            }
+            positions[i] = position;
+            if (has_normals) {
+                normals[i] = glm::vec3((float)readValue(e + vp[nx].offset, vp[nx].type, swap), (float)readValue(e + vp[ny].offset, vp[ny].type, swap),
+                    (float)readValue(e + vp[nz].offset, vp[nz].type, swap));
+            }
+            if (has_uvs) {
+                uvs[i] = glm::vec2((float)readValue(e + vp[u].offset, vp[u].type, swap), (float)readValue(e + vp[v].offset, vp[v].type, swap));
+            }
+        }
+    });
+    for (int b = 0; b < num_vertex_blocks; ++b) {
+        AABB_min = glm::min(AABB_min, block_min[b]);
+        AABB_max = glm::max(AABB_max, block_max[b]);
+    }
+    if (bounds_only) {
+        return true;
+    }
+
+    bad_faces = 0;
+    indices.clear();
+    const int corners = face != NULL ? face->find("vertex_indices", "vertex_index") : -1;
+    if (face == NULL || face->count == 0) {
+        return true; // a point cloud
+    }
+    if (corners < 0 || face->properties[corners].count_type == PLY_NONE) {
+        error = path + " has faces without a vertex_indices list";
+        return false;
+    }
+    const PLYProperty& list = face->properties[corners];
+    const size_t corner_property = (size_t)corners;
+    const size_t count_size = typeSize(list.count_type);
+    const size_t index_size = typeSize(list.type);
+
+    // scans write every face as a tri, so first try a fixed tri stride, which lets face blocks
+    // be decoded in parallel. any face that isn't a tri sends it to the serial walk below
+    size_t before = 0; // bytes of the fixed properties ahead of the list
+    size_t tri_stride = 0;
+    bool fixed_tris = true;
+    for (size_t i = 0; i < face->properties.size(); ++i) {
+        const PLYProperty& prop = face->properties[i];
+        if (i != corner_property && prop.count_type != PLY_NONE) {
+            fixed_tris = false; // a second list, per face uvs and the like
+        }
+        const size_t size = i == corner_property ? count_size + 3 * index_size : typeSize(prop.type);
+        if (i < corner_property) {
+            before += size;
+        }
+        tri_stride += size;
+    }
+    fixed_tris = fixed_tris && face->count <= (size_t)INT32_MAX && (size_t)(end - face_data) / tri_stride >= face->count;
+
+    if (fixed_tris) {
+        const int num_faces = (int)face->count;
+        const int num_face_blocks = (num_faces + PLY_BLOCK_SIZE - 1) / PLY_BLOCK_SIZE;
+        std::atomic<bool> all_tris(true);
+        indices.resize(num_faces);
+        utilityCore::parallelFor(num_face_blocks, [&](int b) {
+            const int last = std::min((b + 1) * PLY_BLOCK_SIZE, num_faces);
+            for (int i = b * PLY_BLOCK_SIZE; i < last && all_tris; ++i) {
+                const unsigned char* e = face_data + (size_t)i * tri_stride + before;
+                if (readIndex(e, list.count_type, swap) != 3) {
+                    all_tris = false;
+                    break;
+                }
+                e += count_size;
+                glm::ivec3 tri(-1);
+                const long long i0 = readIndex(e, list.type, swap);
+                const long long i1 = readIndex(e + index_size, list.type, swap);
+                const long long i2 = readIndex(e + 2 * index_size, list.type, swap);
+                if (i0 >= 0 && i0 < num_vertices && i1 >= 0 && i1 < num_vertices && i2 >= 0 && i2 < num_vertices) {
+                    tri = glm::ivec3((int)i0, (int)i1, (int)i2);
+                }
+                indices[i] = tri; // -1 marks a bad face, removed below
+            }
+        });
+        fixed_tris = all_tris;
+    }
+    if (!fixed_tris) {
+        indices.clear();
+        const unsigned char* e = face_data;
+        std::vector<long long> face_indices;
+        for (size_t f = 0; f < face->count; ++f) {
+            const size_t size = elementSize(*face, e, end, swap);
+            if (size == 0) {
+                error = path + " is cut short in its face element";
+                return false;
+            }
+            const unsigned char* q = e;
+            for (size_t i = 0; i < face->properties.size(); ++i) {
+                const PLYProperty& prop = face->properties[i];
+                if (prop.count_type == PLY_NONE) {
+                    q += typeSize(prop.type);
+                    continue;
+                }
+                const long long count = std::max(readIndex(q, prop.count_type, swap), 0ll);
+                q += typeSize(prop.count_type);
+                if (i == corner_property) {
+                    face_indices.resize(count);
+                    for (long long c = 0; c < count; ++c) {
+                        face_indices[c] = readIndex(q + c * index_size, list.type, swap);
+                    }
+                }
+                q += count * typeSize(prop.type);
+            }
+            e += size;
+
+            bool in_range = face_indices.size() >= 3;
+            for (long long index : face_indices) {
+                in_range = in_range && index >= 0 && index < num_vertices;
+            }
+            if (!in_range) {
+                indices.push_back(glm::ivec3(-1));
+                continue;
+            }
+            for (size_t c = 2; c < face_indices.size(); ++c) {
+                indices.push_back(glm::ivec3((int)face_indices[0], (int)face_indices[c - 1], (int)face_indices[c]));
+            }
+        }
+    }
+
+    const size_t num_tris = indices.size();
+    indices.erase(std::remove(indices.begin(), indices.end(), glm::ivec3(-1)), indices.end());
+    bad_faces = (int)(num_tris - indices.size());
+    return true;
+}
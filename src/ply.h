@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+// binary PLY meshes (little or big endian), as photogrammetry and scanning tools write them.
+// the file is memory mapped and its vertex and face elements are decoded in parallel blocks
+
+bool isPLYPath(const std::string& path); // .ply
+
+// the vertices (x y z, nx ny nz and u v / s t when present) and faces of path as one indexed
+// mesh. faces with more than three corners are fanned, faces with out of range indices are
+// dropped and counted in bad_faces. missing normals and uvs are left zero. with bounds_only
+// just AABB_min / AABB_max are filled in. false with error set if the file can't be used
+bool loadPLY(const std::string& path, std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals, std::vector<glm::vec2>& uvs,
+    std::vector<glm::ivec3>& indices, glm::vec3& AABB_min, glm::vec3& AABB_max, int& bad_faces, std::string& error, bool bounds_only = false);
@@ -1,7 +1,11 @@
 //#define _CRT_SECURE_NO_DEPRECATE
 #include <ctime>
+#include <cstring>
+#include <chrono>
+#include <glm/gtc/matrix_inverse.hpp>
 #include "main.h"
 #include "preview.h"
+#include "raster.h"
 #include "ImGui/imgui.h"
 #include "ImGui/imgui_impl_glfw.h"
 #include "ImGui/imgui_impl_opengl3.h"
@@ -109,6 +113,7 @@ void cleanupCuda() {
 }
 
 void initCuda() {
+	PhaseTimer phase(PHASE_CUDA_INIT);
 	cudaGLSetGLDevice(0);
 
 	// Clean up on program exit
@@ -133,6 +138,104 @@ void initPBO() {
 
 }
 
+// DISPLAY_SURFACE, CUDA writes display colors straight into displayImage through a surface
+// instead of into the PBO glTexSubImage2D then copies from. GL can't sample the texture while
+// it's mapped, so it's mapped for each frame's writes; the surface object is kept as long as
+// the mapping hands back the same array
+static cudaGraphicsResource* textureResource = NULL;
+static cudaArray_t textureArray = NULL;
+static cudaSurfaceObject_t textureSurface = 0;
+
+static void initDisplaySurface() {
+	if (cudaGraphicsGLRegisterImage(&textureResource, displayImage, GL_TEXTURE_2D, cudaGraphicsRegisterFlagsSurfaceLoadStore) != cudaSuccess) {
+		cudaGetLastError();
+		textureResource = NULL;
+		std::cout << "DISPLAY_SURFACE: the driver can't register the display texture, using the PBO" << std::endl;
+	}
+}
+
+static void freeDisplaySurface() {
+	if (textureResource != NULL) {
+		if (textureSurface != 0) {
+			cudaDestroySurfaceObject(textureSurface);
+		}
+		cudaGraphicsUnregisterResource(textureResource);
+		textureResource = NULL;
+		textureSurface = 0;
+		textureArray = NULL;
+	}
+}
+
+bool displaySurfaceEnabled() {
+	return textureResource != NULL;
+}
+
+static cudaArray_t mapTextureArray(cudaStream_t stream) {
+	cudaArray_t array = NULL;
+	cudaGraphicsMapResources(1, &textureResource, stream);
+	cudaGraphicsSubResourceGetMappedArray(&array, textureResource, 0, 0);
+	return array;
+}
+
+cudaSurfaceObject_t mapDisplaySurface() {
+	cudaArray_t array = mapTextureArray(0);
+	if (array != textureArray) {
+		if (textureSurface != 0) {
+			cudaDestroySurfaceObject(textureSurface);
+		}
+		cudaResourceDesc desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.resType = cudaResourceTypeArray;
+		desc.res.array.array = array;
+		cudaCreateSurfaceObject(&textureSurface, &desc);
+		textureArray = array;
+	}
+	return textureSurface;
+}
+
+void unmapDisplaySurface() {
+	cudaGraphicsUnmapResources(1, &textureResource, 0);
+}
+
+// RENDER_THREAD, the window copies the images the render thread finishes into the PBO on a
+// stream of its own. the legacy mapping runs on the default stream, where it would queue
+// behind the render thread's kernels
+static cudaGraphicsResource* pboResource = NULL;
+static cudaStream_t displayStream = NULL;
+
+void initDisplayCopy() {
+	cudaGLUnregisterBufferObject(pbo);
+	cudaGraphicsGLRegisterBuffer(&pboResource, pbo, cudaGraphicsRegisterFlagsWriteDiscard);
+	cudaStreamCreateWithFlags(&displayStream, cudaStreamNonBlocking);
+}
+
+void freeDisplayCopy() {
+	if (pboResource != NULL) {
+		cudaGraphicsUnregisterResource(pboResource);
+		cudaStreamDestroy(displayStream);
+		pboResource = NULL;
+		cudaGLRegisterBufferObject(pbo); // what deletePBO unregisters
+	}
+}
+
+void copyToPBO(const uchar4* image) {
+	if (displaySurfaceEnabled()) {
+		// into the texture, the PBO isn't drawn from
+		cudaArray_t array = mapTextureArray(displayStream);
+		cudaMemcpy2DToArrayAsync(array, 0, 0, image, width * sizeof(uchar4), width * sizeof(uchar4), height, cudaMemcpyDeviceToDevice, displayStream);
+		cudaGraphicsUnmapResources(1, &textureResource, displayStream);
+		cudaStreamSynchronize(displayStream);
+		return;
+	}
+	uchar4* pbo_dptr = NULL;
+	size_t size = 0;
+	cudaGraphicsMapResources(1, &pboResource, displayStream);
+	cudaGraphicsResourceGetMappedPointer((void**)&pbo_dptr, &size, pboResource);
+	cudaMemcpyAsync(pbo_dptr, image, width * height * sizeof(uchar4), cudaMemcpyDeviceToDevice, displayStream);
+	cudaGraphicsUnmapResources(1, &pboResource, displayStream);
+	cudaStreamSynchronize(displayStream);
+}
+
 void errorCallback(int error, const char* description) {
 	fprintf(stderr, "%s\n", description);
 }
@@ -174,6 +277,12 @@ bool init() {
 	initTextures();
 	initCuda();
 	initPBO();
+	if (scene->render_settings.display_surface) {
+		initDisplaySurface();
+	}
+	if (!rasterInit() && scene->render_settings.raster_primary) {
+		std::cout << "RASTER_PRIMARY needs OpenGL 3.3, camera rays are traced" << std::endl;
+	}
 	GLuint passthroughProgram = initShader();
 
 	glUseProgram(passthroughProgram);
@@ -216,7 +325,244 @@ void RenderImGui()
 	//	counter++;
 	//ImGui::SameLine();
 	//ImGui::Text("counter = %d", counter);
+	RenderSettings& settings = guiSettings();
 	ImGui::Text("Traced Depth %d", imguiData->TracedDepth);
+	if (imguiData->RaysPerSecond > 0.0f) {
+		ImGui::Text("%.1f Mrays/s, %.1f BVH nodes per ray", imguiData->RaysPerSecond * 1e-6f, imguiData->NodesPerRay);
+	}
+	ImGui::SliderInt("Roulette start depth", &settings.roulette_start_depth, 0, 16);
+	ImGui::SliderFloat("Roulette min survival", &settings.roulette_min_survival, 0.0f, 1.0f, "%.3f");
+	// taken bounces are counted whatever the limits, so they can change mid render
+	ImGui::SliderInt("Diffuse depth", &settings.diffuse_depth, 0, 16);
+	ImGui::SliderInt("Glossy depth", &settings.glossy_depth, 0, 16);
+	ImGui::SliderInt("Specular depth", &settings.specular_depth, 0, 16);
+	if (ImGui::SliderFloat("Indirect clamp", &settings.indirect_clamp, 0.0f, 100.0f, settings.indirect_clamp == 0.0f ? "off" : "%.2f",
+		ImGuiSliderFlags_Logarithmic)) {
+		guiRestart(); // clamped and unclamped samples would average to neither
+	}
+	if (settings.restir) {
+		ImGui::SliderInt("ReSTIR candidates", &settings.restir_candidates, 1, 64);
+		ImGui::SliderInt("ReSTIR spatial neighbours", &settings.restir_spatial, 0, 8);
+	}
+	if (settings.path_guiding > 0) {
+		// every fraction is unbiased, the accumulation can keep going
+		ImGui::SliderFloat("Guide fraction", &settings.guide_fraction, 0.0f, 0.9f, "%.2f");
+	}
+	ImGui::Checkbox("Persistent threads", &settings.persistent_threads);
+	if (settings.compaction != COMPACT_NONE) {
+		ImGui::SliderInt("Tail paths", &settings.tail_paths, 0, 65536, settings.tail_paths == 0 ? "off" : "%d", ImGuiSliderFlags_Logarithmic);
+	}
+	int traversal = settings.traversal;
+	if (ImGui::Combo("Path ray traversal", &traversal, "thread per ray\0persistent\0persistent, speculative\0")) {
+		settings.traversal = (TraversalMode)traversal;
+	}
+	ImGui::Checkbox("Fused MIS and shading", &settings.fused_shading);
+	ImGui::Checkbox("CUDA graph", &settings.cuda_graph);
+	ImGui::Checkbox("Blocking stage timers", &settings.blocking_timers);
+	ImGui::Checkbox("Anti-aliasing", &settings.anti_aliasing);
+	int tonemap = settings.tonemap;
+	if (ImGui::Combo("Tonemap", &tonemap, "reinhard\0ACES\0filmic\0linear\0")) {
+		settings.tonemap = (ToneMap)tonemap;
+	}
+	ImGui::SliderFloat("Exposure", &settings.exposure, -8.0f, 8.0f, "%.1f stops");
+	ImGui::Checkbox("Auto exposure", &settings.auto_exposure);
+	if (!renderThreadRunning()) {
+		// the visibility buffer is drawn with the window's GL context
+		ImGui::Checkbox("Rasterize camera rays (no anti-aliasing)", &settings.raster_primary);
+	}
+	int preview = settings.preview_scale >= 4 ? 2 : settings.preview_scale >= 2 ? 1 : 0;
+	if (ImGui::Combo("Preview while moving", &preview, "off\0" "1/2 resolution\0" "1/4 resolution\0")) {
+		settings.preview_scale = 1 << preview;
+	}
+	if (settings.preview_scale > 1) {
+		ImGui::SliderInt("Preview depth", &settings.preview_depth, 0, 8, settings.preview_depth == 0 ? "full" : "%d");
+	}
+	ImGui::SliderInt("Iterations per frame", &settings.iterations_per_frame, 0, 64, settings.iterations_per_frame == 0 ? "adaptive" : "%d");
+	if (settings.iterations_per_frame == 0) {
+		ImGui::SliderFloat("Frame time target", &settings.frame_time_target, 8.0f, 200.0f, "%.0f ms");
+	}
+	if (settings.tile_size > 0) {
+		// how a slow iteration fills in over several frames
+		int tile_order = settings.tile_order;
+		if (ImGui::Combo("Tile order", &tile_order, "scanline\0center out\0follow cursor\0highest variance\0")) {
+			settings.tile_order = (TileOrder)tile_order;
+		}
+	}
+	// shift drag on the image sets it too, the rest of the image keeps what it had
+	ImGui::DragInt4("Crop x y w h", &settings.crop[0], 1.0f, 0, glm::max(width, height));
+	settings.crop = glm::max(settings.crop, glm::ivec4(0));
+	if (settings.crop.z > 0 && settings.crop.w > 0) {
+		ImGui::SameLine();
+		if (ImGui::Button("Clear")) {
+			settings.crop = glm::ivec4(0);
+		}
+	}
+	ImGui::SliderFloat("Intersection slice", &settings.launch_slice_ms, 0.0f, 20.0f, settings.launch_slice_ms == 0.0f ? "off" : "%.1f ms");
+	if (settings.denoise) {
+		ImGui::SliderInt("Denoise interval", &settings.denoise_interval, 0, 256, settings.denoise_interval == 0 ? "saves only" : "%d");
+	}
+	ImGui::Checkbox("BVH traversal", &settings.bvh_accel);
+	if (ImGui::SliderFloat("Mesh LOD bias", &settings.lod_bias, 0.0f, 8.0f, settings.lod_bias == 0.0f ? "full detail" : "%.2f")) {
+		guiRestart();
+	}
+	if (ImGui::SliderFloat("Shutter", &settings.shutter, 0.0f, 1.0f, settings.shutter == 0.0f ? "open key only" : "%.2f")) {
+		guiRestart();
+	}
+	ImGui::Checkbox("Watch scene file", &settings.watch_scene);
+	int shading_mode = settings.shading_mode;
+	if (ImGui::Combo("Shading", &shading_mode, "full\0albedo\0normals\0ambient occlusion\0direct light only\0")) {
+		settings.shading_mode = (ShadingMode)shading_mode;
+		guiRestart();
+	}
+	if (settings.shading_mode == SHADING_AO) {
+		if (ImGui::SliderFloat("AO distance", &settings.ao_distance, 0.0f, 100.0f, settings.ao_distance == 0.0f ? "scene size / 10" : "%.2f",
+			ImGuiSliderFlags_Logarithmic)) {
+			guiRestart();
+		}
+	}
+	int debug_view = settings.debug_view;
+	if (ImGui::Combo("Debug view", &debug_view, "none\0BVH nodes per camera ray\0tri tests per camera ray\0")) {
+		settings.debug_view = (DebugView)debug_view;
+		guiRestart(); // restart accumulation, heatmaps and renders don't mix
+	}
+	if (settings.debug_view != DEBUG_NONE) {
+		if (ImGui::SliderFloat("Heatmap max", &settings.heatmap_max, 1.0f, 1024.0f, "%.0f", ImGuiSliderFlags_Logarithmic)) {
+			guiRestart();
+		}
+	}
+	if (ImGui::CollapsingHeader("Stage times")) {
+		for (int s = 0; s < imguiData->StageMs.size(); s++) {
+			if (imguiData->StageMs[s] > 0.0f) {
+				ImGui::Text("%s: %.3f ms", renderStageName(s), imguiData->StageMs[s]);
+			}
+		}
+	}
+	if (!imguiData->RayStats.empty() && ImGui::CollapsingHeader("Ray stats")) {
+		const std::vector<unsigned long long>& stats = imguiData->RayStats;
+		for (int q = 0; q < NUM_TRACE_QUERIES; q++) {
+			if (stats[STAT_RAYS + q] > 0) {
+				ImGui::Text("%s rays: %llu, %.1f nodes %.1f tris per ray", traceQueryName(q), stats[STAT_RAYS + q],
+					(double)stats[STAT_NODES + q] / stats[STAT_RAYS + q], (double)stats[STAT_TRIS + q] / stats[STAT_RAYS + q]);
+			}
+		}
+		ImGui::Text("escaped %llu, roulette kills %llu, specular bounces %llu", stats[STAT_ESCAPED], stats[STAT_ROULETTE_KILLS],
+			stats[STAT_SPECULAR_BOUNCES]);
+		for (int b = 0; b < MAX_STAT_BOUNCES; b++) {
+			if (stats[STAT_BOUNCE_RAYS + b] > 0) {
+				ImGui::Text("bounce %d%s: %llu paths", b, b == MAX_STAT_BOUNCES - 1 ? "+" : "", stats[STAT_BOUNCE_RAYS + b]);
+			}
+		}
+	}
+	const PathProbe& probe = guiProbe();
+	if (probe.x >= 0 && ImGui::CollapsingHeader("Path probe")) {
+		// the slowest sample's bounces, reportProbe prints the same on stdout
+		int slowest = 0;
+		long long total_cycles = 0;
+		for (int k = 0; k < (int)probe.num_bounces.size(); k++) {
+			total_cycles += probeSampleCycles(probe, k);
+			if (probeSampleCycles(probe, k) > probeSampleCycles(probe, slowest)) {
+				slowest = k;
+			}
+		}
+		ImGui::Text("pixel (%d, %d), %d samples, %.2f us per sample", width - 1 - probe.x, probe.y, (int)probe.num_bounces.size(),
+			probeMicroseconds(probe, total_cycles) / glm::max((int)probe.num_bounces.size(), 1));
+		ImGui::Text("slowest: sample %d, %.2f us", slowest, probeMicroseconds(probe, probeSampleCycles(probe, slowest)));
+		for (int b = 0; b < probe.num_bounces[slowest]; b++) {
+			const ProbeBounce& bounce = probe.bounces[slowest * probe.max_bounces + b];
+			ImGui::Text("%d: geom %d mat %d%s, w %.2f / %.2f, %d nodes, %.2f us", b, bounce.geom, bounce.material,
+				bounce.specular ? " spec" : "", bounce.light_weight, bounce.bsdf_weight, bounce.nodes, probeMicroseconds(probe, bounce.cycles));
+		}
+	}
+	if (imguiData->ActivePixels >= 0) {
+		ImGui::Text("Active pixels %d / %d", imguiData->ActivePixels, width * height);
+		ImGui::SliderFloat("Adaptive threshold", &settings.adaptive_threshold, 0.001f, 0.1f, "%.4f", ImGuiSliderFlags_Logarithmic);
+	}
+	if (imguiData->TemporalBuffers) {
+		ImGui::SliderInt("Temporal history", &settings.temporal_history, 0, 64, settings.temporal_history == 0 ? "off" : "%d samples");
+	}
+	if (imguiData->AtrousBuffers) {
+		ImGui::SliderInt("A-Trous passes", &settings.atrous_iterations, 0, 10);
+		ImGui::SliderFloat("A-Trous color sigma", &settings.atrous_sigma_color, 0.01f, 10.0f, "%.2f", ImGuiSliderFlags_Logarithmic);
+		ImGui::SliderFloat("A-Trous normal sigma", &settings.atrous_sigma_normal, 0.01f, 2.0f, "%.2f", ImGuiSliderFlags_Logarithmic);
+		ImGui::SliderFloat("A-Trous position sigma", &settings.atrous_sigma_position, 0.01f, 10.0f, "%.2f", ImGuiSliderFlags_Logarithmic);
+	}
+	if (!guiGeoms().empty() && ImGui::CollapsingHeader("Objects")) {
+		// geom indices, which the TLAS build reordered. the path probe's first hit picks one too
+		static int selected = 0;
+		static float update_ms = 0.0f;
+		selected = glm::clamp(selected, 0, (int)guiGeoms().size() - 1);
+		ImGui::SliderInt("Geom", &selected, 0, (int)guiGeoms().size() - 1);
+		if (probe.x >= 0 && !probe.bounces.empty() && probe.bounces[0].geom >= 0) {
+			ImGui::SameLine();
+			if (ImGui::Button("Probed")) {
+				selected = probe.bounces[0].geom;
+			}
+		}
+		Geom& geom = guiGeoms()[selected];
+		ImGui::Text("%s, material %d", geom.type == MESH ? "mesh" : geom.type == SPHERE ? "sphere" : geom.type == CUBE ? "cube" : geom.type == CURVES ? "curves" : geom.type == VOLUME ? "volume" : "squareplane",
+			geom.materialid);
+		bool moved = ImGui::DragFloat3("Translation", &geom.translation.x, 0.05f);
+		moved |= ImGui::DragFloat3("Rotation", &geom.rotation.x, 0.5f);
+		moved |= ImGui::DragFloat3("Scale", &geom.scale.x, 0.01f, 0.001f, 1000.0f);
+		if (moved) {
+			// only the geom and the TLAS change, every BLAS stays as it is
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			geom.transform = utilityCore::buildTransformationMatrix(geom.translation, geom.rotation, geom.scale);
+			geom.inverseTransform = glm::inverse(geom.transform);
+			geom.invTranspose = glm::inverseTranspose(geom.transform);
+			guiGeomEdited(selected);
+			update_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+			guiRestart();
+		}
+		if (update_ms > 0.0f && !renderThreadRunning()) {
+			ImGui::Text("last update %.3f ms", update_ms);
+		}
+	}
+	if (ImGui::CollapsingHeader("Materials")) {
+		// each edit uploads just that material and restarts accumulation
+		for (int i = 0; i < guiMaterials().size(); i++) {
+			Material& m = guiMaterials()[i];
+			ImGui::PushID(i);
+			if (ImGui::TreeNode("material", "Material %d", i)) {
+				bool changed = false;
+				int type = m.type;
+				if (ImGui::Combo("BSDF", &type, "diffuse brdf\0diffuse btdf\0spec brdf\0spec btdf\0spec glass\0spec plastic\0microfacet brdf\0")) {
+					m.type = (BSDF)type;
+					changed = true;
+				}
+				changed |= ImGui::ColorEdit3("R", &m.R.x);
+				changed |= ImGui::ColorEdit3("T", &m.T.x);
+				changed |= ImGui::SliderFloat("IOR", &m.ior, 1.0f, 3.0f, "%.3f");
+				if (m.type == MIRCROFACET_BRDF) {
+					changed |= ImGui::SliderFloat("Roughness", &m.roughness, 0.0f, 1.0f, "%.3f");
+				}
+				// lights are gathered at load, an emissive material can't go dark or a dark one start emitting
+				if (m.emittance > 0.0f) {
+					changed |= ImGui::SliderFloat("Emittance", &m.emittance, 0.001f, 100.0f, "%.3f", ImGuiSliderFlags_Logarithmic | ImGuiSliderFlags_AlwaysClamp);
+				}
+				if (changed) {
+					guiMaterialEdited(i);
+					guiRestart();
+				}
+				ImGui::TreePop();
+			}
+			ImGui::PopID();
+		}
+	}
+	ImGui::Checkbox("Sort paths by material", &settings.sort_by_material);
+	ImGui::Checkbox("Shade each BSDF in its own launch", &settings.shade_by_bsdf);
+	ImGui::Checkbox("Sort rays by direction and origin", &settings.sort_rays);
+	ImGui::Checkbox("Compact MIS light rays", &settings.compact_light_rays);
+	int compaction = settings.compaction;
+	if (ImGui::Combo("Stream compaction", &compaction, "none\0thrust\0scan\0warp aggregated\0")) {
+		settings.compaction = (CompactMethod)compaction;
+	}
+	if (settings.compaction != COMPACT_NONE) {
+		ImGui::Checkbox("Refill ended paths (tiled)", &settings.regenerate_paths);
+		for (int d = 1; d <= imguiData->TracedDepth && d < imguiData->CompactionMs.size(); d++) {
+			ImGui::Text("bounce %d: %.3f ms, %d paths left", d, imguiData->CompactionMs[d], imguiData->PathsAlive[d]);
+		}
+	}
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 	ImGui::End();
 
@@ -232,21 +578,24 @@ bool MouseOverImGuiWindow()
 }
 
 void mainLoop() {
+	bool startupReported = false;
 	while (!glfwWindowShouldClose(window)) {
 		
 		glfwPollEvents();
 
 		runCuda();
 
-		string title = "CIS565 Path Tracer | " + utilityCore::convertIntToString(iteration) + " Iterations";
+		string title = "CIS565 Path Tracer | " + utilityCore::convertIntToString(guiIteration()) + " Iterations";
 		glfwSetWindowTitle(window, title.c_str());
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
 		glBindTexture(GL_TEXTURE_2D, displayImage);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-		glClear(GL_COLOR_BUFFER_BIT);
+		if (!displaySurfaceEnabled()) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
-		// Binding GL_PIXEL_UNPACK_BUFFER back to default
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			// Binding GL_PIXEL_UNPACK_BUFFER back to default
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		glClear(GL_COLOR_BUFFER_BIT);
 
 		// VAO, shader program, and texture already bound
 		glDrawElements(GL_TRIANGLES, 6,  GL_UNSIGNED_SHORT, 0);
@@ -255,8 +604,15 @@ void mainLoop() {
 		RenderImGui();
 
 		glfwSwapBuffers(window);
+		if (!startupReported) {
+			reportStartup("the first frame");
+			startupReported = true;
+		}
 	}
 
+	stopRenderThread();
+	freeDisplaySurface();
+	rasterFree();
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
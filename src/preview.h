@@ -6,5 +6,16 @@ std::string currentTimeString();
 bool init();
 void mainLoop();
 
+// DISPLAY_SURFACE, the display texture as a surface for the frame's display kernels, false
+// when it's off or the texture couldn't be registered and frames go through the PBO
+bool displaySurfaceEnabled();
+cudaSurfaceObject_t mapDisplaySurface();
+void unmapDisplaySurface();
+
+// RENDER_THREAD, the PBO (or with DISPLAY_SURFACE the texture) filled from a device image the render thread published
+void initDisplayCopy();
+void freeDisplayCopy();
+void copyToPBO(const uchar4* image);
+
 bool MouseOverImGuiWindow();
 void InitImguiData(GuiDataContainer* guiData);
\ No newline at end of file
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+// NVTX ranges for Nsight Systems and Compute. ENABLE_PROFILING in CMake defines USE_NVTX,
+// without it every range compiles to nothing. the header only NVTX 3 ships with the toolkit
+#ifdef USE_NVTX
+#include <nvtx3/nvToolsExt.h>
+#endif
+
+// opens a range on the calling thread, payload >= 0 shows up next to the name (the bounce
+// of a render stage)
+inline void profilePush(const char* name, int payload = -1)
+{
+#ifdef USE_NVTX
+    nvtxEventAttributes_t attributes = {};
+    attributes.version = NVTX_VERSION;
+    attributes.size = NVTX_EVENT_ATTRIB_STRUCT_SIZE;
+    attributes.messageType = NVTX_MESSAGE_TYPE_ASCII;
+    attributes.message.ascii = name;
+    if (payload >= 0) {
+        attributes.payloadType = NVTX_PAYLOAD_TYPE_INT32;
+        attributes.payload.iValue = payload;
+    }
+    nvtxRangePushEx(&attributes);
+#endif
+}
+
+inline void profilePop()
+{
+#ifdef USE_NVTX
+    nvtxRangePop();
+#endif
+}
+
+// a range over the rest of the enclosing scope
+class ProfileRange
+{
+public:
+    explicit ProfileRange(const char* name, int payload = -1) { profilePush(name, payload); }
+    ~ProfileRange() { profilePop(); }
+
+private:
+    ProfileRange(const ProfileRange&);
+    ProfileRange& operator=(const ProfileRange&);
+};
+
+// the steps between launch and the first frame, timed on the host for reportStartup and the
+// benchmark JSON. a phase started inside another one pauses it, so each thread's times are
+// exclusive. builds on worker threads add up their own time, see PHASE_BVH_REFORMAT
+enum StartupPhase {
+    PHASE_SCENE_FILE, // parsing the scene file and whatever loading isn't one of the phases below
+    PHASE_OBJ_PARSE, // tinyobj, or reading BVH_CACHE files, over every mesh in parallel
+    PHASE_TRI_SETUP, // laying the meshes out and computing the tri bounds
+    PHASE_BVH_BUILD, // BLASes, TLAS, wide collapse, LBVH and OptiX builds
+    PHASE_BVH_REFORMAT, // reformatBVHToGPU, summed over the threads building BLASes side by side
+    PHASE_CUDA_INIT, // creating the CUDA context
+    PHASE_GPU_ALLOC, // cudaMalloc of the arenas and the pixel buffers
+    PHASE_UPLOAD, // copying the scene to the device, without its allocations
+    PHASE_GL_INIT, // window, GL context, ImGui and shaders
+    NUM_STARTUP_PHASES
+};
+
+inline const char* startupPhaseName(int phase)
+{
+    static const char* names[NUM_STARTUP_PHASES] = { "scene file", "OBJ parse", "tri setup", "BVH build",
+        "BVH reformat", "CUDA context", "GPU allocation", "upload", "GL / ImGui init" };
+    return names[phase];
+}
+
+// nanoseconds spent in each phase since the last resetStartupPhases
+inline std::atomic<long long>* startupPhaseTimes()
+{
+    static std::atomic<long long> times[NUM_STARTUP_PHASES];
+    return times;
+}
+
+inline double startupPhaseMs(int phase)
+{
+    return startupPhaseTimes()[phase].load() * 1e-6;
+}
+
+inline void resetStartupPhases()
+{
+    for (int p = 0; p < NUM_STARTUP_PHASES; ++p) {
+        startupPhaseTimes()[p] = 0;
+    }
+}
+
+// adds the time until stop() or the end of the enclosing scope to its phase
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(StartupPhase phase) : phase(phase), parent(current()), stopped(false)
+    {
+        if (parent != NULL) {
+            parent->pause();
+        }
+        current() = this;
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer() { stop(); }
+
+    void stop()
+    {
+        if (stopped) {
+            return;
+        }
+        stopped = true;
+        pause();
+        current() = parent;
+        if (parent != NULL) {
+            parent->start = std::chrono::steady_clock::now();
+        }
+    }
+
+private:
+    PhaseTimer(const PhaseTimer&);
+    PhaseTimer& operator=(const PhaseTimer&);
+
+    void pause()
+    {
+        startupPhaseTimes()[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // the innermost running timer of this thread
+    static PhaseTimer*& current()
+    {
+        static thread_local PhaseTimer* timer = NULL;
+        return timer;
+    }
+
+    StartupPhase phase;
+    PhaseTimer* parent;
+    bool stopped;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,337 @@
+// RASTER_PRIMARY: the first hits of unjittered pinhole camera rays come out of a rasterized
+// visibility buffer instead of a BVH walk. the geoms are drawn with the pathtracer's own camera
+// model into an RG32I target of geom and BLAS local tri ids, and the target is copied into
+// pathtrace's buffer through CUDA GL interop. mesh tris are drawn straight out of dev_tris,
+// cubes and square planes as their faces and spheres as a ray cast impostor on their cube
+#include "main.h"
+#include "raster.h"
+
+#define RASTER_NEAR 0.001f
+#define RASTER_FAR 10000.0f // MAX_INTERSECT_DIST, only without clip control
+
+// clip x and y from the camera space position like generateCameraPath maps pixels to rays,
+// shifted half a pixel so pixel centers sample the rays through the pixel corners
+static const char* visibilityVS =
+	"#version 330\n"
+	"layout(location = 0) in vec3 Position;\n"
+	"uniform mat4 u_model;\n"
+	"uniform vec3 u_cam_position;\n"
+	"uniform vec3 u_cam_right; // over their squared lengths, dot products give the basis coordinates\n"
+	"uniform vec3 u_cam_up;\n"
+	"uniform vec3 u_cam_view;\n"
+	"uniform vec2 u_clip_scale; // 2 / (resolution * pixelLength)\n"
+	"uniform vec2 u_inv_resolution;\n"
+	"uniform vec2 u_depth; // clip z = u_depth.x * z + u_depth.y\n"
+	"out vec3 v_world;\n"
+	"void main() {\n"
+	"    vec4 world = u_model * vec4(Position, 1.0);\n"
+	"    vec3 d = world.xyz - u_cam_position;\n"
+	"    float z = dot(d, u_cam_view);\n"
+	"    v_world = world.xyz;\n"
+	"    gl_Position = vec4(z * u_inv_resolution - vec2(dot(d, u_cam_right), dot(d, u_cam_up)) * u_clip_scale,\n"
+	"        u_depth.x * z + u_depth.y, z);\n"
+	"}\n";
+
+// u_mode 0 is mesh tris, 1 analytic faces and 2 the sphere inside the cube that's drawn
+static const char* visibilityFS =
+	"#version 330\n"
+	"uniform int u_geom;\n"
+	"uniform int u_mode;\n"
+	"uniform mat4 u_inverse_model;\n"
+	"uniform vec3 u_cam_position;\n"
+	"uniform vec3 u_cam_view;\n"
+	"uniform vec2 u_depth;\n"
+	"uniform vec2 u_depth_window; // ndc depth to window depth\n"
+	"in vec3 v_world;\n"
+	"layout(location = 0) out ivec2 id;\n"
+	"void main() {\n"
+	"    gl_FragDepth = gl_FragCoord.z;\n"
+	"    if (u_mode == 2) {\n"
+	"        vec3 dir = v_world - u_cam_position;\n"
+	"        vec3 o = (u_inverse_model * vec4(u_cam_position, 1.0)).xyz;\n"
+	"        vec3 d = (u_inverse_model * vec4(dir, 0.0)).xyz;\n"
+	"        float a = dot(d, d);\n"
+	"        float b = dot(o, d);\n"
+	"        float radicand = b * b - a * (dot(o, o) - 0.25);\n"
+	"        if (radicand < 0.0) {\n"
+	"            discard;\n"
+	"        }\n"
+	"        // a camera inside the sphere only sees its back, which camera rays skip\n"
+	"        float t = (-b - sqrt(radicand)) / a;\n"
+	"        if (t <= 0.0) {\n"
+	"            discard;\n"
+	"        }\n"
+	"        gl_FragDepth = (u_depth.x + u_depth.y / (t * dot(dir, u_cam_view))) * u_depth_window.x + u_depth_window.y;\n"
+	"    }\n"
+	"    id = ivec2(u_geom, u_mode == 0 ? gl_PrimitiveID : -1);\n"
+	"}\n";
+
+static GLuint program = 0;
+static GLuint tri_vao = 0;
+static GLuint shape_vao = 0;
+static GLuint tri_vbo = 0; // three vertices per tri of dev_tris, refilled before every draw
+static GLuint shape_vbo = 0; // the unit cube's 36 vertices, then the unit square plane's 6
+static GLuint fbo = 0;
+static GLuint id_texture = 0;
+static GLuint depth_buffer = 0;
+static cudaGraphicsResource_t tri_resource = NULL;
+static cudaGraphicsResource_t id_resource = NULL;
+static int tri_capacity = 0;
+static glm::ivec2 target_size = glm::ivec2(0);
+static bool reversed_z = false; // float depth of near / z with clip control, precise far from the camera
+
+static void attachVertices(GLuint vao, GLuint vbo) {
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindVertexArray(0);
+}
+
+bool rasterInit() {
+	if (!GLEW_VERSION_3_3) {
+		return false;
+	}
+	const char* attribLocations[] = { "Position" };
+	program = glslUtility::createProgramFromSource(visibilityVS, visibilityFS, attribLocations, 1);
+	if (program == 0) {
+		std::cout << "RASTER_PRIMARY: the visibility shaders didn't build, camera rays are traced" << std::endl;
+		return false;
+	}
+	reversed_z = GLEW_VERSION_4_5 || GLEW_ARB_clip_control;
+
+	// unit cube as 12 tris, both windings are drawn so the order doesn't matter
+	std::vector<glm::vec3> shapes;
+	for (int axis = 0; axis < 3; axis++) {
+		for (int side = -1; side <= 1; side += 2) {
+			glm::vec3 corners[4];
+			for (int c = 0; c < 4; c++) {
+				glm::vec3 p;
+				p[axis] = 0.5f * side;
+				p[(axis + 1) % 3] = (c == 1 || c == 2) ? 0.5f : -0.5f;
+				p[(axis + 2) % 3] = c >= 2 ? 0.5f : -0.5f;
+				corners[c] = p;
+			}
+			shapes.insert(shapes.end(), { corners[0], corners[1], corners[2], corners[0], corners[2], corners[3] });
+		}
+	}
+	// square plane at z = 0
+	shapes.insert(shapes.end(), {
+		glm::vec3(-0.5f, -0.5f, 0.0f), glm::vec3(0.5f, -0.5f, 0.0f), glm::vec3(0.5f, 0.5f, 0.0f),
+		glm::vec3(-0.5f, -0.5f, 0.0f), glm::vec3(0.5f, 0.5f, 0.0f), glm::vec3(-0.5f, 0.5f, 0.0f) });
+
+	glGenBuffers(1, &shape_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, shape_vbo);
+	glBufferData(GL_ARRAY_BUFFER, shapes.size() * sizeof(glm::vec3), shapes.data(), GL_STATIC_DRAW);
+	glGenBuffers(1, &tri_vbo);
+	glGenVertexArrays(1, &tri_vao);
+	glGenVertexArrays(1, &shape_vao);
+	attachVertices(shape_vao, shape_vbo);
+	attachVertices(tri_vao, tri_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return true;
+}
+
+static void freeTarget() {
+	if (id_resource != NULL) {
+		cudaGraphicsUnregisterResource(id_resource);
+		id_resource = NULL;
+	}
+	if (fbo != 0) {
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &id_texture);
+		glDeleteRenderbuffers(1, &depth_buffer);
+		fbo = 0;
+	}
+	target_size = glm::ivec2(0);
+}
+
+// id and depth attachments the size of the camera's image
+static void resizeTarget(glm::ivec2 size) {
+	if (size == target_size) {
+		return;
+	}
+	freeTarget();
+	glGenTextures(1, &id_texture);
+	glBindTexture(GL_TEXTURE_2D, id_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32I, size.x, size.y, 0, GL_RG_INTEGER, GL_INT, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenRenderbuffers(1, &depth_buffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, size.x, size.y);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, id_texture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_buffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	cudaGraphicsGLRegisterImage(&id_resource, id_texture, GL_TEXTURE_2D, cudaGraphicsRegisterFlagsReadOnly);
+	target_size = size;
+}
+
+// this frame's dev_tris, refits move them in place
+static void uploadTris(int num_tris) {
+	if (num_tris > tri_capacity) {
+		if (tri_resource != NULL) {
+			cudaGraphicsUnregisterResource(tri_resource);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, tri_vbo);
+		glBufferData(GL_ARRAY_BUFFER, 3 * num_tris * sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		cudaGraphicsGLRegisterBuffer(&tri_resource, tri_vbo, cudaGraphicsRegisterFlagsWriteDiscard);
+		tri_capacity = num_tris;
+	}
+	glm::vec3* positions = NULL;
+	size_t bytes = 0;
+	cudaGraphicsMapResources(1, &tri_resource);
+	cudaGraphicsResourceGetMappedPointer((void**)&positions, &bytes, tri_resource);
+	pathtraceCopyTriPositions(positions);
+	cudaGraphicsUnmapResources(1, &tri_resource);
+}
+
+static void setUniform(const char* name, glm::vec2 v) {
+	glUniform2f(glGetUniformLocation(program, name), v.x, v.y);
+}
+
+static void setUniform(const char* name, glm::vec3 v) {
+	glUniform3f(glGetUniformLocation(program, name), v.x, v.y, v.z);
+}
+
+static void setUniform(const char* name, const glm::mat4& m) {
+	glUniformMatrix4fv(glGetUniformLocation(program, name), 1, GL_FALSE, &m[0][0]);
+}
+
+static void setUniform(const char* name, int i) {
+	glUniform1i(glGetUniformLocation(program, name), i);
+}
+
+void rasterVisibility(const Scene* scene) {
+	glm::ivec2* target = program != 0 ? pathtraceVisibilityTarget() : NULL;
+	if (target == NULL) {
+		return;
+	}
+	const Camera& cam = scene->state.camera;
+	resizeTarget(cam.resolution);
+	if (scene->num_tris > 0) {
+		uploadTris(scene->num_tris);
+	}
+
+	GLint prev_program, prev_fbo, prev_vao, viewport[4];
+	glGetIntegerv(GL_CURRENT_PROGRAM, &prev_program);
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prev_fbo);
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &prev_vao);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, cam.resolution.x, cam.resolution.y);
+	glEnable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	const GLint no_hit[4] = { -1, -1, 0, 0 };
+	glClearBufferiv(GL_COLOR, 0, no_hit);
+	glm::vec2 depth, depth_window;
+	if (reversed_z) {
+		// window depth near / z, the far plane goes to infinity
+		glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+		glDepthFunc(GL_GREATER);
+		const GLfloat clear_depth = 0.0f;
+		glClearBufferfv(GL_DEPTH, 0, &clear_depth);
+		depth = glm::vec2(0.0f, RASTER_NEAR);
+		depth_window = glm::vec2(1.0f, 0.0f);
+	}
+	else {
+		glDepthFunc(GL_LESS);
+		const GLfloat clear_depth = 1.0f;
+		glClearBufferfv(GL_DEPTH, 0, &clear_depth);
+		depth = glm::vec2((RASTER_FAR + RASTER_NEAR) / (RASTER_FAR - RASTER_NEAR), -2.0f * RASTER_FAR * RASTER_NEAR / (RASTER_FAR - RASTER_NEAR));
+		depth_window = glm::vec2(0.5f, 0.5f);
+	}
+
+	glUseProgram(program);
+	setUniform("u_cam_position", cam.position);
+	setUniform("u_cam_right", cam.right / glm::dot(cam.right, cam.right));
+	setUniform("u_cam_up", cam.up / glm::dot(cam.up, cam.up));
+	setUniform("u_cam_view", cam.view / glm::dot(cam.view, cam.view));
+	setUniform("u_clip_scale", 2.0f / (glm::vec2(cam.resolution) * cam.pixelLength));
+	setUniform("u_inv_resolution", 1.0f / glm::vec2(cam.resolution));
+	setUniform("u_depth", depth);
+	setUniform("u_depth_window", depth_window);
+
+	// geoms in TLAS leaf order, the same indices dev_geoms has
+	for (int i = 0; i < (int)scene->geoms.size(); i++) {
+		const Geom& geom = scene->geoms[i];
+		if (!(scene->render_settings.geom_mask & (1 << geom.type))) {
+			continue;
+		}
+		if (geom.type == CURVES) {
+			// traced only, visibilityApplies leaves scenes with curves to camera rays
+			continue;
+		}
+		if (geom.type == VOLUME) {
+			// no surface to rasterize, the rasterized first hits don't see volumes
+			continue;
+		}
+		setUniform("u_geom", i);
+		setUniform("u_model", geom.transform);
+		if (geom.type == MESH) {
+			const BLAS& blas = scene->blases[geom.blas_ID];
+			if (blas.num_tris == 0) {
+				continue;
+			}
+			setUniform("u_mode", 0);
+			glBindVertexArray(tri_vao);
+			glDrawArrays(GL_TRIANGLES, 3 * blas.tri_offset, 3 * blas.num_tris);
+		}
+		else if (geom.type == SQUAREPLANE) {
+			setUniform("u_mode", 1);
+			glBindVertexArray(shape_vao);
+			glDrawArrays(GL_TRIANGLES, 36, 6);
+		}
+		else {
+			setUniform("u_mode", geom.type == SPHERE ? 2 : 1);
+			setUniform("u_inverse_model", geom.inverseTransform);
+			glBindVertexArray(shape_vao);
+			glDrawArrays(GL_TRIANGLES, 0, 36);
+		}
+	}
+
+	if (reversed_z) {
+		glClipControl(GL_LOWER_LEFT, GL_NEGATIVE_ONE_TO_ONE);
+	}
+	glDepthFunc(GL_LESS);
+	glDisable(GL_DEPTH_TEST);
+	glBindVertexArray(prev_vao);
+	glUseProgram(prev_program);
+	glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	// rows go up the image like pixel y, so the copy keeps the layout dev_image has
+	cudaArray_t ids = NULL;
+	cudaGraphicsMapResources(1, &id_resource);
+	cudaGraphicsSubResourceGetMappedArray(&ids, id_resource, 0, 0);
+	cudaMemcpy2DFromArray(target, cam.resolution.x * sizeof(glm::ivec2), ids, 0, 0, cam.resolution.x * sizeof(glm::ivec2),
+		cam.resolution.y, cudaMemcpyDeviceToDevice);
+	cudaGraphicsUnmapResources(1, &id_resource);
+	pathtraceVisibilityDrawn();
+}
+
+void rasterFree() {
+	freeTarget();
+	if (tri_resource != NULL) {
+		cudaGraphicsUnregisterResource(tri_resource);
+		tri_resource = NULL;
+	}
+	if (program != 0) {
+		glDeleteBuffers(1, &tri_vbo);
+		glDeleteBuffers(1, &shape_vbo);
+		glDeleteVertexArrays(1, &tri_vao);
+		glDeleteVertexArrays(1, &shape_vao);
+		glDeleteProgram(program);
+		program = 0;
+	}
+	tri_capacity = 0;
+}
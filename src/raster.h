@@ -0,0 +1,9 @@
+#pragma once
+
+class Scene;
+
+// RASTER_PRIMARY, rasterizes the geom and tri under every pixel corner of the scene's camera
+// into pathtraceVisibilityTarget when there is one. everything runs in the window's GL context
+bool rasterInit(); // false when the context is older than GL 3.3, RASTER_PRIMARY then traces as usual
+void rasterVisibility(const Scene* scene);
+void rasterFree();
@@ -0,0 +1,308 @@
+#include "remote.h"
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include "jpeg.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+typedef WSAPOLLFD pollfd_t;
+#define closeSocket closesocket
+#define pollSockets WSAPoll
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+typedef int socket_t;
+typedef pollfd pollfd_t;
+#define closeSocket close
+#define pollSockets ::poll
+#endif
+
+// most a request may send before the blank line that ends its headers, a longer one is dropped
+#define MAX_REQUEST_BYTES 65536
+// connections open at once, streams included. one past it is closed as soon as it's accepted
+#define MAX_REMOTE_CLIENTS 32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // a closed connection's SIGPIPE is ignored in listen instead
+#endif
+
+// the viewer, mouse buttons as in the window: left orbits, middle pans, right zooms. moves are
+// added up and sent a few dozen times a second rather than per mouse event
+static const char* PAGE =
+    "<!doctype html><html><head><title>CIS565 Path Tracer</title>"
+    "<style>body{margin:0;background:#222}img{display:block;margin:auto;user-select:none}</style></head><body>"
+    "<img id=\"view\" src=\"/stream\" draggable=\"false\">"
+    "<script>"
+    "var view=document.getElementById('view'),button=-1,x=0,y=0,dx=0,dy=0;"
+    "view.onmousedown=function(e){button=e.button;x=e.clientX;y=e.clientY;e.preventDefault();};"
+    "window.onmouseup=function(){button=-1;};"
+    "view.oncontextmenu=function(e){e.preventDefault();};"
+    "window.onmousemove=function(e){if(button<0)return;dx+=e.clientX-x;dy+=e.clientY-y;x=e.clientX;y=e.clientY;};"
+    "setInterval(function(){if(dx==0&&dy==0)return;"
+    "fetch('/camera?'+['orbit','pan','zoom'][button]+'&dx='+dx+'&dy='+dy);dx=0;dy=0;},30);"
+    "window.onkeydown=function(e){var a={' ':'reset','s':'save','q':'quit'}[e.key];if(a)fetch('/camera?'+a);};"
+    "</script></body></html>";
+
+static void setNonBlocking(socket_t socket) {
+#ifdef _WIN32
+    u_long on = 1;
+    ioctlsocket(socket, FIONBIO, &on);
+#else
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+static bool wouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static std::string response(const char* status, const char* type, const std::string& body) {
+    return std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + type + "\r\nContent-Length: " + std::to_string(body.size())
+        + "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n" + body;
+}
+
+RemoteServer::RemoteServer() : listener(-1) {}
+
+RemoteServer::~RemoteServer() {
+    for (const Client& client : clients) {
+        closeSocket((socket_t)client.socket);
+    }
+    if (listener != -1) {
+        closeSocket((socket_t)listener);
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+bool RemoteServer::listen(int port, const std::string& bind_address, std::string& error) {
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    socket_t socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == (socket_t)-1) {
+        error = "can't open a socket";
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, bind_address.c_str(), &address.sin_addr) != 1) {
+        error = "can't bind to " + bind_address + ", it isn't an IPv4 address";
+        closeSocket(socket);
+        return false;
+    }
+    if (bind(socket, (const sockaddr*)&address, sizeof(address)) != 0 || ::listen(socket, 8) != 0) {
+        error = "can't listen on " + bind_address + ":" + std::to_string(port);
+        closeSocket(socket);
+        return false;
+    }
+    setNonBlocking(socket);
+    listener = (long long)socket;
+    return true;
+}
+
+bool RemoteServer::streaming() const {
+    for (const Client& client : clients) {
+        if (client.stream) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RemoteServer::answer(Client& client, std::vector<RemoteCommand>& commands) {
+    // just the request line, GET PATH HTTP/1.1
+    size_t start = client.request.find(' ');
+    size_t end = start == std::string::npos ? std::string::npos : client.request.find(' ', start + 1);
+    std::string path = end == std::string::npos ? "" : client.request.substr(start + 1, end - start - 1);
+    client.request.clear();
+
+    std::string status = "200 OK", type = "text/plain", body;
+    if (path != "/stream" && handler && handler(path, status, type, body)) {
+        client.pending = response(status.c_str(), type.c_str(), body);
+    }
+    else if (path == "/") {
+        client.pending = response("200 OK", "text/html", PAGE);
+    }
+    else if (path == "/stream") {
+        client.pending = "HTTP/1.1 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+            "Cache-Control: no-cache\r\nConnection: close\r\n\r\n";
+        client.stream = true;
+    }
+    else if (path.compare(0, 8, "/camera?") == 0) {
+        RemoteCommand command;
+        std::string query = path.substr(8);
+        size_t amp = query.find('&');
+        command.action = query.substr(0, amp);
+        while (amp != std::string::npos) {
+            size_t next = query.find('&', amp + 1);
+            std::string param = query.substr(amp + 1, next == std::string::npos ? std::string::npos : next - amp - 1);
+            if (param.compare(0, 3, "dx=") == 0) {
+                command.dx = (float)atof(param.c_str() + 3);
+            }
+            else if (param.compare(0, 3, "dy=") == 0) {
+                command.dy = (float)atof(param.c_str() + 3);
+            }
+            amp = next;
+        }
+        commands.push_back(command);
+        client.pending = "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n";
+    }
+    else {
+        client.pending = response("404 Not Found", "text/plain", "not found");
+    }
+}
+
+bool RemoteServer::flush(Client& client) {
+    while (client.sent < client.pending.size()) {
+        int sent = (int)send((socket_t)client.socket, client.pending.data() + client.sent, (int)(client.pending.size() - client.sent), MSG_NOSIGNAL);
+        if (sent < 0) {
+            return wouldBlock();
+        }
+        client.sent += sent;
+    }
+    client.pending.clear();
+    client.sent = 0;
+    return true;
+}
+
+void RemoteServer::poll(int timeout_ms, std::vector<RemoteCommand>& commands) {
+    if (listener == -1) {
+        return;
+    }
+    // poll rather than select, whose fd_set can't hold a descriptor past FD_SETSIZE
+    std::vector<pollfd_t> sockets(clients.size() + 1);
+    sockets[0].fd = (socket_t)listener;
+    sockets[0].events = POLLIN;
+    for (size_t i = 0; i < clients.size(); i++) {
+        sockets[i + 1].fd = (socket_t)clients[i].socket;
+        sockets[i + 1].events = (short)(POLLIN | (clients[i].pending.empty() ? 0 : POLLOUT));
+    }
+    if (pollSockets(sockets.data(), sockets.size(), timeout_ms) <= 0) {
+        return;
+    }
+
+    if (sockets[0].revents & POLLIN) {
+        socket_t accepted;
+        while ((accepted = accept((socket_t)listener, NULL, NULL)) != (socket_t)-1) {
+            if (clients.size() >= MAX_REMOTE_CLIENTS) {
+                closeSocket(accepted);
+                continue;
+            }
+            setNonBlocking(accepted);
+            Client client;
+            client.socket = (long long)accepted;
+            clients.push_back(client);
+        }
+    }
+
+    // slot follows the clients polled, the ones just accepted are past the end of sockets
+    for (int i = 0, slot = 1; i < (int)clients.size(); i++, slot++) {
+        Client& client = clients[i];
+        bool open = true;
+        // a hung up or failed connection reads as 0 or an error, which closes it
+        if (slot < (int)sockets.size() && (sockets[slot].revents & (POLLIN | POLLHUP | POLLERR))) {
+            char buffer[2048];
+            int received = (int)recv((socket_t)client.socket, buffer, sizeof(buffer), 0);
+            if (received > 0) {
+                // a stream's browser sends nothing more, anything it does is ignored
+                if (!client.stream) {
+                    client.request.append(buffer, received);
+                    if (client.request.find("\r\n\r\n") != std::string::npos) {
+                        answer(client, commands);
+                    }
+                    else if (client.request.size() > MAX_REQUEST_BYTES) {
+                        open = false;
+                    }
+                }
+            }
+            else if (received == 0 || !wouldBlock()) {
+                open = false;
+            }
+        }
+        if (open && !client.pending.empty()) {
+            // everything but the stream closes once its response is out
+            open = flush(client) && (client.stream || !client.pending.empty());
+        }
+        if (!open) {
+            closeSocket((socket_t)client.socket);
+            clients.erase(clients.begin() + i);
+            i--;
+        }
+    }
+}
+
+void RemoteServer::sendFrame(const std::vector<unsigned char>& jpeg) {
+    for (int i = 0; i < (int)clients.size(); i++) {
+        Client& client = clients[i];
+        if (!client.stream || !client.pending.empty()) {
+            continue;
+        }
+        client.pending = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(jpeg.size()) + "\r\n\r\n";
+        client.pending.append((const char*)jpeg.data(), jpeg.size());
+        client.pending += "\r\n";
+        if (!flush(client)) {
+            closeSocket((socket_t)client.socket);
+            clients.erase(clients.begin() + i);
+            i--;
+        }
+    }
+}
+
+std::string queryValue(const std::string& path, const char* name) {
+    const size_t length = strlen(name);
+    size_t start = path.find('?');
+    while (start != std::string::npos) {
+        start++;
+        size_t end = path.find('&', start);
+        if (path.compare(start, length, name) == 0 && start + length < path.size() && path[start + length] == '=') {
+            std::string value;
+            for (size_t i = start + length + 1; i < path.size() && i != end; i++) {
+                if (path[i] == '%' && i + 2 < path.size()) {
+                    value += (char)strtol(path.substr(i + 1, 2).c_str(), NULL, 16);
+                    i += 2;
+                }
+                else {
+                    value += path[i] == '+' ? ' ' : path[i];
+                }
+            }
+            return value;
+        }
+        start = end;
+    }
+    return "";
+}
+
+void encodeFrame(const std::vector<uchar4>& pixels, int width, int height, int quality, std::vector<unsigned char>& jpeg) {
+    std::vector<unsigned char> rgb((size_t)width * height * 3);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const uchar4& pix = pixels[x + y * width];
+            unsigned char* out = &rgb[((size_t)y * width + width - 1 - x) * 3];
+            out[0] = pix.x;
+            out[1] = pix.y;
+            out[2] = pix.z;
+        }
+    }
+    encodeJPEG(rgb.data(), width, height, quality, jpeg);
+}
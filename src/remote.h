@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cuda_runtime.h>
+
+// --serve, a small HTTP server a browser views a render through. GET / is a page showing the
+// image with the window's mouse controls, /stream a motion JPEG (multipart/x-mixed-replace) of
+// the frames sent and /camera?ACTION&dx=X&dy=Y the control requests the page makes
+
+struct RemoteCommand {
+    std::string action; // orbit, pan and zoom by dx / dy window pixels, reset, save or quit
+    float dx = 0.0f;
+    float dy = 0.0f;
+};
+
+class RemoteServer {
+public:
+    RemoteServer();
+    ~RemoteServer();
+
+    // bind_address is an IPv4 address like 127.0.0.1 (only this host) or 0.0.0.0 (every interface)
+    bool listen(int port, const std::string& bind_address, std::string& error);
+    // answers the paths other than /stream before the server's own routes do: true once it set
+    // the response (status starts as 200 OK, type as text/plain), false to leave the path to them
+    std::function<bool(const std::string& path, std::string& status, std::string& type, std::string& body)> handler;
+    // accepts connections, answers their requests and sends what's left of queued frames,
+    // waiting at most timeout_ms for any of it. the camera requests are appended to commands
+    void poll(int timeout_ms, std::vector<RemoteCommand>& commands);
+    bool streaming() const; // a browser has the stream open
+    // queues a frame for every stream that sent the last one completely. a slow connection skips
+    // frames instead of falling behind, so what it shows is never more than a frame old
+    void sendFrame(const std::vector<unsigned char>& jpeg);
+
+private:
+    struct Client {
+        long long socket;
+        std::string request; // read so far, until the blank line that ends the headers
+        std::string pending; // the response or frame being sent
+        size_t sent = 0; // of pending
+        bool stream = false;
+    };
+
+    void answer(Client& client, std::vector<RemoteCommand>& commands);
+    bool flush(Client& client); // false once the connection is gone
+
+    long long listener;
+    std::vector<Client> clients;
+};
+
+// the %XX and + decoded value of name=VALUE in a request path's query, empty without one
+std::string queryValue(const std::string& path, const char* name);
+
+// display colors (row major, flipped left to right like dev_image) as a JPEG oriented the way
+// saved images are
+void encodeFrame(const std::vector<uchar4>& pixels, int width, int height, int quality, std::vector<unsigned char>& jpeg);
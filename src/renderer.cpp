@@ -0,0 +1,163 @@
+#include "renderer.h"
+#include <cstring>
+#include <stdexcept>
+#include "scene.h"
+
+Renderer::Renderer() : scene(NULL), iterations(0) {}
+
+Renderer::~Renderer() {
+    unload();
+}
+
+bool Renderer::load(const std::string& filename, const std::vector<std::string>& setting_overrides, std::string& error) {
+    Scene* next;
+    try {
+        next = new Scene(filename, setting_overrides);
+    }
+    catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+    unload();
+    scene = next;
+    pathtraceInit(scene);
+    return true;
+}
+
+void Renderer::unload() {
+    if (scene == NULL) {
+        return;
+    }
+    pathtraceFree();
+    delete scene;
+    scene = NULL;
+    iterations = 0;
+}
+
+const Camera& Renderer::camera() const {
+    return scene->state.camera;
+}
+
+void Renderer::setCamera(const glm::vec3& eye, const glm::vec3& lookat, const glm::vec3& up) {
+    Camera& cam = scene->state.camera;
+    cam.position = eye;
+    cam.lookAt = lookat;
+    cam.up = up;
+    Scene::updateCameraBasis(cam);
+    restart();
+}
+
+RenderSettings& Renderer::settings() {
+    return scene->render_settings;
+}
+
+void Renderer::render(int samples) {
+    for (int i = 0; i < samples; i++) {
+        iterations++;
+        pathtrace(DisplayTarget(), 0, iterations);
+    }
+}
+
+void Renderer::restart() {
+    pathtraceResetImage();
+    iterations = 0;
+}
+
+const glm::vec3* Renderer::deviceImage() const {
+    return (const glm::vec3*)pathtraceDeviceBuffer(BUFFER_IMAGE);
+}
+
+void Renderer::readImage(std::vector<glm::vec3>& averaged) const {
+    pathtraceRetrieveImage();
+    averaged = scene->state.image;
+    for (glm::vec3& pix : averaged) {
+        pix /= (float)glm::max(iterations, 1);
+    }
+}
+
+void Renderer::readDisplayImage(std::vector<uchar4>& pixels) const {
+    pathtraceRetrieveLDRImage(iterations, pixels);
+}
+
+// a DLManagedTensor and the shape and strides it points at, freed together by its deleter
+struct ExportedTensor {
+    DLManagedTensor managed;
+    int64_t shape[3];
+    int64_t strides[3];
+};
+
+static void deleteExportedTensor(DLManagedTensor* self) {
+    delete (ExportedTensor*)self->manager_ctx;
+}
+
+DLManagedTensor* Renderer::exportBuffer(DeviceBuffer buffer) const {
+    void* data = (void*)pathtraceDeviceBuffer(buffer);
+    if (data == NULL) {
+        return NULL;
+    }
+    const glm::ivec2 resolution = scene->state.camera.resolution;
+    const bool counts = buffer == BUFFER_SAMPLE_COUNTS;
+    ExportedTensor* exported = new ExportedTensor();
+    exported->shape[0] = resolution.y;
+    exported->shape[1] = resolution.x;
+    exported->shape[2] = 3;
+    exported->strides[0] = (int64_t)resolution.x * (counts ? 1 : 3);
+    exported->strides[1] = counts ? 1 : 3;
+    exported->strides[2] = 1;
+
+    DLTensor& tensor = exported->managed.dl_tensor;
+    tensor.data = data;
+    tensor.device.device_type = kDLCUDA;
+    tensor.device.device_id = 0; // pathtraceDeviceBuffer's first device
+    tensor.ndim = counts ? 2 : 3;
+    tensor.dtype.code = counts ? kDLInt : kDLFloat;
+    tensor.dtype.bits = 32;
+    tensor.dtype.lanes = 1;
+    tensor.shape = exported->shape;
+    tensor.strides = exported->strides;
+    tensor.byte_offset = 0;
+    exported->managed.manager_ctx = exported;
+    exported->managed.deleter = deleteExportedTensor;
+    return &exported->managed;
+}
+
+Renderer* rendererCreate() {
+    return new Renderer();
+}
+
+void rendererDestroy(Renderer* renderer) {
+    delete renderer;
+}
+
+int rendererLoad(Renderer* renderer, const char* filename, const char* const* overrides, int num_overrides, char* error, int error_size) {
+    std::string message;
+    if (renderer->load(filename, std::vector<std::string>(overrides, overrides + num_overrides), message)) {
+        return 1;
+    }
+    if (error != NULL && error_size > 0) {
+        strncpy(error, message.c_str(), error_size - 1);
+        error[error_size - 1] = '\0';
+    }
+    return 0;
+}
+
+void rendererSetCamera(Renderer* renderer, const float* eye, const float* lookat, const float* up) {
+    renderer->setCamera(glm::vec3(eye[0], eye[1], eye[2]), glm::vec3(lookat[0], lookat[1], lookat[2]),
+        up != NULL ? glm::vec3(up[0], up[1], up[2]) : glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+void rendererRender(Renderer* renderer, int samples) {
+    renderer->render(samples);
+}
+
+int rendererSamples(const Renderer* renderer) {
+    return renderer->samples();
+}
+
+void rendererRestart(Renderer* renderer) {
+    renderer->restart();
+}
+
+DLManagedTensor* rendererExportBuffer(const Renderer* renderer, int buffer) {
+    return renderer->exportBuffer((DeviceBuffer)buffer);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+#include "pathtrace.h"
+#include "dlpack.h"
+
+// the path tracer without the window, for programs that link cis565_renderer and render in
+// process instead of running the executable and reading its image files back. the renderer's
+// state is per thread (see pathtrace.cu), so a Renderer is used from the thread that loaded it,
+// and a thread has one loaded at a time. other threads can each have their own
+class Renderer {
+public:
+    Renderer();
+    ~Renderer();
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    // parses the scene file with its SETTINGS overridden by setting_overrides (KEY=VALUE), builds
+    // the BVHs and uploads it. false with error set if it doesn't load, the current scene stays then
+    bool load(const std::string& filename, const std::vector<std::string>& setting_overrides, std::string& error);
+    void unload(); // frees the scene and the device buffers
+    bool loaded() const { return scene != NULL; }
+
+    const Camera& camera() const;
+    // moves the camera and restarts the image, the resolution stays as loaded
+    void setCamera(const glm::vec3& eye, const glm::vec3& lookat, const glm::vec3& up = glm::vec3(0.0f, 1.0f, 0.0f));
+    RenderSettings& settings(); // edits apply from the next render, ones that change buffers need a load
+
+    void render(int samples); // traces samples more iterations into the image
+    int samples() const { return iterations; }
+    void restart(); // drops the accumulated samples
+
+    // the accumulated sums on the device, resolution.x * resolution.y of them, row major and
+    // flipped left to right. divide by samples() for the image. the pointer stays valid until the
+    // next load or unload. only the first device's iterations with NUM_GPUS, see readImage
+    const glm::vec3* deviceImage() const;
+    void readImage(std::vector<glm::vec3>& averaged) const; // the average of every device's samples
+    void readDisplayImage(std::vector<uchar4>& pixels) const; // tonemapped 8 bit colors, as saved pngs have them
+    // buffer as a DLPack tensor over the device memory itself, no copy: height x width x 3 float32
+    // sums, or height x width int32 for the sample counts, flipped left to right like deviceImage.
+    // NULL when the scene's settings don't keep the buffer. the consumer's deleter frees the
+    // tensor, not the buffer, which the next render, load or unload writes or frees
+    DLManagedTensor* exportBuffer(DeviceBuffer buffer) const;
+
+private:
+    Scene* scene;
+    int iterations;
+};
+
+// the same as plain C functions, for the Python bindings (python/cis565_renderer.py) and other
+// FFIs. load returns 0 with error filled in (at most error_size bytes) when the scene doesn't load
+extern "C" {
+Renderer* rendererCreate();
+void rendererDestroy(Renderer* renderer);
+int rendererLoad(Renderer* renderer, const char* filename, const char* const* overrides, int num_overrides, char* error, int error_size);
+void rendererSetCamera(Renderer* renderer, const float* eye, const float* lookat, const float* up);
+void rendererRender(Renderer* renderer, int samples);
+int rendererSamples(const Renderer* renderer);
+void rendererRestart(Renderer* renderer);
+DLManagedTensor* rendererExportBuffer(const Renderer* renderer, int buffer);
+}
@@ -1,25 +1,87 @@
 #include <iostream>
 #include "scene.h"
 #include <cstring>
+#include <cstdio>
 #include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include "tiny_obj_loader.h"
+#include "ply.h"
+#include "hair.h"
+#include "volume.h"
+#include "tessellate.h"
+#include "profiling.h"
 #include <stack>
+#include <random>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <tuple>
+#include <set>
+#include <cfloat>
+#include <climits>
+#include <stdexcept>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <stb_image.h>
 
-Scene::Scene(string filename) {
+// SAH costs in units of one triangle test. PBRT uses 1/8 for a traversal step, but on the
+// GPU a node fetch and slab test cost about as much as a tri test, so leaves fill up more
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECT_COST 1.0f
+#define MAX_SAH_BINS 256
+
+// most LODS a mesh may ask for, each level halves the detail of the one before
+#define MAX_MESH_LODS 8
+
+struct SAHBin {
+    glm::vec3 AABB_min;
+    glm::vec3 AABB_max;
+    int count;
+};
+
+static float surfaceArea(const glm::vec3& AABB_min, const glm::vec3& AABB_max) {
+    glm::vec3 d = AABB_max - AABB_min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// BVH_PROGRESSIVE holds back a host build for the renderer to run later, so there has to be one
+// worth waiting for (cached trees load whole) and a host mesh left to run it over
+static bool progressiveApplies(const BVHSettings& bvh_settings, const RenderSettings& render_settings) {
+    if (!bvh_settings.progressive) {
+        return false;
+    }
+    if (bvh_settings.builder == BVH_LBVH || bvh_settings.builder == BVH_MIDPOINT) {
+        cout << "BVH_PROGRESSIVE is ignored with BVH_BUILDER LBVH and MIDPOINT" << endl;
+        return false;
+    }
+    if (bvh_settings.cache || render_settings.free_host_geometry || render_settings.shard_geometry) {
+        cout << "BVH_PROGRESSIVE is ignored with BVH_CACHE, FREE_HOST_GEOMETRY and SHARD_GEOMETRY" << endl;
+        return false;
+    }
+    return true;
+}
+
+Scene::Scene(string filename, const vector<string>& setting_overrides, bool allow_mesh_proxies, bool parse_only) : parse_only(parse_only) {
+    ProfileRange range("load scene");
+    PhaseTimer phase(PHASE_SCENE_FILE);
     cout << "Reading scene from " << filename << " ..." << endl;
     cout << " " << endl;
-    char* fname = (char*)filename.c_str();
-    fp_in.open(fname);
-    if (!fp_in.is_open()) {
-        cout << "Error reading from file - aborting!" << endl;
-        throw;
+    if (!fp_in.open(filename)) {
+        throw std::runtime_error("Cannot open scene file [" + filename + "]");
     }
+    // generated scenes can hold a lot of objects, size the vectors once up front
+    geoms.reserve(fp_in.countLines("OBJECT"));
+    materials.reserve(fp_in.countLines("MATERIAL"));
+    string line;
     while (fp_in.good()) {
-        string line;
-        utilityCore::safeGetline(fp_in, line);
+        fp_in.getline(line);
         if (!line.empty()) {
-            vector<string> tokens = utilityCore::tokenizeString(line);
+            const vector<string>& tokens = fp_in.tokenize(line);
             if (strcmp(tokens[0].c_str(), "MATERIAL") == 0) {
                 loadMaterial(tokens[1]);
                 cout << " " << endl;
@@ -28,19 +90,75 @@ Scene::Scene(string filename) {
                 loadGeom(tokens[1]);
                 cout << " " << endl;
             }
+            else if (strcmp(tokens[0].c_str(), "SCATTER") == 0) {
+                loadScatter(tokens[1]);
+                cout << " " << endl;
+            }
             else if (strcmp(tokens[0].c_str(), "CAMERA") == 0) {
                 loadCamera();
                 cout << " " << endl;
             }
+            else if (strcmp(tokens[0].c_str(), "ENVIRONMENT") == 0) {
+                loadEnvironment();
+                cout << " " << endl;
+            }
+            else if (strcmp(tokens[0].c_str(), "SETTINGS") == 0) {
+                loadSettings();
+                cout << " " << endl;
+            }
         }
     }
 
-    if (mesh_tris.size() > 0) {
-        root_node = buildBVH(0, mesh_tris.size());
+    // scattered copies go after every OBJECT, so OBJECT ids stay the geom indices
+    for (const Geom& copy : scattered_geoms) {
+        geoms.push_back(copy);
+        if (copy.type != MESH && copy.type != CURVES && copy.type != VOLUME && !copy.moving && materials[copy.materialid].emittance > 0.0f) {
+            Light newLight;
+            newLight.geom_ID = geoms.size() - 1;
+            newLight.is_tri = false;
+            lights.push_back(newLight);
+        }
+    }
+    utilityCore::freeVector(scattered_geoms);
 
-        reformatBVHToGPU();
+    // command line overrides come in as KEY=VALUE[,VALUE...] and win over the scene file
+    for (const string& setting : setting_overrides) {
+        string line = setting;
+        std::replace(line.begin(), line.end(), '=', ' ');
+        std::replace(line.begin(), line.end(), ',', ' ');
+        const vector<string>& tokens = fp_in.tokenize(line);
+        if (tokens.size() < 2 || !applySetting(tokens)) {
+            cout << "WARNING: ignoring unknown setting override " << setting << endl;
+        }
+    }
+    if (parse_only) {
+        return;
+    }
 
-        std::cout << "num nodes: " << num_nodes << std::endl;
+    if (allow_mesh_proxies && render_settings.stream_meshes && !mesh_sources.empty()) {
+        makeMeshProxies();
+    }
+    else {
+        loadMeshes();
+        buildMeshLODs();
+        lbvh_until_swap = num_tris > 0 && progressiveApplies(bvh_settings, render_settings);
+        buildBLASes();
+        if (bvh_settings.cache) {
+            writeMeshCaches();
+        }
+    }
+    loadCurves();
+    loadVolumes();
+    if (!wide_bvh_nodes_gpu.empty()) {
+        // only the collapsed nodes get uploaded
+        utilityCore::freeVector(bvh_nodes_gpu);
+    }
+    buildTLAS();
+    placeVolumes();
+    gatherMeshLights();
+    buildLightTable();
+    if (render_settings.bake_object >= 0 && !mesh_proxies) {
+        buildBakeTexels();
     }
 
     /*for (int i = 0; i < num_nodes; ++i) {
@@ -50,12 +168,35 @@ Scene::Scene(string filename) {
         std::cout << "   num_tris: " << bvh_nodes_gpu[i].num_tris << std::endl;
         std::cout << "   tri_index: " << bvh_nodes_gpu[i].tri_index << std::endl;
         std::cout << "   offset_to_second_child: " << bvh_nodes_gpu[i].offset_to_second_child << std::endl;
-        std::cout << "   split_axis: " << bvh_nodes_gpu[i].axis << std::endl;
+        std::cout << "   split_axis: " << BVH_SPLIT_AXIS(bvh_nodes_gpu[i]) << std::endl;
     }*/
 
 
 }
 
+// everything the scene holds is in its own vectors
+Scene::~Scene() {
+}
+
+// an empty BLAS for source, its tris are read in loadMeshes once every setting (BVH_CACHE) is known
+int Scene::addBLAS(const MeshSource& source) {
+    BLAS newBLAS;
+    newBLAS.tri_offset = 0;
+    newBLAS.num_tris = 0;
+    newBLAS.num_nodes = 0;
+    newBLAS.node_offset = 0;
+    newBLAS.wide_node_offset = -1;
+    newBLAS.top_slot = -1;
+    newBLAS.grid_origin = glm::vec3(0.0f);
+    newBLAS.grid_step = glm::vec3(0.0f);
+    newBLAS.lod_next = -1;
+    newBLAS.lod_spacing = 0.0f;
+    blas_IDs[source.path] = blases.size();
+    blases.push_back(newBLAS);
+    mesh_sources.push_back(source);
+    return blases.size() - 1;
+}
+
 int Scene::loadGeom(string objectid) {
     int id = atoi(objectid.c_str());
     if (id != num_geoms) {
@@ -63,156 +204,121 @@ int Scene::loadGeom(string objectid) {
         return -1;
     } else {
         num_geoms++;
-        cout << "Loading Geom " << id << "..." << endl;
+        cout << "Loading Geom " << id << "..." << "\n";
         Geom newGeom;
         string line;
+        string gltf_path;
+        std::map<int, int> gltf_materials; // GLTF_MATERIAL lines, glTF material -> scene material
+        MeshSource mesh_options; // SUBDIV / DISPLACE / LODS lines
+        VolumeMedium medium_options; // DENSITY / ANISOTROPY lines
+        glm::vec3 end_translation, end_rotation, end_scale; // TRANS_END / ROTAT_END / SCALE_END lines, the open key's by default
+        bool end_trs[3] = { false, false, false };
+        bool new_blas = false;
 
         //load object type
-        utilityCore::safeGetline(fp_in, line);
+        fp_in.getline(line);
         if (!line.empty() && fp_in.good()) {
             if (strcmp(line.c_str(), "sphere") == 0) {
-                cout << "Creating new sphere..." << endl;
+                cout << "Creating new sphere..." << "\n";
                 newGeom.type = SPHERE;
             } else if (strcmp(line.c_str(), "cube") == 0) {
-                cout << "Creating new cube..." << endl;
+                cout << "Creating new cube..." << "\n";
                 newGeom.type = CUBE;
             }
             else if (strcmp(line.c_str(), "squareplane") == 0) {
-                cout << "Creating new squareplane..." << endl;
+                cout << "Creating new squareplane..." << "\n";
                 newGeom.type = SQUAREPLANE;
             }
             else if (strcmp(line.c_str(), "mesh") == 0) {
-                std::cout << "Creating new mesh..." << std::endl;
+                std::cout << "Creating new mesh..." << "\n";
                 newGeom.type = MESH;
             }
+            else if (strcmp(line.c_str(), "curves") == 0) {
+                std::cout << "Creating new curves..." << "\n";
+                newGeom.type = CURVES;
+            }
+            else if (strcmp(line.c_str(), "volume") == 0) {
+                std::cout << "Creating new volume..." << "\n";
+                newGeom.type = VOLUME;
+            }
         }
 
-        std::cout << num_tris << std::endl;
-        int starting_tri_size = num_tris;
-
         if (newGeom.type == MESH) {
 
-            utilityCore::safeGetline(fp_in, line);
+            fp_in.getline(line);
+            if (!line.empty() && fp_in.good() && isGLTFPath(line)) {
+                // its BLASes and instances are made once the transform block is read
+                gltf_path = line;
+                if (!gltf_assets.count(line)) {
+                    std::string error;
+                    if (!loadGLTF(line, gltf_assets[line], error)) {
+                        throw std::runtime_error(error);
+                    }
+                    const GLTFAsset& asset = gltf_assets[line];
+                    std::cout << "Read " << line << ": " << asset.meshes.size() << " meshes, " << asset.instances.size() << " instances" << "\n";
+                    if (asset.skipped_primitives > 0) {
+                        std::cout << "WARNING: skipped " << asset.skipped_primitives << " primitives of " << line << " that aren't plain triangles" << "\n";
+                    }
+                }
+            }
+            else if (!line.empty() && fp_in.good() && blas_IDs.count(line)) {
+                // already loaded, this geom is another instance of the same BLAS
+                newGeom.blas_ID = blas_IDs[line];
+                std::cout << "Instancing " << line << " (BLAS " << newGeom.blas_ID << ")" << "\n";
+            }
+            else if (!line.empty() && fp_in.good()) {
+                // the obj itself is read in loadMeshes, once every setting (BVH_CACHE) is known
+                MeshSource source;
+                source.path = line;
+                newGeom.blas_ID = addBLAS(source);
+                new_blas = true;
+            }
+        }
+        else if (newGeom.type == CURVES) {
+            // the strands are read in loadCurves, a repeated path instances them
+            fp_in.getline(line);
             if (!line.empty() && fp_in.good()) {
-                tinyobj::attrib_t attrib;
-                std::vector<tinyobj::shape_t> shapes;
-                std::vector<tinyobj::material_t> materials;
-                std::string warn, err;
-
-                if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, line.c_str())) {
-                    throw std::runtime_error(warn + err);
+                if (!curve_IDs.count(line)) {
+                    curve_IDs[line] = curve_sets.size();
+                    curve_sets.push_back(CurveSet());
+                    curve_sources.push_back(line);
                 }
-
-                // every mesh in the obj
-                for (const tinyobj::shape_t& shape : shapes) {
-
-
-
-                    // every tri in the mesh
-                    for (int i = 0; i < shape.mesh.indices.size(); i += 3) {
-                        Tri newTri;
-
-                        
-
-                        glm::vec3 newP = glm::vec3(0.0f);
-                        glm::vec3 newN = glm::vec3(0.0f);
-                        glm::vec2 newT = glm::vec2(0.0f);
-
-                        for (int k = 0; k < 3; ++k) {
-
-                            if (shape.mesh.indices[i + k].vertex_index != -1) {
-                                newP = glm::vec3(attrib.vertices[3 * shape.mesh.indices[i + k].vertex_index + 0],
-                                    attrib.vertices[3 * shape.mesh.indices[i + k].vertex_index + 1],
-                                    attrib.vertices[3 * shape.mesh.indices[i + k].vertex_index + 2]);
-                            }
-
-                            if (shape.mesh.indices[i + k].texcoord_index != -1) {
-                                newT = glm::vec2(
-                                    attrib.texcoords[2 * shape.mesh.indices[i + k].texcoord_index + 0],
-                                    1.0f - attrib.texcoords[2 * shape.mesh.indices[i + k].texcoord_index + 1]
-                                );
-                            }
-
-                            if (shape.mesh.indices[i + k].normal_index != -1) {
-                                newN = glm::vec3(
-                                    attrib.normals[3 * shape.mesh.indices[i + k].normal_index + 0],
-                                    attrib.normals[3 * shape.mesh.indices[i + k].normal_index + 1],
-                                    attrib.normals[3 * shape.mesh.indices[i + k].normal_index + 2]
-                                );
-                            }
-
-                            if (k == 0) {
-                                newTri.p0 = newP;
-                                newTri.n0 = newN;
-                                newTri.t0 = newT;
-                            }
-                            else if (k == 1) {
-                                newTri.p1 = newP;
-                                newTri.n1 = newN;
-                                newTri.t1 = newT;
-                            }
-                            else {
-                                newTri.p2 = newP;
-                                newTri.n2 = newN;
-                                newTri.t2 = newT;
-                            }
-                        }
-
-
-                        newTri.plane_normal = glm::normalize(glm::cross(newTri.p1 - newTri.p0, newTri.p2 - newTri.p1));
-                        newTri.S = glm::length(glm::cross(newTri.p1 - newTri.p0, newTri.p2 - newTri.p1));
-
-                        TriBounds newTriBounds;
-
-                        newTriBounds.tri_ID = num_tris;
-                        
-
-                        float max_x = glm::max(glm::max(newTri.p0.x, newTri.p1.x), newTri.p2.x);
-                        float max_y = glm::max(glm::max(newTri.p0.y, newTri.p1.y), newTri.p2.y);
-                        float max_z = glm::max(glm::max(newTri.p0.z, newTri.p1.z), newTri.p2.z);
-                        newTriBounds.AABB_max = glm::vec3(max_x, max_y, max_z);
-
-                        float min_x = glm::min(glm::min(newTri.p0.x, newTri.p1.x), newTri.p2.x);
-                        float min_y = glm::min(glm::min(newTri.p0.y, newTri.p1.y), newTri.p2.y);
-                        float min_z = glm::min(glm::min(newTri.p0.z, newTri.p1.z), newTri.p2.z);
-                        newTriBounds.AABB_min = glm::vec3(min_x, min_y, min_z);
-
-                        float mid_x = (newTri.p0.x + newTri.p1.x + newTri.p2.x) / 3.0;
-                        float mid_y = (newTri.p0.y + newTri.p1.y + newTri.p2.y) / 3.0;
-                        float mid_z = (newTri.p0.z + newTri.p1.z + newTri.p2.z) / 3.0;
-                        newTriBounds.AABB_centroid = glm::vec3(mid_x, mid_y, mid_z);
-
-                        tri_bounds.push_back(newTriBounds);
-
-                        mesh_tris.push_back(newTri);
-                        num_tris++;
-                    }
-                    //std::cout << num_tris << std::endl;
+                newGeom.blas_ID = curve_IDs[line];
+            }
+        }
+        else if (newGeom.type == VOLUME) {
+            // the grid is read in loadVolumes, a repeated path instances it
+            fp_in.getline(line);
+            if (!line.empty() && fp_in.good()) {
+                if (!volume_IDs.count(line)) {
+                    volume_IDs[line] = volume_grids.size();
+                    volume_grids.push_back(VolumeGrid());
+                    volume_sources.push_back(line);
                 }
+                VolumeMedium medium;
+                medium.grid = volume_IDs[line];
+                newGeom.blas_ID = volume_media.size();
+                volume_media.push_back(medium);
+            }
+            else {
+                throw std::runtime_error("Geom " + objectid + " is a volume without a .vol file");
             }
         }
 
-        int ending_tri_size = mesh_tris.size();
 
         //link material
-        utilityCore::safeGetline(fp_in, line);
+        fp_in.getline(line);
         if (!line.empty() && fp_in.good()) {
-            vector<string> tokens = utilityCore::tokenizeString(line);
+            const vector<string>& tokens = fp_in.tokenize(line);
             newGeom.materialid = atoi(tokens[1].c_str());
-            cout << "Connecting Geom " << objectid << " to Material " << newGeom.materialid << "..." << endl;
+            cout << "Connecting Geom " << objectid << " to Material " << newGeom.materialid << "..." << "\n";
         }
 
-        if (newGeom.type == MESH) {
-            for (int i = starting_tri_size; i < ending_tri_size; ++i) {
-                mesh_tris[i].mat_ID = newGeom.materialid;
-            }
-        }
-        
 
         //load transformations
-        utilityCore::safeGetline(fp_in, line);
+        fp_in.getline(line);
         while (!line.empty() && fp_in.good()) {
-            vector<string> tokens = utilityCore::tokenizeString(line);
+            const vector<string>& tokens = fp_in.tokenize(line);
 
             //load tranformations
             if (strcmp(tokens[0].c_str(), "TRANS") == 0) {
@@ -221,21 +327,96 @@ int Scene::loadGeom(string objectid) {
                 newGeom.rotation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
             } else if (strcmp(tokens[0].c_str(), "SCALE") == 0) {
                 newGeom.scale = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+            } else if (tokens.size() >= 4 && strcmp(tokens[0].c_str(), "TRANS_END") == 0) {
+                end_translation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+                end_trs[0] = true;
+            } else if (tokens.size() >= 4 && strcmp(tokens[0].c_str(), "ROTAT_END") == 0) {
+                end_rotation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+                end_trs[1] = true;
+            } else if (tokens.size() >= 4 && strcmp(tokens[0].c_str(), "SCALE_END") == 0) {
+                end_scale = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+                end_trs[2] = true;
+            } else if (tokens.size() >= 3 && strcmp(tokens[0].c_str(), "GLTF_MATERIAL") == 0) {
+                gltf_materials[atoi(tokens[1].c_str())] = atoi(tokens[2].c_str());
+            } else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "SUBDIV") == 0) {
+                mesh_options.subdiv_segments = glm::clamp(atoi(tokens[1].c_str()), 1, MAX_EDGE_SEGMENTS);
+            } else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "LODS") == 0) {
+                mesh_options.lod_levels = glm::clamp(atoi(tokens[1].c_str()), 0, MAX_MESH_LODS);
+            } else if (tokens.size() >= 3 && strcmp(tokens[0].c_str(), "DISPLACE") == 0) {
+                mesh_options.displacement_map = tokens[1];
+                mesh_options.displacement_scale = atof(tokens[2].c_str());
+            } else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "DENSITY") == 0) {
+                medium_options.density = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+            } else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "ANISOTROPY") == 0) {
+                medium_options.anisotropy = glm::clamp((float)atof(tokens[1].c_str()), -0.99f, 0.99f);
             }
 
-            utilityCore::safeGetline(fp_in, line);
+            fp_in.getline(line);
         }
 
         newGeom.transform = utilityCore::buildTransformationMatrix(
                 newGeom.translation, newGeom.rotation, newGeom.scale);
         newGeom.inverseTransform = glm::inverse(newGeom.transform);
         newGeom.invTranspose = glm::inverseTranspose(newGeom.transform);
+        if (end_trs[0] || end_trs[1] || end_trs[2]) {
+            // the shutter close key, whatever it leaves out stays as it is at the open key
+            newGeom.moving = true;
+            newGeom.end_transform = utilityCore::buildTransformationMatrix(end_trs[0] ? end_translation : newGeom.translation,
+                end_trs[1] ? end_rotation : newGeom.rotation, end_trs[2] ? end_scale : newGeom.scale);
+        }
 
-        if (newGeom.type != MESH) {
-            geoms.push_back(newGeom);
+        if (mesh_options.subdiv_segments == 0 && !mesh_options.displacement_map.empty()) {
+            cout << "WARNING: DISPLACE without SUBDIV on Geom " << objectid << ", only tessellated meshes are displaced" << "\n";
+        }
+        if ((mesh_options.subdiv_segments > 0 || mesh_options.lod_levels > 0) && !gltf_path.empty()) {
+            cout << "WARNING: SUBDIV and LODS on Geom " << objectid << " are ignored, only OBJ and PLY meshes take them" << "\n";
+        }
+        else if (new_blas) {
+            // the tessellation and LODs go with the mesh, instances of it share the first OBJECT's
+            MeshSource& source = mesh_sources[newGeom.blas_ID];
+            source.subdiv_segments = mesh_options.subdiv_segments;
+            source.displacement_map = mesh_options.displacement_map;
+            source.displacement_scale = mesh_options.displacement_scale;
+            source.lod_levels = mesh_options.lod_levels;
+        }
+        else if (newGeom.type == MESH && newGeom.blas_ID >= 0 && (mesh_options.subdiv_segments > 0 || mesh_options.lod_levels > 0)) {
+            const MeshSource& source = mesh_sources[newGeom.blas_ID];
+            if (source.subdiv_segments != mesh_options.subdiv_segments || source.displacement_map != mesh_options.displacement_map
+                || source.displacement_scale != mesh_options.displacement_scale || source.lod_levels != mesh_options.lod_levels) {
+                cout << "WARNING: Geom " << objectid << " instances " << source.path << ", its SUBDIV / DISPLACE / LODS lines are ignored for the first OBJECT's" << "\n";
+            }
+        }
+
+        if (newGeom.type == VOLUME) {
+            volume_media[newGeom.blas_ID].density = medium_options.density;
+            volume_media[newGeom.blas_ID].anisotropy = medium_options.anisotropy;
+        }
+
+        if (!gltf_path.empty()) {
+            loadGLTFInstances(newGeom, gltf_path, gltf_materials);
+            return 1;
+        }
+
+        geoms.push_back(newGeom);
+        if (newGeom.moving && materials[newGeom.materialid].emittance > 0.0f) {
+            cout << "WARNING: moving geoms aren't sampled as lights, Geom " << objectid << " only emits where paths hit it" << "\n";
+        }
+        else if (newGeom.type == CURVES) {
+            if (materials[newGeom.materialid].emittance > 0.0f) {
+                cout << "WARNING: curves aren't sampled as lights, Geom " << objectid << " only emits where paths hit it" << "\n";
+            }
+        }
+        else if (newGeom.type == VOLUME) {
+            if (materials[newGeom.materialid].emittance > 0.0f) {
+                cout << "WARNING: volumes don't emit, Geom " << objectid << "'s material only colors what it scatters" << "\n";
+            }
+        }
+        else if (newGeom.type != MESH) {
+            // emissive meshes get a light per tri in gatherMeshLights
             if (materials[newGeom.materialid].emittance > 0.0f) {
                 Light newLight;
                 newLight.geom_ID = geoms.size() - 1;
+                newLight.is_tri = false;
                 lights.push_back(newLight);
             }
         }
@@ -246,178 +427,2926 @@ int Scene::loadGeom(string objectid) {
     }
 }
 
-int Scene::loadCamera() {
-    cout << "Loading Camera ..." << endl;
-    RenderState &state = this->state;
-    Camera &camera = state.camera;
-    float fovy;
+// a glTF OBJECT is a geom per (node, material) of the asset, each placed by the node's world
+// matrix on top of the OBJECT's transform. meshes get a BLAS per material they use, shared by
+// every node and OBJECT placing them. the first geom takes the OBJECT's id and the others go
+// with the scattered copies, so OBJECT ids stay the geom indices
+void Scene::loadGLTFInstances(const Geom& object, const string& path, const std::map<int, int>& materials) {
+    const GLTFAsset& asset = gltf_assets[path];
+    bool first = true;
+    for (const GLTFInstance& instance : asset.instances) {
+        for (int material : gltfMeshMaterials(asset, instance.mesh)) {
+            MeshSource source;
+            source.path = path + "#" + std::to_string(instance.mesh) + ":" + std::to_string(material);
+            source.gltf_mesh = instance.mesh;
+            source.gltf_material = material;
 
-    //load static properties
-    for (int i = 0; i < 7; i++) {
-        string line;
-        utilityCore::safeGetline(fp_in, line);
-        vector<string> tokens = utilityCore::tokenizeString(line);
-        if (strcmp(tokens[0].c_str(), "RES") == 0) {
-            camera.resolution.x = atoi(tokens[1].c_str());
-            camera.resolution.y = atoi(tokens[2].c_str());
-        } else if (strcmp(tokens[0].c_str(), "FOVY") == 0) {
-            fovy = atof(tokens[1].c_str());
-        } else if (strcmp(tokens[0].c_str(), "ITERATIONS") == 0) {
-            state.iterations = atoi(tokens[1].c_str());
-        } else if (strcmp(tokens[0].c_str(), "DEPTH") == 0) {
-            state.traceDepth = atoi(tokens[1].c_str());
-        } else if (strcmp(tokens[0].c_str(), "FILE") == 0) {
-            state.imageName = tokens[1];
-        }
-        else if (strcmp(tokens[0].c_str(), "FOCAL_DISTANCE") == 0) {
-            camera.focal_distance = atof(tokens[1].c_str());
-        }
-        else if (strcmp(tokens[0].c_str(), "LENS_RADIUS") == 0) {
-            camera.lens_radius = atof(tokens[1].c_str());
+            Geom geom = object;
+            geom.blas_ID = blas_IDs.count(source.path) ? blas_IDs[source.path] : addBLAS(source);
+            std::map<int, int>::const_iterator mapped = materials.find(material);
+            if (mapped != materials.end()) {
+                geom.materialid = mapped->second;
+            }
+            geom.transform = object.transform * instance.transform;
+            geom.inverseTransform = glm::inverse(geom.transform);
+            geom.invTranspose = glm::inverseTranspose(geom.transform);
+            geom.end_transform = object.end_transform * instance.transform;
+            if (first) {
+                geoms.push_back(geom);
+                first = false;
+            }
+            else {
+                scattered_geoms.push_back(geom);
+            }
         }
     }
+    cout << "Placed " << asset.instances.size() << " node(s) of " << path << " using " << blases.size() << " BLAS(es) so far" << "\n";
+}
+
+// one of SCATTER's copies, placed by trs on top of the source object's own transform
+static Geom scatteredCopy(const Geom& source, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale) {
+    Geom copy = source;
+    copy.translation = translation;
+    copy.rotation = rotation;
+    copy.scale = scale;
+    const glm::mat4 placement = utilityCore::buildTransformationMatrix(translation, rotation, scale);
+    copy.transform = placement * source.transform;
+    copy.inverseTransform = glm::inverse(copy.transform);
+    copy.invTranspose = glm::inverseTranspose(copy.transform);
+    copy.end_transform = placement * source.end_transform;
+    return copy;
+}
+
+// SCATTER <object id> places copies of an earlier OBJECT, meshes share its BLAS like any other
+// instance. FILE reads one copy per line as TX TY TZ [RX RY RZ [S | SX SY SZ]], otherwise COUNT
+// copies are drawn from SEED, uniform in BOX (min xyz, max xyz), rotated by up to ROTAT_RANGE
+// degrees about each axis and scaled uniformly within SCALE_RANGE (min, max)
+int Scene::loadScatter(string objectid) {
+    int id = atoi(objectid.c_str());
+    if (id < 0 || id >= num_geoms) {
+        cout << "ERROR: SCATTER must name an OBJECT defined before it" << endl;
+        return -1;
+    }
+    const Geom source = geoms[id];
+    string path;
+    int count = 0;
+    unsigned int seed = 0;
+    glm::vec3 box_min(0.0f), box_max(0.0f), rotation_range(0.0f);
+    glm::vec2 scale_range(1.0f);
 
     string line;
-    utilityCore::safeGetline(fp_in, line);
+    fp_in.getline(line);
     while (!line.empty() && fp_in.good()) {
-        vector<string> tokens = utilityCore::tokenizeString(line);
-        if (strcmp(tokens[0].c_str(), "EYE") == 0) {
-            camera.position = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-        } else if (strcmp(tokens[0].c_str(), "LOOKAT") == 0) {
-            camera.lookAt = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-        } else if (strcmp(tokens[0].c_str(), "UP") == 0) {
-            camera.up = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+        const vector<string>& tokens = fp_in.tokenize(line);
+        if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "FILE") == 0) {
+            path = tokens[1];
+        }
+        else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "COUNT") == 0) {
+            count = glm::max(atoi(tokens[1].c_str()), 0);
+        }
+        else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "SEED") == 0) {
+            seed = strtoul(tokens[1].c_str(), NULL, 10);
+        }
+        else if (tokens.size() >= 7 && strcmp(tokens[0].c_str(), "BOX") == 0) {
+            box_min = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+            box_max = glm::vec3(atof(tokens[4].c_str()), atof(tokens[5].c_str()), atof(tokens[6].c_str()));
+        }
+        else if (tokens.size() >= 4 && strcmp(tokens[0].c_str(), "ROTAT_RANGE") == 0) {
+            rotation_range = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+        }
+        else if (tokens.size() >= 3 && strcmp(tokens[0].c_str(), "SCALE_RANGE") == 0) {
+            scale_range = glm::vec2(atof(tokens[1].c_str()), atof(tokens[2].c_str()));
+        }
+        else {
+            cout << "WARNING: ignoring SCATTER line " << line << endl;
         }
+        fp_in.getline(line);
+    }
 
-        utilityCore::safeGetline(fp_in, line);
+    const size_t first = scattered_geoms.size();
+    if (!path.empty()) {
+        utilityCore::LineReader file;
+        if (!file.open(path)) {
+            throw std::runtime_error("Cannot open SCATTER file [" + path + "]");
+        }
+        while (file.good()) {
+            file.getline(line);
+            const vector<string>& tokens = file.tokenize(line);
+            if (tokens.size() < 3 || tokens[0][0] == '#') {
+                continue;
+            }
+            float v[9] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+            for (int i = 0; i < (int)tokens.size() && i < 9; ++i) {
+                v[i] = atof(tokens[i].c_str());
+            }
+            if (tokens.size() == 7) {
+                // one uniform scale
+                v[7] = v[8] = v[6];
+            }
+            scattered_geoms.push_back(scatteredCopy(source, glm::vec3(v[0], v[1], v[2]), glm::vec3(v[3], v[4], v[5]), glm::vec3(v[6], v[7], v[8])));
+        }
+    }
+    else {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> u(0.0f, 1.0f);
+        for (int i = 0; i < count; ++i) {
+            glm::vec3 t = box_min + (box_max - box_min) * glm::vec3(u(rng), u(rng), u(rng));
+            glm::vec3 r = rotation_range * glm::vec3(u(rng), u(rng), u(rng));
+            float scale = glm::mix(scale_range.x, scale_range.y, u(rng));
+            scattered_geoms.push_back(scatteredCopy(source, t, r, glm::vec3(scale)));
+        }
     }
+    cout << "Scattered " << scattered_geoms.size() - first << " copies of Geom " << id << endl;
+    return 1;
+}
 
-    //calculate fov based on resolution
-    float yscaled = tan(fovy * (PI / 180));
-    float xscaled = (yscaled * camera.resolution.x) / camera.resolution.y;
-    float fovx = (atan(xscaled) * 180) / PI;
-    camera.fov = glm::vec2(fovx, fovy);
+// FNV-1a over the file bytes, what a mesh cache is keyed on
+static bool hashFile(const std::string& path, unsigned long long& hash) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    hash = utilityCore::hashBytes(NULL, 0);
+    std::vector<char> buffer(1 << 16);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        hash = utilityCore::hashBytes(buffer.data(), file.gcount(), hash);
+    }
+    return true;
+}
 
-    camera.right = glm::normalize(glm::cross(camera.view, camera.up));
-    camera.pixelLength = glm::vec2(2 * xscaled / (float)camera.resolution.x,
-                                   2 * yscaled / (float)camera.resolution.y);
+// bump whenever the layout below or what the BVH builders emit changes
+#define MESH_CACHE_VERSION 4
 
-    camera.view = glm::normalize(camera.lookAt - camera.position);
+// <obj>.cache is this header followed by positions, normals and uvs (num_vertices each),
+// indices (num_tris, vertex ids local to the mesh, in BVH leaf order) and the BLAS nodes
+// (num_nodes, none for LBVH), every array laid out exactly as the Scene vectors
+// pathtraceInit uploads so it can be appended (or mapped) as is
+struct MeshCacheHeader {
+    char magic[4];
+    int version;
+    unsigned long long obj_hash;
+    int builder;
+    int sah_bins;
+    int max_leaf_size;
+    float split_budget;
+    int area_order;
+    float traversal_cost;
+    float intersect_cost;
+    int num_vertices;
+    int num_tris;
+    int num_nodes;
+    glm::vec3 AABB_min;
+    glm::vec3 AABB_max;
+};
 
-    //set up render camera stuff
-    int arraylen = camera.resolution.x * camera.resolution.y;
-    state.image.resize(arraylen);
-    std::fill(state.image.begin(), state.image.end(), glm::vec3());
+static MeshCacheHeader meshCacheKey(unsigned long long obj_hash, const BVHSettings& bvh_settings) {
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PTMC", 4);
+    header.version = MESH_CACHE_VERSION;
+    header.obj_hash = obj_hash;
+    header.builder = bvh_settings.builder;
+    header.sah_bins = bvh_settings.sah_bins;
+    header.max_leaf_size = bvh_settings.max_leaf_size;
+    header.split_budget = bvh_settings.builder == BVH_SBVH ? bvh_settings.split_budget : 0.0f;
+    header.area_order = bvh_settings.builder != BVH_LBVH && bvh_settings.area_order;
+    header.traversal_cost = SAH_TRAVERSAL_COST;
+    header.intersect_cost = SAH_INTERSECT_COST;
+    return header;
+}
 
-    cout << "Loaded camera!" << endl;
-    return 1;
+static bool sameMeshCacheKey(const MeshCacheHeader& a, const MeshCacheHeader& b) {
+    return memcmp(a.magic, b.magic, 4) == 0 && a.version == b.version && a.obj_hash == b.obj_hash
+        && a.builder == b.builder && a.sah_bins == b.sah_bins && a.max_leaf_size == b.max_leaf_size && a.split_budget == b.split_budget
+        && a.area_order == b.area_order
+        && a.traversal_cost == b.traversal_cost && a.intersect_cost == b.intersect_cost;
 }
 
-int Scene::loadMaterial(string materialid) {
-    int id = atoi(materialid.c_str());
-    if (id != materials.size()) {
-        cout << "ERROR: MATERIAL ID does not match expected number of materials" << endl;
-        return -1;
-    } else {
-        cout << "Loading Material " << id << "..." << endl;
-        Material newMaterial;
+// copies count values out of the mapping at offset and steps past them
+template <typename T>
+static bool readCacheArray(const utilityCore::MappedFile& file, size_t& offset, std::vector<T>& values, int count) {
+    const size_t bytes = (size_t)count * sizeof(T);
+    if (count < 0 || file.size() - offset < bytes) {
+        return false;
+    }
+    values.resize(count);
+    if (count > 0) {
+        memcpy(values.data(), file.data() + offset, bytes);
+    }
+    offset += bytes;
+    return true;
+}
 
-        //load static properties
-        for (int i = 0; i < 5; i++) {
-            string line;
-            utilityCore::safeGetline(fp_in, line);
-            vector<string> tokens = utilityCore::tokenizeString(line);
-            if (strcmp(tokens[0].c_str(), "R_COLOR") == 0) {
-                glm::vec3 rColor( atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()) );
-                newMaterial.R = rColor;
-            } 
-            else if (strcmp(tokens[0].c_str(), "T_COLOR") == 0) {
-                glm::vec3 tColor(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
-                newMaterial.T = tColor;
-            } 
-            else if (strcmp(tokens[0].c_str(), "DIFFUSE_BRDF") == 0) {
-                newMaterial.type = DIFFUSE_BRDF;
-            }
-            else if (strcmp(tokens[0].c_str(), "DIFFUSE_BTDF") == 0) {
-                newMaterial.type = DIFFUSE_BTDF;
-            }
-            else if (strcmp(tokens[0].c_str(), "SPEC_BRDF") == 0) {
-                newMaterial.type = SPEC_BRDF;
-            }
-            else if (strcmp(tokens[0].c_str(), "SPEC_BTDF") == 0) {
-                newMaterial.type = SPEC_BTDF;
-            }
-            else if (strcmp(tokens[0].c_str(), "SPEC_GLASS") == 0) {
-                newMaterial.type = SPEC_GLASS;
-            }
-            else if (strcmp(tokens[0].c_str(), "SPEC_PLASTIC") == 0) {
-                newMaterial.type = SPEC_PLASTIC;
-            }
-            else if (strcmp(tokens[0].c_str(), "IOR") == 0) {
-                newMaterial.ior = atof(tokens[1].c_str());
-            } 
-            else if (strcmp(tokens[0].c_str(), "EMITTANCE") == 0) {
-                newMaterial.emittance = atof(tokens[1].c_str());
-            }
-        }
-        materials.push_back(newMaterial);
-        return 1;
+template <typename T>
+static void writeCacheArray(std::ofstream& file, const T* values, int count) {
+    if (count > 0) {
+        file.write((const char*)values, count * sizeof(T));
     }
 }
 
-// PBRT BVH as reference
-// https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+// one mesh on its way into Scene::mesh, the deduplicated vertices of its obj or the arrays
+// of its cache. vertex / tri ids are local to the mesh
+struct MeshLoad {
+    bool cached = false;
+    std::string error; // tinyobj's, rethrown on the main thread
+    std::vector<std::string> notes; // logged on the main thread
 
-BVHNode* Scene::buildBVH(int start_index, int end_index) {
-    BVHNode* new_node = new BVHNode();
-    num_nodes++;
-    int num_tris_in_node = end_index - start_index;
+    std::vector<glm::vec3> positions, normals;
+    std::vector<glm::vec2> uvs;
+    std::vector<BVHNode_GPU> nodes; // cache only
 
-    // get the AABB bounds for this node (getting min and max of all triangles within)
-    glm::vec3 max_bounds = glm::vec3(-100000.0);
-    glm::vec3 min_bounds = glm::vec3(100000.0);
-    for (int i = start_index; i < end_index; ++i) {
-        if (max_bounds.x < tri_bounds[i].AABB_max.x) {
-            max_bounds.x = tri_bounds[i].AABB_max.x;
-        }
-        if (max_bounds.y < tri_bounds[i].AABB_max.y) {
-            max_bounds.y = tri_bounds[i].AABB_max.y;
-        }
-        if (max_bounds.z < tri_bounds[i].AABB_max.z) {
-            max_bounds.z = tri_bounds[i].AABB_max.z;
-        }
+    std::vector<glm::ivec3> indices;
+    int num_vertices = 0;
+    glm::vec3 AABB_min = glm::vec3(FLT_MAX);
+    glm::vec3 AABB_max = glm::vec3(-FLT_MAX);
+};
 
-        if (min_bounds.x > tri_bounds[i].AABB_min.x) {
-            min_bounds.x = tri_bounds[i].AABB_min.x;
+// <obj>.cache next to the mesh, or with BVH_CACHE_DIR <dir>/<hash of key>.ptmc. the name there
+// is the key itself, so every node (and every path to the same obj) finds the one entry an asset
+// version and builder setup have, and no entry is ever stale
+static std::string meshCachePath(const std::string& path, const MeshCacheHeader& key, const BVHSettings& bvh_settings) {
+    if (bvh_settings.cache_dir.empty()) {
+        return path + ".cache";
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.ptmc", utilityCore::hashBytes(&key, sizeof(key)));
+    return bvh_settings.cache_dir + "/" + name;
+}
+
+static bool readMeshCache(const std::string& path, const MeshCacheHeader& key, MeshLoad& load) {
+    utilityCore::MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+
+    MeshCacheHeader header;
+    if (file.size() < sizeof(header)) {
+        load.notes.push_back("Mesh cache " + path + " is truncated, rebuilding");
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (!sameMeshCacheKey(header, key)) {
+        load.notes.push_back("Mesh cache " + path + " is stale, rebuilding");
+        return false;
+    }
+    size_t offset = sizeof(header);
+    if (!readCacheArray(file, offset, load.positions, header.num_vertices) || !readCacheArray(file, offset, load.normals, header.num_vertices)
+        || !readCacheArray(file, offset, load.uvs, header.num_vertices) || !readCacheArray(file, offset, load.indices, header.num_tris)
+        || !readCacheArray(file, offset, load.nodes, header.num_nodes)) {
+        load.notes.push_back("Mesh cache " + path + " is truncated, rebuilding");
+        return false;
+    }
+    load.num_vertices = header.num_vertices;
+    load.AABB_min = header.AABB_min;
+    load.AABB_max = header.AABB_max;
+    return true;
+}
+
+// how long a node waits on another one building the same shared cache entry before building it too
+#define MESH_CACHE_WAIT_SECONDS 600
+
+// a miss in BVH_CACHE_DIR. the first node to create <entry>.lock builds the mesh (and
+// writeMeshCaches publishes it and drops the lock), the others poll for the entry instead of
+// building it again. true once it's been read
+static bool awaitMeshCache(const std::string& path, const MeshCacheHeader& key, MeshLoad& load) {
+    const std::string lock = path + ".lock";
+    for (int waited = 0; waited < MESH_CACHE_WAIT_SECONDS; ++waited) {
+        FILE* claim = fopen(lock.c_str(), "wx");
+        if (claim != NULL) {
+            fclose(claim);
+            // published between the miss and the claim
+            if (readMeshCache(path, key, load)) {
+                remove(lock.c_str());
+                return true;
+            }
+            return false;
         }
-        if (min_bounds.y > tri_bounds[i].AABB_min.y) {
-            min_bounds.y = tri_bounds[i].AABB_min.y;
+        if (waited == 0) {
+            load.notes.push_back("Waiting on another node building mesh cache " + path);
         }
-        if (min_bounds.z > tri_bounds[i].AABB_min.z) {
-            min_bounds.z = tri_bounds[i].AABB_min.z;
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        if (readMeshCache(path, key, load)) {
+            return true;
         }
     }
+    load.notes.push_back("WARNING: gave up waiting on " + lock + ", building the mesh here");
+    return false;
+}
 
-    // leaf node (with 1 tri in it)
-    if (num_tris_in_node <= 1) {
-        mesh_tris_sorted.push_back(mesh_tris[tri_bounds[start_index].tri_ID]);
-        new_node->tri_index = mesh_tris_sorted.size() - 1;
-        new_node->AABB_max = max_bounds;
-        new_node->AABB_min = min_bounds;
-        return new_node;
+struct CornerHash {
+    size_t operator()(const glm::ivec3& c) const {
+        return ((size_t)(unsigned int)c.x * 73856093u) ^ ((size_t)(unsigned int)c.y * 19349663u) ^ ((size_t)(unsigned int)c.z * 83492791u);
     }
-    // intermediate node (covering tris start_index through end_index
-    else {
-        // get the greatest length between tri centroids in each direction x, y, and z
-        glm::vec3 centroid_max = glm::vec3(-100000.0);
-        glm::vec3 centroid_min = glm::vec3(100000.0);
-        for (int i = start_index; i < end_index; ++i) {
-            if (centroid_max.x < tri_bounds[i].AABB_centroid.x) {
-                centroid_max.x = tri_bounds[i].AABB_centroid.x;
-            }
-            if (centroid_max.y < tri_bounds[i].AABB_centroid.y) {
-                centroid_max.y = tri_bounds[i].AABB_centroid.y;
-            }
+};
+
+// state of one obj streamed through the tinyobj callbacks. only the raw v / vn / vt lines
+// are kept until the end, faces go straight to deduplicated vertices and tris in load
+struct OBJStream {
+    MeshLoad* load;
+    std::vector<glm::vec3> v;
+    std::vector<glm::vec3> vn;
+    std::vector<glm::vec2> vt;
+    // corners that share all three obj indices (position, normal, uv) become one vertex
+    std::unordered_map<glm::ivec3, int, CornerHash> vertex_IDs;
+    int bad_faces = 0;
+};
+
+// obj indices are 1 based or negative from the end, 0 is a missing index (fixed is -1).
+// false for an index past either end
+static bool fixOBJIndex(int idx, int count, int& fixed) {
+    fixed = idx > 0 ? idx - 1 : (idx < 0 ? count + idx : -1);
+    return idx == 0 || (fixed >= 0 && fixed < count);
+}
+
+static bool resolveCorner(const OBJStream& stream, const tinyobj::index_t& idx, glm::ivec3& key) {
+    return fixOBJIndex(idx.vertex_index, stream.v.size(), key.x) && key.x >= 0
+        && fixOBJIndex(idx.normal_index, stream.vn.size(), key.y) && fixOBJIndex(idx.texcoord_index, stream.vt.size(), key.z);
+}
+
+static int streamCorner(OBJStream& stream, const glm::ivec3& key) {
+    auto found = stream.vertex_IDs.find(key);
+    if (found != stream.vertex_IDs.end()) {
+        return found->second;
+    }
+
+    MeshLoad& load = *stream.load;
+    const int vertex_ID = load.positions.size();
+    stream.vertex_IDs[key] = vertex_ID;
+    load.positions.push_back(stream.v[key.x]);
+    load.normals.push_back(key.y != -1 ? stream.vn[key.y] : glm::vec3(0.0f));
+    load.uvs.push_back(key.z != -1 ? stream.vt[key.z] : glm::vec2(0.0f));
+    // every vertex is a corner of some tri, so this is the bounds of the tris too
+    load.AABB_min = glm::min(load.AABB_min, load.positions.back());
+    load.AABB_max = glm::max(load.AABB_max, load.positions.back());
+    return vertex_ID;
+}
+
+// vertex ids are handed out in the order the tris reference corners, same as LoadObj's output
+static void streamTri(OBJStream& stream, const glm::ivec3& k0, const glm::ivec3& k1, const glm::ivec3& k2) {
+    glm::ivec3 tri;
+    tri[0] = streamCorner(stream, k0);
+    tri[1] = streamCorner(stream, k1);
+    tri[2] = streamCorner(stream, k2);
+    stream.load->indices.push_back(tri);
+}
+
+static void streamVertex(void* user_data, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z, tinyobj::real_t w) {
+    ((OBJStream*)user_data)->v.push_back(glm::vec3(x, y, z));
+}
+
+static void streamNormal(void* user_data, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z) {
+    ((OBJStream*)user_data)->vn.push_back(glm::vec3(x, y, z));
+}
+
+static void streamTexcoord(void* user_data, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z) {
+    ((OBJStream*)user_data)->vt.push_back(glm::vec2(x, 1.0f - y));
+}
+
+// quads split along their shorter diagonal like tinyobj's LoadObj, bigger polygons are fanned
+static void streamFace(void* user_data, tinyobj::index_t* indices, int num_indices) {
+    OBJStream& stream = *(OBJStream*)user_data;
+    std::vector<glm::ivec3> keys(glm::max(num_indices, 0));
+    for (int k = 0; k < num_indices; ++k) {
+        if (!resolveCorner(stream, indices[k], keys[k])) {
+            stream.bad_faces++;
+            return;
+        }
+    }
+    if (num_indices < 3) {
+        stream.bad_faces++;
+        return;
+    }
+
+    if (num_indices == 4) {
+        glm::vec3 e02 = stream.v[keys[2].x] - stream.v[keys[0].x];
+        glm::vec3 e13 = stream.v[keys[3].x] - stream.v[keys[1].x];
+        if (glm::dot(e02, e02) < glm::dot(e13, e13)) {
+            streamTri(stream, keys[0], keys[1], keys[2]);
+            streamTri(stream, keys[0], keys[2], keys[3]);
+        }
+        else {
+            streamTri(stream, keys[0], keys[1], keys[3]);
+            streamTri(stream, keys[1], keys[2], keys[3]);
+        }
+        return;
+    }
+    for (int k = 2; k < num_indices; ++k) {
+        streamTri(stream, keys[0], keys[k - 1], keys[k]);
+    }
+}
+
+// reads the obj a line at a time, peak memory is its v / vn / vt lines plus the final mesh
+static void parseOBJ(const std::string& path, MeshLoad& load) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        load.error = "Cannot open file [" + path + "]";
+        return;
+    }
+
+    OBJStream stream;
+    stream.load = &load;
+    tinyobj::callback_t callbacks;
+    callbacks.vertex_cb = streamVertex;
+    callbacks.normal_cb = streamNormal;
+    callbacks.texcoord_cb = streamTexcoord;
+    callbacks.index_cb = streamFace;
+
+    std::string warn, err;
+    if (!tinyobj::LoadObjWithCallback(file, callbacks, &stream, NULL, &warn, &err)) {
+        load.error = warn + err;
+        return;
+    }
+    if (stream.bad_faces > 0) {
+        load.notes.push_back("WARNING: skipped " + std::to_string(stream.bad_faces) + " faces of " + path + " with missing or out of range indices");
+    }
+    load.num_vertices = load.positions.size();
+}
+
+// the file a source's tris are in, a glTF source's path is <file>#<mesh>:<material>
+static std::string sourceFile(const MeshSource& source) {
+    return source.gltf_mesh >= 0 ? source.path.substr(0, source.path.rfind('#')) : source.path;
+}
+
+// every file the scene reads besides the scene file itself, each once
+std::vector<std::string> Scene::inputFiles() const {
+    std::set<std::string> files;
+    for (const MeshSource& source : mesh_sources) {
+        if (source.lod_of == -1) {
+            files.insert(sourceFile(source));
+        }
+    }
+    for (const std::string& path : curve_sources) {
+        files.insert(path);
+    }
+    for (const std::string& path : volume_sources) {
+        files.insert(path);
+    }
+    for (const MeshSource& source : mesh_sources) {
+        if (!source.displacement_map.empty()) {
+            files.insert(source.displacement_map);
+        }
+    }
+    for (const Texture& texture : textures) {
+        files.insert(texture.path);
+    }
+    if (!environment.path.empty()) {
+        files.insert(environment.path);
+    }
+    return std::vector<std::string>(files.begin(), files.end());
+}
+
+// the vertex and index buffers of a glTF mesh are already indexed, they go into load as is
+static void parseGLTFMesh(const GLTFAsset& asset, const MeshSource& source, MeshLoad& load) {
+    if (!loadGLTFMesh(asset, source.gltf_mesh, source.gltf_material, load.positions, load.normals, load.uvs, load.indices, load.error)) {
+        return;
+    }
+    for (const glm::vec3& p : load.positions) {
+        load.AABB_min = glm::min(load.AABB_min, p);
+        load.AABB_max = glm::max(load.AABB_max, p);
+    }
+    load.num_vertices = load.positions.size();
+}
+
+// binary PLY, memory mapped and decoded in parallel blocks, see loadPLY
+static void parsePLY(const std::string& path, MeshLoad& load) {
+    int bad_faces = 0;
+    if (!loadPLY(path, load.positions, load.normals, load.uvs, load.indices, load.AABB_min, load.AABB_max, bad_faces, load.error)) {
+        return;
+    }
+    if (bad_faces > 0) {
+        load.notes.push_back("WARNING: skipped " + std::to_string(bad_faces) + " faces of " + path + " with missing or out of range indices");
+    }
+    load.num_vertices = load.positions.size();
+}
+
+static void boundVertex(void* user_data, tinyobj::real_t x, tinyobj::real_t y, tinyobj::real_t z, tinyobj::real_t w) {
+    MeshLoad& load = *(MeshLoad*)user_data;
+    load.AABB_min = glm::min(load.AABB_min, glm::vec3(x, y, z));
+    load.AABB_max = glm::max(load.AABB_max, glm::vec3(x, y, z));
+}
+
+// bounds of an obj for its STREAM_MESHES proxy, off the header of any cache it has (the obj
+// isn't hashed, a stale cache is still close enough for a placeholder) or its v lines. the
+// bounds of every v line, referenced or not. a PLY's come from a pass over its vertex element
+static void meshBounds(const std::string& path, MeshLoad& load) {
+    std::ifstream cache(path + ".cache", std::ios::binary);
+    MeshCacheHeader header;
+    if (cache.is_open() && cache.read((char*)&header, sizeof(header))
+        && memcmp(header.magic, "PTMC", 4) == 0 && header.version == MESH_CACHE_VERSION) {
+        load.AABB_min = header.AABB_min;
+        load.AABB_max = header.AABB_max;
+        return;
+    }
+
+    if (isPLYPath(path)) {
+        int bad_faces = 0;
+        loadPLY(path, load.positions, load.normals, load.uvs, load.indices, load.AABB_min, load.AABB_max, bad_faces, load.error, true);
+        return;
+    }
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        load.error = "Cannot open file [" + path + "]";
+        return;
+    }
+    tinyobj::callback_t callbacks;
+    callbacks.vertex_cb = boundVertex;
+    std::string warn, err;
+    if (!tinyobj::LoadObjWithCallback(file, callbacks, &load, NULL, &warn, &err)) {
+        load.error = warn + err;
+    }
+}
+
+// STREAM_MESHES, turns every mesh geom into a cube over its obj's bounds and drops the BLASes,
+// so the window has something to show while the real scene loads. geoms keep their order, so
+// OBJECT ids still find them. emissive meshes don't light the proxy scene
+void Scene::makeMeshProxies() {
+    std::vector<MeshLoad> bounds(mesh_sources.size());
+    utilityCore::parallelFor(mesh_sources.size(), [&](int i) {
+        const MeshSource& source = mesh_sources[i];
+        if (source.gltf_mesh < 0) {
+            meshBounds(source.path, bounds[i]);
+        }
+        else if (!gltfMeshBounds(gltf_assets[sourceFile(source)], source.gltf_mesh, source.gltf_material, bounds[i].AABB_min, bounds[i].AABB_max)) {
+            parseGLTFMesh(gltf_assets[sourceFile(source)], source, bounds[i]);
+        }
+    });
+    for (int i = 0; i < bounds.size(); ++i) {
+        if (!bounds[i].error.empty()) {
+            throw std::runtime_error(bounds[i].error);
+        }
+    }
+
+    for (Geom& geom : geoms) {
+        if (geom.type != MESH) {
+            continue;
+        }
+        const MeshLoad& load = bounds[geom.blas_ID];
+        glm::vec3 center = 0.5f * (load.AABB_min + load.AABB_max);
+        glm::vec3 extent = glm::max(load.AABB_max - load.AABB_min, glm::vec3(1e-4f));
+        if (load.AABB_min.x > load.AABB_max.x) {
+            // no vertices at all
+            center = glm::vec3(0.0f);
+            extent = glm::vec3(1e-4f);
+        }
+        geom.type = CUBE;
+        geom.blas_ID = -1;
+        geom.transform = geom.transform * glm::translate(glm::mat4(1.0f), center) * glm::scale(glm::mat4(1.0f), extent);
+        geom.inverseTransform = glm::inverse(geom.transform);
+        geom.invTranspose = glm::inverseTranspose(geom.transform);
+    }
+    cout << "Showing " << mesh_sources.size() << " mesh(es) as bounding boxes until they're loaded" << endl;
+
+    blases.clear();
+    blas_IDs.clear();
+    mesh_sources.clear();
+    mesh_proxies = true;
+}
+
+// Reads the OBJ of every BLAS, from its cache when BVH_CACHE is on and the cache was written
+// for the same obj contents and BVH settings. Meshes are parsed in parallel, then laid out
+// in BLAS order and their vertices, tris and tri bounds written straight into mesh and
+// tri_bounds in parallel ranges
+// SUBDIV, the mesh's cage becomes its tessellation for the view from the scene's camera
+static void tessellateLoad(const MeshSource& source, const TessellationView& view, MeshLoad& load) {
+    DisplacementMap map;
+    if (!source.displacement_map.empty() && !loadDisplacementMap(source.displacement_map, source.displacement_scale, map, load.error)) {
+        return;
+    }
+    const size_t cage_tris = load.indices.size();
+    tessellateMesh(load.positions, load.normals, load.uvs, load.indices, view, map);
+    load.num_vertices = load.positions.size();
+    load.AABB_min = glm::vec3(FLT_MAX);
+    load.AABB_max = glm::vec3(-FLT_MAX);
+    for (const glm::vec3& p : load.positions) {
+        load.AABB_min = glm::min(load.AABB_min, p);
+        load.AABB_max = glm::max(load.AABB_max, p);
+    }
+    load.notes.push_back("Tessellated " + source.path + " from " + std::to_string(cage_tris) + " cage tris into " + std::to_string(load.indices.size()));
+}
+
+// what a tessellated mesh's cache is keyed on besides its file: everything tessellateLoad reads
+static unsigned long long tessellationHash(const MeshSource& source, const TessellationView& view, unsigned long long hash) {
+    unsigned long long map_hash = 0;
+    if (!source.displacement_map.empty()) {
+        hashFile(source.displacement_map, map_hash);
+    }
+    hash = utilityCore::hashBytes(&map_hash, sizeof(map_hash), hash);
+    hash = utilityCore::hashBytes(&source.displacement_scale, sizeof(float), hash);
+    hash = utilityCore::hashBytes(&view.max_segments, sizeof(int), hash);
+    hash = utilityCore::hashBytes(&view.rate, sizeof(float), hash);
+    hash = utilityCore::hashBytes(&view.pixel_angle, sizeof(float), hash);
+    hash = utilityCore::hashBytes(&view.eye, sizeof(glm::vec3), hash);
+    return utilityCore::hashBytes(view.instances.data(), view.instances.size() * sizeof(glm::mat4), hash);
+}
+
+// COMPRESSED_MESH keeps a mesh's vertices on the 65535 step grid over its box. they're moved onto it
+// as they're loaded, so the BVHs, the lights and the CPU renderer are all built over the positions
+// the device decodes. the grid is only recorded without it
+static void snapToVertexGrid(glm::vec3* positions, int count, const glm::vec3& box_min, const glm::vec3& box_max, BLAS& blas) {
+    blas.grid_origin = box_min;
+    blas.grid_step = (box_max - box_min) * (1.0f / 65535.0f);
+#if COMPRESSED_MESH
+    for (int v = 0; v < count; ++v) {
+        positions[v] = dequantizeVertex(quantizeVertex(positions[v], blas.grid_origin, blas.grid_step), blas.grid_origin, blas.grid_step);
+    }
+#endif
+}
+
+void Scene::loadMeshes() {
+    ProfileRange range("load meshes");
+    PhaseTimer phase(PHASE_TRI_SETUP);
+    PhaseTimer parse_phase(PHASE_OBJ_PARSE);
+    std::vector<MeshLoad> loads(blases.size());
+    std::vector<TessellationView> views(blases.size());
+    for (int i = 0; i < blases.size(); ++i) {
+        views[i].eye = state.camera.position;
+        views[i].pixel_angle = state.camera.pixelLength.y;
+        views[i].rate = render_settings.tessellation_rate;
+        views[i].max_segments = mesh_sources[i].subdiv_segments;
+    }
+    for (const Geom& geom : geoms) {
+        if (geom.type == MESH && mesh_sources[geom.blas_ID].subdiv_segments > 0) {
+            views[geom.blas_ID].instances.push_back(geom.transform);
+        }
+    }
+    utilityCore::parallelFor(blases.size(), [&](int i) {
+        MeshSource& source = mesh_sources[i];
+        MeshLoad& load = loads[i];
+        if (bvh_settings.cache && hashFile(sourceFile(source), source.hash)) {
+            if (source.subdiv_segments > 0) {
+                source.hash = tessellationHash(source, views[i], source.hash);
+            }
+            const MeshCacheHeader key = meshCacheKey(source.hash, bvh_settings);
+            const std::string cache_path = meshCachePath(source.path, key, bvh_settings);
+            load.cached = readMeshCache(cache_path, key, load);
+            if (!load.cached && !bvh_settings.cache_dir.empty()) {
+                load.cached = awaitMeshCache(cache_path, key, load);
+            }
+        }
+        if (!load.cached && source.gltf_mesh >= 0) {
+            parseGLTFMesh(gltf_assets[sourceFile(source)], source, load);
+        }
+        else if (!load.cached && isPLYPath(source.path)) {
+            parsePLY(source.path, load);
+        }
+        else if (!load.cached) {
+            parseOBJ(source.path, load);
+        }
+        if (!load.cached && load.error.empty() && source.subdiv_segments > 0) {
+            tessellateLoad(source, views[i], load);
+        }
+        snapToVertexGrid(load.positions.data(), load.positions.size(), load.AABB_min, load.AABB_max, blases[i]);
+    });
+    parse_phase.stop();
+
+    const int chunk_size = 1 << 16;
+    std::vector<glm::ivec3> chunks; // (mesh, first vertex or tri, 0 for vertices / 1 for tris)
+    int num_vertices = mesh.positions.size();
+    for (int i = 0; i < blases.size(); ++i) {
+        BLAS& blas = blases[i];
+        MeshSource& source = mesh_sources[i];
+        MeshLoad& load = loads[i];
+        if (!load.error.empty()) {
+            throw std::runtime_error(load.error);
+        }
+        for (const std::string& note : load.notes) {
+            cout << note << endl;
+        }
+
+        source.cached = load.cached;
+        source.vertex_offset = num_vertices;
+        source.num_vertices = load.num_vertices;
+        num_vertices += source.num_vertices;
+        blas.tri_offset = num_tris;
+        blas.num_tris = load.indices.size();
+        blas.AABB_min = load.AABB_min;
+        blas.AABB_max = load.AABB_max;
+        num_tris += blas.num_tris;
+        if (load.cached) {
+            blas.node_offset = bvh_nodes_gpu.size();
+            blas.num_nodes = load.nodes.size();
+            bvh_nodes_gpu.insert(bvh_nodes_gpu.end(), load.nodes.begin(), load.nodes.end());
+            cout << "Loaded mesh " << source.path << " from its cache, vertices: " << source.num_vertices << ", tris: " << blas.num_tris << ", nodes: " << blas.num_nodes << endl;
+        }
+        else {
+            cout << "Loaded mesh " << source.path << ", vertices: " << source.num_vertices << ", tris: " << blas.num_tris << endl;
+        }
+
+        for (int v = 0; v < source.num_vertices; v += chunk_size) {
+            chunks.push_back(glm::ivec3(i, v, 0));
+        }
+        for (int t = 0; t < blas.num_tris; t += chunk_size) {
+            chunks.push_back(glm::ivec3(i, t, 1));
+        }
+    }
+
+    mesh.positions.resize(num_vertices);
+    mesh.normals.resize(num_vertices);
+    mesh.uvs.resize(num_vertices);
+    mesh.indices.resize(num_tris);
+    tri_bounds.resize(num_tris);
+
+    // cached tris are already in leaf order and never need their bounds
+    utilityCore::parallelFor(chunks.size(), [&](int c) {
+        const int i = chunks[c].x;
+        const BLAS& blas = blases[i];
+        const MeshSource& source = mesh_sources[i];
+        const MeshLoad& load = loads[i];
+        const int begin = chunks[c].y;
+
+        if (chunks[c].z == 0) {
+            const int end = glm::min(begin + chunk_size, source.num_vertices);
+            for (int v = begin; v < end; ++v) {
+                const int vertex_ID = source.vertex_offset + v;
+                mesh.positions[vertex_ID] = load.positions[v];
+                mesh.normals[vertex_ID] = load.normals[v];
+                mesh.uvs[vertex_ID] = load.uvs[v];
+            }
+            return;
+        }
+
+        const int end = glm::min(begin + chunk_size, blas.num_tris);
+        for (int t = begin; t < end; ++t) {
+            const int tri_ID = blas.tri_offset + t;
+            const glm::ivec3& tri_indices = load.indices[t];
+            mesh.indices[tri_ID] = tri_indices + glm::ivec3(source.vertex_offset);
+            if (load.cached) {
+                continue;
+            }
+
+            const glm::vec3& p0 = load.positions[tri_indices[0]];
+            const glm::vec3& p1 = load.positions[tri_indices[1]];
+            const glm::vec3& p2 = load.positions[tri_indices[2]];
+
+            TriBounds& bounds = tri_bounds[tri_ID];
+            bounds.tri_ID = tri_ID;
+            bounds.AABB_max = glm::max(glm::max(p0, p1), p2);
+            bounds.AABB_min = glm::min(glm::min(p0, p1), p2);
+            bounds.AABB_centroid = (p0 + p1 + p2) / 3.0f;
+        }
+    });
+}
+
+// snapToVertexGrid over the mesh's current vertices, after a refit moved them
+void Scene::snapMeshToGrid(int blas_ID) {
+    const MeshSource& source = mesh_sources[blas_ID];
+    glm::vec3 box_min(FLT_MAX);
+    glm::vec3 box_max(-FLT_MAX);
+    for (int v = source.vertex_offset; v < source.vertex_offset + source.num_vertices; ++v) {
+        box_min = glm::min(box_min, mesh.positions[v]);
+        box_max = glm::max(box_max, mesh.positions[v]);
+    }
+    snapToVertexGrid(mesh.positions.data() + source.vertex_offset, source.num_vertices, box_min, box_max, blases[blas_ID]);
+}
+
+// one LOD of a mesh, its own vertices and tris until buildMeshLODs appends them to the scene's
+struct MeshLOD {
+    int level;
+    std::vector<glm::vec3> positions, normals;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::ivec3> indices; // local to the LOD
+    float spacing = 0.0f;
+};
+
+static float meanEdgeLength(const glm::vec3* positions, const glm::ivec3* indices, int num_tris, int vertex_offset) {
+    double sum = 0.0;
+    for (int t = 0; t < num_tris; ++t) {
+        const glm::vec3& p0 = positions[indices[t].x - vertex_offset];
+        const glm::vec3& p1 = positions[indices[t].y - vertex_offset];
+        const glm::vec3& p2 = positions[indices[t].z - vertex_offset];
+        sum += glm::length(p1 - p0) + glm::length(p2 - p1) + glm::length(p0 - p2);
+    }
+    return num_tris > 0 ? (float)(sum / (3.0 * num_tris)) : 0.0f;
+}
+
+// vertex clustering (Rossignac and Borrel 1993): the vertices in each cell of a grid over the
+// mesh's box become their mean, and the tris left with three different cells are kept, once each
+static void clusterMesh(const Mesh& mesh, const MeshSource& source, const BLAS& blas, float cell, MeshLOD& lod) {
+    std::unordered_map<glm::ivec3, int, CornerHash> cluster_IDs;
+    std::vector<int> cluster_of(source.num_vertices);
+    std::vector<int> counts;
+    for (int v = 0; v < source.num_vertices; ++v) {
+        const int vertex_ID = source.vertex_offset + v;
+        const glm::ivec3 key = glm::ivec3(glm::floor((mesh.positions[vertex_ID] - blas.AABB_min) / cell));
+        auto inserted = cluster_IDs.insert(std::make_pair(key, (int)counts.size()));
+        if (inserted.second) {
+            counts.push_back(0);
+            lod.positions.push_back(glm::vec3(0.0f));
+            lod.normals.push_back(glm::vec3(0.0f));
+            lod.uvs.push_back(glm::vec2(0.0f));
+        }
+        const int c = inserted.first->second;
+        cluster_of[v] = c;
+        counts[c]++;
+        lod.positions[c] += mesh.positions[vertex_ID];
+        lod.normals[c] += mesh.normals[vertex_ID];
+        lod.uvs[c] += mesh.uvs[vertex_ID];
+    }
+    for (int c = 0; c < counts.size(); ++c) {
+        lod.positions[c] /= (float)counts[c];
+        lod.uvs[c] /= (float)counts[c];
+        const float length = glm::length(lod.normals[c]);
+        lod.normals[c] = length > 0.0f ? lod.normals[c] / length : glm::vec3(0.0f);
+    }
+
+    std::unordered_set<glm::ivec3, CornerHash> kept;
+    for (int t = blas.tri_offset; t < blas.tri_offset + blas.num_tris; ++t) {
+        const glm::ivec3 tri = glm::ivec3(cluster_of[mesh.indices[t].x - source.vertex_offset], cluster_of[mesh.indices[t].y - source.vertex_offset],
+            cluster_of[mesh.indices[t].z - source.vertex_offset]);
+        if (tri.x == tri.y || tri.y == tri.z || tri.x == tri.z) {
+            continue;
+        }
+        glm::ivec3 sorted = tri;
+        std::sort(&sorted[0], &sorted[0] + 3);
+        if (kept.insert(sorted).second) {
+            lod.indices.push_back(tri);
+        }
+    }
+    lod.spacing = meanEdgeLength(lod.positions.data(), lod.indices.data(), lod.indices.size(), 0);
+}
+
+// LODS, coarser copies of the meshes that ask for them. level k clusters the full mesh on a grid
+// 2^k times its mean edge length, and each level becomes a BLAS of its own after the scene's, chained
+// off the mesh's through lod_next for selectLOD. a level that doesn't drop a quarter of the tris of
+// the one before is skipped. emissive meshes keep their full tris only, their lights are those tris
+void Scene::buildMeshLODs() {
+    ProfileRange range("build mesh LODs");
+    const int num_sources = blases.size();
+    std::vector<bool> emissive(num_sources, false);
+    for (const Geom& geom : geoms) {
+        if (geom.type == MESH && materials[geom.materialid].emittance > 0.0f) {
+            emissive[geom.blas_ID] = true;
+        }
+    }
+
+    std::vector<std::vector<MeshLOD>> lods(num_sources);
+    utilityCore::parallelFor(num_sources, [&](int i) {
+        const MeshSource& source = mesh_sources[i];
+        BLAS& blas = blases[i];
+        if (source.lod_levels == 0 || blas.num_tris == 0 || emissive[i]) {
+            return;
+        }
+        blas.lod_spacing = meanEdgeLength(mesh.positions.data() + source.vertex_offset, mesh.indices.data() + blas.tri_offset, blas.num_tris, source.vertex_offset);
+        int last_tris = blas.num_tris;
+        for (int level = 1; level <= source.lod_levels && blas.lod_spacing > 0.0f; ++level) {
+            MeshLOD lod;
+            lod.level = level;
+            clusterMesh(mesh, source, blas, blas.lod_spacing * (float)(1 << level), lod);
+            if (lod.indices.empty()) {
+                break;
+            }
+            if (lod.indices.size() <= 3 * last_tris / 4) {
+                last_tris = lod.indices.size();
+                lods[i].push_back(std::move(lod));
+            }
+        }
+    });
+
+    for (int i = 0; i < num_sources; ++i) {
+        if (emissive[i] && mesh_sources[i].lod_levels > 0) {
+            cout << "WARNING: " << mesh_sources[i].path << " is emissive, its LODS are ignored" << endl;
+        }
+        int coarser_of = i;
+        for (MeshLOD& lod : lods[i]) {
+            MeshSource source;
+            source.path = mesh_sources[i].path + "#lod" + std::to_string(lod.level);
+            source.lod_of = i;
+            source.vertex_offset = mesh.positions.size();
+            source.num_vertices = lod.positions.size();
+
+            BLAS blas;
+            blas.tri_offset = num_tris;
+            blas.num_tris = lod.indices.size();
+            blas.num_nodes = 0;
+            blas.node_offset = 0;
+            blas.wide_node_offset = -1;
+            blas.top_slot = -1;
+            blas.AABB_min = glm::vec3(FLT_MAX);
+            blas.AABB_max = glm::vec3(-FLT_MAX);
+            for (const glm::vec3& p : lod.positions) {
+                blas.AABB_min = glm::min(blas.AABB_min, p);
+                blas.AABB_max = glm::max(blas.AABB_max, p);
+            }
+            blas.lod_next = -1;
+            blas.lod_spacing = lod.spacing;
+            snapToVertexGrid(lod.positions.data(), lod.positions.size(), blas.AABB_min, blas.AABB_max, blas);
+
+            mesh.positions.insert(mesh.positions.end(), lod.positions.begin(), lod.positions.end());
+            mesh.normals.insert(mesh.normals.end(), lod.normals.begin(), lod.normals.end());
+            mesh.uvs.insert(mesh.uvs.end(), lod.uvs.begin(), lod.uvs.end());
+            for (const glm::ivec3& tri : lod.indices) {
+                const glm::vec3& p0 = lod.positions[tri.x];
+                const glm::vec3& p1 = lod.positions[tri.y];
+                const glm::vec3& p2 = lod.positions[tri.z];
+                TriBounds bounds;
+                bounds.tri_ID = mesh.indices.size();
+                bounds.AABB_max = glm::max(glm::max(p0, p1), p2);
+                bounds.AABB_min = glm::min(glm::min(p0, p1), p2);
+                bounds.AABB_centroid = (p0 + p1 + p2) / 3.0f;
+                tri_bounds.push_back(bounds);
+                mesh.indices.push_back(tri + glm::ivec3(source.vertex_offset));
+            }
+            num_tris += blas.num_tris;
+
+            blases[coarser_of].lod_next = blases.size();
+            coarser_of = blases.size();
+            cout << "LOD " << lod.level << " of " << mesh_sources[i].path << ": " << blas.num_tris << " tris, mean edge " << lod.spacing << endl;
+            blases.push_back(blas);
+            mesh_sources.push_back(source);
+        }
+    }
+}
+
+// writes the cache of every mesh that was parsed and built this run, see meshCachePath
+void Scene::writeMeshCaches() {
+    for (int i = 0; i < blases.size(); ++i) {
+        const BLAS& blas = blases[i];
+        const MeshSource& source = mesh_sources[i];
+        if (source.cached || source.lod_of != -1) {
+            continue;
+        }
+
+        MeshCacheHeader header = meshCacheKey(source.hash, bvh_settings);
+        header.num_vertices = source.num_vertices;
+        header.num_tris = blas.num_tris;
+        header.num_nodes = bvh_settings.builder == BVH_LBVH ? 0 : blas.num_nodes;
+        header.AABB_min = blas.AABB_min;
+        header.AABB_max = blas.AABB_max;
+
+        std::vector<glm::ivec3> indices(mesh.indices.begin() + blas.tri_offset, mesh.indices.begin() + blas.tri_offset + blas.num_tris);
+        for (glm::ivec3& tri : indices) {
+            tri -= glm::ivec3(source.vertex_offset);
+        }
+
+        // a shared entry is written under a name of its own and renamed into place, so a node
+        // reading it never sees half of one
+        const std::string path = meshCachePath(source.path, meshCacheKey(source.hash, bvh_settings), bvh_settings);
+        const bool shared = !bvh_settings.cache_dir.empty();
+        const std::string written = shared ? path + ".tmp" + std::to_string(std::random_device()()) : path;
+        std::ofstream file(written, std::ios::binary);
+        if (file.is_open()) {
+            file.write((const char*)&header, sizeof(header));
+            writeCacheArray(file, mesh.positions.data() + source.vertex_offset, source.num_vertices);
+            writeCacheArray(file, mesh.normals.data() + source.vertex_offset, source.num_vertices);
+            writeCacheArray(file, mesh.uvs.data() + source.vertex_offset, source.num_vertices);
+            writeCacheArray(file, indices.data(), blas.num_tris);
+            writeCacheArray(file, bvh_nodes_gpu.data() + blas.node_offset, header.num_nodes);
+        }
+        bool good = file.is_open() && file.good();
+        file.close();
+        if (shared) {
+            // a rename over an entry another node just published is fine, the bytes are the same
+            good = good && (rename(written.c_str(), path.c_str()) == 0 || utilityCore::fileModifiedTime(path) != 0);
+            remove(written.c_str());
+            remove((path + ".lock").c_str());
+        }
+        if (!good) {
+            cout << "WARNING: could not write mesh cache " << path << endl;
+        }
+        else {
+            cout << "Wrote mesh cache " << path << " for " << source.path << endl;
+        }
+    }
+}
+
+// Drops everything pathtraceInit uploaded that the host never reads again, the mesh and
+// every BVH. geoms, lights, materials and blases stay, they're small and read while rendering
+void Scene::releaseHostGeometry() {
+    size_t bytes = mesh.positions.capacity() * sizeof(glm::vec3) + mesh.normals.capacity() * sizeof(glm::vec3)
+        + mesh.uvs.capacity() * sizeof(glm::vec2) + mesh.indices.capacity() * sizeof(glm::ivec3)
+        + bvh_nodes_gpu.capacity() * sizeof(BVHNode_GPU) + wide_bvh_nodes_gpu.capacity() * sizeof(WideBVHNode_GPU)
+        + tlas_nodes_gpu.capacity() * sizeof(BVHNode_GPU)
+        + curve_segments.capacity() * sizeof(CurveSegment) + curve_nodes.capacity() * sizeof(BVHNode_GPU);
+    for (Texture& texture : textures) {
+        for (std::vector<unsigned char>& level : texture.levels) {
+            bytes += level.capacity();
+            utilityCore::freeVector(level);
+        }
+    }
+    bytes += environment.texels.capacity() * sizeof(glm::vec4)
+        + (environment.marginal_cdf.capacity() + environment.conditional_cdf.capacity()) * sizeof(float);
+    utilityCore::freeVector(environment.texels);
+    utilityCore::freeVector(environment.marginal_cdf);
+    utilityCore::freeVector(environment.conditional_cdf);
+    utilityCore::freeVector(mesh.positions);
+    utilityCore::freeVector(mesh.normals);
+    utilityCore::freeVector(mesh.uvs);
+    utilityCore::freeVector(mesh.indices);
+    utilityCore::freeVector(bvh_nodes_gpu);
+    utilityCore::freeVector(wide_bvh_nodes_gpu);
+    utilityCore::freeVector(tlas_nodes_gpu);
+    utilityCore::freeVector(curve_segments);
+    utilityCore::freeVector(curve_nodes);
+    host_geometry_released = true;
+    cout << "Released " << bytes / (1024 * 1024) << " MB of host geometry" << endl;
+}
+
+void Scene::updateCameraBasis(Camera& camera) {
+    camera.view = glm::normalize(camera.lookAt - camera.position);
+    camera.right = glm::normalize(glm::cross(camera.view, camera.up));
+    camera.up = glm::cross(camera.right, camera.view);
+}
+
+int Scene::loadCamera() {
+    cout << "Loading Camera ..." << endl;
+    RenderState &state = this->state;
+    Camera &camera = state.camera;
+    float fovy;
+
+    //load static properties
+    for (int i = 0; i < 7; i++) {
+        string line;
+        fp_in.getline(line);
+        const vector<string>& tokens = fp_in.tokenize(line);
+        if (strcmp(tokens[0].c_str(), "RES") == 0) {
+            camera.resolution.x = atoi(tokens[1].c_str());
+            camera.resolution.y = atoi(tokens[2].c_str());
+        } else if (strcmp(tokens[0].c_str(), "FOVY") == 0) {
+            fovy = atof(tokens[1].c_str());
+        } else if (strcmp(tokens[0].c_str(), "ITERATIONS") == 0) {
+            state.iterations = atoi(tokens[1].c_str());
+        } else if (strcmp(tokens[0].c_str(), "DEPTH") == 0) {
+            state.traceDepth = atoi(tokens[1].c_str());
+        } else if (strcmp(tokens[0].c_str(), "FILE") == 0) {
+            state.imageName = tokens[1];
+        }
+        else if (strcmp(tokens[0].c_str(), "FOCAL_DISTANCE") == 0) {
+            camera.focal_distance = atof(tokens[1].c_str());
+        }
+        else if (strcmp(tokens[0].c_str(), "LENS_RADIUS") == 0) {
+            camera.lens_radius = atof(tokens[1].c_str());
+        }
+    }
+
+    string line;
+    fp_in.getline(line);
+    while (!line.empty() && fp_in.good()) {
+        const vector<string>& tokens = fp_in.tokenize(line);
+        if (strcmp(tokens[0].c_str(), "EYE") == 0) {
+            camera.position = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+        } else if (strcmp(tokens[0].c_str(), "LOOKAT") == 0) {
+            camera.lookAt = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+        } else if (strcmp(tokens[0].c_str(), "UP") == 0) {
+            camera.up = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+        }
+
+        fp_in.getline(line);
+    }
+
+    //calculate fov based on resolution
+    float yscaled = tan(fovy * (PI / 180));
+    float xscaled = (yscaled * camera.resolution.x) / camera.resolution.y;
+    float fovx = (atan(xscaled) * 180) / PI;
+    camera.fov = glm::vec2(fovx, fovy);
+
+    camera.pixelLength = glm::vec2(2 * xscaled / (float)camera.resolution.x,
+                                   2 * yscaled / (float)camera.resolution.y);
+
+    updateCameraBasis(camera);
+
+    //set up render camera stuff
+    int arraylen = parse_only ? 0 : camera.resolution.x * camera.resolution.y;
+    state.image.resize(arraylen);
+    std::fill(state.image.begin(), state.image.end(), glm::vec3());
+
+    cout << "Loaded camera!" << endl;
+    return 1;
+}
+
+// FILE is an equirectangular image, .hdr keeps its range and LDR formats are linearized by
+// stb_image. INTENSITY scales it
+int Scene::loadEnvironment() {
+    cout << "Loading Environment ..." << endl;
+    string line;
+    fp_in.getline(line);
+    while (!line.empty() && fp_in.good()) {
+        const vector<string>& tokens = fp_in.tokenize(line);
+        if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "FILE") == 0) {
+            environment.path = tokens[1];
+        }
+        else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "INTENSITY") == 0) {
+            environment.intensity = atof(tokens[1].c_str());
+        }
+        else if (tokens.size() >= 9 && strcmp(tokens[0].c_str(), "PORTAL") == 0) {
+            // translation, rotation and the x y scale of a unit squareplane facing +z
+            glm::vec3 t(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+            glm::vec3 r(atof(tokens[4].c_str()), atof(tokens[5].c_str()), atof(tokens[6].c_str()));
+            glm::vec3 sc(atof(tokens[7].c_str()), atof(tokens[8].c_str()), 1.0f);
+            glm::mat4 transform = utilityCore::buildTransformationMatrix(t, r, sc);
+            EnvironmentPortal portal;
+            portal.corner = glm::vec3(transform * glm::vec4(-0.5f, -0.5f, 0.0f, 1.0f));
+            portal.edge_u = glm::vec3(transform * glm::vec4(1.0f, 0.0f, 0.0f, 0.0f));
+            portal.edge_v = glm::vec3(transform * glm::vec4(0.0f, 1.0f, 0.0f, 0.0f));
+            portal.normal = glm::normalize(glm::vec3(glm::inverseTranspose(transform) * glm::vec4(0.0f, 0.0f, 1.0f, 0.0f)));
+            portal.area = glm::length(portal.edge_u) * glm::length(portal.edge_v);
+            if (portal.area > 0.0f) {
+                environment.portals.push_back(portal);
+            }
+        }
+        fp_in.getline(line);
+    }
+    if (parse_only) {
+        return 1;
+    }
+
+    int width, height, channels;
+    float* pixels = environment.path.empty() ? NULL : stbi_loadf(environment.path.c_str(), &width, &height, &channels, 3);
+    if (pixels == NULL) {
+        cout << "WARNING: could not read environment map " << environment.path << ", ignoring it" << endl;
+        environment = Environment();
+        return -1;
+    }
+    environment.width = width;
+    environment.height = height;
+    environment.texels.resize(width * height);
+    for (int i = 0; i < width * height; i++) {
+        environment.texels[i] = glm::vec4(pixels[3 * i], pixels[3 * i + 1], pixels[3 * i + 2], 0.0f);
+    }
+    stbi_image_free(pixels);
+
+    // texels are weighted by the solid angle their row covers, rows that are all black get a
+    // uniform cdf so it's still well formed but the marginal never picks them
+    environment.marginal_cdf.assign(height + 1, 0.0f);
+    environment.conditional_cdf.assign(height * (width + 1), 0.0f);
+    for (int y = 0; y < height; y++) {
+        float sin_theta = sinf(PI * (y + 0.5f) / height);
+        float* row = &environment.conditional_cdf[y * (width + 1)];
+        for (int x = 0; x < width; x++) {
+            const glm::vec4& c = environment.texels[y * width + x];
+            float luminance = glm::dot(glm::vec3(c), glm::vec3(0.2126f, 0.7152f, 0.0722f));
+            row[x + 1] = row[x] + glm::max(luminance, 0.0f) * sin_theta;
+        }
+        float row_sum = row[width];
+        for (int x = 1; x <= width; x++) {
+            row[x] = row_sum > 0.0f ? row[x] / row_sum : (float)x / width;
+        }
+        environment.marginal_cdf[y + 1] = environment.marginal_cdf[y] + row_sum;
+    }
+    float total = environment.marginal_cdf[height];
+    for (int y = 1; y <= height; y++) {
+        environment.marginal_cdf[y] = total > 0.0f ? environment.marginal_cdf[y] / total : (float)y / height;
+    }
+
+    cout << "Loaded environment map " << environment.path << " (" << width << "x" << height << ")" << endl;
+    return 1;
+}
+
+int Scene::loadSettings() {
+    cout << "Loading Settings ..." << endl;
+    string line;
+    fp_in.getline(line);
+    while (!line.empty() && fp_in.good()) {
+        const vector<string>& tokens = fp_in.tokenize(line);
+        if (tokens.size() < 2 || !applySetting(tokens)) {
+            cout << "WARNING: ignoring unknown setting " << line << endl;
+        }
+        setting_lines.push_back(line);
+        fp_in.getline(line);
+    }
+    return 1;
+}
+
+// ENABLE_<geom type> settings, geoms of a disabled type are skipped by intersection
+static void setGeomEnabled(RenderSettings& settings, GeomType type, bool enabled) {
+    if (enabled) {
+        settings.geom_mask |= 1u << type;
+    }
+    else {
+        settings.geom_mask &= ~(1u << type);
+    }
+}
+
+bool Scene::applySetting(const vector<string>& tokens) {
+    if (strcmp(tokens[0].c_str(), "BVH_BUILDER") == 0) {
+        if (strcmp(tokens[1].c_str(), "SAH") == 0 || strcmp(tokens[1].c_str(), "sah") == 0) {
+            bvh_settings.builder = BVH_SAH;
+        }
+        else if (strcmp(tokens[1].c_str(), "MIDPOINT") == 0 || strcmp(tokens[1].c_str(), "midpoint") == 0) {
+            bvh_settings.builder = BVH_MIDPOINT;
+        }
+        else if (strcmp(tokens[1].c_str(), "LBVH") == 0 || strcmp(tokens[1].c_str(), "lbvh") == 0) {
+            bvh_settings.builder = BVH_LBVH;
+        }
+        else if (strcmp(tokens[1].c_str(), "SBVH") == 0 || strcmp(tokens[1].c_str(), "sbvh") == 0) {
+            bvh_settings.builder = BVH_SBVH;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_BINS") == 0) {
+        bvh_settings.sah_bins = glm::clamp(atoi(tokens[1].c_str()), 2, MAX_SAH_BINS);
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_MAX_LEAF_SIZE") == 0) {
+        bvh_settings.max_leaf_size = glm::max(atoi(tokens[1].c_str()), 1);
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_SPLIT_BUDGET") == 0) {
+        bvh_settings.split_budget = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_AREA_ORDER") == 0) {
+        bvh_settings.area_order = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_WIDE") == 0) {
+        bvh_settings.wide = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "FREE_HOST_GEOMETRY") == 0) {
+        render_settings.free_host_geometry = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "MANAGED_GEOMETRY") == 0) {
+        render_settings.managed_geometry = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "MEMORY_RESERVE") == 0) {
+        render_settings.memory_reserve = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "VIRTUAL_TEXTURES") == 0) {
+        render_settings.virtual_textures = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "TESSELLATION_RATE") == 0) {
+        render_settings.tessellation_rate = glm::max((float)atof(tokens[1].c_str()), 0.25f);
+    }
+    else if (strcmp(tokens[0].c_str(), "STREAM_MESHES") == 0) {
+        render_settings.stream_meshes = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "WATCH_SCENE") == 0) {
+        render_settings.watch_scene = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "REMOTE_QUALITY") == 0) {
+        render_settings.remote_quality = glm::clamp(atoi(tokens[1].c_str()), 1, 100);
+    }
+    else if (strcmp(tokens[0].c_str(), "DISPLAY_SURFACE") == 0) {
+        render_settings.display_surface = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "RENDER_THREAD") == 0) {
+        render_settings.render_thread = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_REFIT_REBUILD") == 0) {
+        bvh_settings.refit_rebuild = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_CACHE") == 0) {
+        bvh_settings.cache = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_CACHE_DIR") == 0) {
+        bvh_settings.cache_dir = tokens[1];
+        bvh_settings.cache = true;
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_REPORT") == 0) {
+        bvh_settings.report = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "BVH_PROGRESSIVE") == 0) {
+        bvh_settings.progressive = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "SORT_MATERIALS") == 0) {
+        render_settings.sort_by_material = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "SHADE_BY_BSDF") == 0) {
+        render_settings.shade_by_bsdf = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "COMPACT_LIGHT_RAYS") == 0) {
+        render_settings.compact_light_rays = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "REUSE_BSDF_RAY") == 0) {
+        render_settings.reuse_bsdf_ray = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "SORT_RAYS") == 0) {
+        render_settings.sort_rays = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "BLOCKING_TIMERS") == 0) {
+        render_settings.blocking_timers = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "CUDA_GRAPH") == 0) {
+        render_settings.cuda_graph = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "OVERLAP_TILES") == 0) {
+        render_settings.overlap_tiles = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "AUTO_TUNE") == 0) {
+        render_settings.auto_tune = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "BLOCK_SIZE") == 0) {
+        // BLOCK_SIZE <kernel or all> <threads>
+        if (tokens.size() < 3) {
+            return false;
+        }
+        const int block_size = glm::clamp(atoi(tokens[2].c_str()), 0, 1024);
+        bool found = false;
+        for (int k = 0; k < NUM_LAUNCH_KERNELS; k++) {
+            if (strcmp(tokens[1].c_str(), "all") == 0 || strcmp(tokens[1].c_str(), launchKernelName(k)) == 0) {
+                render_settings.block_sizes[k] = block_size;
+                found = true;
+            }
+        }
+        return found;
+    }
+    else if (strcmp(tokens[0].c_str(), "ADAPTIVE_THRESHOLD") == 0) {
+        render_settings.adaptive_threshold = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "ADAPTIVE_MIN_SPP") == 0) {
+        render_settings.adaptive_min_spp = glm::max(atoi(tokens[1].c_str()), 2);
+    }
+    else if (strcmp(tokens[0].c_str(), "TIME_BUDGET") == 0) {
+        render_settings.time_budget = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "CHECKPOINT_INTERVAL") == 0) {
+        render_settings.checkpoint_interval = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "SAVE_INTERVAL") == 0) {
+        render_settings.save_interval = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "NOISE_TARGET") == 0) {
+        render_settings.noise_target = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "SAMPLE_STATS") == 0) {
+        render_settings.sample_stats = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "NUM_GPUS") == 0) {
+        render_settings.num_gpus = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "SHARD_GEOMETRY") == 0) {
+        render_settings.shard_geometry = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "TILE_SIZE") == 0) {
+        render_settings.tile_size = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "TILE_ORDER") == 0) {
+        if (strcmp(tokens[1].c_str(), "SCANLINE") == 0 || strcmp(tokens[1].c_str(), "scanline") == 0) {
+            render_settings.tile_order = TILE_SCANLINE;
+        }
+        else if (strcmp(tokens[1].c_str(), "CENTER") == 0 || strcmp(tokens[1].c_str(), "center") == 0) {
+            render_settings.tile_order = TILE_CENTER;
+        }
+        else if (strcmp(tokens[1].c_str(), "CURSOR") == 0 || strcmp(tokens[1].c_str(), "cursor") == 0) {
+            render_settings.tile_order = TILE_CURSOR;
+        }
+        else if (strcmp(tokens[1].c_str(), "VARIANCE") == 0 || strcmp(tokens[1].c_str(), "variance") == 0) {
+            render_settings.tile_order = TILE_VARIANCE;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "CROP") == 0 && tokens.size() >= 5) {
+        render_settings.crop = glm::max(glm::ivec4(atoi(tokens[1].c_str()), atoi(tokens[2].c_str()), atoi(tokens[3].c_str()), atoi(tokens[4].c_str())), glm::ivec4(0));
+    }
+    else if (strcmp(tokens[0].c_str(), "SAMPLES_PER_ITERATION") == 0) {
+        render_settings.samples_per_iteration = glm::max(atoi(tokens[1].c_str()), 1);
+    }
+    else if (strcmp(tokens[0].c_str(), "CACHE_FIRST_BOUNCE") == 0) {
+        render_settings.cache_first_bounce = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "FIRST_BOUNCE_PATTERNS") == 0) {
+        render_settings.first_bounce_patterns = glm::max(atoi(tokens[1].c_str()), 1);
+    }
+    else if (strcmp(tokens[0].c_str(), "PREVIEW_SCALE") == 0) {
+        render_settings.preview_scale = glm::max(atoi(tokens[1].c_str()), 1);
+    }
+    else if (strcmp(tokens[0].c_str(), "PREVIEW_DEPTH") == 0) {
+        render_settings.preview_depth = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "PREVIEW_IDLE") == 0) {
+        render_settings.preview_idle = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "ITERATIONS_PER_FRAME") == 0) {
+        render_settings.iterations_per_frame = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "FRAME_TIME_TARGET") == 0) {
+        render_settings.frame_time_target = glm::max((float)atof(tokens[1].c_str()), 1.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "LAUNCH_SLICE_MS") == 0) {
+        render_settings.launch_slice_ms = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "TONEMAP") == 0) {
+        if (strcmp(tokens[1].c_str(), "REINHARD") == 0 || strcmp(tokens[1].c_str(), "reinhard") == 0) {
+            render_settings.tonemap = TONEMAP_REINHARD;
+        }
+        else if (strcmp(tokens[1].c_str(), "ACES") == 0 || strcmp(tokens[1].c_str(), "aces") == 0) {
+            render_settings.tonemap = TONEMAP_ACES;
+        }
+        else if (strcmp(tokens[1].c_str(), "FILMIC") == 0 || strcmp(tokens[1].c_str(), "filmic") == 0) {
+            render_settings.tonemap = TONEMAP_FILMIC;
+        }
+        else if (strcmp(tokens[1].c_str(), "LINEAR") == 0 || strcmp(tokens[1].c_str(), "linear") == 0) {
+            render_settings.tonemap = TONEMAP_LINEAR;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "EXPOSURE") == 0) {
+        render_settings.exposure = (float)atof(tokens[1].c_str());
+    }
+    else if (strcmp(tokens[0].c_str(), "AUTO_EXPOSURE") == 0) {
+        render_settings.auto_exposure = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "DENOISE") == 0) {
+        render_settings.denoise = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "DENOISE_INTERVAL") == 0) {
+        render_settings.denoise_interval = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "ATROUS_ITERATIONS") == 0) {
+        render_settings.atrous_iterations = glm::clamp(atoi(tokens[1].c_str()), 0, 10);
+    }
+    else if (strcmp(tokens[0].c_str(), "ATROUS_SIGMA_COLOR") == 0) {
+        render_settings.atrous_sigma_color = glm::max((float)atof(tokens[1].c_str()), 1e-3f);
+    }
+    else if (strcmp(tokens[0].c_str(), "ATROUS_SIGMA_NORMAL") == 0) {
+        render_settings.atrous_sigma_normal = glm::max((float)atof(tokens[1].c_str()), 1e-3f);
+    }
+    else if (strcmp(tokens[0].c_str(), "ATROUS_SIGMA_POSITION") == 0) {
+        render_settings.atrous_sigma_position = glm::max((float)atof(tokens[1].c_str()), 1e-3f);
+    }
+    else if (strcmp(tokens[0].c_str(), "TEMPORAL_HISTORY") == 0) {
+        render_settings.temporal_history = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "FUSED_SHADING") == 0) {
+        render_settings.fused_shading = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "ROULETTE_START_DEPTH") == 0) {
+        render_settings.roulette_start_depth = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "ROULETTE_MIN_SURVIVAL") == 0) {
+        render_settings.roulette_min_survival = glm::clamp((float)atof(tokens[1].c_str()), 0.0f, 1.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "DIFFUSE_DEPTH") == 0) {
+        render_settings.diffuse_depth = glm::clamp(atoi(tokens[1].c_str()), 0, 255);
+    }
+    else if (strcmp(tokens[0].c_str(), "GLOSSY_DEPTH") == 0) {
+        render_settings.glossy_depth = glm::clamp(atoi(tokens[1].c_str()), 0, 255);
+    }
+    else if (strcmp(tokens[0].c_str(), "SPECULAR_DEPTH") == 0) {
+        render_settings.specular_depth = glm::clamp(atoi(tokens[1].c_str()), 0, 255);
+    }
+    else if (strcmp(tokens[0].c_str(), "INDIRECT_CLAMP") == 0) {
+        render_settings.indirect_clamp = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "LIGHT_SAMPLES") == 0) {
+        render_settings.light_samples = glm::max(atoi(tokens[1].c_str()), 1);
+    }
+    else if (strcmp(tokens[0].c_str(), "RESTIR") == 0) {
+        render_settings.restir = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "RESTIR_CANDIDATES") == 0) {
+        render_settings.restir_candidates = glm::clamp(atoi(tokens[1].c_str()), 1, 64);
+    }
+    else if (strcmp(tokens[0].c_str(), "RESTIR_SPATIAL") == 0) {
+        render_settings.restir_spatial = glm::clamp(atoi(tokens[1].c_str()), 0, 8);
+    }
+    else if (strcmp(tokens[0].c_str(), "PATH_GUIDING") == 0) {
+        render_settings.path_guiding = glm::clamp(atoi(tokens[1].c_str()), 0, MAX_GUIDE_RESOLUTION);
+    }
+    else if (strcmp(tokens[0].c_str(), "GUIDE_FRACTION") == 0) {
+        render_settings.guide_fraction = glm::clamp((float)atof(tokens[1].c_str()), 0.0f, 0.9f);
+    }
+    else if (strcmp(tokens[0].c_str(), "RADIANCE_CACHE") == 0) {
+        render_settings.radiance_cache = glm::clamp(atoi(tokens[1].c_str()), 0, MAX_RADIANCE_CACHE_RESOLUTION);
+    }
+    else if (strcmp(tokens[0].c_str(), "CAUSTIC_PHOTONS") == 0) {
+        render_settings.caustic_photons = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "CAUSTIC_RADIUS") == 0) {
+        render_settings.caustic_radius = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "BDPT") == 0) {
+        render_settings.bdpt = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "OUTLIER_BUCKETS") == 0) {
+        const int buckets = atoi(tokens[1].c_str());
+        render_settings.outlier_buckets = buckets > 0 ? glm::clamp(buckets, 3, MAX_OUTLIER_BUCKETS) : 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "REGENERATE_PATHS") == 0) {
+        render_settings.regenerate_paths = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "RASTER_PRIMARY") == 0) {
+        render_settings.raster_primary = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "ANTI_ALIASING") == 0) {
+        render_settings.anti_aliasing = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "SAMPLER") == 0) {
+        if (strcmp(tokens[1].c_str(), "RANDOM") == 0 || strcmp(tokens[1].c_str(), "random") == 0) {
+            render_settings.sampler = SAMPLER_RANDOM;
+        }
+        else if (strcmp(tokens[1].c_str(), "SOBOL") == 0 || strcmp(tokens[1].c_str(), "sobol") == 0) {
+            render_settings.sampler = SAMPLER_SOBOL;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "LIGHT_SAMPLER") == 0) {
+        if (strcmp(tokens[1].c_str(), "POWER") == 0 || strcmp(tokens[1].c_str(), "power") == 0) {
+            render_settings.light_sampler = LIGHT_POWER;
+        }
+        else if (strcmp(tokens[1].c_str(), "BVH") == 0 || strcmp(tokens[1].c_str(), "bvh") == 0) {
+            render_settings.light_sampler = LIGHT_BVH;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "PIXEL_FILTER") == 0) {
+        if (strcmp(tokens[1].c_str(), "BOX") == 0 || strcmp(tokens[1].c_str(), "box") == 0) {
+            render_settings.pixel_filter = FILTER_BOX;
+        }
+        else if (strcmp(tokens[1].c_str(), "TENT") == 0 || strcmp(tokens[1].c_str(), "tent") == 0) {
+            render_settings.pixel_filter = FILTER_TENT;
+        }
+        else if (strcmp(tokens[1].c_str(), "GAUSSIAN") == 0 || strcmp(tokens[1].c_str(), "gaussian") == 0) {
+            render_settings.pixel_filter = FILTER_GAUSSIAN;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "PATH_ORDER") == 0) {
+        if (strcmp(tokens[1].c_str(), "SCANLINE") == 0 || strcmp(tokens[1].c_str(), "scanline") == 0) {
+            render_settings.path_order = PATH_SCANLINE;
+        }
+        else if (strcmp(tokens[1].c_str(), "TILES") == 0 || strcmp(tokens[1].c_str(), "tiles") == 0) {
+            render_settings.path_order = PATH_TILES;
+        }
+        else if (strcmp(tokens[1].c_str(), "MORTON") == 0 || strcmp(tokens[1].c_str(), "morton") == 0) {
+            render_settings.path_order = PATH_MORTON;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "CAPTURE_RAYS") == 0) {
+        if (tokens.size() < 3) {
+            return false;
+        }
+        render_settings.capture_iteration = glm::max(atoi(tokens[1].c_str()), 0);
+        render_settings.capture_bounce = glm::max(atoi(tokens[2].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "PROBE_SAMPLES") == 0) {
+        render_settings.probe_samples = glm::max(atoi(tokens[1].c_str()), 1);
+    }
+    else if (strcmp(tokens[0].c_str(), "FILTER_RADIUS") == 0) {
+        render_settings.filter_radius = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "DEBUG_VIEW") == 0) {
+        if (strcmp(tokens[1].c_str(), "NONE") == 0 || strcmp(tokens[1].c_str(), "none") == 0) {
+            render_settings.debug_view = DEBUG_NONE;
+        }
+        else if (strcmp(tokens[1].c_str(), "BVH_NODES") == 0 || strcmp(tokens[1].c_str(), "bvh_nodes") == 0) {
+            render_settings.debug_view = DEBUG_BVH_NODES;
+        }
+        else if (strcmp(tokens[1].c_str(), "TRI_TESTS") == 0 || strcmp(tokens[1].c_str(), "tri_tests") == 0) {
+            render_settings.debug_view = DEBUG_TRI_TESTS;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "HEATMAP_MAX") == 0) {
+        render_settings.heatmap_max = glm::max((float)atof(tokens[1].c_str()), 1.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "SHADING_MODE") == 0) {
+        if (strcmp(tokens[1].c_str(), "FULL") == 0 || strcmp(tokens[1].c_str(), "full") == 0) {
+            render_settings.shading_mode = SHADING_FULL;
+        }
+        else if (strcmp(tokens[1].c_str(), "ALBEDO") == 0 || strcmp(tokens[1].c_str(), "albedo") == 0) {
+            render_settings.shading_mode = SHADING_ALBEDO;
+        }
+        else if (strcmp(tokens[1].c_str(), "NORMALS") == 0 || strcmp(tokens[1].c_str(), "normals") == 0) {
+            render_settings.shading_mode = SHADING_NORMALS;
+        }
+        else if (strcmp(tokens[1].c_str(), "AO") == 0 || strcmp(tokens[1].c_str(), "ao") == 0) {
+            render_settings.shading_mode = SHADING_AO;
+        }
+        else if (strcmp(tokens[1].c_str(), "DIRECT") == 0 || strcmp(tokens[1].c_str(), "direct") == 0) {
+            render_settings.shading_mode = SHADING_DIRECT;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "AO_DISTANCE") == 0) {
+        render_settings.ao_distance = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "DETERMINISTIC") == 0) {
+        render_settings.deterministic = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "VIEWS") == 0) {
+        if (strcmp(tokens[1].c_str(), "NONE") == 0 || strcmp(tokens[1].c_str(), "none") == 0) {
+            render_settings.views = VIEWS_NONE;
+        }
+        else if (strcmp(tokens[1].c_str(), "STEREO") == 0 || strcmp(tokens[1].c_str(), "stereo") == 0) {
+            render_settings.views = VIEWS_STEREO;
+        }
+        else if (strcmp(tokens[1].c_str(), "CUBEMAP") == 0 || strcmp(tokens[1].c_str(), "cubemap") == 0) {
+            render_settings.views = VIEWS_CUBEMAP;
+        }
+        else if (strcmp(tokens[1].c_str(), "EQUIRECT") == 0 || strcmp(tokens[1].c_str(), "equirect") == 0) {
+            render_settings.views = VIEWS_EQUIRECT;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "EYE_SEPARATION") == 0) {
+        render_settings.eye_separation = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "BAKE") == 0) {
+        render_settings.bake_object = glm::max(atoi(tokens[1].c_str()), -1);
+    }
+    else if (strcmp(tokens[0].c_str(), "OPTIX") == 0) {
+        render_settings.optix = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "ENABLE_BVH_ACCEL") == 0) {
+        render_settings.bvh_accel = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "MESH_LOD_BIAS") == 0) {
+        render_settings.lod_bias = glm::max((float)atof(tokens[1].c_str()), 0.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "SHUTTER") == 0) {
+        render_settings.shutter = glm::clamp((float)atof(tokens[1].c_str()), 0.0f, 1.0f);
+    }
+    else if (strcmp(tokens[0].c_str(), "SHARED_BVH_LEVELS") == 0) {
+        render_settings.shared_bvh_levels = glm::clamp(atoi(tokens[1].c_str()), 0, 16);
+    }
+    else if (strcmp(tokens[0].c_str(), "STACKLESS_BVH") == 0) {
+        render_settings.stackless_bvh = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "ENABLE_RECTS") == 0) {
+        setGeomEnabled(render_settings, CUBE, atoi(tokens[1].c_str()) != 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "ENABLE_SPHERES") == 0) {
+        setGeomEnabled(render_settings, SPHERE, atoi(tokens[1].c_str()) != 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "ENABLE_SQUAREPLANES") == 0) {
+        setGeomEnabled(render_settings, SQUAREPLANE, atoi(tokens[1].c_str()) != 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "ENABLE_TRIS") == 0) {
+        setGeomEnabled(render_settings, MESH, atoi(tokens[1].c_str()) != 0);
+        setGeomEnabled(render_settings, TRI, atoi(tokens[1].c_str()) != 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "ENABLE_CURVES") == 0) {
+        setGeomEnabled(render_settings, CURVES, atoi(tokens[1].c_str()) != 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "ENABLE_VOLUMES") == 0) {
+        setGeomEnabled(render_settings, VOLUME, atoi(tokens[1].c_str()) != 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "PERSISTENT_THREADS") == 0) {
+        render_settings.persistent_threads = atoi(tokens[1].c_str()) != 0;
+    }
+    else if (strcmp(tokens[0].c_str(), "TAIL_PATHS") == 0) {
+        render_settings.tail_paths = glm::max(atoi(tokens[1].c_str()), 0);
+    }
+    else if (strcmp(tokens[0].c_str(), "TRAVERSAL") == 0) {
+        if (strcmp(tokens[1].c_str(), "THREAD") == 0 || strcmp(tokens[1].c_str(), "thread") == 0) {
+            render_settings.traversal = TRAVERSAL_THREAD;
+        }
+        else if (strcmp(tokens[1].c_str(), "PERSISTENT") == 0 || strcmp(tokens[1].c_str(), "persistent") == 0) {
+            render_settings.traversal = TRAVERSAL_PERSISTENT;
+        }
+        else if (strcmp(tokens[1].c_str(), "SPECULATIVE") == 0 || strcmp(tokens[1].c_str(), "speculative") == 0) {
+            render_settings.traversal = TRAVERSAL_SPECULATIVE;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (strcmp(tokens[0].c_str(), "STREAM_COMPACT") == 0) {
+        if (strcmp(tokens[1].c_str(), "NONE") == 0 || strcmp(tokens[1].c_str(), "none") == 0) {
+            render_settings.compaction = COMPACT_NONE;
+        }
+        else if (strcmp(tokens[1].c_str(), "THRUST") == 0 || strcmp(tokens[1].c_str(), "thrust") == 0) {
+            render_settings.compaction = COMPACT_THRUST;
+        }
+        else if (strcmp(tokens[1].c_str(), "SCAN") == 0 || strcmp(tokens[1].c_str(), "scan") == 0) {
+            render_settings.compaction = COMPACT_SCAN;
+        }
+        else if (strcmp(tokens[1].c_str(), "WARP") == 0 || strcmp(tokens[1].c_str(), "warp") == 0) {
+            render_settings.compaction = COMPACT_WARP;
+        }
+        else {
+            return false;
+        }
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+int Scene::loadMaterial(string materialid) {
+    int id = atoi(materialid.c_str());
+    if (id != materials.size()) {
+        cout << "ERROR: MATERIAL ID does not match expected number of materials" << endl;
+        return -1;
+    } else {
+        cout << "Loading Material " << id << "..." << "\n";
+        Material newMaterial;
+
+        //load static properties
+        for (int i = 0; i < 5; i++) {
+            string line;
+            fp_in.getline(line);
+            const vector<string>& tokens = fp_in.tokenize(line);
+            if (strcmp(tokens[0].c_str(), "R_COLOR") == 0) {
+                glm::vec3 rColor( atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()) );
+                newMaterial.R = rColor;
+            } 
+            else if (strcmp(tokens[0].c_str(), "T_COLOR") == 0) {
+                glm::vec3 tColor(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
+                newMaterial.T = tColor;
+            } 
+            else if (strcmp(tokens[0].c_str(), "DIFFUSE_BRDF") == 0) {
+                newMaterial.type = DIFFUSE_BRDF;
+            }
+            else if (strcmp(tokens[0].c_str(), "DIFFUSE_BTDF") == 0) {
+                newMaterial.type = DIFFUSE_BTDF;
+            }
+            else if (strcmp(tokens[0].c_str(), "SPEC_BRDF") == 0) {
+                newMaterial.type = SPEC_BRDF;
+            }
+            else if (strcmp(tokens[0].c_str(), "SPEC_BTDF") == 0) {
+                newMaterial.type = SPEC_BTDF;
+            }
+            else if (strcmp(tokens[0].c_str(), "SPEC_GLASS") == 0) {
+                newMaterial.type = SPEC_GLASS;
+            }
+            else if (strcmp(tokens[0].c_str(), "SPEC_PLASTIC") == 0) {
+                newMaterial.type = SPEC_PLASTIC;
+            }
+            else if (strcmp(tokens[0].c_str(), "MICROFACET_BRDF") == 0) {
+                newMaterial.type = MIRCROFACET_BRDF;
+            }
+            else if (strcmp(tokens[0].c_str(), "IOR") == 0) {
+                newMaterial.ior = atof(tokens[1].c_str());
+            } 
+            else if (strcmp(tokens[0].c_str(), "EMITTANCE") == 0) {
+                newMaterial.emittance = atof(tokens[1].c_str());
+            }
+        }
+
+        // optional roughness and texture lines follow the five properties, anything else is left for the next block
+        while (fp_in.good()) {
+            size_t line_start = fp_in.tell();
+            string line;
+            fp_in.getline(line);
+            const vector<string>& tokens = fp_in.tokenize(line);
+            if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "ROUGHNESS") == 0) {
+                newMaterial.roughness = glm::clamp((float)atof(tokens[1].c_str()), 0.0f, 1.0f);
+            }
+            else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "ALBEDO_MAP") == 0) {
+                newMaterial.albedo_map = loadTexture(tokens[1], true);
+            }
+            else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "NORMAL_MAP") == 0) {
+                newMaterial.normal_map = loadTexture(tokens[1], false);
+            }
+            else if (tokens.size() >= 2 && strcmp(tokens[0].c_str(), "ALPHA_MAP") == 0) {
+                // alpha reads linear from sRGB textures too, so an ALPHA_MAP of the ALBEDO_MAP's file shares it
+                newMaterial.alpha_map = loadTexture(tokens[1], true);
+                if (tokens.size() >= 3) {
+                    newMaterial.alpha_cutoff = glm::clamp((float)atof(tokens[2].c_str()), 0.0f, 1.0f);
+                }
+            }
+            else {
+                fp_in.seek(line_start);
+                break;
+            }
+        }
+        materials.push_back(newMaterial);
+        return 1;
+    }
+}
+
+static float srgbToLinear(unsigned char c) {
+    float x = c / 255.0f;
+    return x <= 0.04045f ? x / 12.92f : powf((x + 0.055f) / 1.055f, 2.4f);
+}
+
+static unsigned char linearToSrgb(float x) {
+    x = x <= 0.0031308f ? x * 12.92f : 1.055f * powf(x, 1.0f / 2.4f) - 0.055f;
+    return (unsigned char)glm::clamp(x * 255.0f + 0.5f, 0.0f, 255.0f);
+}
+
+// the parts of a .dds header that say how the blocks after it are laid out
+struct DDSHeader {
+    unsigned int size;
+    unsigned int flags;
+    unsigned int height;
+    unsigned int width;
+    unsigned int pitch_or_linear_size;
+    unsigned int depth;
+    unsigned int mip_map_count;
+    unsigned int reserved1[11];
+    unsigned int pf_size;
+    unsigned int pf_flags;
+    unsigned int pf_four_cc;
+    unsigned int pf_bit_count;
+    unsigned int pf_masks[4];
+    unsigned int caps[4];
+    unsigned int reserved2;
+};
+
+struct DDSHeaderDX10 {
+    unsigned int dxgi_format;
+    unsigned int resource_dimension;
+    unsigned int misc_flag;
+    unsigned int array_size;
+    unsigned int misc_flags2;
+};
+
+#define DDS_FOURCC(a, b, c, d) ((unsigned int)(a) | ((unsigned int)(b) << 8) | ((unsigned int)(c) << 16) | ((unsigned int)(d) << 24))
+
+// block compressed 2D textures as written by texconv / nvcompress, the levels are kept as
+// stored so the GPU decodes them when sampled. levels drop off once they stop being a whole
+// number of blocks, since block compressed CUDA arrays have to be
+static bool loadDDS(const string& path, Texture& texture) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[4];
+    DDSHeader header;
+    if (!file.read(magic, 4) || memcmp(magic, "DDS ", 4) != 0
+        || !file.read((char*)&header, sizeof(header)) || header.size != sizeof(header)) {
+        cout << "WARNING: " << path << " is not a DDS file" << endl;
+        return false;
+    }
+
+    unsigned int four_cc = header.pf_four_cc;
+    unsigned int dxgi_format = 0;
+    if (four_cc == DDS_FOURCC('D', 'X', '1', '0')) {
+        DDSHeaderDX10 dx10;
+        if (!file.read((char*)&dx10, sizeof(dx10))) {
+            cout << "WARNING: " << path << " is truncated" << endl;
+            return false;
+        }
+        dxgi_format = dx10.dxgi_format;
+    }
+    // DXGI_FORMAT_BC1_UNORM(_SRGB) = 71, 72, BC5_UNORM = 83, BC7_UNORM(_SRGB) = 98, 99
+    if (four_cc == DDS_FOURCC('D', 'X', 'T', '1') || dxgi_format == 71 || dxgi_format == 72) {
+        texture.format = TEXTURE_BC1;
+    }
+    else if (four_cc == DDS_FOURCC('A', 'T', 'I', '2') || four_cc == DDS_FOURCC('B', 'C', '5', 'U') || dxgi_format == 83) {
+        texture.format = TEXTURE_BC5;
+    }
+    else if (dxgi_format == 98 || dxgi_format == 99) {
+        texture.format = TEXTURE_BC7;
+    }
+    else {
+        cout << "WARNING: " << path << " is not BC1, BC5 or BC7" << endl;
+        return false;
+    }
+    if (texture.format == TEXTURE_BC5 && texture.srgb) {
+        cout << "WARNING: " << path << " is BC5, which only holds normal maps" << endl;
+        return false;
+    }
+    if (header.width == 0 || header.height == 0 || header.width % 4 != 0 || header.height % 4 != 0) {
+        cout << "WARNING: " << path << " is " << header.width << "x" << header.height << ", not a whole number of 4x4 blocks" << endl;
+        return false;
+    }
+
+    texture.width = header.width;
+    texture.height = header.height;
+    int block_bytes = texture.format == TEXTURE_BC1 ? 8 : 16;
+    int stored_levels = glm::max((int)header.mip_map_count, 1);
+    int w = texture.width;
+    int h = texture.height;
+    for (int level = 0; level < stored_levels && w % 4 == 0 && h % 4 == 0; level++) {
+        std::vector<unsigned char> blocks((size_t)(w / 4) * (h / 4) * block_bytes);
+        if (!file.read((char*)blocks.data(), blocks.size())) {
+            break;
+        }
+        texture.levels.push_back(std::move(blocks));
+        w = glm::max(w / 2, 1);
+        h = glm::max(h / 2, 1);
+    }
+    if (texture.levels.empty()) {
+        cout << "WARNING: " << path << " is truncated" << endl;
+        return false;
+    }
+    return true;
+}
+
+// loads an image once per path and colour space and builds its mip chain with a 2x2 box
+// filter, averaged in linear space for sRGB images. .dds files keep their compressed blocks
+// and whatever mips they were saved with. returns its index in textures, -1 if it can't be read
+int Scene::loadTexture(const string& path, bool srgb) {
+    for (int i = 0; i < (int)textures.size(); i++) {
+        if (textures[i].path == path && textures[i].srgb == srgb) {
+            return i;
+        }
+    }
+    if (parse_only) {
+        // just the path, for comparing against another parse
+        Texture texture;
+        texture.path = path;
+        texture.srgb = srgb;
+        textures.push_back(texture);
+        return textures.size() - 1;
+    }
+
+    if (path.size() >= 4 && strcmp(path.c_str() + path.size() - 4, ".dds") == 0) {
+        Texture texture;
+        texture.path = path;
+        texture.srgb = srgb;
+        if (!loadDDS(path, texture)) {
+            cout << "WARNING: could not read texture " << path << ", ignoring it" << endl;
+            return -1;
+        }
+        const char* format_names[] = { "RGBA8", "BC1", "BC5", "BC7" };
+        cout << "Loaded texture " << path << " (" << texture.width << "x" << texture.height << " " << format_names[texture.format]
+            << ", " << texture.levels.size() << " mip levels)" << endl;
+        textures.push_back(texture);
+        return textures.size() - 1;
+    }
+
+    int width, height, channels;
+    unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, 4);
+    if (pixels == NULL) {
+        cout << "WARNING: could not read texture " << path << ", ignoring it" << endl;
+        return -1;
+    }
+
+    Texture texture;
+    texture.path = path;
+    texture.srgb = srgb;
+    texture.format = TEXTURE_RGBA8;
+    texture.width = width;
+    texture.height = height;
+    texture.levels.push_back(std::vector<unsigned char>(pixels, pixels + 4 * width * height));
+    stbi_image_free(pixels);
+
+    int w = width;
+    int h = height;
+    while (w > 1 || h > 1) {
+        int next_w = glm::max(w / 2, 1);
+        int next_h = glm::max(h / 2, 1);
+        const std::vector<unsigned char>& src = texture.levels.back();
+        std::vector<unsigned char> dst(4 * next_w * next_h);
+        for (int y = 0; y < next_h; y++) {
+            for (int x = 0; x < next_w; x++) {
+                int x0 = glm::min(2 * x, w - 1), x1 = glm::min(2 * x + 1, w - 1);
+                int y0 = glm::min(2 * y, h - 1), y1 = glm::min(2 * y + 1, h - 1);
+                const unsigned char* taps[4] = { &src[4 * (y0 * w + x0)], &src[4 * (y0 * w + x1)],
+                    &src[4 * (y1 * w + x0)], &src[4 * (y1 * w + x1)] };
+                for (int c = 0; c < 4; c++) {
+                    // alpha is always linear
+                    bool linearize = srgb && c < 3;
+                    float sum = 0.0f;
+                    for (int t = 0; t < 4; t++) {
+                        sum += linearize ? srgbToLinear(taps[t][c]) : taps[t][c] / 255.0f;
+                    }
+                    dst[4 * (y * next_w + x) + c] = linearize ? linearToSrgb(sum * 0.25f)
+                        : (unsigned char)glm::clamp(sum * 0.25f * 255.0f + 0.5f, 0.0f, 255.0f);
+                }
+            }
+        }
+        texture.levels.push_back(dst);
+        w = next_w;
+        h = next_h;
+    }
+
+    cout << "Loaded texture " << path << " (" << width << "x" << height << ", " << texture.levels.size() << " mip levels)" << endl;
+    textures.push_back(texture);
+    return textures.size() - 1;
+}
+
+// subtrees at least this big are handed to a task of their own
+#define BVH_TASK_MIN_TRIS 4096
+
+// state of one buildFlatBVH. every subtree partitions its own range of tri_bounds, so tasks
+// only share the pool list, each new task allocating nodes from a deque of its own
+struct BVHBuildContext {
+    int range_start; // leaf tri_index is relative to this
+    int max_leaf_size; // most primitives a leaf may hold
+    int split_budget = 0; // BVH_SBVH, references spatial splits may still add
+    float root_area = 0.0f; // BVH_SBVH
+    std::atomic<int> num_nodes;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<std::deque<BVHNode>>> pools;
+
+    std::deque<BVHNode>* newPool() {
+        std::lock_guard<std::mutex> lock(mutex);
+        pools.emplace_back(new std::deque<BVHNode>());
+        return pools.back().get();
+    }
+};
+
+// extra build threads running across every BVH being built, capped at the hardware threads
+static std::atomic<int> bvh_build_tasks(0);
+
+static bool reserveBVHBuildTask() {
+    if (bvh_build_tasks.fetch_add(1) < utilityCore::numThreads() - 1) {
+        return true;
+    }
+    bvh_build_tasks--;
+    return false;
+}
+
+// builds the BVH over tri_bounds [start_index, end_index) and flattens it into nodes. the
+// range ends up in leaf order, leaf_tri_IDs gets its tri_IDs, and the pointer tree is freed
+void Scene::buildFlatBVH(int start_index, int end_index, int max_leaf_size, std::vector<BVHNode_GPU>& nodes, std::vector<int>& leaf_tri_IDs) {
+    BVHBuildContext context;
+    context.range_start = start_index;
+    context.max_leaf_size = max_leaf_size;
+    context.num_nodes = 0;
+    BVHNode* root_node = buildBVH(context, *context.newPool(), start_index, end_index);
+
+    nodes.clear();
+    nodes.reserve(context.num_nodes);
+    reformatBVHToGPU(root_node, nodes);
+
+    leaf_tri_IDs.resize(end_index - start_index);
+    for (int i = start_index; i < end_index; ++i) {
+        leaf_tri_IDs[i - start_index] = tri_bounds[i].tri_ID;
+    }
+}
+
+// One BVH per BLAS over its own tris, node and tri indices local to the BLAS.
+// LBVH builds are only laid out here, pathtraceInit runs them on the gpu
+void Scene::buildBLASes() {
+    ProfileRange range("build BLASes");
+    PhaseTimer phase(PHASE_BVH_BUILD);
+    num_nodes = 0;
+    if (num_tris == 0) {
+        return;
+    }
+
+    if (bvh_settings.builder == BVH_LBVH || lbvh_until_swap) {
+        // tris stay in load order, pathtraceInit sorts them on the gpu
+        for (BLAS& blas : blases) {
+            blas.node_offset = num_nodes;
+            blas.num_nodes = glm::max(2 * blas.num_tris - 1, 0);
+            num_nodes += blas.num_nodes;
+        }
+        cout << "Deferring BVH to the GPU (LBVH" << (lbvh_until_swap ? " until the host build is swapped in" : "") << "), num nodes: " << num_nodes << endl;
+        return;
+    }
+
+    if (bvh_settings.report) {
+        compareBVHBuilders();
+    }
+
+    std::vector<std::vector<BVHNode_GPU>> blas_nodes;
+    std::vector<std::vector<int>> blas_tri_order;
+    buildHostBLASes(blas_nodes, blas_tri_order);
+    layOutBLASes(blas_nodes, blas_tri_order);
+}
+
+// the host builder's tree of every BLAS over tri_bounds, nodes and leaf tri order per BLAS. only
+// reads the scene, so BVH_PROGRESSIVE runs it on a thread while the LBVH renders
+void Scene::buildHostBLASes(std::vector<std::vector<BVHNode_GPU>>& blas_nodes, std::vector<std::vector<int>>& blas_tri_order) {
+    string builder_name = bvh_settings.builder == BVH_MIDPOINT ? string("midpoint")
+        : (bvh_settings.builder == BVH_SBVH ? "SBVH, " : "SAH, ") + utilityCore::convertIntToString(bvh_settings.sah_bins) + " bins";
+    cout << "Building BVH (" << builder_name << ") ..." << endl;
+    // BLASes cover disjoint ranges of tri_bounds, so they build side by side
+    blas_nodes.assign(blases.size(), std::vector<BVHNode_GPU>());
+    blas_tri_order.assign(blases.size(), std::vector<int>());
+    utilityCore::parallelFor(blases.size(), [&](int i) {
+        const BLAS& blas = blases[i];
+        std::vector<int>& leaf_tri_IDs = blas_tri_order[i];
+        if (mesh_sources[i].cached) {
+            // loaded in leaf order with its nodes already in bvh_nodes_gpu
+            for (int t = 0; t < blas.num_tris; ++t) {
+                leaf_tri_IDs.push_back(blas.tri_offset + t);
+            }
+            return;
+        }
+
+        if (bvh_settings.builder == BVH_SBVH) {
+            buildFlatSBVH(blas.tri_offset, blas.tri_offset + blas.num_tris, blas_nodes[i], leaf_tri_IDs);
+        }
+        else {
+            buildFlatBVH(blas.tri_offset, blas.tri_offset + blas.num_tris, bvh_settings.max_leaf_size, blas_nodes[i], leaf_tri_IDs);
+        }
+    });
+}
+
+// puts buildHostBLASes' trees in place: the tris in leaf order, the nodes after each other in
+// bvh_nodes_gpu and collapsed when the BVH is wide
+void Scene::layOutBLASes(std::vector<std::vector<BVHNode_GPU>>& blas_nodes, std::vector<std::vector<int>>& blas_tri_order) {
+    // spatial splits can list a tri in several leaves, so the BLAS tri ranges are laid out again
+    std::vector<int> tri_order;
+    for (int i = 0; i < blases.size(); ++i) {
+        BLAS& blas = blases[i];
+        if (bvh_settings.builder == BVH_SBVH && !mesh_sources[i].cached) {
+            cout << "SBVH " << mesh_sources[i].path << ": " << blas_tri_order[i].size() << " references to " << blas.num_tris << " tris" << endl;
+        }
+        blas.tri_offset = tri_order.size();
+        blas.num_tris = blas_tri_order[i].size();
+        tri_order.insert(tri_order.end(), blas_tri_order[i].begin(), blas_tri_order[i].end());
+        std::vector<int>().swap(blas_tri_order[i]);
+    }
+
+    for (int i = 0; i < blases.size(); ++i) {
+        BLAS& blas = blases[i];
+        if (mesh_sources[i].cached) {
+            continue;
+        }
+        blas.node_offset = bvh_nodes_gpu.size();
+        blas.num_nodes = blas_nodes[i].size();
+        bvh_nodes_gpu.insert(bvh_nodes_gpu.end(), blas_nodes[i].begin(), blas_nodes[i].end());
+        std::vector<BVHNode_GPU>().swap(blas_nodes[i]);
+        reportBVHStats(&bvh_nodes_gpu[blas.node_offset], blas.num_tris);
+    }
+    reorderMeshTris(tri_order);
+    num_tris = tri_order.size();
+
+    num_nodes = bvh_nodes_gpu.size();
+    std::cout << "num nodes: " << num_nodes << std::endl;
+
+    if (bvh_settings.wide) {
+        collapseBVHToWide();
+    }
+}
+
+// world space box of a geom, the transformed corners of its object space box
+static TriBounds geomWorldBounds(const Geom& geom, const std::vector<BLAS>& blases, const std::vector<CurveSet>& curve_sets) {
+    // untransformed analytic shapes fit in the unit cube, squareplanes are flat in z
+    glm::vec3 obj_min = glm::vec3(-0.5f);
+    glm::vec3 obj_max = glm::vec3(0.5f);
+    if (geom.type == MESH) {
+        obj_min = blases[geom.blas_ID].AABB_min;
+        obj_max = blases[geom.blas_ID].AABB_max;
+    }
+    else if (geom.type == CURVES) {
+        obj_min = curve_sets[geom.blas_ID].AABB_min;
+        obj_max = curve_sets[geom.blas_ID].AABB_max;
+    }
+    else if (geom.type == SQUAREPLANE) {
+        obj_min.z = 0.0f;
+        obj_max.z = 0.0f;
+    }
+
+    TriBounds bounds;
+    bounds.AABB_min = glm::vec3(FLT_MAX);
+    bounds.AABB_max = glm::vec3(-FLT_MAX);
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec3 p = glm::vec3(corner & 1 ? obj_max.x : obj_min.x, corner & 2 ? obj_max.y : obj_min.y, corner & 4 ? obj_max.z : obj_min.z);
+        p = glm::vec3(geom.transform * glm::vec4(p, 1.0f));
+        bounds.AABB_min = glm::min(bounds.AABB_min, p);
+        bounds.AABB_max = glm::max(bounds.AABB_max, p);
+    }
+    // keep flat boxes from degenerating in the slab test
+    bounds.AABB_min -= glm::vec3(0.0001f);
+    bounds.AABB_max += glm::vec3(0.0001f);
+    bounds.AABB_centroid = 0.5f * (bounds.AABB_min + bounds.AABB_max);
+    bounds.tri_ID = -1;
+    return bounds;
+}
+
+// a moving geom's world box at shutter close
+static TriBounds geomEndBounds(const Geom& geom, const std::vector<BLAS>& blases, const std::vector<CurveSet>& curve_sets) {
+    Geom end = geom;
+    end.transform = geom.end_transform;
+    return geomWorldBounds(end, blases, curve_sets);
+}
+
+// Reads every curves file and builds the BVH over its segments, a segment per pair of
+// consecutive strand points. the segments are put in leaf order so a leaf covers a range of
+// them, the same way the TLAS orders geoms. runs before buildTLAS, which needs the sets' bounds
+void Scene::loadCurves() {
+    if (curve_sets.empty()) {
+        return;
+    }
+    ProfileRange range("load curves");
+    PhaseTimer phase(PHASE_BVH_BUILD);
+    curve_segments.clear();
+    curve_nodes.clear();
+    for (int c = 0; c < curve_sets.size(); ++c) {
+        const std::string& path = curve_sources[c];
+        std::vector<glm::vec4> points;
+        std::vector<int> strand_points;
+        std::string error;
+        if (!loadHair(path, points, strand_points, error)) {
+            throw std::runtime_error(error);
+        }
+
+        std::vector<CurveSegment> segments;
+        segments.reserve(points.size());
+        int first_point = 0;
+        for (int count : strand_points) {
+            for (int i = first_point; i + 1 < first_point + count; ++i) {
+                CurveSegment segment;
+                segment.p0 = points[i];
+                segment.p1 = points[i + 1];
+                segments.push_back(segment);
+            }
+            first_point += count;
+        }
+        utilityCore::freeVector(points);
+
+        CurveSet& set = curve_sets[c];
+        set.segment_offset = curve_segments.size();
+        set.num_segments = segments.size();
+        set.node_offset = curve_nodes.size();
+        set.num_nodes = 0;
+        set.AABB_min = glm::vec3(FLT_MAX);
+        set.AABB_max = glm::vec3(-FLT_MAX);
+        if (segments.empty()) {
+            set.AABB_min = set.AABB_max = glm::vec3(0.0f);
+            cout << "WARNING: " << path << " has no segments" << endl;
+            continue;
+        }
+
+        // the boxes around each segment's end spheres, the round cone between them stays inside
+        tri_bounds.resize(segments.size());
+        utilityCore::parallelFor(segments.size(), [&](int i) {
+            const CurveSegment& segment = segments[i];
+            TriBounds& bounds = tri_bounds[i];
+            bounds.AABB_min = glm::min(glm::vec3(segment.p0) - segment.p0.w, glm::vec3(segment.p1) - segment.p1.w);
+            bounds.AABB_max = glm::max(glm::vec3(segment.p0) + segment.p0.w, glm::vec3(segment.p1) + segment.p1.w);
+            bounds.AABB_centroid = 0.5f * (bounds.AABB_min + bounds.AABB_max);
+            bounds.tri_ID = i;
+        });
+        for (const TriBounds& bounds : tri_bounds) {
+            set.AABB_min = glm::min(set.AABB_min, bounds.AABB_min);
+            set.AABB_max = glm::max(set.AABB_max, bounds.AABB_max);
+        }
+
+        std::vector<BVHNode_GPU> nodes;
+        std::vector<int> leaf_segment_IDs;
+        buildFlatBVH(0, segments.size(), bvh_settings.max_leaf_size, nodes, leaf_segment_IDs);
+        for (int i = 0; i < leaf_segment_IDs.size(); ++i) {
+            curve_segments.push_back(segments[leaf_segment_IDs[i]]);
+        }
+        set.num_nodes = nodes.size();
+        curve_nodes.insert(curve_nodes.end(), nodes.begin(), nodes.end());
+        cout << "Loaded " << path << ": " << strand_points.size() << " strands, " << segments.size() << " segments, " << nodes.size() << " nodes" << endl;
+    }
+    utilityCore::freeVector(tri_bounds);
+}
+
+// Reads every volume file into the sparse bricks of its grid, only bricks with density keep
+// voxels. a brick's voxels are quantized to 16 bits of its densest one, and its majorant cell
+// bounds every trilinear lookup inside the brick, so it covers the voxels one past its faces
+void Scene::loadVolumes() {
+    if (volume_grids.empty()) {
+        return;
+    }
+    ProfileRange range("load volumes");
+    const int B = VOLUME_BRICK_SIZE;
+    volume_bricks.clear();
+    volume_majorants.clear();
+    volume_brick_scales.clear();
+    volume_voxels.clear();
+    for (int v = 0; v < volume_grids.size(); ++v) {
+        const std::string& path = volume_sources[v];
+        std::vector<float> densities;
+        glm::ivec3 res;
+        glm::vec3 bounds_min, bounds_max;
+        std::string error;
+        if (!loadVolume(path, densities, res, bounds_min, bounds_max, error)) {
+            throw std::runtime_error(error);
+        }
+
+        VolumeGrid& grid = volume_grids[v];
+        grid.resolution = res;
+        grid.bricks = (res + (B - 1)) / B;
+        grid.brick_offset = volume_bricks.size();
+        // the file's box keeps its proportions inside the unit cube the geom's transform places
+        glm::vec3 extent = bounds_max - bounds_min;
+        if (!(extent.x > 0.0f && extent.y > 0.0f && extent.z > 0.0f)) {
+            extent = glm::vec3(res);
+        }
+        grid.AABB_max = 0.5f * extent / glm::max(extent.x, glm::max(extent.y, extent.z));
+        grid.AABB_min = -grid.AABB_max;
+        grid.index_scale = glm::vec3(res) / (grid.AABB_max - grid.AABB_min);
+
+        const glm::ivec3 bricks = grid.bricks;
+        const int cells = bricks.x * bricks.y * bricks.z;
+        auto density = [&](int x, int y, int z) {
+            return glm::max(densities[((size_t)z * res.y + y) * res.x + x], 0.0f);
+        };
+        std::vector<float> brick_max(cells);
+        std::vector<float> majorants(cells);
+        utilityCore::parallelFor(cells, [&](int c) {
+            const glm::ivec3 lo = glm::ivec3(c % bricks.x, (c / bricks.x) % bricks.y, c / (bricks.x * bricks.y)) * B;
+            const glm::ivec3 hi = glm::min(lo + B, res);
+            const glm::ivec3 apron_lo = glm::max(lo - 1, glm::ivec3(0));
+            const glm::ivec3 apron_hi = glm::min(hi + 1, res);
+            float inner = 0.0f;
+            float outer = 0.0f;
+            for (int z = apron_lo.z; z < apron_hi.z; ++z) {
+                for (int y = apron_lo.y; y < apron_hi.y; ++y) {
+                    for (int x = apron_lo.x; x < apron_hi.x; ++x) {
+                        const float d = density(x, y, z);
+                        outer = glm::max(outer, d);
+                        if (x >= lo.x && y >= lo.y && z >= lo.z && x < hi.x && y < hi.y && z < hi.z) {
+                            inner = glm::max(inner, d);
+                        }
+                    }
+                }
+            }
+            brick_max[c] = inner;
+            // a quantized neighbor can round up by half a step
+            majorants[c] = outer * (1.0f + 1.0f / 65535.0f);
+        });
+
+        std::vector<int> slots(cells, -1);
+        int num_bricks = 0;
+        for (int c = 0; c < cells; ++c) {
+            if (brick_max[c] > 0.0f) {
+                slots[c] = volume_brick_scales.size();
+                volume_brick_scales.push_back(brick_max[c] / 65535.0f);
+                num_bricks++;
+            }
+        }
+        volume_voxels.resize(volume_voxels.size() + (size_t)num_bricks * B * B * B, 0);
+        utilityCore::parallelFor(cells, [&](int c) {
+            if (slots[c] == -1) {
+                return;
+            }
+            const glm::ivec3 lo = glm::ivec3(c % bricks.x, (c / bricks.x) % bricks.y, c / (bricks.x * bricks.y)) * B;
+            const glm::ivec3 hi = glm::min(lo + B, res);
+            unsigned short* voxels = volume_voxels.data() + (size_t)slots[c] * B * B * B;
+            for (int z = lo.z; z < hi.z; ++z) {
+                for (int y = lo.y; y < hi.y; ++y) {
+                    for (int x = lo.x; x < hi.x; ++x) {
+                        voxels[((z - lo.z) * B + (y - lo.y)) * B + (x - lo.x)] = (unsigned short)(density(x, y, z) / brick_max[c] * 65535.0f + 0.5f);
+                    }
+                }
+            }
+        });
+        volume_bricks.insert(volume_bricks.end(), slots.begin(), slots.end());
+        volume_majorants.insert(volume_majorants.end(), majorants.begin(), majorants.end());
+        cout << "Loaded " << path << ": " << res.x << "x" << res.y << "x" << res.z << " voxels, " << num_bricks << " of " << cells
+            << " bricks hold density (" << ((size_t)num_bricks * B * B * B * sizeof(unsigned short) >> 10) << " KB of voxels against "
+            << (densities.size() * sizeof(float) >> 10) << " KB dense)" << endl;
+    }
+}
+
+// a VolumeGPU per VOLUME geom, once buildTLAS has put the geoms in their final order
+void Scene::placeVolumes() {
+    volumes.clear();
+    for (int i = 0; i < geoms.size(); ++i) {
+        if (geoms[i].type != VOLUME) {
+            continue;
+        }
+        const VolumeMedium& medium = volume_media[geoms[i].blas_ID];
+        VolumeGPU volume;
+        volume.geom = i;
+        volume.grid = volume_grids[medium.grid];
+        volume.sigma_t = medium.density;
+        volume.g = medium.anisotropy;
+        volumes.push_back(volume);
+    }
+}
+
+// Top level BVH over every geom's world space box, built with the same settings as the
+// BLASes except that leaves hold one geom: an instance test transforms the ray and runs a
+// quadric or a whole BLAS, so another box test in front of it always pays. Geoms are put in
+// leaf order (lights remapped) so a leaf covers a range of them
+void Scene::buildTLAS() {
+    ProfileRange range("build TLAS");
+    PhaseTimer phase(PHASE_BVH_BUILD);
+    tlas_nodes_gpu.clear();
+    if (geoms.empty()) {
+        return;
+    }
+
+    // the BLAS tri bounds are done with, the TLAS reuses the array for geom bounds. a moving
+    // geom is split by the box it sweeps over the shutter
+    utilityCore::freeVector(tri_bounds);
+    bool any_moving = false;
+    for (int i = 0; i < geoms.size(); ++i) {
+        TriBounds bounds = geomWorldBounds(geoms[i], blases, curve_sets);
+        if (geoms[i].moving) {
+            const TriBounds end = geomEndBounds(geoms[i], blases, curve_sets);
+            bounds.AABB_min = glm::min(bounds.AABB_min, end.AABB_min);
+            bounds.AABB_max = glm::max(bounds.AABB_max, end.AABB_max);
+            bounds.AABB_centroid = 0.5f * (bounds.AABB_min + bounds.AABB_max);
+            any_moving = true;
+        }
+        bounds.tri_ID = i;
+        tri_bounds.push_back(bounds);
+    }
+
+    std::vector<int> leaf_tri_IDs;
+    buildFlatBVH(0, geoms.size(), 1, tlas_nodes_gpu, leaf_tri_IDs);
+
+    std::vector<Geom> sorted_geoms(geoms.size());
+    std::vector<int> new_geom_IDs(geoms.size());
+    for (int i = 0; i < leaf_tri_IDs.size(); ++i) {
+        sorted_geoms[i] = geoms[leaf_tri_IDs[i]];
+        new_geom_IDs[leaf_tri_IDs[i]] = i;
+    }
+    geoms.swap(sorted_geoms);
+    for (Light& light : lights) {
+        light.geom_ID = new_geom_IDs[light.geom_ID];
+    }
+    geom_IDs.swap(new_geom_IDs);
+    utilityCore::freeVector(tri_bounds);
+
+    // the moving geoms' keys go up in TLAS order, and the nodes get their boxes at both keys
+    tlas_end_bounds.clear();
+    int num_moving = 0;
+    for (Geom& geom : geoms) {
+        geom.motion_ID = geom.moving ? num_moving++ : -1;
+    }
+    if (any_moving) {
+        refitTLAS();
+        cout << "TLAS: " << num_moving << " moving geom(s), nodes keep their boxes at shutter open and close" << endl;
+    }
+
+    std::cout << "TLAS: " << geoms.size() << " instances of " << blases.size() << " BLASes, " << tlas_nodes_gpu.size() << " nodes" << std::endl;
+    if (bvh_settings.report) {
+        reportBVHStats(tlas_nodes_gpu.data(), geoms.size());
+    }
+}
+
+// every tri of an emissive mesh instance becomes its own light, with its object space
+// positions baked like dev_tris. runs again after a refit, the tris moved
+void Scene::gatherMeshLights() {
+    lights.erase(std::remove_if(lights.begin(), lights.end(), [](const Light& light) { return light.is_tri; }), lights.end());
+    for (int g = 0; g < geoms.size(); ++g) {
+        const Geom& geom = geoms[g];
+        // a moving mesh's tris aren't where the light records would put them
+        if (geom.type != MESH || geom.moving || materials[geom.materialid].emittance <= 0.0f) {
+            continue;
+        }
+        const BLAS& blas = blases[geom.blas_ID];
+        // spatial splits repeat a tri in every leaf it was cut into, it's still one light
+        std::set<std::tuple<int, int, int>> seen;
+        for (int t = blas.tri_offset; t < blas.tri_offset + blas.num_tris; ++t) {
+            const glm::ivec3& tri = mesh.indices[t];
+            if (bvh_settings.builder == BVH_SBVH && !seen.insert(std::make_tuple(tri.x, tri.y, tri.z)).second) {
+                continue;
+            }
+            Light light;
+            light.geom_ID = g;
+            light.is_tri = true;
+            light.tri.p0 = mesh.positions[tri.x];
+            light.tri.p1 = mesh.positions[tri.y];
+            light.tri.p2 = mesh.positions[tri.z];
+            lights.push_back(light);
+        }
+    }
+}
+
+// surface area of a light, squareplanes and tris match the pdf the MIS rays use.
+// spheres are taken as spheres of their mean scale
+static float lightArea(const Light& light, const Geom& geom) {
+    if (light.is_tri) {
+        glm::mat3 m = glm::mat3(geom.transform);
+        return 0.5f * glm::length(glm::cross(m * (light.tri.p1 - light.tri.p0), m * (light.tri.p2 - light.tri.p0)));
+    }
+    const glm::vec3& s = geom.scale;
+    if (geom.type == SQUAREPLANE) {
+        return glm::abs(s.x * s.y);
+    }
+    if (geom.type == CUBE) {
+        return 2.0f * glm::abs(s.x * s.y + s.y * s.z + s.z * s.x);
+    }
+    float d = (glm::abs(s.x) + glm::abs(s.y) + glm::abs(s.z)) / 3.0f;
+    return PI * d * d;
+}
+
+// the world space corner, edges, normal, area and power of a light, so sampling it is a few
+// multiply adds instead of going through its geom's transforms
+static void bakeLightRecord(Light& light, const Geom& geom, const Material& m) {
+    light.corner = light.edge_u = light.edge_v = light.normal = glm::vec3(0.0f);
+    light.area = lightArea(light, geom);
+    light.area_pdf = 0.0f;
+    if (light.is_tri) {
+        light.corner = glm::vec3(geom.transform * glm::vec4(light.tri.p0, 1.0f));
+        glm::mat3 to_world = glm::mat3(geom.transform);
+        light.edge_u = to_world * (light.tri.p1 - light.tri.p0);
+        light.edge_v = to_world * (light.tri.p2 - light.tri.p0);
+        if (light.area > 0.0f) {
+            light.normal = glm::cross(light.edge_u, light.edge_v) * (0.5f / light.area);
+            light.area_pdf = 1.0f / light.area;
+        }
+    }
+    else if (geom.type == SQUAREPLANE) {
+        light.corner = glm::vec3(geom.transform * glm::vec4(-0.5f, -0.5f, 0.0f, 1.0f));
+        light.edge_u = glm::vec3(geom.transform * glm::vec4(1.0f, 0.0f, 0.0f, 0.0f));
+        light.edge_v = glm::vec3(geom.transform * glm::vec4(0.0f, 1.0f, 0.0f, 0.0f));
+        light.normal = glm::normalize(glm::vec3(geom.invTranspose * glm::vec4(0.0f, 0.0f, 1.0f, 0.0f)));
+        light.area_pdf = light.area > 0.0f ? 1.0f / light.area : 0.0f;
+    }
+    light.Le = m.emittance * m.R;
+    light.power = glm::max(glm::dot(light.Le, glm::vec3(0.2126f, 0.7152f, 0.0722f)) * light.area, 0.0f);
+}
+
+// smallest cone holding both cones of normals, PBRT's DirectionCone union
+static void mergeLightCones(LightBVHNode& a, const LightBVHNode& b) {
+    float theta_e = glm::max(a.theta_e, b.theta_e);
+    LightBVHNode wide = a.theta_o >= b.theta_o ? a : b;
+    const LightBVHNode& narrow = a.theta_o >= b.theta_o ? b : a;
+    float theta_d = glm::acos(glm::clamp(glm::dot(wide.axis, narrow.axis), -1.0f, 1.0f));
+    a.theta_e = theta_e;
+    if (glm::min(theta_d + narrow.theta_o, PI) <= wide.theta_o) {
+        a.axis = wide.axis;
+        a.theta_o = wide.theta_o;
+        return;
+    }
+    float theta_o = 0.5f * (wide.theta_o + theta_d + narrow.theta_o);
+    if (theta_o >= PI) {
+        a.axis = wide.axis;
+        a.theta_o = PI;
+        return;
+    }
+    // turn the wide axis toward the narrow one
+    glm::vec3 w = glm::cross(wide.axis, narrow.axis);
+    if (glm::length(w) < 1e-6f) {
+        // opposite axes, any perpendicular turns them
+        w = glm::cross(wide.axis, glm::abs(wide.axis.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f));
+    }
+    w = glm::normalize(w);
+    float theta_r = theta_o - wide.theta_o;
+    a.axis = glm::normalize(wide.axis * glm::cos(theta_r) + glm::cross(w, wide.axis) * glm::sin(theta_r)
+        + w * glm::dot(w, wide.axis) * (1.0f - glm::cos(theta_r)));
+    a.theta_o = theta_o;
+}
+
+// node over leaves [start, end), split at the median centroid of the longest axis.
+// returns the node's index
+static int buildLightBVHNode(std::vector<LightBVHNode>& nodes, std::vector<LightBVHNode>& leaves, int start, int end) {
+    int index = nodes.size();
+    if (end - start == 1) {
+        nodes.push_back(leaves[start]);
+        return index;
+    }
+    LightBVHNode node = leaves[start];
+    glm::vec3 centroid_min = 0.5f * (node.AABB_min + node.AABB_max);
+    glm::vec3 centroid_max = centroid_min;
+    for (int i = start + 1; i < end; ++i) {
+        const LightBVHNode& leaf = leaves[i];
+        node.AABB_min = glm::min(node.AABB_min, leaf.AABB_min);
+        node.AABB_max = glm::max(node.AABB_max, leaf.AABB_max);
+        node.power += leaf.power;
+        mergeLightCones(node, leaf);
+        glm::vec3 centroid = 0.5f * (leaf.AABB_min + leaf.AABB_max);
+        centroid_min = glm::min(centroid_min, centroid);
+        centroid_max = glm::max(centroid_max, centroid);
+    }
+    node.light_index = -1;
+    nodes.push_back(node);
+
+    glm::vec3 extent = centroid_max - centroid_min;
+    int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+    int mid = (start + end) / 2;
+    std::nth_element(leaves.begin() + start, leaves.begin() + mid, leaves.begin() + end,
+        [axis](const LightBVHNode& a, const LightBVHNode& b) {
+            return a.AABB_min[axis] + a.AABB_max[axis] < b.AABB_min[axis] + b.AABB_max[axis];
+        });
+    buildLightBVHNode(nodes, leaves, start, mid);
+    nodes[index].offset_to_second_child = buildLightBVHNode(nodes, leaves, mid, end) - index;
+    return index;
+}
+
+// Vose's alias method over emittance * luminance * area of every light, so bright or big
+// lights get most of the shadow rays and picking one stays O(1). lights with no power left
+// to weigh fall back to a uniform pick. LIGHT_SAMPLER BVH also gets a light BVH over the
+// same powers, squareplanes emit into the hemisphere their normal is in, mesh tris to both
+// sides and the others all around
+void Scene::buildLightTable() {
+    ProfileRange range("build light BVH");
+    const int n = lights.size();
+    light_bvh_nodes.clear();
+    if (n == 0) {
+        return;
+    }
+    std::vector<float> power(n);
+    float total = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        const Geom& geom = geoms[lights[i].geom_ID];
+        bakeLightRecord(lights[i], geom, materials[geom.materialid]);
+        power[i] = lights[i].power;
+        total += power[i];
+    }
+    if (!(total > 0.0f)) {
+        std::fill(power.begin(), power.end(), 1.0f);
+        total = (float)n;
+    }
+
+    // column heights scaled so the average is 1, small ones get topped up from large ones
+    std::vector<float> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; ++i) {
+        lights[i].pdf = power[i] / total;
+        lights[i].alias = i;
+        scaled[i] = lights[i].pdf * n;
+        (scaled[i] < 1.0f ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        lights[s].alias_threshold = scaled[s];
+        lights[s].alias = l;
+        scaled[l] -= 1.0f - scaled[s];
+        if (scaled[l] < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // whatever is left is full up to rounding
+    for (int i : small) {
+        lights[i].alias_threshold = 1.0f;
+    }
+    for (int i : large) {
+        lights[i].alias_threshold = 1.0f;
+    }
+
+    if (render_settings.light_sampler != LIGHT_BVH) {
+        return;
+    }
+    std::vector<LightBVHNode> leaves(n);
+    for (int i = 0; i < n; ++i) {
+        const Geom& geom = geoms[lights[i].geom_ID];
+        LightBVHNode& leaf = leaves[i];
+        if (lights[i].is_tri) {
+            const TriIntersect& tri = lights[i].tri;
+            glm::vec3 p0 = glm::vec3(geom.transform * glm::vec4(tri.p0, 1.0f));
+            glm::vec3 p1 = glm::vec3(geom.transform * glm::vec4(tri.p1, 1.0f));
+            glm::vec3 p2 = glm::vec3(geom.transform * glm::vec4(tri.p2, 1.0f));
+            leaf.AABB_min = glm::min(p0, glm::min(p1, p2)) - glm::vec3(0.0001f);
+            leaf.AABB_max = glm::max(p0, glm::max(p1, p2)) + glm::vec3(0.0001f);
+        }
+        else {
+            TriBounds bounds = geomWorldBounds(geom, blases, curve_sets);
+            leaf.AABB_min = bounds.AABB_min;
+            leaf.AABB_max = bounds.AABB_max;
+        }
+        leaf.power = power[i];
+        leaf.light_index = i;
+        leaf.offset_to_second_child = 0;
+        leaf.theta_e = 0.5f * PI;
+        if (lights[i].is_tri) {
+            // tris emit from both sides
+            leaf.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+            leaf.theta_o = PI;
+        }
+        else if (geom.type == SQUAREPLANE) {
+            leaf.axis = lights[i].normal;
+            leaf.theta_o = 0.0f;
+        }
+        else {
+            leaf.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+            leaf.theta_o = PI;
+        }
+    }
+    light_bvh_nodes.reserve(2 * n - 1);
+    buildLightBVHNode(light_bvh_nodes, leaves, 0, n);
+}
+
+// texels of gutter around every uv island that take their nearest covered neighbour's point,
+// so bilinear lookups at island edges don't blend in the black of uncovered texels
+#define BAKE_PADDING 2
+
+// BAKE, a surface point per pixel of the image for the OBJECT's uv atlas. every tri is
+// rasterized over the texel centers its uvs cover, the point and the interpolated normal taken
+// to world space through the geom's transform at shutter open. overlapping uvs keep the last
+// tri's, the atlas is expected to be unique like a lightmap's. the uncovered texels then get
+// BAKE_PADDING rings of gutter
+void Scene::buildBakeTexels() {
+    const glm::ivec2 size = state.camera.resolution;
+    bake_texels.assign(size.x * size.y, BakeTexel{ glm::vec3(0.0f), glm::vec3(0.0f) });
+    const int object = render_settings.bake_object;
+    if (object >= (int)geom_IDs.size() || geoms[geom_IDs[object]].type != MESH) {
+        cout << "BAKE is ignored, OBJECT " << object << " isn't a mesh" << endl;
+        render_settings.bake_object = -1;
+        utilityCore::freeVector(bake_texels);
+        return;
+    }
+    const Geom& geom = geoms[geom_IDs[object]];
+    const BLAS& blas = blases[geom.blas_ID];
+    const glm::mat3 normal_transform = glm::mat3(geom.invTranspose);
+
+    int covered = 0;
+    int overlapped = 0;
+    for (int t = blas.tri_offset; t < blas.tri_offset + blas.num_tris; ++t) {
+        const glm::ivec3& tri = mesh.indices[t];
+        glm::vec2 uv[3];
+        for (int k = 0; k < 3; ++k) {
+            // buildImage mirrors the columns for the camera, u runs against them so the saved atlas matches the uvs
+            uv[k] = glm::vec2(1.0f - mesh.uvs[tri[k]].x, mesh.uvs[tri[k]].y) * glm::vec2(size);
+        }
+        const float area = (uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y);
+        if (glm::abs(area) < 1e-12f) {
+            continue;
+        }
+        const glm::vec3 face_normal = glm::cross(mesh.positions[tri[1]] - mesh.positions[tri[0]], mesh.positions[tri[2]] - mesh.positions[tri[0]]);
+        const glm::ivec2 lo = glm::max(glm::ivec2(glm::floor(glm::min(uv[0], glm::min(uv[1], uv[2])))), glm::ivec2(0));
+        const glm::ivec2 hi = glm::min(glm::ivec2(glm::ceil(glm::max(uv[0], glm::max(uv[1], uv[2])))), size - 1);
+        for (int y = lo.y; y <= hi.y; ++y) {
+            for (int x = lo.x; x <= hi.x; ++x) {
+                const glm::vec2 c = glm::vec2(x + 0.5f, y + 0.5f);
+                // barycentrics of the texel center, winding either way
+                const float b1 = ((c.x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (c.y - uv[0].y)) / area;
+                const float b2 = ((uv[1].x - uv[0].x) * (c.y - uv[0].y) - (c.x - uv[0].x) * (uv[1].y - uv[0].y)) / area;
+                const float b0 = 1.0f - b1 - b2;
+                if (b0 < 0.0f || b1 < 0.0f || b2 < 0.0f) {
+                    continue;
+                }
+                glm::vec3 n = b0 * mesh.normals[tri[0]] + b1 * mesh.normals[tri[1]] + b2 * mesh.normals[tri[2]];
+                if (glm::dot(n, n) < 1e-12f) {
+                    n = face_normal;
+                }
+                BakeTexel& texel = bake_texels[x + y * size.x];
+                if (texel.normal != glm::vec3(0.0f)) {
+                    overlapped++;
+                }
+                else {
+                    covered++;
+                }
+                const glm::vec3 p = b0 * mesh.positions[tri[0]] + b1 * mesh.positions[tri[1]] + b2 * mesh.positions[tri[2]];
+                texel.position = glm::vec3(geom.transform * glm::vec4(p, 1.0f));
+                texel.normal = glm::normalize(normal_transform * n);
+            }
+        }
+    }
+
+    for (int ring = 0; ring < BAKE_PADDING; ++ring) {
+        const std::vector<BakeTexel> previous = bake_texels;
+        for (int y = 0; y < size.y; ++y) {
+            for (int x = 0; x < size.x; ++x) {
+                if (previous[x + y * size.x].normal != glm::vec3(0.0f)) {
+                    continue;
+                }
+                const glm::ivec2 neighbours[4] = { glm::ivec2(x - 1, y), glm::ivec2(x + 1, y), glm::ivec2(x, y - 1), glm::ivec2(x, y + 1) };
+                for (const glm::ivec2& n : neighbours) {
+                    if (n.x >= 0 && n.y >= 0 && n.x < size.x && n.y < size.y && previous[n.x + n.y * size.x].normal != glm::vec3(0.0f)) {
+                        bake_texels[x + y * size.x] = previous[n.x + n.y * size.x];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    cout << "BAKE: OBJECT " << object << " covers " << covered << " of " << size.x * size.y << " texels";
+    if (overlapped > 0) {
+        cout << ", WARNING: " << overlapped << " more tri texels landed on covered ones, its uvs overlap";
+    }
+    cout << endl;
+}
+
+// Recomputes the TLAS boxes bottom up after geoms moved or BLAS bounds changed, keeping
+// its topology and the geom order. children come after their parent in the flattened layout
+void Scene::refitTLAS() {
+    const bool motion = std::any_of(geoms.begin(), geoms.end(), [](const Geom& geom) { return geom.moving; });
+    tlas_end_bounds.resize(motion ? tlas_nodes_gpu.size() : 0);
+    for (int i = (int)tlas_nodes_gpu.size() - 1; i >= 0; --i) {
+        BVHNode_GPU& node = tlas_nodes_gpu[i];
+        node.AABB_min = glm::vec3(FLT_MAX);
+        node.AABB_max = glm::vec3(-FLT_MAX);
+        MotionBounds end;
+        end.AABB_min = glm::vec3(FLT_MAX);
+        end.AABB_max = glm::vec3(-FLT_MAX);
+        if (BVH_IS_LEAF(node)) {
+            for (int g = node.tri_index; g < node.tri_index + node.num_tris; ++g) {
+                TriBounds bounds = geomWorldBounds(geoms[g], blases, curve_sets);
+                node.AABB_min = glm::min(node.AABB_min, bounds.AABB_min);
+                node.AABB_max = glm::max(node.AABB_max, bounds.AABB_max);
+                // a geom that stays put has the same box at both keys
+                if (geoms[g].moving) {
+                    bounds = geomEndBounds(geoms[g], blases, curve_sets);
+                }
+                end.AABB_min = glm::min(end.AABB_min, bounds.AABB_min);
+                end.AABB_max = glm::max(end.AABB_max, bounds.AABB_max);
+            }
+        }
+        else {
+            const BVHNode_GPU& left = tlas_nodes_gpu[i + 1];
+            const BVHNode_GPU& right = tlas_nodes_gpu[node.offset_to_second_child];
+            node.AABB_min = glm::min(left.AABB_min, right.AABB_min);
+            node.AABB_max = glm::max(left.AABB_max, right.AABB_max);
+            if (motion) {
+                end.AABB_min = glm::min(tlas_end_bounds[i + 1].AABB_min, tlas_end_bounds[node.offset_to_second_child].AABB_min);
+                end.AABB_max = glm::max(tlas_end_bounds[i + 1].AABB_max, tlas_end_bounds[node.offset_to_second_child].AABB_max);
+            }
+        }
+        if (motion) {
+            tlas_end_bounds[i] = end;
+        }
+    }
+}
+
+// tri_bounds of the host mesh's tris in their current order
+void Scene::computeTriBounds() {
+    tri_bounds.resize(num_tris);
+    utilityCore::parallelFor(blases.size(), [&](int i) {
+        const BLAS& blas = blases[i];
+        for (int t = blas.tri_offset; t < blas.tri_offset + blas.num_tris; ++t) {
+            const glm::vec3& p0 = mesh.positions[mesh.indices[t][0]];
+            const glm::vec3& p1 = mesh.positions[mesh.indices[t][1]];
+            const glm::vec3& p2 = mesh.positions[mesh.indices[t][2]];
+            TriBounds& bounds = tri_bounds[t];
+            bounds.tri_ID = t;
+            bounds.AABB_max = glm::max(glm::max(p0, p1), p2);
+            bounds.AABB_min = glm::min(glm::min(p0, p1), p2);
+            bounds.AABB_centroid = (p0 + p1 + p2) / 3.0f;
+        }
+    });
+}
+
+// BVH_PROGRESSIVE, replaces the LBVH layout by the trees buildHostBLASes made over
+// computeTriBounds, as buildBLASes would have laid them out at load. the BLAS boxes stay, so
+// the TLAS does too
+void Scene::swapInHostBLASes(std::vector<std::vector<BVHNode_GPU>>& blas_nodes, std::vector<std::vector<int>>& blas_tri_order) {
+    lbvh_until_swap = false;
+    bvh_nodes_gpu.clear();
+    layOutBLASes(blas_nodes, blas_tri_order);
+    if (!wide_bvh_nodes_gpu.empty()) {
+        utilityCore::freeVector(bvh_nodes_gpu);
+    }
+    utilityCore::freeVector(tri_bounds);
+}
+
+// Builds every BLAS again from the current host mesh, for when refits have worn the trees
+// down. the tris are taken in their current order, the TLAS is only refit so geoms keep
+// their indices
+void Scene::rebuildBLASes() {
+    if (bvh_settings.builder == BVH_SBVH) {
+        // start again from one reference per tri, or every rebuild would cut them up further
+        std::vector<int> order;
+        for (BLAS& blas : blases) {
+            std::set<std::tuple<int, int, int>> seen;
+            int tri_offset = order.size();
+            for (int t = blas.tri_offset; t < blas.tri_offset + blas.num_tris; ++t) {
+                const glm::ivec3& tri = mesh.indices[t];
+                if (seen.insert(std::make_tuple(tri.x, tri.y, tri.z)).second) {
+                    order.push_back(t);
+                }
+            }
+            blas.tri_offset = tri_offset;
+            blas.num_tris = order.size() - tri_offset;
+        }
+        reorderMeshTris(order);
+        num_tris = order.size();
+    }
+    computeTriBounds();
+    for (int i = 0; i < blases.size(); ++i) {
+        BLAS& blas = blases[i];
+        mesh_sources[i].cached = false;
+        blas.wide_node_offset = -1;
+        blas.AABB_min = glm::vec3(FLT_MAX);
+        blas.AABB_max = glm::vec3(-FLT_MAX);
+        for (int t = blas.tri_offset; t < blas.tri_offset + blas.num_tris; ++t) {
+            blas.AABB_min = glm::min(blas.AABB_min, tri_bounds[t].AABB_min);
+            blas.AABB_max = glm::max(blas.AABB_max, tri_bounds[t].AABB_max);
+        }
+    }
+
+    bvh_nodes_gpu.clear();
+    wide_bvh_nodes_gpu.clear();
+    buildBLASes();
+    if (!wide_bvh_nodes_gpu.empty()) {
+        utilityCore::freeVector(bvh_nodes_gpu);
+    }
+    utilityCore::freeVector(tri_bounds);
+    refitTLAS();
+}
+
+// PBRT BVH as reference
+// https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+
+BVHNode* Scene::buildBVH(BVHBuildContext& context, std::deque<BVHNode>& pool, int start_index, int end_index) {
+    pool.emplace_back();
+    BVHNode* new_node = &pool.back();
+    context.num_nodes++;
+    int num_tris_in_node = end_index - start_index;
+
+    // get the AABB bounds for this node (getting min and max of all triangles within)
+    glm::vec3 max_bounds = glm::vec3(-100000.0);
+    glm::vec3 min_bounds = glm::vec3(100000.0);
+    for (int i = start_index; i < end_index; ++i) {
+        if (max_bounds.x < tri_bounds[i].AABB_max.x) {
+            max_bounds.x = tri_bounds[i].AABB_max.x;
+        }
+        if (max_bounds.y < tri_bounds[i].AABB_max.y) {
+            max_bounds.y = tri_bounds[i].AABB_max.y;
+        }
+        if (max_bounds.z < tri_bounds[i].AABB_max.z) {
+            max_bounds.z = tri_bounds[i].AABB_max.z;
+        }
+
+        if (min_bounds.x > tri_bounds[i].AABB_min.x) {
+            min_bounds.x = tri_bounds[i].AABB_min.x;
+        }
+        if (min_bounds.y > tri_bounds[i].AABB_min.y) {
+            min_bounds.y = tri_bounds[i].AABB_min.y;
+        }
+        if (min_bounds.z > tri_bounds[i].AABB_min.z) {
+            min_bounds.z = tri_bounds[i].AABB_min.z;
+        }
+    }
+
+    // leaf node (with 1 tri in it, or up to max_leaf_size when not using SAH to decide)
+    // BVH_SBVH only gets here for the TLAS, which takes the plain SAH build
+    const bool use_sah = bvh_settings.builder == BVH_SAH || bvh_settings.builder == BVH_SBVH;
+    if (num_tris_in_node <= 1 || (!use_sah && num_tris_in_node <= context.max_leaf_size)) {
+        return makeBVHLeaf(context, new_node, start_index, end_index, min_bounds, max_bounds);
+    }
+    // intermediate node (covering tris start_index through end_index
+    else {
+        // get the greatest length between tri centroids in each direction x, y, and z
+        glm::vec3 centroid_max = glm::vec3(-100000.0);
+        glm::vec3 centroid_min = glm::vec3(100000.0);
+        for (int i = start_index; i < end_index; ++i) {
+            if (centroid_max.x < tri_bounds[i].AABB_centroid.x) {
+                centroid_max.x = tri_bounds[i].AABB_centroid.x;
+            }
+            if (centroid_max.y < tri_bounds[i].AABB_centroid.y) {
+                centroid_max.y = tri_bounds[i].AABB_centroid.y;
+            }
             if (centroid_max.z < tri_bounds[i].AABB_centroid.z) {
                 centroid_max.z = tri_bounds[i].AABB_centroid.z;
             }
@@ -448,33 +3377,57 @@ BVHNode* Scene::buildBVH(int start_index, int end_index) {
 
 
         int mid_point = (start_index + end_index) / 2;
-        float centroid_midpoint = (centroid_min[dimension_to_split] + centroid_max[dimension_to_split]) / 2;
-
-        if (centroid_min[dimension_to_split] == centroid_max[dimension_to_split]) {
-            mesh_tris_sorted.push_back(mesh_tris[tri_bounds[start_index].tri_ID]);
-            new_node->tri_index = mesh_tris_sorted.size() - 1;
-            new_node->AABB_max = max_bounds;
-            new_node->AABB_min = min_bounds;
-            return new_node;
-        }
-
-        // partition triangles in bounding box, ones with centroids less than the midpoint go before ones with greater than
-        // using std::partition for partition algorithm
-        // https://en.cppreference.com/w/cpp/algorithm/partition
-        TriBounds* pointer_to_partition_point = std::partition(&tri_bounds[start_index], &tri_bounds[end_index - 1] + 1,
-                [dimension_to_split, centroid_midpoint](const TriBounds& triangle_AABB) {
-                return triangle_AABB.AABB_centroid[dimension_to_split] < centroid_midpoint;
-        });
 
-        // get the pointer relative to the start of the array
-        mid_point = pointer_to_partition_point - &tri_bounds[0];
+        if (use_sah) {
+            float split_area_cost;
+            mid_point = findSAHSplit(start_index, end_index, centroid_min, centroid_max, dimension_to_split, split_area_cost);
+
+            // keep the tris together if testing all of them is cheaper than the best split
+            float node_area = surfaceArea(min_bounds, max_bounds);
+            float split_cost = node_area > 0.0f && split_area_cost < FLT_MAX ? SAH_TRAVERSAL_COST + SAH_INTERSECT_COST * split_area_cost / node_area : FLT_MAX;
+            float leaf_cost = SAH_INTERSECT_COST * num_tris_in_node;
+            if (num_tris_in_node <= context.max_leaf_size && leaf_cost <= split_cost) {
+                return makeBVHLeaf(context, new_node, start_index, end_index, min_bounds, max_bounds);
+            }
+        }
+        else {
+            float centroid_midpoint = (centroid_min[dimension_to_split] + centroid_max[dimension_to_split]) / 2;
+
+            if (centroid_min[dimension_to_split] == centroid_max[dimension_to_split]) {
+                // can't separate the centroids, so all of them share one leaf
+                return makeBVHLeaf(context, new_node, start_index, end_index, min_bounds, max_bounds);
+            }
+
+            // partition triangles in bounding box, ones with centroids less than the midpoint go before ones with greater than
+            // using std::partition for partition algorithm
+            // https://en.cppreference.com/w/cpp/algorithm/partition
+            TriBounds* pointer_to_partition_point = std::partition(&tri_bounds[start_index], &tri_bounds[end_index - 1] + 1,
+                    [dimension_to_split, centroid_midpoint](const TriBounds& triangle_AABB) {
+                    return triangle_AABB.AABB_centroid[dimension_to_split] < centroid_midpoint;
+            });
+
+            // get the pointer relative to the start of the array
+            mid_point = pointer_to_partition_point - &tri_bounds[0];
+        }
 
-        // create two children nodes each for one side of the partitioned node
-        new_node->child_nodes[0] = buildBVH(start_index, mid_point);
-        new_node->child_nodes[1] = buildBVH(mid_point, end_index);
+        // create two children nodes each for one side of the partitioned node,
+        // big enough subtrees build the left side on another thread
+        if (num_tris_in_node >= BVH_TASK_MIN_TRIS && reserveBVHBuildTask()) {
+            std::thread left_task([&]() {
+                new_node->child_nodes[0] = buildBVH(context, *context.newPool(), start_index, mid_point);
+            });
+            new_node->child_nodes[1] = buildBVH(context, pool, mid_point, end_index);
+            left_task.join();
+            bvh_build_tasks--;
+        }
+        else {
+            new_node->child_nodes[0] = buildBVH(context, pool, start_index, mid_point);
+            new_node->child_nodes[1] = buildBVH(context, pool, mid_point, end_index);
+        }
 
         new_node->split_axis = dimension_to_split;
         new_node->tri_index = -1;
+        new_node->num_tris = 0;
             
         new_node->AABB_max.x = glm::max(new_node->child_nodes[0]->AABB_max.x, new_node->child_nodes[1]->AABB_max.x);
         new_node->AABB_max.y = glm::max(new_node->child_nodes[0]->AABB_max.y, new_node->child_nodes[1]->AABB_max.y);
@@ -487,17 +3440,510 @@ BVHNode* Scene::buildBVH(int start_index, int end_index) {
     }
 }
 
-void Scene::reformatBVHToGPU() {
+// puts tris in the order the BVH leaves reference them,
+// tri i of the result is tri order[i] of the current mesh
+void Scene::reorderMeshTris(const std::vector<int>& order) {
+    std::vector<glm::ivec3> sorted_indices(order.size());
+    for (int i = 0; i < order.size(); ++i) {
+        sorted_indices[i] = mesh.indices[order[i]];
+    }
+    mesh.indices.swap(sorted_indices);
+}
+
+// leaves keep their tris where the partitions left them, so leaf order is tri_bounds order
+BVHNode* Scene::makeBVHLeaf(BVHBuildContext& context, BVHNode* node, int start_index, int end_index, const glm::vec3& min_bounds, const glm::vec3& max_bounds) {
+    node->tri_index = start_index - context.range_start;
+    node->num_tris = end_index - start_index;
+    node->AABB_max = max_bounds;
+    node->AABB_min = min_bounds;
+    return node;
+}
+
+// Binned SAH split, see PBRT 4.3.2
+// Centroids are bucketed along every axis and each bucket boundary is scored with
+// SA(left) * N(left) + SA(right) * N(right). Returns the partition point in tri_bounds,
+// split_cost gets the winning score (FLT_MAX if nothing could be separated).
+int Scene::findSAHSplit(int start_index, int end_index, const glm::vec3& centroid_min, const glm::vec3& centroid_max, int& split_axis, float& split_cost) {
+    const int num_bins = bvh_settings.sah_bins;
+    SAHBin bins[MAX_SAH_BINS];
+    float right_cost[MAX_SAH_BINS];
+    int right_count[MAX_SAH_BINS];
+
+    glm::vec3 centroid_extent = centroid_max - centroid_min;
+    float best_cost = FLT_MAX;
+    int best_axis = -1;
+    int best_bin = -1;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroid_extent[axis] <= 0.0f) {
+            continue;
+        }
+
+        for (int b = 0; b < num_bins; ++b) {
+            bins[b].AABB_min = glm::vec3(FLT_MAX);
+            bins[b].AABB_max = glm::vec3(-FLT_MAX);
+            bins[b].count = 0;
+        }
+
+        float bin_scale = (float)num_bins / centroid_extent[axis];
+        for (int i = start_index; i < end_index; ++i) {
+            int b = glm::min((int)((tri_bounds[i].AABB_centroid[axis] - centroid_min[axis]) * bin_scale), num_bins - 1);
+            bins[b].AABB_min = glm::min(bins[b].AABB_min, tri_bounds[i].AABB_min);
+            bins[b].AABB_max = glm::max(bins[b].AABB_max, tri_bounds[i].AABB_max);
+            bins[b].count++;
+        }
+
+        // sweep from the right so right_cost[b] covers every bin above boundary b
+        glm::vec3 grow_min = glm::vec3(FLT_MAX);
+        glm::vec3 grow_max = glm::vec3(-FLT_MAX);
+        int grow_count = 0;
+        for (int b = num_bins - 1; b > 0; --b) {
+            if (bins[b].count > 0) {
+                grow_min = glm::min(grow_min, bins[b].AABB_min);
+                grow_max = glm::max(grow_max, bins[b].AABB_max);
+                grow_count += bins[b].count;
+            }
+            right_count[b - 1] = grow_count;
+            right_cost[b - 1] = grow_count > 0 ? surfaceArea(grow_min, grow_max) * grow_count : 0.0f;
+        }
+
+        // then from the left, scoring every boundary with tris on both sides
+        grow_min = glm::vec3(FLT_MAX);
+        grow_max = glm::vec3(-FLT_MAX);
+        grow_count = 0;
+        for (int b = 0; b < num_bins - 1; ++b) {
+            if (bins[b].count > 0) {
+                grow_min = glm::min(grow_min, bins[b].AABB_min);
+                grow_max = glm::max(grow_max, bins[b].AABB_max);
+                grow_count += bins[b].count;
+            }
+            if (grow_count == 0 || right_count[b] == 0) {
+                continue;
+            }
+            float cost = surfaceArea(grow_min, grow_max) * grow_count + right_cost[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    split_cost = best_cost;
+    if (best_axis == -1) {
+        // every centroid is in the same spot, split the range in half so no tri is dropped
+        int mid_point = (start_index + end_index) / 2;
+        std::nth_element(&tri_bounds[start_index], &tri_bounds[mid_point], &tri_bounds[end_index - 1] + 1,
+            [split_axis](const TriBounds& a, const TriBounds& b) {
+                return a.AABB_centroid[split_axis] < b.AABB_centroid[split_axis];
+        });
+        return mid_point;
+    }
+
+    split_axis = best_axis;
+    float bin_scale = (float)num_bins / centroid_extent[best_axis];
+    float axis_min = centroid_min[best_axis];
+    TriBounds* pointer_to_partition_point = std::partition(&tri_bounds[start_index], &tri_bounds[end_index - 1] + 1,
+        [best_axis, best_bin, bin_scale, axis_min, num_bins](const TriBounds& triangle_AABB) {
+            return glm::min((int)((triangle_AABB.AABB_centroid[best_axis] - axis_min) * bin_scale), num_bins - 1) <= best_bin;
+    });
+
+    return pointer_to_partition_point - &tri_bounds[0];
+}
+
+// SBVH, see Stich et al. 2009, "Spatial Splits in Bounding Volume Hierarchies".
+// Each reference is a tri clipped to a box (TriBounds with the clipped box and its centre).
+// A node picks the better of a binned object split and a binned spatial split. A spatial
+// split cuts the tris that straddle its plane, so both children get tight boxes where an
+// object split would leave them overlapping. It is only tried when the object split's
+// children overlap by more than this share of the root box area
+#define SBVH_OVERLAP_THRESHOLD 1e-5f
+
+struct SBVHSplit {
+    float cost = FLT_MAX; // SA(left) * N(left) + SA(right) * N(right)
+    int axis = -1;
+    bool spatial = false;
+    float plane; // spatial: the cut. object: centroids go left when binned at or below bin
+    int bin;
+    float bin_min, bin_scale;
+    glm::vec3 left_min, left_max, right_min, right_max;
+    int left_count, right_count;
+};
+
+static bool validBounds(const glm::vec3& AABB_min, const glm::vec3& AABB_max) {
+    return AABB_min.x <= AABB_max.x && AABB_min.y <= AABB_max.y && AABB_min.z <= AABB_max.z;
+}
+
+static int sbvhBin(float x, float bin_min, float bin_scale, int num_bins) {
+    return glm::clamp((int)((x - bin_min) * bin_scale), 0, num_bins - 1);
+}
+
+// box of the part of ref's tri between lo and hi along axis, within ref's box. the clipped
+// polygon's corners are the tri vertices in the slab and the edge crossings of its planes
+static bool clipReference(const TriBounds& ref, const glm::vec3 v[3], int axis, float lo, float hi, glm::vec3& AABB_min, glm::vec3& AABB_max) {
+    AABB_min = glm::vec3(FLT_MAX);
+    AABB_max = glm::vec3(-FLT_MAX);
+    const float planes[2] = { lo, hi };
+    for (int i = 0; i < 3; ++i) {
+        const glm::vec3& a = v[i];
+        const glm::vec3& b = v[(i + 1) % 3];
+        if (a[axis] >= lo && a[axis] <= hi) {
+            AABB_min = glm::min(AABB_min, a);
+            AABB_max = glm::max(AABB_max, a);
+        }
+        for (float plane : planes) {
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                glm::vec3 p = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+                p[axis] = plane;
+                AABB_min = glm::min(AABB_min, p);
+                AABB_max = glm::max(AABB_max, p);
+            }
+        }
+    }
+    AABB_min = glm::max(AABB_min, ref.AABB_min);
+    AABB_max = glm::min(AABB_max, ref.AABB_max);
+    return validBounds(AABB_min, AABB_max);
+}
+
+// binned SAH over the reference centroids, same sweep as findSAHSplit
+static SBVHSplit findObjectSplit(const std::vector<TriBounds>& refs, int num_bins) {
+    SBVHSplit best;
+    glm::vec3 centroid_min = glm::vec3(FLT_MAX);
+    glm::vec3 centroid_max = glm::vec3(-FLT_MAX);
+    for (const TriBounds& ref : refs) {
+        centroid_min = glm::min(centroid_min, ref.AABB_centroid);
+        centroid_max = glm::max(centroid_max, ref.AABB_centroid);
+    }
+
+    SAHBin bins[MAX_SAH_BINS];
+    SAHBin right[MAX_SAH_BINS];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centroid_max[axis] - centroid_min[axis];
+        if (extent <= 0.0f) {
+            continue;
+        }
+        for (int b = 0; b < num_bins; ++b) {
+            bins[b].AABB_min = glm::vec3(FLT_MAX);
+            bins[b].AABB_max = glm::vec3(-FLT_MAX);
+            bins[b].count = 0;
+        }
+        float bin_scale = (float)num_bins / extent;
+        for (const TriBounds& ref : refs) {
+            SAHBin& bin = bins[sbvhBin(ref.AABB_centroid[axis], centroid_min[axis], bin_scale, num_bins)];
+            bin.AABB_min = glm::min(bin.AABB_min, ref.AABB_min);
+            bin.AABB_max = glm::max(bin.AABB_max, ref.AABB_max);
+            bin.count++;
+        }
+
+        // right[b] covers every bin above boundary b
+        right[num_bins - 1] = bins[num_bins - 1];
+        for (int b = num_bins - 2; b >= 0; --b) {
+            right[b].AABB_min = glm::min(right[b + 1].AABB_min, bins[b].AABB_min);
+            right[b].AABB_max = glm::max(right[b + 1].AABB_max, bins[b].AABB_max);
+            right[b].count = right[b + 1].count + bins[b].count;
+        }
+
+        SAHBin left = bins[0];
+        for (int b = 0; b < num_bins - 1; ++b) {
+            if (b > 0) {
+                left.AABB_min = glm::min(left.AABB_min, bins[b].AABB_min);
+                left.AABB_max = glm::max(left.AABB_max, bins[b].AABB_max);
+                left.count += bins[b].count;
+            }
+            const SAHBin& rest = right[b + 1];
+            if (left.count == 0 || rest.count == 0) {
+                continue;
+            }
+            float cost = surfaceArea(left.AABB_min, left.AABB_max) * left.count + surfaceArea(rest.AABB_min, rest.AABB_max) * rest.count;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.bin_min = centroid_min[axis];
+                best.bin_scale = bin_scale;
+                best.left_min = left.AABB_min;
+                best.left_max = left.AABB_max;
+                best.right_min = rest.AABB_min;
+                best.right_max = rest.AABB_max;
+                best.left_count = left.count;
+                best.right_count = rest.count;
+            }
+        }
+    }
+    return best;
+}
+
+// binned spatial split: bins are even slices of the node box, each reference is clipped to
+// every bin it crosses and counted as entering its first bin and leaving its last
+static SBVHSplit findSpatialSplit(const std::vector<TriBounds>& refs, const Mesh& mesh, const glm::vec3& node_min, const glm::vec3& node_max, int num_bins) {
+    SBVHSplit best;
+    SAHBin bins[MAX_SAH_BINS];
+    SAHBin right[MAX_SAH_BINS];
+    int entries[MAX_SAH_BINS];
+    int exits[MAX_SAH_BINS];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = node_max[axis] - node_min[axis];
+        if (extent <= 0.0f) {
+            continue;
+        }
+        for (int b = 0; b < num_bins; ++b) {
+            bins[b].AABB_min = glm::vec3(FLT_MAX);
+            bins[b].AABB_max = glm::vec3(-FLT_MAX);
+            entries[b] = 0;
+            exits[b] = 0;
+        }
+        float bin_scale = (float)num_bins / extent;
+        float bin_width = extent / num_bins;
+        for (const TriBounds& ref : refs) {
+            const glm::ivec3& tri = mesh.indices[ref.tri_ID];
+            const glm::vec3 v[3] = { mesh.positions[tri.x], mesh.positions[tri.y], mesh.positions[tri.z] };
+            int first = sbvhBin(ref.AABB_min[axis], node_min[axis], bin_scale, num_bins);
+            int last = glm::max(sbvhBin(ref.AABB_max[axis], node_min[axis], bin_scale, num_bins), first);
+            for (int b = first; b <= last; ++b) {
+                float lo = b == 0 ? -FLT_MAX : node_min[axis] + b * bin_width;
+                float hi = b == num_bins - 1 ? FLT_MAX : node_min[axis] + (b + 1) * bin_width;
+                glm::vec3 clip_min, clip_max;
+                if (clipReference(ref, v, axis, lo, hi, clip_min, clip_max)) {
+                    bins[b].AABB_min = glm::min(bins[b].AABB_min, clip_min);
+                    bins[b].AABB_max = glm::max(bins[b].AABB_max, clip_max);
+                }
+            }
+            entries[first]++;
+            exits[last]++;
+        }
+
+        // right[b] covers bins b and above, counting the references that leave in them
+        right[num_bins - 1] = bins[num_bins - 1];
+        right[num_bins - 1].count = exits[num_bins - 1];
+        for (int b = num_bins - 2; b >= 0; --b) {
+            right[b].AABB_min = glm::min(right[b + 1].AABB_min, bins[b].AABB_min);
+            right[b].AABB_max = glm::max(right[b + 1].AABB_max, bins[b].AABB_max);
+            right[b].count = right[b + 1].count + exits[b];
+        }
+
+        SAHBin left = bins[0];
+        left.count = entries[0];
+        for (int b = 0; b < num_bins - 1; ++b) {
+            if (b > 0) {
+                left.AABB_min = glm::min(left.AABB_min, bins[b].AABB_min);
+                left.AABB_max = glm::max(left.AABB_max, bins[b].AABB_max);
+                left.count += entries[b];
+            }
+            const SAHBin& rest = right[b + 1];
+            if (left.count == 0 || rest.count == 0 || !validBounds(left.AABB_min, left.AABB_max) || !validBounds(rest.AABB_min, rest.AABB_max)) {
+                continue;
+            }
+            float cost = surfaceArea(left.AABB_min, left.AABB_max) * left.count + surfaceArea(rest.AABB_min, rest.AABB_max) * rest.count;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.spatial = true;
+                best.plane = node_min[axis] + (b + 1) * bin_width;
+                best.left_min = left.AABB_min;
+                best.left_max = left.AABB_max;
+                best.right_min = rest.AABB_min;
+                best.right_max = rest.AABB_max;
+                best.left_count = left.count;
+                best.right_count = rest.count;
+            }
+        }
+    }
+    return best;
+}
+
+// hands refs to the children of a spatial split. a straddling reference is cut in two unless
+// moving it whole into one side scores better (the paper's reference unsplitting), or the
+// duplication budget has run out
+static void partitionSpatial(std::vector<TriBounds>& refs, const Mesh& mesh, const SBVHSplit& split, int& split_budget,
+    std::vector<TriBounds>& left, std::vector<TriBounds>& right) {
+    const int axis = split.axis;
+    const float left_area = surfaceArea(split.left_min, split.left_max);
+    const float right_area = surfaceArea(split.right_min, split.right_max);
+    for (const TriBounds& ref : refs) {
+        if (ref.AABB_max[axis] <= split.plane) {
+            left.push_back(ref);
+            continue;
+        }
+        if (ref.AABB_min[axis] >= split.plane) {
+            right.push_back(ref);
+            continue;
+        }
+
+        const float split_cost = left_area * split.left_count + right_area * split.right_count;
+        const float left_cost = surfaceArea(glm::min(split.left_min, ref.AABB_min), glm::max(split.left_max, ref.AABB_max)) * split.left_count
+            + right_area * (split.right_count - 1);
+        const float right_cost = left_area * (split.left_count - 1)
+            + surfaceArea(glm::min(split.right_min, ref.AABB_min), glm::max(split.right_max, ref.AABB_max)) * split.right_count;
+
+        const glm::ivec3& tri = mesh.indices[ref.tri_ID];
+        const glm::vec3 v[3] = { mesh.positions[tri.x], mesh.positions[tri.y], mesh.positions[tri.z] };
+        TriBounds left_ref = ref;
+        TriBounds right_ref = ref;
+        bool left_valid = clipReference(ref, v, axis, -FLT_MAX, split.plane, left_ref.AABB_min, left_ref.AABB_max);
+        bool right_valid = clipReference(ref, v, axis, split.plane, FLT_MAX, right_ref.AABB_min, right_ref.AABB_max);
+        if (left_valid && right_valid && split_budget > 0 && split_cost < left_cost && split_cost < right_cost) {
+            split_budget--;
+            left_ref.AABB_centroid = 0.5f * (left_ref.AABB_min + left_ref.AABB_max);
+            right_ref.AABB_centroid = 0.5f * (right_ref.AABB_min + right_ref.AABB_max);
+            left.push_back(left_ref);
+            right.push_back(right_ref);
+        }
+        else if (left_cost <= right_cost) {
+            left.push_back(ref);
+        }
+        else {
+            right.push_back(ref);
+        }
+    }
+}
+
+// builds the SBVH over one BLAS's tri_bounds [start_index, end_index) and flattens it into
+// nodes. leaf_tri_IDs gets a tri_ID per reference in leaf order, so it can be longer than the range
+void Scene::buildFlatSBVH(int start_index, int end_index, std::vector<BVHNode_GPU>& nodes, std::vector<int>& leaf_tri_IDs) {
+    BVHBuildContext context;
+    context.range_start = 0;
+    context.max_leaf_size = bvh_settings.max_leaf_size;
+    context.num_nodes = 0;
+    context.split_budget = (int)(bvh_settings.split_budget * (end_index - start_index));
+
+    std::vector<TriBounds> refs(tri_bounds.begin() + start_index, tri_bounds.begin() + end_index);
+    glm::vec3 root_min = glm::vec3(FLT_MAX);
+    glm::vec3 root_max = glm::vec3(-FLT_MAX);
+    for (const TriBounds& ref : refs) {
+        root_min = glm::min(root_min, ref.AABB_min);
+        root_max = glm::max(root_max, ref.AABB_max);
+    }
+    context.root_area = surfaceArea(root_min, root_max);
+    BVHNode* root_node = buildSBVH(context, *context.newPool(), refs, leaf_tri_IDs);
+
+    nodes.clear();
+    nodes.reserve(context.num_nodes);
+    reformatBVHToGPU(root_node, nodes);
+}
+
+// one SBVH node over refs, which it consumes. leaves append their references to leaf_tri_IDs,
+// left subtrees first so a leaf's tris are next to its neighbours'
+BVHNode* Scene::buildSBVH(BVHBuildContext& context, std::deque<BVHNode>& pool, std::vector<TriBounds>& refs, std::vector<int>& leaf_tri_IDs) {
+    pool.emplace_back();
+    BVHNode* new_node = &pool.back();
+    context.num_nodes++;
+    const int num_refs = refs.size();
+
+    glm::vec3 min_bounds = glm::vec3(FLT_MAX);
+    glm::vec3 max_bounds = glm::vec3(-FLT_MAX);
+    for (const TriBounds& ref : refs) {
+        min_bounds = glm::min(min_bounds, ref.AABB_min);
+        max_bounds = glm::max(max_bounds, ref.AABB_max);
+    }
+
+    SBVHSplit split;
+    if (num_refs > 1) {
+        split = findObjectSplit(refs, bvh_settings.sah_bins);
+        glm::vec3 overlap_min = glm::max(split.left_min, split.right_min);
+        glm::vec3 overlap_max = glm::min(split.left_max, split.right_max);
+        bool overlaps = split.axis == -1 || (validBounds(overlap_min, overlap_max)
+            && surfaceArea(overlap_min, overlap_max) > SBVH_OVERLAP_THRESHOLD * context.root_area);
+        if (overlaps && context.split_budget > 0) {
+            SBVHSplit spatial = findSpatialSplit(refs, mesh, min_bounds, max_bounds, bvh_settings.sah_bins);
+            if (spatial.cost < split.cost) {
+                split = spatial;
+            }
+        }
+    }
+
+    // keep the refs together if testing all of them is cheaper than the best split
+    float node_area = surfaceArea(min_bounds, max_bounds);
+    float split_cost = node_area > 0.0f && split.cost < FLT_MAX ? SAH_TRAVERSAL_COST + SAH_INTERSECT_COST * split.cost / node_area : FLT_MAX;
+    float leaf_cost = SAH_INTERSECT_COST * num_refs;
+    if (num_refs <= 1 || (num_refs <= context.max_leaf_size && leaf_cost <= split_cost)) {
+        new_node->tri_index = leaf_tri_IDs.size();
+        new_node->num_tris = num_refs;
+        new_node->AABB_min = min_bounds;
+        new_node->AABB_max = max_bounds;
+        for (const TriBounds& ref : refs) {
+            leaf_tri_IDs.push_back(ref.tri_ID);
+        }
+        std::vector<TriBounds>().swap(refs);
+        return new_node;
+    }
+
+    std::vector<TriBounds> left, right;
+    if (split.spatial) {
+        partitionSpatial(refs, mesh, split, context.split_budget, left, right);
+        if (left.empty() || right.empty()) {
+            // unsplitting moved every reference to one side, take the object split instead
+            left.clear();
+            right.clear();
+            split = findObjectSplit(refs, bvh_settings.sah_bins);
+        }
+    }
+    if (!split.spatial) {
+        if (split.axis != -1) {
+            for (const TriBounds& ref : refs) {
+                bool goes_left = sbvhBin(ref.AABB_centroid[split.axis], split.bin_min, split.bin_scale, bvh_settings.sah_bins) <= split.bin;
+                (goes_left ? left : right).push_back(ref);
+            }
+        }
+        if (left.empty() || right.empty()) {
+            // every centroid is in the same spot, split the refs in half so none is dropped
+            left.assign(refs.begin(), refs.begin() + num_refs / 2);
+            right.assign(refs.begin() + num_refs / 2, refs.end());
+        }
+    }
+    std::vector<TriBounds>().swap(refs);
+
+    new_node->child_nodes[0] = buildSBVH(context, pool, left, leaf_tri_IDs);
+    new_node->child_nodes[1] = buildSBVH(context, pool, right, leaf_tri_IDs);
+    new_node->split_axis = glm::max(split.axis, 0);
+    new_node->tri_index = -1;
+    new_node->num_tris = 0;
+    new_node->AABB_min = glm::min(new_node->child_nodes[0]->AABB_min, new_node->child_nodes[1]->AABB_min);
+    new_node->AABB_max = glm::max(new_node->child_nodes[0]->AABB_max, new_node->child_nodes[1]->AABB_max);
+    return new_node;
+}
+
+// first tri and tri count of a subtree's leaves, false unless they cover one run of tris
+static bool subtreeTriRange(const BVHNode* root_node, int& first_tri, int& num_tris) {
+    int end_tri = 0;
+    first_tri = INT_MAX;
+    num_tris = 0;
+    std::stack<const BVHNode*> nodes_to_visit;
+    nodes_to_visit.push(root_node);
+    while (!nodes_to_visit.empty()) {
+        const BVHNode* node = nodes_to_visit.top();
+        nodes_to_visit.pop();
+        if (node->tri_index == -1) {
+            nodes_to_visit.push(node->child_nodes[0]);
+            nodes_to_visit.push(node->child_nodes[1]);
+            continue;
+        }
+        if (node->num_tris > 0) {
+            first_tri = glm::min(first_tri, node->tri_index);
+            end_tri = glm::max(end_tri, node->tri_index + node->num_tris);
+            num_tris += node->num_tris;
+        }
+    }
+    return num_tris > 0 && end_tri - first_tri == num_tris;
+}
+
+// flattens a tree into nodes, indices are relative to the start of nodes. an inner node at depth
+// BVH_STACK_SIZE (the root is 1) becomes one leaf over its subtree's tris, so the walk never
+// pushes past the traversal stack
+void Scene::reformatBVHToGPU(BVHNode* root_node, std::vector<BVHNode_GPU>& nodes) {
+    ProfileRange range("reformat BVH");
+    PhaseTimer phase(PHASE_BVH_REFORMAT);
     BVHNode *cur_node;
     std::stack<BVHNode*> nodes_to_process;
     std::stack<int> index_to_parent;
     std::stack<bool> second_child_query;
+    std::stack<int> node_depths;
     int cur_node_index = 0;
     int parent_index = 0;
     bool is_second_child = false;
     nodes_to_process.push(root_node);
     index_to_parent.push(-1);
     second_child_query.push(false);
+    node_depths.push(1);
     while (!nodes_to_process.empty()) {
         BVHNode_GPU new_gpu_node;
 
@@ -507,27 +3953,356 @@ void Scene::reformatBVHToGPU() {
         index_to_parent.pop();
         is_second_child = second_child_query.top();
         second_child_query.pop();
+        const int depth = node_depths.top();
+        node_depths.pop();
 
         if (is_second_child && parent_index != -1) {
-            bvh_nodes_gpu[parent_index].offset_to_second_child = bvh_nodes_gpu.size();
+            nodes[parent_index].offset_to_second_child = nodes.size();
         }
         new_gpu_node.AABB_min = cur_node->AABB_min;
         new_gpu_node.AABB_max = cur_node->AABB_max;
+        int first_tri, num_tris;
         if (cur_node->tri_index != -1) {
             // leaf node
             new_gpu_node.tri_index = cur_node->tri_index;
+            new_gpu_node.num_tris = cur_node->num_tris;
+        }
+        else if (depth >= BVH_STACK_SIZE && subtreeTriRange(cur_node, first_tri, num_tris)) {
+            // too deep for the stack, the subtree's tris go in one leaf
+            new_gpu_node.tri_index = first_tri;
+            new_gpu_node.num_tris = num_tris;
         }
         else {
-            // intermediate node
-            new_gpu_node.axis = cur_node->split_axis;
-            new_gpu_node.tri_index = -1;
-            nodes_to_process.push(cur_node->child_nodes[1]);
-            index_to_parent.push(bvh_nodes_gpu.size());
+            // intermediate node. BVH_AREA_ORDER puts the child a ray is likelier to enter
+            // (the larger box) next to its parent, so the common descent stays sequential
+            const BVHNode* lower = cur_node->child_nodes[0];
+            const BVHNode* upper = cur_node->child_nodes[1];
+            bool upper_first = bvh_settings.area_order
+                && surfaceArea(upper->AABB_min, upper->AABB_max) > surfaceArea(lower->AABB_min, lower->AABB_max);
+            new_gpu_node.offset_to_second_child = -1;
+            new_gpu_node.num_tris = BVH_INNER_NODE(cur_node->split_axis, upper_first);
+            nodes_to_process.push(upper_first ? cur_node->child_nodes[0] : cur_node->child_nodes[1]);
+            index_to_parent.push(nodes.size());
             second_child_query.push(true);
-            nodes_to_process.push(cur_node->child_nodes[0]);
+            node_depths.push(depth + 1);
+            nodes_to_process.push(upper_first ? cur_node->child_nodes[1] : cur_node->child_nodes[0]);
             index_to_parent.push(-1);
             second_child_query.push(false);
+            node_depths.push(depth + 1);
+        }
+        nodes.push_back(new_gpu_node);
+    }
+}
+
+// SAH cost of a flattened tree relative to its root box, optionally its depth and leaf count
+float Scene::sahCost(const BVHNode_GPU* nodes, int* depth, int* leaves) {
+    BVHStats stats = bvhStats(nodes);
+    if (depth != NULL) {
+        *depth = stats.max_depth;
+    }
+    if (leaves != NULL) {
+        *leaves = stats.num_leaves;
+    }
+    return stats.sah_cost;
+}
+
+// Walks a flattened tree for its SAH cost, depth and leaf size histograms and sibling overlap
+BVHStats Scene::bvhStats(const BVHNode_GPU* nodes) {
+    BVHStats stats;
+    float root_area = surfaceArea(nodes[0].AABB_min, nodes[0].AABB_max);
+    long long depth_sum = 0;
+
+    std::stack<glm::ivec2> nodes_to_visit; // (node index, depth)
+    nodes_to_visit.push(glm::ivec2(0, 1));
+    while (!nodes_to_visit.empty()) {
+        glm::ivec2 cur = nodes_to_visit.top();
+        nodes_to_visit.pop();
+        const BVHNode_GPU& node = nodes[cur.x];
+        stats.num_nodes++;
+
+        float area_ratio = root_area > 0.0f ? surfaceArea(node.AABB_min, node.AABB_max) / root_area : 1.0f;
+        if (BVH_IS_LEAF(node)) {
+            stats.sah_cost += area_ratio * SAH_INTERSECT_COST * node.num_tris;
+            stats.num_leaves++;
+            stats.max_depth = glm::max(stats.max_depth, cur.y);
+            stats.max_leaf_size = glm::max(stats.max_leaf_size, node.num_tris);
+            depth_sum += cur.y;
+            if (stats.leaf_sizes.size() <= node.num_tris) {
+                stats.leaf_sizes.resize(node.num_tris + 1, 0);
+            }
+            stats.leaf_sizes[node.num_tris]++;
+            if (stats.depths.size() <= cur.y) {
+                stats.depths.resize(cur.y + 1, 0);
+            }
+            stats.depths[cur.y]++;
+        }
+        else {
+            stats.sah_cost += area_ratio * SAH_TRAVERSAL_COST;
+            const BVHNode_GPU& left = nodes[cur.x + 1];
+            const BVHNode_GPU& right = nodes[node.offset_to_second_child];
+            glm::vec3 overlap_min = glm::max(left.AABB_min, right.AABB_min);
+            glm::vec3 overlap_max = glm::min(left.AABB_max, right.AABB_max);
+            if (root_area > 0.0f && glm::all(glm::lessThanEqual(overlap_min, overlap_max))) {
+                stats.overlap += surfaceArea(overlap_min, overlap_max) / root_area;
+            }
+            nodes_to_visit.push(glm::ivec2(cur.x + 1, cur.y + 1));
+            nodes_to_visit.push(glm::ivec2(node.offset_to_second_child, cur.y + 1));
+        }
+    }
+    stats.avg_depth = (float)depth_sum / glm::max(stats.num_leaves, 1);
+    return stats;
+}
+
+// counts of a histogram as "value: count" pairs, every bucket covering step values
+static string histogramString(const std::vector<int>& counts, int step) {
+    std::ostringstream out;
+    for (int first = 0; first < counts.size(); first += step) {
+        int count = 0;
+        for (int v = first; v < first + step && v < counts.size(); ++v) {
+            count += counts[v];
+        }
+        if (count == 0) {
+            continue;
+        }
+        out << " " << first;
+        if (step > 1) {
+            out << "-" << first + step - 1;
+        }
+        out << ": " << count;
+    }
+    return out.str();
+}
+
+void Scene::reportBVHStats(const BVHNode_GPU* nodes, int num_prims) {
+    if (nodes == NULL) {
+        return;
+    }
+
+    BVHStats stats = bvhStats(nodes);
+    std::cout << "BVH SAH cost: " << stats.sah_cost << ", max depth: " << stats.max_depth << ", leaves: " << stats.num_leaves
+        << " (avg " << (float)num_prims / stats.num_leaves << " tris)" << std::endl;
+    if (bvh_settings.report) {
+        std::cout << "  avg leaf depth: " << stats.avg_depth << ", sibling overlap: " << stats.overlap << std::endl;
+        std::cout << "  leaf sizes:" << histogramString(stats.leaf_sizes, 1) << std::endl;
+        std::cout << "  leaf depths:" << histogramString(stats.depths, 4) << std::endl;
+    }
+    if (stats.max_depth > BVH_STACK_SIZE) {
+        std::cout << "WARNING: BVH depth " << stats.max_depth << " exceeds the traversal stack size of " << BVH_STACK_SIZE << std::endl;
+    }
+}
+
+// BVH_REPORT, builds every mesh with each host builder before the real build and prints the
+// trees side by side. runs on the load order tri_bounds, which every build puts back
+void Scene::compareBVHBuilders() {
+    const BVHBuilder builders[] = { BVH_MIDPOINT, BVH_SAH, BVH_SBVH };
+    const char* builder_names[] = { "midpoint", "SAH", "SBVH" };
+    const int num_builders = sizeof(builders) / sizeof(builders[0]);
+    const BVHBuilder scene_builder = bvh_settings.builder;
+    const std::vector<TriBounds> load_order = tri_bounds;
+
+    std::vector<std::vector<BVHStats>> stats(num_builders, std::vector<BVHStats>(blases.size()));
+    std::vector<std::vector<int>> refs(num_builders, std::vector<int>(blases.size(), 0));
+    std::vector<double> build_ms(num_builders);
+    for (int b = 0; b < num_builders; ++b) {
+        bvh_settings.builder = builders[b];
+        auto start = std::chrono::high_resolution_clock::now();
+        utilityCore::parallelFor(blases.size(), [&](int i) {
+            const BLAS& blas = blases[i];
+            if (mesh_sources[i].cached || blas.num_tris == 0) {
+                return;
+            }
+            std::vector<BVHNode_GPU> nodes;
+            std::vector<int> leaf_tri_IDs;
+            if (builders[b] == BVH_SBVH) {
+                buildFlatSBVH(blas.tri_offset, blas.tri_offset + blas.num_tris, nodes, leaf_tri_IDs);
+            }
+            else {
+                buildFlatBVH(blas.tri_offset, blas.tri_offset + blas.num_tris, bvh_settings.max_leaf_size, nodes, leaf_tri_IDs);
+            }
+            stats[b][i] = bvhStats(nodes.data());
+            refs[b][i] = leaf_tri_IDs.size();
+        });
+        build_ms[b] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        tri_bounds = load_order;
+    }
+    bvh_settings.builder = scene_builder;
+
+    for (int i = 0; i < blases.size(); ++i) {
+        if (mesh_sources[i].cached || blases[i].num_tris == 0) {
+            cout << "BVH builders, " << mesh_sources[i].path << ": loaded from its cache, not compared" << endl;
+            continue;
+        }
+        cout << "BVH builders, " << mesh_sources[i].path << " (" << blases[i].num_tris << " tris, "
+            << bvh_settings.sah_bins << " bins, leaves of up to " << bvh_settings.max_leaf_size << "):" << endl;
+        printf("  %-9s %8s %9s %8s %9s %9s %9s %9s %9s %8s\n", "builder", "nodes", "SAH cost", "leaves", "avg leaf",
+            "max leaf", "avg depth", "max depth", "overlap", "refs");
+        for (int b = 0; b < num_builders; ++b) {
+            const BVHStats& s = stats[b][i];
+            printf("  %-9s %8d %9.2f %8d %9.2f %9d %9.2f %9d %9.2f %8d%s\n", builder_names[b], s.num_nodes, s.sah_cost,
+                s.num_leaves, (float)refs[b][i] / s.num_leaves, s.max_leaf_size, s.avg_depth, s.max_depth, s.overlap,
+                refs[b][i], s.max_depth > BVH_STACK_SIZE ? "  (deeper than the stack)" : "");
+        }
+    }
+    printf("  build time over every mesh:");
+    for (int b = 0; b < num_builders; ++b) {
+        printf(" %s %.1f ms%s", builder_names[b], build_ms[b], b + 1 < num_builders ? "," : "\n");
+    }
+}
+
+// deepest wide node (the root is 1) that may have intermediate children. a walk holds at most
+// WIDE_BVH_WIDTH - 1 waiting siblings per level above the node plus its own children, so this
+// keeps intersectWideBVH within WIDE_BVH_STACK_SIZE
+#define WIDE_BVH_MAX_INNER_DEPTH ((WIDE_BVH_STACK_SIZE - 1) / (WIDE_BVH_WIDTH - 1))
+
+// Collapses every BLAS into WIDE_BVH_WIDTH-ary nodes with quantized child boxes
+void Scene::collapseBVHToWide() {
+    ProfileRange range("collapse BVH");
+    PhaseTimer phase(PHASE_BVH_BUILD);
+    wide_bvh_nodes_gpu.clear();
+    if (bvh_nodes_gpu.empty()) {
+        return;
+    }
+
+    int max_depth = 0;
+    for (BLAS& blas : blases) {
+        std::vector<WideBVHNode_GPU> wide_nodes;
+        collapseBVHNode(&bvh_nodes_gpu[blas.node_offset], 0, wide_nodes, 1, max_depth);
+        blas.wide_node_offset = wide_bvh_nodes_gpu.size();
+        wide_bvh_nodes_gpu.insert(wide_bvh_nodes_gpu.end(), wide_nodes.begin(), wide_nodes.end());
+    }
+
+    std::cout << "Wide BVH (" << WIDE_BVH_WIDTH << " wide): " << wide_bvh_nodes_gpu.size() << " nodes, "
+        << wide_bvh_nodes_gpu.size() * sizeof(WideBVHNode_GPU) / 1024 << " KB (binary "
+        << bvh_nodes_gpu.size() * sizeof(BVHNode_GPU) / 1024 << " KB), max depth: " << max_depth << std::endl;
+    if (max_depth > WIDE_BVH_MAX_INNER_DEPTH + 1) {
+        std::cout << "WARNING: wide BVH depth " << max_depth << " may overflow the traversal stack size of " << WIDE_BVH_STACK_SIZE << std::endl;
+    }
+}
+
+// nudges q down (or up) until the decoded plane is outside the true bound, both for
+// the unfused float math on the host and an fma on the device (checked in double)
+static unsigned char quantizeBound(float bound, float origin, float scale, bool is_min) {
+    if (scale <= 0.0f) {
+        return is_min ? 0 : 255;
+    }
+    int q = is_min ? (int)floorf((bound - origin) / scale) : (int)ceilf((bound - origin) / scale);
+    q = glm::clamp(q, 0, 255);
+    if (is_min) {
+        while (q > 0 && (origin + q * scale > bound || (double)origin + (double)q * (double)scale > bound)) {
+            q--;
+        }
+    }
+    else {
+        while (q < 255 && (origin + q * scale < bound || (double)origin + (double)q * (double)scale < bound)) {
+            q++;
+        }
+    }
+    return (unsigned char)q;
+}
+
+// first tri and tri count of a flattened subtree's leaves, false unless they cover one run of tris
+static bool subtreeTriRange(const BVHNode_GPU* nodes, int node_index, int& first_tri, int& num_tris) {
+    int end_tri = 0;
+    first_tri = INT_MAX;
+    num_tris = 0;
+    std::stack<int> nodes_to_visit;
+    nodes_to_visit.push(node_index);
+    while (!nodes_to_visit.empty()) {
+        const int index = nodes_to_visit.top();
+        nodes_to_visit.pop();
+        const BVHNode_GPU& node = nodes[index];
+        if (!BVH_IS_LEAF(node)) {
+            nodes_to_visit.push(index + 1);
+            nodes_to_visit.push(node.offset_to_second_child);
+            continue;
+        }
+        if (node.num_tris > 0) {
+            first_tri = glm::min(first_tri, node.tri_index);
+            end_tri = glm::max(end_tri, node.tri_index + node.num_tris);
+            num_tris += node.num_tris;
+        }
+    }
+    return num_tris > 0 && end_tri - first_tri == num_tris;
+}
+
+// past WIDE_BVH_MAX_INNER_DEPTH, intermediate children become leaf slots over their subtree's tris
+int Scene::collapseBVHNode(const BVHNode_GPU* nodes, int node_index, std::vector<WideBVHNode_GPU>& wide_nodes, int depth, int& max_depth) {
+    max_depth = glm::max(max_depth, depth);
+    const BVHNode_GPU node = nodes[node_index];
+
+    // open up the largest intermediate child until the node is full
+    std::vector<int> children;
+    if (BVH_IS_LEAF(node)) {
+        children.push_back(node_index);
+    }
+    else {
+        children.push_back(node_index + 1);
+        children.push_back(node.offset_to_second_child);
+    }
+    while (children.size() < WIDE_BVH_WIDTH) {
+        int best_child = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < children.size(); ++i) {
+            const BVHNode_GPU& child = nodes[children[i]];
+            float area = surfaceArea(child.AABB_min, child.AABB_max);
+            if (!BVH_IS_LEAF(child) && area > best_area) {
+                best_child = i;
+                best_area = area;
+            }
+        }
+        if (best_child == -1) {
+            break;
+        }
+        int opened = children[best_child];
+        children[best_child] = opened + 1;
+        children.push_back(nodes[opened].offset_to_second_child);
+    }
+
+    WideBVHNode_GPU wide_node;
+    wide_node.origin = node.AABB_min;
+    wide_node.scale = (node.AABB_max - node.AABB_min) / 255.0f;
+    for (int axis = 0; axis < 3; ++axis) {
+        while (wide_node.origin[axis] + 255.0f * wide_node.scale[axis] < node.AABB_max[axis]) {
+            wide_node.scale[axis] = nextafterf(wide_node.scale[axis], FLT_MAX);
+        }
+    }
+
+    int wide_index = wide_nodes.size();
+    wide_nodes.push_back(wide_node);
+
+    for (int k = 0; k < WIDE_BVH_WIDTH; ++k) {
+        WideBVHNode_GPU& slot = wide_nodes[wide_index];
+        if (k >= children.size()) {
+            // empty slot, skipped by child_index == -1
+            for (int axis = 0; axis < 3; ++axis) {
+                slot.child_min[k][axis] = 255;
+                slot.child_max[k][axis] = 0;
+            }
+            slot.child_index[k] = -1;
+            slot.child_num_tris[k] = 0;
+            continue;
+        }
+
+        const BVHNode_GPU& child = nodes[children[k]];
+        for (int axis = 0; axis < 3; ++axis) {
+            slot.child_min[k][axis] = quantizeBound(child.AABB_min[axis], slot.origin[axis], slot.scale[axis], true);
+            slot.child_max[k][axis] = quantizeBound(child.AABB_max[axis], slot.origin[axis], slot.scale[axis], false);
+        }
+        int first_tri, num_tris;
+        if (BVH_IS_LEAF(child)) {
+            slot.child_index[k] = child.tri_index;
+            slot.child_num_tris[k] = child.num_tris;
+        }
+        else if (depth > WIDE_BVH_MAX_INNER_DEPTH && subtreeTriRange(nodes, children[k], first_tri, num_tris)) {
+            slot.child_index[k] = first_tri;
+            slot.child_num_tris[k] = num_tris;
+        }
+        else {
+            slot.child_num_tris[k] = 0;
+            // recursing can grow the vector, so don't hold on to slot
+            int child_wide_index = collapseBVHNode(nodes, children[k], wide_nodes, depth + 1, max_depth);
+            wide_nodes[wide_index].child_index[k] = child_wide_index;
         }
-        bvh_nodes_gpu.push_back(new_gpu_node);
     }
-}
\ No newline at end of file
+    return wide_index;
+}
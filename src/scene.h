@@ -4,43 +4,160 @@
 #include <sstream>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <deque>
 #include "glm/glm.hpp"
 #include "utilities.h"
 #include "sceneStructs.h"
+#include "gltf.h"
 
 using namespace std;
 
+struct BVHBuildContext; // scene.cpp, shared by the tasks of one buildFlatBVH
+
+// where a BLAS's tris came from, parallel to Scene::blases
+struct MeshSource {
+    std::string path; // obj file or <gltf file>#<mesh>:<material>, the cache is path + ".cache" or named by its key under BVH_CACHE_DIR
+    int gltf_mesh = -1; // glTF sources only
+    int gltf_material = -1;
+    unsigned long long hash = 0; // of the obj contents, only computed with BVH_CACHE on
+    int vertex_offset = 0;
+    int num_vertices = 0;
+    bool cached = false; // loaded from the cache, tris already in leaf order
+    int subdiv_segments = 0; // SUBDIV, most segments tessellateMesh splits a cage edge into, 0 loads the mesh as is
+    std::string displacement_map; // DISPLACE, heights moving the tessellated vertices along their normals
+    float displacement_scale = 0.0f;
+    int lod_levels = 0; // LODS, coarser copies buildMeshLODs makes of the mesh
+    int lod_of = -1; // the source this is an LOD of, -1 for meshes the scene file names
+};
+
+// what one VOLUME OBJECT scatters with, its geom's blas_ID. SCATTER copies share their source's
+struct VolumeMedium {
+    int grid; // into Scene::volume_grids
+    float density = 1.0f; // DENSITY, sigma_t per unit of the file's density
+    float anisotropy = 0.0f; // ANISOTROPY, Henyey-Greenstein g in (-1, 1)
+};
+
+// shape of one flattened tree, see Scene::bvhStats
+struct BVHStats {
+    float sah_cost = 0.0f; // relative to the root box, like the builders score splits
+    int num_nodes = 0;
+    int num_leaves = 0;
+    int max_depth = 0; // the root is depth 1, the binary walks push at most this many nodes
+    float avg_depth = 0.0f; // of the leaves
+    int max_leaf_size = 0;
+    float overlap = 0.0f; // surface area both children of a node cover, summed over every node relative to the root
+    std::vector<int> leaf_sizes; // leaves holding each tri count
+    std::vector<int> depths; // leaves at each depth
+};
+
 class Scene {
 private:
-    ifstream fp_in;
+    utilityCore::LineReader fp_in; // the scene file, read into memory by the constructor
+    std::vector<Geom> scattered_geoms; // SCATTER copies and glTF nodes, appended to geoms once every OBJECT is in
     int loadMaterial(string materialid);
+    int loadTexture(const string& path, bool srgb);
     int loadGeom(string objectid);
+    int addBLAS(const MeshSource& source);
+    void loadGLTFInstances(const Geom& object, const string& path, const std::map<int, int>& materials);
+    int loadScatter(string objectid);
     int loadCamera();
+    int loadEnvironment();
+    int loadSettings();
+    int findSAHSplit(int start_index, int end_index, const glm::vec3& centroid_min, const glm::vec3& centroid_max, int& split_axis, float& split_cost);
+    BVHNode* buildBVH(BVHBuildContext& context, std::deque<BVHNode>& pool, int start_index, int end_index);
+    BVHNode* buildSBVH(BVHBuildContext& context, std::deque<BVHNode>& pool, std::vector<TriBounds>& refs, std::vector<int>& leaf_tri_IDs);
+    BVHNode* makeBVHLeaf(BVHBuildContext& context, BVHNode* node, int start_index, int end_index, const glm::vec3& min_bounds, const glm::vec3& max_bounds);
+    int collapseBVHNode(const BVHNode_GPU* nodes, int node_index, std::vector<WideBVHNode_GPU>& wide_nodes, int depth, int& max_depth);
+    void reorderMeshTris(const std::vector<int>& order);
 
 
 public:
 
-    Scene(string filename);
+    // allow_mesh_proxies lets STREAM_MESHES stand bounding box cubes in for the meshes, see makeMeshProxies.
+    // parse_only stops after the scene file: no meshes, images or BVHs, textures are just paths
+    Scene(string filename, const vector<string>& setting_overrides = vector<string>(), bool allow_mesh_proxies = false, bool parse_only = false);
     ~Scene();
 
-    BVHNode* buildBVH(int start_index, int end_index);
-    void reformatBVHToGPU();
+    bool applySetting(const vector<string>& tokens);
+    static void updateCameraBasis(Camera& camera); // view, right and up from position, lookAt and up
+
+    void buildFlatBVH(int start_index, int end_index, int max_leaf_size, std::vector<BVHNode_GPU>& nodes, std::vector<int>& leaf_tri_IDs);
+    void buildFlatSBVH(int start_index, int end_index, std::vector<BVHNode_GPU>& nodes, std::vector<int>& leaf_tri_IDs);
+    void reformatBVHToGPU(BVHNode* root_node, std::vector<BVHNode_GPU>& nodes);
+    void reportBVHStats(const BVHNode_GPU* nodes, int num_prims);
+    static float sahCost(const BVHNode_GPU* nodes, int* depth = NULL, int* leaves = NULL);
+    static BVHStats bvhStats(const BVHNode_GPU* nodes);
+    void compareBVHBuilders();
+    void loadMeshes();
+    void makeMeshProxies();
+    void buildMeshLODs();
+    void buildBLASes();
+    void buildHostBLASes(std::vector<std::vector<BVHNode_GPU>>& blas_nodes, std::vector<std::vector<int>>& blas_tri_order);
+    void layOutBLASes(std::vector<std::vector<BVHNode_GPU>>& blas_nodes, std::vector<std::vector<int>>& blas_tri_order);
+    void computeTriBounds();
+    void swapInHostBLASes(std::vector<std::vector<BVHNode_GPU>>& blas_nodes, std::vector<std::vector<int>>& blas_tri_order);
+    void writeMeshCaches();
+    void snapMeshToGrid(int blas_ID); // COMPRESSED_MESH, see snapToVertexGrid
+    void releaseHostGeometry();
+    void loadCurves();
+    void loadVolumes();
+    void placeVolumes();
+    void buildTLAS();
+    void refitTLAS();
+    void gatherMeshLights();
+    void buildLightTable();
+    void buildBakeTexels();
+    void rebuildBLASes();
+    void collapseBVHToWide();
+    std::vector<std::string> inputFiles() const; // meshes, curves, volumes, textures and the environment map
 
     int num_tris = 0;
 
     std::vector<Geom> geoms;
+    std::vector<int> geom_IDs; // scene file OBJECT id -> index into geoms, which buildTLAS reorders
     int num_geoms = 0;
     //std::vector<Mesh> meshes;
     std::vector<Light> lights;
+    std::vector<LightBVHNode> light_bvh_nodes; // LIGHT_SAMPLER BVH only, empty otherwise
     std::vector<Material> materials;
+    std::vector<Texture> textures; // ALBEDO_MAP / NORMAL_MAP images, Material holds indices into it
+    Environment environment;
 
-    std::vector<Tri> mesh_tris;
-    std::vector<Tri> mesh_tris_sorted;
+    Mesh mesh; // tris in BVH leaf order once the host BVH is built
+    std::vector<BLAS> blases;
+    std::map<std::string, int> blas_IDs; // MeshSource path -> BLAS, repeated paths are instanced
+    std::vector<MeshSource> mesh_sources;
+    std::map<std::string, GLTFAsset> gltf_assets; // the glTF files mesh OBJECTs name, by path
+    std::vector<CurveSet> curve_sets;
+    std::map<std::string, int> curve_IDs; // .hair path -> curve set, repeated paths are instanced
+    std::vector<std::string> curve_sources; // the .hair file of each curve set
+    std::vector<CurveSegment> curve_segments; // every set's segments, each set's in its BVH leaf order
+    std::vector<BVHNode_GPU> curve_nodes;
+    std::vector<VolumeGrid> volume_grids;
+    std::map<std::string, int> volume_IDs; // .vol path -> grid, repeated paths are instanced
+    std::vector<std::string> volume_sources; // the .vol file of each grid
+    std::vector<VolumeMedium> volume_media;
+    std::vector<VolumeGPU> volumes; // one per VOLUME geom, made by placeVolumes once the TLAS ordered them
+    std::vector<int> volume_bricks; // see SceneAccel
+    std::vector<float> volume_majorants;
+    std::vector<float> volume_brick_scales;
+    std::vector<unsigned short> volume_voxels;
 
-    BVHNode* root_node;
-    int num_nodes = 0;
+    int num_nodes = 0; // BLAS nodes, the sum of every BLAS num_nodes
+    BVHSettings bvh_settings;
+    RenderSettings render_settings;
 
     std::vector<BVHNode_GPU> bvh_nodes_gpu;
+    std::vector<WideBVHNode_GPU> wide_bvh_nodes_gpu;
+    std::vector<BVHNode_GPU> tlas_nodes_gpu;
+    std::vector<MotionBounds> tlas_end_bounds; // parallel to tlas_nodes_gpu, their boxes at shutter close. empty when no geom moves
     std::vector<TriBounds> tri_bounds;
+    std::vector<BakeTexel> bake_texels; // BAKE, one per pixel of the image, see buildBakeTexels
     RenderState state;
+    bool host_geometry_released = false; // FREE_HOST_GEOMETRY, the scene can't be uploaded again
+    bool mesh_proxies = false; // STREAM_MESHES, the meshes are cubes and the full scene still has to be loaded
+    bool lbvh_until_swap = false; // BVH_PROGRESSIVE, the device traces an LBVH until swapInHostBLASes
+    bool parse_only = false; // see the constructor
+    std::vector<std::string> setting_lines; // every SETTINGS line in file order, what WATCH_SCENE compares
 };
@@ -3,9 +3,47 @@
 #include <string>
 #include <vector>
 #include <cuda_runtime.h>
+#include <cuda_fp16.h>
 #include "glm/glm.hpp"
 
 #define BACKGROUND_COLOR (glm::vec3(0.0f))
+#define ENVIRONMENT_LIGHT 0x7fffffff // MISLightRay::light_index of environment samples
+
+// size of the per-thread node stack used by the BVH traversal kernels
+#define BVH_STACK_SIZE 32
+
+// branching factor of the collapsed BVH (4 or 8) and its traversal stack size,
+// every wide node visited can leave up to WIDE_BVH_WIDTH - 1 children on the stack
+#define WIDE_BVH_WIDTH 4
+#define WIDE_BVH_STACK_SIZE 64
+
+// SHARED_BVH_LEVELS: nodes each traversal block keeps in shared memory, 2.25 KB at 64
+#define BVH_SHARED_NODES 64
+
+// 1 stores the directions of the queued MIS rays octahedral encoded in two 16 bit snorms, which
+// takes ShadowRay to 24 bytes and MISLightRay to 40 for about 1e-4 radians of error.
+// 0 keeps them as floats
+#define PACKED_RAY_DIRECTIONS 0
+
+// 1 keeps every path's throughput and radiance in half floats, 6 bytes a vector instead of 12,
+// which halves the path state the shading and compaction kernels stream through. radiance is
+// clamped to the half range and the image it's added into stays fp32, samples are summed there
+#define HALF_PATH_STATE 0
+
+// 1 keeps the meshes compressed on the device. positions are 16 bit fixed point in their BLAS's
+// box and the tris are read through the index buffer, in place of 48 byte baked TriIntersects,
+// normals are octahedral encoded in two 16 bit snorms and uvs are half floats. a big mesh takes
+// about half the memory, and traversal decodes every tri it tests. 0 keeps them as floats
+#define COMPRESSED_MESH 0
+
+// most OUTLIER_BUCKETS there can be, the median sorts one pixel's bucket means in registers
+#define MAX_OUTLIER_BUCKETS 16
+
+// most PATH_GUIDING cells a side, each of the resolution^3 holds three GUIDE_BINS arrays
+#define MAX_GUIDE_RESOLUTION 32
+
+// most RADIANCE_CACHE cells a side, a cell's coordinates are 9 bits each of its hash key
+#define MAX_RADIANCE_CACHE_RESOLUTION 511
 
 enum GeomType {
     SPHERE,
@@ -13,6 +51,8 @@ enum GeomType {
     SQUAREPLANE,
     MESH,
     TRI,
+    CURVES,
+    VOLUME,
 };
 
 enum BSDF {
@@ -23,13 +63,249 @@ enum BSDF {
     SPEC_GLASS,
     SPEC_PLASTIC,
     MIRCROFACET_BRDF,
+    NUM_BSDF_TYPES,
+};
+
+enum BVHBuilder {
+    BVH_MIDPOINT,
+    BVH_SAH,
+    BVH_LBVH, // built on the device in pathtraceInit
+    BVH_SBVH, // SAH with spatial splits, a tri can be referenced by several leaves
+};
+
+struct BVHSettings {
+    BVHBuilder builder = BVH_SAH;
+    int sah_bins = 16;
+    int max_leaf_size = 4;
+    float split_budget = 0.3f; // BVH_SBVH, most extra tri references spatial splits may add, as a share of the mesh's tris
+    bool area_order = false; // host builds put the larger child first, next to its parent
+    bool wide = false; // collapse into WIDE_BVH_WIDTH-ary nodes for traversal
+    float refit_rebuild = 2.0f; // pathtraceRefitMesh rebuilds once a refit BLAS costs this many times its build, 0 never
+    bool cache = false; // load meshes and their BLAS nodes from <obj>.cache, written when missing or stale
+    std::string cache_dir; // BVH_CACHE_DIR, keep the caches in this (shared) directory named by their key instead
+    bool report = false; // BVH_REPORT, depth, leaf size and overlap of every tree and a builder comparison per mesh
+    bool progressive = false; // BVH_PROGRESSIVE, trace a GPU LBVH while the host builder runs on a thread, then swap its tree in
+};
+
+enum CompactMethod {
+    COMPACT_NONE,
+    COMPACT_THRUST, // thrust::stable_partition over the zipped path arrays
+    COMPACT_SCAN, // stream_compaction shared memory scan, stable
+    COMPACT_WARP, // stream_compaction warp aggregated atomics, not stable
+};
+
+// the per path launches whose block size is tuned per device when the scene is uploaded,
+// every other kernel launches BLOCK_SIZE_1D or BLOCK_SIZE_2D threads
+enum LaunchKernel {
+    KERNEL_INTERSECT, // computeIntersections
+    KERNEL_MIS_RAYS, // genMISRaysKernel
+    KERNEL_MIS_LIGHT_RAYS, // computeMISLightRays
+    KERNEL_SHADE, // shadeMaterialUberKernel and the per BSDF shadeBSDFKernels
+    KERNEL_FUSED_SHADE, // shadeFusedKernel
+    KERNEL_PERSISTENT, // persistentPathtrace
+    KERNEL_FINAL_GATHER, // finalGather
+    NUM_LAUNCH_KERNELS,
+};
+
+// the names BLOCK_SIZE takes and the benchmark reports them by
+inline const char* launchKernelName(int kernel)
+{
+    static const char* names[NUM_LAUNCH_KERNELS] = {
+        "intersect", "mis_rays", "light_rays", "shade", "fused_shade", "persistent", "gather",
+    };
+    return names[kernel];
+}
+
+enum DebugView {
+    DEBUG_NONE,
+    DEBUG_BVH_NODES, // TLAS and BLAS nodes each camera ray visits
+    DEBUG_TRI_TESTS, // ray / tri tests of each camera ray
+};
+
+// what an iteration shades. the viewport modes stop at the camera ray's hit
+enum ShadingMode {
+    SHADING_FULL, // the whole path tracer
+    SHADING_ALBEDO, // textured albedo of the first hit
+    SHADING_NORMALS, // world shading normal of the first hit, mapped to [0, 1]
+    SHADING_AO, // one cosine sampled any hit ray of ao_distance from the first hit
+    SHADING_DIRECT, // emission and direct light of the first hit, the full pipeline at depth 1
+};
+
+// VIEWS, cameras packed into the one image so all of their paths share the pool. saves write
+// every view to a file of its own
+enum ViewLayout {
+    VIEWS_NONE,
+    VIEWS_STEREO, // left and right eye side by side, each half the width, eye_separation apart along the camera's right
+    VIEWS_CUBEMAP, // six 90 degree faces around the camera on the world axes, +X -X +Y over -Y +Z -Z
+    VIEWS_EQUIRECT, // one 360 x 180 degree latitude / longitude panorama around the camera's view
+};
+
+// how the path rays of computeIntersections are spread over threads
+enum TraversalMode {
+    TRAVERSAL_THREAD, // one thread per path for its whole walk
+    TRAVERSAL_PERSISTENT, // persistentIntersections, a lane takes the next path as soon as its ray is done
+    TRAVERSAL_SPECULATIVE, // the same, and lanes that found a leaf keep walking until all of the warp have one
+};
+
+enum SamplerType {
+    SAMPLER_RANDOM, // independent pcg hashes
+    SAMPLER_SOBOL, // owen scrambled sobol pairs, stratified over the iterations
+};
+
+enum LightSampler {
+    LIGHT_POWER, // alias table over the emitted power
+    LIGHT_BVH, // light BVH traversed by estimated contribution at the shading point
+};
+
+enum FilterType {
+    FILTER_BOX,
+    FILTER_TENT,
+    FILTER_GAUSSIAN, // radial, sigma is a third of the radius
+};
+
+// how a tile's camera paths are laid out in the path arrays, so a warp's primary rays come
+// from a compact patch of pixels instead of a 32 pixel stretch of scanline
+enum PathOrder {
+    PATH_SCANLINE, // row after row of the tile
+    PATH_TILES, // 8x4 pixel blocks, one per warp, in scanline order
+    PATH_MORTON, // 8x8 pixel blocks in Z-order inside, blocks cut by the tile edge stay in scanline order
 };
 
+// the curve displayColor maps exposed radiance to the display with, before gamma
+enum ToneMap {
+    TONEMAP_REINHARD, // x / (1 + x)
+    TONEMAP_ACES, // Narkowicz's ACES fit, more contrast and saturation than reinhard
+    TONEMAP_FILMIC, // Uncharted 2's, a soft toe and shoulder
+    TONEMAP_LINEAR, // clipped at 1
+};
+
+// which TILE_SIZE tiles a window iteration traces first, the order they fill in when it's
+// split over frames
+enum TileOrder {
+    TILE_SCANLINE, // row after row
+    TILE_CENTER, // spiraling out from the middle of the image
+    TILE_CURSOR, // nearest the mouse first
+    TILE_VARIANCE, // highest mean relative error first, needs the per pixel statistics
+};
+
+enum TextureFormat {
+    TEXTURE_RGBA8, // decoded by stb_image, mips built on load
+    TEXTURE_BC1, // rgb, 8 bytes per 4x4 block
+    TEXTURE_BC5, // two channel normal maps, z is rebuilt when sampled
+    TEXTURE_BC7, // rgba, 16 bytes per 4x4 block
+};
+
+// per frame toggles, read on the host every iteration so the gui can flip them
+struct RenderSettings {
+    bool sort_by_material = false;
+    bool shade_by_bsdf = true; // with sort_by_material, one template specialized shading launch per BSDF over its sorted range
+    CompactMethod compaction = COMPACT_NONE;
+    bool persistent_threads = false; // one persistentPathtrace launch per iteration
+    int tail_paths = 0; // with compaction, finish the bounces of this many live paths or fewer in one persistentPathtrace launch
+    TraversalMode traversal = TRAVERSAL_THREAD; // path rays one per thread, or off a shared counter in a persistent launch
+    bool fused_shading = false; // MIS rays, light intersections and shading of a bounce in one launch
+    bool cuda_graph = false; // replay the whole iteration as one CUDA graph launch
+    bool overlap_tiles = false; // with tile_size, a second path pool so the graph traces two tiles at once. read in pathtraceInit
+    int auto_tune = 0; // timed iterations per candidate when picking the pipeline options before the render, 0 is off. see autotuneScene
+    int block_sizes[NUM_LAUNCH_KERNELS] = {}; // threads per block of each LaunchKernel, 0 picks the best occupancy. read in pathtraceInitScene
+    bool blocking_timers = false; // wait on every stage so its time isn't overlapped by the next
+    int tile_size = 0; // trace tile_size squares through a pool of that many paths, 0 is the whole image. read in pathtraceInit
+    TileOrder tile_order = TILE_SCANLINE; // window only, tile order of iterations split over frames, SCANLINE never splits them. see TilePass
+    glm::ivec2 tile_focus = glm::ivec2(-1); // TILE_CURSOR's dev_image pixel, the window keeps it under the mouse
+    glm::ivec4 crop = glm::ivec4(0); // x, y, width, height of the only pixels traced, in saved image pixels from the top left. 0 size traces them all
+    int roulette_start_depth = 4; // bounces a path takes before Russian roulette can end it
+    float roulette_min_survival = 0.05f; // lowest survival probability, dark paths are kept at least this often
+    int diffuse_depth = 0; // most bounces off diffuse BSDFs a path takes, 0 leaves them to DEPTH
+    int glossy_depth = 0; // the same for MICROFACET_BRDF and SPEC_PLASTIC
+    int specular_depth = 0; // the same for mirrors and glass, SPEC_BRDF, SPEC_BTDF and SPEC_GLASS
+    float indirect_clamp = 0.0f; // most luminance a contribution past the camera ray's first hit adds to its path, 0 is unclamped
+    int light_samples = 1; // light sampled MIS rays at the camera ray's first hit, averaged in shading. read in pathtraceInit
+    bool restir = false; // reservoir resampled direct light at the camera ray's first hit. read in pathtraceInit
+    int restir_candidates = 16; // light points each first hit resamples its reservoir from
+    int restir_spatial = 2; // neighbouring pixels' reservoirs each first hit reuses, besides its own
+    int path_guiding = 0; // cells a side of the guiding grid over the scene bounds, 0 is off. read in pathtraceInit
+    float guide_fraction = 0.5f; // share of guided bounces that draw their direction from the guide rather than the bsdf
+    int radiance_cache = 0; // cells along the longest side of the scene bounds in the radiance cache, 0 is off. read in pathtraceInit
+    int caustic_photons = 0; // photons traced from the lights each iteration for the first hit's caustics, 0 is off. read in pathtraceInit
+    float caustic_radius = 0.0f; // the first iteration's photon gather radius, shrinking after. 0 for 1/200 of the scene's diagonal
+    int bdpt = 0; // light subpaths traced each iteration for the camera vertices to connect to, 0 is off. read in pathtraceInit
+    int outlier_buckets = 0; // median of this many interleaved per pixel means for the display and png / exr saves, 0 is the plain mean. read in pathtraceInit
+    bool regenerate_paths = false; // with compaction and tile_size, refill the slots of ended paths with the image's next camera rays
+    float adaptive_threshold = 0.0f; // relative standard error a pixel stops sampling at, buffers only exist if > 0 in pathtraceInit
+    int adaptive_min_spp = 16; // samples every pixel gets before it can be tested
+    float time_budget = 0.0f; // seconds, the render stops before ITERATIONS once it has taken this long. 0 for no limit
+    int save_interval = 0; // iterations between progressive saves, read back and encoded without stalling the render. 0 for none
+    float checkpoint_interval = 0.0f; // seconds between headless checkpoints of the accumulation, 0 for none
+    float noise_target = 0.0f; // stop once pathtraceNoiseEstimate is below this, 0 for no target. read in pathtraceInit
+    bool sample_stats = false; // keep the per pixel statistics without ADAPTIVE_THRESHOLD or NOISE_TARGET, for the samples and variance channels of exr saves. read in pathtraceInit
+    int num_gpus = 1; // devices iterations are spread over, 0 for all of them. read in pathtraceInit, headless only
+    bool shard_geometry = false; // split the BLASes over the NUM_GPUS devices and forward rays to the ones holding them. read in pathtraceInit
+    int samples_per_iteration = 1; // paths traced per pixel each iteration and averaged in finalGather. read in pathtraceInit
+    bool cache_first_bounce = false; // replay the first iteration's camera ray hits, pinhole rays through pixel corners. read in pathtraceInit
+    int first_bounce_patterns = 1; // CACHE_FIRST_BOUNCE slots, more than 1 caches that many jittered and lens camera samples and cycles them. read in pathtraceInit
+    bool anti_aliasing = true; // jitter every camera ray by its own filter sample
+    int preview_scale = 1; // window only, frames while the camera moves are traced at 1/preview_scale resolution. 1 is off
+    int preview_depth = 2; // bounces of those frames, 0 keeps the scene's DEPTH
+    float preview_idle = 0.15f; // seconds the camera has to rest before the full resolution accumulation starts
+    int iterations_per_frame = 1; // window only, iterations traced between display refreshes, 0 sizes the batches to frame_time_target
+    float frame_time_target = 33.0f; // milliseconds per displayed frame ITERATIONS_PER_FRAME 0 aims for
+    float launch_slice_ms = 0.0f; // milliseconds each slice of a bounce's intersection launch aims for, 0 launches the whole pool at once
+    ToneMap tonemap = TONEMAP_REINHARD; // window display and png saves
+    float exposure = 0.0f; // stops the image is scaled by before it's tonemapped, on top of auto_exposure
+    bool auto_exposure = false; // scale the image to middle grey from a GPU histogram of its luminance
+    bool denoise = false; // OptiX denoiser guided by first hit albedo and normals for png / exr saves, needs ENABLE_OPTIX. buffers allocated in pathtraceInit
+    int denoise_interval = 0; // window iterations between denoised displays, 0 only denoises saves
+    int atrous_iterations = 0; // A-Trous passes over the window display, guide buffers allocated in pathtraceInit if > 0
+    float atrous_sigma_color = 1.0f; // edge stopping sigmas of the first pass, the color one halves every pass
+    float atrous_sigma_normal = 0.3f;
+    float atrous_sigma_position = 0.5f; // world units
+    int temporal_history = 0; // window camera moves reproject the image as up to this many samples instead of clearing it. buffers allocated in pathtraceInit if > 0
+    bool raster_primary = false; // unjittered pinhole camera rays take their first hit from a GL visibility buffer, window only. buffer allocated in pathtraceInit
+    SamplerType sampler = SAMPLER_SOBOL; // sequence behind pixel jitter, lens, light and bsdf samples. read in pathtraceInit
+    LightSampler light_sampler = LIGHT_POWER; // how MIS picks the light it samples. read in pathtraceInit
+    bool compact_light_rays = true; // trace MIS light rays only for the paths that have them, through a scanned index list
+    bool reuse_bsdf_ray = true; // continue paths along the bsdf sampled MIS ray and keep its hit for the next bounce. read in pathtraceInit
+    FilterType pixel_filter = FILTER_BOX; // camera jitter is drawn from this filter around the pixel center. read in pathtraceInit
+    float filter_radius = 0.0f; // pixels, 0 for the filter's default: box 0.5, tent 1, gaussian 1.5
+    PathOrder path_order = PATH_SCANLINE; // pixel each camera path slot is traced for. read in pathtraceInit
+    bool bvh_accel = true; // traverse the TLAS and BLASes, off brute forces every geom and tri
+    float lod_bias = 1.0f; // a mesh LOD is traced once its edges fit in this many ray cone footprints, 0 traces every mesh in full
+    float shutter = 1.0f; // part of a moving geom's open to close keys the shutter is open for, 0 renders it at its open key
+    int shared_bvh_levels = 0; // top levels of the TLAS and binary BLASes the tracing kernels read from shared memory, BVH_SHARED_NODES nodes at most. read when the scene is uploaded
+    bool stackless_bvh = false; // walk the binary BLASes and the TLAS through parent links instead of a per thread node stack. read when the scene is uploaded
+    unsigned int geom_mask = ~0u; // bit per GeomType that gets intersected, set by the ENABLE_<type> settings
+    bool sort_rays = false; // reorder bounce rays by direction octant and origin before intersecting them
+    bool free_host_geometry = false; // drop the host mesh and BVHs once pathtraceInit has uploaded them
+    bool managed_geometry = false; // tris, mesh attributes and BLAS nodes in managed memory paged in on demand. read in pathtraceInit
+    int memory_reserve = 256; // MB of device memory the path pool leaves free on top of the scene's geometry and textures. read in pathtraceInit
+    int virtual_textures = 0; // VIRTUAL_TEXTURES, MB of device cache large textures stream their tiles into on demand, 0 keeps every texture whole. read when the scene is uploaded
+    float tessellation_rate = 4.0f; // pixels a SUBDIV mesh's tessellated edges span at most from the camera. read when the meshes load
+    bool stream_meshes = false; // window only, show mesh bounding boxes while the meshes load on a background thread
+    bool watch_scene = false; // window only, re-read the scene file when it or a file it reads is saved and apply what changed
+    int remote_quality = 80; // --serve, JPEG quality of the frames sent, 1 to 100
+    bool display_surface = true; // window only, display kernels write the window's texture through a surface instead of the PBO
+    bool render_thread = false; // window only, trace on a thread of its own so the window's event loop never waits on an iteration
+    DebugView debug_view = DEBUG_NONE; // trace camera rays only and show their traversal cost as a heatmap
+    float heatmap_max = 64.0f; // count the heatmap saturates at
+    ShadingMode shading_mode = SHADING_FULL;
+    float ao_distance = 0.0f; // SHADING_AO ray length, 0 for a tenth of the scene box's diagonal
+    int capture_iteration = 0; // CAPTURE_RAYS, iteration whose rays at capture_bounce are kept with the BVH, 0 for none. see RayCapture
+    int capture_bounce = 0;
+    int probe_samples = 256; // paths pathtrace_Single traces through the probed pixel. read in pathtraceInit_Single
+    bool optix = false; // trace the wavefront's rays on the RT cores, needs a build with ENABLE_OPTIX. read in pathtraceInit
+    bool deterministic = false; // integer accumulation and no state carried between samples, for bit exact reruns and merges. read in pathtraceInit
+    int bake_object = -1; // BAKE, OBJECT id whose uv atlas the image is, lit per texel instead of seen by the camera. -1 is off, read when the scene loads
+    ViewLayout views = VIEWS_NONE; // read when the scene is uploaded
+    float eye_separation = 0.065f; // EYE_SEPARATION, VIEWS STEREO distance between the eyes in scene units
+};
+
+// what traversal works on, made by makeRay where a ray is traced and never stored. the direction
+// signs come off direction_inv, see rayDirSigns
 struct Ray {
     glm::vec3 origin;
     glm::vec3 direction;
     glm::vec3 direction_inv;
-    int ray_dir_sign[3]; // + == 0, - == 1
+    float time; // in [0, 1) over the shutter, where moving geoms are tested. 0 is shutter open
 };
 
 struct TriBounds {
@@ -39,62 +315,374 @@ struct TriBounds {
     int tri_ID;
 };
 
+// BAKE, the world space surface point the paths of one atlas texel leave from. a zero normal is
+// a texel no tri covers, its paths end before they start
+struct BakeTexel {
+    glm::vec3 position;
+    glm::vec3 normal;
+};
+
 struct BVHNode {
     glm::vec3 AABB_min;
     glm::vec3 AABB_max;
     BVHNode* child_nodes[2];
     int split_axis;
-    int tri_index;
+    int tri_index; // first tri in leaf order, -1 for intermediate nodes
+    int num_tris;
 };
 
-struct BVHNode_GPU {
+// 32 bytes and aligned to them, so a node is one L2 sector and two share a cache line.
+// leaves cover tris [tri_index, tri_index + num_tris), inner nodes have their first child
+// right after them and keep their split (BVH_INNER_NODE) in num_tris
+struct alignas(32) BVHNode_GPU {
     glm::vec3 AABB_min;
     glm::vec3 AABB_max;
-    int tri_index;
-    int offset_to_second_child;
-    int axis;
+    union {
+        int tri_index; // leaves
+        int offset_to_second_child; // inner nodes
+    };
+    int num_tris;
+};
+
+// an inner node's split, negative so it can't be a tri count. the first child holds the
+// lower centroids along axis unless upper_first, set by BVH_AREA_ORDER
+#define BVH_INNER_NODE(axis, upper_first) (-1 - ((axis) | ((upper_first) ? 4 : 0)))
+#define BVH_IS_LEAF(node) ((node).num_tris >= 0)
+#define BVH_SPLIT_AXIS(node) ((-1 - (node).num_tris) & 3)
+#define BVH_UPPER_FIRST(node) (((-1 - (node).num_tris) & 4) != 0)
+
+// child boxes are stored on a 255 step grid spanning the node bounds,
+// child k covers [origin + child_min[k] * scale, origin + child_max[k] * scale].
+// 80 bytes, read as five 16 byte loads
+struct alignas(16) WideBVHNode_GPU {
+    glm::vec3 origin;
+    glm::vec3 scale;
+    unsigned char child_min[WIDE_BVH_WIDTH][3];
+    unsigned char child_max[WIDE_BVH_WIDTH][3];
+    int child_index[WIDE_BVH_WIDTH]; // wide node index, first tri for leaves, -1 for empty slots
+    int child_num_tris[WIDE_BVH_WIDTH]; // 0 for intermediate children
 };
 
-struct Tri {
-    // positions
+// indexed triangles for every mesh in the scene. OBJ corners are deduplicated on their
+// (position, normal, uv) indices, so vertex i is positions[i] / normals[i] / uvs[i]
+// and tri j is the three vertices in indices[j]
+struct Mesh {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::ivec3> indices;
+};
+
+// a unit vector folded onto the octahedron and flattened, two 16 bit snorms for about 1e-4
+// radians of error
+struct OctDirection {
+    short x, y; // octahedral coordinates in [-1, 1]
+};
+
+__host__ __device__ inline OctDirection packOctahedral(glm::vec3 d) {
+    d /= glm::abs(d.x) + glm::abs(d.y) + glm::abs(d.z);
+    glm::vec2 e(d.x, d.y);
+    if (d.z < 0.0f) {
+        // the lower half folds over the diagonals
+        e = (1.0f - glm::abs(glm::vec2(d.y, d.x))) * glm::vec2(d.x >= 0.0f ? 1.0f : -1.0f, d.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    OctDirection p;
+    p.x = (short)roundf(glm::clamp(e.x, -1.0f, 1.0f) * 32767.0f);
+    p.y = (short)roundf(glm::clamp(e.y, -1.0f, 1.0f) * 32767.0f);
+    return p;
+}
+
+__host__ __device__ inline glm::vec3 unpackOctahedral(OctDirection p) {
+    glm::vec2 e((float)p.x / 32767.0f, (float)p.y / 32767.0f);
+    glm::vec3 d(e.x, e.y, 1.0f - glm::abs(e.x) - glm::abs(e.y));
+    if (d.z < 0.0f) {
+        d.x = (1.0f - glm::abs(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f);
+        d.y = (1.0f - glm::abs(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return glm::normalize(d);
+}
+
+// COMPRESSED_MESH: a vertex position on the 65535 step grid over its mesh's box
+struct alignas(8) QuantizedVertex {
+    unsigned short x, y, z, pad;
+};
+
+// step is the box's extent / 65535. the decode is a single fma per axis, so the host and every
+// kernel that decodes a shared vertex get the same bits and the tris stay watertight
+__host__ __device__ inline QuantizedVertex quantizeVertex(const glm::vec3& p, const glm::vec3& origin, const glm::vec3& step) {
+    glm::vec3 q = glm::clamp((p - origin) / glm::max(step, glm::vec3(1e-30f)) + 0.5f, glm::vec3(0.0f), glm::vec3(65535.0f));
+    QuantizedVertex v;
+    v.x = (unsigned short)q.x;
+    v.y = (unsigned short)q.y;
+    v.z = (unsigned short)q.z;
+    v.pad = 0;
+    return v;
+}
+
+__host__ __device__ inline glm::vec3 dequantizeVertex(const QuantizedVertex& v, const glm::vec3& origin, const glm::vec3& step) {
+    return glm::vec3(fmaf((float)v.x, step.x, origin.x), fmaf((float)v.y, step.y, origin.y), fmaf((float)v.z, step.z, origin.z));
+}
+
+// the shading attributes of a mesh vertex as the device stores them
+#if COMPRESSED_MESH
+typedef OctDirection MeshNormal;
+
+struct MeshUV {
+    unsigned short u, v; // fp16 bit patterns
+};
+
+__host__ __device__ inline MeshNormal packNormal(glm::vec3 n) {
+    return packOctahedral(n);
+}
+
+__host__ __device__ inline glm::vec3 unpackNormal(MeshNormal p) {
+    return unpackOctahedral(p);
+}
+
+__host__ __device__ inline MeshUV packUV(glm::vec2 uv) {
+    MeshUV p;
+    p.u = __half_as_ushort(__float2half_rn(uv.x));
+    p.v = __half_as_ushort(__float2half_rn(uv.y));
+    return p;
+}
+
+__host__ __device__ inline glm::vec2 unpackUV(MeshUV p) {
+    return glm::vec2(__half2float(__ushort_as_half(p.u)), __half2float(__ushort_as_half(p.v)));
+}
+#else
+typedef glm::vec3 MeshNormal;
+typedef glm::vec2 MeshUV;
+
+__host__ __device__ inline MeshNormal packNormal(glm::vec3 n) {
+    return n;
+}
+
+__host__ __device__ inline glm::vec3 unpackNormal(MeshNormal n) {
+    return n;
+}
+
+__host__ __device__ inline MeshUV packUV(glm::vec2 uv) {
+    return uv;
+}
+
+__host__ __device__ inline glm::vec2 unpackUV(MeshUV uv) {
+    return uv;
+}
+#endif
+
+// device side of Mesh, only what shading needs (passed to kernels by value).
+// positions are baked into TriIntersect for traversal, or quantized with COMPRESSED_MESH
+struct MeshGPU {
+    MeshNormal* normals;
+    MeshUV* uvs;
+    glm::ivec3* indices;
+};
+
+struct TriIntersect;
+
+// bottom level of the acceleration structure, one per OBJ file. node and tri indices
+// inside its BVH are relative to node_offset / tri_offset so every instance shares it
+struct BLAS {
+    int tri_offset;
+    int num_tris;
+    int node_offset; // into bvh_nodes_gpu
+    int num_nodes;
+    int wide_node_offset; // into wide_bvh_nodes_gpu, -1 unless collapsed
+    int top_slot; // SHARED_BVH_LEVELS: its root's slot in SceneAccel::top_nodes, -1 when it isn't cached
+    glm::vec3 AABB_min; // object space
+    glm::vec3 AABB_max;
+    glm::vec3 grid_origin; // COMPRESSED_MESH: the grid its vertices are stored on, see snapToVertexGrid
+    glm::vec3 grid_step;
+    int lod_next; // LODS: the BLAS of the mesh's next coarser LOD, -1 for none. see Scene::buildMeshLODs
+    float lod_spacing; // mean object space edge length of its tris, what selectLOD compares footprints against
+    const TriIntersect* tris = NULL; // SHARD_GEOMETRY: its tris on the device holding them, NULL for SceneAccel::tris + tri_offset
+};
+
+// hot per tri data, all the traversal loads per tri test. the vertices themselves rather
+// than edges, so tris sharing an edge see bitwise equal endpoints and the watertight test
+// can't let a ray through between them. padded to 48 bytes for three 16 byte loads
+struct alignas(16) TriIntersect {
     glm::vec3 p0;
     glm::vec3 p1;
     glm::vec3 p2;
-    // normals
-    glm::vec3 n0;
-    glm::vec3 n1;
-    glm::vec3 n2;
-    // uvs
-    glm::vec2 t0;
-    glm::vec2 t1;
-    glm::vec2 t2;
-    // plane normal
-    glm::vec3 plane_normal;
-    float S;
-    int mat_ID;
+};
+
+// a piece of a hair strand between two of its points, a round cone (a cone capped by a sphere at
+// each end) in object space. xyz of each end and its radius in w
+struct alignas(16) CurveSegment {
+    glm::vec4 p0;
+    glm::vec4 p1;
+};
+
+// one curves file, the segments of its strands and the BVH over them. segment and node indices
+// are relative to the offsets like a BLAS's, every CURVES geom naming the file instances it
+struct CurveSet {
+    int segment_offset;
+    int num_segments;
+    int node_offset; // into Scene::curve_nodes
+    int num_nodes;
+    glm::vec3 AABB_min; // object space
+    glm::vec3 AABB_max;
+};
+
+// voxels along a density grid brick's edge, the size of a NanoVDB leaf node
+#define VOLUME_BRICK_SIZE 8
+
+// one volume file's densities, kept sparse: the grid is cut into VOLUME_BRICK_SIZE^3 voxel bricks
+// and only the bricks with any density keep voxels. the majorant grid has a cell per brick. cell
+// indices are relative to brick_offset, every VOLUME geom naming the file instances it
+struct VolumeGrid {
+    glm::ivec3 resolution; // voxels
+    glm::ivec3 bricks; // resolution / VOLUME_BRICK_SIZE, rounded up
+    int brick_offset; // first cell in volume_bricks and volume_majorants
+    glm::vec3 AABB_min; // object space, the file's box scaled to fit the unit cube
+    glm::vec3 AABB_max;
+    glm::vec3 index_scale; // voxels per object space unit
+};
+
+// a VOLUME geom as delta tracking reads it, its box and transform are the geom's
+struct VolumeGPU {
+    int geom; // in TLAS leaf order, its material's R is the single scattering albedo
+    VolumeGrid grid;
+    float sigma_t; // DENSITY, extinction per unit of density and of world distance
+    float g; // ANISOTROPY, the Henyey-Greenstein phase function's mean cosine
 };
 
 struct Geom {
     enum GeomType type;
     int materialid;
+    int blas_ID; // MESH's BLAS, CURVES' curve set or VOLUME's Scene::volume_media entry, all in object space through transform
     glm::vec3 translation;
     glm::vec3 rotation;
     glm::vec3 scale;
-    glm::mat4 transform;
+    glm::mat4 transform; // at shutter open
     glm::mat4 inverseTransform;
     glm::mat4 invTranspose;
+    bool moving = false; // TRANS_END / ROTAT_END / SCALE_END gave it a second key
+    glm::mat4 end_transform; // moving only, object to world at shutter close
+    int motion_ID = -1; // moving only, its SceneAccel::geom_motions entry, numbered by buildTLAS
+};
+
+// the part of a Geom that traversal reads, parallel to SceneAccel::geoms: its world to object
+// transform as the three rows of a 3x4 matrix, 64 bytes against the Geom's three mat4s. the
+// Geom itself is only read for the hit a ray keeps. a moving geom's rows are those at shutter open
+struct alignas(16) GeomGPU {
+    glm::vec4 inverse_rows[3];
+    int type;
+    int materialid;
+    int blas_ID;
+    int motion_ID; // -1 for a geom that stays put
+};
+
+// a moving geom's object to world transform at shutter open and close, as the rows of 3x4
+// matrices. a ray lerps the two by its time like OptiX's matrix motion transforms do, so every
+// point of the geom moves along a line and the TLAS boxes at the two keys lerp to hold it
+struct alignas(16) GeomMotion {
+    glm::vec4 rows[2][3];
 };
 
+// a TLAS node's box at shutter close, parallel to the nodes, which keep the one at shutter open
+struct MotionBounds {
+    glm::vec3 AABB_min;
+    glm::vec3 AABB_max;
+};
+
+// lights double as an alias table over their emitted power, built by Scene::buildLightTable.
+// u * num_lights picks column i, whose fraction keeps light i below alias_threshold and
+// switches to lights[i].alias above it
 struct Light {
     int geom_ID;
+    bool is_tri; // one tri of an emissive MESH geom, not the whole geom
+    TriIntersect tri; // is_tri only, object space like dev_tris. bsdf rays compare the tri they hit against it
+    float pdf; // probability this light gets picked
+    float alias_threshold;
+    int alias;
+    // world space sampling record, baked by Scene::buildLightTable. tris and squareplanes are
+    // sampled at corner + a * edge_u + b * edge_v, tris with a + b <= 1
+    glm::vec3 corner;
+    glm::vec3 edge_u;
+    glm::vec3 edge_v;
+    glm::vec3 normal; // unit, squareplanes emit against it and tris to both sides
+    float area;
+    float area_pdf; // 1 / area for the lights sampled by area, 0 for the other shapes
+    glm::vec3 Le; // emittance * R of its material
+    float power; // Le's luminance times area, what the alias table and the light BVH weigh
 };
 
+// node of the light BVH over Scene::lights. the first child is the next node and the second
+// offset_to_second_child on, like BVHNode_GPU. a leaf holds one light
+struct LightBVHNode {
+    glm::vec3 AABB_min;
+    glm::vec3 AABB_max;
+    glm::vec3 axis; // every emitter normal is within theta_o of axis
+    float theta_o;
+    float theta_e; // how far past its normal an emitter still emits, pi / 2 for one sided ones
+    float power;
+    int light_index; // leaves only, index into lights. -1 for interior nodes
+    int offset_to_second_child;
+};
+
+// Material::flags, what the kernels branch on at a hit before they need the rest of its material
+#define MATERIAL_EMISSIVE 1 // emittance > 0, paths end on it
+#define MATERIAL_SPECULAR 2 // no light sampling at its hits, SPEC_PLASTIC's coat included
+#define MATERIAL_DELTA 4 // only delta lobes, light sampled directions get nothing and photons pass on
+
 struct Material {
     glm::vec3 R;
     glm::vec3 T;
     BSDF type;
     float ior;
     float emittance;
+    float roughness = 0.5f; // MICROFACET_BRDF's, the GGX alpha is its square
+    int albedo_map = -1; // Scene::textures index, R is multiplied by it. -1 for none
+    int normal_map = -1; // tangent space normals, only on meshes with uvs
+    int alpha_map = -1; // ALPHA_MAP, meshes with uvs are cut away where its alpha is below alpha_cutoff
+    float alpha_cutoff = 0.5f;
+    int flags = 0; // MATERIAL_* bits of type and emittance, set when the material is uploaded
+};
+
+// an image a material samples, RGBA8 with its whole mip chain built on load. levels[0] is
+// width x height, each next one half the size (rounded down, at least 1) down to 1x1
+struct Texture {
+    std::string path;
+    bool srgb; // albedo maps are, normal maps hold linear data
+    TextureFormat format;
+    int width;
+    int height;
+    std::vector<std::vector<unsigned char> > levels; // packed texels, or rows of 4x4 blocks for BCn
+};
+
+// a material's ALPHA_MAP as traversal reads it, see alphaCoverage. the device samples tex, the
+// host the RGBA8 texels of the full size level. width is 0 for materials without one
+struct AlphaMap {
+    cudaTextureObject_t tex;
+    const unsigned char* texels;
+    int width;
+    int height;
+    float cutoff;
+};
+
+// an opening the environment is seen through, a squareplane in world space. light samples go
+// through these instead of over the whole sphere when the environment has any
+struct EnvironmentPortal {
+    glm::vec3 corner;
+    glm::vec3 edge_u;
+    glm::vec3 edge_v;
+    glm::vec3 normal;
+    float area;
+};
+
+// equirectangular HDR image that lights whatever rays escape to, +y is up. sampled in
+// proportion to luminance * sin(theta) through a marginal cdf over rows and a cdf per row
+struct Environment {
+    std::string path; // empty when the scene has none
+    float intensity = 1.0f;
+    int width = 0;
+    int height = 0;
+    std::vector<glm::vec4> texels; // linear rgb, row 0 looks straight up
+    std::vector<float> marginal_cdf; // height + 1 entries
+    std::vector<float> conditional_cdf; // height rows of width + 1 entries
+    std::vector<EnvironmentPortal> portals;
 };
 
 struct Camera {
@@ -118,20 +706,159 @@ struct RenderState {
     std::string imageName;
 };
 
-struct PathSegment {
-    Ray ray;
-    glm::vec3 accumulatedIrradiance;
-    glm::vec3 rayThroughput;
-    int pixelIndex;
-    int remainingBounces;
-    bool prev_hit_was_specular;
+// path pool as a structure of arrays, path i is entry i of every array so each kernel
+// only pulls in the fields it uses (passed to kernels by value, just the pointers)
+#if HALF_PATH_STATE
+struct PathColor {
+    unsigned short r, g, b; // fp16 bit patterns
+};
+
+__host__ __device__ inline PathColor packColor(glm::vec3 c) {
+    c = glm::min(c, glm::vec3(65504.0f)); // largest finite half
+    PathColor p;
+    p.r = __half_as_ushort(__float2half_rn(c.x));
+    p.g = __half_as_ushort(__float2half_rn(c.y));
+    p.b = __half_as_ushort(__float2half_rn(c.z));
+    return p;
+}
+
+__host__ __device__ inline glm::vec3 unpackColor(PathColor p) {
+    return glm::vec3(__half2float(__ushort_as_half(p.r)), __half2float(__ushort_as_half(p.g)),
+        __half2float(__ushort_as_half(p.b)));
+}
+#else
+typedef glm::vec3 PathColor;
+
+__host__ __device__ inline PathColor packColor(glm::vec3 c) {
+    return c;
+}
+
+__host__ __device__ inline glm::vec3 unpackColor(PathColor c) {
+    return c;
+}
+#endif
+
+struct PathSegments {
+    glm::vec3* origin;
+    glm::vec3* direction;
+    PathColor* accumulatedIrradiance; // packed by packColor, see HALF_PATH_STATE
+    PathColor* rayThroughput;
+    int* pixelIndex;
+    int* remainingBounces;
+    bool* prev_hit_was_specular;
+    float* cone_width; // ray cone width at origin, grows by the pixel spread angle with distance. sets texture LOD
+    int* guide_bin; // PATH_GUIDING cell * GUIDE_BINS + direction bin the last bounce left through, -1 for none
+    bool* caustic_gathered; // CAUSTIC_PHOTONS gathered at the first hit and only mirrors and glass since
+    int* class_bounces; // diffuse, glossy and specular bounces taken, a byte each from the lowest. see DIFFUSE_DEPTH
+    // RADIANCE_CACHE, the key of the vertex the path's radiance goes to once it's done (0 for none), and
+    // the path's radiance and throughput when it got there
+    unsigned int* cache_key;
+    PathColor* cache_base;
+    PathColor* cache_throughput;
+    glm::vec2* bdpt_mis; // BDPT, the camera subpath's dVCM and dVC so far, see traceLightSubpaths
 };
 
+// the rays of one trace site, the OPTIX launches keep their hits apart by these
+enum TraceQuery {
+    TRACE_PATHS,
+    TRACE_SHADOW_RAYS,
+    TRACE_BSDF_LIGHT_RAYS,
+    NUM_TRACE_QUERIES,
+};
+
+// one ray's hit as an OPTIX launch or traceShards hands it to the shading kernels, geom -1 for a miss.
+// tri, bary and normal are what intersectScene leaves in a SceneHit
+struct TracedHit {
+    float t;
+    int geom;
+    int tri;
+    glm::vec3 bary;
+    glm::vec3 normal;
+};
+
+// the top level BVH over geoms and the shared BLAS buffers, passed to kernels by value
+struct SceneAccel {
+    Geom* geoms; // in TLAS leaf order
+    GeomGPU* geom_records; // parallel to geoms, all that intersection tests read
+    int geoms_size;
+    BVHNode_GPU* tlas_nodes; // leaves cover geoms [tri_index, tri_index + num_tris)
+    BLAS* blases;
+    TriIntersect* tris; // NULL with COMPRESSED_MESH, the tris are read out of vertices through tri_indices
+    BVHNode_GPU* bvh_nodes;
+    int* bvh_parents; // parallel to bvh_nodes, NULL unless STACKLESS_BVH
+    int* tlas_parents; // parallel to tlas_nodes, NULL unless STACKLESS_BVH
+    WideBVHNode_GPU* wide_bvh_nodes; // NULL unless BVH_WIDE
+    BVHNode_GPU* top_nodes = NULL; // SHARED_BVH_LEVELS: the TLAS's top levels then the BLASes', see topNodeIndex. NULL reads every node from its tree
+    int* top_links = NULL; // parallel to top_nodes
+    int num_top_nodes = 0; // at most BVH_SHARED_NODES
+    bool use_bvh = true; // ENABLE_BVH_ACCEL, off tests every geom and every tri of a mesh
+    unsigned int geom_mask = ~0u; // bit per GeomType that gets intersected
+    float lod_bias = 0.0f; // MESH_LOD_BIAS, ray footprints are scaled by it before picking LODs. 0 always traces the full meshes
+    float lod_spread = 0.0f; // ray cone spread angle of a camera ray, what footprints grow by per unit of distance
+    unsigned int lod_seed = 0; // the iteration, so the LOD dithering changes between them
+    AlphaMap* alpha_maps = NULL; // parallel to the materials, NULL when none has an ALPHA_MAP
+    glm::ivec3* tri_indices = NULL; // the mesh's indices and uvs, what the ALPHA_MAP lookups read
+    MeshUV* tri_uvs = NULL;
+    QuantizedVertex* vertices = NULL; // COMPRESSED_MESH, every mesh vertex on its BLAS's grid
+    CurveSegment* curve_segments = NULL;
+    BVHNode_GPU* curve_nodes = NULL;
+    CurveSet* curve_sets = NULL;
+    VolumeGPU* volumes = NULL; // one per VOLUME geom
+    int num_volumes = 0;
+    int* volume_bricks = NULL; // per majorant cell, its brick of VOLUME_BRICK_SIZE^3 volume_voxels, -1 for a brick without density
+    float* volume_majorants = NULL; // per majorant cell, the densest its brick's voxels and their neighbors get
+    float* volume_brick_scales = NULL; // per brick, the density of one step of its quantized voxels
+    unsigned short* volume_voxels = NULL;
+    unsigned int medium_seed = 0; // the iteration, so delta and ratio tracking take new samples every one
+    GeomMotion* geom_motions = NULL; // by GeomGPU::motion_ID, NULL when no geom moves
+    MotionBounds* tlas_end_bounds = NULL; // parallel to tlas_nodes, NULL when no geom moves
+    unsigned int time_seed = 0; // the iteration, what each path draws its shutter time from
+    SamplerType time_sampler = SAMPLER_RANDOM;
+    float shutter = 1.0f; // SHUTTER, path times are drawn from [0, shutter)
+    TracedHit* traced_hits = NULL; // OPTIX, SHARD_GEOMETRY: what the launch before the kernel found, traced_stride slots per TraceQuery. NULL traverses here
+    int traced_stride = 0;
+};
+
+#if PACKED_RAY_DIRECTIONS
+typedef OctDirection RayDirection;
+
+__host__ __device__ inline RayDirection packDirection(glm::vec3 d) {
+    return packOctahedral(d);
+}
+
+__host__ __device__ inline glm::vec3 unpackDirection(RayDirection p) {
+    return unpackOctahedral(p);
+}
+#else
+typedef glm::vec3 RayDirection;
+
+__host__ __device__ inline RayDirection packDirection(glm::vec3 d) {
+    return d;
+}
+
+__host__ __device__ inline glm::vec3 unpackDirection(RayDirection d) {
+    return d;
+}
+#endif
+
+// the light sampled MIS ray, only what its occlusion test reads. the traversal Ray is rebuilt
+// from origin and direction with makeRay when it's traced, so the buffer is half the size
+struct ShadowRay {
+    glm::vec3 origin;
+    RayDirection direction;
+    float t_max; // distance to the light sample, occluders past it don't count
+    int light_ID; // geom of the light, -1 when there's nothing the ray must not hit
+};
+
+// the bsdf sampled MIS ray, traced like ShadowRay. f and pdf weigh the light it finds and, with
+// REUSE_BSDF_RAY, the path that continues along it
 struct MISLightRay {
-    Ray ray;
+    glm::vec3 origin;
+    RayDirection direction;
     glm::vec3 f;
     float pdf;
-    int light_ID;
+    int light_ID; // geom of the light, -1 when there's nothing the ray must not hit
+    int light_index; // index into lights, ENVIRONMENT_LIGHT for the environment, -1 when no light was picked
 };
 
 struct MISLightIntersection {
@@ -146,4 +873,15 @@ struct ShadeableIntersection {
   float t;
   glm::vec3 surfaceNormal;
   int materialId;
+  glm::vec2 uv;
+  float lod; // 0.5 * log2(uv area / world area) + log2(cone width), add 0.5 * log2(texels) per texture
+};
+
+// device side storage for ShadeableIntersection, same layout idea as PathSegments
+struct ShadeableIntersections {
+    float* t;
+    glm::vec3* surfaceNormal;
+    int* materialId;
+    glm::vec2* uv;
+    float* lod;
 };
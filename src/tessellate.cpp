@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <stb_image.h>
+
+#include "tessellate.h"
+#include "utilities.h"
+
+// cage tris per task of the parallel passes
+#define TESSELLATE_CHUNK 4096
+
+bool loadDisplacementMap(const std::string& path, float scale, DisplacementMap& map, std::string& error) {
+    int width, height, channels;
+    unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, 1);
+    if (pixels == NULL) {
+        error = "Cannot read displacement map [" + path + "]";
+        return false;
+    }
+    map.width = width;
+    map.height = height;
+    map.scale = scale;
+    map.heights.resize((size_t)width * height);
+    for (size_t i = 0; i < map.heights.size(); ++i) {
+        map.heights[i] = pixels[i] / 255.0f;
+    }
+    stbi_image_free(pixels);
+    return true;
+}
+
+// bilinear, repeating like the device's texture reads
+static float sampleHeight(const DisplacementMap& map, const glm::vec2& uv) {
+    const float x = uv.x * map.width - 0.5f;
+    const float y = uv.y * map.height - 0.5f;
+    const float fx = floorf(x);
+    const float fy = floorf(y);
+    auto texel = [&](int i, int j) {
+        i %= map.width;
+        j %= map.height;
+        i += i < 0 ? map.width : 0;
+        j += j < 0 ? map.height : 0;
+        return map.heights[(size_t)j * map.width + i];
+    };
+    const int x0 = (int)fx;
+    const int y0 = (int)fy;
+    return glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), x - fx), glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), x - fx), y - fy);
+}
+
+// the cubic bezier of a PN triangle, b300 / b030 / b003 are the corners
+struct PNPatch {
+    glm::vec3 b300, b030, b003, b210, b120, b021, b012, b102, b201, b111;
+    glm::vec3 n[3];
+    glm::vec2 uv[3];
+};
+
+// an edge control point, a third of the way from p0 to p1 projected onto p0's tangent plane
+static glm::vec3 edgeControl(const glm::vec3& p0, const glm::vec3& n0, const glm::vec3& p1) {
+    return (2.0f * p0 + p1 - glm::dot(p1 - p0, n0) * n0) * (1.0f / 3.0f);
+}
+
+static PNPatch pnPatch(const glm::vec3 p[3], const glm::vec3 n[3], const glm::vec2 uv[3]) {
+    PNPatch patch;
+    patch.b300 = p[0];
+    patch.b030 = p[1];
+    patch.b003 = p[2];
+    patch.b210 = edgeControl(p[0], n[0], p[1]);
+    patch.b120 = edgeControl(p[1], n[1], p[0]);
+    patch.b021 = edgeControl(p[1], n[1], p[2]);
+    patch.b012 = edgeControl(p[2], n[2], p[1]);
+    patch.b102 = edgeControl(p[2], n[2], p[0]);
+    patch.b201 = edgeControl(p[0], n[0], p[2]);
+    const glm::vec3 e = (patch.b210 + patch.b120 + patch.b021 + patch.b012 + patch.b102 + patch.b201) * (1.0f / 6.0f);
+    const glm::vec3 v = (p[0] + p[1] + p[2]) * (1.0f / 3.0f);
+    patch.b111 = e + 0.5f * (e - v);
+    for (int c = 0; c < 3; ++c) {
+        patch.n[c] = n[c];
+        patch.uv[c] = uv[c];
+    }
+    return patch;
+}
+
+// the displaced point at barycentrics w (weights of corners 0, 1, 2)
+static glm::vec3 patchPoint(const PNPatch& patch, const glm::vec3& w, const DisplacementMap& map) {
+    const float u = w.x, v = w.y, t = w.z;
+    glm::vec3 p = patch.b300 * (u * u * u) + patch.b030 * (v * v * v) + patch.b003 * (t * t * t)
+        + 3.0f * (patch.b210 * (u * u * v) + patch.b120 * (u * v * v) + patch.b201 * (u * u * t)
+            + patch.b021 * (v * v * t) + patch.b102 * (u * t * t) + patch.b012 * (v * t * t))
+        + patch.b111 * (6.0f * u * v * t);
+    if (!map.heights.empty()) {
+        const glm::vec3 n = patch.n[0] * u + patch.n[1] * v + patch.n[2] * t;
+        const float length = glm::length(n);
+        if (length > 0.0f) {
+            p += n * (map.scale * sampleHeight(map, patch.uv[0] * u + patch.uv[1] * v + patch.uv[2] * t) / length);
+        }
+    }
+    return p;
+}
+
+// segments so the edge spans at most rate pixels in every instance, judged at its midpoint
+static int edgeSegments(const glm::vec3& a, const glm::vec3& b, const TessellationView& view) {
+    float pixels = 0.0f;
+    for (const glm::mat4& transform : view.instances) {
+        const glm::vec3 wa = glm::vec3(transform * glm::vec4(a, 1.0f));
+        const glm::vec3 wb = glm::vec3(transform * glm::vec4(b, 1.0f));
+        const float distance = glm::max(glm::length(0.5f * (wa + wb) - view.eye), 1e-6f);
+        pixels = glm::max(pixels, glm::length(wb - wa) / (distance * view.pixel_angle));
+    }
+    return (int)glm::clamp(ceilf(pixels / view.rate), 1.0f, (float)view.max_segments);
+}
+
+struct PositionHash {
+    size_t operator()(const glm::vec3& p) const {
+        unsigned int bits[3];
+        memcpy(bits, &p, sizeof(bits));
+        return ((size_t)bits[0] * 73856093u) ^ ((size_t)bits[1] * 19349663u) ^ ((size_t)bits[2] * 83492791u);
+    }
+};
+
+// one edge of the welded cage
+struct CageEdge {
+    int a, b; // welded ends, a < b
+    int segments;
+    int first_point; // its segments - 1 points from a to b, in edge_points
+    int face; // the first tri on it, whose patch places the points
+    int side; // which edge of face it is, from corner side to side + 1
+};
+
+static unsigned long long pairKey(int a, int b) {
+    return ((unsigned long long)(unsigned int)std::min(a, b) << 32) | (unsigned int)std::max(a, b);
+}
+
+void tessellateMesh(std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals, std::vector<glm::vec2>& uvs,
+    std::vector<glm::ivec3>& indices, const TessellationView& view, const DisplacementMap& map) {
+    const int num_vertices = positions.size();
+    const int num_faces = indices.size();
+    const int num_chunks = (num_faces + TESSELLATE_CHUNK - 1) / TESSELLATE_CHUNK;
+
+    // vertices at one position are one welded vertex (-0 and 0 too), its normal is area weighted
+    // over every tri around it so the patches meet across the cage's seams
+    std::vector<int> welded(num_vertices);
+    std::vector<int> weld_first; // a vertex of each welded one
+    {
+        std::unordered_map<glm::vec3, int, PositionHash> weld_IDs;
+        for (int v = 0; v < num_vertices; ++v) {
+            auto inserted = weld_IDs.insert(std::make_pair(positions[v] + glm::vec3(0.0f), (int)weld_first.size()));
+            if (inserted.second) {
+                weld_first.push_back(v);
+            }
+            welded[v] = inserted.first->second;
+        }
+    }
+    const int num_welded = weld_first.size();
+    std::vector<glm::vec3> weld_normals(num_welded, glm::vec3(0.0f));
+    for (const glm::ivec3& tri : indices) {
+        const glm::vec3 n = glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]);
+        for (int c = 0; c < 3; ++c) {
+            weld_normals[welded[tri[c]]] += n;
+        }
+    }
+    for (glm::vec3& n : weld_normals) {
+        const float length = glm::length(n);
+        n = length > 0.0f ? n / length : glm::vec3(0.0f);
+    }
+
+    auto facePatch = [&](int f) {
+        glm::vec3 p[3], n[3];
+        glm::vec2 uv[3];
+        for (int c = 0; c < 3; ++c) {
+            p[c] = positions[indices[f][c]];
+            n[c] = weld_normals[welded[indices[f][c]]];
+            uv[c] = uvs[indices[f][c]];
+        }
+        return pnPatch(p, n, uv);
+    };
+
+    std::vector<CageEdge> edges;
+    std::vector<glm::ivec3> face_edges(num_faces);
+    {
+        std::unordered_map<unsigned long long, int> edge_IDs;
+        for (int f = 0; f < num_faces; ++f) {
+            for (int e = 0; e < 3; ++e) {
+                const int a = welded[indices[f][e]];
+                const int b = welded[indices[f][(e + 1) % 3]];
+                auto inserted = edge_IDs.insert(std::make_pair(pairKey(a, b), (int)edges.size()));
+                if (inserted.second) {
+                    CageEdge edge;
+                    edge.a = std::min(a, b);
+                    edge.b = std::max(a, b);
+                    edge.segments = 1;
+                    edge.first_point = 0;
+                    edge.face = f;
+                    edge.side = e;
+                    edges.push_back(edge);
+                }
+                face_edges[f][e] = inserted.first->second;
+            }
+        }
+    }
+    utilityCore::parallelFor((edges.size() + TESSELLATE_CHUNK - 1) / TESSELLATE_CHUNK, [&](int chunk) {
+        const int end = std::min((chunk + 1) * TESSELLATE_CHUNK, (int)edges.size());
+        for (int i = chunk * TESSELLATE_CHUNK; i < end; ++i) {
+            CageEdge& edge = edges[i];
+            if (edge.a != edge.b) {
+                edge.segments = edgeSegments(positions[weld_first[edge.a]], positions[weld_first[edge.b]], view);
+            }
+        }
+    });
+    int num_edge_points = 0;
+    for (CageEdge& edge : edges) {
+        edge.first_point = num_edge_points;
+        num_edge_points += edge.segments - 1;
+    }
+
+    // every point on an edge is placed once, by one tri's patch, so the tris on either side of
+    // it get the same point. the boundary curve of a PN patch only depends on the edge anyway
+    std::vector<glm::vec3> edge_points(num_edge_points);
+    utilityCore::parallelFor((edges.size() + TESSELLATE_CHUNK - 1) / TESSELLATE_CHUNK, [&](int chunk) {
+        const int end = std::min((chunk + 1) * TESSELLATE_CHUNK, (int)edges.size());
+        for (int i = chunk * TESSELLATE_CHUNK; i < end; ++i) {
+            const CageEdge& edge = edges[i];
+            if (edge.segments == 1) {
+                continue;
+            }
+            const PNPatch patch = facePatch(edge.face);
+            const bool forward = welded[indices[edge.face][edge.side]] == edge.a;
+            for (int k = 1; k < edge.segments; ++k) {
+                const float t = (float)(forward ? k : edge.segments - k) / edge.segments;
+                glm::vec3 w(0.0f);
+                w[edge.side] = 1.0f - t;
+                w[(edge.side + 1) % 3] = t;
+                edge_points[edge.first_point + k - 1] = patchPoint(patch, w, map);
+            }
+        }
+    });
+
+    // the output starts with the cage's own vertices. every welded one is displaced once
+    std::vector<glm::vec3> corners(num_welded);
+    utilityCore::parallelFor((num_welded + TESSELLATE_CHUNK - 1) / TESSELLATE_CHUNK, [&](int chunk) {
+        const int end = std::min((chunk + 1) * TESSELLATE_CHUNK, num_welded);
+        for (int w = chunk * TESSELLATE_CHUNK; w < end; ++w) {
+            const int v = weld_first[w];
+            corners[w] = positions[v];
+            if (!map.heights.empty()) {
+                corners[w] += weld_normals[w] * (map.scale * sampleHeight(map, uvs[v]));
+            }
+        }
+    });
+
+    // then a run of vertices per edge and pair of cage vertices on it, the vertices of tris
+    // on both sides of an edge without a seam are shared. point m of a run is m / segments
+    // of the way from its lower vertex id to the higher one
+    std::vector<glm::ivec3> face_runs(num_faces, glm::ivec3(-1));
+    std::vector<glm::ivec3> runs; // (edge, lower cage vertex, higher one)
+    int num_out = num_vertices;
+    {
+        std::unordered_map<unsigned long long, int> run_IDs;
+        for (int f = 0; f < num_faces; ++f) {
+            for (int e = 0; e < 3; ++e) {
+                const CageEdge& edge = edges[face_edges[f][e]];
+                if (edge.segments == 1) {
+                    continue;
+                }
+                const int v0 = indices[f][e];
+                const int v1 = indices[f][(e + 1) % 3];
+                auto inserted = run_IDs.insert(std::make_pair(pairKey(v0, v1), num_out));
+                if (inserted.second) {
+                    runs.push_back(glm::ivec3(face_edges[f][e], std::min(v0, v1), std::max(v0, v1)));
+                    num_out += edge.segments - 1;
+                }
+                face_runs[f][e] = inserted.first->second;
+            }
+        }
+    }
+    const int runs_end = num_out;
+
+    // and the points inside each tri, which is cut into a grid as fine as its finest edge
+    std::vector<int> face_interiors(num_faces);
+    for (int f = 0; f < num_faces; ++f) {
+        const int n = std::max(std::max(edges[face_edges[f][0]].segments, edges[face_edges[f][1]].segments), edges[face_edges[f][2]].segments);
+        face_interiors[f] = num_out;
+        num_out += (n - 1) * (n - 2) / 2;
+    }
+
+    // vertices at one position share a position id, their normals are summed over it
+    std::vector<glm::vec3> out_positions(num_out);
+    std::vector<glm::vec2> out_uvs(num_out);
+    std::vector<int> position_IDs(num_out);
+    for (int v = 0; v < num_vertices; ++v) {
+        out_positions[v] = corners[welded[v]];
+        out_uvs[v] = uvs[v];
+        position_IDs[v] = welded[v];
+    }
+    int out = num_vertices;
+    for (const glm::ivec3& run : runs) {
+        const CageEdge& edge = edges[run.x];
+        const int v0 = run.y;
+        const int v1 = run.z;
+        for (int m = 1; m < edge.segments; ++m, ++out) {
+            const int k = welded[v0] == edge.a ? m : edge.segments - m;
+            out_positions[out] = edge_points[edge.first_point + k - 1];
+            out_uvs[out] = glm::mix(uvs[v0], uvs[v1], (float)m / edge.segments);
+            position_IDs[out] = num_welded + edge.first_point + k - 1;
+        }
+    }
+
+    // the grid of every tri, its interior points placed by its own patch
+    std::vector<std::vector<glm::ivec3>> chunk_tris(num_chunks);
+    utilityCore::parallelFor(num_chunks, [&](int chunk) {
+        const int end = std::min((chunk + 1) * TESSELLATE_CHUNK, num_faces);
+        std::vector<glm::ivec3>& tris = chunk_tris[chunk];
+        for (int f = chunk * TESSELLATE_CHUNK; f < end; ++f) {
+            const glm::ivec3& cage = indices[f];
+            int segments[3];
+            for (int e = 0; e < 3; ++e) {
+                segments[e] = edges[face_edges[f][e]].segments;
+            }
+            const int n = std::max(std::max(segments[0], segments[1]), segments[2]);
+            // grid point g of n along edge e, snapped onto the edge's own segments
+            auto edgeVertex = [&](int e, int g) {
+                const int m = (2 * g * segments[e] + n) / (2 * n);
+                const int v0 = cage[e];
+                const int v1 = cage[(e + 1) % 3];
+                if (m == 0) {
+                    return v0;
+                }
+                if (m == segments[e]) {
+                    return v1;
+                }
+                return v0 < v1 ? face_runs[f][e] + m - 1 : face_runs[f][e] + segments[e] - m - 1;
+            };
+            // the grid point with weights (n - j - k, j, k) / n of corners 0, 1, 2
+            auto gridVertex = [&](int j, int k) {
+                const int i = n - j - k;
+                if (i == n) {
+                    return cage[0];
+                }
+                if (j == n) {
+                    return cage[1];
+                }
+                if (k == n) {
+                    return cage[2];
+                }
+                if (k == 0) {
+                    return edgeVertex(0, j);
+                }
+                if (i == 0) {
+                    return edgeVertex(1, k);
+                }
+                if (j == 0) {
+                    return edgeVertex(2, i);
+                }
+                return face_interiors[f] + (j - 1) * (n - 1) - (j - 1) * j / 2 + (k - 1);
+            };
+
+            if (n > 2) {
+                const PNPatch patch = facePatch(f);
+                for (int j = 1; j < n - 1; ++j) {
+                    for (int k = 1; j + k < n; ++k) {
+                        const int v = gridVertex(j, k);
+                        const glm::vec3 w = glm::vec3(n - j - k, j, k) / (float)n;
+                        out_positions[v] = patchPoint(patch, w, map);
+                        out_uvs[v] = patch.uv[0] * w.x + patch.uv[1] * w.y + patch.uv[2] * w.z;
+                        position_IDs[v] = num_welded + num_edge_points + (v - runs_end);
+                    }
+                }
+            }
+
+            // snapping collapses some of the tris next to a coarser edge, those are dropped
+            auto emit = [&](int a, int b, int c) {
+                if (a != b && b != c && a != c) {
+                    tris.push_back(glm::ivec3(a, b, c));
+                }
+            };
+            for (int j = 0; j < n; ++j) {
+                for (int k = 0; j + k < n; ++k) {
+                    emit(gridVertex(j, k), gridVertex(j + 1, k), gridVertex(j, k + 1));
+                    if (j + k + 2 <= n) {
+                        emit(gridVertex(j + 1, k), gridVertex(j + 1, k + 1), gridVertex(j, k + 1));
+                    }
+                }
+            }
+        }
+    });
+
+    indices.clear();
+    for (std::vector<glm::ivec3>& tris : chunk_tris) {
+        indices.insert(indices.end(), tris.begin(), tris.end());
+        utilityCore::freeVector(tris);
+    }
+
+    std::vector<glm::vec3> sums(num_welded + num_edge_points + (num_out - runs_end), glm::vec3(0.0f));
+    for (const glm::ivec3& tri : indices) {
+        const glm::vec3 n = glm::cross(out_positions[tri[1]] - out_positions[tri[0]], out_positions[tri[2]] - out_positions[tri[0]]);
+        for (int c = 0; c < 3; ++c) {
+            sums[position_IDs[tri[c]]] += n;
+        }
+    }
+    normals.resize(num_out);
+    for (int v = 0; v < num_out; ++v) {
+        const float length = glm::length(sums[position_IDs[v]]);
+        normals[v] = length > 0.0f ? sums[position_IDs[v]] / length : glm::vec3(0.0f);
+    }
+    positions.swap(out_positions);
+    uvs.swap(out_uvs);
+}
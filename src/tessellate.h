@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+// the most a SUBDIV line may ask for, a cage tri becomes up to this squared tris
+#define MAX_EDGE_SEGMENTS 64
+
+// where a cage mesh is seen from, what its edges' segment counts are picked for
+struct TessellationView {
+    std::vector<glm::mat4> instances; // object to world of every geom placing the mesh
+    glm::vec3 eye;
+    float pixel_angle; // world size of a pixel at distance 1, the camera's pixelLength.y
+    float rate; // TESSELLATION_RATE, pixels a segment spans at most
+    int max_segments; // SUBDIV, most segments an edge is split into
+};
+
+// a grey image read as heights in [0, 1], moving a tessellated vertex scale along its normal
+struct DisplacementMap {
+    std::vector<float> heights;
+    int width = 0;
+    int height = 0;
+    float scale = 0.0f;
+};
+
+// false with error set if path can't be read
+bool loadDisplacementMap(const std::string& path, float scale, DisplacementMap& map, std::string& error);
+
+// replaces a cage mesh by its tessellation, in place. every cage tri becomes a curved PN triangle
+// (Vlachos et al. 2001) over the cage's smoothed normals, and every edge gets as many segments as
+// it needs to span at most rate pixels from eye in its nearest instance. a tri is cut into a
+// grid as fine as its finest edge, the grid points on coarser edges snapped onto theirs, so tris
+// sharing an edge share its vertices and the surface stays watertight. the points are displaced
+// by map (if it has heights) and the normals recomputed from the result. vertices at the same
+// position keep sharing one, across uv and normal seams too
+void tessellateMesh(std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals, std::vector<glm::vec2>& uvs,
+    std::vector<glm::ivec3>& indices, const TessellationView& view, const DisplacementMap& map);
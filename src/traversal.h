@@ -0,0 +1,782 @@
+#pragma once
+
+#include <vector>
+#include "sceneStructs.h"
+#include "intersections.h"
+
+// host passes test the children of a wide node in one 4 wide slab test
+#if !defined(__CUDA_ARCH__) && WIDE_BVH_WIDTH == 4 && (defined(__SSE2__) || defined(_M_X64))
+#define WIDE_CHILD_SSE
+#include <cfloat>
+#include <emmintrin.h>
+#endif
+
+// the BVH walks every renderer shares, the CUDA kernels over device buffers and cpu_render.cpp
+// over the scene's host copies of the same node layouts
+
+// the intersection record of each geom, see GeomGPU, and the keys of the moving ones by their
+// motion_ID. defined in pathtrace.cu
+std::vector<GeomGPU> geomRecords(const std::vector<Geom>& geoms);
+std::vector<GeomMotion> motionRecords(const std::vector<Geom>& geoms);
+
+__host__ __device__ inline Ray makeRay(const glm::vec3& origin, const glm::vec3& direction, float time = 0.0f) {
+    Ray r;
+    r.origin = origin;
+    r.direction = direction;
+    r.direction_inv = 1.0f / direction;
+    r.time = time;
+    return r;
+}
+
+// hit policies for the traversal routines below. ClosestHit keeps looking for the nearest tri,
+// AnyHit returns on the first tri in front of t_closest (shadow / occlusion rays)
+struct ClosestHit {
+    static const bool any_hit = false;
+};
+
+struct AnyHit {
+    static const bool any_hit = true;
+};
+
+// a ray set up for intersectTri (Woop, Benthin and Wald, "Watertight Ray/Triangle
+// Intersection"): its largest direction axis becomes z, and the shear that turns the
+// direction into +z is done once per ray rather than once per tri
+struct TriRay {
+    glm::vec3 origin;
+    glm::vec3 shear; // d[kx] / d[kz], d[ky] / d[kz], 1 / d[kz]
+    int kx, ky, kz;
+};
+
+__host__ __device__ inline TriRay makeTriRay(const Ray& r) {
+    TriRay tr;
+    glm::vec3 d = glm::abs(r.direction);
+    tr.kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+    tr.kx = tr.kz == 2 ? 0 : tr.kz + 1;
+    tr.ky = tr.kx == 2 ? 0 : tr.kx + 1;
+    if (r.direction[tr.kz] < 0.0f) {
+        // keep the winding, so the sign of det still says which side was hit
+        int k = tr.kx;
+        tr.kx = tr.ky;
+        tr.ky = k;
+    }
+    tr.origin = r.origin;
+    tr.shear = glm::vec3(r.direction[tr.kx], r.direction[tr.ky], 1.0f) / r.direction[tr.kz];
+    return tr;
+}
+
+// the watertight test: the vertices are moved into the ray's sheared space, where the hit is
+// inside the tri when the three 2D edge functions agree in sign. edges shared by two tris are
+// evaluated from the same endpoints, so a ray exactly on one always hits one of them. edge
+// functions that come out exactly 0 are redone in double. s is the barycentric weight of
+// (p0, p1, p2), both windings hit
+__host__ __device__ inline bool intersectTri(const TriIntersect& tri, const TriRay& tr, float& t, glm::vec3& s) {
+    glm::vec3 a = tri.p0 - tr.origin;
+    glm::vec3 b = tri.p1 - tr.origin;
+    glm::vec3 c = tri.p2 - tr.origin;
+    float ax = a[tr.kx] - tr.shear.x * a[tr.kz];
+    float ay = a[tr.ky] - tr.shear.y * a[tr.kz];
+    float bx = b[tr.kx] - tr.shear.x * b[tr.kz];
+    float by = b[tr.ky] - tr.shear.y * b[tr.kz];
+    float cx = c[tr.kx] - tr.shear.x * c[tr.kz];
+    float cy = c[tr.ky] - tr.shear.y * c[tr.kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if (u == 0.0f || v == 0.0f || w == 0.0f) {
+        u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) {
+        return false;
+    }
+    float det = u + v + w;
+    if (det == 0.0f) {
+        return false;
+    }
+
+    float inv_det = 1.0f / det;
+    t = (u * a[tr.kz] + v * b[tr.kz] + w * c[tr.kz]) * tr.shear.z * inv_det;
+    s = glm::vec3(u, v, w) * inv_det;
+    return t >= -0.0001f;
+}
+
+// (ray-aabb test) true if the box overlaps [-epsilon, t_closest] along the ray
+__host__ __device__ inline bool intersectAABB(const Ray& r, const glm::vec3& AABB_min, const glm::vec3& AABB_max, float t_closest, float& tmin) {
+    glm::vec3 t1 = (AABB_min - r.origin) * r.direction_inv;
+    glm::vec3 t2 = (AABB_max - r.origin) * r.direction_inv;
+    glm::vec3 t_near = glm::min(t1, t2);
+    glm::vec3 t_far = glm::max(t1, t2);
+    tmin = glm::max(glm::max(t_near.x, t_near.y), t_near.z);
+    float tmax = glm::min(glm::min(t_far.x, t_far.y), t_far.z);
+    return tmax >= tmin && tmax >= -0.0001f && tmin <= t_closest;
+}
+
+// work one ray's traversal did, for RAY_STATS and the DEBUG_VIEW heatmaps
+struct TraversalStats {
+    int nodes = 0; // TLAS and BLAS nodes fetched
+    int tris = 0; // ray / tri tests
+};
+
+// a traversal record in 16 byte loads through the read only cache. nodes, tris and geom
+// records are multiples of 16 bytes and aligned to them, and nothing writes them while rays trace.
+// a plain load on the host
+template<class T>
+__host__ __device__ T loadReadOnly(const T* __restrict__ p) {
+    static_assert(sizeof(T) % 16 == 0, "read only records are whole float4s");
+#ifdef __CUDA_ARCH__
+    T v;
+    const float4* src = reinterpret_cast<const float4*>(p);
+    float4* dst = reinterpret_cast<float4*>(&v);
+    for (int i = 0; i < sizeof(T) / 16; i++) {
+        dst[i] = __ldg(src + i);
+    }
+    return v;
+#else
+    return *p;
+#endif
+}
+
+// the tris of one BLAS as traversal reads them. COMPRESSED_MESH decodes each from its three
+// quantized vertices when it's tested, unless the accel keeps float tris (the CPU renderer and
+// ray replays do). a pointer to the BLAS's baked TriIntersects otherwise, on another device when
+// SHARD_GEOMETRY put them there
+#if COMPRESSED_MESH
+struct TriSource {
+    const TriIntersect* tris;
+    const glm::ivec3* indices; // the BLAS's own, like tris
+    const QuantizedVertex* vertices;
+    glm::vec3 origin; // the BLAS's grid
+    glm::vec3 step;
+};
+#else
+typedef const TriIntersect* TriSource;
+#endif
+
+__host__ __device__ inline TriSource blasTris(const SceneAccel& accel, const BLAS& blas) {
+#if COMPRESSED_MESH
+    TriSource source;
+    source.tris = accel.tris != NULL ? accel.tris + blas.tri_offset : NULL;
+    source.indices = accel.tri_indices + blas.tri_offset;
+    source.vertices = accel.vertices;
+    source.origin = blas.grid_origin;
+    source.step = blas.grid_step;
+    return source;
+#else
+    return blas.tris != NULL ? blas.tris : accel.tris + blas.tri_offset;
+#endif
+}
+
+__host__ __device__ inline TriIntersect loadTri(const TriSource& source, int tri_index) {
+#if COMPRESSED_MESH
+    if (source.tris != NULL) {
+        return loadReadOnly(source.tris + tri_index);
+    }
+    const glm::ivec3 tri = source.indices[tri_index];
+    TriIntersect isect;
+    isect.p0 = dequantizeVertex(source.vertices[tri.x], source.origin, source.step);
+    isect.p1 = dequantizeVertex(source.vertices[tri.y], source.origin, source.step);
+    isect.p2 = dequantizeVertex(source.vertices[tri.z], source.origin, source.step);
+    return isect;
+#else
+    return loadReadOnly(source + tri_index);
+#endif
+}
+
+// ALPHA_MAP cutouts of the mesh instance being traced, tri indices are the BLAS's own like those
+// of its tris. map is NULL for opaque instances, AlphaTest() for every caller without one
+struct AlphaTest {
+    const AlphaMap* map;
+    const glm::ivec3* indices;
+    const MeshUV* uvs;
+};
+
+__host__ __device__ inline AlphaTest alphaTest(const SceneAccel& accel, const GeomGPU& geom, const BLAS& blas) {
+    AlphaTest alpha = AlphaTest();
+    if (accel.alpha_maps != NULL && accel.alpha_maps[geom.materialid].width > 0) {
+        alpha.map = accel.alpha_maps + geom.materialid;
+        alpha.indices = accel.tri_indices + blas.tri_offset;
+        alpha.uvs = accel.tri_uvs;
+    }
+    return alpha;
+}
+
+// the map's alpha at uv, from the full size level. the host reads the nearest RGBA8 texel and
+// counts maps it has no texels of (BCn) as opaque
+__host__ __device__ inline float alphaCoverage(const AlphaMap& map, glm::vec2 uv) {
+#ifdef __CUDA_ARCH__
+    return tex2DLod<float4>(map.tex, uv.x, 1.0f - uv.y, 0.0f).w;
+#else
+    if (map.texels == NULL) {
+        return 1.0f;
+    }
+    float u = uv.x - floorf(uv.x);
+    float v = (1.0f - uv.y) - floorf(1.0f - uv.y);
+    int x = glm::min((int)(u * map.width), map.width - 1);
+    int y = glm::min((int)(v * map.height), map.height - 1);
+    return map.texels[4 * (x + y * map.width) + 3] / 255.0f;
+#endif
+}
+
+// false where the hit at barycentrics s falls in a hole of the instance's cutout
+__host__ __device__ inline bool alphaCovers(const AlphaTest& alpha, int tri_index, const glm::vec3& s) {
+    if (alpha.map == NULL) {
+        return true;
+    }
+    const glm::ivec3 tri = alpha.indices[tri_index];
+    const glm::vec2 uv = s.x * unpackUV(alpha.uvs[tri.x]) + s.y * unpackUV(alpha.uvs[tri.y]) + s.z * unpackUV(alpha.uvs[tri.z]);
+    return alphaCoverage(*alpha.map, uv) >= alpha.map->cutoff;
+}
+
+// tests tris [first_tri, last_tri) and returns the hit (or -1) the policy asks for,
+// only hits nearer than t_closest count and t_closest / bary are updated on a hit.
+// hits alpha cuts away don't count, the lookup only runs for ones that would
+template<class HitPolicy>
+__host__ __device__ inline int intersectTriRange(const TriRay& tr, const TriSource& tris, int first_tri, int last_tri, const AlphaTest& alpha,
+    float& t_closest, glm::vec3& bary, TraversalStats& traversal) {
+    int hit_tri = -1;
+    float t;
+    glm::vec3 s;
+    for (int tri_index = first_tri; tri_index < last_tri; ++tri_index) {
+        traversal.tris++;
+        if (intersectTri(loadTri(tris, tri_index), tr, t, s) && t_closest > t && alphaCovers(alpha, tri_index, s)) {
+            t_closest = t;
+            bary = s;
+            hit_tri = tri_index;
+            if (HitPolicy::any_hit) {
+                break;
+            }
+        }
+    }
+    return hit_tri;
+}
+
+// bit per axis, set where the ray points down it. off direction_inv so -0 counts as down like
+// the slab test sees it
+__host__ __device__ inline int rayDirSigns(const Ray& r) {
+    return (r.direction_inv.x < 0.0f) | ((r.direction_inv.y < 0.0f) << 1) | ((r.direction_inv.z < 0.0f) << 2);
+}
+
+// children of an inner node front to back for a ray. the first child holds the lower centroids
+// along the split axis (the upper ones with BVH_UPPER_FIRST), rays pointing down the axis
+// reach the upper side first
+__host__ __device__ inline void orderChildren(const BVHNode_GPU& node, int node_index, int dir_signs, int& near_child, int& far_child) {
+    bool flip = (((dir_signs >> BVH_SPLIT_AXIS(node)) & 1) != 0) != BVH_UPPER_FIRST(node);
+    near_child = flip ? node.offset_to_second_child : node_index + 1;
+    far_child = flip ? node_index + 1 : node.offset_to_second_child;
+}
+
+// SHARED_BVH_LEVELS: SceneAccel::top_nodes holds the top levels of the TLAS and binary BLASes as
+// small trees of their own, first child right after its parent and offset_to_second_child a slot.
+// an index below -1 is slot -2 - index. top_links[slot] is -1 for cached inner nodes and the node's
+// own index in its tree on the last cached level, whose children are read from the tree itself
+__host__ __device__ inline int topNodeIndex(int slot) {
+    return -2 - slot;
+}
+
+// the node at node_index, from the cache for tagged indices. link is the index its children
+// hang off for orderTopChildren, -1 when they're cache slots too
+__host__ __device__ inline BVHNode_GPU loadBVHNode(const BVHNode_GPU* __restrict__ nodes, const BVHNode_GPU* top_nodes, const int* top_links,
+    int node_index, int& link) {
+    if (node_index < -1) {
+        const int slot = topNodeIndex(node_index);
+        link = top_links[slot];
+        return top_nodes[slot];
+    }
+    link = node_index;
+    return loadReadOnly(nodes + node_index);
+}
+
+// orderChildren for a node loadBVHNode found, children in the cache come back tagged
+__host__ __device__ inline void orderTopChildren(const BVHNode_GPU& node, int node_index, int link, int dir_signs, int& near_child, int& far_child) {
+    if (link != -1) {
+        orderChildren(node, link, dir_signs, near_child, far_child);
+        return;
+    }
+    orderChildren(node, topNodeIndex(node_index), dir_signs, near_child, far_child);
+    near_child = topNodeIndex(near_child);
+    far_child = topNodeIndex(far_child);
+}
+
+__host__ __device__ inline int loadParent(const int* __restrict__ p) {
+#ifdef __CUDA_ARCH__
+    return __ldg(p);
+#else
+    return *p;
+#endif
+}
+
+// STACKLESS_BVH: the node after cur in the same front to back order the stack walk takes, found
+// by climbing past every finished far child and crossing to the far sibling, -1 at the end
+__host__ __device__ inline int nextStacklessNode(int cur_node_index, int dir_signs, const BVHNode_GPU* __restrict__ nodes, const int* __restrict__ parents) {
+    int parent = loadParent(parents + cur_node_index);
+    while (parent != -1) {
+        int near_child, far_child;
+        orderChildren(loadReadOnly(nodes + parent), parent, dir_signs, near_child, far_child);
+        if (cur_node_index == near_child) {
+            return far_child;
+        }
+        cur_node_index = parent;
+        parent = loadParent(parents + cur_node_index);
+    }
+    return -1;
+}
+
+// with bvh_parents (STACKLESS_BVH) the walk goes through the parent links instead of the stack
+template<class HitPolicy>
+__host__ __device__ inline int intersectBinaryBVH(const Ray& r, const TriRay& tr, const TriSource& tris, const BVHNode_GPU* __restrict__ bvh_nodes, const int* __restrict__ bvh_parents,
+    const BVHNode_GPU* top_nodes, const int* top_links, int root_index, const AlphaTest& alpha, float& t_closest, glm::vec3& bary, TraversalStats& traversal) {
+    int hit_tri = -1;
+    int cur_node_index = root_index;
+    int dir_signs = rayDirSigns(r);
+    const bool stackless = bvh_parents != NULL;
+    int stack_pointer = 0;
+    int node_stack[BVH_STACK_SIZE];
+    float tmin;
+    int link;
+    while (true) {
+        const BVHNode_GPU cur_node = loadBVHNode(bvh_nodes, top_nodes, top_links, cur_node_index, link);
+        traversal.nodes++;
+
+        if (intersectAABB(r, cur_node.AABB_min, cur_node.AABB_max, t_closest, tmin)) {
+            // we intersected AABB
+            if (!BVH_IS_LEAF(cur_node)) {
+                // near child next, the far one is tested against the closest t when it's reached
+                int near_child, far_child;
+                orderTopChildren(cur_node, cur_node_index, link, dir_signs, near_child, far_child);
+                if (!stackless) {
+                    node_stack[stack_pointer] = far_child;
+                    stack_pointer++;
+                }
+                cur_node_index = near_child;
+                continue;
+            }
+            // this is leaf node
+            int leaf_hit = intersectTriRange<HitPolicy>(tr, tris, cur_node.tri_index, cur_node.tri_index + cur_node.num_tris, alpha, t_closest, bary, traversal);
+            if (leaf_hit != -1) {
+                hit_tri = leaf_hit;
+                if (HitPolicy::any_hit) {
+                    return hit_tri;
+                }
+            }
+        }
+        if (stackless) {
+            cur_node_index = nextStacklessNode(cur_node_index, dir_signs, bvh_nodes, bvh_parents);
+            if (cur_node_index == -1) {
+                break;
+            }
+            continue;
+        }
+        // if last node in tree, we are done
+        if (stack_pointer == 0) {
+            break;
+        }
+        // otherwise need to check rest of the things in the stack
+        stack_pointer--;
+        cur_node_index = node_stack[stack_pointer];
+    }
+    return hit_tri;
+}
+
+// bit k set when child k of a wide node overlaps [-epsilon, t_closest] along the ray, with
+// its entry distance in tmin[k]. the device dequantizes and tests the boxes one at a time
+__host__ __device__ inline int wideChildHits(const WideBVHNode_GPU& node, const Ray& r, float t_closest, float* tmin) {
+    int mask = 0;
+#ifdef WIDE_CHILD_SSE
+    // the children's boxes as one lane each, then the slab test of intersectAABB per axis
+    __m128 t_near = _mm_set1_ps(-FLT_MAX);
+    __m128 t_far = _mm_set1_ps(FLT_MAX);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 lo = _mm_setr_ps(node.child_min[0][axis], node.child_min[1][axis], node.child_min[2][axis], node.child_min[3][axis]);
+        __m128 hi = _mm_setr_ps(node.child_max[0][axis], node.child_max[1][axis], node.child_max[2][axis], node.child_max[3][axis]);
+        __m128 scale = _mm_set1_ps(node.scale[axis]);
+        // (origin + q * scale - ray origin) * inverse direction
+        __m128 offset = _mm_set1_ps(node.origin[axis] - r.origin[axis]);
+        __m128 inv = _mm_set1_ps(r.direction_inv[axis]);
+        __m128 t1 = _mm_mul_ps(_mm_add_ps(offset, _mm_mul_ps(lo, scale)), inv);
+        __m128 t2 = _mm_mul_ps(_mm_add_ps(offset, _mm_mul_ps(hi, scale)), inv);
+        t_near = _mm_max_ps(t_near, _mm_min_ps(t1, t2));
+        t_far = _mm_min_ps(t_far, _mm_max_ps(t1, t2));
+    }
+    __m128 hit = _mm_and_ps(_mm_cmpge_ps(t_far, t_near),
+        _mm_and_ps(_mm_cmpge_ps(t_far, _mm_set1_ps(-0.0001f)), _mm_cmple_ps(t_near, _mm_set1_ps(t_closest))));
+    _mm_storeu_ps(tmin, t_near);
+    mask = _mm_movemask_ps(hit);
+    for (int k = 0; k < WIDE_BVH_WIDTH; ++k) {
+        if (node.child_index[k] == -1) {
+            mask &= ~(1 << k);
+        }
+    }
+#else
+    for (int k = 0; k < WIDE_BVH_WIDTH; ++k) {
+        if (node.child_index[k] == -1) {
+            continue;
+        }
+        glm::vec3 AABB_min = node.origin + glm::vec3(node.child_min[k][0], node.child_min[k][1], node.child_min[k][2]) * node.scale;
+        glm::vec3 AABB_max = node.origin + glm::vec3(node.child_max[k][0], node.child_max[k][1], node.child_max[k][2]) * node.scale;
+        if (intersectAABB(r, AABB_min, AABB_max, t_closest, tmin[k])) {
+            mask |= 1 << k;
+        }
+    }
+#endif
+    return mask;
+}
+
+template<class HitPolicy>
+__host__ __device__ inline int intersectWideBVH(const Ray& r, const TriRay& tr, const TriSource& tris, const WideBVHNode_GPU* __restrict__ wide_bvh_nodes, const AlphaTest& alpha, float& t_closest, glm::vec3& bary,
+    TraversalStats& traversal) {
+    int hit_tri = -1;
+    int node_stack[WIDE_BVH_STACK_SIZE];
+    int stack_pointer = 0;
+    node_stack[stack_pointer++] = 0;
+
+    float tmins[WIDE_BVH_WIDTH];
+    while (stack_pointer > 0) {
+        const WideBVHNode_GPU node = loadReadOnly(wide_bvh_nodes + node_stack[--stack_pointer]);
+        traversal.nodes++;
+
+        // intermediate children that were hit, kept sorted far to near so the nearest is popped first
+        int hit_children[WIDE_BVH_WIDTH];
+        float hit_dists[WIDE_BVH_WIDTH];
+        int num_hits = 0;
+
+        int child_hits = wideChildHits(node, r, t_closest, tmins);
+        for (int k = 0; k < WIDE_BVH_WIDTH; ++k) {
+            if (!(child_hits & (1 << k))) {
+                continue;
+            }
+            float tmin = tmins[k];
+
+            if (node.child_num_tris[k] > 0) {
+                // leaf child, test its tris right away
+                int leaf_hit = intersectTriRange<HitPolicy>(tr, tris, node.child_index[k], node.child_index[k] + node.child_num_tris[k], alpha, t_closest, bary, traversal);
+                if (leaf_hit != -1) {
+                    hit_tri = leaf_hit;
+                    if (HitPolicy::any_hit) {
+                        return hit_tri;
+                    }
+                }
+            }
+            else {
+                int insert_index = num_hits++;
+                while (insert_index > 0 && hit_dists[insert_index - 1] < tmin) {
+                    hit_children[insert_index] = hit_children[insert_index - 1];
+                    hit_dists[insert_index] = hit_dists[insert_index - 1];
+                    insert_index--;
+                }
+                hit_children[insert_index] = node.child_index[k];
+                hit_dists[insert_index] = tmin;
+            }
+        }
+
+        for (int h = 0; h < num_hits; ++h) {
+            node_stack[stack_pointer++] = hit_children[h];
+        }
+    }
+    return hit_tri;
+}
+
+// CURVES: the segment hit of an instance's curve set the policy asks for, along the object space
+// ray r whose t is the world distance like the unit shapes'. the segments are tested with a unit
+// direction and their t scaled back. MAX_INTERSECT_DIST when nothing nearer than t_closest is hit
+template<class HitPolicy>
+__host__ __device__ inline float intersectCurves(const SceneAccel& accel, const CurveSet& set, const Ray& r, float t_closest, glm::vec3& normal,
+    TraversalStats& traversal) {
+    float t_hit = MAX_INTERSECT_DIST;
+    if (set.num_segments == 0) {
+        return t_hit;
+    }
+    const BVHNode_GPU* __restrict__ nodes = accel.curve_nodes + set.node_offset;
+    const CurveSegment* __restrict__ segments = accel.curve_segments + set.segment_offset;
+    const float length = glm::length(r.direction);
+    const glm::vec3 unit_direction = r.direction / length;
+    const int dir_signs = rayDirSigns(r);
+    int node_stack[BVH_STACK_SIZE];
+    int stack_pointer = 0;
+    int node_index = 0;
+    float tmin;
+    while (true) {
+        const BVHNode_GPU node = loadReadOnly(nodes + node_index);
+        traversal.nodes++;
+        if (intersectAABB(r, node.AABB_min, node.AABB_max, t_closest, tmin)) {
+            if (!BVH_IS_LEAF(node)) {
+                int near_child, far_child;
+                orderChildren(node, node_index, dir_signs, near_child, far_child);
+                node_stack[stack_pointer++] = far_child;
+                node_index = near_child;
+                continue;
+            }
+            for (int i = node.tri_index; i < node.tri_index + node.num_tris; ++i) {
+                traversal.tris++;
+                glm::vec3 n;
+                float t = curveSegmentIntersectionTest(loadReadOnly(segments + i), r.origin, unit_direction, n);
+                if (t < MAX_INTERSECT_DIST && t / length < t_closest) {
+                    t_closest = t_hit = t / length;
+                    normal = n;
+                    if (HitPolicy::any_hit) {
+                        return t_hit;
+                    }
+                }
+            }
+        }
+        if (stack_pointer == 0) {
+            break;
+        }
+        node_index = node_stack[--stack_pointer];
+    }
+    return t_hit;
+}
+
+// single entry point for tri intersection used by every intersection kernel,
+// picks the wide BVH, binary BVH or brute force loop. root_index is 0 or the tagged cache slot
+// of the binary BVH's root
+template<class HitPolicy>
+__host__ __device__ inline int intersectTris(const Ray& r, const TriSource& tris, int tris_size, const BVHNode_GPU* bvh_nodes, const int* bvh_parents,
+    const WideBVHNode_GPU* wide_bvh_nodes, const BVHNode_GPU* top_nodes, const int* top_links, int root_index, bool use_bvh, const AlphaTest& alpha,
+    float& t_closest, glm::vec3& bary, TraversalStats& traversal) {
+    TriRay tr = makeTriRay(r);
+    if (!use_bvh) {
+        return intersectTriRange<HitPolicy>(tr, tris, 0, tris_size, alpha, t_closest, bary, traversal);
+    }
+    if (wide_bvh_nodes != NULL) {
+        return intersectWideBVH<HitPolicy>(r, tr, tris, wide_bvh_nodes, alpha, t_closest, bary, traversal);
+    }
+    return intersectBinaryBVH<HitPolicy>(r, tr, tris, bvh_nodes, bvh_parents, top_nodes, top_links, root_index, alpha, t_closest, bary, traversal);
+}
+
+// what intersectScene found, tri is -1 for analytic geoms which fill in normal instead
+struct SceneHit {
+    int tri;
+    glm::vec3 bary;
+    glm::vec3 normal; // analytic hits only, in object space until analyticHitNormal
+};
+
+// the ray cone of a ray, what picks the LOD of each mesh it's tested against (see selectLOD)
+struct RayLOD {
+    float width = -1.0f; // at the ray origin, negative traces every mesh in full
+    float u = 0.0f; // in [0, 1), dithers between two LODs. one value for every instance the ray meets
+};
+
+// the coarsest LOD of blas whose edges still fit in the ray's footprint where it enters the mesh's
+// box. the threshold is scaled by 2^u, so between two LODs the pick is dithered over a doubling of
+// distance instead of popping. obj_r's direction is a unit world one through the inverse transform,
+// its length turns world footprints into object space ones
+__host__ __device__ inline BLAS selectLOD(const SceneAccel& accel, BLAS blas, const Ray& obj_r, float t_closest, const RayLOD& lod) {
+    float t_enter;
+    if (!intersectAABB(obj_r, blas.AABB_min, blas.AABB_max, t_closest, t_enter)) {
+        return blas;
+    }
+    const float footprint = (lod.width + accel.lod_spread * glm::max(t_enter, 0.0f)) * glm::length(obj_r.direction) * accel.lod_bias * exp2f(lod.u);
+    while (blas.lod_next != -1) {
+        const BLAS next = accel.blases[blas.lod_next];
+        if (next.lod_spacing > footprint) {
+            break;
+        }
+        blas = next;
+    }
+    return blas;
+}
+
+// the BLAS a mesh hit's tri is in, the geom's own or one of its LODs
+__host__ __device__ inline BLAS hitBLAS(const SceneAccel& accel, int blas_ID, int tri) {
+    BLAS blas = accel.blases[blas_ID];
+    while (blas.lod_next != -1 && (tri < blas.tri_offset || tri >= blas.tri_offset + blas.num_tris)) {
+        blas = accel.blases[blas.lod_next];
+    }
+    return blas;
+}
+
+// p (w = 1) or a direction (w = 0) through the 3x4 world to object rows of a geom
+__host__ __device__ inline glm::vec3 toObjectSpace(const GeomGPU& geom, glm::vec3 p, float w) {
+    glm::vec4 v = glm::vec4(p, w);
+    return glm::vec3(glm::dot(geom.inverse_rows[0], v), glm::dot(geom.inverse_rows[1], v), glm::dot(geom.inverse_rows[2], v));
+}
+
+// the linear part and translation of a moving geom's object to world transform at time
+__host__ __device__ inline glm::mat3 motionToWorld(const SceneAccel& accel, int motion_ID, float time, glm::vec3& translation) {
+    const GeomMotion& motion = accel.geom_motions[motion_ID];
+    glm::mat3 m;
+    for (int row = 0; row < 3; ++row) {
+        const glm::vec4 r = glm::mix(motion.rows[0][row], motion.rows[1][row], time);
+        m[0][row] = r.x;
+        m[1][row] = r.y;
+        m[2][row] = r.z;
+        translation[row] = r.w;
+    }
+    return m;
+}
+
+// geom with the world to object rows it has at time, unchanged for one that stays put. the
+// lerped transform is inverted per ray, only for the instances it reaches
+__host__ __device__ inline GeomGPU geomAtTime(const SceneAccel& accel, GeomGPU geom, float time) {
+    if (geom.motion_ID == -1 || accel.geom_motions == NULL) {
+        return geom;
+    }
+    glm::vec3 translation;
+    const glm::mat3 inv = glm::inverse(motionToWorld(accel, geom.motion_ID, time, translation));
+    const glm::vec3 inv_translation = -(inv * translation);
+    for (int row = 0; row < 3; ++row) {
+        geom.inverse_rows[row] = glm::vec4(inv[0][row], inv[1][row], inv[2][row], inv_translation[row]);
+    }
+    return geom;
+}
+
+// a TLAS node's box at time, between its boxes at shutter open and close. node_index is the
+// node's index in tlas_nodes, the top levels aren't cached when geoms move
+__host__ __device__ inline void tlasNodeBounds(const SceneAccel& accel, const BVHNode_GPU& node, int node_index, float time,
+    glm::vec3& AABB_min, glm::vec3& AABB_max) {
+    AABB_min = node.AABB_min;
+    AABB_max = node.AABB_max;
+    if (accel.tlas_end_bounds != NULL) {
+        const MotionBounds end = accel.tlas_end_bounds[node_index];
+        AABB_min = glm::mix(AABB_min, end.AABB_min, time);
+        AABB_max = glm::mix(AABB_max, end.AABB_max, time);
+    }
+}
+
+// world space normal of the analytic hit a ray kept
+__host__ __device__ inline glm::vec3 analyticHitNormal(const Geom& geom, const SceneHit& hit) {
+    return glm::normalize(multiplyMV(geom.invTranspose, glm::vec4(hit.normal, 0.0f)));
+}
+
+// tests one geom in its object space, the object space direction is left unnormalized so
+// t stays the world space distance along r. meshes are traced against their BLAS, or the LOD of
+// it lod picks
+template<class HitPolicy>
+__host__ __device__ inline bool intersectInstance(const Ray& r, const SceneAccel& accel, int geom_index, bool cull_backfaces, float& t_closest, SceneHit& hit,
+    TraversalStats& traversal, const RayLOD& lod = RayLOD()) {
+    GeomGPU geom = loadReadOnly(accel.geom_records + geom_index);
+    // a VOLUME has no surface, delta tracking finds what's inside it
+    if (!(accel.geom_mask & (1 << geom.type)) || geom.type == VOLUME) {
+        return false;
+    }
+    geom = geomAtTime(accel, geom, r.time);
+    glm::vec3 obj_origin = toObjectSpace(geom, r.origin, 1.0f);
+    glm::vec3 obj_direction = toObjectSpace(geom, r.direction, 0.0f);
+    if (geom.type == MESH) {
+        BLAS blas = accel.blases[geom.blas_ID];
+        Ray obj_r = makeRay(obj_origin, obj_direction);
+        if (lod.width >= 0.0f && blas.lod_next != -1 && accel.lod_bias > 0.0f) {
+            blas = selectLOD(accel, blas, obj_r, t_closest, lod);
+        }
+        if (blas.num_tris == 0) {
+            return false;
+        }
+        const WideBVHNode_GPU* wide_bvh_nodes = blas.wide_node_offset != -1 ? accel.wide_bvh_nodes + blas.wide_node_offset : NULL;
+        const int root_index = accel.top_nodes != NULL && blas.top_slot != -1 ? topNodeIndex(blas.top_slot) : 0;
+        int hit_tri = intersectTris<HitPolicy>(obj_r, blasTris(accel, blas), blas.num_tris, accel.bvh_nodes + blas.node_offset,
+            accel.bvh_parents + blas.node_offset, wide_bvh_nodes, accel.top_nodes, accel.top_links, root_index, accel.use_bvh, alphaTest(accel, geom, blas), t_closest, hit.bary, traversal);
+        if (hit_tri != -1) {
+            hit.tri = blas.tri_offset + hit_tri;
+            return true;
+        }
+        return false;
+    }
+
+    float t = MAX_INTERSECT_DIST;
+    glm::vec3 normal;
+    if (geom.type == CURVES) {
+        t = intersectCurves<HitPolicy>(accel, accel.curve_sets[geom.blas_ID], makeRay(obj_origin, obj_direction), t_closest, normal, traversal);
+    }
+    else if (geom.type == SPHERE) {
+        t = sphereIntersectionTest(obj_origin, obj_direction, normal);
+    }
+    else if (geom.type == SQUAREPLANE) {
+        t = squareplaneIntersectionTest(obj_origin, obj_direction, normal);
+    }
+    else {
+        t = boxIntersectionTest(obj_origin, obj_direction, normal);
+    }
+
+    if (t_closest > t) {
+        // the inverse transpose keeps the sign of the normal against the direction
+        if (cull_backfaces && glm::dot(normal, obj_direction) > 0.0) {
+            return false;
+        }
+        t_closest = t;
+        hit.tri = -1;
+        hit.normal = normal;
+        return true;
+    }
+    return false;
+}
+
+// tests geoms [first_geom, last_geom) except ignore_geom, same contract as intersectTriRange
+template<class HitPolicy>
+__host__ __device__ inline int intersectInstanceRange(const Ray& r, const SceneAccel& accel, int first_geom, int last_geom, bool cull_backfaces, int ignore_geom,
+    float& t_closest, SceneHit& hit, TraversalStats& traversal, const RayLOD& lod = RayLOD()) {
+    int hit_geom = -1;
+    for (int geom_index = first_geom; geom_index < last_geom; ++geom_index) {
+        if (geom_index != ignore_geom && intersectInstance<HitPolicy>(r, accel, geom_index, cull_backfaces, t_closest, hit, traversal, lod)) {
+            hit_geom = geom_index;
+            if (HitPolicy::any_hit) {
+                break;
+            }
+        }
+    }
+    return hit_geom;
+}
+
+// walks the TLAS over geoms and descends into the BLAS of every mesh instance it reaches,
+// returns the hit geom or -1
+template<class HitPolicy>
+__host__ __device__ inline int traverseScene(const Ray& r, const SceneAccel& accel, bool cull_backfaces, int ignore_geom, float& t_closest, SceneHit& hit,
+    TraversalStats& traversal, const RayLOD& lod = RayLOD()) {
+    if (accel.geoms_size == 0) {
+        return -1;
+    }
+    if (!accel.use_bvh) {
+        return intersectInstanceRange<HitPolicy>(r, accel, 0, accel.geoms_size, cull_backfaces, ignore_geom, t_closest, hit, traversal, lod);
+    }
+    int hit_geom = -1;
+    // the TLAS's top levels come first in the cache
+    int cur_node_index = accel.top_nodes != NULL ? topNodeIndex(0) : 0;
+    int dir_signs = rayDirSigns(r);
+    const bool stackless = accel.tlas_parents != NULL;
+    int stack_pointer = 0;
+    int node_stack[BVH_STACK_SIZE];
+    float tmin;
+    int link;
+    while (true) {
+        const BVHNode_GPU cur_node = loadBVHNode(accel.tlas_nodes, accel.top_nodes, accel.top_links, cur_node_index, link);
+        traversal.nodes++;
+        glm::vec3 AABB_min, AABB_max;
+        tlasNodeBounds(accel, cur_node, cur_node_index, r.time, AABB_min, AABB_max);
+
+        if (intersectAABB(r, AABB_min, AABB_max, t_closest, tmin)) {
+            if (!BVH_IS_LEAF(cur_node)) {
+                // near child next, the far one is tested against the closest t when it's reached
+                int near_child, far_child;
+                orderTopChildren(cur_node, cur_node_index, link, dir_signs, near_child, far_child);
+                if (!stackless) {
+                    node_stack[stack_pointer] = far_child;
+                    stack_pointer++;
+                }
+                cur_node_index = near_child;
+                continue;
+            }
+            int leaf_hit = intersectInstanceRange<HitPolicy>(r, accel, cur_node.tri_index, cur_node.tri_index + cur_node.num_tris,
+                cull_backfaces, ignore_geom, t_closest, hit, traversal, lod);
+            if (leaf_hit != -1) {
+                hit_geom = leaf_hit;
+                if (HitPolicy::any_hit) {
+                    return hit_geom;
+                }
+            }
+        }
+        if (stackless) {
+            cur_node_index = nextStacklessNode(cur_node_index, dir_signs, accel.tlas_nodes, accel.tlas_parents);
+            if (cur_node_index == -1) {
+                break;
+            }
+            continue;
+        }
+        if (stack_pointer == 0) {
+            break;
+        }
+        stack_pointer--;
+        cur_node_index = node_stack[stack_pointer];
+    }
+    return hit_geom;
+}
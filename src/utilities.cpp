@@ -8,6 +8,22 @@
 #include <glm/gtc/matrix_inverse.hpp>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <atomic>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "utilities.h"
 
@@ -110,3 +126,179 @@ std::istream& utilityCore::safeGetline(std::istream& is, std::string& t) {
         }
     }
 }
+
+bool utilityCore::LineReader::open(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    text.resize((size_t)file.tellg());
+    file.seekg(0, std::ios::beg);
+    file.read(&text[0], text.size());
+    pos = 0;
+    at_end = false;
+    return true;
+}
+
+void utilityCore::LineReader::getline(std::string& line) {
+    if (pos >= text.size()) {
+        line.clear();
+        at_end = true;
+        return;
+    }
+    size_t end = text.find_first_of("\r\n", pos);
+    if (end == std::string::npos) {
+        end = text.size();
+    }
+    line.assign(text, pos, end - pos);
+    pos = end;
+    if (pos < text.size() && text[pos] == '\r') {
+        pos++;
+    }
+    if (pos < text.size() && text[pos] == '\n') {
+        // the \n of a \r\n, or a line of its own ending
+        pos++;
+    }
+}
+
+const std::vector<std::string>& utilityCore::LineReader::tokenize(const std::string& line) {
+    int count = 0;
+    size_t start = line.find_first_not_of(" \t");
+    while (start != std::string::npos) {
+        size_t end = line.find_first_of(" \t", start);
+        size_t length = (end == std::string::npos ? line.size() : end) - start;
+        if (count < (int)tokens.size()) {
+            tokens[count].assign(line, start, length);
+        }
+        else {
+            tokens.push_back(line.substr(start, length));
+        }
+        count++;
+        start = end == std::string::npos ? end : line.find_first_not_of(" \t", end);
+    }
+    tokens.resize(count);
+    return tokens;
+}
+
+int utilityCore::LineReader::countLines(const char* keyword) const {
+    const size_t length = strlen(keyword);
+    int count = 0;
+    for (size_t p = 0; p < text.size(); p = text.find('\n', p), p = p == std::string::npos ? p : p + 1) {
+        if (text.compare(p, length, keyword) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int utilityCore::numThreads() {
+    return std::max((int)std::thread::hardware_concurrency(), 1);
+}
+
+// workers pull the next index off a shared counter, so uneven items still balance
+bool utilityCore::MappedFile::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER file_size;
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* view = mapping != NULL ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (view == NULL) {
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        return false;
+    }
+    file_handle = file;
+    mapping_handle = mapping;
+    bytes = (const unsigned char*)view;
+    length = (size_t)file_size.QuadPart;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file open
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    bytes = (const unsigned char*)view;
+    length = (size_t)info.st_size;
+#endif
+    return true;
+}
+
+void utilityCore::MappedFile::close() {
+    if (bytes == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(bytes);
+    CloseHandle(mapping_handle);
+    CloseHandle(file_handle);
+#else
+    munmap((void*)bytes, length);
+#endif
+    bytes = NULL;
+    length = 0;
+}
+
+long long utilityCore::fileModifiedTime(const std::string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return 0;
+    }
+#if defined(__linux__)
+    return (long long)info.st_mtim.tv_sec * 1000000000ll + info.st_mtim.tv_nsec;
+#else
+    return (long long)info.st_mtime * 1000000000ll;
+#endif
+}
+
+void utilityCore::parallelFor(int count, const std::function<void(int)>& body) {
+    int num_workers = std::min(numThreads(), count);
+    if (num_workers <= 1) {
+        for (int i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            body(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_workers; ++t) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+unsigned long long utilityCore::hashBytes(const void* data, size_t size, unsigned long long hash) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
@@ -2,12 +2,14 @@
 
 #include "glm/glm.hpp"
 #include <algorithm>
+#include <atomic>
 #include <istream>
 #include <ostream>
 #include <iterator>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <functional>
 
 #define PI                3.1415926535897932384626422832795028841971f
 #define TWO_PI            6.2831853071795864769252867665590057683943f
@@ -19,6 +21,15 @@ class GuiDataContainer
 public:
     GuiDataContainer() : TracedDepth(0) {}
     int TracedDepth;
+    std::vector<float> StageMs; // GPU time per RenderStage, a few frames old
+    std::vector<float> CompactionMs; // stream compaction time per bounce, same frame as StageMs
+    std::vector<int> PathsAlive; // paths left after compacting each bounce
+    int ActivePixels = -1; // pixels adaptive sampling still traces, -1 when it's off
+    float RaysPerSecond = 0.0f; // every ray traced, 0 without RAY_STATS
+    float NodesPerRay = 0.0f; // TLAS and BLAS nodes visited per ray
+    std::vector<unsigned long long> RayStats; // RAY_STATS counts by RayStat over the same interval, empty without it
+    bool AtrousBuffers = false; // the A-Trous guides and images were allocated, so its passes can be tuned
+    bool TemporalBuffers = false; // TEMPORAL_HISTORY can be tuned, its buffers were allocated
 };
 
 namespace utilityCore {
@@ -30,4 +41,82 @@ namespace utilityCore {
     extern glm::mat4 buildTransformationMatrix(glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale);
     extern std::string convertIntToString(int number);
     extern std::istream& safeGetline(std::istream& is, std::string& t); //Thanks to http://stackoverflow.com/a/6089413
+
+    // a text file read into memory in one go and handed out a line at a time, lines end like
+    // safeGetline's. the strings passed in and the token vector keep their capacity from line
+    // to line, so a long file parses without allocating per line
+    class LineReader {
+    public:
+        bool open(const std::string& path);
+        void getline(std::string& line);
+        bool good() const { return !at_end; } // false once a getline found nothing left
+        size_t tell() const { return pos; }
+        void seek(size_t p) { pos = p; at_end = false; }
+        const std::vector<std::string>& tokenize(const std::string& line); // valid until the next call
+        int countLines(const char* keyword) const; // lines starting with keyword
+
+    private:
+        std::string text;
+        size_t pos = 0;
+        bool at_end = false;
+        std::vector<std::string> tokens;
+    };
+    // a whole file mapped read only, the OS pages it in as it's read. unmapped on destruction
+    class MappedFile {
+    public:
+        MappedFile() {}
+        ~MappedFile() { close(); }
+        bool open(const std::string& path);
+        void close();
+        const unsigned char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+        const unsigned char* bytes = NULL;
+        size_t length = 0;
+#ifdef _WIN32
+        void* file_handle = NULL;
+        void* mapping_handle = NULL;
+#endif
+    };
+    extern long long fileModifiedTime(const std::string& path); // in ns where the OS has them, 0 for a missing file
+    extern int numThreads(); // host worker threads, every hardware thread
+    extern void parallelFor(int count, const std::function<void(int)>& body); // body(0..count-1) spread over numThreads(), body must not throw
+    // 64 bit FNV-1a of size bytes, hash carries on from an earlier call's result
+    extern unsigned long long hashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ull);
+
+    // clear() keeps the capacity, this hands the memory back
+    template <typename T>
+    void freeVector(std::vector<T>& values) {
+        std::vector<T>().swap(values);
+    }
+
+    // the latest of a stream of values handed from one producer thread to one consumer without
+    // either waiting on the other. the producer fills back() and publishes it, the consumer
+    // picks up the newest published value with update() and reads front() until the next one.
+    // values published while the consumer wasn't looking are dropped
+    template <typename T>
+    class TripleBuffer {
+    public:
+        TripleBuffer() : back_slot(0), middle(1), front_slot(2) {}
+        T& slot(int i) { return slots[i]; } // for setting up all three before any thread uses them
+        T& back() { return slots[back_slot]; }
+        void publish() { back_slot = middle.exchange(back_slot | FRESH) & SLOT; }
+        bool update() {
+            if (!(middle.load() & FRESH)) {
+                return false;
+            }
+            front_slot = middle.exchange(front_slot) & SLOT;
+            return true;
+        }
+        T& front() { return slots[front_slot]; }
+    private:
+        enum { SLOT = 3, FRESH = 4 }; // middle holds a slot index and whether it was published since the last update
+        T slots[3];
+        int back_slot; // producer only
+        std::atomic<int> middle;
+        int front_slot; // consumer only
+    };
 }
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "volume.h"
+#include "utilities.h"
+
+// the encodings of the int after the version byte
+#define VOL_FLOAT32 1
+#define VOL_UINT8 3
+
+// the 48 byte header, little endian like the voxels after it
+struct VolHeader {
+    char signature[3]; // "VOL"
+    unsigned char version; // 3
+    int encoding;
+    int resolution[3];
+    int channels;
+    float bounds[6]; // min xyz, max xyz
+};
+
+bool isVolumePath(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string ext = path.substr(dot + 1);
+    for (char& c : ext) {
+        c = (char)tolower(c);
+    }
+    return ext == "vol";
+}
+
+bool loadVolume(const std::string& path, std::vector<float>& densities, glm::ivec3& resolution, glm::vec3& bounds_min,
+    glm::vec3& bounds_max, std::string& error) {
+    utilityCore::MappedFile file;
+    if (!file.open(path)) {
+        error = "Cannot open file [" + path + "]";
+        return false;
+    }
+    VolHeader header;
+    if (file.size() < sizeof(VolHeader) || memcmp(file.data(), "VOL", 3) != 0) {
+        error = path + " is not a .vol file";
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(VolHeader));
+    if (header.version != 3) {
+        error = path + " is .vol version " + std::to_string(header.version) + ", only version 3 is read";
+        return false;
+    }
+    if (header.encoding != VOL_FLOAT32 && header.encoding != VOL_UINT8) {
+        error = path + " has encoding " + std::to_string(header.encoding) + ", only float32 (1) and uint8 (3) grids are read";
+        return false;
+    }
+    resolution = glm::ivec3(header.resolution[0], header.resolution[1], header.resolution[2]);
+    if (resolution.x <= 0 || resolution.y <= 0 || resolution.z <= 0 || header.channels <= 0) {
+        error = path + " has no voxels";
+        return false;
+    }
+    bounds_min = glm::vec3(header.bounds[0], header.bounds[1], header.bounds[2]);
+    bounds_max = glm::vec3(header.bounds[3], header.bounds[4], header.bounds[5]);
+
+    // the size before anything is read, so a truncated file is caught up front
+    const size_t count = (size_t)resolution.x * resolution.y * resolution.z;
+    const size_t value_bytes = header.encoding == VOL_FLOAT32 ? sizeof(float) : 1;
+    const size_t stride = header.channels * value_bytes;
+    if (file.size() < sizeof(VolHeader) + count * stride) {
+        error = path + " is truncated";
+        return false;
+    }
+    const unsigned char* voxels = file.data() + sizeof(VolHeader);
+
+    densities.resize(count);
+    utilityCore::parallelFor((count + 65535) / 65536, [&](int block) {
+        const size_t end = std::min((size_t)(block + 1) * 65536, count);
+        for (size_t i = (size_t)block * 65536; i < end; i++) {
+            if (header.encoding == VOL_FLOAT32) {
+                memcpy(&densities[i], voxels + i * stride, sizeof(float));
+            }
+            else {
+                densities[i] = voxels[i * stride] * (1.0f / 255.0f);
+            }
+        }
+    });
+    return true;
+}
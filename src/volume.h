@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+// Mitsuba's binary .vol grids ("VOL" version 3), as its gridvolume plugin reads them and most
+// smoke and cloud sets ship converted to. a dense grid of voxels over a box, x fastest
+
+bool isVolumePath(const std::string& path); // .vol
+
+// the first channel of every voxel of path, x fastest then y then z, its resolution and the box
+// the file places it in. float32 and uint8 (read as / 255) encodings. false with error set if
+// the file can't be used
+bool loadVolume(const std::string& path, std::vector<float>& densities, glm::ivec3& resolution, glm::vec3& bounds_min,
+    glm::vec3& bounds_max, std::string& error);
@@ -0,0 +1,74 @@
+#include <map>
+#include "common.h"
+#include "aggregated.h"
+
+#define FULL_WARP_MASK 0xffffffffu
+
+namespace StreamCompaction {
+namespace WarpAggregated {
+
+	static thread_local std::map<int, int*> device_counters; // kept, dropped on each device, per renderer thread
+
+	static int*& currentCounters() {
+		int device = 0;
+		cudaGetDevice(&device);
+		return device_counters[device];
+	}
+
+	// one lane per warp reserves room for the whole warp's kept and dropped elements,
+	// the other lanes find their slot from the ballot bits below them.
+	// blockDim.x must be a multiple of 32 so every warp is full
+	__global__ void kernWarpPartition(int n, const int* keep, int* indices, int* counters) {
+		int index = blockIdx.x * blockDim.x + threadIdx.x;
+		int lane = threadIdx.x & 31;
+		bool valid = index < n;
+		bool kept = valid && keep[index] != 0;
+
+		unsigned int kept_mask = __ballot_sync(FULL_WARP_MASK, kept);
+		unsigned int dropped_mask = __ballot_sync(FULL_WARP_MASK, valid && !kept);
+		int kept_base = 0;
+		int dropped_base = 0;
+		if (lane == 0) {
+			if (kept_mask != 0) {
+				kept_base = atomicAdd(&counters[0], __popc(kept_mask));
+			}
+			if (dropped_mask != 0) {
+				dropped_base = atomicAdd(&counters[1], __popc(dropped_mask));
+			}
+		}
+		kept_base = __shfl_sync(FULL_WARP_MASK, kept_base, 0);
+		dropped_base = __shfl_sync(FULL_WARP_MASK, dropped_base, 0);
+
+		unsigned int lanes_below = (1u << lane) - 1u;
+		if (kept) {
+			indices[kept_base + __popc(kept_mask & lanes_below)] = index;
+		}
+		else if (valid) {
+			indices[n - 1 - dropped_base - __popc(dropped_mask & lanes_below)] = index;
+		}
+	}
+
+	void init() {
+		cudaMalloc(&currentCounters(), 2 * sizeof(int));
+	}
+
+	void free() {
+		cudaFree(currentCounters());
+		currentCounters() = NULL;
+	}
+
+	int partition(int n, const int* dev_keep, int* dev_indices) {
+		if (n <= 0) {
+			return 0;
+		}
+		int* dev_counters = currentCounters();
+		cudaMemset(dev_counters, 0, 2 * sizeof(int));
+		int num_blocks = (n + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE;
+		kernWarpPartition << <num_blocks, SCAN_BLOCK_SIZE >> > (n, dev_keep, dev_indices, dev_counters);
+		int num_kept;
+		cudaMemcpy(&num_kept, dev_counters, sizeof(int), cudaMemcpyDeviceToHost);
+		return num_kept;
+	}
+
+} // namespace WarpAggregated
+} // namespace StreamCompaction
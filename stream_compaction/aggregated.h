@@ -0,0 +1,16 @@
+#pragma once
+
+namespace StreamCompaction {
+namespace WarpAggregated {
+
+    // per device like Efficient::init
+    void init();
+    void free();
+
+    // same contract as Efficient::partition but one atomic per warp reserves the slots, so
+    // there is no scan pass. order is only kept within a warp, kept paths fill from the
+    // front and dropped ones from the back
+    int partition(int n, const int* dev_keep, int* dev_indices);
+
+} // namespace WarpAggregated
+} // namespace StreamCompaction
@@ -0,0 +1,24 @@
+#include "common.h"
+
+namespace StreamCompaction {
+namespace Common {
+
+	__global__ void kernMapToBoolean(int n, int* bools, const int* idata) {
+		int index = blockIdx.x * blockDim.x + threadIdx.x;
+		if (index < n) {
+			bools[index] = idata[index] != 0;
+		}
+	}
+
+	__global__ void kernScatterPartition(int n, int num_kept, int* indices,
+		const int* bools, const int* offsets) {
+		int index = blockIdx.x * blockDim.x + threadIdx.x;
+		if (index < n) {
+			// index - offsets[index] is how many were dropped before this one
+			int slot = bools[index] ? offsets[index] : num_kept + index - offsets[index];
+			indices[slot] = index;
+		}
+	}
+
+} // namespace Common
+} // namespace StreamCompaction
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#define SCAN_BLOCK_SIZE 128
+#define SCAN_ELEMS_PER_BLOCK (2 * SCAN_BLOCK_SIZE) // each thread scans two elements
+
+namespace StreamCompaction {
+namespace Common {
+
+    // bools[i] = idata[i] != 0
+    __global__ void kernMapToBoolean(int n, int* bools, const int* idata);
+
+    // stable partition of the index range from a boolean map and its exclusive scan,
+    // kept elements land at offsets[i], dropped ones after all num_kept kept elements.
+    // indices[slot] is the index the slot was taken from
+    __global__ void kernScatterPartition(int n, int num_kept, int* indices,
+        const int* bools, const int* offsets);
+
+} // namespace Common
+} // namespace StreamCompaction
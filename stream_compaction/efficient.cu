@@ -0,0 +1,163 @@
+#include <map>
+#include <vector>
+#include "common.h"
+#include "efficient.h"
+
+// pads shared memory indices so the tree sweeps don't hit the same bank
+#define LOG_NUM_BANKS 5
+#define CONFLICT_FREE_OFFSET(i) ((i) >> LOG_NUM_BANKS)
+
+namespace StreamCompaction {
+namespace Efficient {
+
+	// scratch buffers of one device, everything below works on the current device's. every
+	// renderer thread keeps its own so contexts sharing a device don't scan into each other's
+	struct Buffers {
+		int* dev_bools = NULL;
+		int* dev_offsets = NULL;
+		int* dev_num_kept = NULL;
+		std::vector<int*> dev_block_sums; // one level per pass of the recursive scan
+	};
+
+	static thread_local std::map<int, Buffers> device_buffers;
+
+	static Buffers& currentBuffers() {
+		int device = 0;
+		cudaGetDevice(&device);
+		return device_buffers[device];
+	}
+
+	// exclusive scan of SCAN_ELEMS_PER_BLOCK elements per block, the block total goes
+	// to block_sums when there is more than one block
+	__global__ void kernBlockScan(int n, int* odata, const int* idata, int* block_sums) {
+		__shared__ int temp[SCAN_ELEMS_PER_BLOCK + CONFLICT_FREE_OFFSET(SCAN_ELEMS_PER_BLOCK)];
+
+		int tid = threadIdx.x;
+		int block_offset = blockIdx.x * SCAN_ELEMS_PER_BLOCK;
+		int ai = tid;
+		int bi = tid + SCAN_BLOCK_SIZE;
+		temp[ai + CONFLICT_FREE_OFFSET(ai)] = (block_offset + ai < n) ? idata[block_offset + ai] : 0;
+		temp[bi + CONFLICT_FREE_OFFSET(bi)] = (block_offset + bi < n) ? idata[block_offset + bi] : 0;
+
+		// up sweep
+		int offset = 1;
+		for (int d = SCAN_BLOCK_SIZE; d > 0; d >>= 1) {
+			__syncthreads();
+			if (tid < d) {
+				int a = offset * (2 * tid + 1) - 1;
+				int b = offset * (2 * tid + 2) - 1;
+				temp[b + CONFLICT_FREE_OFFSET(b)] += temp[a + CONFLICT_FREE_OFFSET(a)];
+			}
+			offset <<= 1;
+		}
+
+		if (tid == 0) {
+			int last = SCAN_ELEMS_PER_BLOCK - 1 + CONFLICT_FREE_OFFSET(SCAN_ELEMS_PER_BLOCK - 1);
+			if (block_sums != NULL) {
+				block_sums[blockIdx.x] = temp[last];
+			}
+			temp[last] = 0;
+		}
+
+		// down sweep
+		for (int d = 1; d < SCAN_ELEMS_PER_BLOCK; d <<= 1) {
+			offset >>= 1;
+			__syncthreads();
+			if (tid < d) {
+				int a = offset * (2 * tid + 1) - 1;
+				int b = offset * (2 * tid + 2) - 1;
+				a += CONFLICT_FREE_OFFSET(a);
+				b += CONFLICT_FREE_OFFSET(b);
+				int t = temp[a];
+				temp[a] = temp[b];
+				temp[b] += t;
+			}
+		}
+		__syncthreads();
+
+		if (block_offset + ai < n) {
+			odata[block_offset + ai] = temp[ai + CONFLICT_FREE_OFFSET(ai)];
+		}
+		if (block_offset + bi < n) {
+			odata[block_offset + bi] = temp[bi + CONFLICT_FREE_OFFSET(bi)];
+		}
+	}
+
+	__global__ void kernAddBlockSums(int n, int* data, const int* block_sums) {
+		int block_offset = blockIdx.x * SCAN_ELEMS_PER_BLOCK;
+		int sum = block_sums[blockIdx.x];
+		int a = block_offset + threadIdx.x;
+		int b = a + SCAN_BLOCK_SIZE;
+		if (a < n) {
+			data[a] += sum;
+		}
+		if (b < n) {
+			data[b] += sum;
+		}
+	}
+
+	__global__ void kernCountKept(int n, int* num_kept, const int* bools, const int* offsets) {
+		num_kept[0] = offsets[n - 1] + bools[n - 1];
+	}
+
+	void init(int max_n) {
+		Buffers& b = currentBuffers();
+		cudaMalloc(&b.dev_bools, max_n * sizeof(int));
+		cudaMalloc(&b.dev_offsets, max_n * sizeof(int));
+		cudaMalloc(&b.dev_num_kept, sizeof(int));
+		int n = (max_n + SCAN_ELEMS_PER_BLOCK - 1) / SCAN_ELEMS_PER_BLOCK;
+		while (n > 1) {
+			int* sums;
+			cudaMalloc(&sums, n * sizeof(int));
+			b.dev_block_sums.push_back(sums);
+			n = (n + SCAN_ELEMS_PER_BLOCK - 1) / SCAN_ELEMS_PER_BLOCK;
+		}
+	}
+
+	void free() {
+		Buffers& b = currentBuffers();
+		cudaFree(b.dev_bools);
+		cudaFree(b.dev_offsets);
+		cudaFree(b.dev_num_kept);
+		for (int* sums : b.dev_block_sums) {
+			cudaFree(sums);
+		}
+		b = Buffers();
+	}
+
+	static void scanLevel(int n, int* dev_odata, const int* dev_idata, const std::vector<int*>& block_sums, int level) {
+		int num_blocks = (n + SCAN_ELEMS_PER_BLOCK - 1) / SCAN_ELEMS_PER_BLOCK;
+		if (num_blocks == 1) {
+			kernBlockScan << <1, SCAN_BLOCK_SIZE >> > (n, dev_odata, dev_idata, NULL);
+			return;
+		}
+		int* sums = block_sums[level];
+		kernBlockScan << <num_blocks, SCAN_BLOCK_SIZE >> > (n, dev_odata, dev_idata, sums);
+		scanLevel(num_blocks, sums, sums, block_sums, level + 1);
+		kernAddBlockSums << <num_blocks, SCAN_BLOCK_SIZE >> > (n, dev_odata, sums);
+	}
+
+	void scan(int n, int* dev_odata, const int* dev_idata) {
+		if (n <= 0) {
+			return;
+		}
+		scanLevel(n, dev_odata, dev_idata, currentBuffers().dev_block_sums, 0);
+	}
+
+	int partition(int n, const int* dev_keep, int* dev_indices) {
+		if (n <= 0) {
+			return 0;
+		}
+		const Buffers& b = currentBuffers();
+		int num_blocks = (n + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE;
+		Common::kernMapToBoolean << <num_blocks, SCAN_BLOCK_SIZE >> > (n, b.dev_bools, dev_keep);
+		scan(n, b.dev_offsets, b.dev_bools);
+		kernCountKept << <1, 1 >> > (n, b.dev_num_kept, b.dev_bools, b.dev_offsets);
+		int num_kept;
+		cudaMemcpy(&num_kept, b.dev_num_kept, sizeof(int), cudaMemcpyDeviceToHost);
+		Common::kernScatterPartition << <num_blocks, SCAN_BLOCK_SIZE >> > (n, num_kept, dev_indices, b.dev_bools, b.dev_offsets);
+		return num_kept;
+	}
+
+} // namespace Efficient
+} // namespace StreamCompaction
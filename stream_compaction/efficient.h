@@ -0,0 +1,20 @@
+#pragma once
+
+namespace StreamCompaction {
+namespace Efficient {
+
+    // allocates the scratch buffers for up to max_n elements on the current device,
+    // every device in use needs its own init / free
+    void init(int max_n);
+    void free();
+
+    // exclusive scan of device arrays (Blelloch up / down sweep in shared memory per block,
+    // block sums are scanned recursively). idata and odata may alias
+    void scan(int n, int* dev_odata, const int* dev_idata);
+
+    // stable partition of [0, n) on dev_keep[i] != 0, dev_indices[slot] receives the source
+    // index of each slot with the kept ones first. returns the number kept
+    int partition(int n, const int* dev_keep, int* dev_indices);
+
+} // namespace Efficient
+} // namespace StreamCompaction